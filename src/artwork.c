@@ -42,6 +42,7 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "worker.h"
 
 #include "artwork.h"
 
@@ -73,6 +74,30 @@
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 5
 
+// Number of albums that artwork_prerender_start() does per worker job
+#define ARTWORK_PRERENDER_BATCH 20
+
+// Number of slots in the directory artwork lookup cache, see dir_lookup_cache
+#define DIR_LOOKUP_CACHE_SIZE 1024
+
+// Number of rescaled versions of an in-memory image to keep, see artwork_mem
+#define ARTWORK_MEM_SCALED_MAX 4
+
+// Searches for group artwork that can be remembered as having found nothing,
+// see process_group()
+#define ARTWORK_MISS_DIRECTORY (1 << 0)
+#define ARTWORK_MISS_ITEMS (1 << 1)
+
+// Index in online_sources[], also the priority order (same as in the list of
+// item sources)
+enum online_source_id
+{
+  ONLINE_SOURCE_SPOTIFY,
+  ONLINE_SOURCE_DISCOGS,
+  ONLINE_SOURCE_MUSICBRAINZ,
+  ONLINE_SOURCE_MAX,
+};
+
 enum artwork_cache
 {
   NEVER = 0,       // No caching of any results
@@ -114,10 +139,38 @@ struct artwork_ctx {
   // Input data for group handlers
   int64_t persistentid;
 
+  // Output from the embedded handler, hash of the embedded image
+  uint64_t src_hash;
+
   // Not to be used by handler - query for item or group
   struct query_params qp;
   // Not to be used by handler - should the result be cached
   enum artwork_cache cache;
+
+  // Not to be used by handler - results of online_sources_search() for item
+  // online_id. A source is not done if its search was cancelled.
+  int online_id;
+  bool online_searched;
+  struct {
+    bool is_done;
+    char *artwork_url;
+  } online[ONLINE_SOURCE_MAX];
+};
+
+// State of a search made by online_sources_search()
+struct online_search {
+  const struct online_source *src;
+  char search_url[2048];
+  uint32_t hash;
+  struct keyval output_headers;
+  struct http_client_ctx client;
+  bool is_requested;
+};
+
+struct online_race {
+  struct artwork_ctx *ctx;
+  struct online_search *searches;
+  int *ids; // online source id of each request
 };
 
 /* Definition of an artwork source. Covers both item and group sources.
@@ -137,6 +190,10 @@ struct artwork_source {
 
   // When should results from the source be cached?
   enum artwork_cache cache;
+
+  // Group sources only: flag for remembering in the cache that the source
+  // found nothing for the group (ARTWORK_MISS_*), 0 if it shouldn't be
+  int miss_flag;
 };
 
 /* Since online sources of artwork have similar characteristics there generic
@@ -194,6 +251,56 @@ static const char *cover_extension[] =
 
 static pthread_mutex_t artwork_cache_stash_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Remembers the outcome of artwork_get_bydir() for a directory, so that we
+// don't need to check for every possible artwork filename every time (which is
+// slow on network mounts). An entry is valid as long as the directory mtime is
+// unchanged. The slot is selected by hash of the path, collisions just replace.
+struct dir_lookup
+{
+  char *dir;
+  time_t mtime;
+  char *found; // NULL if the directory has no artwork file
+};
+
+static struct dir_lookup dir_lookup_cache[DIR_LOOKUP_CACHE_SIZE];
+static pthread_mutex_t dir_lookup_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// An image that another module (e.g. the pipe input) has in memory and has
+// registered with artwork_mem_register(), so that it doesn't need to write it
+// to a file for us to read. The list holds a reference, and so does a handler
+// while using it, so it can be replaced any time. Rescaled versions are kept,
+// since the speakers and clients usually ask for the same few sizes. Image
+// data is never modified after registration, so it is read without the lock.
+struct artwork_mem_scaled
+{
+  struct artwork_req_params req_params;
+  int format;
+  uint8_t *data;
+  size_t len;
+};
+
+struct artwork_mem
+{
+  char *url;
+  uint8_t *data;
+  size_t len;
+  int refcount;
+
+  struct artwork_mem_scaled scaled[ARTWORK_MEM_SCALED_MAX];
+  int scaled_next;
+
+  struct artwork_mem *next;
+};
+
+static struct artwork_mem *artwork_mem_list;
+static unsigned int artwork_mem_seq;
+static pthread_mutex_t artwork_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Only one prerender at a time, protected by the mutex
+static pthread_mutex_t artwork_prerender_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool artwork_prerender_is_running;
+static bool artwork_prerender_is_requested;
+
 /* ----------------- DECLARE AND CONFIGURE SOURCE HANDLERS ----------------- */
 
 /* Forward - group handlers */
@@ -226,6 +333,7 @@ static struct artwork_source artwork_group_source[] =
       .name = "directory",
       .handler = source_group_dir_get,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .miss_flag = ARTWORK_MISS_DIRECTORY,
     },
     {
       .name = NULL,
@@ -419,6 +527,13 @@ static const struct online_source musicbrainz_source =
     .search_history = &search_history_musicbrainz,
   };
 
+static const struct online_source *online_sources[ONLINE_SOURCE_MAX] =
+  {
+    &spotify_source,
+    &discogs_source,
+    &musicbrainz_source,
+  };
+
 
 
 /* -------------------------------- HELPERS -------------------------------- */
@@ -488,8 +603,10 @@ artwork_read_byurl(struct evbuffer *evbuf, const char *url)
   return format;
 }
 
-/* Reads an artwork file from the filesystem straight into an evbuf
- * TODO Use evbuffer_add_file or evbuffer_read?
+/* Reads an artwork file from the filesystem straight into an evbuf. We use
+ * evbuffer_read() so the data goes directly into the evbuffer's memory. The
+ * file is not mapped with evbuffer_add_file(), since it is a user file that
+ * could get truncated while we serve it, which for a mapping means SIGBUS.
  *
  * @out evbuf     Image data
  * @in  path      Path to the artwork
@@ -498,8 +615,8 @@ artwork_read_byurl(struct evbuffer *evbuf, const char *url)
 static int
 artwork_read_bypath(struct evbuffer *evbuf, char *path)
 {
-  uint8_t buf[4096];
   struct stat sb;
+  size_t remaining;
   int fd;
   int ret;
 
@@ -527,8 +644,12 @@ artwork_read_bypath(struct evbuffer *evbuf, char *path)
       goto out_fail;
     }
 
-  while ((ret = read(fd, buf, sizeof(buf))) > 0)
-    evbuffer_add(evbuf, buf, ret);
+  for (remaining = sb.st_size; remaining > 0; remaining -= ret)
+    {
+      ret = evbuffer_read(evbuf, fd, remaining);
+      if (ret <= 0)
+	break;
+    }
 
   close(fd);
 
@@ -597,13 +718,14 @@ size_calculate(int *dst_w, int *dst_h, int src_w, int src_h, int max_w, int max_
  * @out evbuf        Image data (rescaled if needed)
  * @in  path         Path to the artwork file (alternative to inbuf)
  * @in  in_buf       Buffer with the artwork (alternative to path)
- * @in  is_embedded  Whether the artwork in file is embedded or raw jpeg/png
+ * @out src_hash     Hash of the embedded image, NULL if the artwork in file is
+ *                   raw jpeg/png and not embedded
  * @in  data_kind    Used by the transcode module to determine e.g. probe size
  * @in  req_params   Requested max size/format
  * @return           ART_FMT_* on success, ART_E_ERROR on error
  */
 static int
-artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is_embedded, enum data_kind data_kind, struct artwork_req_params req_params)
+artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, uint64_t *src_hash, enum data_kind data_kind, struct artwork_req_params req_params)
 {
   struct transcode_decode_setup_args xcode_decode_args = { .profile = XCODE_JPEG }; // Covers XCODE_PNG too
   struct transcode_encode_setup_args xcode_encode_args = { 0 };
@@ -611,7 +733,11 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
   struct encode_ctx *xcode_encode = NULL;
   struct transcode_evbuf_io xcode_evbuf_io = { 0 };
   struct evbuffer *xcode_buf = NULL;
+  const uint8_t *pic;
+  size_t pic_len;
   void *frame;
+  int cached;
+  int cached_format;
   int src_width;
   int src_height;
   int src_format;
@@ -697,7 +823,7 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
 
   // Fast path. Won't work for embedded, since we need to extract the image from
   // the file.
-  if (!is_embedded && dst_format == src_format && dst_width == src_width && dst_height == src_height)
+  if (!src_hash && dst_format == src_format && dst_width == src_width && dst_height == src_height)
     {
       if (path)
 	ret = artwork_read_bypath(evbuf, path);
@@ -708,6 +834,21 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
       goto out;
     }
 
+  // Tracks of an album often have the same embedded image, so if it was already
+  // rescaled for another track we can use that instead
+  if (src_hash && transcode_decode_attached_pic_get(&pic, &pic_len, xcode_decode) == 0)
+    {
+      *src_hash = murmur_hash64(pic, pic_len, 0);
+
+      ret = cache_artwork_get_bysrc(*src_hash, req_params.max_w, req_params.max_h, req_params.format, &cached, &cached_format, evbuf);
+      if (ret == 0 && cached && cached_format > 0)
+	{
+	  DPRINTF(E_SPAM, L_ART, "Embedded artwork of '%s' is in the cache from another item\n", path);
+	  ret = cached_format;
+	  goto out;
+	}
+    }
+
   xcode_encode_args.src_ctx = xcode_decode;
   xcode_encode_args.width = dst_width;
   xcode_encode_args.height = dst_height;
@@ -717,6 +858,8 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
     xcode_encode_args.profile = XCODE_PNG;
   else if (dst_format == ART_FMT_VP8)
     xcode_encode_args.profile = XCODE_VP8;
+  else if (dst_format == ART_FMT_WEBP)
+    xcode_encode_args.profile = XCODE_WEBP;
   else
     xcode_encode_args.profile = XCODE_JPEG;
 
@@ -895,6 +1038,60 @@ parent_dir_image_find(char *out_path, size_t len, const char *dir)
   return -1;
 }
 
+/*
+ * Same as dir_image_find() followed by parent_dir_image_find(), but the result
+ * (also if negative) is cached until the mtime of the directory changes.
+ *
+ * @param out_path If return value is 0, contains the absolute path to the image
+ * @param len If return value is 0, contains the length of the absolute path
+ * @param dir The directory to search
+ * @return 0 if image exists, -1 otherwise
+ */
+static int
+dir_lookup_cache_get(char *out_path, size_t len, const char *dir)
+{
+  struct dir_lookup *entry;
+  struct stat sb;
+  time_t mtime;
+  int ret;
+
+  // If we can't stat the dir we just do the lookup without the cache
+  mtime = (stat(dir, &sb) == 0) ? sb.st_mtime : 0;
+
+  entry = &dir_lookup_cache[djb_hash(dir, strlen(dir)) % DIR_LOOKUP_CACHE_SIZE];
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&dir_lookup_cache_mutex));
+  if (mtime != 0 && entry->dir && entry->mtime == mtime && strcmp(entry->dir, dir) == 0)
+    {
+      ret = entry->found ? 0 : -1;
+      if (ret == 0)
+	snprintf(out_path, len, "%s", entry->found);
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_lookup_cache_mutex));
+
+      DPRINTF(E_SPAM, L_ART, "Directory artwork lookup cache hit for %s\n", dir);
+      return ret;
+    }
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_lookup_cache_mutex));
+
+  // Not holding the lock here, since the lookup can be slow
+  ret = dir_image_find(out_path, len, dir);
+  if (ret < 0)
+    ret = parent_dir_image_find(out_path, len, dir);
+
+  if (mtime == 0)
+    return ret;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&dir_lookup_cache_mutex));
+  free(entry->dir);
+  free(entry->found);
+  entry->dir = strdup(dir);
+  entry->mtime = mtime;
+  entry->found = (ret == 0) ? strdup(out_path) : NULL;
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&dir_lookup_cache_mutex));
+
+  return ret;
+}
+
 /* Looks for an artwork file in a directory. Will rescale if needed.
  *
  * @out evbuf     Image data
@@ -909,19 +1106,11 @@ artwork_get_bydir(struct evbuffer *evbuf, char *out_path, size_t len, char *dir,
 {
   int ret;
 
-  ret = dir_image_find(out_path, len, dir);
-  if (ret >= 0)
-    {
-      return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
-    }
-
-  ret = parent_dir_image_find(out_path, len, dir);
-  if (ret >= 0)
-    {
-      return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
-    }
+  ret = dir_lookup_cache_get(out_path, len, dir);
+  if (ret < 0)
+    return ART_E_NONE;
 
-  return ART_E_NONE;
+  return artwork_get(evbuf, out_path, NULL, NULL, DATA_KIND_FILE, req_params);
 }
 
 /* Retrieves artwork from an URL, will rescale if needed. Checks the cache stash
@@ -960,7 +1149,7 @@ artwork_get_byurl(struct evbuffer *artwork, const char *url, struct artwork_req_
     goto out;
 
   // Takes care of resizing
-  ret = artwork_get(artwork, NULL, raw, false, 0, req_params);
+  ret = artwork_get(artwork, NULL, raw, NULL, 0, req_params);
   if (ret < 0)
     format = ART_E_ERROR;
 
@@ -969,6 +1158,147 @@ artwork_get_byurl(struct evbuffer *artwork, const char *url, struct artwork_req_
   return format;
 }
 
+// Caller must hold artwork_mem_mutex
+static void
+artwork_mem_unref(struct artwork_mem *mem)
+{
+  int i;
+
+  mem->refcount--;
+  if (mem->refcount > 0)
+    return;
+
+  for (i = 0; i < ARTWORK_MEM_SCALED_MAX; i++)
+    free(mem->scaled[i].data);
+
+  free(mem->data);
+  free(mem->url);
+  free(mem);
+}
+
+// Caller must hold artwork_mem_mutex. Returns a reference to the image, which
+// the caller must release with artwork_mem_unref()
+static struct artwork_mem *
+artwork_mem_find(const char *url)
+{
+  struct artwork_mem *mem;
+
+  for (mem = artwork_mem_list; mem; mem = mem->next)
+    {
+      if (strcmp(mem->url, url) == 0)
+	{
+	  mem->refcount++;
+	  return mem;
+	}
+    }
+
+  return NULL;
+}
+
+// Caller must hold artwork_mem_mutex
+static void
+artwork_mem_remove(const char *name)
+{
+  struct artwork_mem *mem;
+  struct artwork_mem **prev;
+  size_t name_len = strlen(name);
+
+  prev = &artwork_mem_list;
+  while ((mem = *prev))
+    {
+      // Registered urls are "memory:<name>/<seq>"
+      if (strncmp(mem->url + strlen("memory:"), name, name_len) == 0 && mem->url[strlen("memory:") + name_len] == '/')
+	{
+	  *prev = mem->next;
+	  artwork_mem_unref(mem);
+	}
+      else
+	prev = &mem->next;
+    }
+}
+
+static bool
+artwork_mem_params_equal(struct artwork_req_params *a, struct artwork_req_params *b)
+{
+  return (a->max_w == b->max_w && a->max_h == b->max_h && a->format == b->format);
+}
+
+/* Gets an in-memory image, rescaled if needed. A rescaled image is saved with
+ * the original, so it only has to be made once per size.
+ *
+ * @out evbuf     Image data
+ * @in  mem       The image, caller must hold a reference
+ * @in  data_kind Used by the transcode module to determine e.g. probe size
+ * @in  req_params Requested max size/format
+ * @return        ART_FMT_* on success, ART_E_NONE or ART_E_ERROR otherwise
+ */
+static int
+artwork_mem_get(struct evbuffer *evbuf, struct artwork_mem *mem, enum data_kind data_kind, struct artwork_req_params req_params)
+{
+  struct artwork_mem_scaled *scaled;
+  struct evbuffer *in_buf;
+  struct evbuffer *out_buf;
+  uint8_t *data;
+  size_t len;
+  int ret;
+  int i;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+  for (i = 0; i < ARTWORK_MEM_SCALED_MAX; i++)
+    {
+      scaled = &mem->scaled[i];
+      if (!scaled->data || !artwork_mem_params_equal(&scaled->req_params, &req_params))
+	continue;
+
+      ret = evbuffer_add(evbuf, scaled->data, scaled->len);
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+
+      DPRINTF(E_SPAM, L_ART, "Serving rescaled in-memory artwork '%s'\n", mem->url);
+      return (ret < 0) ? ART_E_ERROR : scaled->format;
+    }
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+
+  CHECK_NULL(L_ART, in_buf = evbuffer_new());
+  CHECK_NULL(L_ART, out_buf = evbuffer_new());
+
+  // No copy, the data stays valid while we hold the reference
+  ret = evbuffer_add_reference(in_buf, mem->data, mem->len, NULL, NULL);
+  if (ret < 0)
+    {
+      ret = ART_E_ERROR;
+      goto out;
+    }
+
+  ret = artwork_get(out_buf, NULL, in_buf, NULL, data_kind, req_params);
+  if (ret <= 0)
+    goto out;
+
+  len = evbuffer_get_length(out_buf);
+  data = malloc(len);
+  if (data)
+    {
+      evbuffer_copyout(out_buf, data, len);
+
+      CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+      scaled = &mem->scaled[mem->scaled_next];
+      free(scaled->data);
+      scaled->req_params = req_params;
+      scaled->format = ret;
+      scaled->data = data;
+      scaled->len = len;
+      mem->scaled_next = (mem->scaled_next + 1) % ARTWORK_MEM_SCALED_MAX;
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+    }
+
+  if (evbuffer_add_buffer(evbuf, out_buf) < 0)
+    ret = ART_E_ERROR;
+
+ out:
+  evbuffer_free(in_buf);
+  evbuffer_free(out_buf);
+  return ret;
+}
+
 /* ------------------------- ONLINE SOURCE HANDLING  ----------------------- */
 
 #ifdef SPOTIFY
@@ -1325,6 +1655,41 @@ auth_header_add(struct keyval *headers, const struct online_source *src)
   return 0;
 }
 
+// Must be called with the search history locked, returns the artwork url from
+// the response or NULL
+static char *
+online_source_response_handle(const struct online_source *src, struct http_client_ctx *client, int request_ret, int id, uint32_t hash, int max_w, int max_h)
+{
+  char *artwork_url;
+  int ret;
+
+  if (request_ret < 0 || client->response_code != HTTP_OK)
+    {
+      DPRINTF(E_WARN, L_ART, "Artwork request to '%s' failed, response code %d\n", client->url, client->response_code);
+      goto error;
+    }
+
+  ret = online_source_response_parse(&artwork_url, src, client->input_body, max_w, max_h);
+  if (ret == ONLINE_SOURCE_PARSE_NOT_FOUND)
+    DPRINTF(E_DBG, L_ART, "No image tag found in response from source '%s'\n", src->name);
+  else if (ret == ONLINE_SOURCE_PARSE_INVALID)
+    DPRINTF(E_WARN, L_ART, "Response from source '%s' was in an unexpected format\n", src->name);
+  else if (ret == ONLINE_SOURCE_PARSE_NO_PARSER)
+    DPRINTF(E_LOG, L_ART, "Bug! Cannot parse response from source '%s', parser missing\n", src->name);
+  else if (ret != ONLINE_SOURCE_PARSE_OK)
+    DPRINTF(E_LOG, L_ART, "Bug! Cannot parse response from source '%s', unknown error\n", src->name);
+
+  if (ret != ONLINE_SOURCE_PARSE_OK)
+    goto error;
+
+  online_source_history_update(src, id, hash, client->response_code, artwork_url, max_w, max_h);
+  return artwork_url;
+
+ error:
+  online_source_history_update(src, id, hash, client->response_code, NULL, max_w, max_h);
+  return NULL;
+}
+
 static char *
 online_source_artwork_url_get(const char *search_url, const struct online_source *src, int id, int max_w, int max_h)
 {
@@ -1361,35 +1726,13 @@ online_source_artwork_url_get(const char *search_url, const struct online_source
 
   ret = http_client_request(&client, NULL);
   keyval_clear(&output_headers);
-  if (ret < 0 || client.response_code != HTTP_OK)
-    {
-      DPRINTF(E_WARN, L_ART, "Artwork request to '%s' failed, response code %d\n", search_url, client.response_code);
-      goto error;
-    }
 
-  ret = online_source_response_parse(&artwork_url, src, client.input_body, max_w, max_h);
-  if (ret == ONLINE_SOURCE_PARSE_NOT_FOUND)
-    DPRINTF(E_DBG, L_ART, "No image tag found in response from source '%s'\n", src->name);
-  else if (ret == ONLINE_SOURCE_PARSE_INVALID)
-    DPRINTF(E_WARN, L_ART, "Response from source '%s' was in an unexpected format\n", src->name);
-  else if (ret == ONLINE_SOURCE_PARSE_NO_PARSER)
-    DPRINTF(E_LOG, L_ART, "Bug! Cannot parse response from source '%s', parser missing\n", src->name);
-  else if (ret != ONLINE_SOURCE_PARSE_OK)
-    DPRINTF(E_LOG, L_ART, "Bug! Cannot parse response from source '%s', unknown error\n", src->name);
-
-  if (ret != ONLINE_SOURCE_PARSE_OK)
-    goto error;
-
-  online_source_history_update(src, id, hash, client.response_code, artwork_url, max_w, max_h);
+  artwork_url = online_source_response_handle(src, &client, ret, id, hash, max_w, max_h);
   evbuffer_free(client.input_body);
   return artwork_url;
-
- error:
-  online_source_history_update(src, id, hash, client.response_code, NULL, max_w, max_h);
-  evbuffer_free(client.input_body);
-  return NULL;
 }
 
+
 static char *
 online_source_search(const struct online_source *src, struct artwork_ctx *ctx)
 {
@@ -1430,6 +1773,189 @@ online_source_is_enabled(const struct online_source *src)
   return enabled;
 }
 
+static void
+online_results_clear(struct artwork_ctx *ctx)
+{
+  int i;
+
+  for (i = 0; i < ONLINE_SOURCE_MAX; i++)
+    {
+      free(ctx->online[i].artwork_url);
+      ctx->online[i].artwork_url = NULL;
+      ctx->online[i].is_done = false;
+    }
+
+  ctx->online_searched = false;
+}
+
+/* We have what we need when the source with the highest priority that hasn't
+ * failed has given a result
+ */
+static bool
+online_race_is_decided(struct artwork_ctx *ctx, struct online_search *searches)
+{
+  int i;
+
+  for (i = 0; i < ONLINE_SOURCE_MAX; i++)
+    {
+      if (ctx->online[i].artwork_url)
+	return true;
+      if (!ctx->online[i].is_done && searches[i].is_requested)
+	return false;
+    }
+
+  return true;
+}
+
+// Called by http_client_request_multi() when a request completes
+static bool
+online_race_done_cb(int i, int result, void *arg)
+{
+  struct online_race *race = arg;
+  struct artwork_ctx *ctx = race->ctx;
+  struct online_search *search;
+  int id;
+
+  id = race->ids[i];
+  search = &race->searches[id];
+
+  ctx->online[id].artwork_url = online_source_response_handle(search->src, &search->client, result, ctx->id, search->hash, ctx->req_params.max_w, ctx->req_params.max_h);
+  ctx->online[id].is_done = true;
+
+  return online_race_is_decided(ctx, race->searches);
+}
+
+/* Searches the enabled online sources concurrently, and stops when the source
+ * with the highest priority has given a result. The results are saved in ctx,
+ * where the handlers get them with online_source_result_get() in priority
+ * order.
+ */
+static void
+online_sources_search(struct artwork_ctx *ctx)
+{
+  struct online_search searches[ONLINE_SOURCE_MAX] = { 0 };
+  struct http_client_ctx *clients[ONLINE_SOURCE_MAX];
+  struct online_race race;
+  struct online_search_history *history;
+  int ids[ONLINE_SOURCE_MAX];
+  bool is_decided;
+  int n;
+  int i;
+  int ret;
+
+  online_results_clear(ctx);
+  ctx->online_id = ctx->id;
+  ctx->online_searched = true;
+
+  n = 0;
+  is_decided = false;
+  for (i = 0; i < ONLINE_SOURCE_MAX && !is_decided; i++)
+    {
+      searches[i].src = online_sources[i];
+      history = searches[i].src->search_history;
+      ctx->online[i].is_done = true; // Unless we make a request
+
+#ifndef SPOTIFY
+      if (i == ONLINE_SOURCE_SPOTIFY)
+	continue;
+#endif
+
+      if (!online_source_is_enabled(searches[i].src))
+	continue;
+
+      ret = online_source_search_url_make(searches[i].search_url, sizeof(searches[i].search_url), searches[i].src, ctx);
+      if (ret < 0)
+	continue;
+
+      // Locked until the request is done, see online_source_search()
+      pthread_mutex_lock(&history->mutex);
+
+      searches[i].hash = djb_hash(searches[i].search_url, strlen(searches[i].search_url));
+      ret = online_source_search_check_last(&ctx->online[i].artwork_url, searches[i].src, searches[i].hash, ctx->req_params.max_w, ctx->req_params.max_h);
+      if (ret == 0)
+	{
+	  // Repeated search, no need to ask sources with lower priority if it was found
+	  is_decided = (ctx->online[i].artwork_url != NULL);
+	  pthread_mutex_unlock(&history->mutex);
+	  continue;
+	}
+
+      if (online_source_is_failing(searches[i].src, ctx->id))
+	{
+	  DPRINTF(E_DBG, L_ART, "Skipping artwork source %s, too many failed requests\n", searches[i].src->name);
+	  pthread_mutex_unlock(&history->mutex);
+	  continue;
+	}
+
+      ret = auth_header_add(&searches[i].output_headers, searches[i].src);
+      if (ret < 0)
+	{
+	  pthread_mutex_unlock(&history->mutex);
+	  continue;
+	}
+
+      CHECK_NULL(L_ART, searches[i].client.input_body = evbuffer_new());
+      searches[i].client.url = searches[i].search_url;
+      searches[i].client.output_headers = &searches[i].output_headers;
+      searches[i].is_requested = true;
+      ctx->online[i].is_done = false;
+
+      clients[n] = &searches[i].client;
+      ids[n] = i;
+      n++;
+    }
+
+  // Sources we didn't get to are left as not done, so they will be searched
+  // individually if they are needed after all (e.g. if the image download of
+  // the source that was found fails)
+  for (; i < ONLINE_SOURCE_MAX; i++)
+    ctx->online[i].is_done = false;
+
+  if (n > 0)
+    {
+      DPRINTF(E_DBG, L_ART, "Searching %d online artwork sources for '%s'\n", n, ctx->dbmfi->path);
+
+      race.ctx = ctx;
+      race.searches = searches;
+      race.ids = ids;
+
+      // Requests that are aborted because the race was decided are left as not
+      // done, same as if the requests could not be made at all
+      http_client_request_multi(clients, n, online_race_done_cb, &race);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      keyval_clear(&searches[ids[i]].output_headers);
+      evbuffer_free(searches[ids[i]].client.input_body);
+      pthread_mutex_unlock(&searches[ids[i]].src->search_history->mutex);
+    }
+}
+
+/* Returns the result of the concurrent search for the given source, or makes
+ * the search if the result isn't there (e.g. because the source was cancelled)
+ */
+static char *
+online_source_result_get(enum online_source_id id, struct artwork_ctx *ctx)
+{
+  char *artwork_url;
+
+  if (!ctx->online_searched || ctx->online_id != ctx->id)
+    online_sources_search(ctx);
+
+  if (!ctx->online[id].is_done)
+    {
+      // Mark as done, so that we don't search again if called twice
+      ctx->online[id].is_done = true;
+      return online_source_search(online_sources[id], ctx);
+    }
+
+  artwork_url = ctx->online[id].artwork_url;
+  ctx->online[id].artwork_url = NULL;
+
+  return artwork_url;
+}
+
 
 /* ---------------------- SOURCE HANDLER IMPLEMENTATION -------------------- */
 
@@ -1442,7 +1968,7 @@ source_group_cache_get(struct artwork_ctx *ctx)
   int cached;
   int ret;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, ctx->req_params.format, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
 
@@ -1517,7 +2043,7 @@ source_item_cache_get(struct artwork_ctx *ctx)
   if (!ctx->individual)
     return ART_E_NONE;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, ctx->req_params.format, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
 
@@ -1535,7 +2061,9 @@ source_item_cache_get(struct artwork_ctx *ctx)
 static int
 source_item_embedded_get(struct artwork_ctx *ctx)
 {
+  uint64_t src_hash = 0;
   int artwork;
+  int ret;
 
   DPRINTF(E_SPAM, L_ART, "Trying embedded artwork in %s\n", ctx->dbmfi->path);
 
@@ -1550,7 +2078,11 @@ source_item_embedded_get(struct artwork_ctx *ctx)
 
   snprintf(ctx->path, sizeof(ctx->path), "%s", ctx->dbmfi->path);
 
-  return artwork_get(ctx->evbuf, ctx->path, NULL, true, ctx->data_kind, ctx->req_params);
+  ret = artwork_get(ctx->evbuf, ctx->path, NULL, &src_hash, ctx->data_kind, ctx->req_params);
+  if (ret > 0)
+    ctx->src_hash = src_hash;
+
+  return ret;
 }
 
 /* Looks for basename(in_path).{png,jpg}, so if in_path is /foo/bar.mp3 it
@@ -1604,7 +2136,7 @@ source_item_own_get(struct artwork_ctx *ctx)
 
   snprintf(ctx->path, sizeof(ctx->path), "%s", path);
 
-  return artwork_get(ctx->evbuf, path, NULL, false, ctx->data_kind, ctx->req_params);
+  return artwork_get(ctx->evbuf, path, NULL, NULL, ctx->data_kind, ctx->req_params);
 }
 
 /*
@@ -1646,16 +2178,16 @@ source_item_artwork_url_get(struct artwork_ctx *ctx)
 
 /*
  * If we are playing a pipe and there is also a metadata pipe, then input/pipe.c
- * may have saved the incoming artwork in a tmp file
+ * may have registered the incoming artwork with artwork_mem_register()
  *
  */
 static int
 source_item_pipe_get(struct artwork_ctx *ctx)
 {
   struct db_queue_item *queue_item;
-  const char *proto_file = "file:";
-  bool is_file;
-  char *path;
+  struct artwork_mem *mem;
+  const char *proto_memory = "memory:";
+  bool is_memory;
   int ret;
 
   DPRINTF(E_SPAM, L_ART, "Trying pipe metadata from %s.metadata\n", ctx->dbmfi->path);
@@ -1664,22 +2196,29 @@ source_item_pipe_get(struct artwork_ctx *ctx)
   if (!queue_item || !queue_item->artwork_url)
     goto notfound;
 
-  is_file = (strncmp(queue_item->artwork_url, proto_file, strlen(proto_file)) == 0);
-  if (!is_file)
+  is_memory = (strncmp(queue_item->artwork_url, proto_memory, strlen(proto_memory)) == 0);
+  if (!is_memory)
     goto notfound;
 
-  path = queue_item->artwork_url + strlen(proto_file);
-
-  // Sometimes the file has been replaced, but queue_item->artwork_url hasn't
+  // Sometimes the image has been replaced, but queue_item->artwork_url hasn't
   // been updated yet. In that case just stop now.
-  ret = access(path, F_OK);
-  if (ret != 0)
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+  mem = artwork_mem_find(queue_item->artwork_url);
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+  if (!mem)
     goto notfound;
 
-  snprintf(ctx->path, sizeof(ctx->path), "%s", path);
+  snprintf(ctx->path, sizeof(ctx->path), "%s", queue_item->artwork_url);
 
   free_queue_item(queue_item, 0);
-  return artwork_get(ctx->evbuf, ctx->path, NULL, false, ctx->data_kind, ctx->req_params);
+
+  ret = artwork_mem_get(ctx->evbuf, mem, ctx->data_kind, ctx->req_params);
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+  artwork_mem_unref(mem);
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+
+  return ret;
 
  notfound:
   free_queue_item(queue_item, 0);
@@ -1695,7 +2234,7 @@ source_item_discogs_get(struct artwork_ctx *ctx)
   if (!online_source_is_enabled(&discogs_source))
     return ART_E_NONE;
 
-  url = online_source_search(&discogs_source, ctx);
+  url = online_source_result_get(ONLINE_SOURCE_DISCOGS, ctx);
   if (!url)
     return ART_E_NONE;
 
@@ -1718,7 +2257,7 @@ source_item_coverartarchive_get(struct artwork_ctx *ctx)
 
   // We search Musicbrainz to get the Musicbrainz ID, which we need to get the
   // artwork from the Cover Art Archive
-  url = online_source_search(&musicbrainz_source, ctx);
+  url = online_source_result_get(ONLINE_SOURCE_MUSICBRAINZ, ctx);
   if (!url)
     return ART_E_NONE;
 
@@ -1759,7 +2298,7 @@ source_item_spotifywebapi_search_get(struct artwork_ctx *ctx)
   if (!online_source_is_enabled(&spotify_source))
     return ART_E_NONE;
 
-  url = online_source_search(&spotify_source, ctx);
+  url = online_source_result_get(ONLINE_SOURCE_SPOTIFY, ctx);
   if (!url)
     return ART_E_NONE;
 
@@ -1911,6 +2450,7 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	    {
 	      DPRINTF(E_DBG, L_ART, "Artwork for '%s' found in source '%s'\n", dbmfi.title, artwork_item_source[i].name);
 	      ctx->cache = artwork_item_source[i].cache;
+	      online_results_clear(ctx);
 	      db_query_end(&ctx->qp);
 	      return ret;
 	    }
@@ -1935,16 +2475,28 @@ process_items(struct artwork_ctx *ctx, int item_mode)
     }
 
  no_artwork:
+  online_results_clear(ctx);
   db_query_end(&ctx->qp);
 
   return -1;
 }
 
+/* Misses are remembered per group and not per requested size, so that a group
+ * without artwork only costs a cache lookup, also after a restart. The search
+ * in the items of the group is only remembered if none of the sources said
+ * not to cache a negative result (e.g. because a stream can change).
+ */
 static int
 process_group(struct artwork_ctx *ctx)
 {
   struct db_media_file_info dbmfi;
+  enum artwork_cache cache;
+  char dirpath[PATH_MAX];
+  char *ptr;
+  uint32_t data_kind;
   bool is_valid;
+  int misses;
+  int misses_new;
   int i;
   int ret;
 
@@ -1964,6 +2516,17 @@ process_group(struct artwork_ctx *ctx)
     }
 
   is_valid = (db_query_fetch_file(&dbmfi, &ctx->qp) == 0 && strcmp(dbmfi.album, CFG_NAME_UNKNOWN_ALBUM) != 0 && strcmp(dbmfi.album_artist, CFG_NAME_UNKNOWN_ARTIST) != 0);
+
+  // The directory is what cache_artwork_ping() uses to forget the misses again
+  dirpath[0] = '\0';
+  if (is_valid && safe_atou32(dbmfi.data_kind, &data_kind) == 0 && data_kind == DATA_KIND_FILE)
+    {
+      snprintf(dirpath, sizeof(dirpath), "%s", dbmfi.path);
+      ptr = strrchr(dirpath, '/');
+      if (ptr)
+	*ptr = '\0';
+    }
+
   db_query_end(&ctx->qp);
   if (!is_valid)
     {
@@ -1971,8 +2534,17 @@ process_group(struct artwork_ctx *ctx)
       goto invalid_group;
     }
 
+  cache_artwork_miss_get(CACHE_ARTWORK_GROUP, ctx->persistentid, &misses);
+  misses_new = misses;
+
   for (i = 0; artwork_group_source[i].handler; i++)
     {
+      if (misses & artwork_group_source[i].miss_flag)
+	{
+	  DPRINTF(E_SPAM, L_ART, "Skipping group source '%s', no artwork last time\n", artwork_group_source[i].name);
+	  continue;
+	}
+
       // If just one handler says we should not cache a negative result then we obey that
       if ((artwork_group_source[i].cache & ON_FAILURE) == 0)
 	ctx->cache = NEVER;
@@ -1980,6 +2552,9 @@ process_group(struct artwork_ctx *ctx)
       DPRINTF(E_SPAM, L_ART, "Checking group source '%s'\n", artwork_group_source[i].name);
 
       ret = artwork_group_source[i].handler(ctx);
+      if (ret == ART_E_NONE && (artwork_group_source[i].cache & ON_FAILURE))
+	misses_new |= artwork_group_source[i].miss_flag;
+
       if (ret > 0)
 	{
 	  DPRINTF(E_DBG, L_ART, "Artwork for group %" PRIi64 " found in source '%s'\n", ctx->persistentid, artwork_group_source[i].name);
@@ -1999,11 +2574,152 @@ process_group(struct artwork_ctx *ctx)
 	}
     }
 
+  if (misses & ARTWORK_MISS_ITEMS)
+    {
+      DPRINTF(E_SPAM, L_ART, "Skipping item sources for group %" PRIi64 ", no artwork last time\n", ctx->persistentid);
+      return -1;
+    }
+
+  // Only want to know if the item sources allow caching a negative result
+  cache = ctx->cache;
+  ctx->cache = ON_FAILURE;
+
+  ret = process_items(ctx, 0);
+  if (ret > 0)
+    return ret;
+
+  if (ctx->cache & ON_FAILURE)
+    misses_new |= ARTWORK_MISS_ITEMS;
+
+  ctx->cache &= cache;
+
+  if (misses_new != misses)
+    cache_artwork_miss_add(CACHE_ARTWORK_GROUP, ctx->persistentid, misses_new, dirpath);
+
+  return -1;
+
  invalid_group:
   return process_items(ctx, 0);
 }
 
 
+/* ----------------------------- PRERENDERING ------------------------------ */
+
+/* If the user configured artwork_sizes, requests for square artwork are served
+ * with the smallest configured size that is at least as large. That way few
+ * sizes need to be in the cache, and they can be prepared in advance.
+ */
+static void
+size_ladder_apply(int *max_w, int *max_h)
+{
+  cfg_t *lib = cfg_getsec(cfg, "library");
+  int nearest;
+  int size;
+  int n;
+  int i;
+
+  if (*max_w <= 0 || *max_w != *max_h)
+    return;
+
+  n = cfg_size(lib, "artwork_sizes");
+  nearest = 0;
+  for (i = 0; i < n; i++)
+    {
+      size = cfg_getnint(lib, "artwork_sizes", i);
+      if (size >= *max_w && (nearest == 0 || size < nearest))
+	nearest = size;
+    }
+
+  if (nearest == 0 || nearest == *max_w)
+    return;
+
+  DPRINTF(E_SPAM, L_ART, "Serving artwork request for %dx%d with size %d\n", *max_w, *max_h, nearest);
+
+  *max_w = nearest;
+  *max_h = nearest;
+}
+
+// Thread: worker
+static void
+prerender_cb(void *arg)
+{
+  cfg_t *lib = cfg_getsec(cfg, "library");
+  struct query_params qp = { 0 };
+  struct db_group_info dbgri;
+  struct evbuffer *evbuf;
+  int offset = *(int *)arg;
+  int nsizes;
+  int count;
+  int size;
+  int id;
+  int i;
+  int ret;
+
+  nsizes = cfg_size(lib, "artwork_sizes");
+
+  qp.type = Q_GROUP_ALBUMS;
+  qp.idx_type = I_SUB;
+  qp.offset = offset;
+  qp.limit = ARTWORK_PRERENDER_BATCH;
+  qp.sort = S_NONE;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not start query for artwork prerendering\n");
+      goto stop;
+    }
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  count = 0;
+  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
+    {
+      count++;
+
+      if (safe_atoi32(dbgri.id, &id) < 0)
+	continue;
+
+      for (i = 0; i < nsizes; i++)
+	{
+	  size = cfg_getnint(lib, "artwork_sizes", i);
+	  if (size <= 0)
+	    continue;
+
+	  // Will add to the cache, or just read from it if already there
+	  artwork_get_group(evbuf, id, size, size, 0);
+	  evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	}
+    }
+
+  db_query_end(&qp);
+  evbuffer_free(evbuf);
+
+  if (count == ARTWORK_PRERENDER_BATCH)
+    {
+      // More albums, continue after a short break so we yield to other jobs
+      offset += count;
+      worker_execute(prerender_cb, &offset, sizeof(int), 1);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_ART, "Artwork prerendering completed (%d albums)\n", offset + count);
+
+ stop:
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_prerender_mutex));
+  artwork_prerender_is_running = false;
+  if (artwork_prerender_is_requested)
+    {
+      // Library changed while we were running, so go again
+      artwork_prerender_is_requested = false;
+      artwork_prerender_is_running = true;
+      offset = 0;
+      worker_execute(prerender_cb, &offset, sizeof(int), 5);
+    }
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_prerender_mutex));
+}
+
+
 /* ------------------------------ ARTWORK API ------------------------------ */
 
 int
@@ -2012,12 +2728,15 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   struct artwork_ctx ctx;
   char filter[32];
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_ARTWORK);
 
   DPRINTF(E_DBG, L_ART, "Artwork request for item %d (max_w=%d, max_h=%d)\n", id, max_w, max_h);
 
   if (id == DB_MEDIA_FILE_NON_PERSISTENT_ID)
     return  -1;
 
+  size_ladder_apply(&max_w, &max_h);
+
   memset(&ctx, 0, sizeof(struct artwork_ctx));
 
   ctx.qp.type = Q_ITEMS;
@@ -2042,7 +2761,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, format, ret, ctx.path, ctx.src_hash, evbuf);
 
       return ret;
     }
@@ -2054,7 +2773,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, ret, ctx.path, ctx.src_hash, evbuf);
 
       return ret;
     }
@@ -2062,7 +2781,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   DPRINTF(E_DBG, L_ART, "No artwork found for item %d\n", id);
 
   if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
+    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, 0, "", 0, evbuf);
 
   return -1;
 }
@@ -2072,9 +2791,12 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
 {
   struct artwork_ctx ctx;
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_ARTWORK);
 
   DPRINTF(E_DBG, L_ART, "Artwork request for group %d (max_w=%d, max_h=%d)\n", id, max_w, max_h);
 
+  size_ladder_apply(&max_w, &max_h);
+
   memset(&ctx, 0, sizeof(struct artwork_ctx));
 
   /* Get the persistent id for the given group id */
@@ -2098,7 +2820,7 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, ret, ctx.path, ctx.src_hash, evbuf);
 
       return ret;
     }
@@ -2106,11 +2828,55 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   DPRINTF(E_DBG, L_ART, "No artwork found for group %d\n", id);
 
   if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
+    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, 0, "", 0, evbuf);
 
   return -1;
 }
 
+void
+artwork_prerender_start(void)
+{
+  int offset = 0;
+
+  if (cfg_size(cfg_getsec(cfg, "library"), "artwork_sizes") == 0)
+    return;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_prerender_mutex));
+  if (artwork_prerender_is_running)
+    {
+      artwork_prerender_is_requested = true;
+    }
+  else
+    {
+      DPRINTF(E_INFO, L_ART, "Starting artwork prerendering\n");
+
+      artwork_prerender_is_running = true;
+      // Low priority, so wait a bit to let client requests after the scan go first
+      worker_execute(prerender_cb, &offset, sizeof(int), 10);
+    }
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_prerender_mutex));
+}
+
+bool
+artwork_format_is_supported(int format)
+{
+  static int webp_supported = -1;
+
+  switch (format)
+    {
+      case ART_FMT_PNG:
+      case ART_FMT_JPEG:
+	return true;
+      case ART_FMT_WEBP:
+	// Only available if ffmpeg was built with libwebp, so check just once
+	if (webp_supported < 0)
+	  webp_supported = transcode_encode_is_supported(XCODE_WEBP);
+	return webp_supported;
+      default:
+	return false;
+    }
+}
+
 /* Checks if the file is an artwork file */
 bool
 artwork_file_is_artwork(const char *filename)
@@ -2173,3 +2939,38 @@ artwork_extension_is_artwork(const char *path)
 
   return false;
 }
+
+char *
+artwork_mem_register(const char *name, const uint8_t *data, size_t len)
+{
+  struct artwork_mem *mem;
+  char *url;
+
+  CHECK_NULL(L_ART, mem = calloc(1, sizeof(struct artwork_mem)));
+  CHECK_NULL(L_ART, mem->data = malloc(len));
+
+  memcpy(mem->data, data, len);
+  mem->len = len;
+  mem->refcount = 1; // The list's reference
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+  artwork_mem_remove(name);
+
+  artwork_mem_seq++;
+  mem->url = safe_asprintf("memory:%s/%u", name, artwork_mem_seq);
+  mem->next = artwork_mem_list;
+  artwork_mem_list = mem;
+
+  url = strdup(mem->url);
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+
+  return url;
+}
+
+void
+artwork_mem_unregister(const char *name)
+{
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_mem_mutex));
+  artwork_mem_remove(name);
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_mem_mutex));
+}
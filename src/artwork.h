@@ -5,12 +5,14 @@
 #define ART_FMT_PNG     1
 #define ART_FMT_JPEG    2
 #define ART_FMT_VP8     3
+#define ART_FMT_WEBP    4
 
 #define ART_DEFAULT_HEIGHT 600
 #define ART_DEFAULT_WIDTH  600
 
 #include <event2/buffer.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * Get the artwork image for an individual item (track)
@@ -38,6 +40,20 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
 int
 artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
 
+/*
+ * Prepares the artwork of all albums in the sizes from the artwork_sizes
+ * config option, so they are in the artwork cache when requested. Runs in the
+ * background in small batches via the worker, returns immediately.
+ */
+void
+artwork_prerender_start(void);
+
+/*
+ * Checks if artwork can be output in the given format (ART_FMT_*)
+ */
+bool
+artwork_format_is_supported(int format);
+
 /*
  * Checks if the file is an artwork file (based on user config)
  *
@@ -58,4 +74,24 @@ artwork_file_is_artwork(const char *filename);
 bool
 artwork_extension_is_artwork(const char *path);
 
+/*
+ * Registers an image that is held in memory, so that it can be used as artwork
+ * for queue items (as their artwork_url) without writing it to a file first.
+ * An image registered earlier with the same name is replaced. The data is
+ * copied.
+ *
+ * @in  name     Name of the registration, e.g. "pipe"
+ * @in  data     Image data (PNG or JPEG)
+ * @in  len      Length of data
+ * @return       The url ("memory:<name>/<seq>"), caller must free
+ */
+char *
+artwork_mem_register(const char *name, const uint8_t *data, size_t len);
+
+/*
+ * Removes the image registered with the given name (if any)
+ */
+void
+artwork_mem_unregister(const char *name);
+
 #endif /* !__ARTWORK_H__ */
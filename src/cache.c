@@ -25,8 +25,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
 #include <string.h>
@@ -37,6 +40,7 @@
 
 #include "conffile.h"
 #include "logger.h"
+#include "misc.h"
 #include "httpd.h" // TODO get rid of this, only used for httpd_gzip_deflate
 #include "httpd_daap.h"
 #include "transcode.h"
@@ -45,6 +49,7 @@
 #include "cache.h"
 #include "listener.h"
 #include "commands.h"
+#include "player.h"
 
 struct cache_arg
 {
@@ -54,6 +59,7 @@ struct cache_arg
   char *ua;    // user agent
   int is_remote;
   int msec;
+  bool is_gzip; // DAAP reply gzipped or raw
 
   uint32_t id; // file id
   const char *header_format;
@@ -64,12 +70,25 @@ struct cache_arg
   int64_t persistentid;
   int max_w;
   int max_h;
+  int req_format; // requested artwork format, 0 for the source format
   int format;
+  uint64_t src_hash; // hash of the source image, e.g. embedded artwork
   time_t mtime;
   int cached;
   int del;
 
   struct evbuffer *evbuf;
+
+  char **uris;   // artwork url lists (see cache_artwork_urls_add)
+  char **images;
+  int count;
+
+  int sources;   // artwork sources without a result (see cache_artwork_miss_add)
+
+  char *etag;    // web api responses (see cache_webapi_add)
+  time_t expires;
+
+  struct cache_stats *stats;
 };
 
 struct cachelist
@@ -93,6 +112,41 @@ struct cache_artwork_stash
   uint8_t *data;
 };
 
+// Entry of the in-memory tier of the DAAP cache, holds a gzipped or raw reply
+struct cache_daap_mem_entry
+{
+  char *query;
+  bool is_gzip;
+  uint8_t *data;
+  size_t len;
+
+  struct cache_daap_mem_entry *prev;
+  struct cache_daap_mem_entry *next;
+};
+
+struct cache_daap_mem
+{
+  pthread_mutex_t lck;
+
+  // Least recently used is the tail, which is the first to be evicted
+  struct cache_daap_mem_entry *head;
+  struct cache_daap_mem_entry *tail;
+
+  int count;
+  size_t size;
+  size_t max_size;
+
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct cache_stream_file
+{
+  char name[NAME_MAX + 1];
+  off_t size;
+  time_t mtime;
+};
+
 struct cache_xcode_job
 {
   const char *format;
@@ -108,17 +162,35 @@ struct cache_xcode_job
 
 /* --------------------------------- GLOBALS -------------------------------- */
 
+// Stream cache, max_size is 0 if disabled. Only accessed by httpd and worker
+// threads, the cache thread is not involved.
+static char cache_stream_dir[PATH_MAX];
+static off_t cache_stream_max_size;
+static pthread_mutex_t cache_stream_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// Artwork images are stored as files in this dir, named by their id in the
+// artwork table, so they can be served without copying them out of sqlite. If
+// the dir is empty, images are stored as blobs in the table. Only accessed by
+// the cache thread.
+static char cache_artwork_dir[PATH_MAX];
+
 // cache thread
 static pthread_t tid_cache;
 
 // Event base, pipes and events
 static struct event_base *evbase_cache;
 static struct commands_base *cmdbase;
+static struct event *cache_warmev;
 
 // State
 static bool cache_is_initialized;
 static bool cache_is_suspended;
 
+// Counters, which are also updated by the threads that do lookups
+static struct cache_stats cache_stats[CACHE_TYPE_MAX];
+static pthread_mutex_t cache_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+static const char *cache_type_names[CACHE_TYPE_MAX] = { "daap", "artwork", "xcode" };
+
 #define DB_DEF_ADMIN \
   { \
     "admin", \
@@ -130,12 +202,18 @@ static bool cache_is_suspended;
   }
 
 // DAAP cache
-#define CACHE_DAAP_VERSION 5
+#define CACHE_DAAP_VERSION 7
+// Max number of the most hit replies loaded into memory when warming the cache
+#define CACHE_DAAP_WARM_MAX 20
 static sqlite3 *cache_daap_hdl;
 static struct event *cache_daap_updateev;
 // The user may configure a threshold (in msec), and queries slower than
 // that will have their reply cached
 static int cache_daap_threshold;
+// The most recently used replies are also kept in memory (up to a configured
+// number of bytes), so that they can be served directly by the httpd threads
+// without going through the cache thread and the cache db
+static struct cache_daap_mem cache_daap_mem = { .lck = PTHREAD_MUTEX_INITIALIZER };
 static struct cache_db_def cache_daap_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -143,7 +221,8 @@ static struct cache_db_def cache_daap_db_def[] = {
     "CREATE TABLE IF NOT EXISTS replies ("
     "   id                 INTEGER PRIMARY KEY NOT NULL,"
     "   query              VARCHAR(4096) NOT NULL,"
-    "   reply              BLOB"
+    "   reply              BLOB,"
+    "   raw                BLOB"
     ");",
     "DROP TABLE IF EXISTS replies;",
   },
@@ -155,7 +234,8 @@ static struct cache_db_def cache_daap_db_def[] = {
     "   user_agent         VARCHAR(1024),"
     "   is_remote          INTEGER DEFAULT 0,"
     "   msec               INTEGER DEFAULT 0,"
-    "   timestamp          INTEGER DEFAULT 0"
+    "   timestamp          INTEGER DEFAULT 0,"
+    "   hits               INTEGER DEFAULT 0"
     ");",
     "DROP TABLE IF EXISTS queries;",
   },
@@ -167,7 +247,19 @@ static struct cache_db_def cache_daap_db_def[] = {
 };
 
 // Artwork cache
-#define CACHE_ARTWORK_VERSION 5
+#define CACHE_ARTWORK_VERSION 12
+// Max number of the most hit images read when warming the cache
+#define CACHE_ARTWORK_WARM_MAX 100
+// How long artwork url lists of online items are used (seconds)
+#define CACHE_ARTWORK_URLS_TTL (30 * 24 * 3600)
+// Web api responses are kept this long after they expired, so they can be
+// revalidated with their etag
+#define CACHE_WEBAPI_TTL (7 * 24 * 3600)
+// Max number of web api responses, the oldest are removed first
+#define CACHE_WEBAPI_MAX 2000
+// How long to trust that a source found no artwork for a group, unless a file
+// in its directory changes before that
+#define CACHE_ARTWORK_MISSES_TTL (7 * 24 * 3600)
 static sqlite3 *cache_artwork_hdl;
 static struct cache_artwork_stash cache_stash;
 static struct cache_db_def cache_artwork_db_def[] = {
@@ -175,21 +267,54 @@ static struct cache_db_def cache_artwork_db_def[] = {
   {
     "artwork",
     "CREATE TABLE IF NOT EXISTS artwork ("
-    "   id                  INTEGER PRIMARY KEY NOT NULL,"
+    "   id                  INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,"
     "   type                INTEGER NOT NULL DEFAULT 0,"
     "   persistentid        INTEGER NOT NULL,"
     "   max_w               INTEGER NOT NULL,"
     "   max_h               INTEGER NOT NULL,"
+    "   req_format          INTEGER NOT NULL DEFAULT 0,"
     "   format              INTEGER NOT NULL,"
     "   filepath            VARCHAR(4096) NOT NULL,"
     "   db_timestamp        INTEGER DEFAULT 0,"
-    "   data                BLOB"
+    "   hits                INTEGER DEFAULT 0,"
+    "   datalen             INTEGER DEFAULT 0,"
+    "   data                BLOB,"
+    "   data_hash           INTEGER DEFAULT 0,"
+    "   src_hash            INTEGER DEFAULT 0,"
+    "   file_id             INTEGER DEFAULT NULL"
     ");",
     "DROP TABLE IF EXISTS artwork;",
   },
+  // Rows with identical images share one file (file_id is the id of the row
+  // that wrote it, NULL if it is the row's own), so the file is only removed
+  // with the last row that uses it. Ids are not reused (AUTOINCREMENT), so a
+  // new row can't overwrite a file that another row still uses.
+  {
+    "trg_artwork_delete",
+    "CREATE TRIGGER IF NOT EXISTS trg_artwork_delete AFTER DELETE ON artwork"
+    "   WHEN OLD.data IS NULL AND OLD.datalen > 0"
+    "   AND NOT EXISTS (SELECT 1 FROM artwork WHERE id = COALESCE(OLD.file_id, OLD.id) OR file_id = COALESCE(OLD.file_id, OLD.id))"
+    "   BEGIN SELECT artwork_file_remove(COALESCE(OLD.file_id, OLD.id)); END;",
+    "DROP TRIGGER IF EXISTS trg_artwork_delete;",
+  },
+  {
+    "idx_file_id",
+    "CREATE INDEX IF NOT EXISTS idx_file_id ON artwork(file_id);",
+    "DROP INDEX IF EXISTS idx_file_id;",
+  },
+  {
+    "idx_data_hash",
+    "CREATE INDEX IF NOT EXISTS idx_data_hash ON artwork(data_hash);",
+    "DROP INDEX IF EXISTS idx_data_hash;",
+  },
+  {
+    "idx_src_hash",
+    "CREATE INDEX IF NOT EXISTS idx_src_hash ON artwork(src_hash, max_w, max_h, req_format);",
+    "DROP INDEX IF EXISTS idx_src_hash;",
+  },
   {
     "idx_persistentidwh",
-    "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h);",
+    "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h, req_format);",
     "DROP INDEX IF EXISTS idx_persistentidwh;",
   },
   {
@@ -197,17 +322,81 @@ static struct cache_db_def cache_artwork_db_def[] = {
     "CREATE INDEX IF NOT EXISTS idx_pathtime ON artwork(filepath, db_timestamp);",
     "DROP INDEX IF EXISTS idx_pathtime;",
   },
+  {
+    "idx_hits",
+    "CREATE INDEX IF NOT EXISTS idx_hits ON artwork(hits);",
+    "DROP INDEX IF EXISTS idx_hits;",
+  },
+  {
+    "artwork_urls",
+    "CREATE TABLE IF NOT EXISTS artwork_urls ("
+    "   uri                 VARCHAR(4096) PRIMARY KEY NOT NULL,"
+    "   images              TEXT NOT NULL,"
+    "   db_timestamp        INTEGER NOT NULL"
+    ");",
+    "DROP TABLE IF EXISTS artwork_urls;",
+  },
+  {
+    "webapi_responses",
+    "CREATE TABLE IF NOT EXISTS webapi_responses ("
+    "   uri                 VARCHAR(4096) PRIMARY KEY NOT NULL,"
+    "   etag                VARCHAR(1024) DEFAULT NULL,"
+    "   expires             INTEGER NOT NULL,"
+    "   body                BLOB NOT NULL,"
+    "   db_timestamp        INTEGER NOT NULL"
+    ");",
+    "DROP TABLE IF EXISTS webapi_responses;",
+  },
+  {
+    "idx_webapi_timestamp",
+    "CREATE INDEX IF NOT EXISTS idx_webapi_timestamp ON webapi_responses(db_timestamp);",
+    "DROP INDEX IF EXISTS idx_webapi_timestamp;",
+  },
+  {
+    "artwork_misses",
+    "CREATE TABLE IF NOT EXISTS artwork_misses ("
+    "   type                INTEGER NOT NULL,"
+    "   persistentid        INTEGER NOT NULL,"
+    "   sources             INTEGER NOT NULL,"
+    "   dirpath             VARCHAR(4096) NOT NULL,"
+    "   db_timestamp        INTEGER NOT NULL,"
+    "   PRIMARY KEY (type, persistentid)"
+    ");",
+    "DROP TABLE IF EXISTS artwork_misses;",
+  },
+  {
+    "idx_misses_dirpath",
+    "CREATE INDEX IF NOT EXISTS idx_misses_dirpath ON artwork_misses(dirpath, db_timestamp);",
+    "DROP INDEX IF EXISTS idx_misses_dirpath;",
+  },
 };
 
 // Transcoding cache
 #define CACHE_XCODE_VERSION 1
-#define CACHE_XCODE_NTHREADS 4
 #define CACHE_XCODE_FORMAT_MP4 "mp4"
+// Seek indexes from transcode are kept in the data table with this format
+#define CACHE_XCODE_FORMAT_SEEKINDEX "seekindex"
+// Max number of files in the priority lane, see xcode_priority_add()
+#define CACHE_XCODE_PRIORITY_MAX 64
+// Log progress of header generation at most this often (seconds)
+#define CACHE_XCODE_PROGRESS_INTERVAL 60
 static sqlite3 *cache_xcode_hdl;
 static struct event *cache_xcode_updateev;
 static struct event *cache_xcode_prepareev;
-static struct cache_xcode_job cache_xcode_jobs[CACHE_XCODE_NTHREADS];
+static struct cache_xcode_job *cache_xcode_jobs;
+static int cache_xcode_njobs;
 static bool cache_xcode_is_enabled;
+// File ids that should have their header prepared before the rest
+static uint32_t cache_xcode_priority[CACHE_XCODE_PRIORITY_MAX];
+static int cache_xcode_npriority;
+// Progress of the current header generation run
+static struct
+{
+  int total;
+  int done;
+  time_t start;
+  time_t logged;
+} cache_xcode_progress;
 static struct cache_db_def cache_xcode_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -260,6 +449,40 @@ remove_tag(char *in, const char *tag)
 /* ---------------------------------- MAIN ---------------------------------- */
 /*                                Thread: cache                               */
 
+static void
+cache_stats_lookup(enum cache_type type, bool is_hit, struct timespec *start)
+{
+  struct timespec now;
+  uint64_t usec;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_stats_lck));
+
+  if (is_hit)
+    cache_stats[type].hits++;
+  else
+    cache_stats[type].misses++;
+
+  cache_stats[type].lookup_usec += usec;
+  if (usec > cache_stats[type].lookup_max_usec)
+    cache_stats[type].lookup_max_usec = usec;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_stats_lck));
+}
+
+static void
+cache_stats_change(enum cache_type type, int insertions, int evictions)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_stats_lck));
+
+  cache_stats[type].insertions += insertions;
+  cache_stats[type].evictions += evictions;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_stats_lck));
+}
+
 static int
 cache_tables_create(sqlite3 *hdl, int version, struct cache_db_def *db_def, int db_def_size)
 {
@@ -519,6 +742,115 @@ cache_open_one(sqlite3 **hdl, const char *path, const char *name, int want_versi
   return -1;
 }
 
+static int
+cache_artwork_file_path(char *path, size_t len, int64_t id, bool is_tmp)
+{
+  int ret;
+
+  ret = snprintf(path, len, "%s%" PRIi64 "%s", cache_artwork_dir, id, is_tmp ? ".tmp" : "");
+  if (ret < 0 || ret >= len)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Path for artwork cache file %" PRIi64 " is too long\n", id);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* SQL function called by trg_artwork_delete, so that no matter how rows are
+ * deleted from the artwork table, their image file is also removed
+ */
+static void
+cache_artwork_file_remove_sqlfn(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  char path[PATH_MAX];
+  int ret;
+
+  ret = cache_artwork_file_path(path, sizeof(path), sqlite3_value_int64(ppv[0]), false);
+  if (ret < 0)
+    return;
+
+  if (unlink(path) < 0 && errno != ENOENT)
+    DPRINTF(E_LOG, L_CACHE, "Could not remove artwork cache file '%s': %s\n", path, strerror(errno));
+}
+
+/* Creates the artwork file dir and removes files that have no row in the
+ * artwork table, e.g. because the table was recreated or we crashed while
+ * adding an image. If the dir can't be created images are stored as blobs.
+ */
+static int
+cache_artwork_files_init(sqlite3 *hdl, const char *directory)
+{
+  char path[PATH_MAX];
+  sqlite3_stmt *stmt;
+  struct dirent *de;
+  DIR *dir;
+  int64_t id;
+  char *end;
+  int nremoved;
+  int ret;
+
+  ret = sqlite3_create_function(hdl, "artwork_file_remove", 1, SQLITE_UTF8, NULL, cache_artwork_file_remove_sqlfn, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork_file_remove function: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  snprintf(cache_artwork_dir, sizeof(cache_artwork_dir), "%sartwork/", directory);
+  if (mkdir(cache_artwork_dir, 0755) < 0 && errno != EEXIST)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork cache dir '%s', will store artwork in the db: %s\n", cache_artwork_dir, strerror(errno));
+      cache_artwork_dir[0] = '\0';
+      return 0;
+    }
+
+  dir = opendir(cache_artwork_dir);
+  if (!dir)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open artwork cache dir '%s', will store artwork in the db: %s\n", cache_artwork_dir, strerror(errno));
+      cache_artwork_dir[0] = '\0';
+      return 0;
+    }
+
+  ret = sqlite3_prepare_v2(hdl, "SELECT 1 FROM artwork WHERE (id = ?1 OR file_id = ?1) AND data IS NULL LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      closedir(dir);
+      return -1;
+    }
+
+  nremoved = 0;
+  while ((de = readdir(dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      id = strtoll(de->d_name, &end, 10);
+      if (*end == '\0')
+	{
+	  sqlite3_bind_int64(stmt, 1, id);
+	  ret = sqlite3_step(stmt);
+	  sqlite3_reset(stmt);
+	  if (ret == SQLITE_ROW)
+	    continue;
+	}
+
+      snprintf(path, sizeof(path), "%s%s", cache_artwork_dir, de->d_name);
+      if (unlink(path) == 0)
+	nremoved++;
+    }
+
+  sqlite3_finalize(stmt);
+  closedir(dir);
+
+  if (nremoved > 0)
+    DPRINTF(E_INFO, L_CACHE, "Removed %d orphaned artwork cache files\n", nremoved);
+
+  return 0;
+}
+
 static int
 cache_open(void)
 {
@@ -556,6 +888,10 @@ cache_open(void)
   if (ret < 0)
     goto error;
 
+  ret = cache_artwork_files_init(cache_artwork_hdl, directory);
+  if (ret < 0)
+    goto error;
+
   DPRINTF(E_DBG, L_CACHE, "Cache opened\n");
 
   free(daap_db_path);
@@ -572,18 +908,182 @@ cache_open(void)
 }
 
 
-/* Adds the reply (stored in evbuf) to the cache */
+/* Must be called with the lock held */
+static void
+cache_daap_mem_unlink(struct cache_daap_mem_entry *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache_daap_mem.head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache_daap_mem.tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+/* Must be called with the lock held */
+static void
+cache_daap_mem_remove(struct cache_daap_mem_entry *entry)
+{
+  cache_daap_mem_unlink(entry);
+
+  cache_daap_mem.count--;
+  cache_daap_mem.size -= entry->len;
+
+  free(entry->query);
+  free(entry->data);
+  free(entry);
+}
+
+/* Must be called with the lock held */
+static struct cache_daap_mem_entry *
+cache_daap_mem_find(const char *query, bool is_gzip)
+{
+  struct cache_daap_mem_entry *entry;
+
+  for (entry = cache_daap_mem.head; entry; entry = entry->next)
+    {
+      if (entry->is_gzip == is_gzip && strcmp(entry->query, query) == 0)
+	return entry;
+    }
+
+  return NULL;
+}
+
+/* Thread: httpd (any) */
+static int
+cache_daap_mem_get(struct evbuffer *evbuf, const char *query, bool is_gzip)
+{
+  struct cache_daap_mem_entry *entry;
+  int ret;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_mem.lck));
+
+  entry = cache_daap_mem_find(query, is_gzip);
+  if (!entry)
+    {
+      cache_daap_mem.misses++;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+      return -1;
+    }
+
+  cache_daap_mem.hits++;
+
+  // Move to front, since it is now the most recently used
+  cache_daap_mem_unlink(entry);
+  entry->next = cache_daap_mem.head;
+  if (cache_daap_mem.head)
+    cache_daap_mem.head->prev = entry;
+  cache_daap_mem.head = entry;
+  if (!cache_daap_mem.tail)
+    cache_daap_mem.tail = entry;
+
+  ret = evbuffer_add(evbuf, entry->data, entry->len);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
+      return -1;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Cache hit (memory): %s\n", query);
+
+  return 0;
+}
+
+/* Thread: httpd (any) */
+static void
+cache_daap_mem_add(const char *query, bool is_gzip, const uint8_t *data, size_t len)
+{
+  struct cache_daap_mem_entry *entry;
+
+  if (len == 0 || len > cache_daap_mem.max_size)
+    return;
+
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_daap_mem_entry)));
+  CHECK_NULL(L_CACHE, entry->query = strdup(query));
+  entry->is_gzip = is_gzip;
+  CHECK_NULL(L_CACHE, entry->data = malloc(len));
+  memcpy(entry->data, data, len);
+  entry->len = len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_mem.lck));
+
+  // Another thread may have added the same reply in the meantime
+  if (cache_daap_mem_find(query, is_gzip))
+    {
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+      free(entry->query);
+      free(entry->data);
+      free(entry);
+      return;
+    }
+
+  while (cache_daap_mem.tail && cache_daap_mem.size + len > cache_daap_mem.max_size)
+    cache_daap_mem_remove(cache_daap_mem.tail);
+
+  entry->next = cache_daap_mem.head;
+  if (cache_daap_mem.head)
+    cache_daap_mem.head->prev = entry;
+  cache_daap_mem.head = entry;
+  if (!cache_daap_mem.tail)
+    cache_daap_mem.tail = entry;
+
+  cache_daap_mem.count++;
+  cache_daap_mem.size += len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+}
+
+/* Empties the memory tier and logs how well it did since last time */
+static void
+cache_daap_mem_clear(void)
+{
+  uint64_t lookups;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_mem.lck));
+
+  lookups = cache_daap_mem.hits + cache_daap_mem.misses;
+  if (lookups > 0)
+    DPRINTF(E_INFO, L_CACHE, "DAAP memory cache: %d replies using %zu of %zu bytes, %" PRIu64 " of %" PRIu64 " lookups were hits (%.1f%%)\n",
+      cache_daap_mem.count, cache_daap_mem.size, cache_daap_mem.max_size, cache_daap_mem.hits, lookups, 100.0 * cache_daap_mem.hits / lookups);
+
+  while (cache_daap_mem.head)
+    cache_daap_mem_remove(cache_daap_mem.head);
+
+  cache_daap_mem.hits = 0;
+  cache_daap_mem.misses = 0;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+}
+
+/* Adds the reply to the cache, both gzipped (gzbuf) and raw (evbuf), so that
+ * it can be served without compressing to clients that accept gzip, and still
+ * be served to those that don't
+ */
 static int
-cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
+cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf, struct evbuffer *gzbuf)
 {
-#define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
+#define Q_TMPL "INSERT INTO replies (query, reply, raw) VALUES (?, ?, ?);"
   sqlite3_stmt *stmt;
   unsigned char *data;
   size_t datalen;
+  unsigned char *raw;
+  size_t rawlen;
   int ret;
 
-  datalen = evbuffer_get_length(evbuf);
-  data = evbuffer_pullup(evbuf, -1);
+  datalen = evbuffer_get_length(gzbuf);
+  data = evbuffer_pullup(gzbuf, -1);
+
+  rawlen = evbuffer_get_length(evbuf);
+  raw = evbuffer_pullup(evbuf, -1);
 
   ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
@@ -594,6 +1094,7 @@ cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
 
   sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
   sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 3, raw, rawlen, SQLITE_STATIC);
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE)
@@ -612,6 +1113,8 @@ cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
 
   //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
 
+  cache_stats_change(CACHE_TYPE_DAAP, 1, 0);
+
   return 0;
 #undef Q_TMPL
 }
@@ -620,7 +1123,8 @@ cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
 static enum command_state
 cache_daap_query_add(void *arg, int *retval)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ");"
+#define Q_TMPL "INSERT INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ") " \
+               "ON CONFLICT(query) DO UPDATE SET user_agent = excluded.user_agent, is_remote = excluded.is_remote, msec = excluded.msec, timestamp = excluded.timestamp;"
 #define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
   struct cache_arg *cmdarg = arg;
   struct timeval delay = { 60, 0 };
@@ -698,12 +1202,40 @@ cache_daap_query_add(void *arg, int *retval)
 #undef Q_TMPL
 }
 
+/* Counts the hit, so that the cache can be warmed with the most used replies
+ * after a restart
+ */
+static void
+cache_daap_hit_record(sqlite3 *hdl, const char *query)
+{
+#define Q_TMPL "UPDATE queries SET hits = hits + 1 WHERE query = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for recording cache hit: %s\n", sqlite3_errmsg(hdl));
+      return;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error recording cache hit: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+#undef Q_TMPL
+}
+
 // Gets a reply from the cache.
-// cmdarg->evbuf will be filled with the reply (gzipped)
+// cmdarg->evbuf will be filled with the reply (gzipped if cmdarg->is_gzip)
 static enum command_state
 cache_daap_query_get(void *arg, int *retval)
 {
 #define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
+#define Q_TMPL_RAW "SELECT raw FROM replies WHERE query = ?;"
   struct cache_arg *cmdarg = arg;
   sqlite3_stmt *stmt;
   char *query;
@@ -715,7 +1247,7 @@ cache_daap_query_get(void *arg, int *retval)
   remove_tag(query, "revision-number");
 
   // Look in the DB
-  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  ret = sqlite3_prepare_v2(cmdarg->hdl, cmdarg->is_gzip ? Q_TMPL : Q_TMPL_RAW, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(cmdarg->hdl));
@@ -755,6 +1287,8 @@ cache_daap_query_get(void *arg, int *retval)
 
   DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
 
+  cache_daap_hit_record(cmdarg->hdl, query);
+
   free(query);
 
   *retval = 0;
@@ -765,6 +1299,71 @@ cache_daap_query_get(void *arg, int *retval)
   free(query);
   *retval = -1;
   return COMMAND_END;
+#undef Q_TMPL_RAW
+#undef Q_TMPL
+}
+
+// Records a hit from the memory tier, which doesn't go through the cache db
+static enum command_state
+cache_daap_hit_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+
+  cache_daap_hit_record(cmdarg->hdl, cmdarg->query);
+
+  free(cmdarg->query);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Loads the replies that were hit the most into the memory tier. Only the
+ * gzipped replies, since that is what clients normally ask for.
+ */
+static int
+cache_daap_warm(sqlite3 *hdl)
+{
+#define Q_TMPL "SELECT r.query, r.reply FROM replies r JOIN queries q ON r.query = q.query WHERE q.hits > 0 AND r.reply IS NOT NULL ORDER BY q.hits DESC LIMIT %d;"
+  sqlite3_stmt *stmt;
+  char query[256];
+  size_t size;
+  size_t len;
+  int count;
+  int ret;
+
+  if (cache_daap_mem.max_size == 0)
+    return 0;
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL, CACHE_DAAP_WARM_MAX);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for warming DAAP cache: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  size = 0;
+  count = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      len = sqlite3_column_bytes(stmt, 1);
+
+      // Stop before a less used reply would evict one that is used more
+      if (size + len > cache_daap_mem.max_size)
+	break;
+
+      cache_daap_mem_add((char *)sqlite3_column_text(stmt, 0), true, sqlite3_column_blob(stmt, 1), len);
+      size += len;
+      count++;
+    }
+
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error stepping query for warming DAAP cache: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+
+  return count;
 #undef Q_TMPL
 }
 
@@ -815,6 +1414,8 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
   DPRINTF(E_INFO, L_CACHE, "Beginning DAAP cache update\n");
 
+  cache_daap_mem_clear();
+
   ret = sqlite3_exec(hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
@@ -823,6 +1424,8 @@ cache_daap_update_cb(int fd, short what, void *arg)
       return;
     }
 
+  cache_stats_change(CACHE_TYPE_DAAP, 0, sqlite3_changes(hdl));
+
   ret = sqlite3_prepare_v2(hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
@@ -855,11 +1458,10 @@ cache_daap_update_cb(int fd, short what, void *arg)
 	  continue;
 	}
 
-      evbuffer_free(evbuf);
-
-      cache_daap_reply_add(hdl, query, gzbuf);
+      cache_daap_reply_add(hdl, query, evbuf, gzbuf);
 
       free(query);
+      evbuffer_free(evbuf);
       evbuffer_free(gzbuf);
     }
 
@@ -869,6 +1471,9 @@ cache_daap_update_cb(int fd, short what, void *arg)
   sqlite3_finalize(stmt);
 
   DPRINTF(E_INFO, L_CACHE, "DAAP cache updated\n");
+
+  // Memory tier was cleared, so get the most used replies back in
+  cache_daap_warm(hdl);
 }
 
 
@@ -889,6 +1494,52 @@ xcode_job_clear(struct cache_xcode_job *job)
   job->is_encoding = false;
 }
 
+/* Adds a file to the priority lane, which xcode_file_next() picks from before
+ * going through the rest of the files. Recently requested files go first, while
+ * the files of the queue are added last in queue order.
+ */
+static void
+xcode_priority_add(uint32_t id, bool first)
+{
+  int i;
+
+  for (i = 0; i < cache_xcode_npriority; i++)
+    {
+      if (cache_xcode_priority[i] == id)
+	break;
+    }
+
+  // Not in the lane and no room at the end
+  if (i == cache_xcode_npriority && i == CACHE_XCODE_PRIORITY_MAX && !first)
+    return;
+
+  if (i < cache_xcode_npriority)
+    {
+      if (!first)
+	return; // Already in the lane
+
+      // Remove so it can be moved to the front
+      memmove(&cache_xcode_priority[i], &cache_xcode_priority[i + 1], (cache_xcode_npriority - i - 1) * sizeof(uint32_t));
+      cache_xcode_npriority--;
+    }
+
+  if (!first)
+    {
+      cache_xcode_priority[cache_xcode_npriority++] = id;
+      return;
+    }
+
+  if (cache_xcode_npriority == CACHE_XCODE_PRIORITY_MAX)
+    cache_xcode_npriority--; // Drops the last one
+
+  memmove(&cache_xcode_priority[1], &cache_xcode_priority[0], cache_xcode_npriority * sizeof(uint32_t));
+  cache_xcode_priority[0] = id;
+  cache_xcode_npriority++;
+
+  if (cache_xcode_is_enabled)
+    event_active(cache_xcode_prepareev, 0, 0);
+}
+
 static enum command_state
 xcode_header_get(void *arg, int *retval)
 {
@@ -908,7 +1559,11 @@ xcode_header_get(void *arg, int *retval)
 
   ret = sqlite3_step(stmt);
   if (ret == SQLITE_DONE)
-    goto end;
+    {
+      // Requested but not ready, so prepare it before the rest
+      xcode_priority_add(cmdarg->id, true);
+      goto end;
+    }
   else if (ret != SQLITE_ROW)
     goto error;
 
@@ -1013,6 +1668,8 @@ xcode_del_entry(sqlite3 *hdl, uint32_t id)
       return -1;
     }
 
+  cache_stats_change(CACHE_TYPE_XCODE, 0, sqlite3_changes(hdl));
+
   return 0;
 #undef Q_TMPL_DATA
 #undef Q_TMPL_FILES
@@ -1151,18 +1808,114 @@ xcode_header_save(sqlite3 *hdl, int file_id, const char *format, uint8_t *data,
     }
 
   sqlite3_finalize(stmt);
+
+  // Empty headers are only placeholders, see xcode_file_next()
+  if (datalen > 0)
+    cache_stats_change(CACHE_TYPE_XCODE, 1, 0);
+
   return 0;
 #undef Q_TMPL
 }
 
+static enum command_state
+xcode_seekindex_get(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT header FROM data WHERE length(header) > 0 AND file_id = ? AND format = ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt = NULL;
+  int ret;
+
+  cmdarg->cached = 0;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    goto error;
+
+  sqlite3_bind_int(stmt, 1, cmdarg->id);
+  sqlite3_bind_text(stmt, 2, CACHE_XCODE_FORMAT_SEEKINDEX, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_DONE)
+    goto end;
+  else if (ret != SQLITE_ROW)
+    goto error;
+
+  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+  if (ret < 0)
+    goto error;
+
+  cmdarg->cached = 1;
+
+ end:
+  sqlite3_finalize(stmt);
+  *retval = 0;
+  return COMMAND_END;
+
+ error:
+  DPRINTF(E_LOG, L_CACHE, "Database error getting seek index from cache: %s\n", sqlite3_errmsg(cmdarg->hdl));
+  if (stmt)
+    sqlite3_finalize(stmt);
+  *retval = -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+xcode_seekindex_add(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+  uint8_t *data;
+  size_t datalen;
+
+  datalen = evbuffer_get_length(cmdarg->evbuf);
+  data = evbuffer_pullup(cmdarg->evbuf, -1);
+
+  *retval = xcode_header_save(cmdarg->hdl, cmdarg->id, CACHE_XCODE_FORMAT_SEEKINDEX, data, datalen);
+
+  evbuffer_free(cmdarg->evbuf);
+  return COMMAND_END;
+}
+
 static int
 xcode_file_next(int *file_id, char **file_path, sqlite3 *hdl, const char *format)
 {
 #define Q_TMPL "SELECT f.id, f.filepath, d.id FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL LIMIT 1;"
+#define Q_TMPL_ID "SELECT f.id, f.filepath, d.id FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL AND f.id = %u;"
   sqlite3_stmt *stmt;
   char query[256];
   int ret;
 
+  // Files in the priority lane first, unless they have been done already
+  while (cache_xcode_npriority > 0)
+    {
+      sqlite3_snprintf(sizeof(query), query, Q_TMPL_ID, format, cache_xcode_priority[0]);
+
+      cache_xcode_npriority--;
+      memmove(&cache_xcode_priority[0], &cache_xcode_priority[1], cache_xcode_npriority * sizeof(uint32_t));
+
+      ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error occured while finding next file to prepare header for\n");
+	  return -1;
+	}
+
+      ret = sqlite3_step(stmt);
+      if (ret == SQLITE_ROW)
+	{
+	  *file_id = sqlite3_column_int(stmt, 0);
+	  *file_path = strdup((char *)sqlite3_column_text(stmt, 1));
+
+	  sqlite3_finalize(stmt);
+
+	  DPRINTF(E_DBG, L_CACHE, "Preparing header for file id %d ahead of the rest\n", *file_id);
+
+	  return xcode_header_save(hdl, *file_id, format, NULL, 0);
+	}
+
+      sqlite3_finalize(stmt);
+    }
+
   sqlite3_snprintf(sizeof(query), query, Q_TMPL, format);
 
   ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
@@ -1186,16 +1939,72 @@ xcode_file_next(int *file_id, char **file_path, sqlite3 *hdl, const char *format
 
   // Save an empty header so next call to this function will return a new file
   return xcode_header_save(hdl, *file_id, format, NULL, 0);
+#undef Q_TMPL_ID
+#undef Q_TMPL
+}
+
+static int
+xcode_file_remaining(sqlite3 *hdl, const char *format)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM files f LEFT JOIN data d ON f.id = d.file_id AND d.format = '%q' WHERE d.id IS NULL;"
+  sqlite3_stmt *stmt;
+  char query[256];
+  int count;
+  int ret;
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL, format);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    return -1;
+
+  ret = sqlite3_step(stmt);
+  count = (ret == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+
+  sqlite3_finalize(stmt);
+  return count;
 #undef Q_TMPL
 }
 
+static void
+xcode_progress_log(bool force)
+{
+  time_t now;
+  double elapsed;
+  int eta;
+
+  now = time(NULL);
+  if (!force && now - cache_xcode_progress.logged < CACHE_XCODE_PROGRESS_INTERVAL)
+    return;
+
+  cache_xcode_progress.logged = now;
+  elapsed = difftime(now, cache_xcode_progress.start);
+
+  if (cache_xcode_progress.done == 0 || cache_xcode_progress.total <= 0 || elapsed <= 0)
+    return;
+
+  eta = (cache_xcode_progress.total - cache_xcode_progress.done) * elapsed / cache_xcode_progress.done;
+
+  DPRINTF(E_LOG, L_CACHE, "Header generation: %d of %d files done (%.1f files/sec), ETA %d min\n",
+    cache_xcode_progress.done, cache_xcode_progress.total, cache_xcode_progress.done / elapsed, (eta + 59) / 60);
+}
+
 // Thread: worker
 static void
 xcode_worker(void *arg)
 {
   struct cache_xcode_job *job = *(struct cache_xcode_job **)arg;
+  static __thread unsigned int throttle_ms;
+  bool io_idle;
   int ret;
 
+  // The worker threads are shared, so only for the job
+  io_idle = cfg_getbool(cfg_getsec(cfg, "library"), "scan_io_idle");
+  if (io_idle)
+    thread_io_idle_set(true);
+
+  player_pressure_throttle(&throttle_ms);
+
   DPRINTF(E_DBG, L_CACHE, "Preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
 
   if (strcmp(job->format, CACHE_XCODE_FORMAT_MP4) == 0)
@@ -1205,6 +2014,9 @@ xcode_worker(void *arg)
 	DPRINTF(E_LOG, L_CACHE, "Error preparing %s header for '%s' (file id %d)\n", job->format, job->file_path, job->file_id);
     }
 
+  if (io_idle)
+    thread_io_idle_set(false);
+
   // Tell the cache thread that we are done. Only the cache thread can save the
   // result to the DB.
   event_active(job->ev, 0, 0);
@@ -1229,6 +2041,9 @@ cache_xcode_job_complete_cb(int fd, short what, void *arg)
       xcode_header_save(cache_xcode_hdl, job->file_id, job->format, data, datalen);
     }
 
+  cache_xcode_progress.done++;
+  xcode_progress_log(false);
+
   xcode_job_clear(job); // Makes the job available again
   event_active(cache_xcode_prepareev, 0, 0);
 }
@@ -1247,7 +2062,7 @@ cache_xcode_prepare_cb(int fd, short what, void *arg)
   if (!cache_is_initialized)
     return;
 
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
+  for (i = 0; i < cache_xcode_njobs; i++)
     {
       if (cache_xcode_jobs[i].is_encoding)
 	is_encoding = true;
@@ -1258,16 +2073,27 @@ cache_xcode_prepare_cb(int fd, short what, void *arg)
   if (!job)
     return; // No available thread right now, wait for cache_xcode_job_complete_cb()
 
+  if (!is_encoding)
+    {
+      cache_xcode_progress.total = xcode_file_remaining(cache_xcode_hdl, CACHE_XCODE_FORMAT_MP4);
+      cache_xcode_progress.done = 0;
+      cache_xcode_progress.start = time(NULL);
+      cache_xcode_progress.logged = cache_xcode_progress.start;
+    }
+
   ret = xcode_file_next(&job->file_id, &job->file_path, cache_xcode_hdl, CACHE_XCODE_FORMAT_MP4);
   if (ret < 0)
     {
-      if (!is_encoding)
-	DPRINTF(E_LOG, L_CACHE, "Header generation completed\n");
+      if (!is_encoding && cache_xcode_progress.done > 0)
+	{
+	  xcode_progress_log(true);
+	  DPRINTF(E_LOG, L_CACHE, "Header generation completed\n");
+	}
 
       return;
     }
   else if (!is_encoding)
-    DPRINTF(E_LOG, L_CACHE, "Kicking off header generation\n");
+    DPRINTF(E_LOG, L_CACHE, "Kicking off header generation for %d files using %d threads\n", cache_xcode_progress.total, cache_xcode_njobs);
 
   job->is_encoding = true;
   job->format = CACHE_XCODE_FORMAT_MP4;
@@ -1312,11 +2138,55 @@ cache_daap_listener_cb(short event_mask, void *ctx)
   commands_exec_async(cmdbase, cache_database_update, NULL);
 }
 
+/* Puts the files of the queue in the priority lane, so their headers are ready
+ * when they are played
+ */
+static enum command_state
+cache_queue_update(void *arg, int *retval)
+{
+  struct query_params qp;
+  struct db_queue_item qi;
+  char filter[32];
+  int n;
+  int ret;
+
+  *retval = 0;
+
+  if (!cache_xcode_is_enabled)
+    return COMMAND_END;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  snprintf(filter, sizeof(filter), "f.data_kind = %d", DATA_KIND_FILE);
+  qp.filter = filter;
+
+  ret = db_queue_enum_start(&qp);
+  if (ret < 0)
+    return COMMAND_END;
+
+  for (n = 0; n < CACHE_XCODE_PRIORITY_MAX && (ret = db_queue_enum_fetch(&qp, &qi)) == 0 && qi.id > 0; n++)
+    xcode_priority_add(qi.file_id, false);
+
+  db_queue_enum_end(&qp);
+
+  if (cache_xcode_npriority > 0)
+    event_active(cache_xcode_prepareev, 0, 0);
+
+  return COMMAND_END;
+}
+
+/* Callback from player thread */
+static void
+cache_xcode_listener_cb(short event_mask, void *ctx)
+{
+  commands_exec_async(cmdbase, cache_queue_update, NULL);
+}
+
 
 /*
  * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
  * after the cached timestamp. All cache entries for the given path are deleted, if the file was
- * modified after the cached timestamp.
+ * modified after the cached timestamp. Also forgets the artwork misses for the directory of the file,
+ * if the file was modified after they were recorded.
  *
  * @param cmdarg->pathcopy the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
  * @param cmdarg->mtime modified timestamp of the artwork file
@@ -1327,9 +2197,11 @@ cache_artwork_ping_impl(void *arg, int *retval)
 {
 #define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
 #define Q_TMPL_DEL "DELETE FROM artwork WHERE filepath = '%q' AND db_timestamp < %" PRIi64 ";"
+#define Q_TMPL_MISSES "DELETE FROM artwork_misses WHERE dirpath = '%.*q' AND db_timestamp < %" PRIi64 ";"
   struct cache_arg *cmdarg = arg;
   char *query;
   char *errmsg;
+  char *ptr;
   int ret;
 
   query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)time(NULL), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
@@ -1351,6 +2223,24 @@ cache_artwork_ping_impl(void *arg, int *retval)
 
       DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
 
+      ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+	  goto error_ping;
+	}
+
+      cache_stats_change(CACHE_TYPE_ARTWORK, 0, sqlite3_changes(cmdarg->hdl));
+    }
+
+  // Spotify uris etc. have no directory
+  ptr = strrchr(cmdarg->pathcopy, '/');
+  if (ptr && ptr != cmdarg->pathcopy)
+    {
+      query = sqlite3_mprintf(Q_TMPL_MISSES, (int)(ptr - cmdarg->pathcopy), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
+
       ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
       sqlite3_free(query);
       if (ret != SQLITE_OK)
@@ -1373,10 +2263,50 @@ cache_artwork_ping_impl(void *arg, int *retval)
   *retval = -1;
   return COMMAND_END;
   
+#undef Q_TMPL_MISSES
 #undef Q_TMPL_PING
 #undef Q_TMPL_DEL
 }
 
+/*
+ * Updates cached timestamps to current time for all cache entries for files
+ * directly in the given directory, regardless of file modification times. Used
+ * by the bulk scan for directories where nothing has changed.
+ *
+ * @param cmdarg->pathcopy the full path to the directory
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_ping_bydir_impl(void *arg, int *retval)
+{
+#define Q_TMPL "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath LIKE '%q/%%' AND filepath NOT LIKE '%q/%%/%%';"
+  struct cache_arg *cmdarg = arg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), cmdarg->pathcopy, cmdarg->pathcopy);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->pathcopy);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+
+#undef Q_TMPL
+}
+
 /*
  * Removes all cache entries for the given path
  *
@@ -1409,6 +2339,8 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Deleted %d rows\n", sqlite3_changes(cmdarg->hdl));
 
+  cache_stats_change(CACHE_TYPE_ARTWORK, 0, sqlite3_changes(cmdarg->hdl));
+
   *retval = 0;
   return COMMAND_END;
 
@@ -1425,6 +2357,9 @@ static enum command_state
 cache_artwork_purge_cruft_impl(void *arg, int *retval)
 {
 #define Q_TMPL "DELETE FROM artwork WHERE db_timestamp < %" PRIi64 ";"
+#define Q_TMPL_URLS "DELETE FROM artwork_urls WHERE db_timestamp < %" PRIi64 ";" \
+                    "DELETE FROM artwork_misses WHERE db_timestamp < %" PRIi64 ";" \
+                    "DELETE FROM webapi_responses WHERE expires < %" PRIi64 ";"
 
   struct cache_arg *cmdarg = arg;
   char *query;
@@ -1448,45 +2383,207 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Purged %d rows\n", sqlite3_changes(cmdarg->hdl));
 
+  cache_stats_change(CACHE_TYPE_ARTWORK, 0, sqlite3_changes(cmdarg->hdl));
+
+  query = sqlite3_mprintf(Q_TMPL_URLS, (int64_t)time(NULL) - CACHE_ARTWORK_URLS_TTL, (int64_t)time(NULL) - CACHE_ARTWORK_MISSES_TTL, (int64_t)time(NULL) - CACHE_WEBAPI_TTL);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
   *retval = 0;
   return COMMAND_END;
 
+#undef Q_TMPL_URLS
 #undef Q_TMPL
 }
 
-/*
- * Adds the given (scaled) artwork image to the artwork cache
- *
- * @param cmdarg->persistentid persistent songalbumid or songartistid
- * @param cmdarg->max_w maximum image width
- * @param cmdarg->max_h maximum image height
- * @param cmdarg->format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
- * @param cmdarg->filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
- * @param cmdarg->evbuf event buffer containing the (scaled) image
- * @return 0 if successful, -1 if an error occurred
+/* Writes to a temp file first and then renames, so a file that is being read
+ * (mapped) while the id gets reused will not change under the reader
  */
-static enum command_state
-cache_artwork_add_impl(void *arg, int *retval)
+static int
+cache_artwork_file_write(int64_t id, uint8_t *data, int datalen)
 {
-  struct cache_arg *cmdarg = arg;
-  sqlite3_stmt *stmt;
-  char *query;
-  uint8_t *data;
-  int datalen;
+  char tmp_path[PATH_MAX];
+  char path[PATH_MAX];
+  ssize_t written;
+  int fd;
   int ret;
 
-  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
+  if (cache_artwork_file_path(tmp_path, sizeof(tmp_path), id, true) < 0 || cache_artwork_file_path(path, sizeof(path), id, false) < 0)
+    return -1;
 
-  ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork cache file '%s': %s\n", tmp_path, strerror(errno));
+      return -1;
     }
 
-  datalen = evbuffer_get_length(cmdarg->evbuf);
-  data = evbuffer_pullup(cmdarg->evbuf, -1);
+  for (written = 0; written < datalen; written += ret)
+    {
+      ret = write(fd, data + written, datalen - written);
+      if (ret < 0 && errno == EINTR)
+	ret = 0;
+      else if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error writing artwork cache file '%s': %s\n", tmp_path, strerror(errno));
+	  goto error;
+	}
+    }
+
+  close(fd);
+
+  if (rename(tmp_path, path) < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not rename artwork cache file '%s': %s\n", tmp_path, strerror(errno));
+      unlink(tmp_path);
+      return -1;
+    }
+
+  return 0;
+
+ error:
+  close(fd);
+  unlink(tmp_path);
+  return -1;
+}
+
+/* Attaches the file to the evbuffer without reading it into memory (libevent
+ * maps it). We disable sendfile, since the caller is free to pullup or copy the
+ * evbuffer, which is not possible with a sendfile segment.
+ */
+static int
+cache_artwork_file_read(struct evbuffer *evbuf, int64_t id, int datalen)
+{
+  struct evbuffer_file_segment *seg;
+  char path[PATH_MAX];
+  int fd;
+  int ret;
+
+  ret = cache_artwork_file_path(path, sizeof(path), id, false);
+  if (ret < 0)
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open artwork cache file '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  seg = evbuffer_file_segment_new(fd, 0, datalen, EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_SENDFILE);
+  if (!seg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not map artwork cache file '%s'\n", path);
+      close(fd);
+      return -1;
+    }
+
+  // The evbuffer takes a reference, so the segment lives until it is drained
+  ret = evbuffer_add_file_segment(evbuf, seg, 0, datalen);
+  evbuffer_file_segment_free(seg);
+
+  return ret;
+}
+
+static int
+cache_artwork_file_warm(int64_t id)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  if (cache_artwork_file_path(path, sizeof(path), id, false) < 0)
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+  return 0;
+}
+
+// Returns the id of the file of an identical image, or 0 if there is none
+static int64_t
+cache_artwork_file_find(sqlite3 *hdl, uint64_t data_hash, int datalen)
+{
+  sqlite3_stmt *stmt;
+  int64_t file_id;
+  int ret;
+
+  ret = sqlite3_prepare_v2(hdl, "SELECT COALESCE(file_id, id) FROM artwork WHERE data_hash = ? AND datalen = ? AND data IS NULL LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return 0;
+    }
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)data_hash);
+  sqlite3_bind_int(stmt, 2, datalen);
+
+  file_id = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : 0;
+
+  sqlite3_finalize(stmt);
+
+  if (file_id > 0)
+    DPRINTF(E_DBG, L_CACHE, "Artwork is identical to cached file %" PRIi64 ", will share it\n", file_id);
+
+  return file_id;
+}
+
+/*
+ * Adds the given (scaled) artwork image to the artwork cache
+ *
+ * @param cmdarg->persistentid persistent songalbumid or songartistid
+ * @param cmdarg->max_w maximum image width
+ * @param cmdarg->max_h maximum image height
+ * @param cmdarg->format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
+ * @param cmdarg->filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
+ * @param cmdarg->src_hash hash of the source image (see cache_artwork_get_bysrc) or 0
+ * @param cmdarg->evbuf event buffer containing the (scaled) image
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_add_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  char *query;
+  uint8_t *data;
+  int datalen;
+  uint64_t data_hash;
+  int64_t file_id;
+  bool as_file;
+  int64_t id;
+  int ret;
+
+  datalen = evbuffer_get_length(cmdarg->evbuf);
+  data = evbuffer_pullup(cmdarg->evbuf, -1);
+  as_file = (cache_artwork_dir[0] != '\0' && datalen > 0);
+
+  // E.g. all the tracks of an album with the same embedded cover, or an album
+  // and its tracks, give identical images, which only need one file
+  data_hash = (datalen > 0) ? murmur_hash64(data, datalen, 0) : 0;
+  file_id = as_file ? cache_artwork_file_find(cmdarg->hdl, data_hash, datalen) : 0;
+
+  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type, datalen, req_format, data_hash, src_hash, file_id) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
 
   sqlite3_bind_int64(stmt, 1, cmdarg->persistentid);
   sqlite3_bind_int(stmt, 2, cmdarg->max_w);
@@ -1494,8 +2591,19 @@ cache_artwork_add_impl(void *arg, int *retval)
   sqlite3_bind_int(stmt, 4, cmdarg->format);
   sqlite3_bind_text(stmt, 5, cmdarg->path, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 6, (uint64_t)time(NULL));
-  sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
+  if (as_file)
+    sqlite3_bind_null(stmt, 7);
+  else
+    sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 8, cmdarg->type);
+  sqlite3_bind_int(stmt, 9, datalen);
+  sqlite3_bind_int(stmt, 10, cmdarg->req_format);
+  sqlite3_bind_int64(stmt, 11, (int64_t)data_hash);
+  sqlite3_bind_int64(stmt, 12, (int64_t)cmdarg->src_hash);
+  if (file_id > 0)
+    sqlite3_bind_int64(stmt, 13, file_id);
+  else
+    sqlite3_bind_null(stmt, 13);
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE)
@@ -1514,6 +2622,23 @@ cache_artwork_add_impl(void *arg, int *retval)
       return COMMAND_END;
     }
 
+  if (as_file && file_id <= 0)
+    {
+      id = sqlite3_last_insert_rowid(cmdarg->hdl);
+      ret = cache_artwork_file_write(id, data, datalen);
+      if (ret < 0)
+	{
+	  query = sqlite3_mprintf("DELETE FROM artwork WHERE id = %" PRIi64 ";", id);
+	  if (query)
+	    sqlite3_exec(cmdarg->hdl, query, NULL, NULL, NULL);
+	  sqlite3_free(query);
+	  *retval = -1;
+	  return COMMAND_END;
+	}
+    }
+
+  cache_stats_change(CACHE_TYPE_ARTWORK, 1, 0);
+
   *retval = 0;
   return COMMAND_END;
 }
@@ -1536,14 +2661,15 @@ cache_artwork_add_impl(void *arg, int *retval)
 static enum command_state
 cache_artwork_get_impl(void *arg, int *retval)
 {
-#define Q_TMPL "SELECT a.format, a.data FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
+#define Q_TMPL "SELECT a.format, a.data, COALESCE(a.file_id, a.id), a.datalen FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d AND a.req_format = %d;"
+#define Q_TMPL_HIT "UPDATE artwork SET hits = hits + 1 WHERE type = %d AND persistentid = %" PRIi64 " AND max_w = %d AND max_h = %d AND req_format = %d;"
   struct cache_arg *cmdarg = arg;
   sqlite3_stmt *stmt;
   char *query;
   int datalen;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h, cmdarg->req_format);
   if (!query)
     {
       DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
@@ -1589,10 +2715,13 @@ cache_artwork_get_impl(void *arg, int *retval)
       goto error_get;
     }
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 1), datalen);
+  if (sqlite3_column_type(stmt, 1) == SQLITE_NULL && sqlite3_column_int(stmt, 3) > 0)
+    ret = cache_artwork_file_read(cmdarg->evbuf, sqlite3_column_int64(stmt, 2), sqlite3_column_int(stmt, 3));
+  else
+    ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 1), datalen);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork evbuffer\n");
+      DPRINTF(E_LOG, L_CACHE, "Could not add cached artwork to evbuffer\n");
       ret = -1;
       goto error_get;
     }
@@ -1607,6 +2736,16 @@ cache_artwork_get_impl(void *arg, int *retval)
 
   sqlite3_free(query);
 
+  query = sqlite3_mprintf(Q_TMPL_HIT, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h, cmdarg->req_format);
+  if (query)
+    {
+      ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, NULL);
+      if (ret != SQLITE_OK)
+	DPRINTF(E_LOG, L_CACHE, "Error recording artwork cache hit: %s\n", sqlite3_errmsg(cmdarg->hdl));
+
+      sqlite3_free(query);
+    }
+
   *retval = 0;
   return COMMAND_END;
 
@@ -1616,9 +2755,138 @@ cache_artwork_get_impl(void *arg, int *retval)
 
   *retval = ret;
   return COMMAND_END;
+#undef Q_TMPL_HIT
+#undef Q_TMPL
+}
+
+/*
+ * Like cache_artwork_get_impl(), but looks for any entry made from the same
+ * source image (e.g. another track with the same embedded artwork)
+ *
+ * @param cmdarg->src_hash hash of the source image
+ * @param cmdarg->max_w maximum image width
+ * @param cmdarg->max_h maximum image height
+ * @param cmdarg->req_format requested format or 0 for the source format
+ * @param cmdarg->cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @param cmdarg->format set by this function to the format of the cache entry
+ * @param cmdarg->evbuf event buffer filled by this function with the scaled image
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_get_bysrc_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  cmdarg->cached = 0;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, "SELECT format, data, COALESCE(file_id, id), datalen FROM artwork WHERE src_hash = ? AND max_w = ? AND max_h = ? AND req_format = ? AND format > 0 LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)cmdarg->src_hash);
+  sqlite3_bind_int(stmt, 2, cmdarg->max_w);
+  sqlite3_bind_int(stmt, 3, cmdarg->max_h);
+  sqlite3_bind_int(stmt, 4, cmdarg->req_format);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      sqlite3_finalize(stmt);
+      *retval = (ret == SQLITE_DONE) ? 0 : -1;
+      return COMMAND_END;
+    }
+
+  cmdarg->format = sqlite3_column_int(stmt, 0);
+
+  if (sqlite3_column_type(stmt, 1) == SQLITE_NULL && sqlite3_column_int(stmt, 3) > 0)
+    ret = cache_artwork_file_read(cmdarg->evbuf, sqlite3_column_int64(stmt, 2), sqlite3_column_int(stmt, 3));
+  else
+    ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
+
+  sqlite3_finalize(stmt);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not add cached artwork to evbuffer\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  cmdarg->cached = 1;
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* There is no memory tier for artwork, but reading the most used images gets
+ * them into sqlite's page cache and the OS file cache. Images stored as files
+ * are just announced to the kernel.
+ */
+static int
+cache_artwork_warm(sqlite3 *hdl)
+{
+#define Q_TMPL "SELECT data, COALESCE(file_id, id), datalen FROM artwork WHERE hits > 0 ORDER BY hits DESC LIMIT %d;"
+  sqlite3_stmt *stmt;
+  char query[128];
+  int count;
+  int ret;
+
+  sqlite3_snprintf(sizeof(query), query, Q_TMPL, CACHE_ARTWORK_WARM_MAX);
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for warming artwork cache: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  count = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      if (sqlite3_column_blob(stmt, 0))
+	count++;
+      else if (sqlite3_column_int(stmt, 2) > 0 && cache_artwork_file_warm(sqlite3_column_int64(stmt, 1)) == 0)
+	count++;
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error stepping query for warming artwork cache: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+
+  return count;
 #undef Q_TMPL
 }
 
+/* Runs once after the cache is opened, at low priority, so the first clients
+ * after a restart don't pay the full cost of what was hot before
+ */
+static void
+cache_warm_cb(int fd, short what, void *arg)
+{
+  struct timespec start;
+  struct timespec end;
+  int ndaap;
+  int nartwork;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ndaap = cache_daap_warm(cache_daap_hdl);
+  nartwork = cache_artwork_warm(cache_artwork_hdl);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  DPRINTF(E_LOG, L_CACHE, "Cache warmed with %d DAAP replies and %d artwork images in %ld ms\n",
+    ndaap > 0 ? ndaap : 0, nartwork > 0 ? nartwork : 0,
+    (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+}
+
 static enum command_state
 cache_artwork_stash_impl(void *arg, int *retval)
 {
@@ -1664,201 +2932,1098 @@ cache_artwork_stash_impl(void *arg, int *retval)
 }
 
 static enum command_state
-cache_artwork_read_impl(void *arg, int *retval)
+cache_artwork_urls_add_impl(void *arg, int *retval)
 {
+#define Q_TMPL "INSERT OR REPLACE INTO artwork_urls (uri, images, db_timestamp) VALUES (?, ?, ?);"
   struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  int64_t now;
+  int ret;
+  int i;
 
-  cmdarg->format = 0;
+  *retval = -1;
 
-  if (!cache_stash.path || !cache_stash.data || (strcmp(cache_stash.path, cmdarg->path) != 0))
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
     {
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for artwork urls: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      goto out;
     }
 
-  cmdarg->format = cache_stash.format;
+  now = (int64_t)time(NULL);
 
-  DPRINTF(E_DBG, L_CACHE, "Stash hit (format %d, size %zu): %s\n", cache_stash.format, cache_stash.size, cache_stash.path);
+  sqlite3_exec(cmdarg->hdl, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  for (i = 0; i < cmdarg->count; i++)
+    {
+      sqlite3_bind_text(stmt, 1, cmdarg->uris[i], -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, cmdarg->images[i], -1, SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 3, now);
+
+      ret = sqlite3_step(stmt);
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_CACHE, "Error adding artwork urls for '%s': %s\n", cmdarg->uris[i], sqlite3_errmsg(cmdarg->hdl));
+
+      sqlite3_reset(stmt);
+    }
+  sqlite3_exec(cmdarg->hdl, "COMMIT TRANSACTION;", NULL, NULL, NULL);
+
+  sqlite3_finalize(stmt);
+
+  DPRINTF(E_DBG, L_CACHE, "Added artwork urls for %d items\n", cmdarg->count);
+
+  *retval = 0;
+
+ out:
+  for (i = 0; i < cmdarg->count; i++)
+    {
+      free(cmdarg->uris[i]);
+      free(cmdarg->images[i]);
+    }
+  free(cmdarg->uris);
+  free(cmdarg->images);
 
-  *retval = evbuffer_add(cmdarg->evbuf, cache_stash.data, cache_stash.size);
   return COMMAND_END;
+#undef Q_TMPL
 }
 
-static void *
-cache(void *arg)
+static enum command_state
+cache_artwork_urls_get_impl(void *arg, int *retval)
 {
+#define Q_TMPL "SELECT images FROM artwork_urls WHERE uri = ? AND db_timestamp >= ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
   int ret;
-  int i;
 
-  ret = cache_open();
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error: Cache create failed. Cache will be disabled.\n");
-      pthread_exit(NULL);
-    }
+  cmdarg->pathcopy = NULL;
 
-  // The thread needs a connection with the main db, so it can generate DAAP
-  // replies through httpd_daap.c and read changes from the files table
-  ret = db_perthread_init();
-  if (ret < 0)
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error: DB init failed. Cache will be disabled.\n");
-      cache_close();
-
-      pthread_exit(NULL);
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for artwork urls: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      *retval = -1;
+      return COMMAND_END;
     }
 
-  CHECK_NULL(L_CACHE, cache_daap_updateev = evtimer_new(evbase_cache, cache_daap_update_cb, NULL));
-  CHECK_NULL(L_CACHE, cache_xcode_updateev = evtimer_new(evbase_cache, cache_xcode_update_cb, NULL));
-  CHECK_NULL(L_CACHE, cache_xcode_prepareev = evtimer_new(evbase_cache, cache_xcode_prepare_cb, NULL));
-  CHECK_ERR(L_CACHE, event_priority_set(cache_xcode_prepareev, 0));
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
-    CHECK_NULL(L_CACHE, cache_xcode_jobs[i].ev = evtimer_new(evbase_cache, cache_xcode_job_complete_cb, &cache_xcode_jobs[i]));
+  sqlite3_bind_text(stmt, 1, cmdarg->path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)time(NULL) - CACHE_ARTWORK_URLS_TTL);
 
-  CHECK_ERR(L_CACHE, listener_add(cache_daap_listener_cb, LISTENER_DATABASE, NULL));
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    cmdarg->pathcopy = safe_strdup((const char *)sqlite3_column_text(stmt, 0));
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error getting artwork urls: %s\n", sqlite3_errmsg(cmdarg->hdl));
 
-  cache_is_initialized = 1;
+  sqlite3_finalize(stmt);
 
-  event_base_dispatch(evbase_cache);
+  *retval = cmdarg->pathcopy ? 0 : -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
 
-  if (cache_is_initialized)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Cache event loop terminated ahead of time!\n");
+static enum command_state
+cache_artwork_miss_add_impl(void *arg, int *retval)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO artwork_misses (type, persistentid, sources, dirpath, db_timestamp) VALUES (%d, %" PRIi64 ", %d, '%q', %" PRIi64 ");"
+  struct cache_arg *cmdarg = arg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->sources, cmdarg->pathcopy, (int64_t)time(NULL));
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->pathcopy);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_artwork_miss_get_impl(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT sources FROM artwork_misses WHERE type = ? AND persistentid = ? AND db_timestamp >= ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  cmdarg->sources = 0;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for artwork misses: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  sqlite3_bind_int(stmt, 1, cmdarg->type);
+  sqlite3_bind_int64(stmt, 2, cmdarg->persistentid);
+  sqlite3_bind_int64(stmt, 3, (int64_t)time(NULL) - CACHE_ARTWORK_MISSES_TTL);
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    cmdarg->sources = sqlite3_column_int(stmt, 0);
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error getting artwork misses: %s\n", sqlite3_errmsg(cmdarg->hdl));
+
+  sqlite3_finalize(stmt);
+
+  *retval = (ret == SQLITE_ROW || ret == SQLITE_DONE) ? 0 : -1;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_artwork_misses_delete_bydir_impl(void *arg, int *retval)
+{
+#define Q_TMPL "DELETE FROM artwork_misses WHERE dirpath = '%q';"
+  struct cache_arg *cmdarg = arg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->pathcopy);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->pathcopy);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_webapi_add_impl(void *arg, int *retval)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO webapi_responses (uri, etag, expires, body, db_timestamp) VALUES (?, ?, ?, ?, ?);"
+#define Q_TMPL_TRIM "DELETE FROM webapi_responses WHERE uri IN (SELECT uri FROM webapi_responses ORDER BY db_timestamp DESC LIMIT -1 OFFSET %d);"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  *retval = -1;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for web api response: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      goto out;
+    }
+
+  sqlite3_bind_text(stmt, 1, cmdarg->pathcopy, -1, SQLITE_STATIC);
+  if (cmdarg->etag)
+    sqlite3_bind_text(stmt, 2, cmdarg->etag, -1, SQLITE_STATIC);
+  else
+    sqlite3_bind_null(stmt, 2);
+  sqlite3_bind_int64(stmt, 3, (int64_t)cmdarg->expires);
+  sqlite3_bind_blob(stmt, 4, evbuffer_pullup(cmdarg->evbuf, -1), evbuffer_get_length(cmdarg->evbuf), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 5, (int64_t)time(NULL));
+
+  ret = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error adding web api response for '%s': %s\n", cmdarg->pathcopy, sqlite3_errmsg(cmdarg->hdl));
+      goto out;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL_TRIM, CACHE_WEBAPI_MAX);
+  sqlite3_exec(cmdarg->hdl, query, NULL, NULL, NULL);
+  sqlite3_free(query);
+
+  DPRINTF(E_SPAM, L_CACHE, "Added web api response for '%s' (etag %s)\n", cmdarg->pathcopy, cmdarg->etag ? cmdarg->etag : "none");
+
+  *retval = 0;
+
+ out:
+  free(cmdarg->pathcopy);
+  free(cmdarg->etag);
+  evbuffer_free(cmdarg->evbuf);
+
+  return COMMAND_END;
+#undef Q_TMPL_TRIM
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_webapi_get_impl(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT body, etag, expires FROM webapi_responses WHERE uri = ?;"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  cmdarg->etag = NULL;
+  cmdarg->expires = 0;
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for web api response: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  sqlite3_bind_text(stmt, 1, cmdarg->path, -1, SQLITE_STATIC);
+
+  *retval = -1;
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    {
+      ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+      if (ret == 0)
+	{
+	  cmdarg->etag = safe_strdup((const char *)sqlite3_column_text(stmt, 1));
+	  cmdarg->expires = (time_t)sqlite3_column_int64(stmt, 2);
+	  *retval = 0;
+	}
+    }
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Error getting web api response: %s\n", sqlite3_errmsg(cmdarg->hdl));
+
+  sqlite3_finalize(stmt);
+
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_artwork_read_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+
+  cmdarg->format = 0;
+
+  if (!cache_stash.path || !cache_stash.data || (strcmp(cache_stash.path, cmdarg->path) != 0))
+    {
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  cmdarg->format = cache_stash.format;
+
+  DPRINTF(E_DBG, L_CACHE, "Stash hit (format %d, size %zu): %s\n", cache_stash.format, cache_stash.size, cache_stash.path);
+
+  *retval = evbuffer_add(cmdarg->evbuf, cache_stash.data, cache_stash.size);
+  return COMMAND_END;
+}
+
+/* ---------------------------------- Stats --------------------------------- */
+
+static int
+cache_stats_size_get(int64_t *entries, int64_t *bytes, sqlite3 *hdl, const char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache size: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache size: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  *entries = sqlite3_column_int64(stmt, 0);
+  *bytes = sqlite3_column_int64(stmt, 1);
+
+  sqlite3_finalize(stmt);
+  return 0;
+}
+
+static void
+cache_stats_fill(struct cache_stats *stats, enum cache_type type)
+{
+  static const char *size_queries[CACHE_TYPE_MAX] =
+    {
+      "SELECT COUNT(*), COALESCE(SUM(COALESCE(LENGTH(reply), 0) + COALESCE(LENGTH(raw), 0)), 0) FROM replies;",
+      "SELECT COUNT(*), COALESCE(SUM(datalen), 0) FROM artwork;",
+      "SELECT COUNT(*), COALESCE(SUM(LENGTH(header)), 0) FROM data WHERE LENGTH(header) > 0;",
+    };
+  sqlite3 *hdls[CACHE_TYPE_MAX] = { cache_daap_hdl, cache_artwork_hdl, cache_xcode_hdl };
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_stats_lck));
+  *stats = cache_stats[type];
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_stats_lck));
+
+  cache_stats_size_get(&stats->entries, &stats->bytes, hdls[type], size_queries[type]);
+
+  if (type == CACHE_TYPE_DAAP)
+    {
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_mem.lck));
+      stats->mem_entries = cache_daap_mem.count;
+      stats->mem_bytes = cache_daap_mem.size;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_mem.lck));
+    }
+}
+
+static enum command_state
+cache_stats_get_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+
+  cache_stats_fill(cmdarg->stats, cmdarg->type);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+static enum command_state
+cache_stats_log_impl(void *arg, int *retval)
+{
+  struct cache_stats stats;
+  uint64_t lookups;
+  int i;
+
+  for (i = 0; i < CACHE_TYPE_MAX; i++)
+    {
+      memset(&stats, 0, sizeof(struct cache_stats));
+      cache_stats_fill(&stats, i);
+
+      lookups = stats.hits + stats.misses;
+
+      DPRINTF(E_LOG, L_CACHE, "Cache '%s': %" PRIi64 " entries, %" PRIi64 " bytes, %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hits), "
+	"%" PRIu64 " insertions, %" PRIu64 " evictions, avg lookup %" PRIu64 " usec, max %" PRIu64 " usec\n",
+	cache_type_names[i], stats.entries, stats.bytes, stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+	stats.insertions, stats.evictions, lookups ? stats.lookup_usec / lookups : 0, stats.lookup_max_usec);
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+
+static void *
+cache(void *arg)
+{
+  int ret;
+  int i;
+
+  mem_tag_set(MEM_TAG_CACHE);
+
+  ret = cache_open();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error: Cache create failed. Cache will be disabled.\n");
+      pthread_exit(NULL);
+    }
+
+  // The thread needs a connection with the main db, so it can generate DAAP
+  // replies through httpd_daap.c and read changes from the files table
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error: DB init failed. Cache will be disabled.\n");
+      cache_close();
+
+      pthread_exit(NULL);
+    }
+
+  CHECK_NULL(L_CACHE, cache_daap_updateev = evtimer_new(evbase_cache, cache_daap_update_cb, NULL));
+  CHECK_NULL(L_CACHE, cache_xcode_updateev = evtimer_new(evbase_cache, cache_xcode_update_cb, NULL));
+  CHECK_NULL(L_CACHE, cache_xcode_prepareev = evtimer_new(evbase_cache, cache_xcode_prepare_cb, NULL));
+  CHECK_ERR(L_CACHE, event_priority_set(cache_xcode_prepareev, 0));
+  CHECK_NULL(L_CACHE, cache_warmev = evtimer_new(evbase_cache, cache_warm_cb, NULL));
+  CHECK_ERR(L_CACHE, event_priority_set(cache_warmev, 7));
+  for (i = 0; i < cache_xcode_njobs; i++)
+    CHECK_NULL(L_CACHE, cache_xcode_jobs[i].ev = evtimer_new(evbase_cache, cache_xcode_job_complete_cb, &cache_xcode_jobs[i]));
+
+  CHECK_ERR(L_CACHE, listener_add(cache_daap_listener_cb, LISTENER_DATABASE, NULL));
+  CHECK_ERR(L_CACHE, listener_add(cache_xcode_listener_cb, LISTENER_QUEUE, NULL));
+
+  cache_is_initialized = 1;
+
+  event_active(cache_warmev, 0, 0);
+
+  event_base_dispatch(evbase_cache);
+
+  if (cache_is_initialized)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Cache event loop terminated ahead of time!\n");
       cache_is_initialized = 0;
     }
 
-  listener_remove(cache_daap_listener_cb);
+  listener_remove(cache_xcode_listener_cb);
+  listener_remove(cache_daap_listener_cb);
+
+  for (i = 0; i < cache_xcode_njobs; i++)
+    event_free(cache_xcode_jobs[i].ev);
+  event_free(cache_warmev);
+  event_free(cache_xcode_prepareev);
+  event_free(cache_xcode_updateev);
+  event_free(cache_daap_updateev);
+
+  db_perthread_deinit();
+
+  cache_close();
+
+  pthread_exit(NULL);
+}
+
+
+/* ----------------------------- DAAP cache API  ---------------------------- */
+
+/* The DAAP cache will cache raw daap replies for queries added with
+ * cache_daap_add(). Only some query types are supported.
+ * You can't add queries where the canonical reply is not HTTP_OK, because
+ * daap_request will use that as default for cache replies.
+ *
+ */
+
+void
+cache_daap_suspend(void)
+{
+  cache_is_suspended = 1;
+}
+
+void
+cache_daap_resume(void)
+{
+  cache_is_suspended = 0;
+}
+
+int
+cache_daap_get(struct evbuffer *evbuf, const char *query, bool is_gzip)
+{
+  struct cache_arg cmdarg;
+  struct cache_arg *hitarg;
+  struct timespec start;
+  char *key;
+  size_t offset;
+  size_t len;
+  int ret;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (cache_daap_mem.max_size == 0)
+    {
+      cmdarg.hdl = cache_daap_hdl;
+      cmdarg.query = strdup(query);
+      cmdarg.is_gzip = is_gzip;
+      cmdarg.evbuf = evbuf;
+
+      ret = commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+      cache_stats_lookup(CACHE_TYPE_DAAP, (ret == 0), &start);
+      return ret;
+    }
+
+  CHECK_NULL(L_CACHE, key = strdup(query));
+  remove_tag(key, "session-id");
+  remove_tag(key, "revision-number");
+
+  ret = cache_daap_mem_get(evbuf, key, is_gzip);
+  if (ret == 0)
+    {
+      cache_stats_lookup(CACHE_TYPE_DAAP, true, &start);
+
+      hitarg = calloc(1, sizeof(struct cache_arg));
+      if (hitarg)
+	{
+	  hitarg->hdl = cache_daap_hdl;
+	  hitarg->query = key;
+	  commands_exec_async(cmdbase, cache_daap_hit_impl, hitarg);
+	}
+      else
+	free(key);
+
+      return 0;
+    }
+
+  offset = evbuffer_get_length(evbuf);
+
+  cmdarg.hdl = cache_daap_hdl;
+  cmdarg.query = strdup(key);
+  cmdarg.is_gzip = is_gzip;
+  cmdarg.evbuf = evbuf;
+
+  ret = commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  if (ret == 0)
+    {
+      len = evbuffer_get_length(evbuf) - offset;
+      cache_daap_mem_add(key, is_gzip, evbuffer_pullup(evbuf, -1) + offset, len);
+    }
+
+  cache_stats_lookup(CACHE_TYPE_DAAP, (ret == 0), &start);
+
+  free(key);
+  return ret;
+}
+
+void
+cache_daap_add(const char *query, const char *ua, int is_remote, int msec)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_daap_hdl;
+  cmdarg->query = strdup(query);
+  cmdarg->ua = strdup(ua);
+  cmdarg->is_remote = is_remote;
+  cmdarg->msec = msec;
+
+  commands_exec_async(cmdbase, cache_daap_query_add, cmdarg);
+}
+
+int
+cache_daap_threshold_get(void)
+{
+  return cache_daap_threshold;
+}
+
+
+/* --------------------------- Transcode cache API  ------------------------- */
+
+int
+cache_xcode_header_get(struct evbuffer *evbuf, int *cached, uint32_t id, const char *format)
+{
+  struct cache_arg cmdarg;
+  struct timespec start;
+  int ret;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cmdarg.hdl = cache_xcode_hdl;
+  cmdarg.evbuf = evbuf;
+  cmdarg.id = id;
+  cmdarg.header_format = format;
+
+  ret = commands_exec_sync(cmdbase, xcode_header_get, NULL, &cmdarg);
+
+  *cached = cmdarg.cached;
+
+  cache_stats_lookup(CACHE_TYPE_XCODE, (ret == 0 && cmdarg.cached), &start);
+
+  return ret;
+}
+
+int
+cache_xcode_seekindex_get(struct evbuffer *evbuf, int *cached, uint32_t id)
+{
+  struct cache_arg cmdarg;
+  int ret;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  cmdarg.hdl = cache_xcode_hdl;
+  cmdarg.evbuf = evbuf;
+  cmdarg.id = id;
+
+  ret = commands_exec_sync(cmdbase, xcode_seekindex_get, NULL, &cmdarg);
+
+  *cached = cmdarg.cached;
+
+  return ret;
+}
+
+void
+cache_xcode_seekindex_add(uint32_t id, struct evbuffer *evbuf)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_xcode_hdl;
+  cmdarg->id = id;
+  cmdarg->evbuf = evbuffer_new();
+  if (!cmdarg->evbuf || evbuffer_add_buffer(cmdarg->evbuf, evbuf) < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not copy seek index for cache\n");
+      if (cmdarg->evbuf)
+	evbuffer_free(cmdarg->evbuf);
+      free(cmdarg);
+      return;
+    }
+
+  commands_exec_async(cmdbase, xcode_seekindex_add, cmdarg);
+}
+
+int
+cache_xcode_toggle(bool enable)
+{
+  if (!cache_is_initialized)
+    return -1;
+
+  return commands_exec_sync(cmdbase, xcode_toggle, NULL, &enable);
+}
+
+
+/* ---------------------------- Artwork cache API  -------------------------- */
+
+/*
+ * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
+ * after the cached timestamp.
+ *
+ * If the parameter "del" is greater than 0, all cache entries for the given path are deleted, if the file was
+ * modified after the cached timestamp.
+ *
+ * @param path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
+ * @param mtime modified timestamp of the artwork file
+ * @param del if > 0 cached entries for the given path are deleted if the cached timestamp (db_timestamp) is older than mtime
+ * @return 0 if successful, -1 if an error occurred
+ */
+void
+cache_artwork_ping(const char *path, time_t mtime, int del)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->pathcopy = strdup(path);
+  cmdarg->mtime = mtime;
+  cmdarg->del = del;
+
+  commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
+}
+
+void
+cache_artwork_ping_bydir(const char *path)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->pathcopy = strdup(path);
+
+  commands_exec_async(cmdbase, cache_artwork_ping_bydir_impl, cmdarg);
+}
 
-  for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
-    event_free(cache_xcode_jobs[i].ev);
-  event_free(cache_xcode_prepareev);
-  event_free(cache_xcode_updateev);
-  event_free(cache_daap_updateev);
+/*
+ * Removes all cache entries for the given path
+ *
+ * @param path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_delete_by_path(const char *path)
+{
+  struct cache_arg cmdarg;
 
-  db_perthread_deinit();
+  if (!cache_is_initialized)
+    return -1;
 
-  cache_close();
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.path = path;
 
-  pthread_exit(NULL);
+  return commands_exec_sync(cmdbase, cache_artwork_delete_by_path_impl, NULL, &cmdarg);
 }
 
+/*
+ * Removes all cache entries with cached timestamp older than the given reference timestamp
+ *
+ * @param ref reference timestamp
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_purge_cruft(time_t ref)
+{
+  struct cache_arg cmdarg;
+
+  if (!cache_is_initialized)
+    return -1;
 
-/* ----------------------------- DAAP cache API  ---------------------------- */
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.mtime = ref;
 
-/* The DAAP cache will cache raw daap replies for queries added with
- * cache_daap_add(). Only some query types are supported.
- * You can't add queries where the canonical reply is not HTTP_OK, because
- * daap_request will use that as default for cache replies.
+  return commands_exec_sync(cmdbase, cache_artwork_purge_cruft_impl, NULL, &cmdarg);
+}
+
+/*
+ * Adds the given (scaled) artwork image to the artwork cache
  *
+ * @param type individual or group artwork
+ * @param persistentid persistent itemid, songalbumid or songartistid
+ * @param max_w maximum image width
+ * @param max_h maximum image height
+ * @param req_format requested format (ART_FMT_*) or 0 if the source format was requested
+ * @param format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
+ * @param filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
+ * @param src_hash hash of the source image (see cache_artwork_get_bysrc) or 0
+ * @param evbuf event buffer containing the (scaled) image
+ * @return 0 if successful, -1 if an error occurred
  */
+int
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int req_format, int format, char *filename, uint64_t src_hash, struct evbuffer *evbuf)
+{
+  struct cache_arg cmdarg;
 
-void
-cache_daap_suspend(void)
+  if (!cache_is_initialized)
+    return -1;
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
+  cmdarg.max_w = max_w;
+  cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
+  cmdarg.format = format;
+  cmdarg.path = filename;
+  cmdarg.src_hash = src_hash;
+  cmdarg.evbuf = evbuf;
+
+  return commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
+}
+
+/*
+ * Get the cached artwork image for the given persistentid and maximum width/height
+ *
+ * If there is a cached entry for the given id and width/height, the parameter cached is set to 1.
+ * In this case format and data contain the cached values.
+ *
+ * @param persistentid persistent songalbumid or songartistid
+ * @param max_w maximum image width
+ * @param max_h maximum image height
+ * @param req_format requested format (ART_FMT_*) or 0 for the source format
+ * @param cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @param format set by this function to the format of the cache entry
+ * @param evbuf event buffer filled by this function with the scaled image
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf)
 {
-  cache_is_suspended = 1;
+  struct cache_arg cmdarg;
+  struct timespec start;
+  int ret;
+
+  if (!cache_is_initialized)
+    {
+      *cached = 0;
+      *format = 0;
+      return 0;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
+  cmdarg.max_w = max_w;
+  cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
+  cmdarg.evbuf = evbuf;
+
+  ret = commands_exec_sync(cmdbase, cache_artwork_get_impl, NULL, &cmdarg);
+
+  *format = cmdarg.format;
+  *cached = cmdarg.cached;
+
+  cache_stats_lookup(CACHE_TYPE_ARTWORK, (ret == 0 && cmdarg.cached), &start);
+
+  return ret;
 }
 
-void
-cache_daap_resume(void)
+/*
+ * Get cached artwork that was made from the given source image, whatever item
+ * or group it was made for
+ *
+ * @param src_hash hash of the source image, e.g. of embedded artwork
+ * @param max_w maximum image width
+ * @param max_h maximum image height
+ * @param req_format requested format (ART_FMT_*) or 0 for the source format
+ * @param cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @param format set by this function to the format of the cache entry
+ * @param evbuf event buffer filled by this function with the scaled image
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_get_bysrc(uint64_t src_hash, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf)
 {
-  cache_is_suspended = 0;
+  struct cache_arg cmdarg;
+  struct timespec start;
+  int ret;
+
+  *cached = 0;
+  *format = 0;
+
+  if (!cache_is_initialized || src_hash == 0)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.src_hash = src_hash;
+  cmdarg.max_w = max_w;
+  cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
+  cmdarg.format = 0;
+  cmdarg.evbuf = evbuf;
+
+  ret = commands_exec_sync(cmdbase, cache_artwork_get_bysrc_impl, NULL, &cmdarg);
+
+  *format = cmdarg.format;
+  *cached = cmdarg.cached;
+
+  cache_stats_lookup(CACHE_TYPE_ARTWORK, (ret == 0 && cmdarg.cached), &start);
+
+  return ret;
 }
 
+/*
+ * Put an artwork image in the in-memory stash (the previous will be deleted)
+ *
+ * @param evbuf event buffer with the cached image to cache
+ * @param path the source (url) of the image to stash
+ * @param format the format of the image
+ * @return 0 if successful, -1 if an error occurred
+ */
 int
-cache_daap_get(struct evbuffer *evbuf, const char *query)
+cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format)
 {
   struct cache_arg cmdarg;
 
   if (!cache_is_initialized)
     return -1;
 
-  cmdarg.hdl = cache_daap_hdl;
-  cmdarg.query = strdup(query);
   cmdarg.evbuf = evbuf;
+  cmdarg.path = path;
+  cmdarg.format = format;
+
+  return commands_exec_sync(cmdbase, cache_artwork_stash_impl, NULL, &cmdarg);
+}
+
+/*
+ * Read the cached artwork image in the in-memory stash into evbuffer
+ *
+ * @param evbuf event buffer filled by this function with the cached image
+ * @param path this function will check that the path matches the cached image's path
+ * @param format set by this function to the format of the image
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
+{
+  struct cache_arg cmdarg;
+  int ret;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  cmdarg.evbuf = evbuf;
+  cmdarg.path = path;
+
+  ret = commands_exec_sync(cmdbase, cache_artwork_read_impl, NULL, &cmdarg);
+
+  *format = cmdarg.format;
 
-  return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  return ret;
 }
 
+
+/*
+ * Adds lists of artwork urls for online items, e.g. Spotify tracks. The format
+ * of the list is up to the caller. Takes ownership of the arrays and strings,
+ * which must be allocated with malloc.
+ *
+ * @param uris array of item uris
+ * @param images array with the artwork url list for each uri
+ * @param count number of items in the arrays
+ */
 void
-cache_daap_add(const char *query, const char *ua, int is_remote, int msec)
+cache_artwork_urls_add(char **uris, char **images, int count)
 {
   struct cache_arg *cmdarg;
+  int i;
 
   if (!cache_is_initialized)
-    return;
+    goto error;
 
   cmdarg = calloc(1, sizeof(struct cache_arg));
   if (!cmdarg)
     {
       DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
-      return;
+      goto error;
     }
 
-  cmdarg->hdl = cache_daap_hdl;
-  cmdarg->query = strdup(query);
-  cmdarg->ua = strdup(ua);
-  cmdarg->is_remote = is_remote;
-  cmdarg->msec = msec;
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->uris = uris;
+  cmdarg->images = images;
+  cmdarg->count = count;
 
-  commands_exec_async(cmdbase, cache_daap_query_add, cmdarg);
-}
+  commands_exec_async(cmdbase, cache_artwork_urls_add_impl, cmdarg);
+  return;
 
-int
-cache_daap_threshold_get(void)
-{
-  return cache_daap_threshold;
+ error:
+  for (i = 0; i < count; i++)
+    {
+      free(uris[i]);
+      free(images[i]);
+    }
+  free(uris);
+  free(images);
 }
 
-
-/* --------------------------- Transcode cache API  ------------------------- */
-
+/*
+ * Gets the artwork url list of an online item, if it was added less than
+ * CACHE_ARTWORK_URLS_TTL ago
+ *
+ * @param images set by this function to the list, must be freed by caller
+ * @param uri the item uri
+ * @return 0 if found, -1 if not found or an error occurred
+ */
 int
-cache_xcode_header_get(struct evbuffer *evbuf, int *cached, uint32_t id, const char *format)
+cache_artwork_urls_get(char **images, const char *uri)
 {
   struct cache_arg cmdarg;
   int ret;
 
+  *images = NULL;
+
   if (!cache_is_initialized)
     return -1;
 
-  cmdarg.hdl = cache_xcode_hdl;
-  cmdarg.evbuf = evbuf;
-  cmdarg.id = id;
-  cmdarg.header_format = format;
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.path = uri;
 
-  ret = commands_exec_sync(cmdbase, xcode_header_get, NULL, &cmdarg);
+  ret = commands_exec_sync(cmdbase, cache_artwork_urls_get_impl, NULL, &cmdarg);
+  if (ret < 0)
+    return -1;
 
-  *cached = cmdarg.cached;
+  *images = cmdarg.pathcopy;
+  return 0;
+}
 
-  return ret;
+/*
+ * Remembers which artwork sources found nothing for a group or item, so that
+ * they are not searched again for a while. The entry is forgotten when a file
+ * in the directory changes (see cache_artwork_ping()), or after
+ * CACHE_ARTWORK_MISSES_TTL.
+ *
+ * @param type individual or group artwork
+ * @param persistentid persistent itemid, songalbumid or songartistid
+ * @param sources bitmask of the sources that found nothing, replaces any
+ *        previous value
+ * @param dirpath directory of the group's files, or NULL if not local
+ */
+void
+cache_artwork_miss_add(int type, int64_t persistentid, int sources, const char *dirpath)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->type = type;
+  cmdarg->persistentid = persistentid;
+  cmdarg->sources = sources;
+  cmdarg->pathcopy = safe_strdup(dirpath ? dirpath : "");
+
+  commands_exec_async(cmdbase, cache_artwork_miss_add_impl, cmdarg);
 }
 
+/*
+ * @param sources set by this function to the bitmask given to
+ *        cache_artwork_miss_add(), 0 if none or expired
+ * @return 0 if successful, -1 if an error occurred
+ */
 int
-cache_xcode_toggle(bool enable)
+cache_artwork_miss_get(int type, int64_t persistentid, int *sources)
 {
+  struct cache_arg cmdarg;
+  int ret;
+
+  *sources = 0;
+
   if (!cache_is_initialized)
     return -1;
 
-  return commands_exec_sync(cmdbase, xcode_toggle, NULL, &enable);
-}
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
 
+  ret = commands_exec_sync(cmdbase, cache_artwork_miss_get_impl, NULL, &cmdarg);
+  if (ret < 0)
+    return -1;
 
-/* ---------------------------- Artwork cache API  -------------------------- */
+  *sources = cmdarg.sources;
+  return 0;
+}
 
 /*
- * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
- * after the cached timestamp.
- *
- * If the parameter "del" is greater than 0, all cache entries for the given path are deleted, if the file was
- * modified after the cached timestamp.
- *
- * @param path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
- * @param mtime modified timestamp of the artwork file
- * @param del if > 0 cached entries for the given path are deleted if the cached timestamp (db_timestamp) is older than mtime
- * @return 0 if successful, -1 if an error occurred
+ * Forgets the artwork misses for files in the given directory, used when the
+ * directory has changed, since that may mean an artwork file was added
  */
 void
-cache_artwork_ping(const char *path, time_t mtime, int del)
+cache_artwork_misses_delete_bydir(const char *path)
 {
   struct cache_arg *cmdarg;
 
@@ -1874,179 +4039,340 @@ cache_artwork_ping(const char *path, time_t mtime, int del)
 
   cmdarg->hdl = cache_artwork_hdl;
   cmdarg->pathcopy = strdup(path);
-  cmdarg->mtime = mtime;
-  cmdarg->del = del;
 
-  commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
+  commands_exec_async(cmdbase, cache_artwork_misses_delete_bydir_impl, cmdarg);
 }
 
 /*
- * Removes all cache entries for the given path
+ * Saves a response from a web api, e.g. Spotify's, so that it can be reused
+ * until it expires, and revalidated with its etag after that. The body is
+ * copied, so the caller keeps ownership of evbuf.
  *
- * @param path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
- * @return 0 if successful, -1 if an error occurred
+ * @param uri the request uri
+ * @param etag the ETag of the response, may be NULL
+ * @param expires when the response is no longer fresh (unix time)
+ * @param evbuf the response body
  */
-int
-cache_artwork_delete_by_path(const char *path)
+void
+cache_webapi_add(const char *uri, const char *etag, time_t expires, struct evbuffer *evbuf)
 {
-  struct cache_arg cmdarg;
+  struct cache_arg *cmdarg;
 
   if (!cache_is_initialized)
-    return -1;
+    return;
 
-  cmdarg.hdl = cache_artwork_hdl;
-  cmdarg.path = path;
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
 
-  return commands_exec_sync(cmdbase, cache_artwork_delete_by_path_impl, NULL, &cmdarg);
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->pathcopy = strdup(uri);
+  cmdarg->etag = etag ? strdup(etag) : NULL;
+  cmdarg->expires = expires;
+  cmdarg->evbuf = evbuffer_new();
+  if (!cmdarg->pathcopy || !cmdarg->evbuf || evbuffer_add(cmdarg->evbuf, evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf)) < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not copy web api response for '%s'\n", uri);
+      free(cmdarg->pathcopy);
+      free(cmdarg->etag);
+      if (cmdarg->evbuf)
+	evbuffer_free(cmdarg->evbuf);
+      free(cmdarg);
+      return;
+    }
+
+  commands_exec_async(cmdbase, cache_webapi_add_impl, cmdarg);
 }
 
 /*
- * Removes all cache entries with cached timestamp older than the given reference timestamp
+ * Gets a web api response saved with cache_webapi_add(), also if it has
+ * expired. It is up to the caller to check the expiry and revalidate.
  *
- * @param ref reference timestamp
- * @return 0 if successful, -1 if an error occurred
+ * @out evbuf the response body is added to this evbuffer
+ * @out etag the saved ETag or NULL, must be freed by caller
+ * @out expires when the response is no longer fresh
+ * @in  uri the request uri
+ * @return 0 if found, -1 if not found or an error occurred
  */
 int
-cache_artwork_purge_cruft(time_t ref)
+cache_webapi_get(struct evbuffer *evbuf, char **etag, time_t *expires, const char *uri)
 {
   struct cache_arg cmdarg;
+  int ret;
+
+  *etag = NULL;
+  *expires = 0;
 
   if (!cache_is_initialized)
     return -1;
 
   cmdarg.hdl = cache_artwork_hdl;
-  cmdarg.mtime = ref;
+  cmdarg.path = uri;
+  cmdarg.evbuf = evbuf;
 
-  return commands_exec_sync(cmdbase, cache_artwork_purge_cruft_impl, NULL, &cmdarg);
+  ret = commands_exec_sync(cmdbase, cache_webapi_get_impl, NULL, &cmdarg);
+  if (ret < 0)
+    return -1;
+
+  *etag = cmdarg.etag;
+  *expires = cmdarg.expires;
+  return 0;
 }
 
-/*
- * Adds the given (scaled) artwork image to the artwork cache
- *
- * @param type individual or group artwork
- * @param persistentid persistent itemid, songalbumid or songartistid
- * @param max_w maximum image width
- * @param max_h maximum image height
- * @param format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
- * @param filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
- * @param evbuf event buffer containing the (scaled) image
- * @return 0 if successful, -1 if an error occurred
- */
-int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf)
+
+/* ---------------------------- Stream cache API  --------------------------- */
+
+static int
+cache_stream_path(char *path, size_t len, const char *key, bool is_tmp)
 {
-  struct cache_arg cmdarg;
+  int ret;
 
-  if (!cache_is_initialized)
-    return -1;
+  ret = snprintf(path, len, "%s%s.%s", cache_stream_dir, key, is_tmp ? "tmp" : "stream");
+  if (ret < 0 || ret >= len)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Path for stream cache key '%s' is too long\n", key);
+      return -1;
+    }
 
-  cmdarg.hdl = cache_artwork_hdl;
-  cmdarg.type = type;
-  cmdarg.persistentid = persistentid;
-  cmdarg.max_w = max_w;
-  cmdarg.max_h = max_h;
-  cmdarg.format = format;
-  cmdarg.path = filename;
-  cmdarg.evbuf = evbuf;
+  return 0;
+}
 
-  return commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
+static int
+stream_file_cmp(const void *a, const void *b)
+{
+  const struct cache_stream_file *fa = a;
+  const struct cache_stream_file *fb = b;
+
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
 }
 
-/*
- * Get the cached artwork image for the given persistentid and maximum width/height
- *
- * If there is a cached entry for the given id and width/height, the parameter cached is set to 1.
- * In this case format and data contain the cached values.
- *
- * @param persistentid persistent songalbumid or songartistid
- * @param max_w maximum image width
- * @param max_h maximum image height
- * @param cached set by this function to 0 if no cache entry exists, otherwise 1
- * @param format set by this function to the format of the cache entry
- * @param evbuf event buffer filled by this function with the scaled image
- * @return 0 if successful, -1 if an error occurred
+/* Removes the least recently used streams until the cache is within the size
+ * budget. With remove_tmp also removes partial streams, which is only safe
+ * when nothing can be writing them.
  */
-int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf)
+static void
+cache_stream_evict(bool remove_tmp)
 {
-  struct cache_arg cmdarg;
+  struct cache_stream_file *files = NULL;
+  struct cache_stream_file *tmp;
+  struct dirent *de;
+  struct stat sb;
+  char path[PATH_MAX];
+  DIR *dir;
+  const char *ext;
+  off_t total;
+  int nfiles;
+  int nalloc;
+  int nevicted;
+  int i;
   int ret;
 
-  if (!cache_is_initialized)
+  // Another thread is already doing it
+  if (pthread_mutex_trylock(&cache_stream_lck) != 0)
+    return;
+
+  dir = opendir(cache_stream_dir);
+  if (!dir)
     {
-      *cached = 0;
-      *format = 0;
-      return 0;
+      DPRINTF(E_LOG, L_CACHE, "Could not open stream cache dir '%s': %s\n", cache_stream_dir, strerror(errno));
+      goto out;
     }
 
-  cmdarg.hdl = cache_artwork_hdl;
-  cmdarg.type = type;
-  cmdarg.persistentid = persistentid;
-  cmdarg.max_w = max_w;
-  cmdarg.max_h = max_h;
-  cmdarg.evbuf = evbuf;
+  total = 0;
+  nfiles = 0;
+  nalloc = 0;
+  while ((de = readdir(dir)))
+    {
+      ext = strrchr(de->d_name, '.');
+      if (!ext)
+	continue;
 
-  ret = commands_exec_sync(cmdbase, cache_artwork_get_impl, NULL, &cmdarg);
+      ret = snprintf(path, sizeof(path), "%s%s", cache_stream_dir, de->d_name);
+      if (ret < 0 || ret >= sizeof(path))
+	continue;
 
-  *format = cmdarg.format;
-  *cached = cmdarg.cached;
+      if (remove_tmp && strcmp(ext, ".tmp") == 0)
+	{
+	  unlink(path);
+	  continue;
+	}
 
-  return ret;
+      if (strcmp(ext, ".stream") != 0 || stat(path, &sb) < 0)
+	continue;
+
+      if (nfiles == nalloc)
+	{
+	  nalloc += 64;
+	  CHECK_NULL(L_CACHE, tmp = realloc(files, nalloc * sizeof(struct cache_stream_file)));
+	  files = tmp;
+	}
+
+      snprintf(files[nfiles].name, sizeof(files[nfiles].name), "%s", de->d_name);
+      files[nfiles].size = sb.st_size;
+      files[nfiles].mtime = sb.st_mtime;
+      total += sb.st_size;
+      nfiles++;
+    }
+
+  closedir(dir);
+
+  if (total <= cache_stream_max_size)
+    goto out;
+
+  qsort(files, nfiles, sizeof(struct cache_stream_file), stream_file_cmp);
+
+  nevicted = 0;
+  for (i = 0; i < nfiles && total > cache_stream_max_size; i++)
+    {
+      snprintf(path, sizeof(path), "%s%s", cache_stream_dir, files[i].name);
+      if (unlink(path) < 0)
+	continue;
+
+      total -= files[i].size;
+      nevicted++;
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Evicted %d streams from stream cache, now using %" PRIi64 " bytes\n", nevicted, (int64_t)total);
+
+ out:
+  free(files);
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_stream_lck));
+}
+
+// Thread: worker
+static void
+cache_stream_evict_cb(void *arg)
+{
+  cache_stream_evict(false);
 }
 
-/*
- * Put an artwork image in the in-memory stash (the previous will be deleted)
- *
- * @param evbuf event buffer with the cached image to cache
- * @param path the source (url) of the image to stash
- * @param format the format of the image
- * @return 0 if successful, -1 if an error occurred
- */
 int
-cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format)
+cache_stream_open(const char *key, off_t *size)
 {
-  struct cache_arg cmdarg;
+  char path[PATH_MAX];
+  struct stat sb;
+  int fd;
 
-  if (!cache_is_initialized)
+  if (cache_stream_max_size == 0)
     return -1;
 
-  cmdarg.evbuf = evbuf;
-  cmdarg.path = path;
-  cmdarg.format = format;
+  if (cache_stream_path(path, sizeof(path), key, false) < 0)
+    return -1;
 
-  return commands_exec_sync(cmdbase, cache_artwork_stash_impl, NULL, &cmdarg);
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  // The modification time is what eviction goes by
+  futimens(fd, NULL);
+
+  DPRINTF(E_DBG, L_CACHE, "Stream cache hit: %s\n", key);
+
+  *size = sb.st_size;
+  return fd;
 }
 
-/*
- * Read the cached artwork image in the in-memory stash into evbuffer
- *
- * @param evbuf event buffer filled by this function with the cached image
- * @param path this function will check that the path matches the cached image's path
- * @param format set by this function to the format of the image
- * @return 0 if successful, -1 if an error occurred
- */
 int
-cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
+cache_stream_create(const char *key, off_t estimated_size)
 {
-  struct cache_arg cmdarg;
-  int ret;
+  char path[PATH_MAX];
+  int fd;
 
-  if (!cache_is_initialized)
+  if (cache_stream_max_size == 0 || estimated_size > cache_stream_max_size)
     return -1;
 
-  cmdarg.evbuf = evbuf;
-  cmdarg.path = path;
+  if (cache_stream_path(path, sizeof(path), key, true) < 0)
+    return -1;
 
-  ret = commands_exec_sync(cmdbase, cache_artwork_read_impl, NULL, &cmdarg);
+  // Fails if another stream is writing it, in which case we let that one do it
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    {
+      if (errno != EEXIST)
+	DPRINTF(E_LOG, L_CACHE, "Could not create '%s' for stream cache: %s\n", path, strerror(errno));
+      return -1;
+    }
 
-  *format = cmdarg.format;
+  return fd;
+}
 
-  return ret;
+void
+cache_stream_close(int fd, const char *key, bool complete)
+{
+  char tmp_path[PATH_MAX];
+  char path[PATH_MAX];
+  int ret;
+
+  close(fd);
+
+  if (cache_stream_path(tmp_path, sizeof(tmp_path), key, true) < 0 || cache_stream_path(path, sizeof(path), key, false) < 0)
+    return;
+
+  if (!complete)
+    {
+      unlink(tmp_path);
+      return;
+    }
+
+  ret = rename(tmp_path, path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not add '%s' to stream cache: %s\n", path, strerror(errno));
+      unlink(tmp_path);
+      return;
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Stream added to cache: %s\n", key);
+
+  worker_execute(cache_stream_evict_cb, NULL, 0, 0);
 }
 
 
 /* --------------------------- Cache general API ---------------------------- */
 
+const char *
+cache_type_name(enum cache_type type)
+{
+  if (type < 0 || type >= CACHE_TYPE_MAX)
+    return NULL;
+
+  return cache_type_names[type];
+}
+
+int
+cache_stats_get(struct cache_stats *stats, enum cache_type type)
+{
+  struct cache_arg cmdarg;
+
+  memset(stats, 0, sizeof(struct cache_stats));
+
+  if (!cache_is_initialized || type < 0 || type >= CACHE_TYPE_MAX)
+    return -1;
+
+  cmdarg.stats = stats;
+  cmdarg.type = type;
+
+  return commands_exec_sync(cmdbase, cache_stats_get_impl, NULL, &cmdarg);
+}
+
+void
+cache_stats_log(void)
+{
+  if (!cache_is_initialized)
+    return;
+
+  commands_exec_async(cmdbase, cache_stats_log_impl, NULL);
+}
+
 int
 cache_init(void)
 {
@@ -2057,6 +4383,32 @@ cache_init(void)
       return 0;
     }
 
+  cache_daap_mem.max_size = (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_memory") * 1024;
+
+  // Leave a worker thread for other tasks, and with the default also a core
+  cache_xcode_njobs = cfg_getint(cfg_getsec(cfg, "general"), "cache_xcode_threads");
+  if (cache_xcode_njobs <= 0)
+    cache_xcode_njobs = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (cache_xcode_njobs > worker_nthreads_get() - 1)
+    cache_xcode_njobs = worker_nthreads_get() - 1;
+  if (cache_xcode_njobs < 1)
+    cache_xcode_njobs = 1;
+
+  CHECK_NULL(L_CACHE, cache_xcode_jobs = calloc(cache_xcode_njobs, sizeof(struct cache_xcode_job)));
+
+  cache_stream_max_size = (off_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_stream_size") * 1024 * 1024;
+  if (cache_stream_max_size > 0)
+    {
+      snprintf(cache_stream_dir, sizeof(cache_stream_dir), "%sstreams/", cfg_getstr(cfg_getsec(cfg, "general"), "cache_dir"));
+      if (mkdir(cache_stream_dir, 0755) < 0 && errno != EEXIST)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not create stream cache dir '%s', disabling stream cache: %s\n", cache_stream_dir, strerror(errno));
+	  cache_stream_max_size = 0;
+	}
+      else
+	cache_stream_evict(true); // Partial streams from last run and size may have been reduced
+    }
+
   CHECK_NULL(L_CACHE, evbase_cache = event_base_new());
   CHECK_ERR(L_CACHE, event_base_priority_init(evbase_cache, 8));
   CHECK_NULL(L_CACHE, cmdbase = commands_base_new(evbase_cache, NULL));
@@ -2089,4 +4441,8 @@ cache_deinit(void)
     }
 
   event_base_free(evbase_cache);
+
+  cache_daap_mem_clear();
+
+  free(cache_xcode_jobs);
 }
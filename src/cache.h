@@ -2,8 +2,35 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <event2/buffer.h>
 
+enum cache_type
+{
+  CACHE_TYPE_DAAP,
+  CACHE_TYPE_ARTWORK,
+  CACHE_TYPE_XCODE,
+  CACHE_TYPE_MAX,
+};
+
+struct cache_stats
+{
+  // Counted since startup
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t lookup_usec; // Total time spent on lookups
+  uint64_t lookup_max_usec;
+
+  // What the cache currently holds
+  int64_t entries;
+  int64_t bytes;
+  int64_t mem_entries; // DAAP only, the in-memory tier
+  int64_t mem_bytes;
+};
+
 /* ----------------------------- DAAP cache API  ---------------------------- */
 
 void
@@ -13,7 +40,7 @@ void
 cache_daap_resume(void);
 
 int
-cache_daap_get(struct evbuffer *evbuf, const char *query);
+cache_daap_get(struct evbuffer *evbuf, const char *query, bool is_gzip);
 
 void
 cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
@@ -27,10 +54,40 @@ cache_daap_threshold_get(void);
 int
 cache_xcode_header_get(struct evbuffer *evbuf, int *cached, uint32_t id, const char *format);
 
+/* Seek indexes made by transcode, see transcode_seek_index_get(). Adding is
+ * async and drains evbuf.
+ */
+int
+cache_xcode_seekindex_get(struct evbuffer *evbuf, int *cached, uint32_t id);
+
+void
+cache_xcode_seekindex_add(uint32_t id, struct evbuffer *evbuf);
+
 int
 cache_xcode_toggle(bool enable);
 
 
+/* ---------------------------- Stream cache API  --------------------------- */
+
+/* Complete transcoded streams are kept on disk, identified by a key that the
+ * caller makes from file id, profile and quality. Returns a fd for reading the
+ * stream from the start, or -1 if not cached.
+ */
+int
+cache_stream_open(const char *key, off_t *size);
+
+/* Returns a fd for writing a new stream, or -1 if the stream shouldn't be
+ * cached, e.g. because another stream is already writing it. Must be closed
+ * with cache_stream_close().
+ */
+int
+cache_stream_create(const char *key, off_t estimated_size);
+
+/* If complete the stream is added to the cache, otherwise it is discarded */
+void
+cache_stream_close(int fd, const char *key, bool complete);
+
+
 /* ---------------------------- Artwork cache API  -------------------------- */
 
 #define CACHE_ARTWORK_GROUP 0
@@ -39,6 +96,9 @@ cache_xcode_toggle(bool enable);
 void
 cache_artwork_ping(const char *path, time_t mtime, int del);
 
+void
+cache_artwork_ping_bydir(const char *path);
+
 int
 cache_artwork_delete_by_path(const char *path);
 
@@ -46,10 +106,13 @@ int
 cache_artwork_purge_cruft(time_t ref);
 
 int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf);
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int req_format, int format, char *filename, uint64_t src_hash, struct evbuffer *evbuf);
 
 int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf);
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf);
+
+int
+cache_artwork_get_bysrc(uint64_t src_hash, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf);
 
 int
 cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
@@ -57,8 +120,44 @@ cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
 int
 cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format);
 
+void
+cache_artwork_urls_add(char **uris, char **images, int count);
+
+int
+cache_artwork_urls_get(char **images, const char *uri);
+
+void
+cache_artwork_miss_add(int type, int64_t persistentid, int sources, const char *dirpath);
+
+int
+cache_artwork_miss_get(int type, int64_t persistentid, int *sources);
+
+void
+cache_artwork_misses_delete_bydir(const char *path);
+
+/* ---------------------------- Web api cache API  -------------------------- */
+
+void
+cache_webapi_add(const char *uri, const char *etag, time_t expires, struct evbuffer *evbuf);
+
+int
+cache_webapi_get(struct evbuffer *evbuf, char **etag, time_t *expires, const char *uri);
+
 /* ------------------------------- Cache API  ------------------------------- */
 
+const char *
+cache_type_name(enum cache_type type);
+
+/* Gets the counters and current size of the given cache. The size is read
+ * from the cache db, so this call waits for the cache thread.
+ */
+int
+cache_stats_get(struct cache_stats *stats, enum cache_type type);
+
+/* Logs the stats of all caches (async) */
+void
+cache_stats_log(void);
+
 int
 cache_init(void);
 
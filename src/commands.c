@@ -16,19 +16,33 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include "commands.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
 
 #include <pthread.h>
 
 #include "logger.h"
 #include "misc.h"
+#include "trace.h"
+
+// Max number of commands executed per wakeup, so that a burst of commands
+// doesn't hold up the other events of the loop
+#define COMMANDS_BATCH_MAX 64
 
 struct command
 {
@@ -41,134 +55,295 @@ struct command
   int nonblock;
   int ret;
   int pending;
+
+  struct command *next;
 };
 
+/*
+ * Commands are passed to the event loop thread with a lock-free queue, which
+ * any thread can add to (see queue_push), and only the event loop thread takes
+ * from (see queue_pop). The queue is a linked list of the commands themselves,
+ * with a stub command, so it is never empty (Vyukov's MPSC queue). When a
+ * command is added to a queue that hasn't been signaled, the doorbell fd is
+ * written to, which makes libevent call command_cb. That executes all the
+ * commands in the queue, so there is only a wakeup per burst of commands.
+ */
 struct commands_base
 {
   struct event_base *evbase;
   command_exit_cb exit_cb;
-  int command_pipe[2];
+  int doorbell_fd[2];
   struct event *command_event;
   struct command *current_cmd;
+
+  bool signaled;
+  struct command *head; // Last added, updated by any thread
+  struct command *tail; // Next to take, only used by the event loop thread
+  struct command stub;
 };
 
+// Forward
+static enum command_state
+cmdloop_exit(void *arg, int *retval);
+
+
+/* ------------------------------- Queue ------------------------------------ */
+
+static void
+queue_push(struct commands_base *cmdbase, struct command *cmd)
+{
+  struct command *prev;
+
+  cmd->next = NULL;
+  prev = __atomic_exchange_n(&cmdbase->head, cmd, __ATOMIC_ACQ_REL);
+  // Between the exchange and this the list is broken, queue_pop handles that
+  __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+}
+
+// Returns NULL if the queue is empty, or if another thread is in the middle of
+// adding a command. That thread will then ring the doorbell.
+static struct command *
+queue_pop(struct commands_base *cmdbase)
+{
+  struct command *tail = cmdbase->tail;
+  struct command *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &cmdbase->stub)
+    {
+      if (!next)
+	return NULL;
+
+      cmdbase->tail = next;
+      tail = next;
+      next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+  if (next)
+    {
+      cmdbase->tail = next;
+      return tail;
+    }
+
+  if (tail != __atomic_load_n(&cmdbase->head, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  // The tail is the last command, so put the stub back behind it
+  queue_push(cmdbase, &cmdbase->stub);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next)
+    {
+      cmdbase->tail = next;
+      return tail;
+    }
+
+  return NULL;
+}
+
+static void
+doorbell_ring(struct commands_base *cmdbase)
+{
+#ifdef HAVE_EVENTFD
+  if (eventfd_write(cmdbase->doorbell_fd[1], 1) < 0)
+    DPRINTF(E_LOG, L_MAIN, "Could not signal command: %s\n", strerror(errno));
+#else
+  uint8_t dummy = 1;
+
+  // If the pipe is full the event loop will wake up anyway
+  if (write(cmdbase->doorbell_fd[1], &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+    DPRINTF(E_LOG, L_MAIN, "Could not signal command: %s\n", strerror(errno));
+#endif
+}
+
+static void
+doorbell_drain(struct commands_base *cmdbase)
+{
+#ifdef HAVE_EVENTFD
+  eventfd_t count;
+
+  eventfd_read(cmdbase->doorbell_fd[0], &count);
+#else
+  uint8_t dummy[16];
+
+  while (read(cmdbase->doorbell_fd[0], dummy, sizeof(dummy)) > 0)
+    ; // Just emptying the pipe
+#endif
+}
+
+static int
+doorbell_init(struct commands_base *cmdbase)
+{
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  ret = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  cmdbase->doorbell_fd[0] = cmdbase->doorbell_fd[1] = ret;
+#else
+# ifdef HAVE_PIPE2
+  ret = pipe2(cmdbase->doorbell_fd, O_CLOEXEC | O_NONBLOCK);
+# else
+  ret = pipe(cmdbase->doorbell_fd);
+  if (ret == 0)
+    {
+      fcntl(cmdbase->doorbell_fd[0], F_SETFL, O_NONBLOCK);
+      fcntl(cmdbase->doorbell_fd[1], F_SETFL, O_NONBLOCK);
+    }
+# endif
+#endif
+
+  return ret;
+}
+
+static void
+doorbell_deinit(struct commands_base *cmdbase)
+{
+  close(cmdbase->doorbell_fd[0]);
+  if (cmdbase->doorbell_fd[1] != cmdbase->doorbell_fd[0])
+    close(cmdbase->doorbell_fd[1]);
+}
+
+
+/* ----------------------------- Execution ---------------------------------- */
+
+/*
+ * Makes the event loop process commands again, more is true if there may be
+ * commands left in the queue that no doorbell will be rung for
+ */
+static void
+commands_resume(struct commands_base *cmdbase, bool more)
+{
+  event_add(cmdbase->command_event, NULL);
+
+  if (more)
+    event_active(cmdbase->command_event, EV_READ, 0);
+}
+
 /*
  * Asynchronous execution of the command function
  */
 static void
 command_cb_async(struct commands_base *cmdbase, struct command *cmd)
 {
+  struct trace_span span;
   enum command_state cmdstate;
 
   // Command is executed asynchronously
+  trace_begin(&span, "commands", "command_async");
   cmdstate = cmd->func(cmd->arg, &cmd->ret);
+  trace_end(&span);
 
   // Only free arg if there are no pending events (used in httpd.c)
   if (cmdstate != COMMAND_PENDING)
     free(cmd->arg);
 
   free(cmd);
-
-  event_add(cmdbase->command_event, NULL);
 }
 
 /*
  * Synchronous execution of the command function
  */
-static void
+static enum command_state
 command_cb_sync(struct commands_base *cmdbase, struct command *cmd)
 {
+  struct trace_span span;
   enum command_state cmdstate;
 
   CHECK_ERR(L_MAIN, pthread_mutex_lock(&cmd->lck));
 
+  trace_begin(&span, "commands", "command_sync");
   cmdstate = cmd->func(cmd->arg, &cmd->ret);
+  trace_end(&span);
   if (cmdstate == COMMAND_PENDING)
     {
       // Command execution is waiting for pending events before returning to the caller
       cmdbase->current_cmd = cmd;
       cmd->pending = cmd->ret;
-      return;
+      return COMMAND_PENDING;
     }
 
   // Command execution finished, execute the bottom half function
   if (cmd->ret == 0 && cmd->func_bh)
     cmd->func_bh(cmd->arg, &cmd->ret);
 
-  event_add(cmdbase->command_event, NULL);
-
   // Signal the calling thread that the command execution finished
   CHECK_ERR(L_MAIN, pthread_cond_signal(&cmd->cond));
   CHECK_ERR(L_MAIN, pthread_mutex_unlock(&cmd->lck));
 
   // Note if cmd->func was cmdloop_exit then cmdbase may be invalid now,
   // because commands_base_destroy() may have freed it
+  return COMMAND_END;
 }
 
 /*
  * Event callback function
  *
- * Function is triggered by libevent if there is data to read on the command pipe (writing to the command pipe happens through
- * the send_command function).
+ * Function is triggered by libevent when the doorbell has been rung (which
+ * happens in send_command), and then executes the commands in the queue.
  */
 static void
 command_cb(int fd, short what, void *arg)
 {
   struct commands_base *cmdbase;
   struct command *cmd;
-  int ret;
+  int i;
 
   cmdbase = arg;
 
-  // Get the command to execute from the pipe
-  ret = read(cmdbase->command_pipe[0], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
-    {
-      DPRINTF(E_LOG, L_MAIN, "Error reading command from command pipe: expected %zu bytes, read %d bytes\n", sizeof(cmd), ret);
-
-      event_add(cmdbase->command_event, NULL);
-      return;
-    }
+  // Commands added after this will ring the doorbell again
+  doorbell_drain(cmdbase);
+  __atomic_store_n(&cmdbase->signaled, false, __ATOMIC_SEQ_CST);
 
-  // Execute the command function
-  if (cmd->nonblock)
+  for (i = 0; i < COMMANDS_BATCH_MAX; i++)
     {
-      // Command is executed asynchronously
-      command_cb_async(cmdbase, cmd);
-    }
-  else
-    {
-      // Command is executed synchronously, caller is waiting until signaled that the execution finished
-      command_cb_sync(cmdbase, cmd);
+      cmd = queue_pop(cmdbase);
+      if (!cmd)
+	break;
+
+      // Execute the command function
+      if (cmd->nonblock)
+	{
+	  // Command is executed asynchronously
+	  command_cb_async(cmdbase, cmd);
+	}
+      else if (cmd->func == cmdloop_exit)
+	{
+	  // The loop is ending and cmdbase must not be touched after this
+	  command_cb_sync(cmdbase, cmd);
+	  return;
+	}
+      else if (command_cb_sync(cmdbase, cmd) == COMMAND_PENDING)
+	{
+	  // Command is waiting for events, commands_exec_end() resumes
+	  return;
+	}
     }
+
+  commands_resume(cmdbase, i == COMMANDS_BATCH_MAX);
 }
 
 /*
- * Writes the given command to the command pipe
+ * Adds the given command to the queue of the event loop thread
  */
 static int
 send_command(struct commands_base *cmdbase, struct command *cmd)
 {
-  int ret;
-
   if (!cmd->func)
     {
       DPRINTF(E_LOG, L_MAIN, "Programming error: send_command called with command->func NULL!\n");
       return -1;
     }
 
-  ret = write(cmdbase->command_pipe[1], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
-    {
-      DPRINTF(E_LOG, L_MAIN, "Bad write to command pipe (write incomplete)\n");
-      return -1;
-    }
+  queue_push(cmdbase, cmd);
+
+  // Only the first command after the event loop woke up needs to ring
+  if (!__atomic_exchange_n(&cmdbase->signaled, true, __ATOMIC_SEQ_CST))
+    doorbell_ring(cmdbase);
 
   return 0;
 }
 
 /*
- * Frees the command base and closes the (internally used) pipes
+ * Frees the command base and closes the (internally used) doorbell fds
  */
 int
 commands_base_free(struct commands_base *cmdbase)
@@ -176,8 +351,7 @@ commands_base_free(struct commands_base *cmdbase)
   if (cmdbase->command_event)
     event_free(cmdbase->command_event);
 
-  close(cmdbase->command_pipe[0]);
-  close(cmdbase->command_pipe[1]);
+  doorbell_deinit(cmdbase);
   free(cmdbase);
 
   return 0;
@@ -197,19 +371,18 @@ commands_base_new(struct event_base *evbase, command_exit_cb exit_cb)
 
   CHECK_NULL(L_MAIN, cmdbase = calloc(1, sizeof(struct commands_base)));
 
-#ifdef HAVE_PIPE2
-  ret = pipe2(cmdbase->command_pipe, O_CLOEXEC);
-#else
-  ret = pipe(cmdbase->command_pipe);
-#endif
+  cmdbase->head = &cmdbase->stub;
+  cmdbase->tail = &cmdbase->stub;
+
+  ret = doorbell_init(cmdbase);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_MAIN, "Could not create command pipe: %s\n", strerror(errno));
+      DPRINTF(E_LOG, L_MAIN, "Could not create command doorbell: %s\n", strerror(errno));
       free(cmdbase);
       return NULL;
     }
 
-  cmdbase->command_event = event_new(evbase, cmdbase->command_pipe[0], EV_READ, command_cb, cmdbase);
+  cmdbase->command_event = event_new(evbase, cmdbase->doorbell_fd[0], EV_READ, command_cb, cmdbase);
   if (!cmdbase->command_event)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not create cmd event\n");
@@ -284,13 +457,31 @@ commands_exec_end(struct commands_base *cmdbase, int retvalue)
 
   cmdbase->current_cmd = NULL;
 
-  /* Process commands again */
-  event_add(cmdbase->command_event, NULL);
+  /* Process commands again, including those that were queued meanwhile */
+  commands_resume(cmdbase, true);
 
   CHECK_ERR(L_MAIN, pthread_cond_signal(&current_cmd->cond));
   CHECK_ERR(L_MAIN, pthread_mutex_unlock(&current_cmd->lck));
 }
 
+/*
+ * Like commands_exec_end, but finishes the pending command even if some of its
+ * events are still pending. The caller must make sure that those events won't
+ * call commands_exec_end, since they would then end some other command.
+ *
+ * @param cmdbase The command base (holds the current pending command)
+ * @param retvalue The return value for the calling thread
+ */
+void
+commands_exec_end_now(struct commands_base *cmdbase, int retvalue)
+{
+  if (!cmdbase->current_cmd)
+    return;
+
+  cmdbase->current_cmd->pending = 1;
+  commands_exec_end(cmdbase, retvalue);
+}
+
 /*
  * Execute the function 'func' with the given argument 'arg' in the event loop thread.
  * Blocks the caller (thread) until the function returned.
@@ -307,9 +498,12 @@ commands_exec_end(struct commands_base *cmdbase, int retvalue)
 int
 commands_exec_sync(struct commands_base *cmdbase, command_function func, command_function func_bh, void *arg)
 {
+  struct trace_span span;
   struct command cmd;
   int ret;
 
+  trace_begin(&span, "commands", "commands_exec_sync");
+
   memset(&cmd, 0, sizeof(struct command));
   cmd.func = func;
   cmd.func_bh = func_bh;
@@ -336,6 +530,8 @@ commands_exec_sync(struct commands_base *cmdbase, command_function func, command
   CHECK_ERR(L_MAIN, pthread_cond_destroy(&cmd.cond));
   CHECK_ERR(L_MAIN, pthread_mutex_destroy(&cmd.lck));
 
+  trace_end(&span);
+
   return cmd.ret;
 }
 
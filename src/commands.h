@@ -44,6 +44,9 @@ commands_exec_returnvalue(struct commands_base *cmdbase);
 void
 commands_exec_end(struct commands_base *cmdbase, int retvalue);
 
+void
+commands_exec_end_now(struct commands_base *cmdbase, int retvalue);
+
 int
 commands_exec_sync(struct commands_base *cmdbase, command_function func, command_function func_bh, void *arg);
 
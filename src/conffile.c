@@ -52,18 +52,29 @@ static cfg_opt_t sec_general[] =
     CFG_STR("admin_password", NULL, CFGF_NONE),
     CFG_INT("websocket_port", 3688, CFGF_NONE),
     CFG_STR("websocket_interface", NULL, CFGF_NONE),
+    CFG_INT("notify_batch_ms", 1000, CFGF_NONE),
     CFG_STR_LIST("trusted_networks", "{lan}", CFGF_NONE),
     CFG_BOOL("ipv6", cfg_false, CFGF_NONE),
     CFG_STR("bind_address", NULL, CFGF_NONE),
     CFG_STR("cache_dir", STATEDIR "/cache/" PACKAGE, CFGF_NONE),
     CFG_STR("cache_path", NULL, CFGF_DEPRECATED),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_memory", 8192, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
+    CFG_INT("speaker_ready_min", 0, CFGF_NONE),
+    CFG_INT("prepare_next_seconds", 5, CFGF_NONE),
+    CFG_INT("input_buffer_ms", 2000, CFGF_NONE),
+    CFG_INT("input_buffer_network_ms", 5000, CFGF_NONE),
+    CFG_INT("file_readahead_mb", 32, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
 #else
     CFG_BOOL("high_resolution_clock", cfg_true, CFGF_NONE),
 #endif
+    CFG_INT("realtime_priority", 0, CFGF_NONE),
+    CFG_STR("realtime_policy", "fifo", CFGF_NONE),
+    CFG_INT_LIST("realtime_cpus", NULL, CFGF_NONE),
+    CFG_BOOL("lock_memory", cfg_false, CFGF_NONE),
     // Hidden options
     CFG_INT("db_pragma_cache_size", -1, CFGF_NONE),
     CFG_STR("db_pragma_journal_mode", NULL, CFGF_NONE),
@@ -71,6 +82,8 @@ static cfg_opt_t sec_general[] =
     CFG_STR("cache_daap_filename", "daap.db", CFGF_NONE),
     CFG_STR("cache_artwork_filename", "artwork.db", CFGF_NONE),
     CFG_STR("cache_xcode_filename", "xcode.db", CFGF_NONE),
+    CFG_INT("cache_xcode_threads", 0, CFGF_NONE),
+    CFG_INT("cache_stream_size", 0, CFGF_NONE),
     CFG_STR("allow_origin", "*", CFGF_NONE),
     CFG_STR("user_agent", PACKAGE_NAME "/" PACKAGE_VERSION, CFGF_NONE),
     CFG_BOOL("ssl_verifypeer", cfg_true, CFGF_NONE),
@@ -83,6 +96,7 @@ static cfg_opt_t sec_library[] =
   {
     CFG_STR("name", "My Music on %h", CFGF_NONE),
     CFG_INT("port", 3689, CFGF_NONE),
+    CFG_INT("httpd_threads", 0, CFGF_NONE),
     CFG_STR("password", NULL, CFGF_NONE),
     CFG_STR_LIST("directories", NULL, CFGF_NONE),
     CFG_BOOL("follow_symlinks", cfg_true, CFGF_NONE),
@@ -106,13 +120,20 @@ static cfg_opt_t sec_library[] =
     CFG_STR("name_unknown_composer", "Unknown composer", CFGF_NONE),
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
+    CFG_INT_LIST("artwork_sizes", NULL, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
+    CFG_INT("scan_workers", 1, CFGF_NONE),
+    CFG_INT("scan_nice", 0, CFGF_NONE),
+    CFG_BOOL("scan_io_idle", cfg_false, CFGF_NONE),
+    CFG_BOOL("fanotify", cfg_false, CFGF_NONE),
     CFG_BOOL("m3u_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
+    CFG_BOOL("smartpl_cache", cfg_false, CFGF_NONE),
+    CFG_INT("smartpl_cache_refresh", 600, CFGF_NONE),
     CFG_STR_LIST("no_decode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_decode", NULL, CFGF_NONE),
     CFG_STR("prefer_format", NULL, CFGF_NONE),
@@ -129,6 +150,8 @@ static cfg_opt_t sec_library[] =
     CFG_BOOL("only_first_genre", cfg_false, CFGF_NONE),
     CFG_STR_LIST("decode_audio_filters", NULL, CFGF_NONE),
     CFG_STR_LIST("decode_video_filters", NULL, CFGF_NONE),
+    CFG_STR("federation_primary", NULL, CFGF_NONE),
+    CFG_INT("federation_interval", 10, CFGF_NONE),
     CFG_END()
   };
 
@@ -145,6 +168,15 @@ static cfg_opt_t sec_audio[] =
     CFG_INT("offset", 0, CFGF_DEPRECATED),
     CFG_INT("offset_ms", 0, CFGF_NONE),
     CFG_INT("adjust_period_seconds", 100, CFGF_NONE),
+    CFG_BOOL("mmap", cfg_false, CFGF_NONE),
+    CFG_INT("buffer_time_ms", 0, CFGF_NONE),
+    CFG_INT("period_time_ms", 0, CFGF_NONE),
+    CFG_INT("tlength_ms", 0, CFGF_NONE),
+    CFG_INT("minreq_ms", 0, CFGF_NONE),
+    CFG_INT("prebuf_ms", 0, CFGF_NONE),
+    CFG_BOOL("adjust_latency", cfg_false, CFGF_NONE),
+    CFG_STR("resample_quality", "medium", CFGF_NONE),
+    CFG_BOOL("resample_dither", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
@@ -156,6 +188,9 @@ static cfg_opt_t sec_alsa[] =
     CFG_STR("mixer", NULL, CFGF_NONE),
     CFG_STR("mixer_device", NULL, CFGF_NONE),
     CFG_INT("offset_ms", 0, CFGF_NONE),
+    CFG_BOOL("mmap", cfg_false, CFGF_NONE),
+    CFG_INT("buffer_time_ms", 0, CFGF_NONE),
+    CFG_INT("period_time_ms", 0, CFGF_NONE),
     CFG_END()
   };
 
@@ -165,6 +200,10 @@ static cfg_opt_t sec_airplay_shared[] =
     CFG_INT("control_port", 0, CFGF_NONE),
     CFG_INT("timing_port", 0, CFGF_NONE),
     CFG_BOOL("uncompressed_alac", cfg_false, CFGF_NONE),
+    CFG_INT("retransmit_buffer_min_ms", 2000, CFGF_NONE),
+    CFG_INT("retransmit_buffer_max_ms", 16000, CFGF_NONE),
+    CFG_STR("resample_quality", "medium", CFGF_NONE),
+    CFG_BOOL("resample_dither", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
@@ -196,6 +235,9 @@ static cfg_opt_t sec_fifo[] =
   {
     CFG_STR("nickname", "fifo", CFGF_NONE),
     CFG_STR("path", NULL, CFGF_NONE),
+    CFG_INT("write_behind_ms", 1000, CFGF_NONE),
+    CFG_STR("resample_quality", "medium", CFGF_NONE),
+    CFG_BOOL("resample_dither", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
@@ -230,6 +272,11 @@ static cfg_opt_t sec_sqlite[] =
     CFG_INT("pragma_mmap_size_library", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_cache", -1, CFGF_NONE),
     CFG_BOOL("vacuum", cfg_true, CFGF_NONE),
+    CFG_INT("write_batch_size", 250, CFGF_NONE),
+    CFG_INT("write_batch_interval", 2000, CFGF_NONE),
+    CFG_INT("slow_query_threshold", 0, CFGF_NONE),
+    CFG_BOOL("queue_in_memory", cfg_false, CFGF_NONE),
+    CFG_INT("queue_snapshot_interval", 60, CFGF_NONE),
     CFG_END()
   };
 
@@ -250,7 +297,10 @@ static cfg_opt_t sec_streaming[] =
   {
     CFG_INT("sample_rate", 44100, CFGF_NONE),
     CFG_INT("bit_rate", 192, CFGF_NONE),
+    CFG_INT("opus_bit_rate", 96, CFGF_NONE),
     CFG_INT("icy_metaint", 16384, CFGF_NONE),
+    CFG_STR("resample_quality", "medium", CFGF_NONE),
+    CFG_BOOL("resample_dither", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
@@ -505,7 +555,8 @@ conffile_load(char *file)
 
   lib = cfg_getsec(cfg, "library");
 
-  if (cfg_size(lib, "directories") == 0)
+  // A replica gets its library from the primary, so it doesn't need any
+  if (cfg_size(lib, "directories") == 0 && !cfg_getstr(lib, "federation_primary"))
     {
       DPRINTF(E_FATAL, L_CONF, "No directories specified for library\n");
 
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -52,6 +53,7 @@
 #include "db_init.h"
 #include "db_upgrade.h"
 #include "rng.h"
+#include "trace.h"
 
 
 // Inotify cookies are uint32_t
@@ -62,6 +64,36 @@
 #define DB_FLAG_NO_BIND  (1 << 0)
 // Flags that we will only update column value if we have non-zero value (to avoid zeroing e.g. rating)
 #define DB_FLAG_NO_ZERO  (1 << 1)
+// Flags that the column is set on insert, but not by the generic update (because the field doesn't hold the
+// column value after retrieval, e.g. the queue position, see queue_select_src)
+#define DB_FLAG_NO_UPDATE (1 << 2)
+
+// Spacing between the ordering keys of the queue after rebalancing
+#define QUEUE_KEY_GAP 1024
+// Number of keys that db_queue_add_start/next reserves at a time
+#define QUEUE_KEY_RESERVE 64
+
+// Number of changes to keep in the changes table
+#define DB_CHANGES_MAX 50000
+
+// Schema name and uri of the in-memory queue database, see db_queue_mem_init()
+#define DB_QUEUE_MEM_SCHEMA "queuemem"
+#define DB_QUEUE_MEM_URI "file:owntone-queue?mode=memory&cache=shared"
+
+// Number of plays to keep per service in the scrobbles table
+#define DB_SCROBBLES_MAX 10000
+
+// Limits for the automatic library cache size, see db_pragma_autosize()
+#define DB_CACHE_SIZE_MIN (8 * 1024 * 1024)
+#define DB_CACHE_SIZE_MAX (64 * 1024 * 1024)
+#define DB_CACHE_RAM_SHARE 32
+#define DB_MMAP_SIZE_MAX (256 * 1024 * 1024)
+#define DB_MMAP_RAM_SHARE 8
+
+// Incremental vacuum in db_maintenance() when at least this many pages are
+// free, and at most this many pages each time
+#define DB_VACUUM_FREELIST_MIN 1024
+#define DB_VACUUM_PAGES_MAX 16384
 
 // The two last columns of playlist_info are calculated fields, so all playlist retrieval functions must use this query
 #define Q_PL_SELECT "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')" \
@@ -121,6 +153,68 @@ struct db_statements
   sqlite3_stmt *queue_items_update;
 };
 
+// Number of distinct query templates each thread can keep prepared
+#define DB_STMT_CACHE_SIZE 32
+
+struct db_stmt_cache_entry
+{
+  const char *query;
+  sqlite3_stmt *stmt;
+};
+
+// State of a scan-scoped write batch, see db_write_batch_begin()
+struct db_write_batch
+{
+  bool enabled;
+  bool in_transaction;
+  int size;
+  int interval_ms;
+  int count;
+  struct timespec start;
+};
+
+// State of a batch of queue changes, see db_queue_batch_begin()
+struct db_queue_batch
+{
+  bool active;
+  bool changed;
+  int queue_version;
+  // Length of the pending removals when the current change started
+  int removed_saved;
+  bool reset_saved;
+};
+
+// Number of removed queue items that are remembered, see db_queue_removed_get()
+#define DB_QUEUE_REMOVED_LOG_SIZE 1024
+
+struct db_queue_removed
+{
+  int queue_version;
+  uint32_t id;
+};
+
+// Ring buffer with the items most recently removed from the queue. It has all
+// removals after start_version, older versions must be reloaded by clients.
+struct db_queue_removed_log
+{
+  pthread_mutex_t lock;
+  struct db_queue_removed entries[DB_QUEUE_REMOVED_LOG_SIZE];
+  int head;
+  int count;
+  int start_version;
+};
+
+// Removals of the thread's current queue transaction, which are added to the
+// log when the transaction is committed. If reset is set the removed items are
+// unknown (e.g. the queue was cleared), so the log must start over.
+struct db_queue_removed_pending
+{
+  uint32_t *ids;
+  int count;
+  int size;
+  bool reset;
+};
+
 struct col_type_map {
   char *name;
   ssize_t offset;
@@ -152,6 +246,16 @@ struct query_clause {
   char *having;
   char *order;
   char *index;
+  char *keyset;
+  char *cols;
+};
+
+// Column to page by and unique tie-breaker column for keyset paging
+struct keyset_clause {
+  enum query_type type;
+  enum sort_type sort;
+  const char *col;
+  const char *id;
 };
 
 struct browse_clause {
@@ -232,6 +336,7 @@ static const struct col_type_map mfi_cols_map[] =
     { "usermark",           mfi_offsetof(usermark),           DB_TYPE_INT },
     { "scan_kind",          mfi_offsetof(scan_kind),          DB_TYPE_INT },
     { "lyrics",             mfi_offsetof(lyrics),             DB_TYPE_STRING },
+    { "inode",              mfi_offsetof(inode),              DB_TYPE_INT64 },
   };
 
 /* This list must be kept in sync with
@@ -257,6 +362,8 @@ static const struct col_type_map pli_cols_map[] =
     { "media_kind",         pli_offsetof(media_kind),         DB_TYPE_INT,    DB_FIXUP_MEDIA_KIND },
     { "artwork_url",        pli_offsetof(artwork_url),        DB_TYPE_STRING, DB_FIXUP_NO_SANITIZE },
     { "scan_kind",          pli_offsetof(scan_kind),          DB_TYPE_INT },
+    { "http_etag",          pli_offsetof(http_etag),          DB_TYPE_STRING, DB_FIXUP_NO_SANITIZE },
+    { "http_modified",      pli_offsetof(http_modified),      DB_TYPE_STRING, DB_FIXUP_NO_SANITIZE },
 
     // Not in the database, but returned via the query's COUNT()/SUM()
     { "items",              pli_offsetof(items),              DB_TYPE_INT,    DB_FIXUP_STANDARD, DB_FLAG_NO_BIND },
@@ -272,8 +379,8 @@ static const struct col_type_map qi_cols_map[] =
   {
     { "id",                 qi_offsetof(id),                  DB_TYPE_INT,    DB_FIXUP_STANDARD, DB_FLAG_NO_BIND },
     { "file_id",            qi_offsetof(file_id),             DB_TYPE_INT },
-    { "pos",                qi_offsetof(pos),                 DB_TYPE_INT },
-    { "shuffle_pos",        qi_offsetof(shuffle_pos),         DB_TYPE_INT },
+    { "pos",                qi_offsetof(pos),                 DB_TYPE_INT,    DB_FIXUP_STANDARD, DB_FLAG_NO_UPDATE },
+    { "shuffle_pos",        qi_offsetof(shuffle_pos),         DB_TYPE_INT,    DB_FIXUP_STANDARD, DB_FLAG_NO_UPDATE },
     { "data_kind",          qi_offsetof(data_kind),           DB_TYPE_INT },
     { "media_kind",         qi_offsetof(media_kind),          DB_TYPE_INT,    DB_FIXUP_MEDIA_KIND },
     { "song_length",        qi_offsetof(song_length),         DB_TYPE_INT },
@@ -374,6 +481,7 @@ static const ssize_t dbmfi_cols_map[] =
     dbmfi_offsetof(usermark),
     dbmfi_offsetof(scan_kind),
     dbmfi_offsetof(lyrics),
+    dbmfi_offsetof(inode),
   };
 
 /* This list must be kept in sync with
@@ -399,6 +507,8 @@ static const ssize_t dbpli_cols_map[] =
     dbpli_offsetof(media_kind),
     dbpli_offsetof(artwork_url),
     dbpli_offsetof(scan_kind),
+    dbpli_offsetof(http_etag),
+    dbpli_offsetof(http_modified),
 
     dbpli_offsetof(items),
     dbpli_offsetof(streams),
@@ -517,6 +627,16 @@ static const char *sort_clause[] =
     "f.date_released DESC, f.title_sort DESC",
   };
 
+/* Keyset clauses, used instead of the sort clause for I_KEYSET queries. For
+ * groups the sort column is assumed to be the same for all rows in a group.
+ */
+static const struct keyset_clause keyset_clause[] =
+  {
+    { Q_ITEMS,         S_NAME,   "f.title_sort",        "f.id" },
+    { Q_GROUP_ALBUMS,  S_ALBUM,  "f.album_sort",        "f.songalbumid" },
+    { Q_GROUP_ARTISTS, S_ARTIST, "f.album_artist_sort", "f.songartistid" },
+  };
+
 /* Browse clauses, used for SELECT, WHERE, GROUP BY and for default ORDER BY
  * Keep in sync with enum query_type and indices
  * Col 1: for SELECT, Col 2: for WHERE, Col 3: for GROUP BY/ORDER BY
@@ -605,6 +725,7 @@ static const struct enum_label scan_kind_labels[] =
     { SCAN_KIND_FILES,      "files" },
     { SCAN_KIND_SPOTIFY,    "spotify" },
     { SCAN_KIND_RSS,        "rss" },
+    { SCAN_KIND_FEDERATION, "federation" },
   };
 
 const char *
@@ -655,18 +776,123 @@ struct rng_ctx shuffle_rng;
 static char *db_path;
 static char *db_sqlite_ext_path;
 static bool db_rating_updates;
+static bool db_smartpl_cache;
+static int db_smartpl_cache_refresh;
+static bool db_fts_enabled;
+static int db_slow_query_ms;
+
+// With queue_in_memory the queue table is in the in-memory database
+static bool db_queue_in_memory;
+static const char *db_queue_table = "queue";
+
+// Chosen by db_pragma_autosize() for the library connections, when not set in
+// the config. The cache size is in KiB, which is how it is passed to SQLite.
+static int db_auto_cache_size_kib;
+static int db_auto_mmap_size;
+
+/* Cumulative query timings. The first entry is for queue enums (which don't
+ * set a query type), then the query types in enum order and finally prepared
+ * statements run via db_statement_run(). See db_query_stats_index().
+ */
+static struct db_query_stats db_query_stats[] =
+  {
+    { "queue" },
+    { "items" },
+    { "playlists" },
+    { "find_playlists" },
+    { "playlist_items" },
+    { "group_albums" },
+    { "group_artists" },
+    { "group_items" },
+    { "group_dirs" },
+    { "count_items" },
+    { "browse_artists" },
+    { "browse_albums" },
+    { "browse_genres" },
+    { "browse_composers" },
+    { "browse_years" },
+    { "browse_discs" },
+    { "browse_tracks" },
+    { "browse_vpath" },
+    { "browse_path" },
+    { "statements" },
+  };
+static pthread_mutex_t db_query_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+
+#define DB_QUERY_STATS_BROWSE_FIRST (Q_COUNT_ITEMS + 1)
+#define DB_QUERY_STATS_STATEMENTS (ARRAY_SIZE(db_query_stats) - 1)
+
+/* The pos and shuffle_pos columns of the queue table are sparse ordering keys,
+ * so inserting or moving items only requires writing the items in question.
+ * Queue items are always read via this subquery, which replaces the keys with
+ * the zero-based positions (so filters like "pos < 10" keep working). Built by
+ * queue_select_src_build() from qi_cols_map.
+ */
+static char queue_select_src[2048];
+static char queue_select_byid[2200];
 
 static __thread sqlite3 *hdl;
+// Optional read-only connection for browse queries, see db_perthread_reader_init()
+static __thread sqlite3 *hdl_ro;
+static __thread unsigned int db_unlock_waits;
 static __thread struct db_statements db_statements;
+static __thread struct db_stmt_cache_entry db_stmt_cache[DB_STMT_CACHE_SIZE];
+static __thread struct db_write_batch db_write_batch;
+static __thread struct db_queue_batch db_queue_batch;
+static __thread struct db_queue_removed_pending db_queue_removed_pending;
+
+static struct db_queue_removed_log db_queue_removed_log = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* In-memory copy of the enabled directories and their file counts, used by
+ * db_directory_enum_*() for browsing. Rebuilt on demand when the generation
+ * has been bumped by a change to the directories table, or when the library
+ * has been modified (DB_ADMIN_DB_MODIFIED, for the file counts). Enums hold a
+ * reference, so a replaced tree is freed when the last enum ends.
+ */
+struct db_dirtree_node
+{
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t db_timestamp;
+  uint32_t scan_kind;
+  uint32_t file_count;
+  char *virtual_path;
+  char *path;
+};
+
+struct db_dirtree
+{
+  struct db_dirtree_node *nodes; // Sorted by parent_id, then virtual_path
+  struct db_dirtree_node **by_id; // Sorted by id
+  int count;
+  unsigned int generation;
+  int64_t db_modified;
+  int refcount;
+};
+
+static pthread_mutex_t db_dirtree_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_dirtree *db_dirtree;
+static unsigned int db_dirtree_generation;
+// Set if this thread changed directories in a transaction, see db_dirtree_invalidate()
+static __thread bool db_dirtree_uncommitted;
 
 
 /* Forward */
 static enum group_type
 db_group_type_bypersistentid(int64_t persistentid);
 
+static void
+db_dirtree_invalidate(void);
+
+static void
+db_dirtree_committed(void);
+
 static int
 db_query_run(char *query, int free, short update_events);
 
+static int
+db_get_one_int(const char *query);
+
 
 char *
 db_escape_string(const char *str)
@@ -801,6 +1027,8 @@ free_pli(struct playlist_info *pli, int content_only)
   free(pli->virtual_path);
   free(pli->query_order);
   free(pli->artwork_url);
+  free(pli->http_etag);
+  free(pli->http_modified);
 
   if (!content_only)
     free(pli);
@@ -844,6 +1072,8 @@ free_query_params(struct query_params *qp, int content_only)
     return;
 
   free(qp->filter);
+  free(qp->search);
+  free(qp->keyset_value);
   free(qp->having);
   free(qp->order);
   free(qp->group);
@@ -983,6 +1213,20 @@ struct_field_from_statement(void *dst_struct, ssize_t dst_offset, enum field_typ
     }
 }
 
+// NFD normalization leaves plain ASCII untouched, so for the (common) ASCII
+// tags we can skip u8_normalize() and the allocations it makes
+static bool
+sort_tag_is_ascii(const uint8_t *str)
+{
+  for (; *str; str++)
+    {
+      if (*str & 0x80)
+	return false;
+    }
+
+  return true;
+}
+
 static void
 sort_tag_create(char **sort_tag, const char *src_tag)
 {
@@ -1008,6 +1252,9 @@ sort_tag_create(char **sort_tag, const char *src_tag)
   // - queue_item->artist_sort will still be "A".
   if (*sort_tag)
     {
+      if (sort_tag_is_ascii((uint8_t *)*sort_tag))
+	return;
+
       DPRINTF(E_DBG, L_DB, "Existing sort tag will be normalized: %s\n", *sort_tag);
       o_ptr = u8_normalize(UNINORM_NFD, (uint8_t *)*sort_tag, strlen(*sort_tag) + 1, NULL, &len);
       free(*sort_tag);
@@ -1090,6 +1337,12 @@ sort_tag_create(char **sort_tag, const char *src_tag)
     }
   while (n_ptr);
 
+  if (sort_tag_is_ascii(out))
+    {
+      *sort_tag = strdup((char *)out);
+      return;
+    }
+
   *sort_tag = (char *)u8_normalize(UNINORM_NFD, (uint8_t *)&out, u8_strlen(out) + 1, NULL, &len);
 }
 
@@ -1385,6 +1638,8 @@ bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, siz
     {
       if (map[i].flag & DB_FLAG_NO_BIND)
 	continue;
+      if (id && (map[i].flag & DB_FLAG_NO_UPDATE))
+	continue;
 
       ptr = data + map[i].offset;
       strptr = (char **)(data + map[i].offset);
@@ -1476,7 +1731,8 @@ db_wait_unlock(void)
 
       if (!u.proceed)
 	{
-	  DPRINTF(E_INFO, L_DB, "Waiting for database unlock\n");
+	  db_unlock_waits++;
+	  DPRINTF(E_INFO, L_DB, "Waiting for database unlock (wait %u in this thread)\n", db_unlock_waits);
 	  CHECK_ERR(L_DB, pthread_cond_wait(&u.cond, &u.lck));
 	}
 
@@ -1493,6 +1749,7 @@ static int
 db_blocking_step(sqlite3_stmt *stmt)
 {
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_DB);
 
   while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
     {
@@ -1513,6 +1770,7 @@ static int
 db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
 {
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_DB);
 
   while ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED)
     {
@@ -1527,12 +1785,9 @@ db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const ch
   return ret;
 }
 
-static int
-db_statement_run(sqlite3_stmt *stmt, short update_events)
+static void
+db_stmt_debug(sqlite3_stmt *stmt)
 {
-  int ret;
-  int changes = 0;
-
 #ifdef HAVE_SQLITE3_EXPANDED_SQL
   char *query;
   if (logger_severity() >= E_DBG)
@@ -1542,17 +1797,220 @@ db_statement_run(sqlite3_stmt *stmt, short update_events)
       sqlite3_free(query);
     }
 #else
-  DPRINTF(E_DBG, L_DB, "Running query (prepared statement)\n");
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (prepared statement)\n", sqlite3_sql(stmt));
 #endif
+}
+
+/* Per-thread prepared statement cache
+ *
+ * The query must be a static string (a Q_TMPL), since only the pointer is
+ * kept. Statements from the cache must be given back with db_stmt_cache_put()
+ * and never finalized by the caller. If the cache is full the statement is
+ * still prepared, but db_stmt_cache_put() will then finalize it.
+ */
+static sqlite3_stmt *
+db_stmt_cache_get(const char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_stmt_cache) && db_stmt_cache[i].query; i++)
+    {
+      if (db_stmt_cache[i].query == query || strcmp(db_stmt_cache[i].query, query) == 0)
+	return db_stmt_cache[i].stmt;
+    }
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      return NULL;
+    }
+
+  if (i == ARRAY_SIZE(db_stmt_cache))
+    {
+      DPRINTF(E_WARN, L_DB, "Statement cache is full, not caching '%s'\n", query);
+      return stmt;
+    }
+
+  db_stmt_cache[i].query = query;
+  db_stmt_cache[i].stmt = stmt;
+
+  return stmt;
+}
+
+static void
+db_stmt_cache_put(sqlite3_stmt *stmt)
+{
+  int i;
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  for (i = 0; i < ARRAY_SIZE(db_stmt_cache) && db_stmt_cache[i].query; i++)
+    {
+      if (db_stmt_cache[i].stmt == stmt)
+	return;
+    }
+
+  sqlite3_finalize(stmt);
+}
+
+static void
+db_stmt_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_stmt_cache) && db_stmt_cache[i].query; i++)
+    sqlite3_finalize(db_stmt_cache[i].stmt);
+
+  memset(db_stmt_cache, 0, sizeof(db_stmt_cache));
+}
+
+static uint64_t
+db_usec_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int
+db_query_stats_index(enum query_type type)
+{
+  int idx;
+
+  if (type & Q_F_BROWSE)
+    idx = DB_QUERY_STATS_BROWSE_FIRST + (type & ~Q_F_BROWSE) - 1;
+  else
+    idx = type;
+
+  if (idx < 0 || idx >= DB_QUERY_STATS_STATEMENTS)
+    return 0;
+
+  return idx;
+}
+
+static void
+db_query_plan_log(sqlite3_stmt *stmt, const char *sql)
+{
+  sqlite3_stmt *eqp;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+  if (!query)
+    return;
+
+  // Preparing an EXPLAIN doesn't touch any tables, so no need for blocking
+  ret = sqlite3_prepare_v2(sqlite3_db_handle(stmt), query, -1, &eqp, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not get query plan: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+      return;
+    }
+
+  while (sqlite3_step(eqp) == SQLITE_ROW)
+    DPRINTF(E_WARN, L_DB, "Query plan: %d|%d|%s\n", sqlite3_column_int(eqp, 0), sqlite3_column_int(eqp, 1), (const char *)sqlite3_column_text(eqp, 3));
+
+  sqlite3_finalize(eqp);
+}
+
+/*
+ * Adds the time spent on a statement to the stats, and if it exceeds the
+ * slow_query_threshold logs the statement with its query plan. Must be called
+ * before the statement is reset, since the bindings are needed for the log.
+ */
+static void
+db_query_profile(sqlite3_stmt *stmt, int stats_idx, uint64_t elapsed_usec, int rows)
+{
+  struct db_query_stats *stats = &db_query_stats[stats_idx];
+  bool is_slow;
+  char *sql;
+
+  is_slow = (db_slow_query_ms > 0 && elapsed_usec >= (uint64_t)db_slow_query_ms * 1000);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats_lck));
+  stats->count++;
+  stats->total_usec += elapsed_usec;
+  if (elapsed_usec > stats->max_usec)
+    stats->max_usec = elapsed_usec;
+  if (is_slow)
+    stats->slow_count++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats_lck));
+
+  if (!is_slow || !stmt)
+    return;
+
+  sql = sqlite3_expanded_sql(stmt);
+
+  DPRINTF(E_WARN, L_DB, "Slow %s query took %" PRIu64 " ms (%d rows, %d vm steps, %d full scan steps, %d sorts, %d autoindex rows): %s\n",
+    stats->name, elapsed_usec / 1000, rows,
+    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0),
+    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0),
+    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 0),
+    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0),
+    sql ? sql : sqlite3_sql(stmt));
+
+  db_query_plan_log(stmt, sql ? sql : sqlite3_sql(stmt));
+
+  sqlite3_free(sql);
+}
+
+/*
+ * Returns a copy of the cumulative query timings, which the caller must free.
+ *
+ * @out stats Array of timings, one per query type
+ * @return    Number of entries in stats, -1 on error
+ */
+int
+db_query_stats_get(struct db_query_stats **stats)
+{
+  CHECK_NULL(L_DB, *stats = malloc(sizeof(db_query_stats)));
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats_lck));
+  memcpy(*stats, db_query_stats, sizeof(db_query_stats));
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats_lck));
+
+  return ARRAY_SIZE(db_query_stats);
+}
+
+/*
+ * Returns the number of rows inserted, updated or deleted with the calling
+ * thread's connection since it was opened, including rows changed by triggers.
+ */
+int
+db_changes_total_get(void)
+{
+  return sqlite3_total_changes(hdl);
+}
+
+static int
+db_statement_run(sqlite3_stmt *stmt, short update_events)
+{
+  uint64_t start;
+  int rows = 0;
+  int ret;
+  int changes = 0;
+
+  db_stmt_debug(stmt);
+
+  start = db_usec_now();
 
   while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
-    ; /* EMPTY */
+    rows++;
 
   if (ret != SQLITE_DONE)
     {
       DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
     }
 
+  db_query_profile(stmt, DB_QUERY_STATS_STATEMENTS, db_usec_now() - start, rows);
+
   sqlite3_reset(stmt);
   sqlite3_clear_bindings(stmt);
 
@@ -1680,6 +2138,109 @@ db_hook_post_scan(void)
   DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
 }
 
+/* Run by the library thread when idle. PRAGMA optimize only analyzes tables
+ * where that is likely to change query plans, so it is cheap if nothing
+ * changed. With incremental auto vacuum, pages that were freed by e.g. a purge
+ * are returned to the file system, a limited number each time.
+ */
+void
+db_maintenance(void)
+{
+  char *query;
+  char *errmsg;
+  int freelist;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running database maintenance\n");
+
+  ret = db_exec("PRAGMA optimize;", &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "PRAGMA optimize failed: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  // 2 is INCREMENTAL
+  if (db_get_one_int("PRAGMA auto_vacuum;") != 2)
+    return;
+
+  freelist = db_get_one_int("PRAGMA freelist_count;");
+  if (freelist < DB_VACUUM_FREELIST_MIN)
+    return;
+
+  query = sqlite3_mprintf("PRAGMA incremental_vacuum(%d);", MIN(freelist, DB_VACUUM_PAGES_MAX));
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Incremental vacuum failed: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+  else
+    DPRINTF(E_LOG, L_DB, "Returned %d of %d free database pages to the file system\n", MIN(freelist, DB_VACUUM_PAGES_MAX), freelist);
+
+  sqlite3_free(query);
+}
+
+bool
+db_bulk_load_begin(void)
+{
+  int ret;
+
+  ret = db_get_one_int("SELECT EXISTS(SELECT 1 FROM files);");
+  if (ret != 0)
+    return false;
+
+  ret = db_init_indices_deferrable_drop(hdl);
+  if (ret < 0)
+    {
+      db_init_indices(hdl); // Restore those that were dropped
+      return false;
+    }
+
+  DPRINTF(E_LOG, L_DB, "Library is empty, secondary indices will be created when the scan is done\n");
+
+  return true;
+}
+
+void
+db_bulk_load_end(void)
+{
+  time_t start;
+  int ret;
+
+  DPRINTF(E_LOG, L_DB, "Creating secondary indices...\n");
+
+  start = time(NULL);
+  ret = db_init_indices(hdl);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Could not create secondary indices, will retry at next startup\n");
+  else
+    DPRINTF(E_LOG, L_DB, "Secondary indices created in %.f sec\n", difftime(time(NULL), start));
+
+  db_hook_post_scan();
+}
+
+static void
+db_changes_prune(void)
+{
+#define Q_TMPL "DELETE FROM changes WHERE id <= (SELECT MAX(id) FROM changes) - %d;"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, DB_CHANGES_MAX);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return;
+    }
+
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    DPRINTF(E_DBG, L_DB, "Pruned %d changes\n", sqlite3_changes(hdl));
+#undef Q_TMPL
+}
+
 void
 db_purge_cruft(time_t ref)
 {
@@ -1687,10 +2248,12 @@ db_purge_cruft(time_t ref)
   int i;
   int ret;
   char *query;
-  char *queries_tmpl[4] =
+  char *queries_tmpl[6] =
     {
       "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
       "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 ");",
+      "DELETE FROM smartplitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
+      "DELETE FROM smartpls WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
       "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 ";",
       "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 ";",
     };
@@ -1728,6 +2291,10 @@ db_purge_cruft(time_t ref)
   if (ret == 0)
     DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
 
+  db_dirtree_invalidate();
+
+  db_changes_prune();
+
   db_transaction_end();
 
 #undef Q_TMPL
@@ -1740,10 +2307,12 @@ db_purge_cruft_bysource(time_t ref, enum scan_kind scan_kind)
   int i;
   int ret;
   char *query;
-  char *queries_tmpl[4] =
+  char *queries_tmpl[6] =
     {
       "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
       "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
+      "DELETE FROM smartplitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
+      "DELETE FROM smartpls WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
       "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
       "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
     };
@@ -1781,6 +2350,10 @@ db_purge_cruft_bysource(time_t ref, enum scan_kind scan_kind)
   if (ret == 0)
     DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
 
+  db_dirtree_invalidate();
+
+  db_changes_prune();
+
   db_transaction_end();
 
 #undef Q_TMPL
@@ -1791,10 +2364,12 @@ db_purge_all(void)
 {
 #define Q_TMPL_PL "DELETE FROM playlists WHERE type <> %d;"
 #define Q_TMPL_DIR "DELETE FROM directories WHERE id >= %d;"
-  char *queries[4] =
+  char *queries[6] =
     {
       "DELETE FROM inotify;",
       "DELETE FROM playlistitems;",
+      "DELETE FROM smartplitems;",
+      "DELETE FROM smartpls;",
       "DELETE FROM files;",
       "DELETE FROM groups;",
     };
@@ -1862,10 +2437,406 @@ db_purge_all(void)
 
   sqlite3_free(query);
 
+  db_dirtree_invalidate();
+
 #undef Q_TMPL_PL
 #undef Q_TMPL_DIR
 }
 
+int
+db_changes_revision_get(int64_t *oldest, int64_t *latest)
+{
+#define Q_TMPL "SELECT IFNULL(MIN(id) - 1, 0), IFNULL(MAX(id), 0) FROM changes;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), Q_TMPL);
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  if (oldest)
+    *oldest = sqlite3_column_int64(stmt, 0);
+  if (latest)
+    *latest = sqlite3_column_int64(stmt, 1);
+
+  sqlite3_finalize(stmt);
+  return 0;
+#undef Q_TMPL
+}
+
+int
+db_changes_deleted_get(uint32_t **ids, enum db_change_item_type type, int64_t since)
+{
+// Only items where the latest change is the deletion, they may have come back
+#define Q_TMPL "SELECT c.item_id FROM changes c WHERE c.item_type = %d AND c.id > %" PRIi64 " AND c.is_deleted = 1" \
+               " AND c.id = (SELECT MAX(id) FROM changes WHERE item_type = c.item_type AND item_id = c.item_id);"
+  sqlite3_stmt *stmt;
+  char *query;
+  uint32_t *tmp;
+  int size = 0;
+  int n = 0;
+  int ret;
+
+  *ids = NULL;
+
+  query = sqlite3_mprintf(Q_TMPL, type, since);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (n == size)
+	{
+	  size = size ? 2 * size : 64;
+	  CHECK_NULL(L_DB, tmp = realloc(*ids, size * sizeof(uint32_t)));
+	  *ids = tmp;
+	}
+
+      (*ids)[n++] = sqlite3_column_int64(stmt, 0);
+    }
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+      free(*ids);
+      *ids = NULL;
+      n = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return n;
+#undef Q_TMPL
+}
+
+/* ---------------------------- Library federation ------------------------- */
+
+/* A replica instance gets its library from a primary instance, see
+ * library/federation.c. The rows are copied as they are in the primary's
+ * tables, so that ids (and therefore e.g. the queue and DAAP clients) are the
+ * same on all instances. The replica knows the column names from the rows it
+ * gets, so the instances must have the same schema version.
+ */
+
+// The tables a replica gets rows for, in the order they must be saved in
+static const char *db_replica_tables[] =
+  {
+    "directories", "files", "playlists", "playlistitems",
+  };
+
+// The last upsert statement, which is reused as long as the table and the
+// columns don't change
+struct db_replica_save
+{
+  char *query;
+  sqlite3_stmt *stmt;
+};
+
+static __thread struct db_replica_save db_replica_save;
+
+static int
+db_replica_rows_run(const char *table, char *query, db_replica_row_cb cb, void *arg, uint32_t *last_id)
+{
+  sqlite3_stmt *stmt;
+  const char *cols[DB_REPLICA_COLS_MAX];
+  const char *values[DB_REPLICA_COLS_MAX];
+  int ncols;
+  int n;
+  int i;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      free(query);
+      return -1;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+  if (ncols > DB_REPLICA_COLS_MAX)
+    {
+      DPRINTF(E_LOG, L_DB, "Table %s has too many columns for replication (%d)\n", table, ncols);
+      sqlite3_finalize(stmt);
+      free(query);
+      return -1;
+    }
+
+  for (i = 0; i < ncols; i++)
+    cols[i] = sqlite3_column_name(stmt, i);
+
+  n = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      for (i = 0; i < ncols; i++)
+	values[i] = (const char *)sqlite3_column_text(stmt, i);
+
+      // The rows are ordered by id, which is the first column
+      if (last_id)
+	*last_id = sqlite3_column_int64(stmt, 0);
+
+      cb(table, ncols, cols, values, arg);
+      n++;
+    }
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+      n = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  free(query);
+  return n;
+}
+
+int
+db_replica_snapshot_get(db_replica_row_cb cb, void *arg, uint32_t *last_id, bool *done, uint32_t after_id, int limit)
+{
+#define Q_DIRS "SELECT * FROM directories WHERE id >= %d ORDER BY id;"
+#define Q_FILES "SELECT * FROM files WHERE id > %u ORDER BY id LIMIT %d;"
+#define Q_PL "SELECT * FROM playlists WHERE type <> %d ORDER BY id;"
+#define Q_PLITEMS "SELECT * FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists WHERE type <> %d) ORDER BY id;"
+  int n;
+
+  *last_id = after_id;
+  *done = false;
+
+  // The directories with the first page, the playlists with the last
+  if (after_id == 0 && db_replica_rows_run("directories", db_mprintf(Q_DIRS, DIR_MAX), cb, arg, NULL) < 0)
+    return -1;
+
+  n = db_replica_rows_run("files", db_mprintf(Q_FILES, after_id, limit), cb, arg, last_id);
+  if (n < 0)
+    return -1;
+
+  if (n == limit)
+    return 0;
+
+  if (db_replica_rows_run("playlists", db_mprintf(Q_PL, PL_SPECIAL), cb, arg, NULL) < 0)
+    return -1;
+  if (db_replica_rows_run("playlistitems", db_mprintf(Q_PLITEMS, PL_SPECIAL), cb, arg, NULL) < 0)
+    return -1;
+
+  *done = true;
+  return 0;
+#undef Q_DIRS
+#undef Q_FILES
+#undef Q_PL
+#undef Q_PLITEMS
+}
+
+int
+db_replica_delta_get(db_replica_row_cb cb, void *arg, int64_t since, int64_t until)
+{
+#define Q_CHANGED "SELECT item_id FROM changes WHERE item_type = %d AND id > %" PRIi64 " AND id <= %" PRIi64
+// The directories of the changed files and playlists and their parents
+#define Q_DIRS "WITH RECURSIVE d(id) AS (" \
+               "SELECT directory_id FROM files WHERE id IN (%s) UNION SELECT directory_id FROM playlists WHERE id IN (%s)" \
+               " UNION SELECT dir.parent_id FROM directories dir JOIN d ON dir.id = d.id)" \
+               " SELECT * FROM directories WHERE id IN d AND id >= %d ORDER BY id;"
+#define Q_FILES "SELECT * FROM files WHERE id IN (%s) ORDER BY id;"
+#define Q_PL "SELECT * FROM playlists WHERE id IN (%s) AND type <> %d ORDER BY id;"
+#define Q_PLITEMS "SELECT * FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists WHERE id IN (%s) AND type <> %d) ORDER BY id;"
+  char *files;
+  char *playlists;
+  int ret;
+
+  CHECK_NULL(L_DB, files = db_mprintf(Q_CHANGED, DB_CHANGE_FILE, since, until));
+  CHECK_NULL(L_DB, playlists = db_mprintf(Q_CHANGED, DB_CHANGE_PLAYLIST, since, until));
+
+  ret = db_replica_rows_run("directories", db_mprintf(Q_DIRS, files, playlists, DIR_MAX), cb, arg, NULL);
+  if (ret >= 0)
+    ret = db_replica_rows_run("files", db_mprintf(Q_FILES, files), cb, arg, NULL);
+  if (ret >= 0)
+    ret = db_replica_rows_run("playlists", db_mprintf(Q_PL, playlists, PL_SPECIAL), cb, arg, NULL);
+  if (ret >= 0)
+    ret = db_replica_rows_run("playlistitems", db_mprintf(Q_PLITEMS, playlists, PL_SPECIAL), cb, arg, NULL);
+
+  free(files);
+  free(playlists);
+  return (ret < 0) ? -1 : 0;
+#undef Q_CHANGED
+#undef Q_DIRS
+#undef Q_FILES
+#undef Q_PL
+#undef Q_PLITEMS
+}
+
+static bool
+db_replica_name_is_valid(const char *name)
+{
+  if (!*name)
+    return false;
+
+  for (; *name; name++)
+    {
+      if (!isalnum((unsigned char)*name) && *name != '_')
+	return false;
+    }
+
+  return true;
+}
+
+// Makes "INSERT INTO t (id, a, b) VALUES (?, ?, ?) ON CONFLICT(id) DO UPDATE
+// SET a = excluded.a, b = excluded.b;". An upsert instead of INSERT OR REPLACE,
+// since that wouldn't run the delete triggers of the old row.
+static char *
+db_replica_upsert_make(const char *table, int ncols, const char **cols)
+{
+  char keystr[2048];
+  char valstr[512];
+  char updstr[4096];
+  bool has_id = false;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_replica_tables); i++)
+    {
+      if (strcmp(table, db_replica_tables[i]) == 0)
+	break;
+    }
+
+  if (i == ARRAY_SIZE(db_replica_tables))
+    {
+      DPRINTF(E_LOG, L_DB, "Replication of table '%s' is not supported\n", table);
+      return NULL;
+    }
+
+  memset(keystr, 0, sizeof(keystr));
+  memset(valstr, 0, sizeof(valstr));
+  memset(updstr, 0, sizeof(updstr));
+  for (i = 0; i < ncols; i++)
+    {
+      if (!db_replica_name_is_valid(cols[i]))
+	{
+	  DPRINTF(E_LOG, L_DB, "Invalid column name in replicated rows of table %s\n", table);
+	  return NULL;
+	}
+
+      if (safe_snprintf_cat(keystr, sizeof(keystr), "%s%s", i ? ", " : "", cols[i]) < 0 ||
+	  safe_snprintf_cat(valstr, sizeof(valstr), "%s?", i ? ", " : "") < 0)
+	goto too_long;
+
+      if (strcmp(cols[i], "id") == 0)
+	has_id = true;
+      else if (safe_snprintf_cat(updstr, sizeof(updstr), "%s%s = excluded.%s", updstr[0] ? ", " : "", cols[i], cols[i]) < 0)
+	goto too_long;
+    }
+
+  if (!has_id || !updstr[0])
+    {
+      DPRINTF(E_LOG, L_DB, "Replicated rows of table %s must have an id and other columns\n", table);
+      return NULL;
+    }
+
+  return db_mprintf("INSERT INTO %s (%s) VALUES (%s) ON CONFLICT(id) DO UPDATE SET %s;", table, keystr, valstr, updstr);
+
+ too_long:
+  DPRINTF(E_LOG, L_DB, "Too many columns in replicated rows of table %s\n", table);
+  return NULL;
+}
+
+int
+db_replica_row_save(const char *table, int ncols, const char **cols, const char **values)
+{
+  char *query;
+  int ret;
+  int i;
+
+  query = db_replica_upsert_make(table, ncols, cols);
+  if (!query)
+    return -1;
+
+  if (db_replica_save.query && strcmp(db_replica_save.query, query) == 0)
+    free(query);
+  else
+    {
+      if (db_replica_save.stmt)
+	sqlite3_finalize(db_replica_save.stmt);
+      free(db_replica_save.query);
+      memset(&db_replica_save, 0, sizeof(struct db_replica_save));
+
+      ret = db_blocking_prepare_v2(query, -1, &db_replica_save.stmt, NULL);
+      if (ret != SQLITE_OK)
+	{
+	  // Most likely the primary has a different schema version
+	  DPRINTF(E_LOG, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+	  free(query);
+	  return -1;
+	}
+
+      db_replica_save.query = query;
+    }
+
+  // Column affinity makes integers of the values that are integer columns
+  for (i = 0; i < ncols; i++)
+    {
+      if (values[i])
+	sqlite3_bind_text(db_replica_save.stmt, i + 1, values[i], -1, SQLITE_STATIC);
+      else
+	sqlite3_bind_null(db_replica_save.stmt, i + 1);
+    }
+
+  ret = db_statement_run(db_replica_save.stmt, 0);
+  return (ret < 0) ? -1 : 0;
+}
+
+int
+db_replica_item_delete(enum db_change_item_type type, uint32_t id)
+{
+#define Q_TMPL "DELETE FROM files WHERE id = %u;"
+  char *query;
+
+  if (type == DB_CHANGE_PLAYLIST)
+    {
+      db_pl_delete(id);
+      return 0;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_replica_playlistitems_clear(uint32_t playlist_id)
+{
+#define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = %u;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, playlist_id);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 static int
 db_get_one_int(const char *query)
 {
@@ -1914,6 +2885,10 @@ db_transaction_begin(void)
   char *errmsg;
   int ret;
 
+  // Explicit transactions take precedence over an open write batch
+  if (db_write_batch.in_transaction)
+    db_write_batch_flush();
+
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
   ret = db_exec(query, &errmsg);
@@ -1941,6 +2916,8 @@ db_transaction_end(void)
 
       sqlite3_free(errmsg);
     }
+
+  db_dirtree_committed();
 }
 
 void
@@ -1961,31 +2938,315 @@ db_transaction_rollback(void)
     }
 }
 
-static void
-db_free_query_clause(struct query_clause *qc)
+/* Write batching
+ *
+ * While a library scan is running, single inserts/updates of files would each
+ * be committed in their own implicit transaction, so the scan ends up waiting
+ * for fsync. Instead, each write joins a batch transaction which is committed
+ * when it has reached a number of writes or a time limit. Writes that are
+ * already part of an explicit transaction are left alone.
+ */
+void
+db_write_batch_begin(void)
 {
-  if (!qc)
-    return;
+  cfg_t *sqlite_cfg = cfg_getsec(cfg, "sqlite");
 
-  sqlite3_free(qc->where);
-  sqlite3_free(qc->group);
-  sqlite3_free(qc->having);
-  sqlite3_free(qc->order);
-  sqlite3_free(qc->index);
-  free(qc);
+  memset(&db_write_batch, 0, sizeof(struct db_write_batch));
+
+  db_write_batch.size = cfg_getint(sqlite_cfg, "write_batch_size");
+  db_write_batch.interval_ms = cfg_getint(sqlite_cfg, "write_batch_interval");
+  db_write_batch.enabled = (db_write_batch.size > 1);
 }
 
-// Builds the generic parts of the query. Parts that are specific to the query
-// type are in db_build_query_* implementations.
-static struct query_clause *
-db_build_query_clause(struct query_params *qp)
+void
+db_write_batch_flush(void)
 {
-  struct query_clause *qc;
+  char *errmsg;
+  int ret;
+
+  if (!db_write_batch.in_transaction)
+    return;
+
+  db_write_batch.in_transaction = false;
+
+  // Someone else ended our transaction, nothing to commit
+  if (sqlite3_get_autocommit(hdl))
+    return;
+
+  DPRINTF(E_DBG, L_DB, "Committing write batch (%d writes)\n", db_write_batch.count);
+
+  ret = db_exec("END TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not commit write batch: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+    }
+
+  db_dirtree_committed();
+}
+
+void
+db_write_batch_end(void)
+{
+  db_write_batch_flush();
+
+  db_write_batch.enabled = false;
+}
+
+static void
+db_write_batch_prepare(void)
+{
+  char *errmsg;
+  int ret;
+
+  if (!db_write_batch.enabled || db_write_batch.in_transaction || !sqlite3_get_autocommit(hdl))
+    return;
+
+  ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start write batch: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return;
+    }
+
+  db_write_batch.in_transaction = true;
+  db_write_batch.count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &db_write_batch.start);
+}
+
+static void
+db_write_batch_commit_check(void)
+{
+  struct timespec now;
+  int64_t elapsed_ms;
+
+  if (!db_write_batch.in_transaction)
+    return;
+
+  db_write_batch.count++;
+  if (db_write_batch.count >= db_write_batch.size)
+    {
+      db_write_batch_flush();
+      return;
+    }
+
+  if (db_write_batch.interval_ms <= 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed_ms = (int64_t)(now.tv_sec - db_write_batch.start.tv_sec) * 1000 + (now.tv_nsec - db_write_batch.start.tv_nsec) / 1000000;
+  if (elapsed_ms >= db_write_batch.interval_ms)
+    db_write_batch_flush();
+}
+
+static void
+db_free_query_clause(struct query_clause *qc)
+{
+  if (!qc)
+    return;
+
+  sqlite3_free(qc->where);
+  sqlite3_free(qc->group);
+  sqlite3_free(qc->having);
+  sqlite3_free(qc->order);
+  sqlite3_free(qc->index);
+  sqlite3_free(qc->keyset);
+  sqlite3_free(qc->cols);
+  free(qc);
+}
+
+static bool
+db_query_col_wanted(const uint64_t cols[], int i)
+{
+  return cols[i / 64] & ((uint64_t)1 << (i % 64));
+}
+
+static bool
+db_query_cols_empty(const uint64_t cols[])
+{
+  int i;
+
+  for (i = 0; i < DB_QUERY_COLS_WORDS; i++)
+    {
+      if (cols[i])
+	return false;
+    }
+
+  return true;
+}
+
+/*
+ * Adds the column for the given field of struct db_media_file_info to the
+ * columns fetched by file queries. Unknown offsets are ignored.
+ */
+void
+db_query_cols_add(struct query_params *qp, ssize_t dbmfi_offset)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(dbmfi_cols_map); i++)
+    {
+      if (dbmfi_cols_map[i] == dbmfi_offset)
+	{
+	  qp->cols[i / 64] |= (uint64_t)1 << (i % 64);
+	  return;
+	}
+    }
+}
+
+// Returns the select list for file queries, e.g. "f.id, f.title"
+static char *
+db_build_query_cols(struct query_params *qp)
+{
+  char *cols;
+  char *tmp;
+  int i;
+
+  if (db_query_cols_empty(qp->cols))
+    return sqlite3_mprintf("f.*");
+
+  // Needed by db_query_fetch_file() for keyset paging, and id is always useful
+  db_query_cols_add(qp, dbmfi_offsetof(id));
+  if (qp->idx_type == I_KEYSET)
+    db_query_cols_add(qp, dbmfi_offsetof(title_sort));
+
+  cols = NULL;
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (!db_query_col_wanted(qp->cols, i))
+	continue;
+
+      tmp = cols;
+      cols = tmp ? sqlite3_mprintf("%s, f.%s", tmp, mfi_cols_map[i].name) : sqlite3_mprintf("f.%s", mfi_cols_map[i].name);
+      sqlite3_free(tmp);
+      if (!cols)
+	return NULL;
+    }
+
+  return cols;
+}
+
+// The trigram tokenizer can't match terms shorter than 3 characters
+#define DB_FTS_TERM_MIN 3
+
+static char *
+db_build_search_filter(const char *filter, const char *search, const char *field)
+{
+  char *match;
+  char *clause;
+  const char *ptr;
+  int len;
+
+  if (!field)
+    return NULL;
+
+  // Number of UTF-8 characters (doesn't count continuation bytes)
+  for (ptr = search, len = 0; *ptr; ptr++)
+    {
+      if ((*ptr & 0xC0) != 0x80)
+	len++;
+    }
+
+  if (db_fts_enabled && len >= DB_FTS_TERM_MIN)
+    {
+      // Column filter + the term as an FTS5 string, so no FTS5 query syntax
+      // in the search term is interpreted. %w doubles any '"'.
+      match = sqlite3_mprintf("{%s} : \"%w\"", field, search);
+      clause = sqlite3_mprintf("f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH %Q)", match);
+      sqlite3_free(match);
+    }
+  else
+    clause = sqlite3_mprintf("f.%s LIKE '%%%q%%'", field, search);
+
+  if (!clause || !filter)
+    return clause;
+
+  match = clause;
+  clause = sqlite3_mprintf("%s AND %s", filter, match);
+  sqlite3_free(match);
+
+  return clause;
+}
+
+static const struct keyset_clause *
+db_keyset_clause_get(struct query_params *qp)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(keyset_clause); i++)
+    {
+      if (keyset_clause[i].type == qp->type && keyset_clause[i].sort == qp->sort)
+	return &keyset_clause[i];
+    }
+
+  return NULL;
+}
+
+// Adds the keyset condition to the where clause, written out (instead of using
+// a row value) so it also works with older SQLite versions
+static char *
+db_build_keyset_filter(struct query_params *qp, const struct keyset_clause *kc, const char *where)
+{
+  const char *op = (where[0] == '\0') ? "WHERE" : "AND";
+
+  if (!qp->keyset_value && qp->keyset_id == 0)
+    return sqlite3_mprintf("");
+  else if (!qp->keyset_value)
+    return sqlite3_mprintf("%s (%s IS NOT NULL OR (%s IS NULL AND %s > %" PRIi64 "))",
+                           op, kc->col, kc->col, kc->id, qp->keyset_id);
+  else
+    return sqlite3_mprintf("%s (%s > %Q OR (%s = %Q AND %s > %" PRIi64 "))",
+                           op, kc->col, qp->keyset_value, kc->col, qp->keyset_value, kc->id, qp->keyset_id);
+}
+
+// Records the key of the last row fetched, so the next page can continue there
+static void
+db_keyset_update(struct query_params *qp, const char *value, const char *id)
+{
+  free(qp->keyset_value);
+  qp->keyset_value = safe_strdup(value);
+
+  if (!id || safe_atoi64(id, &qp->keyset_id) < 0)
+    qp->keyset_id = 0;
+}
+
+// Builds the generic parts of the query. Parts that are specific to the query
+// type are in db_build_query_* implementations.
+static struct query_clause *
+db_build_query_clause(struct query_params *qp)
+{
+  const struct keyset_clause *kc = NULL;
+  struct query_clause *qc;
+  char *search_filter = NULL;
+  const char *filter;
 
   qc = calloc(1, sizeof(struct query_clause));
   if (!qc)
     goto error;
 
+  if (qp->idx_type == I_KEYSET)
+    {
+      kc = db_keyset_clause_get(qp);
+      if (!kc)
+	{
+	  DPRINTF(E_LOG, L_DB, "Keyset paging not supported for query type %d with sort %d\n", qp->type, qp->sort);
+	  goto error;
+	}
+    }
+
+  filter = qp->filter;
+  if (qp->search)
+    {
+      search_filter = db_build_search_filter(qp->filter, qp->search, qp->search_field);
+      if (!search_filter)
+	goto error;
+
+      filter = search_filter;
+    }
+
   if (qp->type & Q_F_BROWSE)
     qc->group = sqlite3_mprintf("GROUP BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
   else if (qp->group)
@@ -1993,21 +3254,31 @@ db_build_query_clause(struct query_params *qp)
   else
     qc->group = sqlite3_mprintf("");
 
-  if (qp->filter && !qp->with_disabled)
-    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", qp->filter);
+  if (filter && !qp->with_disabled)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", filter);
   else if (!qp->with_disabled)
     qc->where = sqlite3_mprintf("WHERE f.disabled = 0");
-  else if (qp->filter)
-    qc->where = sqlite3_mprintf("WHERE %s", qp->filter);
+  else if (filter)
+    qc->where = sqlite3_mprintf("WHERE %s", filter);
   else
     qc->where = sqlite3_mprintf("");
 
+  sqlite3_free(search_filter);
+  search_filter = NULL;
+
   if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
     qc->having = sqlite3_mprintf("HAVING %s", qp->having);
   else
     qc->having = sqlite3_mprintf("");
 
-  if (qp->order)
+  if (kc)
+    qc->keyset = db_build_keyset_filter(qp, kc, qc->where);
+  else
+    qc->keyset = sqlite3_mprintf("");
+
+  if (kc)
+    qc->order = sqlite3_mprintf("ORDER BY %s, %s", kc->col, kc->id);
+  else if (qp->order)
     qc->order = sqlite3_mprintf("ORDER BY %s", qp->order);
   else if (qp->sort)
     qc->order = sqlite3_mprintf("ORDER BY %s", sort_clause[qp->sort]);
@@ -2036,18 +3307,28 @@ db_build_query_clause(struct query_params *qp)
 	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->offset);
 	break;
 
+      case I_KEYSET:
+	if (qp->limit)
+	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
+	else
+	  qc->index = sqlite3_mprintf("");
+	break;
+
       case I_NONE:
 	qc->index = sqlite3_mprintf("");
 	break;
     }
 
-  if (!qc->where || !qc->index)
+  qc->cols = db_build_query_cols(qp);
+
+  if (!qc->where || !qc->index || !qc->keyset || !qc->cols)
     goto error;
 
   return qc;
 
  error:
   DPRINTF(E_LOG, L_DB, "Error building query clause\n");
+  sqlite3_free(search_filter);
   db_free_query_clause(qc);
   return NULL;
 }
@@ -2087,17 +3368,17 @@ db_build_query_items(struct query_params *qp, struct query_clause *qc)
   if (qp->id == 0)
     {
       count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
-      query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s;", qc->where, qc->group, qc->order, qc->index);
+      query = sqlite3_mprintf("SELECT %s FROM files f %s %s %s %s %s;", qc->cols, qc->where, qc->keyset, qc->group, qc->order, qc->index);
     }
   else if (qc->where[0] == '\0')
     {
       count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.id = %d;", qp->id);
-      query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.id = %d %s %s %s;", qp->id, qc->group, qc->order, qc->index);
+      query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.id = %d %s %s %s;", qc->cols, qp->id, qc->group, qc->order, qc->index);
     }
   else
     {
       count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.id = %d;", qc->where, qp->id);
-      query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.id = %d %s %s %s;", qc->where, qp->id, qc->group, qc->order, qc->index);
+      query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.id = %d %s %s %s;", qc->cols, qc->where, qp->id, qc->group, qc->order, qc->index);
     }
 
   return db_build_query_check(qp, count, query);
@@ -2138,7 +3419,127 @@ db_build_query_plitems_plain(struct query_params *qp, struct query_clause *qc)
   char *query;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d;", qc->where, qp->id);
-  query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->where, qp->id, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->cols, qc->where, qp->id, qc->index);
+
+  return db_build_query_check(qp, count, query);
+}
+
+// Makes sure the smartplitems table holds the current result of the smart
+// playlist's rules, ordered and limited like the playlist itself. The result
+// is kept until the library changes (DB_ADMIN_DB_MODIFIED) or the rules are
+// changed, and if the rules are relative to the current date it also expires
+// after db_smartpl_cache_refresh seconds. Returns 0 if the table can be used.
+static int
+db_smartpl_materialize(struct playlist_info *pli)
+{
+#define Q_FRESH "SELECT COUNT(*) FROM smartpls WHERE playlistid = %d AND query = %Q AND query_order IS %Q AND query_limit = %d AND db_modified = %" PRIi64 " AND (expires = 0 OR expires > %" PRIi64 ");"
+#define Q_CLEAR_STATE "DELETE FROM smartpls WHERE playlistid = %d;"
+#define Q_CLEAR_ITEMS "DELETE FROM smartplitems WHERE playlistid = %d;"
+#define Q_ITEMS "INSERT INTO smartplitems (playlistid, fileid) SELECT %d, f.id FROM files f WHERE f.disabled = 0 AND %s %s %s LIMIT %d;"
+#define Q_STATE "INSERT INTO smartpls (playlistid, query, query_order, query_limit, db_modified, expires) VALUES (%d, %Q, %Q, %d, %" PRIi64 ", %" PRIi64 ");"
+  char *query;
+  int64_t modified;
+  int64_t expires;
+  time_t now;
+  int ret;
+
+  if (!pli->query)
+    return -1;
+
+  ret = db_admin_getint64(&modified, DB_ADMIN_DB_MODIFIED);
+  if (ret < 0)
+    modified = 0;
+
+  now = time(NULL);
+
+  query = sqlite3_mprintf(Q_FRESH, pli->id, pli->query, pli->query_order, pli->query_limit, modified, (int64_t)now);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_get_one_int(query);
+  sqlite3_free(query);
+  if (ret == 1)
+    return 0;
+
+  DPRINTF(E_DBG, L_DB, "Evaluating rules of smart playlist '%s'\n", pli->path);
+
+  // The stamp has a resolution of a second, so a change in the same second as
+  // the evaluation would go unnoticed. Store an invalid stamp in that case, so
+  // the rules are evaluated again next time.
+  if (modified >= now)
+    modified = -1;
+
+  expires = strstr(pli->query, "'now'") ? (int64_t)now + db_smartpl_cache_refresh : 0;
+
+  db_transaction_begin();
+
+  query = sqlite3_mprintf(Q_CLEAR_STATE, pli->id);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto error;
+
+  query = sqlite3_mprintf(Q_CLEAR_ITEMS, pli->id);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto error;
+
+  query = sqlite3_mprintf(Q_ITEMS, pli->id, pli->query, pli->query_order ? "ORDER BY" : "", pli->query_order ? pli->query_order : "",
+			  pli->query_limit > 0 ? pli->query_limit : -1);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto error;
+
+  query = sqlite3_mprintf(Q_STATE, pli->id, pli->query, pli->query_order, pli->query_limit, modified, expires);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto error;
+
+  db_transaction_end();
+
+  return 0;
+
+ error:
+  db_transaction_rollback();
+  return -1;
+#undef Q_STATE
+#undef Q_ITEMS
+#undef Q_CLEAR_ITEMS
+#undef Q_CLEAR_STATE
+#undef Q_FRESH
+}
+
+// Query of the materialized result of a smart playlist, see above. The limit
+// and order of the playlist are already applied to the result, so this is only
+// equivalent to querying the rules directly if the caller doesn't filter or
+// sort the playlist, or if the playlist has no limit.
+static char *
+db_build_query_plitems_smartcache(struct query_params *qp, struct playlist_info *pli)
+{
+  struct query_clause *qc;
+  char *count;
+  char *query;
+
+  if (!db_smartpl_cache || pli->type != PL_SMART || qp->with_disabled)
+    return NULL;
+
+  if (pli->query_limit > 0 && (qp->filter || qp->search || qp->order || qp->sort != S_NONE || qp->idx_type == I_KEYSET))
+    return NULL;
+
+  if (db_smartpl_materialize(pli) < 0)
+    return NULL;
+
+  qc = db_build_query_clause(qp);
+  if (!qc)
+    return NULL;
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN smartplitems si ON f.id = si.fileid %s AND si.playlistid = %d;", qc->where, pli->id);
+  query = sqlite3_mprintf("SELECT %s FROM files f JOIN smartplitems si ON f.id = si.fileid %s AND si.playlistid = %d %s %s;",
+			  qc->cols, qc->where, pli->id, qc->order[0] ? qc->order : "ORDER BY si.id ASC", qc->index);
+
+  db_free_query_clause(qc);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2191,7 +3592,7 @@ db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
     return NULL;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND %s LIMIT %d;", qc->where, pli->query, pli->query_limit ? pli->query_limit : -1);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s AND %s %s %s;", qc->where, pli->query, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f %s AND %s %s %s;", qc->cols, qc->where, pli->query, qc->order, qc->index);
 
   db_free_query_clause(qc);
 
@@ -2218,7 +3619,9 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
     {
       case PL_SPECIAL:
       case PL_SMART:
-	query = db_build_query_plitems_smart(qp, pli);
+	query = db_build_query_plitems_smartcache(qp, pli);
+	if (!query)
+	  query = db_build_query_plitems_smart(qp, pli);
 	break;
 
       case PL_RSS:
@@ -2251,8 +3654,8 @@ db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
 			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s " \
-			  "GROUP BY f.songalbumid %s %s %s;", qc->where, qc->having, qc->order, qc->index);
+			  "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s %s " \
+			  "GROUP BY f.songalbumid %s %s %s;", qc->where, qc->keyset, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2270,9 +3673,9 @@ db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
 			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s " \
+			  "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s %s " \
 			  "GROUP BY f.songartistid %s %s %s;",
-			  qc->where, qc->having, qc->order, qc->index);
+			  qc->where, qc->keyset, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2290,12 +3693,12 @@ db_build_query_group_items(struct query_params *qp, struct query_clause *qc)
     {
       case G_ALBUMS:
 	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->cols, qc->where, qp->persistentid, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
 	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->cols, qc->where, qp->persistentid, qc->order, qc->index);
 	break;
 
       default:
@@ -2375,20 +3778,16 @@ db_build_query_count_items(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
-int
-db_query_start(struct query_params *qp)
+// Returns the query string for the given parameters, and sets qp->results
+static char *
+db_build_query(struct query_params *qp)
 {
   struct query_clause *qc;
-  sqlite3_stmt *stmt;
   char *query;
-  int ret;
-
-  qp->stmt = NULL;
-  qp->results = -1;
 
   qc = db_build_query_clause(qp);
   if (!qc)
-    return -1;
+    return NULL;
 
   switch (qp->type)
     {
@@ -2438,12 +3837,23 @@ db_query_start(struct query_params *qp)
   db_free_query_clause(qc);
 
   if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not create query, unknown type %d\n", qp->type);
-      return -1;
-    }
+    DPRINTF(E_LOG, L_DB, "Could not create query, unknown type %d\n", qp->type);
 
-  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
+  return query;
+}
+
+static int
+db_query_start_impl(struct query_params *qp)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = db_build_query(qp);
+  if (!query)
+    return -1;
+
+  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
   ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
@@ -2461,12 +3871,48 @@ db_query_start(struct query_params *qp)
   return 0;
 }
 
+int
+db_query_start(struct query_params *qp)
+{
+  struct trace_span span;
+  sqlite3 *hdl_rw;
+  uint64_t start;
+  int ret;
+  MEM_TAG_SCOPE(MEM_TAG_DB);
+
+  qp->stmt = NULL;
+  qp->results = -1;
+  qp->rows = 0;
+
+  trace_begin(&span, "db", "db_query_start");
+  start = db_usec_now();
+
+  // Use the read-only connection, unless we are in a transaction, since then
+  // the caller may expect to see its own changes. The statement stays valid
+  // after switching back, so fetching works on either connection.
+  hdl_rw = hdl;
+  if (hdl_ro && sqlite3_get_autocommit(hdl))
+    hdl = hdl_ro;
+
+  ret = db_query_start_impl(qp);
+
+  hdl = hdl_rw;
+
+  // Includes building the query, which may also count the results
+  qp->elapsed_usec = db_usec_now() - start;
+  trace_end(&span);
+
+  return ret;
+}
+
 void
 db_query_end(struct query_params *qp)
 {
   if (!qp->stmt)
     return;
 
+  db_query_profile(qp->stmt, db_query_stats_index(qp->type), qp->elapsed_usec, qp->rows);
+
   sqlite3_finalize(qp->stmt);
   qp->stmt = NULL;
 }
@@ -2516,12 +3962,32 @@ db_query_run(char *query, int free, short update_events)
   return ((ret != SQLITE_OK) ? -1 : 0);
 }
 
+// Steps a query started with db_query_start() and adds the time to its total
+static int
+db_query_step(struct query_params *qp)
+{
+  uint64_t start;
+  int ret;
+
+  start = db_usec_now();
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_ROW)
+    qp->rows++;
+
+  qp->elapsed_usec += db_usec_now() - start;
+
+  return ret;
+}
+
+// If cols is not NULL the query only has the columns that have their bit set
 static int
-db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], int size)
+db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], int size, const uint64_t *cols)
 {
   int ncols;
   char **strcol;
   int i;
+  int n;
   int ret;
 
   if (!qp->stmt)
@@ -2530,7 +3996,7 @@ db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], in
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results\n");
@@ -2544,6 +4010,21 @@ db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], in
 
   ncols = sqlite3_column_count(qp->stmt);
 
+  if (cols)
+    {
+      for (i = 0, n = 0; i < size && n < ncols; i++)
+	{
+	  if (!db_query_col_wanted(cols, i))
+	    continue;
+
+	  strcol = (char **) ((char *)item + cols_map[i]);
+
+	  *strcol = (char *)sqlite3_column_text(qp->stmt, n++);
+	}
+
+      return 0;
+    }
+
   // We allow more cols in db than in map because the db may be a future schema
   if (ncols < size)
     {
@@ -2574,10 +4055,13 @@ db_query_fetch_file(struct db_media_file_info *dbmfi, struct query_params *qp)
       return -1;
     }
 
-  ret = db_query_fetch(dbmfi, qp, dbmfi_cols_map, ARRAY_SIZE(dbmfi_cols_map));
+  ret = db_query_fetch(dbmfi, qp, dbmfi_cols_map, ARRAY_SIZE(dbmfi_cols_map), db_query_cols_empty(qp->cols) ? NULL : qp->cols);
   if (ret < 0) {
       DPRINTF(E_LOG, L_DB, "Failed to fetch db_media_file_info\n");
   }
+  else if (ret == 0 && qp->idx_type == I_KEYSET)
+    db_keyset_update(qp, dbmfi->title_sort, dbmfi->id);
+
   return ret;
 }
 
@@ -2606,7 +4090,7 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results\n");
@@ -2661,10 +4145,13 @@ db_query_fetch_group(struct db_group_info *dbgri, struct query_params *qp)
       return -1;
     }
 
-  ret = db_query_fetch(dbgri, qp, dbgri_cols_map, ARRAY_SIZE(dbgri_cols_map));
+  ret = db_query_fetch(dbgri, qp, dbgri_cols_map, ARRAY_SIZE(dbgri_cols_map), NULL);
   if (ret < 0) {
       DPRINTF(E_LOG, L_DB, "Failed to fetch db_group_info\n");
   }
+  else if (ret == 0 && qp->idx_type == I_KEYSET)
+    db_keyset_update(qp, dbgri->itemname_sort, dbgri->persistentid);
+
   return ret;
 }
 
@@ -2681,7 +4168,7 @@ db_query_fetch_browse(struct db_browse_info *dbbi, struct query_params *qp)
       return -1;
     }
 
-  ret = db_query_fetch(dbbi, qp, dbbi_cols_map, ARRAY_SIZE(dbbi_cols_map));
+  ret = db_query_fetch(dbbi, qp, dbbi_cols_map, ARRAY_SIZE(dbbi_cols_map), NULL);
   if (ret < 0) {
       DPRINTF(E_LOG, L_DB, "Failed to fetch db_browse_info\n");
   }
@@ -2707,7 +4194,7 @@ db_query_fetch_count(struct filecount_info *fci, struct query_params *qp)
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results for count query\n");
@@ -2728,11 +4215,47 @@ db_query_fetch_count(struct filecount_info *fci, struct query_params *qp)
   return 0;
 }
 
+// Totals for the whole library from the counters kept by the trg_counters_*
+// triggers, so no need to scan the files table
+static int
+db_filecount_get_counters(struct filecount_info *fci)
+{
+  int count;
+  int artist_count;
+  int album_count;
+  int64_t length;
+  int64_t file_size;
+
+  if (db_admin_getint(&count, DB_ADMIN_FILES_COUNT) < 0 ||
+      db_admin_getint(&artist_count, DB_ADMIN_ARTISTS_COUNT) < 0 ||
+      db_admin_getint(&album_count, DB_ADMIN_ALBUMS_COUNT) < 0 ||
+      db_admin_getint64(&length, DB_ADMIN_FILES_LENGTH) < 0 ||
+      db_admin_getint64(&file_size, DB_ADMIN_FILES_SIZE) < 0)
+    return -1;
+
+  fci->count = count;
+  fci->length = length;
+  fci->artist_count = artist_count;
+  fci->album_count = album_count;
+  fci->file_size = file_size;
+
+  return 0;
+}
+
 int
 db_filecount_get(struct filecount_info *fci, struct query_params *qp)
 {
   int ret;
 
+  if (qp->type == Q_COUNT_ITEMS && !qp->filter && !qp->search && !qp->with_disabled)
+    {
+      ret = db_filecount_get_counters(fci);
+      if (ret == 0)
+	return 0;
+
+      DPRINTF(E_WARN, L_DB, "Library counters not available, falling back to query\n");
+    }
+
   ret = db_query_start(qp);
   if (ret < 0)
     {
@@ -2766,7 +4289,7 @@ db_query_fetch_string(char **string, struct query_params *qp)
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results\n");
@@ -2803,7 +4326,7 @@ db_query_fetch_string_sort(char **string, char **sortstring, struct query_params
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results\n");
@@ -2829,8 +4352,25 @@ db_files_get_count(uint32_t *nitems, uint32_t *nstreams, const char *filter)
 {
   sqlite3_stmt *stmt = NULL;
   char *query = NULL;
+  int count;
+  int streams = 0;
   int ret;
 
+  if (!filter)
+    {
+      ret = db_admin_getint(&count, DB_ADMIN_FILES_COUNT);
+      if (ret == 0 && nstreams)
+	ret = db_admin_getint(&streams, DB_ADMIN_FILES_STREAMS);
+      if (ret == 0)
+	{
+	  if (nitems)
+	    *nitems = count;
+	  if (nstreams)
+	    *nstreams = streams;
+	  return 0;
+	}
+    }
+
   if (!filter && !nstreams)
     query = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
   else if (!filter)
@@ -3062,33 +4602,34 @@ db_file_ping_bymatch(const char *path, int isdir)
 #undef Q_TMPL_NODIR
 }
 
+// Pings the enabled files that are direct children of the given directory
+void
+db_file_ping_bydirectory(int dir_id)
+{
+#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 " WHERE disabled = 0 AND directory_id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), dir_id);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 char *
 db_file_path_byid(int id)
 {
-#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = %d;"
-  char *query;
+#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = ?;"
   sqlite3_stmt *stmt;
   char *res;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  sqlite3_bind_int(stmt, 1, id);
 
-      sqlite3_free(query);
-      return NULL;
-    }
+  db_stmt_debug(stmt);
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
@@ -3098,8 +4639,7 @@ db_file_path_byid(int id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_stmt_cache_put(stmt);
       return NULL;
     }
 
@@ -3112,8 +4652,7 @@ db_file_path_byid(int id)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_stmt_cache_put(stmt);
 
   return res;
 
@@ -3121,23 +4660,11 @@ db_file_path_byid(int id)
 }
 
 static int
-db_file_id_byquery(const char *query)
+db_file_id_bystmt(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt;
   int ret;
 
-  if (!query)
-    return 0;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      return 0;
-    }
+  db_stmt_debug(stmt);
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
@@ -3147,7 +4674,7 @@ db_file_id_byquery(const char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_cache_put(stmt);
       return 0;
     }
 
@@ -3158,7 +4685,7 @@ db_file_id_byquery(const char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
+  db_stmt_cache_put(stmt);
 
   return ret;
 }
@@ -3166,21 +4693,17 @@ db_file_id_byquery(const char *query)
 bool
 db_file_id_exists(int id)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.id = %d;"
-  char *query;
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.id = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  ret = db_file_id_byquery(query);
+  sqlite3_bind_int(stmt, 1, id);
 
-  sqlite3_free(query);
+  ret = db_file_id_bystmt(stmt);
 
   return (id == ret);
 
@@ -3190,23 +4713,16 @@ db_file_id_exists(int id)
 int
 db_file_id_bypath(const char *path)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = ?;"
+  sqlite3_stmt *stmt;
 
-  ret = db_file_id_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 
-  return ret;
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3214,23 +4730,16 @@ db_file_id_bypath(const char *path)
 int
 db_file_id_byfile(const char *filename)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, filename);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = ?;"
+  sqlite3_stmt *stmt;
 
-  ret = db_file_id_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
 
-  return ret;
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3238,23 +4747,16 @@ db_file_id_byfile(const char *filename)
 int
 db_file_id_byurl(const char *url)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, url);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = ?;"
+  sqlite3_stmt *stmt;
 
-  ret = db_file_id_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
 
-  return ret;
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3262,78 +4764,68 @@ db_file_id_byurl(const char *url)
 int
 db_file_id_byvirtualpath(const char *virtual_path)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path = %Q;"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path = ?;"
+  sqlite3_stmt *stmt;
 
-  ret = db_file_id_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
 
-  return ret;
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
 
+// Finds a file in the directory with the given virtual path. The prefix range
+// can use idx_file_vpath_fold, so that is tried before the (full scan) match
+// anywhere in the path. char(1114111) is the highest code point.
 int
 db_file_id_byvirtualpath_match(const char *virtual_path)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path LIKE '%%%q%%';"
-  char *query;
-  int ret;
+#define Q_TMPL_PREFIX "SELECT f.id FROM files f WHERE daap_fold(f.virtual_path) >= daap_fold(?1 || '/') AND daap_fold(f.virtual_path) < daap_fold(?1 || '/') || char(1114111) LIMIT 1;"
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path LIKE '%' || ? || '%';"
+  sqlite3_stmt *stmt;
+  int id;
 
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_cache_get(Q_TMPL_PREFIX);
+  if (!stmt)
+    return 0;
 
-      return 0;
-    }
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
 
-  ret = db_file_id_byquery(query);
+  id = db_file_id_bystmt(stmt);
+  if (id > 0)
+    return id;
 
-  sqlite3_free(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-  return ret;
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
+
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
+#undef Q_TMPL_PREFIX
 }
 
 static struct media_file_info *
-db_file_fetch_byquery(char *query)
+db_file_fetch_bystmt(sqlite3_stmt *stmt)
 {
   struct media_file_info *mfi;
-  sqlite3_stmt *stmt;
   int ncols;
   int i;
   int ret;
 
-  if (!query)
-    return NULL;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  db_stmt_debug(stmt);
 
   mfi = calloc(1, sizeof(struct media_file_info));
   if (!mfi)
     {
       DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
-      return NULL;
-    }
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      free(mfi);
+      db_stmt_cache_put(stmt);
       return NULL;
     }
 
@@ -3346,7 +4838,7 @@ db_file_fetch_byquery(char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_cache_put(stmt);
       free(mfi);
       return NULL;
     }
@@ -3358,7 +4850,7 @@ db_file_fetch_byquery(char *query)
     {
       DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than mfi column map (%u)\n", ncols, ARRAY_SIZE(mfi_cols_map));
 
-      sqlite3_finalize(stmt);
+      db_stmt_cache_put(stmt);
       free(mfi);
       return NULL;
     }
@@ -3373,7 +4865,7 @@ db_file_fetch_byquery(char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
+  db_stmt_cache_put(stmt);
 
   return mfi;
 }
@@ -3381,23 +4873,16 @@ db_file_fetch_byquery(char *query)
 struct media_file_info *
 db_file_fetch_byid(int id)
 {
-#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = %d;"
-  struct media_file_info *mfi;
-  char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
+#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = ?;"
+  sqlite3_stmt *stmt;
 
-  mfi = db_file_fetch_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-  sqlite3_free(query);
+  sqlite3_bind_int(stmt, 1, id);
 
-  return mfi;
+  return db_file_fetch_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3405,23 +4890,16 @@ db_file_fetch_byid(int id)
 struct media_file_info *
 db_file_fetch_byvirtualpath(const char *virtual_path)
 {
-#define Q_TMPL "SELECT f.* FROM files f WHERE f.virtual_path = %Q;"
-  struct media_file_info *mfi;
-  char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
+#define Q_TMPL "SELECT f.* FROM files f WHERE f.virtual_path = ?;"
+  sqlite3_stmt *stmt;
 
-  mfi = db_file_fetch_byquery(query);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-  sqlite3_free(query);
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
 
-  return mfi;
+  return db_file_fetch_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -3449,7 +4927,12 @@ db_file_add(struct media_file_info *mfi)
   if (ret < 0)
     return -1;
 
+  db_write_batch_prepare();
+
   ret = db_statement_run(db_statements.files_insert, 0);
+
+  db_write_batch_commit_check();
+
   if (ret < 0)
     return -1;
 
@@ -3477,7 +4960,12 @@ db_file_update(struct media_file_info *mfi)
   if (ret < 0)
     return -1;
 
+  db_write_batch_prepare();
+
   ret = db_statement_run(db_statements.files_update, 0);
+
+  db_write_batch_commit_check();
+
   if (ret < 0)
     return -1;
 
@@ -3586,12 +5074,75 @@ db_file_enable_bycookie(uint32_t cookie, const char *path, const char *filename)
 #undef Q_TMPL
 }
 
-int
-db_file_update_directoryid(const char *path, int dir_id)
+// Returns the path of a file with the given inode, size and mtime. Disabled
+// files are preferred, since they are the ones that were moved away.
+char *
+db_file_path_byinode(int *id, int64_t inode, int64_t file_size, uint32_t time_modified)
 {
-#define Q_TMPL "UPDATE files SET directory_id = %d WHERE path = %Q;"
-  char *query;
-  int ret;
+#define Q_TMPL "SELECT f.id, f.path FROM files f WHERE f.inode = ? AND f.file_size = ? AND f.time_modified = ? AND f.data_kind = 0 ORDER BY f.disabled DESC LIMIT 1;"
+  sqlite3_stmt *stmt;
+  char *res;
+  int ret;
+
+  *id = 0;
+
+  if (inode == 0)
+    return NULL;
+
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int64(stmt, 1, inode);
+  sqlite3_bind_int64(stmt, 2, file_size);
+  sqlite3_bind_int64(stmt, 3, time_modified);
+
+  db_stmt_debug(stmt);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      db_stmt_cache_put(stmt);
+      return NULL;
+    }
+
+  *id = sqlite3_column_int(stmt, 0);
+  res = (char *)sqlite3_column_text(stmt, 1);
+  if (res)
+    res = strdup(res);
+
+  db_stmt_cache_put(stmt);
+
+  return res;
+
+#undef Q_TMPL
+}
+
+// Points an existing file entry to a new path, keeping everything else
+int
+db_file_update_path(int id, const char *path, const char *fname, const char *virtual_path, int dir_id)
+{
+#define Q_TMPL "UPDATE files SET path = %Q, fname = %Q, virtual_path = %Q, directory_id = %d, disabled = 0, db_timestamp = %" PRIi64 " WHERE id = %d;"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, path, fname, virtual_path, dir_id, (int64_t)time(NULL), id);
+
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
+
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+#undef Q_TMPL
+}
+
+int
+db_file_update_directoryid(const char *path, int dir_id)
+{
+#define Q_TMPL "UPDATE files SET directory_id = %d WHERE path = %Q;"
+  char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, dir_id, path);
 
@@ -3606,7 +5157,15 @@ db_file_update_directoryid(const char *path, int dir_id)
 int
 db_pl_get_count(uint32_t *nitems)
 {
-  int ret = db_get_one_int("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+  int ret;
+
+  if (db_admin_getint(&ret, DB_ADMIN_PL_COUNT) == 0)
+    {
+      *nitems = (uint32_t)ret;
+      return 0;
+    }
+
+  ret = db_get_one_int("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
 
   if (ret < 0)
     return -1;
@@ -3660,21 +5219,30 @@ db_pl_ping_items_bymatch(const char *path, int id)
 int
 db_pl_id_bypath(const char *path)
 {
-#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return -1;
 
-      return -1;
-    }
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 
-  ret = db_get_one_int(query);
+  db_stmt_debug(stmt);
 
-  sqlite3_free(query);
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_ROW)
+    ret = sqlite3_column_int(stmt, 0);
+  else if (ret == SQLITE_DONE)
+    ret = -1;
+  else
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      ret = -1;
+    }
+
+  db_stmt_cache_put(stmt);
 
   return ret;
 
@@ -3908,6 +5476,30 @@ db_pl_add_item_bypath(int plid, const char *path)
 #undef Q_TMPL
 }
 
+// Inserts all the paths with a single multi-row statement, which is much faster
+// than a statement per item when adding large playlists
+int
+db_pl_add_items_bypath(int plid, const char **paths, int npaths)
+{
+#define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES "
+  sqlite3_str *str;
+  int i;
+
+  if (npaths <= 0)
+    return 0;
+
+  str = sqlite3_str_new(hdl);
+  sqlite3_str_appendall(str, Q_TMPL);
+
+  for (i = 0; i < npaths; i++)
+    sqlite3_str_appendf(str, "%s(%d, '%q')", (i > 0) ? ", " : "", plid, paths[i]);
+
+  sqlite3_str_appendchar(str, 1, ';');
+
+  return db_query_run(sqlite3_str_finish(str), 1, LISTENER_DATABASE);
+#undef Q_TMPL
+}
+
 int
 db_pl_add_item_byid(int plid, int fileid)
 {
@@ -3942,6 +5534,8 @@ db_pl_delete(int id)
 #define Q_TMPL "DELETE FROM playlists WHERE id = %d;"
 #define Q_ORPHAN "SELECT filepath FROM playlistitems WHERE filepath NOT IN (SELECT filepath FROM playlistitems WHERE playlistid <> %d) AND playlistid = %d"
 #define Q_FILES "DELETE FROM files WHERE data_kind = %d AND path IN (" Q_ORPHAN ");"
+#define Q_SMARTPL_ITEMS "DELETE FROM smartplitems WHERE playlistid = %d;"
+#define Q_SMARTPL "DELETE FROM smartpls WHERE playlistid = %d;"
   char *query;
   int ret;
 
@@ -3975,7 +5569,16 @@ db_pl_delete(int id)
   // Clear playlistitems
   db_pl_clear_items(id);
 
+  // Drop the materialized result if it was a smart playlist
+  query = sqlite3_mprintf(Q_SMARTPL_ITEMS, id);
+  db_query_run(query, 1, 0);
+
+  query = sqlite3_mprintf(Q_SMARTPL, id);
+  db_query_run(query, 1, 0);
+
   db_transaction_end();
+#undef Q_SMARTPL
+#undef Q_SMARTPL_ITEMS
 #undef Q_FILES
 #undef Q_ORPHAN
 #undef Q_TMPL
@@ -4074,11 +5677,14 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path)
 /* Groups */
 
 // Remove album and artist entries in the groups table that are not longer referenced from the files table
+// The file_count maintained by the groups triggers tells which groups may be
+// unreferenced, the NOT EXISTS check (using the songalbumid/songartistid
+// indices) protects against stale counts, e.g. after running an older version.
 int
 db_groups_cleanup()
 {
-#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
-#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
+#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND file_count <= 0 AND NOT EXISTS (SELECT 1 FROM files f WHERE f.songalbumid = groups.persistentid AND f.disabled = 0);"
+#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND file_count <= 0 AND NOT EXISTS (SELECT 1 FROM files f WHERE f.songartistid = groups.persistentid AND f.disabled = 0);"
   int ret;
 
   db_transaction_begin();
@@ -4223,23 +5829,35 @@ db_group_persistentid_byid(int id, int64_t *persistentid)
 int
 db_directory_id_byvirtualpath(const char *virtual_path)
 {
-#define Q_TMPL "SELECT d.id FROM directories d WHERE d.virtual_path = '%q';"
-  char *query;
-  int ret;
+#define Q_TMPL "SELECT d.id FROM directories d WHERE d.virtual_path = ?;"
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
 
-      return 0;
-    }
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
 
-  ret = db_file_id_byquery(query);
+  return db_file_id_bystmt(stmt);
 
-  sqlite3_free(query);
+#undef Q_TMPL
+}
 
-  return ret;
+// Returns the timestamp of the last scan of an enabled directory, or 0 if the
+// directory is not in the library or is disabled
+time_t
+db_directory_timestamp_byvirtualpath(const char *virtual_path)
+{
+#define Q_TMPL "SELECT d.db_timestamp FROM directories d WHERE d.virtual_path = ? AND d.disabled = 0;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, virtual_path, -1, SQLITE_STATIC);
+
+  return db_file_id_bystmt(stmt);
 
 #undef Q_TMPL
 }
@@ -4247,98 +5865,276 @@ db_directory_id_byvirtualpath(const char *virtual_path)
 int
 db_directory_id_bypath(const char *path)
 {
-#define Q_TMPL "SELECT d.id FROM directories d WHERE d.path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT d.id FROM directories d WHERE d.path = ?;"
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  return db_file_id_bystmt(stmt);
+
+#undef Q_TMPL
+}
+
+/* --------------------------- Directory tree cache ------------------------- */
+
+// If the change is in a transaction, other threads can't see it until it is
+// committed, so the tree must be invalidated again then
+static void
+db_dirtree_invalidate(void)
+{
+  __atomic_add_fetch(&db_dirtree_generation, 1, __ATOMIC_RELEASE);
+
+  if (!sqlite3_get_autocommit(hdl))
+    db_dirtree_uncommitted = true;
+}
+
+static void
+db_dirtree_committed(void)
+{
+  if (!db_dirtree_uncommitted)
+    return;
+
+  db_dirtree_uncommitted = false;
+  __atomic_add_fetch(&db_dirtree_generation, 1, __ATOMIC_RELEASE);
+}
+
+static void
+db_dirtree_free(struct db_dirtree *tree)
+{
+  int i;
+
+  if (!tree)
+    return;
+
+  for (i = 0; i < tree->count; i++)
+    {
+      free(tree->nodes[i].virtual_path);
+      free(tree->nodes[i].path);
+    }
+
+  free(tree->nodes);
+  free(tree->by_id);
+  free(tree);
+}
+
+static int
+db_dirtree_id_cmp(const void *a, const void *b)
+{
+  const struct db_dirtree_node *x = *(const struct db_dirtree_node **)a;
+  const struct db_dirtree_node *y = *(const struct db_dirtree_node **)b;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static void
+db_dirtree_unref(struct db_dirtree *tree)
+{
+  if (--tree->refcount == 0)
+    db_dirtree_free(tree);
+}
+
+static struct db_dirtree *
+db_dirtree_load(void)
+{
+#define Q_TMPL "SELECT d.id, d.virtual_path, d.db_timestamp, d.parent_id, d.path, d.scan_kind,"                " (SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND f.directory_id = d.id)"                " FROM directories d WHERE d.disabled = 0 ORDER BY d.parent_id, d.virtual_path COLLATE NOCASE;"
+  struct db_dirtree *tree;
+  struct db_dirtree_node *node;
+  sqlite3_stmt *stmt;
+  int64_t modified;
+  time_t now;
+  int size;
+  int i;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  CHECK_NULL(L_DB, tree = calloc(1, sizeof(struct db_dirtree)));
+
+  // Read before loading, so changes made while loading will cause a reload
+  tree->generation = __atomic_load_n(&db_dirtree_generation, __ATOMIC_ACQUIRE);
+
+  ret = db_admin_getint64(&modified, DB_ADMIN_DB_MODIFIED);
+  if (ret < 0)
+    modified = 0;
+
+  // Same as db_smartpl_materialize(), a change in the current second would go
+  // unnoticed, so make sure the tree is reloaded next time
+  now = time(NULL);
+  tree->db_modified = (modified >= now) ? -1 : modified;
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      free(tree);
+      return NULL;
+    }
 
-      return 0;
+  size = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (tree->count == size)
+	{
+	  size = size ? 2 * size : 256;
+	  CHECK_NULL(L_DB, tree->nodes = realloc(tree->nodes, size * sizeof(struct db_dirtree_node)));
+	}
+
+      node = &tree->nodes[tree->count];
+      node->id           = sqlite3_column_int(stmt, 0);
+      node->virtual_path = safe_strdup((char *)sqlite3_column_text(stmt, 1));
+      node->db_timestamp = sqlite3_column_int(stmt, 2);
+      node->parent_id    = sqlite3_column_int(stmt, 3);
+      node->path         = safe_strdup((char *)sqlite3_column_text(stmt, 4));
+      node->scan_kind    = sqlite3_column_int(stmt, 5);
+      node->file_count   = sqlite3_column_int(stmt, 6);
+      tree->count++;
     }
 
-  ret = db_file_id_byquery(query);
+  sqlite3_finalize(stmt);
 
-  sqlite3_free(query);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      db_dirtree_free(tree);
+      return NULL;
+    }
 
-  return ret;
+  CHECK_NULL(L_DB, tree->by_id = calloc(tree->count + 1, sizeof(struct db_dirtree_node *)));
+  for (i = 0; i < tree->count; i++)
+    tree->by_id[i] = &tree->nodes[i];
+
+  qsort(tree->by_id, tree->count, sizeof(struct db_dirtree_node *), db_dirtree_id_cmp);
+
+  DPRINTF(E_DBG, L_DB, "Loaded directory tree with %d directories\n", tree->count);
+
+  return tree;
 
 #undef Q_TMPL
 }
 
-int
-db_directory_enum_start(struct directory_enum *de)
+// Returns the current tree with a reference that must be released with
+// db_dirtree_release()
+static struct db_dirtree *
+db_dirtree_get(void)
 {
-#define Q_TMPL "SELECT * FROM directories WHERE disabled = 0 AND parent_id = %d ORDER BY virtual_path COLLATE NOCASE;"
-  sqlite3_stmt *stmt;
-  char *query;
+  struct db_dirtree *tree;
+  int64_t modified;
   int ret;
 
-  de->stmt = NULL;
+  ret = db_admin_getint64(&modified, DB_ADMIN_DB_MODIFIED);
+  if (ret < 0)
+    modified = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, de->parent_id);
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dirtree_lck));
 
-  if (!query)
+  if (!db_dirtree || db_dirtree->generation != __atomic_load_n(&db_dirtree_generation, __ATOMIC_ACQUIRE) || db_dirtree->db_modified != modified)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      tree = db_dirtree_load();
+      if (!tree)
+	{
+	  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dirtree_lck));
+	  return NULL;
+	}
 
-      return -1;
+      if (db_dirtree)
+	db_dirtree_unref(db_dirtree);
+
+      tree->refcount = 1; // The reference held by db_dirtree
+      db_dirtree = tree;
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+  tree = db_dirtree;
+  tree->refcount++;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dirtree_lck));
 
-      sqlite3_free(query);
-      return -1;
+  return tree;
+}
+
+static void
+db_dirtree_release(struct db_dirtree *tree)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dirtree_lck));
+  db_dirtree_unref(tree);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dirtree_lck));
+}
+
+// Index of the first child of parent_id, or of where it would be
+static int
+db_dirtree_children(struct db_dirtree *tree, uint32_t parent_id)
+{
+  int lo = 0;
+  int hi = tree->count;
+  int mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (tree->nodes[mid].parent_id < parent_id)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
 
-  sqlite3_free(query);
+  return lo;
+}
 
-  de->stmt = stmt;
+static void
+db_dirtree_deinit(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dirtree_lck));
+  if (db_dirtree)
+    db_dirtree_unref(db_dirtree);
+  db_dirtree = NULL;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dirtree_lck));
+}
 
-  return 0;
+int
+db_directory_enum_start(struct directory_enum *de)
+{
+  struct db_dirtree *tree;
 
-#undef Q_TMPL
+  tree = db_dirtree_get();
+  if (!tree)
+    return -1;
+
+  de->tree = tree;
+  de->idx = db_dirtree_children(tree, de->parent_id);
+
+  return 0;
 }
 
 int
 db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
 {
-  int ret;
+  struct db_dirtree *tree = de->tree;
+  struct db_dirtree_node *node;
 
   memset(di, 0, sizeof(struct directory_info));
 
-  if (!de->stmt)
+  if (!tree)
     {
       DPRINTF(E_LOG, L_DB, "Directory enum not started!\n");
       return -1;
     }
 
-  ret = db_blocking_step(de->stmt);
-  if (ret == SQLITE_DONE)
+  if (de->idx >= tree->count || tree->nodes[de->idx].parent_id != de->parent_id)
     {
       DPRINTF(E_DBG, L_DB, "End of directory enum results\n");
       return 0;
     }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
 
-  di->id = sqlite3_column_int(de->stmt, 0);
-  di->virtual_path = (char *)sqlite3_column_text(de->stmt, 1);
-  di->db_timestamp = sqlite3_column_int(de->stmt, 2);
-  di->disabled = sqlite3_column_int64(de->stmt, 3);
-  di->parent_id = sqlite3_column_int(de->stmt, 4);
-  di->path = (char *)sqlite3_column_text(de->stmt, 5);
-  di->scan_kind = sqlite3_column_int(de->stmt, 6);
+  node = &tree->nodes[de->idx++];
+
+  di->id = node->id;
+  di->virtual_path = node->virtual_path;
+  di->db_timestamp = node->db_timestamp;
+  di->disabled = 0;
+  di->parent_id = node->parent_id;
+  di->path = node->path;
+  di->scan_kind = node->scan_kind;
 
   return 0;
 }
@@ -4346,11 +6142,32 @@ db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
 void
 db_directory_enum_end(struct directory_enum *de)
 {
-  if (!de->stmt)
+  if (!de->tree)
     return;
 
-  sqlite3_finalize(de->stmt);
-  de->stmt = NULL;
+  db_dirtree_release(de->tree);
+  de->tree = NULL;
+}
+
+int
+db_directory_file_count(int id)
+{
+  struct db_dirtree *tree;
+  struct db_dirtree_node key = { .id = id };
+  struct db_dirtree_node *keyp = &key;
+  struct db_dirtree_node **node;
+  int count;
+
+  tree = db_dirtree_get();
+  if (!tree)
+    return -1;
+
+  node = bsearch(&keyp, tree->by_id, tree->count, sizeof(struct db_dirtree_node *), db_dirtree_id_cmp);
+  count = node ? (*node)->file_count : -1;
+
+  db_dirtree_release(tree);
+
+  return count;
 }
 
 int
@@ -4401,6 +6218,8 @@ db_directory_add(struct directory_info *di, int *id)
       return -1;
     }
 
+  db_dirtree_invalidate();
+
   DPRINTF(E_DBG, L_DB, "Added directory '%s' with id %d\n", di->virtual_path, *id);
 
   return 0;
@@ -4440,6 +6259,8 @@ db_directory_update(struct directory_info *di)
 
   sqlite3_free(query);
 
+  db_dirtree_invalidate();
+
   DPRINTF(E_DBG, L_DB, "Updated directory '%s' with id %d\n", di->virtual_path, di->id);
 
   return 0;
@@ -4450,15 +6271,29 @@ db_directory_update(struct directory_info *di)
 void
 db_directory_ping_bymatch(char *virtual_path)
 {
-#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR virtual_path LIKE '%q/%%';"
+// A range instead of LIKE '%q/%%' so idx_dir_vpath can be used, '0' is the
+// character after '/'
+#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR (virtual_path > '%q/' AND virtual_path < '%q0');"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path);
+  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path, virtual_path);
 
   db_query_run(query, 1, 0);
 #undef Q_TMPL_DIR
 }
 
+void
+db_directory_timestamp_reset(int id)
+{
+#define Q_TMPL "UPDATE directories SET db_timestamp = 0 WHERE id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 void
 db_directory_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
 {
@@ -4475,6 +6310,7 @@ db_directory_disable_bymatch(const char *path, enum strip_type strip, uint32_t c
   query = sqlite3_mprintf(Q_TMPL, vpath_striplen + 1, disabled, path, path, path);
 
   db_query_run(query, 1, LISTENER_DATABASE);
+  db_dirtree_invalidate();
 #undef Q_TMPL
 }
 
@@ -4489,6 +6325,7 @@ db_directory_enable_bycookie(uint32_t cookie, const char *path)
   query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
 
   ret = db_query_run(query, 1, LISTENER_DATABASE);
+  db_dirtree_invalidate();
 
   return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL
@@ -4504,6 +6341,7 @@ db_directory_enable_bypath(char *path)
   query = sqlite3_mprintf(Q_TMPL, path);
 
   ret = db_query_run(query, 1, LISTENER_DATABASE);
+  db_dirtree_invalidate();
 
   return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL
@@ -4625,6 +6463,7 @@ db_spotify_purge(void)
       return;
     }
   ret = db_query_run(query, 1, LISTENER_DATABASE);
+  db_dirtree_invalidate();
 
   if (ret == 0)
     DPRINTF(E_DBG, L_DB, "Disabled spotify directory\n");
@@ -4674,13 +6513,24 @@ db_spotify_files_delete(void)
 }
 
 /* Admin */
-int
-db_admin_set(const char *key, const char *value)
+
+// The queue versions are kept with the queue, see db_queue_mem_init()
+static const char *
+admin_table(const char *key)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%q');"
+  if (db_queue_in_memory && (strcmp(key, DB_ADMIN_QUEUE_VERSION) == 0 || strcmp(key, DB_ADMIN_QUEUE_ORDER_VERSION) == 0))
+    return DB_QUEUE_MEM_SCHEMA ".admin";
+
+  return "admin";
+}
+
+int
+db_admin_set(const char *key, const char *value)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO %s (key, value) VALUES ('%q', '%q');"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+  query = sqlite3_mprintf(Q_TMPL, admin_table(key), key, value);
 
   return db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4689,10 +6539,10 @@ db_admin_set(const char *key, const char *value)
 int
 db_admin_setint(const char *key, int value)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%d');"
+#define Q_TMPL "INSERT OR REPLACE INTO %s (key, value) VALUES ('%q', '%d');"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+  query = sqlite3_mprintf(Q_TMPL, admin_table(key), key, value);
 
   return db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4701,10 +6551,10 @@ db_admin_setint(const char *key, int value)
 int
 db_admin_setint64(const char *key, int64_t value)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%" PRIi64 "');"
+#define Q_TMPL "INSERT OR REPLACE INTO %s (key, value) VALUES ('%q', '%" PRIi64 "');"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+  query = sqlite3_mprintf(Q_TMPL, admin_table(key), key, value);
 
   return db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4713,12 +6563,12 @@ db_admin_setint64(const char *key, int64_t value)
 static int
 admin_get(void *value, const char *key, short type)
 {
-#define Q_TMPL "SELECT value FROM admin a WHERE a.key = '%q';"
+#define Q_TMPL "SELECT value FROM %s a WHERE a.key = '%q';"
   char *query;
   sqlite3_stmt *stmt;
   int ret;
 
-  CHECK_NULL(L_DB, query = sqlite3_mprintf(Q_TMPL, key));
+  CHECK_NULL(L_DB, query = sqlite3_mprintf(Q_TMPL, admin_table(key), key));
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
@@ -4780,10 +6630,130 @@ db_admin_getint64(int64_t *int64val, const char *key)
 int
 db_admin_delete(const char *key)
 {
-#define Q_TMPL "DELETE FROM admin WHERE key='%q';"
+#define Q_TMPL "DELETE FROM %s WHERE key='%q';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, admin_table(key), key);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+/* Scrobbles */
+int
+db_scrobble_add(enum db_scrobble_service service, struct media_file_info *mfi, time_t listened_at)
+{
+#define Q_TMPL "INSERT INTO scrobbles (service, listened_at, title, artist, album, album_artist, track, song_length)" \
+               " VALUES (%d, %" PRIi64 ", %Q, %Q, %Q, %Q, %u, %u);"
+#define Q_PRUNE "DELETE FROM scrobbles WHERE service = %d AND id NOT IN" \
+                " (SELECT id FROM scrobbles WHERE service = %d ORDER BY id DESC LIMIT %d);"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, service, (int64_t)listened_at, mfi->title, mfi->artist, mfi->album, mfi->album_artist,
+			  mfi->track, mfi->song_length);
+
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  // Cheap when the queue is short, which is the normal case
+  query = sqlite3_mprintf(Q_PRUNE, service, service, DB_SCROBBLES_MAX);
+
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0 && sqlite3_changes(hdl) > 0)
+    DPRINTF(E_WARN, L_DB, "Scrobble queue is full, dropped the oldest\n");
+
+  return 0;
+#undef Q_PRUNE
+#undef Q_TMPL
+}
+
+int
+db_scrobbles_get(struct db_scrobble **scrobbles, enum db_scrobble_service service, int n)
+{
+#define Q_TMPL "SELECT id, listened_at, title, artist, album, album_artist, track, song_length FROM scrobbles" \
+               " WHERE service = %d ORDER BY id LIMIT %d;"
+  struct db_scrobble *s;
+  sqlite3_stmt *stmt;
+  char *query;
+  int i;
+  int ret;
+
+  *scrobbles = NULL;
+
+  query = sqlite3_mprintf(Q_TMPL, service, n);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
+
+  CHECK_NULL(L_DB, *scrobbles = calloc(n, sizeof(struct db_scrobble)));
+
+  for (i = 0; i < n && (ret = db_blocking_step(stmt)) == SQLITE_ROW; i++)
+    {
+      s = &(*scrobbles)[i];
+      s->id           = sqlite3_column_int64(stmt, 0);
+      s->listened_at  = sqlite3_column_int64(stmt, 1);
+      s->title        = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+      s->artist       = safe_strdup((char *)sqlite3_column_text(stmt, 3));
+      s->album        = safe_strdup((char *)sqlite3_column_text(stmt, 4));
+      s->album_artist = safe_strdup((char *)sqlite3_column_text(stmt, 5));
+      s->track        = sqlite3_column_int(stmt, 6);
+      s->song_length  = sqlite3_column_int(stmt, 7);
+    }
+
+  if (i < n && ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+      db_scrobbles_free(*scrobbles, i);
+      *scrobbles = NULL;
+      i = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return i;
+#undef Q_TMPL
+}
+
+void
+db_scrobbles_free(struct db_scrobble *scrobbles, int n)
+{
+  int i;
+
+  if (!scrobbles)
+    return;
+
+  for (i = 0; i < n; i++)
+    {
+      free(scrobbles[i].title);
+      free(scrobbles[i].artist);
+      free(scrobbles[i].album);
+      free(scrobbles[i].album_artist);
+    }
+
+  free(scrobbles);
+}
+
+int
+db_scrobbles_delete(enum db_scrobble_service service, int64_t last_id)
+{
+#define Q_TMPL "DELETE FROM scrobbles WHERE service = %d AND id <= %" PRIi64 ";"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL, key);
+  query = sqlite3_mprintf(Q_TMPL, service, last_id);
 
   return db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4841,78 +6811,544 @@ db_speaker_get(struct output_device *device, uint64_t id)
   device->selected = sqlite3_column_int(stmt, 0);
   device->volume = sqlite3_column_int(stmt, 1);
 
-  free(device->name);
-  device->name = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+  free(device->name);
+  device->name = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+
+  free(device->auth_key);
+  device->auth_key = safe_strdup((char *)sqlite3_column_text(stmt, 3));
+
+  device->selected_format = sqlite3_column_int(stmt, 4);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+  ret = 0;
+
+ out:
+  sqlite3_free(query);
+  return ret;
+
+#undef Q_TMPL
+}
+
+
+/* Queue */
+
+static void
+queue_removed_add(uint32_t id)
+{
+  struct db_queue_removed_pending *pending = &db_queue_removed_pending;
+
+  if (pending->reset)
+    return;
+
+  if (pending->count == pending->size)
+    {
+      pending->size = pending->size ? 2 * pending->size : 16;
+      CHECK_NULL(L_DB, pending->ids = realloc(pending->ids, pending->size * sizeof(uint32_t)));
+    }
+
+  pending->ids[pending->count++] = id;
+}
+
+// For changes where we don't know the removed items
+static void
+queue_removed_reset(void)
+{
+  db_queue_removed_pending.reset = true;
+  db_queue_removed_pending.count = 0;
+}
+
+static void
+queue_removed_discard(void)
+{
+  db_queue_removed_pending.reset = false;
+  db_queue_removed_pending.count = 0;
+}
+
+// Must be called with the log locked
+static void
+queue_removed_commit(int queue_version)
+{
+  struct db_queue_removed_pending *pending = &db_queue_removed_pending;
+  struct db_queue_removed_log *log = &db_queue_removed_log;
+  struct db_queue_removed *entry;
+  int i;
+
+  if (pending->reset || pending->count > DB_QUEUE_REMOVED_LOG_SIZE)
+    {
+      log->start_version = queue_version;
+      log->count = 0;
+      queue_removed_discard();
+      return;
+    }
+
+  for (i = 0; i < pending->count; i++)
+    {
+      entry = &log->entries[log->head];
+
+      // Overwriting the oldest entry, so the log no longer has all of its version
+      if (log->count == DB_QUEUE_REMOVED_LOG_SIZE)
+	log->start_version = entry->queue_version;
+      else
+	log->count++;
+
+      entry->queue_version = queue_version;
+      entry->id = pending->ids[i];
+
+      log->head = (log->head + 1) % DB_QUEUE_REMOVED_LOG_SIZE;
+    }
+
+  queue_removed_discard();
+}
+
+/*
+ * Start a new transaction for modifying the queue. Returns the new queue version for the following changes.
+ * After finishing all queue modifications 'queue_transaction_end' needs to be called.
+ */
+static int
+queue_transaction_begin()
+{
+  int queue_version = 0;
+
+  // In a batch each change gets a savepoint, so a failed change can be undone
+  // without undoing the rest of the batch
+  if (db_queue_batch.active)
+    {
+      db_query_run("SAVEPOINT queue_change;", 0, 0);
+      db_queue_batch.removed_saved = db_queue_removed_pending.count;
+      db_queue_batch.reset_saved = db_queue_removed_pending.reset;
+      return db_queue_batch.queue_version;
+    }
+
+  db_transaction_begin();
+
+  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
+  queue_version++;
+
+  return queue_version;
+}
+
+/*
+ * If retval == 0, updates the version of the queue in the admin table, commits the transaction
+ * and notifies listener of LISTENER_QUEUE about the changes.
+ * If retval < 0, rollsback the transaction.
+ *
+ * This function must be called after modifying the queue.
+ *
+ * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
+ * @param queue_version The new queue version, for the pending modifications
+ */
+static void
+queue_transaction_end(int retval, int queue_version)
+{
+  int ret;
+
+  if (db_queue_batch.active)
+    {
+      if (retval < 0)
+	{
+	  db_query_run("ROLLBACK TO queue_change;", 0, 0);
+	  db_queue_removed_pending.count = db_queue_batch.removed_saved;
+	  db_queue_removed_pending.reset = db_queue_batch.reset_saved;
+	}
+      else
+	db_queue_batch.changed = true;
+
+      db_query_run("RELEASE queue_change;", 0, 0);
+      return;
+    }
+
+  if (retval < 0)
+    goto error;
+
+  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
+  if (ret < 0)
+    goto error;
+
+  // The log is locked while committing, so a reader that sees the new version
+  // will also see its removals
+  pthread_mutex_lock(&db_queue_removed_log.lock);
+  db_transaction_end();
+  queue_removed_commit(queue_version);
+  pthread_mutex_unlock(&db_queue_removed_log.lock);
+
+  listener_notify(LISTENER_QUEUE);
+  return;
+
+ error:
+  queue_removed_discard();
+  db_transaction_rollback();
+}
+
+/*
+ * Ends a queue transaction that didn't change anything
+ */
+static void
+queue_transaction_unchanged(void)
+{
+  if (db_queue_batch.active)
+    {
+      db_query_run("RELEASE queue_change;", 0, 0);
+      return;
+    }
+
+  db_transaction_end();
+}
+
+/*
+ * Records that the positions of items may have changed without the items
+ * getting a new queue_version, e.g. because an item before them was removed.
+ */
+static int
+queue_order_changed(int queue_version)
+{
+  return db_admin_setint(DB_ADMIN_QUEUE_ORDER_VERSION, queue_version);
+}
+
+static void
+queue_select_src_build(void)
+{
+  int i;
+
+  snprintf(queue_select_src, sizeof(queue_select_src), "(SELECT ");
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      if (i > 0)
+	CHECK_ERR(L_DB, safe_snprintf_cat(queue_select_src, sizeof(queue_select_src), ", "));
+
+      if (qi_cols_map[i].offset == qi_offsetof(pos) || qi_cols_map[i].offset == qi_offsetof(shuffle_pos))
+	CHECK_ERR(L_DB, safe_snprintf_cat(queue_select_src, sizeof(queue_select_src), "ROW_NUMBER() OVER (ORDER BY q.%s, q.id) - 1 AS %s",
+	                                  qi_cols_map[i].name, qi_cols_map[i].name));
+      else
+	CHECK_ERR(L_DB, safe_snprintf_cat(queue_select_src, sizeof(queue_select_src), "q.%s", qi_cols_map[i].name));
+    }
+  CHECK_ERR(L_DB, safe_snprintf_cat(queue_select_src, sizeof(queue_select_src), " FROM %s q)", db_queue_table));
+
+  snprintf(queue_select_byid, sizeof(queue_select_byid), "SELECT * FROM %s f WHERE id = ?;", queue_select_src);
+}
+
+/*
+ * Gets the ordering key of the item at the given (zero-based) position, not
+ * counting the count items from position excl_pos (count 0 to exclude nothing).
+ *
+ * @return 0 if found, 1 if there is no item at the position, -1 on error
+ */
+static int
+queue_key_get(int *key, char shuffle, int pos, int excl_pos, int excl_count)
+{
+#define Q_TMPL "SELECT %s FROM %s ORDER BY %s, id LIMIT 1 OFFSET %d;"
+  sqlite3_stmt *stmt;
+  const char *col = shuffle ? "shuffle_pos" : "pos";
+  char *query;
+  int ret;
+
+  // The excluded items are contiguous, so skip over them if pos is after
+  if (excl_count > 0 && pos >= excl_pos)
+    pos += excl_count;
+
+  query = sqlite3_mprintf(Q_TMPL, col, db_queue_table, col, pos);
+  if (!query)
+    return -1;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_ROW)
+    {
+      *key = sqlite3_column_int(stmt, 0);
+      ret = 0;
+    }
+  else if (ret == SQLITE_DONE)
+    ret = 1;
+  else
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      ret = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  return ret;
+
+#undef Q_TMPL
+}
+
+/*
+ * Gets the ids of count items from the given position, in queue order, and if
+ * keys is not NULL also their ordering keys. Caller must free the arrays.
+ */
+static int
+queue_ids_get(uint32_t **ids, int **keys, char shuffle, int pos, int count)
+{
+#define Q_TMPL "SELECT id, %s FROM %s ORDER BY %s, id LIMIT %d OFFSET %d;"
+  sqlite3_stmt *stmt;
+  const char *col = shuffle ? "shuffle_pos" : "pos";
+  char *query;
+  int n;
+  int ret;
+
+  *ids = NULL;
+  if (keys)
+    *keys = NULL;
+
+  if (count <= 0)
+    return 0;
+
+  query = sqlite3_mprintf(Q_TMPL, col, db_queue_table, col, count, pos);
+  if (!query)
+    return -1;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  CHECK_NULL(L_DB, *ids = calloc(count, sizeof(uint32_t)));
+  if (keys)
+    CHECK_NULL(L_DB, *keys = calloc(count, sizeof(int)));
+
+  for (n = 0; n < count && (ret = db_blocking_step(stmt)) == SQLITE_ROW; n++)
+    {
+      (*ids)[n] = sqlite3_column_int(stmt, 0);
+      if (keys)
+	(*keys)[n] = sqlite3_column_int(stmt, 1);
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (n < count && ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      free(*ids);
+      *ids = NULL;
+      if (keys)
+	{
+	  free(*keys);
+	  *keys = NULL;
+	}
+      return -1;
+    }
+
+  return n;
+
+#undef Q_TMPL
+}
+
+/*
+ * Sets the ordering key (pos or shuffle_pos) of each of the given items. Uses
+ * a single prepared statement, since preparing one per item is what makes this
+ * slow for large queues. Must be called within a transaction.
+ */
+static int
+queue_keys_set(char shuffle, uint32_t *ids, int *keys, int len)
+{
+#define Q_TMPL "UPDATE %s SET %s = ?1 WHERE id = ?2;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int i;
+  int ret;
+
+  if (len <= 0)
+    return 0;
+
+  query = sqlite3_mprintf(Q_TMPL, db_queue_table, shuffle ? "shuffle_pos" : "pos");
+  if (!query)
+    return -1;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  for (i = 0; i < len; i++)
+    {
+      sqlite3_bind_int(stmt, 1, keys[i]);
+      sqlite3_bind_int(stmt, 2, ids[i]);
+
+      ret = db_blocking_step(stmt);
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Failed to update item with item-id %" PRIu32 ": %s\n", ids[i], sqlite3_errmsg(hdl));
+	  sqlite3_finalize(stmt);
+	  return -1;
+	}
+
+      sqlite3_reset(stmt);
+    }
+
+  sqlite3_finalize(stmt);
+  return 0;
+
+#undef Q_TMPL
+}
+
+/*
+ * Renumbers the ordering keys of the queue (pos or shuffle_pos) so they are
+ * spaced QUEUE_KEY_GAP apart again. The order and thereby the positions of the
+ * items don't change, so the item versions are not updated.
+ */
+static int
+queue_rebalance(char shuffle)
+{
+  const char *col = shuffle ? "shuffle_pos" : "pos";
+  uint32_t *ids;
+  int *keys;
+  uint32_t count;
+  int gap;
+  int n;
+  int i;
+  int ret;
+
+  ret = db_queue_get_count(&count);
+  if (ret < 0)
+    return -1;
 
-  free(device->auth_key);
-  device->auth_key = safe_strdup((char *)sqlite3_column_text(stmt, 3));
+  n = queue_ids_get(&ids, NULL, shuffle, 0, count);
+  if (n < 0)
+    return -1;
 
-  device->selected_format = sqlite3_column_int(stmt, 4);
+  gap = MIN(QUEUE_KEY_GAP, INT32_MAX / (n + 1));
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  DPRINTF(E_DBG, L_DB, "Rebalancing %s keys of %d queue items\n", col, n);
 
-  sqlite3_finalize(stmt);
+  CHECK_NULL(L_DB, keys = calloc(n + 1, sizeof(int)));
+  for (i = 0; i < n; i++)
+    keys[i] = (i + 1) * gap;
 
-  ret = 0;
+  ret = queue_keys_set(shuffle, ids, keys, n);
 
- out:
-  sqlite3_free(query);
+  free(ids);
+  free(keys);
   return ret;
-
-#undef Q_TMPL
 }
 
-
-/* Queue */
-
 /*
- * Start a new transaction for modifying the queue. Returns the new queue version for the following changes.
- * After finishing all queue modifications 'queue_transaction_end' needs to be called.
+ * Finds count unused ordering keys for inserting items at the given position.
+ * The first key is returned in key, the following are step apart. With
+ * excl_pos/excl_count the keys are found as if the given items were not in
+ * the queue (used for moving them). Rebalances the queue if there is no room
+ * between the neighbouring items.
  */
 static int
-queue_transaction_begin()
+queue_keys_make(int *key, int *step, char shuffle, int pos, int count, int excl_pos, int excl_count)
 {
-  int queue_version = 0;
+  int prev;
+  int next;
+  int ret;
+  int i;
 
-  db_transaction_begin();
+  for (i = 0; i < 2; i++)
+    {
+      prev = -1;
+      if (pos > 0)
+	{
+	  ret = queue_key_get(&prev, shuffle, pos - 1, excl_pos, excl_count);
+	  if (ret < 0)
+	    return -1;
+	}
 
-  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
-  queue_version++;
+      ret = queue_key_get(&next, shuffle, pos, excl_pos, excl_count);
+      if (ret < 0)
+	return -1;
 
-  return queue_version;
+      if (ret == 1 && prev <= INT32_MAX - (int64_t)QUEUE_KEY_GAP * (count + 1))
+	{
+	  // Append to the end
+	  *step = QUEUE_KEY_GAP;
+	  *key = prev + QUEUE_KEY_GAP;
+	  return 0;
+	}
+      else if (ret == 0 && (next - prev) / (count + 1) > 0)
+	{
+	  *step = (next - prev) / (count + 1);
+	  *key = prev + *step;
+	  return 0;
+	}
+
+      ret = queue_rebalance(shuffle);
+      if (ret < 0)
+	return -1;
+    }
+
+  DPRINTF(E_LOG, L_DB, "Could not make room for %d items at queue position %d\n", count, pos);
+  return -1;
 }
 
 /*
- * If retval == 0, updates the version of the queue in the admin table, commits the transaction
- * and notifies listener of LISTENER_QUEUE about the changes.
- * If retval < 0, rollsback the transaction.
- *
- * This function must be called after modifying the queue.
- *
- * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
- * @param queue_version The new queue version, for the pending modifications
+ * Moves count items from pos_from so that they start at pos_to in the queue
+ * (both zero-based), by giving them new ordering keys.
  */
-static void
-queue_transaction_end(int retval, int queue_version)
+static int
+queue_move(int pos_from, int count, int pos_to, char shuffle, int queue_version)
 {
+#define Q_TMPL "UPDATE %s SET %s = %d, queue_version = %d WHERE id = %d;"
+  const char *col = shuffle ? "shuffle_pos" : "pos";
+  uint32_t *ids;
+  uint32_t queue_count;
+  char *query;
+  int key;
+  int step;
+  int n;
+  int i;
   int ret;
 
-  if (retval < 0)
-    goto error;
+  ret = db_queue_get_count(&queue_count);
+  if (ret < 0)
+    return -1;
 
-  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
+  if (pos_from < 0 || count <= 0 || pos_from + count > queue_count)
+    {
+      DPRINTF(E_LOG, L_DB, "Invalid queue move of %d items from position %d\n", count, pos_from);
+      return -1;
+    }
+
+  // Position in the queue without the moved items
+  if (pos_to < 0)
+    pos_to = 0;
+  else if (pos_to > queue_count - count)
+    pos_to = queue_count - count;
+
+  if (pos_to == pos_from)
+    return 0;
+
+  ret = queue_order_changed(queue_version);
   if (ret < 0)
-    goto error;
+    return -1;
 
-  db_transaction_end();
-  listener_notify(LISTENER_QUEUE);
-  return;
+  ret = queue_keys_make(&key, &step, shuffle, pos_to, count, pos_from, count);
+  if (ret < 0)
+    return -1;
 
- error:
-  db_transaction_rollback();
+  n = queue_ids_get(&ids, NULL, shuffle, pos_from, count);
+  if (n < 0)
+    return -1;
+
+  for (i = 0, ret = 0; i < n && ret == 0; i++, key += step)
+    {
+      query = sqlite3_mprintf(Q_TMPL, db_queue_table, col, key, queue_version, ids[i]);
+      ret = db_query_run(query, 1, 0);
+    }
+
+  free(ids);
+  return ret;
+
+#undef Q_TMPL
 }
 
 static int
@@ -5108,9 +7544,16 @@ db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
   queue_add_info->shuffle_pos = queue_count;
 
   if (pos >= 0 && pos < queue_count)
-    queue_add_info->pos = pos;
+    {
+      queue_add_info->pos = pos;
 
-  queue_add_info->start_pos = queue_add_info->pos;
+      ret = queue_order_changed(queue_add_info->queue_version);
+      if (ret < 0)
+	{
+	  queue_transaction_end(ret, queue_add_info->queue_version);
+	  return ret;
+	}
+    }
 
   return 0;
 }
@@ -5118,15 +7561,6 @@ db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
 int
 db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint32_t item_id, int ret)
 {
-  char *query;
-
-  if (ret < 0)
-    goto end;
-
-  // Update pos for all items from the given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND queue_version < %d;",
-                          queue_add_info->count, queue_add_info->queue_version, queue_add_info->start_pos, queue_add_info->queue_version);
-  ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end;
 
@@ -5144,14 +7578,39 @@ db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item
 {
   int ret;
 
-  qi->pos = queue_add_info->pos;
-  qi->shuffle_pos = queue_add_info->shuffle_pos;
+  // Callers may add many items one by one, so reserve ordering keys for a block
+  // of items instead of looking up the neighbours for every item
+  if (queue_add_info->key_avail == 0)
+    {
+      ret = queue_keys_make(&queue_add_info->key, &queue_add_info->key_step, 0, queue_add_info->pos, QUEUE_KEY_RESERVE, 0, 0);
+      if (ret < 0)
+	return -1;
+
+      queue_add_info->key_avail = QUEUE_KEY_RESERVE;
+    }
+
+  if (queue_add_info->shuffle_key_avail == 0)
+    {
+      ret = queue_keys_make(&queue_add_info->shuffle_key, &queue_add_info->shuffle_key_step, 1, queue_add_info->shuffle_pos, QUEUE_KEY_RESERVE, 0, 0);
+      if (ret < 0)
+	return -1;
+
+      queue_add_info->shuffle_key_avail = QUEUE_KEY_RESERVE;
+    }
+
+  qi->pos = queue_add_info->key;
+  qi->shuffle_pos = queue_add_info->shuffle_key;
   qi->queue_version = queue_add_info->queue_version;
 
   ret = queue_item_add(qi);
   if (ret < 0)
     return ret;
 
+  queue_add_info->key += queue_add_info->key_step;
+  queue_add_info->key_avail--;
+  queue_add_info->shuffle_key += queue_add_info->shuffle_key_step;
+  queue_add_info->shuffle_key_avail--;
+
   queue_add_info->pos++;
   queue_add_info->shuffle_pos++;
   queue_add_info->count++;
@@ -5162,6 +7621,204 @@ db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item
   return ret;
 }
 
+/*
+ * Set-based path for db_queue_add_by_query(). Queries that only select from
+ * the files table can be added with INSERT ... SELECT instead of fetching and
+ * inserting each file, which matters when adding the whole library. The ids
+ * are first collected in a temp table, so that the rowid gives the order of
+ * the items, and their ordering keys can be calculated in SQL.
+ */
+static bool
+queue_add_bulk_possible(struct query_params *qp)
+{
+  return (qp->type == Q_ITEMS || qp->type == Q_PLITEMS) && qp->idx_type != I_KEYSET;
+}
+
+// Returns the number of ids added to the temp table, or -1 on error
+static int
+queue_add_bulk_collect(struct query_params *qp)
+{
+#define Q_CREATE "CREATE TEMP TABLE IF NOT EXISTS queue_add (file_id INTEGER NOT NULL);"
+#define Q_CLEAR  "DELETE FROM temp.queue_add;"
+#define Q_FILL   "INSERT INTO temp.queue_add (file_id) %s"
+  uint64_t cols[DB_QUERY_COLS_WORDS];
+  char *select;
+  char *query;
+  int ret;
+
+  ret = db_query_run(Q_CREATE, 0, 0);
+  if (ret < 0)
+    return -1;
+
+  // Starts with rowid 1 again when the table is empty
+  ret = db_query_run(Q_CLEAR, 0, 0);
+  if (ret < 0)
+    return -1;
+
+  // Only the file ids are needed
+  memcpy(cols, qp->cols, sizeof(cols));
+  memset(qp->cols, 0, sizeof(qp->cols));
+  db_query_cols_add(qp, dbmfi_offsetof(id));
+
+  select = db_build_query(qp);
+
+  memcpy(qp->cols, cols, sizeof(cols));
+
+  if (!select)
+    return -1;
+
+  query = sqlite3_mprintf(Q_FILL, select);
+  sqlite3_free(select);
+
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  return sqlite3_changes(hdl);
+
+#undef Q_FILL
+#undef Q_CLEAR
+#undef Q_CREATE
+}
+
+static int
+queue_add_bulk_insert(int pos, int pos_step, int shuffle_pos, int shuffle_pos_step, int queue_version)
+{
+#define Q_TMPL "INSERT INTO %s (pos, shuffle_pos, queue_version%s) SELECT %d + (t.rowid - 1) * %d, %d + (t.rowid - 1) * %d, %d%s FROM temp.queue_add t JOIN files f ON f.id = t.file_id ORDER BY t.rowid;"
+  char *dst = NULL;
+  char *src = NULL;
+  char *tmp;
+  char *query;
+  int i;
+  int j;
+  int ret;
+
+  // The columns that db_queue_item_from_dbmfi() copies from the file
+  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+    {
+      if (qi_mfi_map[i].mfi_offset < 0)
+	continue;
+
+      for (j = 0; j < ARRAY_SIZE(mfi_cols_map) && mfi_cols_map[j].offset != qi_mfi_map[i].mfi_offset; j++)
+	;
+
+      if (j == ARRAY_SIZE(mfi_cols_map))
+	{
+	  DPRINTF(E_LOG, L_DB, "BUG: Queue column '%s' has no files column\n", qi_cols_map[i].name);
+	  goto error;
+	}
+
+      tmp = dst;
+      dst = sqlite3_mprintf("%s, %s", tmp ? tmp : "", qi_cols_map[i].name);
+      sqlite3_free(tmp);
+
+      tmp = src;
+      src = sqlite3_mprintf("%s, f.%s", tmp ? tmp : "", mfi_cols_map[j].name);
+      sqlite3_free(tmp);
+
+      if (!dst || !src)
+	goto error;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, db_queue_table, dst, pos, pos_step, shuffle_pos, shuffle_pos_step, queue_version, src);
+  ret = db_query_run(query, 1, 0);
+
+  db_query_run("DELETE FROM temp.queue_add;", 0, 0);
+
+  sqlite3_free(dst);
+  sqlite3_free(src);
+  return ret;
+
+ error:
+  sqlite3_free(dst);
+  sqlite3_free(src);
+  return -1;
+
+#undef Q_TMPL
+}
+
+static int
+queue_add_by_query_bulk(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
+{
+  char *query;
+  int queue_version;
+  uint32_t queue_count;
+  int n;
+  int pos;
+  int pos_step;
+  int shuffle_pos;
+  int shuffle_pos_step;
+  bool append_to_queue;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  ret = db_queue_get_count(&queue_count);
+  if (ret < 0)
+    goto end_transaction;
+
+  n = queue_add_bulk_collect(qp);
+  if (n < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", n);
+
+  if (n == 0)
+    {
+      queue_transaction_unchanged();
+      return 0;
+    }
+
+  append_to_queue = (position < 0 || position > queue_count);
+
+  if (append_to_queue)
+    position = queue_count;
+  else
+    {
+      ret = queue_order_changed(queue_version);
+      if (ret < 0)
+	goto end_transaction;
+    }
+
+  // Get ordering keys for the new items, the existing items are not touched
+  ret = queue_keys_make(&pos, &pos_step, 0, position, n, 0, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  ret = queue_keys_make(&shuffle_pos, &shuffle_pos_step, 1, position, n, 0, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  ret = queue_add_bulk_insert(pos, pos_step, shuffle_pos, shuffle_pos_step, queue_version);
+  if (ret < 0)
+    goto end_transaction;
+
+  DPRINTF(E_DBG, L_DB, "Added %d songs to queue (pos key=%d shuffle_pos key=%d reshuffle=%d position=%d)\n", n, pos, shuffle_pos, reshuffle, position);
+
+  if (new_item_id)
+    {
+      query = sqlite3_mprintf("SELECT id FROM %s WHERE pos = %d;", db_queue_table, pos);
+      *new_item_id = db_get_one_int(query);
+      sqlite3_free(query);
+    }
+  if (count)
+    *count = n;
+
+  // See db_queue_add_by_query()
+  if (append_to_queue && reshuffle)
+    {
+      ret = queue_reshuffle(item_id, queue_version);
+    }
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
 /*
  * Adds the files matching the given query to the queue
  *
@@ -5183,11 +7840,12 @@ int
 db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
 {
   struct db_media_file_info dbmfi;
-  char *query;
   int queue_version;
   uint32_t queue_count;
   int pos;
+  int pos_step;
   int shuffle_pos;
+  int shuffle_pos_step;
   bool append_to_queue;
   int ret;
 
@@ -5196,6 +7854,9 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id,
   if (count)
     *count = 0;
 
+  if (queue_add_bulk_possible(qp))
+    return queue_add_by_query_bulk(qp, reshuffle, item_id, position, count, new_item_id);
+
   queue_version = queue_transaction_begin();
 
   ret = db_queue_get_count(&queue_count);
@@ -5214,33 +7875,37 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id,
   if (qp->results == 0)
     {
       db_query_end(qp);
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
   append_to_queue = (position < 0 || position > queue_count);
 
   if (append_to_queue)
+    position = queue_count;
+  else
+    {
+      ret = queue_order_changed(queue_version);
+      if (ret < 0)
+	{
+	  db_query_end(qp);
+	  goto end_transaction;
+	}
+    }
+
+  // Get ordering keys for the new items, the existing items are not touched
+  ret = queue_keys_make(&pos, &pos_step, 0, position, qp->results, 0, 0);
+  if (ret < 0)
     {
-      pos = queue_count;
-      shuffle_pos = queue_count;
+      db_query_end(qp);
+      goto end_transaction;
     }
-  else
-    {
-      pos = position;
-      shuffle_pos = position;
-
-      // Update pos for all items from the given position (make room for the new items in the queue)
-      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d;", qp->results, queue_version, pos);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	goto end_transaction;
 
-      // and similary update on shuffle_pos
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + %d, queue_version = %d WHERE shuffle_pos >= %d;", qp->results, queue_version, pos);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	goto end_transaction;
+  ret = queue_keys_make(&shuffle_pos, &shuffle_pos_step, 1, position, qp->results, 0, 0);
+  if (ret < 0)
+    {
+      db_query_end(qp);
+      goto end_transaction;
     }
 
   while ((ret = db_query_fetch_file(&dbmfi, qp)) == 0)
@@ -5253,15 +7918,15 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id,
 	  break;
 	}
 
-      DPRINTF(E_DBG, L_DB, "Added (pos=%d shuffle_pos=%d reshuffle=%d req position=%d) song id %s (%s) to queue with item id %d\n", pos, shuffle_pos, reshuffle, position, dbmfi.id, dbmfi.title, ret);
+      DPRINTF(E_DBG, L_DB, "Added (pos key=%d shuffle_pos key=%d reshuffle=%d position=%d) song id %s (%s) to queue with item id %d\n", pos, shuffle_pos, reshuffle, position, dbmfi.id, dbmfi.title, ret);
 
       if (new_item_id && *new_item_id == 0)
 	*new_item_id = ret;
       if (count)
 	(*count)++;
 
-      pos++;
-      shuffle_pos++;
+      pos += pos_step;
+      shuffle_pos += shuffle_pos_step;
     }
 
   if (ret > 0)
@@ -5289,13 +7954,25 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id,
 static int
 queue_enum_start(struct query_params *qp)
 {
-#define Q_TMPL "SELECT * FROM queue f WHERE %s ORDER BY %s;"
+#define Q_TMPL "SELECT * FROM %s f WHERE %s ORDER BY %s %s;"
   sqlite3_stmt *stmt;
   char *query;
   const char *orderby;
+  char index[64];
   int ret;
 
   qp->stmt = NULL;
+  qp->elapsed_usec = 0;
+  qp->rows = 0;
+
+  // Lets callers that only show a window of the queue (e.g. "Up Next") have
+  // sqlite stop at the end of it, instead of reading past it
+  if ((qp->idx_type == I_FIRST || qp->idx_type == I_SUB) && qp->limit > 0)
+    snprintf(index, sizeof(index), "LIMIT %d OFFSET %d", qp->limit, (qp->idx_type == I_SUB) ? qp->offset : 0);
+  else if (qp->idx_type == I_SUB && qp->offset > 0)
+    snprintf(index, sizeof(index), "LIMIT -1 OFFSET %d", qp->offset);
+  else
+    index[0] = '\0';
 
   if (qp->order)
     orderby = qp->order;
@@ -5305,9 +7982,9 @@ queue_enum_start(struct query_params *qp)
     orderby = sort_clause[S_POS];
 
   if (qp->filter)
-    query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
+    query = sqlite3_mprintf(Q_TMPL, queue_select_src, qp->filter, orderby, index);
   else
-    query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
+    query = sqlite3_mprintf(Q_TMPL, queue_select_src, "1=1", orderby, index);
 
   if (!query)
     {
@@ -5350,7 +8027,7 @@ queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_str
       return -1;
     }
 
-  ret = db_blocking_step(qp->stmt);
+  ret = db_query_step(qp);
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of queue enum results\n");
@@ -5401,16 +8078,16 @@ db_queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi)
 int
 db_queue_get_pos(uint32_t item_id, char shuffle)
 {
-#define Q_TMPL "SELECT pos FROM queue WHERE id = %d;"
-#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE id = %d;"
+#define Q_TMPL "SELECT (SELECT COUNT(*) FROM %s q2 WHERE q2.pos < q.pos OR (q2.pos = q.pos AND q2.id < q.id)) FROM %s q WHERE q.id = %d;"
+#define Q_TMPL_SHUFFLE "SELECT (SELECT COUNT(*) FROM %s q2 WHERE q2.shuffle_pos < q.shuffle_pos OR (q2.shuffle_pos = q.shuffle_pos AND q2.id < q.id)) FROM %s q WHERE q.id = %d;"
 
   char *query;
   int pos;
 
   if (shuffle)
-    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, item_id);
+    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, db_queue_table, db_queue_table, item_id);
   else
-    query = sqlite3_mprintf(Q_TMPL, item_id);
+    query = sqlite3_mprintf(Q_TMPL, db_queue_table, db_queue_table, item_id);
 
   pos = db_get_one_int(query);
 
@@ -5429,18 +8106,18 @@ queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *qi, int with_metada
   int ret;
 
   memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("id = %d", item_id);
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    {
-      sqlite3_free(qp.filter);
-      return -1;
-    }
+  // Stable pointer, so the cache can match on it
+  qp.stmt = db_stmt_cache_get(queue_select_byid);
+  if (!qp.stmt)
+    return -1;
+
+  sqlite3_bind_int(qp.stmt, 1, item_id);
+
+  db_stmt_debug(qp.stmt);
 
   ret = queue_enum_fetch(&qp, qi, with_metadata);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
+  db_stmt_cache_put(qp.stmt);
   return ret;
 }
 
@@ -5664,69 +8341,24 @@ db_queue_fetch_prev(uint32_t item_id, char shuffle)
   return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
 }
 
-static int
-queue_fix_pos(enum sort_type sort, int queue_version)
-{
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
-
-  struct query_params qp;
-  struct db_queue_item queue_item;
-  char *query;
-  int pos;
-  int ret;
-
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.sort = sort;
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    {
-      return -1;
-    }
-
-  pos = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
-    {
-      if (queue_item.pos != pos)
-        {
-	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
-	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
-
-	  ret = db_query_run(query, 1, 0);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
-	      break;
-	    }
-	}
-
-      pos++;
-    }
-
-  db_query_end(&qp);
-  return ret;
-
-#undef Q_TMPL
-}
-
 /*
- * Remove files that are disabled or non existent in the library and repair ordering of
- * the queue (shuffle and normal)
+ * Remove files that are disabled or non existent in the library. Since positions
+ * are derived from the ordering keys, the remaining items need no update.
  */
 int
 db_queue_cleanup()
 {
-#define Q_TMPL "DELETE FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
+#define Q_TMPL "DELETE FROM %s WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
 
+  char *query;
   int queue_version;
   int deleted;
   int ret;
 
   queue_version = queue_transaction_begin();
 
-  ret = db_query_run(Q_TMPL, 0, 0);
+  query = sqlite3_mprintf(Q_TMPL, db_queue_table);
+  ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end_transaction;
 
@@ -5734,17 +8366,14 @@ db_queue_cleanup()
   if (deleted <= 0)
     {
       // Nothing to do
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
-  // Update position of normal queue
-  ret = queue_fix_pos(S_POS, queue_version);
-  if (ret < 0)
-    goto end_transaction;
+  // We don't know which items were removed
+  queue_removed_reset();
 
-  // Update position of shuffle queue
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
+  ret = queue_order_changed(queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5768,12 +8397,14 @@ db_queue_clear(uint32_t keep_item_id)
 
   queue_version = queue_transaction_begin();
 
-  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
+  query = sqlite3_mprintf("DELETE FROM %s where id <> %d;", db_queue_table, keep_item_id);
   ret = db_query_run(query, 1, 0);
 
+  queue_removed_reset();
+
   if (ret == 0 && keep_item_id)
     {
-      query = sqlite3_mprintf("UPDATE queue SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", queue_version, keep_item_id);
+      query = sqlite3_mprintf("UPDATE %s SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", db_queue_table, queue_version, keep_item_id);
       ret = db_query_run(query, 1, 0);
     }
 
@@ -5788,31 +8419,17 @@ queue_delete_item(struct db_queue_item *qi, int queue_version)
   char *query;
   int ret;
 
-  // Remove item with the given item_id
-  query = sqlite3_mprintf("DELETE FROM queue where id = %d;", qi->id);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    {
-      return -1;
-    }
-
-  // Update pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, qi->pos);
+  // Remove item with the given item_id, the following items move up by themselves
+  query = sqlite3_mprintf("DELETE FROM %s where id = %d;", db_queue_table, qi->id);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     {
       return -1;
     }
 
-  // Update shuffle_pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, qi->shuffle_pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    {
-      return -1;
-    }
+  queue_removed_add(qi->id);
 
-  return 0;
+  return queue_order_changed(queue_version);
 }
 
 int
@@ -5831,7 +8448,7 @@ db_queue_delete_byitemid(uint32_t item_id)
 
   if (queue_item.id == 0)
     {
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
@@ -5848,23 +8465,34 @@ db_queue_delete_bypos(uint32_t pos, int count)
 {
   int queue_version;
   char *query;
+  uint32_t *ids;
   int to_pos;
+  int n;
+  int i;
   int ret;
 
   queue_version = queue_transaction_begin();
 
-  // Remove item with the given item_id
+  // Remove the items in the given position range
+  n = queue_ids_get(&ids, NULL, 0, pos, count);
+  if (n < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
   to_pos = pos + count;
-  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d;", pos, to_pos);
+  query = sqlite3_mprintf("DELETE FROM %s WHERE id IN (SELECT id FROM %s WHERE pos >= %d AND pos < %d);", db_queue_table, queue_select_src, pos, to_pos);
   ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  if (ret == 0)
+    {
+      for (i = 0; i < n; i++)
+	queue_removed_add(ids[i]);
 
-  ret = queue_fix_pos(S_POS, queue_version);
-  if (ret < 0)
-    goto end_transaction;
+      ret = queue_order_changed(queue_version);
+    }
 
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
+  free(ids);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5888,7 +8516,7 @@ db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle
   if (queue_item.id == 0)
     {
       // No item found
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
@@ -5912,7 +8540,6 @@ int
 db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
 {
   int queue_version;
-  char *query;
   int pos_from;
   int ret;
 
@@ -5926,33 +8553,7 @@ db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
       goto end_transaction;
     }
 
-  // Update pos for all items after the item with given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, pos_from);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, pos_from);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move(pos_from, 1, pos_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5972,7 +8573,6 @@ db_queue_move_bypos(int pos_from, int pos_to)
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int ret;
 
   queue_version = queue_transaction_begin();
@@ -5984,25 +8584,11 @@ db_queue_move_bypos(int pos_from, int pos_to)
 
   if (queue_item.id == 0)
     {
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, queue_item.id);
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move(queue_item.pos, 1, pos_to, 0, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -6013,43 +8599,16 @@ db_queue_move_bypos(int pos_from, int pos_to)
 int
 db_queue_move_bypos_range(int range_begin, int range_end, int pos_to)
 {
-#define Q_TMPL "UPDATE queue SET pos = CASE WHEN pos < %d THEN pos + %d ELSE pos - %d END, queue_version = %d WHERE pos >= %d AND pos < %d;"
   int queue_version;
-  char *query;
-  int count;
-  int update_begin;
-  int update_end;
   int ret;
-  int cut_off;
-  int offset_up;
-  int offset_down;
 
   queue_version = queue_transaction_begin();
 
-  count = range_end - range_begin;
-  update_begin = MIN(range_begin, pos_to);
-  update_end = MAX(range_begin + count, pos_to + count);
-
-  if (range_begin < pos_to)
-    {
-      cut_off = range_begin + count;
-      offset_up = pos_to - range_begin;
-      offset_down = count;
-    }
-  else
-    {
-      cut_off = range_begin;
-      offset_up = count;
-      offset_down = range_begin - pos_to;
-    }
-
-  query = sqlite3_mprintf(Q_TMPL, cut_off, offset_up, offset_down, queue_version, update_begin, update_end);
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move(range_begin, range_end - range_begin, pos_to, 0, queue_version);
 
   queue_transaction_end(ret, queue_version);
 
   return ret;
-#undef Q_TMPL
 }
 
 /*
@@ -6066,7 +8625,6 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int pos_move_from;
   int pos_move_to;
   int ret;
@@ -6084,7 +8642,7 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 
   if (queue_item.id == 0)
     {
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
@@ -6119,37 +8677,14 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 
   if (queue_item.id == 0)
     {
-      db_transaction_end();
+      queue_transaction_unchanged();
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item.shuffle_pos);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_move_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_move_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
   if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
+    ret = queue_move(queue_item.shuffle_pos, 1, pos_move_to, shuffle, queue_version);
   else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-
-  ret = db_query_run(query, 1, 0);
+    ret = queue_move(queue_item.pos, 1, pos_move_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -6172,17 +8707,15 @@ queue_reshuffle(uint32_t item_id, int queue_version)
   char *query;
   int pos;
   uint32_t count;
-  struct db_queue_item queue_item;
-  int *shuffle_pos = NULL;
+  uint32_t *ids = NULL;
+  int *keys = NULL;
   int len;
-  int i;
-  struct query_params qp = { 0 };
   int ret;
 
   DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
 
   // Reset the shuffled order and mark all items as changed
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d;", queue_version);
+  query = sqlite3_mprintf("UPDATE %s SET shuffle_pos = pos, queue_version = %d;", db_queue_table, queue_version);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto error;
@@ -6201,50 +8734,26 @@ queue_reshuffle(uint32_t item_id, int queue_version)
   if (ret < 0)
     goto error;
 
-  len = count - pos;
-
-  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
-
-  CHECK_NULL(L_DB, shuffle_pos = malloc(len * sizeof(int)));
-  for (i = 0; i < len; i++)
-    {
-      shuffle_pos[i] = i + pos;
-    }
-
-  rng_shuffle_int(&shuffle_rng, shuffle_pos, len);
+  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", (int)count - pos, count, pos);
 
-  qp.filter = sqlite3_mprintf("pos >= %d", pos);
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  // The items after the base item get their ordering keys shuffled among them
+  len = queue_ids_get(&ids, &keys, 0, pos, count - pos);
+  if (len < 0)
     goto error;
 
-  i = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
-    {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
-	  break;
-	}
-
-      i++;
-    }
-
-  db_query_end(&qp);
+  rng_shuffle_int(&shuffle_rng, keys, len);
 
+  ret = queue_keys_set(1, ids, keys, len);
   if (ret < 0)
     goto error;
 
-  sqlite3_free(qp.filter);
-  free(shuffle_pos);
+  free(ids);
+  free(keys);
   return 0;
 
  error:
-  sqlite3_free(qp.filter);
-  free(shuffle_pos);
+  free(ids);
+  free(keys);
   return -1;
 }
 
@@ -6272,6 +8781,39 @@ db_queue_reshuffle(uint32_t item_id)
   return ret;
 }
 
+/*
+ * Starts a batch of queue changes, which will all be made in one transaction,
+ * with one new queue version and one LISTENER_QUEUE notification when the batch
+ * is ended with db_queue_batch_end(). A failed change is still rolled back on
+ * its own. The batch is per thread, and while it is active the thread holds
+ * the write lock, so it must not wait for other threads that may write to the
+ * database.
+ */
+void
+db_queue_batch_begin(void)
+{
+  if (db_queue_batch.active)
+    return;
+
+  db_queue_batch.queue_version = queue_transaction_begin();
+  db_queue_batch.changed = false;
+  db_queue_batch.active = true;
+}
+
+void
+db_queue_batch_end(void)
+{
+  if (!db_queue_batch.active)
+    return;
+
+  db_queue_batch.active = false;
+
+  if (db_queue_batch.changed)
+    queue_transaction_end(0, db_queue_batch.queue_version);
+  else
+    db_transaction_end();
+}
+
 /*
  * Increment queue version (triggers queue change event)
  */
@@ -6289,8 +8831,13 @@ db_queue_inc_version()
 int
 db_queue_get_count(uint32_t *nitems)
 {
-  int ret = db_get_one_int("SELECT COUNT(*) FROM queue;");
+  char *query;
+  int ret;
+
+  CHECK_NULL(L_DB, query = sqlite3_mprintf("SELECT COUNT(*) FROM %s;", db_queue_table));
 
+  ret = db_get_one_int(query);
+  sqlite3_free(query);
   if (ret < 0)
     return -1;
 
@@ -6299,6 +8846,73 @@ db_queue_get_count(uint32_t *nitems)
   return 0;
 }
 
+/*
+ * Gets the ids of all items in the queue, in queue order
+ *
+ * @out ids      Array of item ids, must be freed by caller
+ * @param shuffle If set, the ids are in shuffle order
+ * @return       Number of ids, -1 on error
+ */
+int
+db_queue_ids_get(uint32_t **ids, char shuffle)
+{
+  uint32_t count;
+  int ret;
+
+  *ids = NULL;
+
+  ret = db_queue_get_count(&count);
+  if (ret < 0)
+    return -1;
+
+  return queue_ids_get(ids, NULL, shuffle, 0, count);
+}
+
+/*
+ * Gets the ids of the items that were removed from the queue after the given
+ * queue version. Only the most recent removals are kept, so for older versions
+ * (or if the queue was cleared since) the caller must reload the entire queue.
+ *
+ * @out ids      Array of item ids, must be freed by caller
+ * @out nids     Number of ids
+ * @param since_version Queue version the caller has
+ * @return       0 on success, -1 if the removals are no longer known
+ */
+int
+db_queue_removed_get(uint32_t **ids, int *nids, int since_version)
+{
+  struct db_queue_removed_log *log = &db_queue_removed_log;
+  struct db_queue_removed *entry;
+  int i;
+  int ret = -1;
+
+  *ids = NULL;
+  *nids = 0;
+
+  // Don't query the db with the lock, since a writer may be waiting for it
+  // while it has the db locked
+  pthread_mutex_lock(&log->lock);
+
+  if (since_version < log->start_version)
+    goto out;
+
+  CHECK_NULL(L_DB, *ids = calloc(log->count + 1, sizeof(uint32_t)));
+
+  // Oldest entry is at head - count
+  for (i = 0; i < log->count; i++)
+    {
+      entry = &log->entries[(log->head - log->count + i + DB_QUEUE_REMOVED_LOG_SIZE) % DB_QUEUE_REMOVED_LOG_SIZE];
+      if (entry->queue_version > since_version)
+	(*ids)[(*nids)++] = entry->id;
+    }
+
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
 
 /* Inotify */
 int
@@ -6934,57 +9548,144 @@ db_pragma_set_mmap_size(int mmap_size)
 #undef Q_TMPL
 }
 
-static int
-db_open(void)
+/* Sizes the page cache so that the whole database fits, but at most a share of
+ * the RAM, so that on a Pi a large library doesn't crowd out the rest. mmap is
+ * only used with 64 bit, where there is plenty of address space. Since the
+ * library connections share their cache, this is the total for them.
+ */
+static void
+db_pragma_autosize(void)
 {
-  char *errmsg;
-  int ret;
-  int cache_size;
-  char *journal_mode;
-  int synchronous;
-  int mmap_size;
+  struct stat sb;
+  int64_t db_size;
+  int64_t ram;
+  int64_t cache_size;
+  int64_t cache_max;
+  long pages;
+  long pagesize;
+
+  db_size = (stat(db_path, &sb) == 0) ? sb.st_size : 0;
+
+  pages = sysconf(_SC_PHYS_PAGES);
+  pagesize = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || pagesize <= 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not get size of RAM, using SQLite default cache size\n");
+      return;
+    }
+
+  ram = (int64_t)pages * pagesize;
+
+  cache_max = MIN(ram / DB_CACHE_RAM_SHARE, DB_CACHE_SIZE_MAX);
+  cache_size = MIN(MAX(db_size, DB_CACHE_SIZE_MIN), cache_max);
+
+  db_auto_cache_size_kib = cache_size / 1024;
+
+  if (sizeof(void *) >= 8)
+    db_auto_mmap_size = MIN(ram / DB_MMAP_RAM_SHARE, DB_MMAP_SIZE_MAX);
+
+  DPRINTF(E_LOG, L_DB, "Database is %" PRIi64 " MB and RAM %" PRIi64 " MB, using cache size %d KB and mmap size %d MB\n",
+    db_size / (1024 * 1024), ram / (1024 * 1024), db_auto_cache_size_kib, db_auto_mmap_size / (1024 * 1024));
+}
+
+static int
+db_open_path(sqlite3 **handle, const char *path, int flags)
+{
+  sqlite3 *h;
+  char *errmsg;
+  int ret;
 
-  ret = sqlite3_open(db_path, &hdl);
+  ret = sqlite3_open_v2(path, &h, flags, NULL);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", path, sqlite3_errmsg(h));
 
-      sqlite3_close(hdl);
+      sqlite3_close(h);
       return -1;
     }
 
-  ret = sqlite3_enable_load_extension(hdl, 1);
+  ret = sqlite3_enable_load_extension(h, 1);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not enable extension loading\n");
 
-      sqlite3_close(hdl);
+      sqlite3_close(h);
       return -1;
     }
 
-  ret = sqlite3_load_extension(hdl, db_sqlite_ext_path, NULL, &errmsg);
+  ret = sqlite3_load_extension(h, db_sqlite_ext_path, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_close(hdl);
+      sqlite3_close(h);
       return -1;
     }
 
-  ret = sqlite3_enable_load_extension(hdl, 0);
+  ret = sqlite3_enable_load_extension(h, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not disable extension loading\n");
 
-      sqlite3_close(hdl);
+      sqlite3_close(h);
       return -1;
     }
 
 #ifdef DB_PROFILE
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
+  sqlite3_trace_v2(h, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
 #endif
 
+  *handle = h;
+  return 0;
+}
+
+static int
+db_open_handle(sqlite3 **handle, int flags)
+{
+  char *errmsg;
+  int ret;
+
+  if (!db_queue_in_memory)
+    return db_open_path(handle, db_path, flags);
+
+  // Needed for the uri of the in-memory queue database
+  ret = db_open_path(handle, db_path, flags | SQLITE_OPEN_URI);
+  if (ret < 0)
+    return -1;
+
+  ret = sqlite3_exec(*handle, "ATTACH DATABASE '" DB_QUEUE_MEM_URI "' AS " DB_QUEUE_MEM_SCHEMA ";", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not attach in-memory queue database: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(*handle);
+      *handle = NULL;
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+db_open(void)
+{
+  int ret;
+  int cache_size;
+  char *journal_mode;
+  int synchronous;
+  int mmap_size;
+
+  ret = db_open_handle(&hdl, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if (ret < 0)
+    return -1;
+
+  // For db_maintenance(). Takes effect when a new database is created, or for
+  // an existing one with the next VACUUM. Must come before the journal mode,
+  // since it can't be changed for a new database once it is in WAL mode.
+  sqlite3_exec(hdl, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL);
+
   cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
   if (cache_size > -1)
     {
@@ -6992,6 +9693,11 @@ db_open(void)
       cache_size = db_pragma_get_cache_size();
       DPRINTF(E_DBG, L_DB, "Database cache size in pages: %d\n", cache_size);
     }
+  else if (db_auto_cache_size_kib > 0)
+    {
+      // A negative cache_size is in KiB instead of pages
+      db_pragma_set_cache_size(-db_auto_cache_size_kib);
+    }
 
   journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
   if (journal_mode)
@@ -7015,6 +9721,10 @@ db_open(void)
       mmap_size = db_pragma_get_mmap_size();
       DPRINTF(E_DBG, L_DB, "Database mmap_size: %d\n", mmap_size);
     }
+  else if (db_auto_mmap_size > 0)
+    {
+      db_pragma_set_mmap_size(db_auto_mmap_size);
+    }
 
   return 0;
 }
@@ -7071,7 +9781,7 @@ db_statements_prepare_update(const struct col_type_map *map, size_t map_size, co
   memset(keystr, 0, sizeof(keystr));
   for (i = 0; i < map_size; i++)
     {
-      if (map[i].flag & DB_FLAG_NO_BIND)
+      if (map[i].flag & (DB_FLAG_NO_BIND | DB_FLAG_NO_UPDATE))
 	continue;
 
       if (map[i].flag & DB_FLAG_NO_ZERO)
@@ -7133,8 +9843,8 @@ db_statements_prepare(void)
   db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
   db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
 
-  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
-  db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
+  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), db_queue_table);
+  db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), db_queue_table);
 
   if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
        || !db_statements.playlists_insert || !db_statements.playlists_update
@@ -7145,17 +9855,257 @@ db_statements_prepare(void)
   return 0;
 }
 
-// Returns -2 if backup not enabled in config
-int
-db_backup(void)
+/* In-memory queue
+ *
+ * With queue_in_memory the queue table, and the queue versions from the admin
+ * table, are in a shared in-memory database, which all connections attach as
+ * DB_QUEUE_MEM_SCHEMA. Queue changes then don't write to disk, which would
+ * otherwise compete with scans and wear SD cards. The in-memory database only
+ * exists while a connection has it open, so db_queue_mem_hdl keeps it open.
+ * The queue table is copied from the library database at startup, and a
+ * snapshot is written back to it by db_queue_snapshot(), which the library
+ * thread calls periodically, and at shutdown. A queue change is only lost if
+ * OwnTone stops without shutting down before the next snapshot.
+ */
+static sqlite3 *db_queue_mem_hdl;
+static pthread_mutex_t db_queue_mem_lck = PTHREAD_MUTEX_INITIALIZER;
+static int db_queue_snapshot_version = -1;
+
+// The library database is attached as "disk" to db_queue_mem_hdl
+#define Q_QUEUE_MEM_LOAD \
+  "BEGIN TRANSACTION;" \
+  "CREATE TABLE admin (key VARCHAR(32) PRIMARY KEY NOT NULL, value VARCHAR(32) NOT NULL);" \
+  "INSERT INTO main.queue SELECT * FROM disk.queue;" \
+  "INSERT INTO main.admin SELECT * FROM disk.admin WHERE key IN ('" DB_ADMIN_QUEUE_VERSION "', '" DB_ADMIN_QUEUE_ORDER_VERSION "');" \
+  "DELETE FROM main.sqlite_sequence WHERE name = 'queue';" \
+  "INSERT INTO main.sqlite_sequence SELECT * FROM disk.sqlite_sequence WHERE name = 'queue';" \
+  "COMMIT TRANSACTION;"
+
+#define Q_QUEUE_MEM_SAVE \
+  "BEGIN TRANSACTION;" \
+  "DELETE FROM disk.queue;" \
+  "INSERT INTO disk.queue SELECT * FROM main.queue;" \
+  "DELETE FROM disk.sqlite_sequence WHERE name = 'queue';" \
+  "INSERT INTO disk.sqlite_sequence SELECT * FROM main.sqlite_sequence WHERE name = 'queue';" \
+  "INSERT OR REPLACE INTO disk.admin SELECT * FROM main.admin;" \
+  "COMMIT TRANSACTION;"
+
+static int
+queue_mem_version_get(void)
+{
+  sqlite3_stmt *stmt;
+  int version = -1;
+  int ret;
+
+  ret = sqlite3_prepare_v2(db_queue_mem_hdl, "SELECT value FROM main.admin WHERE key = '" DB_ADMIN_QUEUE_VERSION "';", -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    return -1;
+
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+  return version;
+}
+
+static int
+queue_mem_exec(const char *query)
+{
+  char *errmsg;
+  int ret;
+
+  ret = sqlite3_exec(db_queue_mem_hdl, query, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "In-memory queue query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      if (!sqlite3_get_autocommit(db_queue_mem_hdl))
+	sqlite3_exec(db_queue_mem_hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+db_queue_mem_deinit(void)
+{
+  sqlite3_close(db_queue_mem_hdl);
+  db_queue_mem_hdl = NULL;
+}
+
+// Creates the in-memory queue database with the same schema as the queue in
+// the library database, including any upgrades, and copies the queue to it
+static int
+db_queue_mem_init(void)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  ret = db_open_path(&db_queue_mem_hdl, DB_QUEUE_MEM_URI, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI);
+  if (ret < 0)
+    return -1;
+
+  sqlite3_busy_timeout(db_queue_mem_hdl, 5000);
+
+  CHECK_NULL(L_DB, query = sqlite3_mprintf("ATTACH DATABASE '%q' AS disk;", db_path));
+  ret = queue_mem_exec(query);
+  sqlite3_free(query);
+  if (ret < 0)
+    goto error;
+
+  // The table before its indices
+  ret = sqlite3_prepare_v2(db_queue_mem_hdl, "SELECT sql FROM disk.sqlite_master WHERE tbl_name = 'queue' AND sql NOT NULL ORDER BY type DESC;", -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not read queue schema: %s\n", sqlite3_errmsg(db_queue_mem_hdl));
+      goto error;
+    }
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      ret = queue_mem_exec((const char *)sqlite3_column_text(stmt, 0));
+      if (ret < 0)
+	break;
+    }
+
+  sqlite3_finalize(stmt);
+  if (ret != SQLITE_DONE)
+    goto error;
+
+  ret = queue_mem_exec(Q_QUEUE_MEM_LOAD);
+  if (ret < 0)
+    goto error;
+
+  db_queue_snapshot_version = queue_mem_version_get();
+
+  DPRINTF(E_LOG, L_DB, "Queue is kept in memory, saving changes every %d sec\n", (int)cfg_getint(cfg_getsec(cfg, "sqlite"), "queue_snapshot_interval"));
+
+  return 0;
+
+ error:
+  db_queue_mem_deinit();
+  return -1;
+}
+
+/*
+ * Writes the in-memory queue to the library database, if it changed since the
+ * last snapshot. Does nothing without queue_in_memory. If the library database
+ * is busy the snapshot is skipped, and done the next time.
+ */
+void
+db_queue_snapshot(void)
 {
+  int version;
   int ret;
-  sqlite3 *backup_hdl;
+
+  if (!db_queue_in_memory)
+    return;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_mem_lck));
+
+  if (!db_queue_mem_hdl)
+    goto out;
+
+  version = queue_mem_version_get();
+  if (version == db_queue_snapshot_version)
+    goto out;
+
+  ret = queue_mem_exec(Q_QUEUE_MEM_SAVE);
+  if (ret < 0)
+    goto out;
+
+  DPRINTF(E_DBG, L_DB, "Saved snapshot of in-memory queue (version %d)\n", version);
+
+  db_queue_snapshot_version = version;
+
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mem_lck));
+}
+
+/* Backup
+ *
+ * The backup is copied DB_BACKUP_STEP_PAGES pages at a time, and the caller
+ * does the steps with pauses in between (see httpd_jsonapi.c), so other
+ * connections only ever wait for one step. The source is a private read-only
+ * connection. With WAL it keeps a read transaction for the duration, which
+ * doesn't block writers, but means that the backup is a consistent snapshot
+ * and doesn't restart when the library is modified. The backup is written to
+ * a temporary file, which replaces the old backup when complete.
+ */
+#define DB_BACKUP_STEP_PAGES 256
+
+struct db_backup_job
+{
+  sqlite3 *src;
+  sqlite3 *dst;
   sqlite3_backup *backup;
-  const char *backup_path;
+  char *path;
+  char *tmp_path;
+  bool in_transaction;
+};
 
+// Only used by the thread doing the backup
+static struct db_backup_job db_backup_job;
+
+static struct db_backup_status db_backup_status;
+static pthread_mutex_t db_backup_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+db_backup_job_end(int result)
+{
+  struct db_backup_job *job = &db_backup_job;
+
+  if (job->backup)
+    sqlite3_backup_finish(job->backup);
+  if (job->dst)
+    sqlite3_close(job->dst);
+  if (job->in_transaction)
+    sqlite3_exec(job->src, "END TRANSACTION;", NULL, NULL, NULL);
+  if (job->src)
+    sqlite3_close(job->src);
+
+  if (result == 0 && rename(job->tmp_path, job->path) < 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to rename backup '%s' to '%s': %s\n", job->tmp_path, job->path, strerror(errno));
+      result = -1;
+    }
+
+  if (result < 0 && job->tmp_path)
+    unlink(job->tmp_path);
+
+  if (result == 0)
+    DPRINTF(E_INFO, L_DB, "Backup complete to '%s'\n", job->path);
+
+  free(job->path);
+  free(job->tmp_path);
+  memset(job, 0, sizeof(struct db_backup_job));
+
+  pthread_mutex_lock(&db_backup_lck);
+  db_backup_status.running = false;
+  db_backup_status.result = result;
+  db_backup_status.finished = time(NULL);
+  pthread_mutex_unlock(&db_backup_lck);
+}
+
+/*
+ * Starts a backup to the path given by 'db_backup_path' in the config, which
+ * is then done by calling db_backup_step() until it returns <= 0.
+ *
+ * @return 0 on success, -1 on error, -2 if backup is not enabled in config and
+ *         -3 if a backup is already running
+ */
+int
+db_backup_start(void)
+{
+  struct db_backup_job *job = &db_backup_job;
+  const char *backup_path;
+  const char *journal_mode;
   char resolved_bp[PATH_MAX];
   char resolved_dbp[PATH_MAX];
+  int ret;
 
   backup_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_backup_path");
   if (!backup_path)
@@ -7176,35 +10126,106 @@ db_backup(void)
       return -2;
     }
 
+  pthread_mutex_lock(&db_backup_lck);
+  if (db_backup_status.running)
+    {
+      pthread_mutex_unlock(&db_backup_lck);
+      DPRINTF(E_LOG, L_DB, "Backup already in progress\n");
+      return -3;
+    }
+
+  memset(&db_backup_status, 0, sizeof(struct db_backup_status));
+  db_backup_status.running = true;
+  db_backup_status.started = time(NULL);
+  pthread_mutex_unlock(&db_backup_lck);
+
   DPRINTF(E_INFO, L_DB, "Backup starting...\n");
 
-  ret = sqlite3_open(backup_path, &backup_hdl);
+  job->path = strdup(backup_path);
+  job->tmp_path = safe_asprintf("%s.tmp", backup_path);
+
+  ret = db_open_handle(&job->src, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE);
+  if (ret < 0)
+    goto error;
+
+  sqlite3_busy_timeout(job->src, 5000);
+
+  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  if (journal_mode && strcasecmp(journal_mode, "WAL") == 0)
+    {
+      // The transaction only starts with the first read
+      ret = sqlite3_exec(job->src, "BEGIN TRANSACTION; SELECT COUNT(*) FROM sqlite_master;", NULL, NULL, NULL);
+      job->in_transaction = (ret == SQLITE_OK);
+    }
+
+  unlink(job->tmp_path);
+
+  ret = sqlite3_open(job->tmp_path, &job->dst);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      return -1;
+      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", job->tmp_path, sqlite3_errmsg(job->dst));
+      goto error;
     }
 
-  backup = sqlite3_backup_init(backup_hdl, "main", hdl, "main");
-  if (!backup)
+  job->backup = sqlite3_backup_init(job->dst, "main", job->src, "main");
+  if (!job->backup)
     {
-      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      sqlite3_close(backup_hdl);
-      return -1;
+      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", job->tmp_path, sqlite3_errmsg(job->dst));
+      goto error;
     }
 
-  ret = sqlite3_backup_step(backup, -1);
-  sqlite3_backup_finish(backup);
-  sqlite3_close(backup_hdl);
+  return 0;
+
+ error:
+  db_backup_job_end(-1);
+  return -1;
+}
 
-  if (ret == SQLITE_DONE || ret == SQLITE_OK)
-    DPRINTF(E_INFO, L_DB, "Backup complete to '%s'\n", backup_path);
-  else
-    DPRINTF(E_WARN, L_DB, "Failed to complete backup '%s': %s (%d)\n", backup_path, sqlite3_errstr(ret), ret);
+/*
+ * Copies the next pages of a backup started with db_backup_start(). Must be
+ * called from the thread that started the backup. When it returns 0 or -1 the
+ * backup has ended.
+ *
+ * @return 1 if there is more to copy, 0 if complete, -1 on error
+ */
+int
+db_backup_step(void)
+{
+  struct db_backup_job *job = &db_backup_job;
+  int ret;
+
+  if (!job->backup)
+    return -1;
+
+  ret = sqlite3_backup_step(job->backup, DB_BACKUP_STEP_PAGES);
+
+  pthread_mutex_lock(&db_backup_lck);
+  db_backup_status.pages_total = sqlite3_backup_pagecount(job->backup);
+  db_backup_status.pages_remaining = sqlite3_backup_remaining(job->backup);
+  pthread_mutex_unlock(&db_backup_lck);
+
+  if (ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
+    return 1; // Busy and locked are temporary, so just try again
 
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to complete backup '%s': %s (%d)\n", job->tmp_path, sqlite3_errstr(ret), ret);
+      db_backup_job_end(-1);
+      return -1;
+    }
+
+  db_backup_job_end(0);
   return 0;
 }
 
+void
+db_backup_status_get(struct db_backup_status *status)
+{
+  pthread_mutex_lock(&db_backup_lck);
+  *status = db_backup_status;
+  pthread_mutex_unlock(&db_backup_lck);
+}
+
 int
 db_perthread_init(void)
 {
@@ -7214,6 +10235,9 @@ db_perthread_init(void)
   if (ret < 0)
     return -1;
 
+  // Statements are prepared on first use, see db_stmt_cache_get()
+  memset(db_stmt_cache, 0, sizeof(db_stmt_cache));
+
   ret = db_statements_prepare();
   if (ret < 0)
     {
@@ -7226,6 +10250,40 @@ db_perthread_init(void)
   return 0;
 }
 
+/* Opens a read-only connection for the thread's browse queries (see
+ * db_query_start), for threads that mostly read, like httpd and mpd. It has a
+ * private cache, so in WAL mode it reads from a snapshot and doesn't have to
+ * wait for table locks held by e.g. the scanner in the library thread. Without
+ * WAL it would be blocked by writers instead, so then it isn't used.
+ */
+void
+db_perthread_reader_init(void)
+{
+  char *journal_mode;
+  int ret;
+
+  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  if (!journal_mode || strcasecmp(journal_mode, "WAL") != 0)
+    return;
+
+  ret = db_open_handle(&hdl_ro, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not open read-only connection, reads will use the default connection\n");
+      hdl_ro = NULL;
+      return;
+    }
+
+  // A reader can still get SQLITE_BUSY, e.g. during checkpoints
+  sqlite3_busy_timeout(hdl_ro, 5000);
+
+  ret = sqlite3_exec(hdl_ro, "PRAGMA query_only = ON;", NULL, NULL, NULL);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_WARN, L_DB, "Could not set query_only on read-only connection: %s\n", sqlite3_errmsg(hdl_ro));
+
+  DPRINTF(E_DBG, L_DB, "Opened read-only database connection\n");
+}
+
 void
 db_perthread_deinit(void)
 {
@@ -7234,6 +10292,29 @@ db_perthread_deinit(void)
   if (!hdl)
     return;
 
+  if (db_unlock_waits > 0)
+    DPRINTF(E_DBG, L_DB, "Thread waited %u times for database unlock\n", db_unlock_waits);
+
+  if (hdl_ro)
+    {
+      while ((stmt = sqlite3_next_stmt(hdl_ro, 0)))
+	sqlite3_finalize(stmt);
+
+      sqlite3_close(hdl_ro);
+      hdl_ro = NULL;
+    }
+
+  db_write_batch_end();
+
+  free(db_queue_removed_pending.ids);
+  memset(&db_queue_removed_pending, 0, sizeof(struct db_queue_removed_pending));
+
+  db_stmt_cache_clear();
+
+  // The statement is finalized below
+  free(db_replica_save.query);
+  memset(&db_replica_save, 0, sizeof(struct db_replica_save));
+
   /* Tear down anything that's in flight */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
@@ -7386,6 +10467,7 @@ db_init(char *sqlite_ext_path)
   static_assert(ARRAY_SIZE(dbmfi_cols_map) == ARRAY_SIZE(mfi_cols_map), "mfi column maps are not in sync");
   static_assert(ARRAY_SIZE(dbpli_cols_map) == ARRAY_SIZE(pli_cols_map), "pli column maps are not in sync");
   static_assert(ARRAY_SIZE(qi_cols_map) == ARRAY_SIZE(qi_mfi_map), "queue_item column maps are not in sync");
+  static_assert(ARRAY_SIZE(dbmfi_cols_map) <= 64 * DB_QUERY_COLS_WORDS, "DB_QUERY_COLS_WORDS too small for dbmfi_cols_map");
 
   for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
     {
@@ -7395,6 +10477,10 @@ db_init(char *sqlite_ext_path)
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
   db_sqlite_ext_path = sqlite_ext_path;
   db_rating_updates = cfg_getbool(cfg_getsec(cfg, "library"), "rating_updates");
+  db_smartpl_cache = cfg_getbool(cfg_getsec(cfg, "library"), "smartpl_cache");
+  db_smartpl_cache_refresh = cfg_getint(cfg_getsec(cfg, "library"), "smartpl_cache_refresh");
+  db_slow_query_ms = cfg_getint(cfg_getsec(cfg, "sqlite"), "slow_query_threshold");
+  db_queue_in_memory = cfg_getbool(cfg_getsec(cfg, "sqlite"), "queue_in_memory");
 
   DPRINTF(E_INFO, L_DB, "Configured to use database file '%s'\n", db_path);
 
@@ -7420,6 +10506,8 @@ db_init(char *sqlite_ext_path)
       goto error;
     }
 
+  db_pragma_autosize();
+
   ret = db_open();
   if (ret < 0)
     {
@@ -7447,6 +10535,30 @@ db_init(char *sqlite_ext_path)
 	  goto error;
 	}
     }
+  else
+    {
+      // The deferred indices are missing if we stopped during a bulk load
+      ret = db_init_indices(hdl);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DB, "Could not create missing indices\n");
+    }
+
+  // Must be after any upgrade of the queue table, the copy gets its schema
+  if (db_queue_in_memory)
+    {
+      ret = db_queue_mem_init();
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not set up in-memory queue, using the queue in the database\n");
+	  db_queue_in_memory = false;
+	}
+      else
+	db_queue_table = DB_QUEUE_MEM_SCHEMA ".queue";
+    }
+
+  queue_select_src_build();
+
+  db_fts_enabled = (db_init_fts(hdl) == 0);
 
   db_set_cfg_names();
 
@@ -7455,6 +10567,9 @@ db_init(char *sqlite_ext_path)
 
   db_admin_setint64(DB_ADMIN_START_TIME, (int64_t) time(NULL));
 
+  // Clients with an older queue version have to reload the queue
+  db_admin_getint(&db_queue_removed_log.start_version, DB_ADMIN_QUEUE_VERSION);
+
   db_perthread_deinit();
 
   DPRINTF(E_LOG, L_DB, "Database OK with %" PRIu32 " active files and %" PRIu32 " active playlists\n", files, pls);
@@ -7470,5 +10585,10 @@ db_init(char *sqlite_ext_path)
 void
 db_deinit(void)
 {
+  db_queue_snapshot();
+  db_queue_mem_deinit();
+
+  db_dirtree_deinit();
+
   sqlite3_shutdown();
 }
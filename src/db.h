@@ -13,7 +13,8 @@ enum index_type {
   I_NONE,
   I_FIRST,
   I_LAST,
-  I_SUB
+  I_SUB,
+  I_KEYSET,
 };
 
 // Keep in sync with sort_clause[]
@@ -36,6 +37,9 @@ enum sort_type {
 
 #define Q_F_BROWSE (1 << 15)
 
+// Size of the column projection bitmap in struct query_params
+#define DB_QUERY_COLS_WORDS 2
+
 enum query_type {
   Q_ITEMS            = 1,
   Q_PL               = 2,
@@ -67,12 +71,23 @@ enum query_type {
 #define DB_ADMIN_SCHEMA_VERSION_MINOR "schema_version_minor"
 #define DB_ADMIN_SCHEMA_VERSION "schema_version"
 #define DB_ADMIN_QUEUE_VERSION "queue_version"
+#define DB_ADMIN_QUEUE_ORDER_VERSION "queue_order_version"
+/* Library counters, maintained by triggers (see db_init.c) */
+#define DB_ADMIN_FILES_COUNT "files_count"
+#define DB_ADMIN_FILES_LENGTH "files_length"
+#define DB_ADMIN_FILES_SIZE "files_size"
+#define DB_ADMIN_FILES_STREAMS "files_streams"
+#define DB_ADMIN_ALBUMS_COUNT "albums_count"
+#define DB_ADMIN_ARTISTS_COUNT "artists_count"
+#define DB_ADMIN_PL_COUNT "pl_count"
 #define DB_ADMIN_DB_UPDATE "db_update"
 #define DB_ADMIN_DB_MODIFIED "db_modified"
 #define DB_ADMIN_START_TIME "start_time"
+#define DB_ADMIN_SCAN_START "scan_start"
 #define DB_ADMIN_LASTFM_SESSION_KEY "lastfm_sk"
 #define DB_ADMIN_SPOTIFY_REFRESH_TOKEN "spotify_refresh_token"
 #define DB_ADMIN_LISTENBRAINZ_TOKEN "listenbrainz_token"
+#define DB_ADMIN_FEDERATION_REVISION "federation_revision"
 
 /* Max value for media_file_info->rating (valid range is from 0 to 100) */
 #define DB_FILES_RATING_MAX 100
@@ -90,23 +105,50 @@ struct query_params {
   int offset;
   int limit;
 
+  /* Keyset paging (I_KEYSET): return the items that come after this sort key
+   * value and id, NULL and 0 for the first page. Updated by db_query_fetch_*
+   * to the last row fetched, so the struct can be reused for the next page.
+   * Only supported for the type/sort combinations in db.c keyset_clause[]. */
+  char *keyset_value;
+  int64_t keyset_id;
+
   char *having;
   char *order;
   char *group;
 
   char *filter;
 
+  /* Search for items where the column search_field (static string, e.g.
+   * "title") contains search. Uses the full-text index if available. */
+  char *search;
+  const char *search_field;
+
   int with_disabled;
 
+  /* Only fetch these columns for file queries, the other dbmfi fields are left
+   * NULL. All columns are fetched if this is empty. Use db_query_cols_add(). */
+  uint64_t cols[DB_QUERY_COLS_WORDS];
+
   /* Query results, filled in by query_start */
   int results;
 
   /* Private query context, keep out */
   void *stmt;
+  uint64_t elapsed_usec;
+  int rows;
   char buf1[32];
   char buf2[32];
 };
 
+/* Cumulative timings per query type, see db_query_stats_get() */
+struct db_query_stats {
+  const char *name;
+  uint64_t count;
+  uint64_t slow_count;
+  uint64_t total_usec;
+  uint64_t max_usec;
+};
+
 struct pairing_info {
   char *remote_id;
   char *name;
@@ -147,6 +189,7 @@ enum scan_kind {
   SCAN_KIND_FILES = 1,
   SCAN_KIND_SPOTIFY = 2,
   SCAN_KIND_RSS = 3,
+  SCAN_KIND_FEDERATION = 4,
 };
 
 const char *
@@ -250,6 +293,7 @@ struct media_file_info {
 
   uint32_t scan_kind; /* Identifies the library_source that created/updates this item */
   char *lyrics;
+  int64_t inode;      /* Used to recognize moved files, 0 if unknown */
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -286,6 +330,8 @@ struct playlist_info {
   uint32_t media_kind;
   char *artwork_url;     /* optional artwork */
   uint32_t scan_kind; /* Identifies the library_source that created/updates this item */
+  char *http_etag;       /* ETag of the last download (RSS) or Spotify snapshot_id */
+  char *http_modified;   /* Last-Modified of the last download */
   uint32_t items;        /* number of items (mimc) */
   uint32_t streams;      /* number of internet streams */
 };
@@ -310,6 +356,8 @@ struct db_playlist_info {
   char *media_kind;
   char *artwork_url;
   char *scan_kind;
+  char *http_etag;
+  char *http_modified;
   char *items;
   char *streams;
 };
@@ -337,6 +385,17 @@ struct group_info {
 
 #define gri_offsetof(field) offsetof(struct group_info, field)
 
+// Progress of a backup, see db_backup_start()
+struct db_backup_status {
+  bool running;
+  // Result of the last backup, 0 if it was successful
+  int result;
+  int pages_total;
+  int pages_remaining;
+  time_t started;
+  time_t finished;
+};
+
 struct db_group_info {
   char *id;
   char *persistentid;
@@ -425,6 +484,7 @@ struct db_media_file_info {
   char *usermark;
   char *scan_kind;
   char *lyrics;
+  char *inode;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -503,7 +563,8 @@ struct directory_enum {
   int parent_id;
 
   /* Private enum context, keep out */
-  void *stmt;
+  void *tree;
+  int idx;
 };
 
 struct db_queue_item {
@@ -567,11 +628,18 @@ struct db_queue_item {
 struct db_queue_add_info
 {
   int queue_version;
-  int start_pos;
   int pos;
   int shuffle_pos;
   int count;
   int new_item_id;
+
+  // Ordering keys reserved for the next items, see db_queue_add_next()
+  int key;
+  int key_step;
+  int key_avail;
+  int shuffle_key;
+  int shuffle_key_step;
+  int shuffle_key_avail;
 };
 
 char *
@@ -608,6 +676,20 @@ free_queue_item(struct db_queue_item *qi, int content_only);
 void
 db_hook_post_scan(void);
 
+void
+db_maintenance(void);
+
+/* Bulk load mode for scans into an empty library, e.g. the first scan or a
+ * full rescan. db_bulk_load_begin() drops the indices that the scan itself
+ * doesn't use, so inserts don't have to maintain them, and returns true if it
+ * did. db_bulk_load_end() then creates them and runs the post scan jobs.
+ */
+bool
+db_bulk_load_begin(void);
+
+void
+db_bulk_load_end(void);
+
 void
 db_purge_cruft(time_t ref);
 
@@ -617,6 +699,50 @@ db_purge_cruft_bysource(time_t ref, enum scan_kind scan_kind);
 void
 db_purge_all(void);
 
+/* Library changes, see the changes table */
+enum db_change_item_type {
+  DB_CHANGE_FILE     = 0,
+  DB_CHANGE_PLAYLIST = 1,
+};
+
+// The revision is the id of the latest change. Changes since oldest are
+// available, earlier ones have been pruned.
+int
+db_changes_revision_get(int64_t *oldest, int64_t *latest);
+
+// Returns the number of items of the given type that were deleted (or disabled)
+// after revision since, and allocates ids with their ids
+int
+db_changes_deleted_get(uint32_t **ids, enum db_change_item_type type, int64_t since);
+
+/* Library federation, see library/federation.c */
+#define DB_REPLICA_COLS_MAX 128
+
+// Called with each row for a replica, values are NULL for NULL columns
+typedef void (*db_replica_row_cb)(const char *table, int ncols, const char **cols, const char **values, void *arg);
+
+// Full copy of the library, one page of files at a time, starting after
+// after_id. The directories come with the first page and the playlists with
+// the last, which sets done.
+int
+db_replica_snapshot_get(db_replica_row_cb cb, void *arg, uint32_t *last_id, bool *done, uint32_t after_id, int limit);
+
+// The files and playlists that changed after revision since up to and
+// including revision until, plus the directories they are in
+int
+db_replica_delta_get(db_replica_row_cb cb, void *arg, int64_t since, int64_t until);
+
+// Saves a row from db_replica_*_get() on the primary, replacing the row with
+// the same id
+int
+db_replica_row_save(const char *table, int ncols, const char **cols, const char **values);
+
+int
+db_replica_item_delete(enum db_change_item_type type, uint32_t id);
+
+int
+db_replica_playlistitems_clear(uint32_t playlist_id);
+
 /* Transactions */
 void
 db_transaction_begin(void);
@@ -627,6 +753,16 @@ db_transaction_end(void);
 void
 db_transaction_rollback(void);
 
+/* Write batching during scans (per thread), see db.c */
+void
+db_write_batch_begin(void);
+
+void
+db_write_batch_flush(void);
+
+void
+db_write_batch_end(void);
+
 /* Queries */
 int
 db_query_start(struct query_params *qp);
@@ -655,6 +791,15 @@ db_query_fetch_string(char **string, struct query_params *qp);
 int
 db_query_fetch_string_sort(char **string, char **sortstring, struct query_params *qp);
 
+int
+db_query_stats_get(struct db_query_stats **stats);
+
+int
+db_changes_total_get(void);
+
+void
+db_query_cols_add(struct query_params *qp, ssize_t dbmfi_offset);
+
 /* Files */
 int
 db_files_get_count(uint32_t *nitems, uint32_t *nstreams, const char *filter);
@@ -683,6 +828,9 @@ db_file_ping_bypath(const char *path, time_t mtime_max);
 void
 db_file_ping_bymatch(const char *path, int isdir);
 
+void
+db_file_ping_bydirectory(int dir_id);
+
 char *
 db_file_path_byid(int id);
 
@@ -731,6 +879,12 @@ db_file_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie
 int
 db_file_enable_bycookie(uint32_t cookie, const char *path, const char *filename);
 
+char *
+db_file_path_byinode(int *id, int64_t inode, int64_t file_size, uint32_t time_modified);
+
+int
+db_file_update_path(int id, const char *path, const char *fname, const char *virtual_path, int dir_id);
+
 int
 db_file_update_directoryid(const char *path, int dir_id);
 
@@ -774,6 +928,9 @@ db_pl_update(struct playlist_info *pli);
 int
 db_pl_add_item_bypath(int plid, const char *path);
 
+int
+db_pl_add_items_bypath(int plid, const char **paths, int npaths);
+
 int
 db_pl_add_item_byid(int plid, int fileid);
 
@@ -807,9 +964,15 @@ db_group_persistentid_byid(int id, int64_t *persistentid);
 int
 db_directory_id_byvirtualpath(const char *virtual_path);
 
+time_t
+db_directory_timestamp_byvirtualpath(const char *virtual_path);
+
 int
 db_directory_id_bypath(const char *path);
 
+/* The enum is served from an in-memory copy of the directory tree, which is
+ * reloaded when directories are added, changed or removed, or when the library
+ * is modified. Only db_timestamp isn't kept up to date by directory pings. */
 int
 db_directory_enum_start(struct directory_enum *de);
 
@@ -819,6 +982,10 @@ db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di);
 void
 db_directory_enum_end(struct directory_enum *de);
 
+/* Returns the number of enabled files in the directory, or -1 if not known */
+int
+db_directory_file_count(int id);
+
 int
 db_directory_add(struct directory_info *di, int *id);
 
@@ -828,6 +995,9 @@ db_directory_update(struct directory_info *di);
 void
 db_directory_ping_bymatch(char *virtual_path);
 
+void
+db_directory_timestamp_reset(int id);
+
 void
 db_directory_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie);
 
@@ -876,6 +1046,40 @@ db_admin_getint64(int64_t *int64val, const char *key);
 int
 db_admin_delete(const char *key);
 
+/* Scrobbles, see the scrobbles table */
+enum db_scrobble_service {
+  DB_SCROBBLE_LASTFM       = 0,
+  DB_SCROBBLE_LISTENBRAINZ = 1,
+};
+
+struct db_scrobble {
+  int64_t id;
+  int64_t listened_at;
+  char *title;
+  char *artist;
+  char *album;
+  char *album_artist;
+  uint32_t track;
+  uint32_t song_length;
+};
+
+// Queues a play of mfi, if the queue for the service is full the oldest is
+// dropped
+int
+db_scrobble_add(enum db_scrobble_service service, struct media_file_info *mfi, time_t listened_at);
+
+// Returns the number of plays in scrobbles (oldest first, max n), which must be
+// freed with db_scrobbles_free()
+int
+db_scrobbles_get(struct db_scrobble **scrobbles, enum db_scrobble_service service, int n);
+
+void
+db_scrobbles_free(struct db_scrobble *scrobbles, int n);
+
+// Deletes all the queued plays for the service up to and including last_id
+int
+db_scrobbles_delete(enum db_scrobble_service service, int64_t last_id);
+
 /* Speakers/outputs */
 int
 db_speaker_save(struct output_device *device);
@@ -938,6 +1142,9 @@ db_queue_fetch_prev(uint32_t item_id, char shuffle);
 int
 db_queue_cleanup();
 
+void
+db_queue_snapshot(void);
+
 int
 db_queue_clear(uint32_t keep_item_id);
 
@@ -965,12 +1172,24 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 int
 db_queue_reshuffle(uint32_t item_id);
 
+void
+db_queue_batch_begin(void);
+
+void
+db_queue_batch_end(void);
+
 int
 db_queue_inc_version(void);
 
 int
 db_queue_get_count(uint32_t *nitems);
 
+int
+db_queue_ids_get(uint32_t **ids, char shuffle);
+
+int
+db_queue_removed_get(uint32_t **ids, int *nids, int since_version);
+
 int
 db_queue_get_pos(uint32_t item_id, char shuffle);
 
@@ -1021,11 +1240,20 @@ int
 db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 
 int
-db_backup(void);
+db_backup_start(void);
+
+int
+db_backup_step(void);
+
+void
+db_backup_status_get(struct db_backup_status *status);
 
 int
 db_perthread_init(void);
 
+void
+db_perthread_reader_init(void);
+
 void
 db_perthread_deinit(void);
 
@@ -99,7 +99,8 @@
   "   channels           INTEGER DEFAULT 0,"		\
   "   usermark           INTEGER DEFAULT 0,"		\
   "   scan_kind          INTEGER DEFAULT 0,"		\
-  "   lyrics             TEXT DEFAULT NULL COLLATE DAAP"		\
+  "   lyrics             TEXT DEFAULT NULL COLLATE DAAP,"		\
+  "   inode              INTEGER DEFAULT 0"		\
   ");"
 
 #define T_PL					\
@@ -120,7 +121,9 @@
   "   query_limit    INTEGER DEFAULT 0,"		\
   "   media_kind     INTEGER DEFAULT 1,"		\
   "   artwork_url    VARCHAR(4096) DEFAULT NULL,"	\
-  "   scan_kind      INTEGER DEFAULT 0"			\
+  "   scan_kind      INTEGER DEFAULT 0,"		\
+  "   http_etag      VARCHAR(255) DEFAULT NULL,"	\
+  "   http_modified  VARCHAR(64) DEFAULT NULL"		\
   ");"
 
 #define T_PLITEMS				\
@@ -136,6 +139,7 @@
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   file_count     INTEGER DEFAULT 0,"				\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
@@ -174,6 +178,51 @@
   "   scan_kind           INTEGER DEFAULT 0"			\
   ");"
 
+#define T_SMARTPLITEMS					\
+  "CREATE TABLE IF NOT EXISTS smartplitems ("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL"			\
+  ");"
+
+#define T_SMARTPLS					\
+  "CREATE TABLE IF NOT EXISTS smartpls ("		\
+  "   playlistid     INTEGER PRIMARY KEY NOT NULL,"	\
+  "   query          VARCHAR(1024) NOT NULL,"		\
+  "   query_order    VARCHAR(1024) DEFAULT NULL,"	\
+  "   query_limit    INTEGER DEFAULT 0,"		\
+  "   db_modified    INTEGER DEFAULT 0,"		\
+  "   expires        INTEGER DEFAULT 0"			\
+  ");"
+
+/* Log of changes to files and playlists, maintained by the trg_changes_*
+ * triggers. The id of the latest change is the library revision, which lets
+ * DAAP clients ask for just what changed since the revision they have.
+ */
+#define T_CHANGES					\
+  "CREATE TABLE IF NOT EXISTS changes ("		\
+  "   id             INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   item_type      INTEGER NOT NULL,"			\
+  "   item_id        INTEGER NOT NULL,"			\
+  "   is_deleted     INTEGER DEFAULT 0"			\
+  ");"
+
+/* Plays waiting to be submitted to Last.fm and ListenBrainz. The metadata is
+ * copied, so pending plays survive the track being removed from the library.
+ */
+#define T_SCROBBLES					\
+  "CREATE TABLE IF NOT EXISTS scrobbles ("		\
+  "   id             INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   service        INTEGER NOT NULL,"			\
+  "   listened_at    INTEGER NOT NULL,"			\
+  "   title          VARCHAR(1024) DEFAULT NULL,"	\
+  "   artist         VARCHAR(1024) DEFAULT NULL,"	\
+  "   album          VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_artist   VARCHAR(1024) DEFAULT NULL,"	\
+  "   track          INTEGER DEFAULT 0,"		\
+  "   song_length    INTEGER DEFAULT 0"			\
+  ");"
+
 #define T_QUEUE								\
   "CREATE TABLE IF NOT EXISTS queue ("					\
   "   id                  INTEGER PRIMARY KEY AUTOINCREMENT,"		\
@@ -255,6 +304,22 @@
 #define Q_QUEUE_VERSION			\
   "INSERT INTO admin (key, value) VALUES ('queue_version', '0');"
 
+/* Library counters maintained by the trg_counters_* triggers, initialized
+ * from the tables since the default playlists already exist at this point
+ */
+#define Q_COUNTERS_FILES						\
+  "INSERT INTO admin (key, value)"					\
+  " SELECT 'files_count', COUNT(*) FROM files WHERE disabled = 0"	\
+  " UNION ALL SELECT 'files_length', IFNULL(SUM(song_length), 0) FROM files WHERE disabled = 0"	\
+  " UNION ALL SELECT 'files_size', IFNULL(SUM(file_size), 0) FROM files WHERE disabled = 0"	\
+  " UNION ALL SELECT 'files_streams', COUNT(*) FROM files WHERE disabled = 0 AND data_kind = 1;"
+#define Q_COUNTERS_GROUPS						\
+  "INSERT INTO admin (key, value)"					\
+  " SELECT 'albums_count', COUNT(*) FROM groups WHERE type = 1 AND file_count > 0"	\
+  " UNION ALL SELECT 'artists_count', COUNT(*) FROM groups WHERE type = 2 AND file_count > 0;"
+#define Q_COUNTERS_PL							\
+  "INSERT INTO admin (key, value) SELECT 'pl_count', COUNT(*) FROM playlists WHERE disabled = 0;"
+
 #define Q_SCVER_MAJOR					\
   "INSERT INTO admin (key, value) VALUES ('schema_version_major', '%d');"
 #define Q_SCVER_MINOR					\
@@ -277,6 +342,10 @@ static const struct db_init_query db_init_table_queries[] =
     { T_INOTIFY,   "create table inotify" },
     { T_DIRECTORIES, "create table directories" },
     { T_QUEUE,     "create table queue" },
+    { T_SMARTPLITEMS, "create table smartplitems" },
+    { T_SMARTPLS,  "create table smartpls" },
+    { T_CHANGES,   "create table changes" },
+    { T_SCROBBLES, "create table scrobbles" },
 
     { Q_PL1,       "create default playlist" },
     { Q_PL2,       "create default smart playlist 'Music'" },
@@ -291,6 +360,10 @@ static const struct db_init_query db_init_table_queries[] =
     { Q_DIR4,      "create default base directory '/spotify:'" },
 
     { Q_QUEUE_VERSION, "initialize queue version" },
+
+    { Q_COUNTERS_FILES,  "initialize file counters" },
+    { Q_COUNTERS_GROUPS, "initialize album and artist counters" },
+    { Q_COUNTERS_PL,     "initialize playlist counter" },
   };
 
 
@@ -339,12 +412,49 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_FILELIST					\
   "CREATE INDEX IF NOT EXISTS idx_filelist ON files(disabled, virtual_path, time_modified);"
 
+/* Used for exact virtual path lookups, e.g. by MPD */
+#define I_FILE_VPATH					\
+  "CREATE INDEX IF NOT EXISTS idx_file_vpath ON files(virtual_path);"
+
+/* Used for case-insensitive virtual path lookups and prefix range scans, since
+ * the custom LIKE function can't use an index. daap_fold() is in sqlext.c. */
+#define I_FILE_VPATH_FOLD				\
+  "CREATE INDEX IF NOT EXISTS idx_file_vpath_fold ON files(daap_fold(virtual_path));"
+
 #define I_FILE_DIR					\
   "CREATE INDEX IF NOT EXISTS idx_file_dir ON files(disabled, directory_id);"
 
+/* Used to recognize files that were moved while we weren't watching */
+#define I_FILE_INODE					\
+  "CREATE INDEX IF NOT EXISTS idx_file_inode ON files(inode);"
+
 #define I_DATE_RELEASED                    \
   "CREATE INDEX IF NOT EXISTS idx_date_released ON files(disabled, date_released DESC, media_kind);"
 
+/* The following are partial indices of the enabled files, which is what
+ * db_build_query_clause() selects unless with_disabled is set. They are ordered
+ * so that the usual filter is an equality on the first column and the result
+ * comes out in ORDER BY order, so SQLite needs no temp B-tree to sort.
+ */
+
+/* Used by Q_ITEMS with a media_kind filter, also for keyset pagination by
+ * title_sort, id (the rowid follows title_sort in the index) */
+#define I_TITLE_MKIND				\
+  "CREATE INDEX IF NOT EXISTS idx_title_mkind ON files(media_kind, title_sort) WHERE disabled = 0;"
+
+/* Used by the tracks of an album, sorted by S_ALBUM */
+#define I_SALI_TRACKS				\
+  "CREATE INDEX IF NOT EXISTS idx_sali_tracks ON files(songalbumid, album_sort, disc, track) WHERE disabled = 0;"
+
+/* Used by Q_GROUP_ALBUMS for the albums of an artist, which groups by
+ * songalbumid */
+#define I_SARI_SALI				\
+  "CREATE INDEX IF NOT EXISTS idx_sari_sali ON files(songartistid, songalbumid) WHERE disabled = 0;"
+
+/* Used by "recently added" smart playlists */
+#define I_TIME_ADDED				\
+  "CREATE INDEX IF NOT EXISTS idx_time_added ON files(time_added) WHERE disabled = 0;"
+
 #define I_PL_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path);"
 
@@ -367,7 +477,7 @@ static const struct db_init_query db_init_table_queries[] =
   "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
 
 #define I_DIR_VPATH				\
-  "CREATE INDEX IF NOT EXISTS idx_dir_vpath ON directories(disabled, virtual_path);"
+  "CREATE INDEX IF NOT EXISTS idx_dir_vpath ON directories(virtual_path, disabled);"
 
 #define I_DIR_PARENT				\
   "CREATE INDEX IF NOT EXISTS idx_dir_parentid ON directories(parent_id);"
@@ -378,6 +488,12 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_QUEUE_SHUFFLEPOS				\
   "CREATE INDEX IF NOT EXISTS idx_queue_shufflepos ON queue(shuffle_pos);"
 
+#define I_SMARTPLITEMID				\
+  "CREATE INDEX IF NOT EXISTS idx_smartplitems_plid ON smartplitems(playlistid);"
+
+#define I_CHANGES_ITEM				\
+  "CREATE INDEX IF NOT EXISTS idx_changes_item ON changes(item_type, item_id);"
+
 static const struct db_init_query db_init_index_queries[] =
   {
     { I_RESCAN,    "create rescan index" },
@@ -393,8 +509,15 @@ static const struct db_init_query db_init_index_queries[] =
     { I_TITLE,     "create title index" },
     { I_ALBUM,     "create album index" },
     { I_FILELIST,  "create filelist index" },
+    { I_FILE_VPATH, "create file virtual_path index" },
+    { I_FILE_VPATH_FOLD, "create file folded virtual_path index" },
     { I_FILE_DIR,  "create file dir index" },
+    { I_FILE_INODE, "create file inode index" },
     { I_DATE_RELEASED, "create date_released index" },
+    { I_TITLE_MKIND, "create partial mkind/title index" },
+    { I_SALI_TRACKS, "create partial sali/tracks index" },
+    { I_SARI_SALI, "create partial sari/sali index" },
+    { I_TIME_ADDED, "create partial time_added index" },
 
     { I_PL_PATH,   "create playlist path index" },
     { I_PL_DISABLED, "create playlist state index" },
@@ -402,42 +525,352 @@ static const struct db_init_query db_init_index_queries[] =
 
     { I_FILEPATH,  "create file path index" },
     { I_PLITEMID,  "create playlist id index" },
+    { I_SMARTPLITEMID, "create smart playlist id index" },
 
     { I_GRP_PERSIST, "create groups persistentid index" },
 
     { I_PAIRING,   "create pairing guid index" },
 
-    { I_DIR_VPATH,   "create directories disabled_virtualpath index" },
+    { I_DIR_VPATH,   "create directories virtualpath_disabled index" },
     { I_DIR_PARENT,  "create directories parentid index" },
 
     { I_QUEUE_POS,  "create queue pos index" },
     { I_QUEUE_SHUFFLEPOS,  "create queue shuffle pos index" },
+
+    { I_CHANGES_ITEM, "create changes item index" },
+  };
+
+/* Indices that the library scan doesn't need for its own lookups. When a scan
+ * starts with an empty library, db_bulk_load_begin() drops them, so they don't
+ * have to be maintained for every insert, and db_init_indices() creates them
+ * again when the scan is done.
+ */
+static const char *db_init_deferrable_indices[] =
+  {
+    "idx_fname",
+    "idx_sari",
+    "idx_sali",
+    "idx_state_mkind_sari",
+    "idx_state_mkind_sali",
+    "idx_albumartist",
+    "idx_composer",
+    "idx_genre",
+    "idx_title",
+    "idx_album",
+    "idx_filelist",
+    "idx_date_released",
+    "idx_title_mkind",
+    "idx_sali_tracks",
+    "idx_sari_sali",
+    "idx_time_added",
   };
 
 
 /* Triggers must be prefixed with trg_ for db_drop_triggers() to id them */
 
+/* The groups triggers also maintain groups.file_count, the number of enabled
+ * files in the group, so db_groups_cleanup() only has to look at groups where
+ * it dropped to zero.
+ */
+
 #define TRG_GROUPS_INSERT										\
   "CREATE TRIGGER trg_groups_insert AFTER INSERT ON files FOR EACH ROW"					\
   " BEGIN"												\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  "   UPDATE groups SET file_count = file_count + 1"							\
+  "     WHERE NEW.disabled = 0 AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));"	\
   " END;"
 
 #define TRG_GROUPS_UPDATE										\
-  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid ON files FOR EACH ROW"	\
+  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid, disabled ON files FOR EACH ROW"	\
+  " WHEN OLD.songalbumid IS NOT NEW.songalbumid OR OLD.songartistid IS NOT NEW.songartistid"		\
+  "   OR (OLD.disabled = 0) <> (NEW.disabled = 0)"								\
   " BEGIN"												\
+  "   UPDATE groups SET file_count = file_count - 1"							\
+  "     WHERE OLD.disabled = 0 AND ((type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid));"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  "   UPDATE groups SET file_count = file_count + 1"							\
+  "     WHERE NEW.disabled = 0 AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));"	\
+  " END;"
+
+#define TRG_GROUPS_DELETE										\
+  "CREATE TRIGGER trg_groups_delete AFTER DELETE ON files FOR EACH ROW"					\
+  " WHEN OLD.disabled = 0"										\
+  " BEGIN"												\
+  "   UPDATE groups SET file_count = file_count - 1"							\
+  "     WHERE (type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid);"	\
+  " END;"
+
+/* Keep the library counters in the admin table up to date, so that getting
+ * the library totals doesn't require scanning the files table. Must be created
+ * after the trg_groups_* triggers, since they depend on groups.file_count.
+ */
+
+// Adds (sign 1) or subtracts (sign -1) the file row R to/from the counters
+#define TRG_COUNTERS_FILES_SET(R, sign)							\
+  "   UPDATE admin SET value = value + (" sign ") * CASE key"				\
+  "       WHEN 'files_count' THEN 1"							\
+  "       WHEN 'files_length' THEN IFNULL(" R ".song_length, 0)"			\
+  "       WHEN 'files_size' THEN IFNULL(" R ".file_size, 0)"				\
+  "       WHEN 'files_streams' THEN (" R ".data_kind = 1)"				\
+  "     END"										\
+  "     WHERE " R ".disabled = 0 AND key IN ('files_count', 'files_length', 'files_size', 'files_streams');"
+
+#define TRG_COUNTERS_FILES_INSERT							\
+  "CREATE TRIGGER trg_counters_files_insert AFTER INSERT ON files FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_COUNTERS_FILES_SET("NEW", "1")							\
+  " END;"
+
+#define TRG_COUNTERS_FILES_UPDATE							\
+  "CREATE TRIGGER trg_counters_files_update AFTER UPDATE OF disabled, song_length, file_size, data_kind ON files FOR EACH ROW" \
+  " BEGIN"										\
+  TRG_COUNTERS_FILES_SET("OLD", "-1")							\
+  TRG_COUNTERS_FILES_SET("NEW", "1")							\
+  " END;"
+
+#define TRG_COUNTERS_FILES_DELETE							\
+  "CREATE TRIGGER trg_counters_files_delete AFTER DELETE ON files FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_COUNTERS_FILES_SET("OLD", "-1")							\
+  " END;"
+
+#define TRG_COUNTERS_GROUPS_UPDATE							\
+  "CREATE TRIGGER trg_counters_groups_update AFTER UPDATE OF file_count ON groups FOR EACH ROW"	\
+  " WHEN (OLD.file_count > 0) <> (NEW.file_count > 0)"					\
+  " BEGIN"										\
+  "   UPDATE admin SET value = value + (CASE WHEN NEW.file_count > 0 THEN 1 ELSE -1 END)"	\
+  "     WHERE key = (CASE NEW.type WHEN 1 THEN 'albums_count' ELSE 'artists_count' END);"	\
+  " END;"
+
+#define TRG_COUNTERS_GROUPS_DELETE							\
+  "CREATE TRIGGER trg_counters_groups_delete AFTER DELETE ON groups FOR EACH ROW"	\
+  " WHEN OLD.file_count > 0"								\
+  " BEGIN"										\
+  "   UPDATE admin SET value = value - 1"						\
+  "     WHERE key = (CASE OLD.type WHEN 1 THEN 'albums_count' ELSE 'artists_count' END);"	\
+  " END;"
+
+#define TRG_COUNTERS_PL_INSERT								\
+  "CREATE TRIGGER trg_counters_pl_insert AFTER INSERT ON playlists FOR EACH ROW"	\
+  " WHEN NEW.disabled = 0"								\
+  " BEGIN"										\
+  "   UPDATE admin SET value = value + 1 WHERE key = 'pl_count';"			\
+  " END;"
+
+#define TRG_COUNTERS_PL_UPDATE								\
+  "CREATE TRIGGER trg_counters_pl_update AFTER UPDATE OF disabled ON playlists FOR EACH ROW"	\
+  " WHEN (OLD.disabled = 0) <> (NEW.disabled = 0)"					\
+  " BEGIN"										\
+  "   UPDATE admin SET value = value + (CASE WHEN NEW.disabled = 0 THEN 1 ELSE -1 END) WHERE key = 'pl_count';"	\
+  " END;"
+
+#define TRG_COUNTERS_PL_DELETE								\
+  "CREATE TRIGGER trg_counters_pl_delete AFTER DELETE ON playlists FOR EACH ROW"	\
+  " WHEN OLD.disabled = 0"								\
+  " BEGIN"										\
+  "   UPDATE admin SET value = value - 1 WHERE key = 'pl_count';"			\
+  " END;"
+
+/* Log changes of files and playlists to the changes table (item_type 0 is a
+ * file, 1 a playlist). An update that only refreshes db_timestamp, which
+ * rescans do for every unchanged file, is not a change. Disabling an item
+ * counts as deleting it. Changes of playlist items are logged as a change of
+ * the playlist, but only once if the playlist was also the latest change,
+ * since scanning a playlist adds its items one by one.
+ */
+#define TRG_CHANGES_ADD(type, R, is_deleted)						\
+  "   INSERT INTO changes (item_type, item_id, is_deleted) VALUES (" type ", " R ", " is_deleted ");"
+
+#define TRG_CHANGES_FILES_INSERT							\
+  "CREATE TRIGGER trg_changes_files_insert AFTER INSERT ON files FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_CHANGES_ADD("0", "NEW.id", "NEW.disabled <> 0")					\
+  " END;"
+
+#define TRG_CHANGES_FILES_UPDATE							\
+  "CREATE TRIGGER trg_changes_files_update AFTER UPDATE ON files FOR EACH ROW"		\
+  " WHEN OLD.db_timestamp = NEW.db_timestamp OR OLD.time_modified <> NEW.time_modified OR OLD.disabled <> NEW.disabled" \
+  " BEGIN"										\
+  TRG_CHANGES_ADD("0", "NEW.id", "NEW.disabled <> 0")					\
+  " END;"
+
+#define TRG_CHANGES_FILES_DELETE							\
+  "CREATE TRIGGER trg_changes_files_delete AFTER DELETE ON files FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_CHANGES_ADD("0", "OLD.id", "1")							\
+  " END;"
+
+#define TRG_CHANGES_PL_INSERT								\
+  "CREATE TRIGGER trg_changes_pl_insert AFTER INSERT ON playlists FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_CHANGES_ADD("1", "NEW.id", "NEW.disabled <> 0")					\
+  " END;"
+
+#define TRG_CHANGES_PL_UPDATE								\
+  "CREATE TRIGGER trg_changes_pl_update AFTER UPDATE ON playlists FOR EACH ROW"		\
+  " WHEN OLD.db_timestamp = NEW.db_timestamp OR OLD.disabled <> NEW.disabled OR OLD.title IS NOT NEW.title" \
+  " BEGIN"										\
+  TRG_CHANGES_ADD("1", "NEW.id", "NEW.disabled <> 0")					\
+  " END;"
+
+#define TRG_CHANGES_PL_DELETE								\
+  "CREATE TRIGGER trg_changes_pl_delete AFTER DELETE ON playlists FOR EACH ROW"		\
+  " BEGIN"										\
+  TRG_CHANGES_ADD("1", "OLD.id", "1")							\
+  " END;"
+
+#define TRG_CHANGES_PLITEMS_SET(R)							\
+  "   INSERT INTO changes (item_type, item_id, is_deleted) SELECT 1, " R ".playlistid, 0"	\
+  "     WHERE NOT EXISTS (SELECT 1 FROM changes WHERE id = (SELECT MAX(id) FROM changes)"	\
+  "       AND item_type = 1 AND item_id = " R ".playlistid);"
+
+#define TRG_CHANGES_PLITEMS_INSERT							\
+  "CREATE TRIGGER trg_changes_plitems_insert AFTER INSERT ON playlistitems FOR EACH ROW"	\
+  " BEGIN"										\
+  TRG_CHANGES_PLITEMS_SET("NEW")							\
+  " END;"
+
+#define TRG_CHANGES_PLITEMS_DELETE							\
+  "CREATE TRIGGER trg_changes_plitems_delete AFTER DELETE ON playlistitems FOR EACH ROW"	\
+  " BEGIN"										\
+  TRG_CHANGES_PLITEMS_SET("OLD")							\
   " END;"
 
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_GROUPS_DELETE,           "create trigger trg_groups_delete" },
+    { TRG_COUNTERS_FILES_INSERT,   "create trigger trg_counters_files_insert" },
+    { TRG_COUNTERS_FILES_UPDATE,   "create trigger trg_counters_files_update" },
+    { TRG_COUNTERS_FILES_DELETE,   "create trigger trg_counters_files_delete" },
+    { TRG_COUNTERS_GROUPS_UPDATE,  "create trigger trg_counters_groups_update" },
+    { TRG_COUNTERS_GROUPS_DELETE,  "create trigger trg_counters_groups_delete" },
+    { TRG_COUNTERS_PL_INSERT,      "create trigger trg_counters_pl_insert" },
+    { TRG_COUNTERS_PL_UPDATE,      "create trigger trg_counters_pl_update" },
+    { TRG_COUNTERS_PL_DELETE,      "create trigger trg_counters_pl_delete" },
+    { TRG_CHANGES_FILES_INSERT,    "create trigger trg_changes_files_insert" },
+    { TRG_CHANGES_FILES_UPDATE,    "create trigger trg_changes_files_update" },
+    { TRG_CHANGES_FILES_DELETE,    "create trigger trg_changes_files_delete" },
+    { TRG_CHANGES_PL_INSERT,       "create trigger trg_changes_pl_insert" },
+    { TRG_CHANGES_PL_UPDATE,       "create trigger trg_changes_pl_update" },
+    { TRG_CHANGES_PL_DELETE,       "create trigger trg_changes_pl_delete" },
+    { TRG_CHANGES_PLITEMS_INSERT,  "create trigger trg_changes_plitems_insert" },
+    { TRG_CHANGES_PLITEMS_DELETE,  "create trigger trg_changes_plitems_delete" },
   };
 
 
+/* Full-text search index over the files table, used for searches. It is an
+ * external content table, so it only holds the index, and the triggers below
+ * keep it in sync with files. Requires an SQLite with FTS5 and the trigram
+ * tokenizer, which gives the same substring semantics as LIKE '%term%'.
+ */
+
+#define T_FILES_FTS								\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("			\
+  "   title, artist, album, album_artist, composer, genre,"			\
+  "   content = 'files', content_rowid = 'id', tokenize = 'trigram'"		\
+  ");"
+
+#define FTS_COLS "title, artist, album, album_artist, composer, genre"
+#define FTS_NEW  "NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre"
+#define FTS_OLD  "OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre"
+
+#define TRG_FILES_FTS_INSERT									\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_insert AFTER INSERT ON files FOR EACH ROW"	\
+  " BEGIN"											\
+  "   INSERT INTO files_fts (rowid, " FTS_COLS ") VALUES (NEW.id, " FTS_NEW ");"		\
+  " END;"
+
+#define TRG_FILES_FTS_DELETE									\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_delete AFTER DELETE ON files FOR EACH ROW"	\
+  " BEGIN"											\
+  "   INSERT INTO files_fts (files_fts, rowid, " FTS_COLS ") VALUES ('delete', OLD.id, " FTS_OLD ");"	\
+  " END;"
+
+#define TRG_FILES_FTS_UPDATE									\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_update AFTER UPDATE OF " FTS_COLS " ON files FOR EACH ROW"	\
+  " WHEN OLD.title IS NOT NEW.title OR OLD.artist IS NOT NEW.artist OR OLD.album IS NOT NEW.album"	\
+  "   OR OLD.album_artist IS NOT NEW.album_artist OR OLD.composer IS NOT NEW.composer OR OLD.genre IS NOT NEW.genre"	\
+  " BEGIN"											\
+  "   INSERT INTO files_fts (files_fts, rowid, " FTS_COLS ") VALUES ('delete', OLD.id, " FTS_OLD ");"	\
+  "   INSERT INTO files_fts (rowid, " FTS_COLS ") VALUES (NEW.id, " FTS_NEW ");"		\
+  " END;"
+
+// If the sync trigger is missing (new table, or dropped by a schema upgrade)
+// the index may be stale and must be rebuilt
+#define Q_FILES_FTS_EXISTS \
+  "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name = 'trg_files_fts_update';"
+
+#define Q_FILES_FTS_REBUILD \
+  "INSERT INTO files_fts (files_fts) VALUES ('rebuild');"
+
+static const struct db_init_query db_init_fts_queries[] =
+  {
+    { T_FILES_FTS,             "create table files_fts" },
+    { TRG_FILES_FTS_INSERT,    "create trigger trg_files_fts_insert" },
+    { TRG_FILES_FTS_DELETE,    "create trigger trg_files_fts_delete" },
+    { TRG_FILES_FTS_UPDATE,    "create trigger trg_files_fts_update" },
+  };
+
+// Without the triggers file writes would fail if FTS5 isn't available
+#define Q_FILES_FTS_DROP_TRIGGERS \
+  "DROP TRIGGER IF EXISTS trg_files_fts_insert;" \
+  "DROP TRIGGER IF EXISTS trg_files_fts_delete;" \
+  "DROP TRIGGER IF EXISTS trg_files_fts_update;"
+
+static int
+fts_exists_cb(void *arg, int ncols, char **values, char **names)
+{
+  int *exists = arg;
+
+  *exists = (values[0] && values[0][0] != '0');
+  return 0;
+}
+
+int
+db_init_fts(sqlite3 *hdl)
+{
+  char *errmsg;
+  int exists = 0;
+  int i;
+  int ret;
+
+  ret = sqlite3_exec(hdl, Q_FILES_FTS_EXISTS, fts_exists_cb, &exists, &errmsg);
+  if (ret != SQLITE_OK)
+    goto error;
+
+  for (i = 0; i < (sizeof(db_init_fts_queries) / sizeof(db_init_fts_queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init fts query: %s\n", db_init_fts_queries[i].desc);
+
+      ret = sqlite3_exec(hdl, db_init_fts_queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	goto error;
+    }
+
+  if (!exists)
+    {
+      DPRINTF(E_LOG, L_DB, "Building full-text search index, this may take some time...\n");
+
+      ret = sqlite3_exec(hdl, Q_FILES_FTS_REBUILD, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	goto error;
+    }
+
+  return 0;
+
+ error:
+  DPRINTF(E_LOG, L_DB, "Full-text search not available (SQLite without FTS5/trigram?): %s\n", errmsg);
+  sqlite3_free(errmsg);
+
+  sqlite3_exec(hdl, Q_FILES_FTS_DROP_TRIGGERS, NULL, NULL, NULL);
+  return -1;
+}
+
 int
 db_init_indices(sqlite3 *hdl)
 {
@@ -462,6 +895,34 @@ db_init_indices(sqlite3 *hdl)
   return 0;
 }
 
+int
+db_init_indices_deferrable_drop(sqlite3 *hdl)
+{
+  char *query;
+  char *errmsg;
+  int i;
+  int ret;
+
+  for (i = 0; i < (sizeof(db_init_deferrable_indices) / sizeof(db_init_deferrable_indices[0])); i++)
+    {
+      query = sqlite3_mprintf("DROP INDEX IF EXISTS %s;", db_init_deferrable_indices[i]);
+
+      DPRINTF(E_DBG, L_DB, "DB init index query: %s\n", query);
+
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not drop index %s: %s\n", db_init_deferrable_indices[i], errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
 int
 db_init_triggers(sqlite3 *hdl)
 {
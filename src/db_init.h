@@ -26,15 +26,21 @@
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * the server after the database was upgraded. */
 #define SCHEMA_VERSION_MAJOR 22
-#define SCHEMA_VERSION_MINOR 2
+#define SCHEMA_VERSION_MINOR 11
 
 int
 db_init_indices(sqlite3 *hdl);
 
+int
+db_init_indices_deferrable_drop(sqlite3 *hdl);
+
 int
 db_init_triggers(sqlite3 *hdl);
 
 int
 db_init_tables(sqlite3 *hdl);
 
+int
+db_init_fts(sqlite3 *hdl);
+
 #endif /* SRC_DB_INIT_H_ */
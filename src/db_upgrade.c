@@ -1265,6 +1265,205 @@ static const struct db_upgrade_query db_upgrade_v2202_queries[] =
   };
 
 
+/* ---------------------------- 22.02 -> 22.03 ------------------------------ */
+
+#define U_v2203_ALTER_GROUPS_ADD_FILE_COUNT \
+  "ALTER TABLE groups ADD COLUMN file_count INTEGER DEFAULT 0;"
+#define U_v2203_GROUPS_SET_FILE_COUNT_ALBUM \
+  "UPDATE groups SET file_count = (SELECT COUNT(*) FROM files f WHERE f.songalbumid = groups.persistentid AND f.disabled = 0) WHERE type = 1;"
+#define U_v2203_GROUPS_SET_FILE_COUNT_ARTIST \
+  "UPDATE groups SET file_count = (SELECT COUNT(*) FROM files f WHERE f.songartistid = groups.persistentid AND f.disabled = 0) WHERE type = 2;"
+
+#define U_v2203_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2203_SCVER_MINOR                    \
+  "UPDATE admin SET value = '03' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2203_queries[] =
+  {
+    { U_v2203_ALTER_GROUPS_ADD_FILE_COUNT, "alter table groups add column file_count" },
+    { U_v2203_GROUPS_SET_FILE_COUNT_ALBUM, "set file_count for album groups" },
+    { U_v2203_GROUPS_SET_FILE_COUNT_ARTIST, "set file_count for artist groups" },
+
+    { U_v2203_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2203_SCVER_MINOR,    "set schema_version_minor to 03" },
+  };
+
+
+#define U_v2204_COUNTERS_FILES \
+  "INSERT INTO admin (key, value)" \
+  " SELECT 'files_count', COUNT(*) FROM files WHERE disabled = 0" \
+  " UNION ALL SELECT 'files_length', IFNULL(SUM(song_length), 0) FROM files WHERE disabled = 0" \
+  " UNION ALL SELECT 'files_size', IFNULL(SUM(file_size), 0) FROM files WHERE disabled = 0" \
+  " UNION ALL SELECT 'files_streams', COUNT(*) FROM files WHERE disabled = 0 AND data_kind = 1;"
+#define U_v2204_COUNTERS_GROUPS \
+  "INSERT INTO admin (key, value)" \
+  " SELECT 'albums_count', COUNT(*) FROM groups WHERE type = 1 AND file_count > 0" \
+  " UNION ALL SELECT 'artists_count', COUNT(*) FROM groups WHERE type = 2 AND file_count > 0;"
+#define U_v2204_COUNTERS_PL \
+  "INSERT INTO admin (key, value) SELECT 'pl_count', COUNT(*) FROM playlists WHERE disabled = 0;"
+
+#define U_v2204_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2204_SCVER_MINOR                    \
+  "UPDATE admin SET value = '04' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2204_queries[] =
+  {
+    { U_v2204_COUNTERS_FILES,  "initialize file counters" },
+    { U_v2204_COUNTERS_GROUPS, "initialize album and artist counters" },
+    { U_v2204_COUNTERS_PL,     "initialize playlist counter" },
+
+    { U_v2204_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2204_SCVER_MINOR,    "set schema_version_minor to 04" },
+  };
+
+
+/* ---------------------------- 22.04 -> 22.05 ------------------------------ */
+
+#define U_v2205_ALTER_FILES_ADD_INODE \
+  "ALTER TABLE files ADD COLUMN inode INTEGER DEFAULT 0;"
+
+#define U_v2205_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2205_SCVER_MINOR                    \
+  "UPDATE admin SET value = '05' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2205_queries[] =
+  {
+    { U_v2205_ALTER_FILES_ADD_INODE, "alter table files add column inode" },
+
+    { U_v2205_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2205_SCVER_MINOR,    "set schema_version_minor to 05" },
+  };
+
+
+#define U_v2206_ALTER_PL_ADD_ETAG \
+  "ALTER TABLE playlists ADD COLUMN http_etag VARCHAR(255) DEFAULT NULL;"
+#define U_v2206_ALTER_PL_ADD_MODIFIED \
+  "ALTER TABLE playlists ADD COLUMN http_modified VARCHAR(64) DEFAULT NULL;"
+
+#define U_v2206_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2206_SCVER_MINOR                    \
+  "UPDATE admin SET value = '06' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2206_queries[] =
+  {
+    { U_v2206_ALTER_PL_ADD_ETAG,     "alter table playlists add column http_etag" },
+    { U_v2206_ALTER_PL_ADD_MODIFIED, "alter table playlists add column http_modified" },
+
+    { U_v2206_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2206_SCVER_MINOR,    "set schema_version_minor to 06" },
+  };
+
+
+#define U_v2207_NEW_SMARTPLITEMS_TABLE				\
+  "CREATE TABLE IF NOT EXISTS smartplitems ("			\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"		\
+  "   playlistid     INTEGER NOT NULL,"				\
+  "   fileid         INTEGER NOT NULL"				\
+  ");"
+#define U_v2207_NEW_SMARTPLS_TABLE				\
+  "CREATE TABLE IF NOT EXISTS smartpls ("			\
+  "   playlistid     INTEGER PRIMARY KEY NOT NULL,"		\
+  "   query          VARCHAR(1024) NOT NULL,"			\
+  "   query_order    VARCHAR(1024) DEFAULT NULL,"		\
+  "   query_limit    INTEGER DEFAULT 0,"			\
+  "   db_modified    INTEGER DEFAULT 0,"			\
+  "   expires        INTEGER DEFAULT 0"				\
+  ");"
+
+#define U_v2207_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2207_SCVER_MINOR                    \
+  "UPDATE admin SET value = '07' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2207_queries[] =
+  {
+    { U_v2207_NEW_SMARTPLITEMS_TABLE, "create new table smartplitems" },
+    { U_v2207_NEW_SMARTPLS_TABLE,     "create new table smartpls" },
+
+    { U_v2207_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2207_SCVER_MINOR,    "set schema_version_minor to 07" },
+  };
+
+
+#define U_v2208_NEW_CHANGES_TABLE				\
+  "CREATE TABLE IF NOT EXISTS changes ("			\
+  "   id             INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   item_type      INTEGER NOT NULL,"			\
+  "   item_id        INTEGER NOT NULL,"			\
+  "   is_deleted     INTEGER DEFAULT 0"			\
+  ");"
+
+#define U_v2208_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2208_SCVER_MINOR                    \
+  "UPDATE admin SET value = '08' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2208_queries[] =
+  {
+    { U_v2208_NEW_CHANGES_TABLE, "create new table changes" },
+
+    { U_v2208_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2208_SCVER_MINOR,    "set schema_version_minor to 08" },
+  };
+
+
+#define U_v2209_NEW_SCROBBLES_TABLE			\
+  "CREATE TABLE IF NOT EXISTS scrobbles ("		\
+  "   id             INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   service        INTEGER NOT NULL,"			\
+  "   listened_at    INTEGER NOT NULL,"			\
+  "   title          VARCHAR(1024) DEFAULT NULL,"	\
+  "   artist         VARCHAR(1024) DEFAULT NULL,"	\
+  "   album          VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_artist   VARCHAR(1024) DEFAULT NULL,"	\
+  "   track          INTEGER DEFAULT 0,"		\
+  "   song_length    INTEGER DEFAULT 0"			\
+  ");"
+
+#define U_v2209_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2209_SCVER_MINOR                    \
+  "UPDATE admin SET value = '09' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2209_queries[] =
+  {
+    { U_v2209_NEW_SCROBBLES_TABLE, "create new table scrobbles" },
+
+    { U_v2209_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2209_SCVER_MINOR,    "set schema_version_minor to 09" },
+  };
+
+
+// Only new indices, which db_init_indices() creates after the upgrade
+#define U_v2210_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2210_SCVER_MINOR                    \
+  "UPDATE admin SET value = '10' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2210_queries[] =
+  {
+    { U_v2210_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2210_SCVER_MINOR,    "set schema_version_minor to 10" },
+  };
+
+
+// Only new indices, which db_init_indices() creates after the upgrade
+#define U_v2211_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2211_SCVER_MINOR                    \
+  "UPDATE admin SET value = '11' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2211_queries[] =
+  {
+    { U_v2211_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2211_SCVER_MINOR,    "set schema_version_minor to 11" },
+  };
+
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1489,6 +1688,69 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2202:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2203_queries, ARRAY_SIZE(db_upgrade_v2203_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2203:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2204_queries, ARRAY_SIZE(db_upgrade_v2204_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2204:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2205_queries, ARRAY_SIZE(db_upgrade_v2205_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2205:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2206_queries, ARRAY_SIZE(db_upgrade_v2206_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2206:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2207_queries, ARRAY_SIZE(db_upgrade_v2207_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2207:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2208_queries, ARRAY_SIZE(db_upgrade_v2208_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2208:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2209_queries, ARRAY_SIZE(db_upgrade_v2209_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2209:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2210_queries, ARRAY_SIZE(db_upgrade_v2210_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2210:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2211_queries, ARRAY_SIZE(db_upgrade_v2211_queries));
+      if (ret < 0)
+	return -1;
+
       /* Last case statement is the only one that ends with a break statement! */
       break;
 
@@ -20,8 +20,11 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "db.h"
 #include "misc.h"
@@ -32,6 +35,33 @@
 /* gperf static hash, dmap_fields.gperf */
 #include "dmap_fields_hash.h"
 
+/* Cache of encoded song list records (mlit), see dmap_encode_file_metadata().
+ * When the size limit is reached the cache is emptied and starts over.
+ */
+#define DMAP_RECORD_CACHE_BUCKETS 16384
+#define DMAP_RECORD_CACHE_MAX (32 * 1024 * 1024)
+
+struct dmap_record
+{
+  uint32_t id;
+  // Which fields the record has (the meta tags of the request)
+  uint64_t fields_key;
+  // And the values they were encoded from
+  uint64_t values_hash;
+
+  struct dmap_record *next;
+
+  size_t len;
+  uint8_t data[];
+};
+
+static struct dmap_record *dmap_record_cache[DMAP_RECORD_CACHE_BUCKETS];
+static size_t dmap_record_cache_size;
+static pthread_mutex_t dmap_record_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Remotes repeat the same queries, so we keep the SQL of the latest ones */
+static struct lru_cache dmap_query_cache = LRU_CACHE_INITIALIZER(lru_cache_strdup, free);
+
 
 const struct dmap_field *
 dmap_get_fields_table(int *nfields)
@@ -359,8 +389,190 @@ dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errms
   dmap_add_string(evbuf, "msts", errmsg);
 }
 
-int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+static const struct dmap_field *
+meta_field_get(int i, const struct dmap_field **meta, int nmeta)
+{
+  /* Specific meta tags requested (or default list) */
+  if (nmeta > 0)
+    return (i < nmeta && meta[i]->dfm) ? meta[i] : NULL;
+
+  /* No specific meta tags requested, send out everything */
+  return (i < ARRAY_SIZE(dmap_fields)) ? &dmap_fields[i] : NULL;
+}
+
+// FNV-1a, the terminating zero is included so that "ab" + "c" != "a" + "bc"
+static uint64_t
+hash_add_string(uint64_t h, const char *str)
+{
+  if (!str)
+    return (h ^ 0xff) * 0x100000001b3ULL;
+
+  do
+    h = (h ^ (uint8_t)*str) * 0x100000001b3ULL;
+  while (*str++);
+
+  return h;
+}
+
+static uint64_t
+record_fields_key(const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; i < nmeta; i++)
+    h = (h ^ (uintptr_t)meta[i]) * 0x100000001b3ULL;
+
+  return (h ^ (nmeta << 1 | !!sort_tags)) * 0x100000001b3ULL;
+}
+
+// Hashes the values that file_metadata_encode() will encode, which is a lot
+// cheaper than encoding them
+static uint64_t
+record_values_hash(struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  const struct dmap_field *df;
+  char **strval;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; (df = meta_field_get(i, meta, nmeta)); i++)
+    {
+      if (df->dfm->mfi_offset < 0)
+	continue;
+
+      strval = (char **) ((char *)dbmfi + df->dfm->mfi_offset);
+      h = hash_add_string(h, *strval);
+    }
+
+  if (sort_tags)
+    {
+      h = hash_add_string(h, dbmfi->title_sort);
+      h = hash_add_string(h, dbmfi->artist_sort);
+      h = hash_add_string(h, dbmfi->album_sort);
+      h = hash_add_string(h, dbmfi->album_artist_sort);
+      h = hash_add_string(h, dbmfi->composer_sort);
+    }
+
+  return h;
+}
+
+static struct dmap_record **
+record_cache_bucket(uint32_t id, uint64_t fields_key)
+{
+  uint64_t h = (id * 0x9e3779b97f4a7c15ULL) ^ fields_key;
+
+  return &dmap_record_cache[(h ^ (h >> 32)) % DMAP_RECORD_CACHE_BUCKETS];
+}
+
+// Must be called with the lock held
+static void
+record_cache_clear(void)
+{
+  struct dmap_record *rec;
+  int i;
+
+  for (i = 0; i < DMAP_RECORD_CACHE_BUCKETS; i++)
+    {
+      while ((rec = dmap_record_cache[i]))
+	{
+	  dmap_record_cache[i] = rec->next;
+	  free(rec);
+	}
+    }
+
+  dmap_record_cache_size = 0;
+}
+
+// Returns true and adds the record to songlist if it is cached and still valid
+static bool
+record_cache_get(struct evbuffer *songlist, uint32_t id, uint64_t fields_key, uint64_t values_hash)
+{
+  struct dmap_record *rec;
+  bool found = false;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&dmap_record_cache_lck));
+
+  for (rec = *record_cache_bucket(id, fields_key); rec; rec = rec->next)
+    {
+      if (rec->id == id && rec->fields_key == fields_key)
+	{
+	  found = (rec->values_hash == values_hash) && (evbuffer_add(songlist, rec->data, rec->len) == 0);
+	  break;
+	}
+    }
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&dmap_record_cache_lck));
+
+  return found;
+}
+
+// Caches what has been added to songlist after offset, replacing any outdated
+// record of the same item
+static void
+record_cache_add(struct evbuffer *songlist, size_t offset, uint32_t id, uint64_t fields_key, uint64_t values_hash)
+{
+  struct dmap_record **bucket;
+  struct dmap_record **prev;
+  struct dmap_record *rec;
+  struct evbuffer_ptr pos;
+  size_t len;
+
+  len = evbuffer_get_length(songlist) - offset;
+
+  rec = malloc(sizeof(struct dmap_record) + len);
+  if (!rec)
+    return;
+
+  if (evbuffer_ptr_set(songlist, &pos, offset, EVBUFFER_PTR_SET) < 0 || evbuffer_copyout_from(songlist, &pos, rec->data, len) != len)
+    {
+      free(rec);
+      return;
+    }
+
+  rec->id = id;
+  rec->fields_key = fields_key;
+  rec->values_hash = values_hash;
+  rec->len = len;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&dmap_record_cache_lck));
+
+  if (dmap_record_cache_size + len > DMAP_RECORD_CACHE_MAX)
+    {
+      DPRINTF(E_DBG, L_DAAP, "DMAP record cache is full, clearing\n");
+      record_cache_clear();
+    }
+
+  bucket = record_cache_bucket(id, fields_key);
+  for (prev = bucket; *prev; prev = &(*prev)->next)
+    {
+      if ((*prev)->id == id && (*prev)->fields_key == fields_key)
+	{
+	  dmap_record_cache_size -= (*prev)->len;
+	  rec->next = (*prev)->next;
+	  free(*prev);
+	  *prev = rec->next;
+	  break;
+	}
+    }
+
+  rec->next = *bucket;
+  *bucket = rec;
+  dmap_record_cache_size += len;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&dmap_record_cache_lck));
+}
+
+void
+dmap_record_cache_purge(void)
+{
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&dmap_record_cache_lck));
+  record_cache_clear();
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&dmap_record_cache_lck));
+}
+
+static int
+file_metadata_encode(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
@@ -376,33 +588,9 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   want_asdk = 0;
   want_ased = 0;
 
-  i = -1;
-  while (1)
+  for (i = 0; (df = meta_field_get(i, meta, nmeta)); i++)
     {
-      i++;
-
-      /* Specific meta tags requested (or default list) */
-      if (nmeta > 0)
-	{
-	  if (i == nmeta)
-	    break;
-
-	  df = meta[i];
-	  if (df->dfm)
-	    dfm = df->dfm;
-	  else
-	    break;
-	}
-      /* No specific meta tags requested, send out everything */
-      else
-	{
-	  /* End of list */
-	  if (i == (sizeof(dmap_fields) / sizeof(dmap_fields[0])))
-	    break;
-
-	  df = &dmap_fields[i];
-	  dfm = dmap_fields[i].dfm;
-	}
+      dfm = df->dfm;
 
       /* Extradata not in media_file_info but flag for reply */
       if (dfm == &dfm_dmap_ased)
@@ -502,6 +690,38 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   return 0;
 }
 
+// The encoded records are cached, since encoding every field of every song is
+// the main cost of making a song list. A record is reused if the values it was
+// encoded from are unchanged, so nothing needs to be invalidated when the
+// library changes (which it does through many different queries).
+int
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  uint64_t fields_key;
+  uint64_t values_hash;
+  uint32_t id;
+  size_t offset;
+  int ret;
+
+  if (!dbmfi->id || safe_atou32(dbmfi->id, &id) < 0)
+    return file_metadata_encode(songlist, song, dbmfi, meta, nmeta, sort_tags);
+
+  fields_key = record_fields_key(meta, nmeta, sort_tags);
+  values_hash = record_values_hash(dbmfi, meta, nmeta, sort_tags);
+
+  if (record_cache_get(songlist, id, fields_key, values_hash))
+    return 0;
+
+  offset = evbuffer_get_length(songlist);
+
+  ret = file_metadata_encode(songlist, song, dbmfi, meta, nmeta, sort_tags);
+  if (ret < 0)
+    return -1;
+
+  record_cache_add(songlist, offset, id, fields_key, values_hash);
+  return 0;
+}
+
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item)
 {
@@ -581,10 +801,15 @@ char *
 dmap_query_parse_sql(const char *dmap_query)
 {
   struct daap_result result;
+  char *sql;
 
   if (!dmap_query)
     return NULL;
 
+  sql = lru_cache_get(&dmap_query_cache, dmap_query);
+  if (sql)
+    return sql;
+
   DPRINTF(E_SPAM, L_DAAP, "Parse DMAP query input '%s'\n", dmap_query);
 
   if (daap_lex_parse(&result, dmap_query) != 0)
@@ -595,5 +820,7 @@ dmap_query_parse_sql(const char *dmap_query)
 
   DPRINTF(E_SPAM, L_DAAP, "Parse DMAP query output '%s'\n", result.str);
 
-  return safe_strdup(result.str);
+  lru_cache_add(&dmap_query_cache, dmap_query, result.str);
+
+  return strdup(result.str);
 }
@@ -78,9 +78,15 @@ dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg);
 
+/* Encodes the song as a mlit container, which is added to songlist. The song
+ * buffer is used as scratch. Encoded songs are cached, see dmap_common.c.
+ */
 int
 dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags);
 
+void
+dmap_record_cache_purge(void);
+
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
 
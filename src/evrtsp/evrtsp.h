@@ -146,6 +146,16 @@ void evrtsp_connection_set_closecb(struct evrtsp_connection *evcon,
 void evrtsp_connection_set_ciphercb(struct evrtsp_connection *evcon,
     int (*)(struct evbuffer *out, struct evbuffer *in, void *, int encrypt), void *);
 
+/**
+ * Allow up to max requests to be written before their replies have been
+ * received. Requests that are queued together are then sent in one write,
+ * which saves round trips. The replies must come in the order of the
+ * requests. If a reply has a CSeq that doesn't match, pipelining is turned
+ * off. The default max is 1, i.e. no pipelining.
+ */
+void evrtsp_connection_set_pipelining(struct evrtsp_connection *evcon,
+    int max);
+
 /**
  * Associates an event base with the connection - can only be called
  * on a freshly created connection object that has not been used yet.
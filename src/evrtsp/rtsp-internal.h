@@ -80,6 +80,9 @@ struct evrtsp_connection {
 	enum evrtsp_connection_state state;
 	int cseq;
 
+	int pipeline_max;		/* max requests written before replies */
+	int inflight;			/* requests written, waiting for reply */
+
 	TAILQ_HEAD(evcon_requestq, evrtsp_request) requests;
 	
 	void (*cb)(struct evrtsp_connection *, void *);
@@ -501,6 +501,25 @@ evrtsp_connection_done(struct evrtsp_connection *evcon)
 	TAILQ_REMOVE(&evcon->requests, req, next);
 	req->evcon = NULL;
 
+	if (evcon->inflight > 0)
+		evcon->inflight--;
+
+	if (evcon->inflight > 0 && evcon->state != EVCON_DISCONNECTED) {
+		/*
+		 * Pipelined, so read the reply to the next request. It may
+		 * already be in the input buffer, see evrtsp_read().
+		 */
+		evrtsp_start_read(evcon);
+		if (evbuffer_get_length(evcon->input_buffer) > 0)
+			event_active(&evcon->ev, EV_READ, 1);
+
+		(*req->cb)(req, req->cb_arg);
+
+		evrtsp_request_free(req);
+		return;
+	}
+
+	evcon->inflight = 0;
 	evcon->state = EVCON_IDLE;
 
 	if (TAILQ_FIRST(&evcon->requests) != NULL) {
@@ -623,6 +642,10 @@ evrtsp_read(int fd, short what, void *arg)
 		if (errno != EINTR && errno != EAGAIN) {
 			event_warn("%s: evbuffer_read", __func__);
 			evrtsp_connection_fail(evcon, EVCON_RTSP_EOF);
+		} else if (evbuffer_get_length(evcon->input_buffer) > 0) {
+			/* Nothing new, but a pipelined reply was read together
+			 * with the previous one */
+			evrtsp_read_message(evcon, req);
 		} else {
 			evrtsp_add_event(&evcon->ev, evcon->timeout,
 			    RTSP_READ_TIMEOUT);	       
@@ -659,12 +682,14 @@ evrtsp_write_connectioncb(struct evrtsp_connection *evcon, void *arg)
 {
 	/* This is after writing the request to the server */
 	struct evrtsp_request *req = TAILQ_FIRST(&evcon->requests);
+	int i;
 	assert(req != NULL);
 
 	assert(evcon->state == EVCON_WRITING);
 
-	/* We are done writing our header and are now expecting the response */
-	req->kind = EVRTSP_RESPONSE;
+	/* We are done writing our header(s) and are now expecting the response */
+	for (i = 0; req && i < evcon->inflight; req = TAILQ_NEXT(req, next), i++)
+		req->kind = EVRTSP_RESPONSE;
 
 	evrtsp_start_read(evcon);
 }
@@ -739,14 +764,22 @@ evrtsp_request_dispatch(struct evrtsp_connection* evcon)
 
 	evcon->state = EVCON_WRITING;
 
-	/* Create the header from the store arguments */
-	evrtsp_make_header(evcon, req);
+	/* owntone customisation for pipelining, write up to pipeline_max of the
+	 * queued requests */
+	evcon->inflight = 0;
+	do {
+		/* Create the header from the store arguments */
+		evrtsp_make_header(evcon, req);
+
+		/* owntone customisation for encryption */
+		if (!evcon->ciphercb)
+			evbuffer_add_buffer(evcon->output_raw, evcon->output_buffer);
+		else
+			evcon->ciphercb(evcon->output_raw, evcon->output_buffer, evcon->ciphercb_arg, 1);
 
-	/* owntone customisation for encryption */
-	if (!evcon->ciphercb)
-		evbuffer_add_buffer(evcon->output_raw, evcon->output_buffer);
-	else
-		evcon->ciphercb(evcon->output_raw, evcon->output_buffer, evcon->ciphercb_arg, 1);
+		evcon->inflight++;
+	} while (evcon->inflight < evcon->pipeline_max &&
+	    (req = TAILQ_NEXT(req, next)) != NULL);
 
 	evrtsp_write_buffer(evcon, evrtsp_write_connectioncb, NULL);
 }
@@ -767,6 +800,7 @@ evrtsp_connection_reset(struct evrtsp_connection *evcon)
 		evcon->fd = -1;
 	}
 	evcon->state = EVCON_DISCONNECTED;
+	evcon->inflight = 0;
 
 	evbuffer_drain(evcon->input_buffer,
 	    evbuffer_get_length(evcon->input_buffer));
@@ -1202,6 +1236,24 @@ evrtsp_read_firstline(struct evrtsp_connection *evcon,
 	evrtsp_read_header(evcon, req);
 }
 
+/* owntone customisation for pipelining. If the device doesn't return replies
+ * in order we can't match them with the requests, so stop pipelining. Some
+ * devices don't return a CSeq at all, which is fine. */
+static void
+evrtsp_check_cseq(struct evrtsp_connection *evcon, struct evrtsp_request *req)
+{
+	const char *out = evrtsp_find_header(req->output_headers, "CSeq");
+	const char *in = evrtsp_find_header(req->input_headers, "CSeq");
+
+	if (!out || !in || strcmp(out, in) == 0)
+		return;
+
+	event_warnx("%s: reply CSeq %s does not match request CSeq %s, "
+	    "disabling pipelining", __func__, in, out);
+
+	evcon->pipeline_max = 1;
+}
+
 static void
 evrtsp_read_header(struct evrtsp_connection *evcon, struct evrtsp_request *req)
 {
@@ -1224,6 +1276,9 @@ evrtsp_read_header(struct evrtsp_connection *evcon, struct evrtsp_request *req)
 	/* Done reading headers, do the real work */
 	switch (req->kind) {
 	case EVRTSP_RESPONSE:
+	  if (evcon->pipeline_max > 1)
+	    evrtsp_check_cseq(evcon, req);
+
 	  event_debug(("%s: start of read body on %d",
 		       __func__, fd));
 	  evrtsp_get_body(evcon, req);
@@ -1291,6 +1346,7 @@ evrtsp_connection_new(const char *address, unsigned short port)
 	evcon->timeout = -1;
 
 	evcon->cseq = 1;
+	evcon->pipeline_max = 1;
 
 	evcon->family = family;
 	evcon->address = addr;
@@ -1326,6 +1382,12 @@ evrtsp_connection_new(const char *address, unsigned short port)
 	return (NULL);
 }
 
+void
+evrtsp_connection_set_pipelining(struct evrtsp_connection *evcon, int max)
+{
+	evcon->pipeline_max = (max > 1) ? max : 1;
+}
+
 void evrtsp_connection_set_base(struct evrtsp_connection *evcon,
     struct event_base *base)
 {
@@ -32,6 +32,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <libavutil/opt.h>
 
@@ -55,6 +56,135 @@
 // Number of seconds the client will wait for a response before aborting
 #define HTTP_CLIENT_TIMEOUT 8
 
+// Sharing of the connection cache requires libcurl 7.57
+#if LIBCURL_VERSION_NUM >= 0x073900
+# define HTTP_CLIENT_SHARE_CONNECT 1
+#endif
+
+struct http_client_async
+{
+  struct event_base *evbase;
+  struct event *timer;
+  CURLM *multi;
+
+  struct http_client_async_req *requests;
+};
+
+struct http_client_async_req
+{
+  CURL *curl;
+  struct curl_slist *headers;
+  struct http_client_ctx *ctx;
+  http_client_cb cb;
+  void *cb_arg;
+
+  struct http_client_async_req *next;
+};
+
+// The DNS cache, TLS sessions and connections are shared by all handles, so
+// that repeated requests to the same host (artwork, Spotify, lastfm etc.) can
+// skip the lookup and the TCP and TLS handshakes
+static CURLSH *http_client_share;
+static pthread_mutex_t http_client_share_lck[CURL_LOCK_DATA_LAST];
+
+// Each thread keeps its easy handle for http_client_request() without session
+static pthread_key_t http_client_thread_key;
+
+
+/* ------------------------------- Sharing --------------------------------- */
+
+static void
+share_lock_cb(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  CHECK_ERR(L_HTTP, pthread_mutex_lock(&http_client_share_lck[data]));
+}
+
+static void
+share_unlock_cb(CURL *curl, curl_lock_data data, void *userptr)
+{
+  CHECK_ERR(L_HTTP, pthread_mutex_unlock(&http_client_share_lck[data]));
+}
+
+static void
+thread_curl_free(void *curl)
+{
+  curl_easy_cleanup(curl);
+}
+
+static CURL *
+thread_curl_get(void)
+{
+  CURL *curl;
+
+  curl = pthread_getspecific(http_client_thread_key);
+  if (curl)
+    {
+      curl_easy_reset(curl);
+      return curl;
+    }
+
+  curl = curl_easy_init();
+  if (!curl)
+    return NULL;
+
+  pthread_setspecific(http_client_thread_key, curl);
+  return curl;
+}
+
+int
+http_client_init(void)
+{
+  int i;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    CHECK_ERR(L_HTTP, mutex_init(&http_client_share_lck[i]));
+
+  CHECK_ERR(L_HTTP, pthread_key_create(&http_client_thread_key, thread_curl_free));
+
+  http_client_share = curl_share_init();
+  if (!http_client_share)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Could not create curl share handle, connections will not be reused\n");
+      return -1;
+    }
+
+  curl_share_setopt(http_client_share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+  curl_share_setopt(http_client_share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+  curl_share_setopt(http_client_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(http_client_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef HTTP_CLIENT_SHARE_CONNECT
+  curl_share_setopt(http_client_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+  return 0;
+}
+
+void
+http_client_deinit(void)
+{
+  CURL *curl;
+  int i;
+
+  // The handles of other threads were freed when they exited
+  curl = pthread_getspecific(http_client_thread_key);
+  if (curl)
+    {
+      pthread_setspecific(http_client_thread_key, NULL);
+      curl_easy_cleanup(curl);
+    }
+
+  if (http_client_share)
+    curl_share_cleanup(http_client_share);
+  http_client_share = NULL;
+
+  pthread_key_delete(http_client_thread_key);
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&http_client_share_lck[i]);
+}
+
+
+/* ------------------------------- Requests -------------------------------- */
 
 void
 http_client_session_init(struct http_client_session *session)
@@ -77,6 +207,10 @@ curl_headers_save(struct keyval *kv, CURL *curl)
   if (!kv || !curl)
     return;
 
+  // Normally already saved by curl_header_cb()
+  if (keyval_get(kv, "Content-Type"))
+    return;
+
   ret = curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
   if (ret == CURLE_OK && content_type)
     {
@@ -84,6 +218,51 @@ curl_headers_save(struct keyval *kv, CURL *curl)
     }
 }
 
+// Saves the response headers. When following redirects curl calls this for the
+// headers of each response, so we start over when a status line arrives.
+static size_t
+curl_header_cb(char *ptr, size_t size, size_t nitems, void *userdata)
+{
+  struct keyval *kv;
+  char header[1024];
+  char *value;
+  size_t realsize;
+  size_t len;
+
+  realsize = size * nitems;
+  kv = (struct keyval *)userdata;
+
+  if (realsize >= sizeof(header))
+    return realsize; // Ignore, we don't need any header that long
+
+  memcpy(header, ptr, realsize);
+  header[realsize] = '\0';
+
+  if (strncmp(header, "HTTP/", strlen("HTTP/")) == 0)
+    {
+      keyval_clear(kv);
+      return realsize;
+    }
+
+  value = strchr(header, ':');
+  if (!value)
+    return realsize;
+
+  *value = '\0';
+  value++;
+
+  while (isspace(*value))
+    value++;
+
+  len = strlen(value);
+  while (len > 0 && isspace(value[len - 1]))
+    value[--len] = '\0';
+
+  keyval_add(kv, header, value);
+
+  return realsize;
+}
+
 static size_t
 curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -107,32 +286,14 @@ curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
   return realsize;
 }
 
-int
-http_client_request(struct http_client_ctx *ctx, struct http_client_session *session)
+static struct curl_slist *
+curl_request_setup(CURL *curl, struct http_client_ctx *ctx)
 {
-  CURL *curl;
-  CURLcode res;
   struct curl_slist *headers;
   struct onekeyval *okv;
   const char *user_agent;
   long verifypeer;
   char header[1024];
-  long response_code;
-
-  if (session)
-    {
-      curl = session->curl;
-      curl_easy_reset(curl);
-    }
-  else
-    {
-      curl = curl_easy_init();
-    }
-  if (!curl)
-    {
-      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
-      return -1;
-    }
 
   user_agent = cfg_getstr(cfg_getsec(cfg, "general"), "user_agent");
   curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent);
@@ -162,10 +323,47 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_request_cb);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
 
+  if (ctx->input_headers)
+    {
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, ctx->input_headers);
+    }
+
   // Artwork and playlist requests might require redirects
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5);
 
+  if (http_client_share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, http_client_share);
+
+  return headers;
+}
+
+int
+http_client_request(struct http_client_ctx *ctx, struct http_client_session *session)
+{
+  CURL *curl;
+  CURLcode res;
+  struct curl_slist *headers;
+  long response_code;
+
+  if (session)
+    {
+      curl = session->curl;
+      curl_easy_reset(curl);
+    }
+  else
+    {
+      curl = thread_curl_get();
+    }
+  if (!curl)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
+      return -1;
+    }
+
+  headers = curl_request_setup(curl, ctx);
+
   /* Make request */
   DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", ctx->url);
 
@@ -174,10 +372,6 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
     {
       DPRINTF(E_WARN, L_HTTP, "Request to %s failed: %s\n", ctx->url, curl_easy_strerror(res));
       curl_slist_free_all(headers);
-      if (!session)
-	{
-	  curl_easy_cleanup(curl);
-	}
       return -1;
     }
 
@@ -186,14 +380,349 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
   curl_headers_save(ctx->input_headers, curl);
 
   curl_slist_free_all(headers);
-  if (!session)
+
+  return 0;
+}
+
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int n, bool (*done_cb)(int i, int result, void *arg), void *arg)
+{
+  CURLM *multi;
+  CURL **curls;
+  struct curl_slist **headers;
+  CURLMsg *msg;
+  CURLMcode mres;
+  long response_code;
+  char *priv;
+  bool is_done;
+  int running;
+  int remaining;
+  int result;
+  int i;
+
+  multi = curl_multi_init();
+  if (!multi)
     {
-      curl_easy_cleanup(curl);
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl multi handle\n");
+      return -1;
+    }
+
+  CHECK_NULL(L_HTTP, curls = calloc(n, sizeof(CURL *)));
+  CHECK_NULL(L_HTTP, headers = calloc(n, sizeof(struct curl_slist *)));
+
+  for (i = 0; i < n; i++)
+    {
+      curls[i] = curl_easy_init();
+      if (!curls[i])
+	{
+	  DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
+	  goto error;
+	}
+
+      headers[i] = curl_request_setup(curls[i], ctxs[i]);
+
+      // Index into ctxs, so we know which one completed
+      curl_easy_setopt(curls[i], CURLOPT_PRIVATE, (void *)(intptr_t)i);
+      curl_multi_add_handle(multi, curls[i]);
+
+      DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", ctxs[i]->url);
+    }
+
+  is_done = false;
+  running = n;
+  while (running > 0 && !is_done)
+    {
+      mres = curl_multi_perform(multi, &running);
+      if (mres != CURLM_OK)
+	{
+	  DPRINTF(E_WARN, L_HTTP, "Concurrent requests failed: %s\n", curl_multi_strerror(mres));
+	  break;
+	}
+
+      while (!is_done && (msg = curl_multi_info_read(multi, &remaining)))
+	{
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+	  i = (intptr_t)priv;
+
+	  if (msg->data.result == CURLE_OK)
+	    {
+	      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+	      ctxs[i]->response_code = (int) response_code;
+	      curl_headers_save(ctxs[i]->input_headers, msg->easy_handle);
+	      result = 0;
+	    }
+	  else
+	    {
+	      DPRINTF(E_WARN, L_HTTP, "Request to %s failed: %s\n", ctxs[i]->url, curl_easy_strerror(msg->data.result));
+	      result = -1;
+	    }
+
+	  is_done = done_cb(i, result, arg);
+	}
+
+      if (running > 0 && !is_done)
+	curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+
+  if (running > 0)
+    DPRINTF(E_DBG, L_HTTP, "Aborting %d remaining concurrent requests\n", running);
+
+  for (i = 0; i < n; i++)
+    {
+      curl_multi_remove_handle(multi, curls[i]);
+      curl_easy_cleanup(curls[i]);
+      curl_slist_free_all(headers[i]);
+    }
+
+  free(curls);
+  free(headers);
+  curl_multi_cleanup(multi);
+  return 0;
+
+ error:
+  for (i = 0; i < n; i++)
+    {
+      if (!curls[i])
+	continue;
+
+      curl_multi_remove_handle(multi, curls[i]);
+      curl_easy_cleanup(curls[i]);
+      curl_slist_free_all(headers[i]);
+    }
+
+  free(curls);
+  free(headers);
+  curl_multi_cleanup(multi);
+  return -1;
+}
+
+
+/* -------------------------------- Async ---------------------------------- */
+
+static void
+async_req_free(struct http_client_async *async, struct http_client_async_req *req)
+{
+  struct http_client_async_req *r;
+
+  if (async->requests == req)
+    async->requests = req->next;
+  else
+    {
+      for (r = async->requests; r && r->next != req; r = r->next)
+	; // Find the one before
+      if (r)
+	r->next = req->next;
+    }
+
+  curl_multi_remove_handle(async->multi, req->curl);
+  curl_easy_cleanup(req->curl);
+  curl_slist_free_all(req->headers);
+  free(req);
+}
+
+static void
+async_done_check(struct http_client_async *async)
+{
+  struct http_client_async_req *req;
+  CURLMsg *msg;
+  long response_code;
+  char *priv;
+  int remaining;
+  int result;
+
+  while ((msg = curl_multi_info_read(async->multi, &remaining)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+      req = (struct http_client_async_req *)priv;
+
+      if (msg->data.result == CURLE_OK)
+	{
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+	  req->ctx->response_code = (int) response_code;
+	  curl_headers_save(req->ctx->input_headers, msg->easy_handle);
+	  result = 0;
+	}
+      else
+	{
+	  DPRINTF(E_WARN, L_HTTP, "Request to %s failed: %s\n", req->ctx->url, curl_easy_strerror(msg->data.result));
+	  result = -1;
+	}
+
+      // msg is invalid after the handle is removed
+      req->cb(req->ctx, result, req->cb_arg);
+      async_req_free(async, req);
+    }
+}
+
+static void
+async_socket_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  struct http_client_async *async = arg;
+  int flags;
+  int running;
+
+  flags = ((events & EV_READ) ? CURL_CSELECT_IN : 0) | ((events & EV_WRITE) ? CURL_CSELECT_OUT : 0);
+
+  curl_multi_socket_action(async->multi, fd, flags, &running);
+  async_done_check(async);
+}
+
+static void
+async_timer_cb(evutil_socket_t fd, short events, void *arg)
+{
+  struct http_client_async *async = arg;
+  int running;
+
+  curl_multi_socket_action(async->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  async_done_check(async);
+}
+
+// Called by curl when it wants us to watch a socket for other events
+static int
+async_socket_cb(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp)
+{
+  struct http_client_async *async = userp;
+  struct event *ev = socketp;
+  short events;
+
+  if (ev)
+    event_free(ev);
+
+  if (what == CURL_POLL_REMOVE)
+    {
+      curl_multi_assign(async->multi, s, NULL);
+      return 0;
     }
 
+  events = EV_PERSIST;
+  if (what & CURL_POLL_IN)
+    events |= EV_READ;
+  if (what & CURL_POLL_OUT)
+    events |= EV_WRITE;
+
+  ev = event_new(async->evbase, s, events, async_socket_event_cb, async);
+  if (!ev)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Out of memory for http client socket event\n");
+      curl_multi_assign(async->multi, s, NULL);
+      return -1;
+    }
+
+  event_add(ev, NULL);
+  curl_multi_assign(async->multi, s, ev);
+  return 0;
+}
+
+// Called by curl when it wants to be called back after timeout_ms
+static int
+async_timer_set_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+  struct http_client_async *async = userp;
+  struct timeval tv;
+
+  if (timeout_ms < 0)
+    {
+      evtimer_del(async->timer);
+      return 0;
+    }
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  evtimer_add(async->timer, &tv);
   return 0;
 }
 
+struct http_client_async *
+http_client_async_new(struct event_base *evbase)
+{
+  struct http_client_async *async;
+
+  CHECK_NULL(L_HTTP, async = calloc(1, sizeof(struct http_client_async)));
+  CHECK_NULL(L_HTTP, async->timer = evtimer_new(evbase, async_timer_cb, async));
+
+  async->evbase = evbase;
+  async->multi = curl_multi_init();
+  if (!async->multi)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl multi handle\n");
+      event_free(async->timer);
+      free(async);
+      return NULL;
+    }
+
+  curl_multi_setopt(async->multi, CURLMOPT_SOCKETFUNCTION, async_socket_cb);
+  curl_multi_setopt(async->multi, CURLMOPT_SOCKETDATA, async);
+  curl_multi_setopt(async->multi, CURLMOPT_TIMERFUNCTION, async_timer_set_cb);
+  curl_multi_setopt(async->multi, CURLMOPT_TIMERDATA, async);
+
+  return async;
+}
+
+void
+http_client_async_free(struct http_client_async *async)
+{
+  if (!async)
+    return;
+
+  // Removing the handles makes curl call async_socket_cb, which frees the
+  // socket events
+  while (async->requests)
+    async_req_free(async, async->requests);
+
+  curl_multi_cleanup(async->multi);
+  event_free(async->timer);
+  free(async);
+}
+
+int
+http_client_request_async(struct http_client_async *async, struct http_client_ctx *ctx, http_client_cb cb, void *arg)
+{
+  struct http_client_async_req *req;
+  CURLMcode mres;
+
+  CHECK_NULL(L_HTTP, req = calloc(1, sizeof(struct http_client_async_req)));
+
+  req->curl = curl_easy_init();
+  if (!req->curl)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
+      free(req);
+      return -1;
+    }
+
+  req->ctx = ctx;
+  req->cb = cb;
+  req->cb_arg = arg;
+  req->headers = curl_request_setup(req->curl, ctx);
+
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+
+  req->next = async->requests;
+  async->requests = req;
+
+  DPRINTF(E_INFO, L_HTTP, "Making async request for %s\n", ctx->url);
+
+  // Will call async_timer_set_cb, which gets the request started
+  mres = curl_multi_add_handle(async->multi, req->curl);
+  if (mres != CURLM_OK)
+    {
+      DPRINTF(E_WARN, L_HTTP, "Request to %s failed: %s\n", ctx->url, curl_multi_strerror(mres));
+      async_req_free(async, req);
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/* ------------------------------- Helpers --------------------------------- */
+
 int
 http_form_urldecode(struct keyval *kv, const char *uri)
 {
@@ -14,6 +14,8 @@ struct http_client_session
   CURL *curl;
 };
 
+struct http_client_async;
+
 struct http_client_ctx
 {
   /* Destination URL, header and body of outgoing request body. If output_body
@@ -56,6 +58,18 @@ struct http_icy_metadata
   uint32_t hash;
 };
 
+/* Sets up the sharing of the DNS cache, TLS sessions and connections between
+ * all requests. Must be called after curl_global_init() and before any other
+ * threads make requests.
+ *
+ * @return 0 if ok, -1 if requests will work but without sharing
+ */
+int
+http_client_init(void);
+
+void
+http_client_deinit(void);
+
 void
 http_client_session_init(struct http_client_session *session);
 
@@ -64,7 +78,9 @@ http_client_session_deinit(struct http_client_session *session);
 
 /* Make a http(s) request. We use libcurl to make https requests. We could use
  * libevent and avoid the dependency, but for SSL, libevent needs to be v2.1
- * or better, which is still a bit too new to be in the major distros.
+ * or better, which is still a bit too new to be in the major distros. Without
+ * a session the request uses a handle kept by the calling thread, and in any
+ * case connections to the same host are reused.
  *
  * @param ctx HTTP request params, see above
  * @return 0 if successful, -1 if an error occurred (e.g. no libcurl)
@@ -72,6 +88,33 @@ http_client_session_deinit(struct http_client_session *session);
 int
 http_client_request(struct http_client_ctx *ctx, struct http_client_session *session);
 
+/* Makes the requests concurrently. Each time one completes, done_cb is called
+ * with its index in ctxs and the result (0 or -1, like http_client_request).
+ * If done_cb returns true the requests that are still running are aborted.
+ *
+ * @param ctxs array of n request params, see above
+ * @return 0 if successful, -1 if the requests could not be made
+ */
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int n, bool (*done_cb)(int i, int result, void *arg), void *arg);
+
+/* Async requests, made from the event loop of evbase without blocking it. The
+ * callback is invoked in that loop with the result (0 or -1, like
+ * http_client_request). ctx must stay valid until then. Requests that are
+ * still running when http_client_async_free() is called are aborted without
+ * callback. The async handle must not be freed from a callback.
+ */
+typedef void (*http_client_cb)(struct http_client_ctx *ctx, int result, void *arg);
+
+struct http_client_async *
+http_client_async_new(struct event_base *evbase);
+
+void
+http_client_async_free(struct http_client_async *async);
+
+int
+http_client_request_async(struct http_client_async *async, struct http_client_ctx *ctx, http_client_cb cb, void *arg);
+
 
 /* Converts the keyval dictionary to a application/x-www-form-urlencoded string.
  * The values will be uri_encoded. Example output: "key1=foo%20bar&key2=123".
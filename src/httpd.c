@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
@@ -33,11 +34,15 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 
 #include <regex.h>
 #include <zlib.h>
+#ifdef HAVE_LIBBROTLIENC
+# include <brotli/encode.h>
+#endif
 
 #include "logger.h"
 #include "db.h"
@@ -55,11 +60,24 @@
 # include "lastfm.h"
 #endif
 #include "listenbrainz.h"
+#include "trace.h"
 #ifdef HAVE_LIBWEBSOCKETS
 # include "websocket.h"
 #endif
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// Local files are sent with sendfile(), so the chunks cost no memory and can be
+// large. We start with STREAM_CHUNK_SIZE and double it up to this size, so that
+// players that only want the start of the file don't get much more than that.
+#define STREAM_FILE_CHUNK_MAX (4 * 1024 * 1024)
+// Replies smaller than this are not worth compressing
+#define COMPRESS_MIN_SIZE 512
+// Replies larger than this are compressed and sent in chunks, so the client can
+// start receiving before the whole reply has been compressed
+#define COMPRESS_STREAM_MIN_SIZE (256 * 1024)
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+// Brotli quality 0-11, where the highest are too slow for dynamic content
+#define COMPRESS_BROTLI_QUALITY 5
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -73,6 +91,7 @@ extern struct httpd_module httpd_artworkapi;
 extern struct httpd_module httpd_streaming;
 extern struct httpd_module httpd_oauth;
 extern struct httpd_module httpd_rsp;
+extern struct httpd_module httpd_metrics;
 
 // Must be in sync with enum httpd_modules
 static struct httpd_module *httpd_modules[] = {
@@ -83,10 +102,25 @@ static struct httpd_module *httpd_modules[] = {
     &httpd_streaming,
     &httpd_oauth,
     &httpd_rsp,
+    &httpd_metrics,
     NULL
 };
 
 
+enum httpd_encoding {
+  HTTPD_ENCODING_NONE,
+  HTTPD_ENCODING_GZIP,
+  HTTPD_ENCODING_BROTLI,
+};
+
+struct httpd_compressor {
+  enum httpd_encoding encoding;
+  z_stream zstrm;
+#ifdef HAVE_LIBBROTLIENC
+  BrotliEncoderState *brotli;
+#endif
+};
+
 struct content_type_map {
   char *ext;
   enum transcode_profile profile;
@@ -103,8 +137,13 @@ struct stream_ctx {
   off_t offset;
   off_t start_offset;
   off_t end_offset;
+  size_t chunk_size;
   bool no_register_playback;
   struct transcode_ctx *xcode;
+
+  // Transcoded data is also written here, if it will be added to the cache
+  int cache_fd;
+  char cache_key[64];
 };
 
 static const struct content_type_map ext2ctype[] =
@@ -139,11 +178,16 @@ static int httpd_port;
 // threads. The handler should use events to avoid this. Handlers, that are non-
 // blocking and where the response must not be delayed can use
 // HTTPD_HANDLER_REALTIME, then the httpd thread calls it directly (sync)
-// instead of the async worker. In short, you shouldn't need to increase the
-// below.
-#define THREADPOOL_NTHREADS 1
-
+// instead of the async worker. Handlers that are HTTPD_HANDLER_HEAVY are
+// passed to a separate pool, so that e.g. iTunes loading a full library can't
+// take all the worker threads from control requests. The number of threads
+// listening for requests is configurable, and each thread binds its own socket
+// (SO_REUSEPORT), so the kernel distributes the connections.
 static struct evthr_pool *httpd_threadpool;
+static struct evthr_pool *httpd_heavy_threadpool;
+
+// Protects the httpd_route_stats of all the modules' handlers
+static pthread_mutex_t httpd_stats_lck = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* -------------------------------- HELPERS --------------------------------- */
@@ -154,6 +198,72 @@ path_is_legal(const char *path)
   return strncmp(webroot_directory, path, strlen(webroot_directory));
 }
 
+// Bundlers like vite put a content hash in the file name, e.g.
+// "index-B2x8fQ1a.js", so those files never change and can be cached forever
+static bool
+path_is_hashed(const char *path)
+{
+  const char *name;
+  const char *ext;
+  const char *ptr;
+
+  name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  ext = strrchr(name, '.');
+  if (!ext)
+    return false;
+
+  for (ptr = ext; ptr > name && (isalnum(ptr[-1]) || ptr[-1] == '_'); ptr--)
+    ; /* EMPTY */
+
+  return (ptr > name && ptr[-1] == '-' && ext - ptr >= 8);
+}
+
+// Looks for a precompressed sibling of path, e.g. index.js.br, that the client
+// accepts. Returns an open fd and sets encoding and sb, or returns -1.
+static int
+precompressed_open(const char **encoding, struct stat *sb, struct httpd_request *hreq, const char *path)
+{
+  static const char *encodings[][2] = { { "br", ".br" }, { "gzip", ".gz" } };
+  char compressed[PATH_MAX];
+  const char *accept;
+  int fd;
+  int ret;
+  int i;
+
+  accept = httpd_header_find(hreq->in_headers, "Accept-Encoding");
+  if (!accept)
+    return -1;
+
+  for (i = 0; i < ARRAY_SIZE(encodings); i++)
+    {
+      if (!strstr(accept, encodings[i][0]))
+	continue;
+
+      ret = snprintf(compressed, sizeof(compressed), "%s%s", path, encodings[i][1]);
+      if (ret < 0 || ret >= sizeof(compressed))
+	continue;
+
+      // The build installs these together with the originals, so we don't
+      // check if they are outdated
+      fd = open(compressed, O_RDONLY);
+      if (fd < 0)
+	continue;
+
+      if (fstat(fd, sb) < 0 || !S_ISREG(sb->st_mode))
+	{
+	  close(fd);
+	  continue;
+	}
+
+      *encoding = encodings[i][0];
+      return fd;
+    }
+
+  return -1;
+}
+
 /* Callback from the worker thread (async operation as it may block) */
 static void
 playcount_inc_cb(void *arg)
@@ -255,11 +365,14 @@ modules_handlers_unset(struct httpd_uri_map *uri_map)
     {
       regfree(uri->preg); // Frees allocation by regcomp
       free(uri->preg); // Frees our own calloc
+      free(uri->stats);
+      uri->preg = NULL;
+      uri->stats = NULL;
     }
 }
 
 static int
-modules_handlers_set(struct httpd_uri_map *uri_map)
+modules_handlers_set(struct httpd_module *m, struct httpd_uri_map *uri_map)
 {
   struct httpd_uri_map *uri;
   char buf[64];
@@ -268,12 +381,19 @@ modules_handlers_set(struct httpd_uri_map *uri_map)
   for (uri = uri_map; uri->handler; uri++)
     {
       uri->preg = calloc(1, sizeof(regex_t));
-      if (!uri->preg)
+      uri->stats = calloc(1, sizeof(struct httpd_route_stats));
+      if (!uri->preg || !uri->stats)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Error setting URI handler, out of memory");
+	  free(uri->stats);
+	  uri->stats = NULL;
 	  goto error;
 	}
 
+      uri->stats->module = m->name;
+      uri->stats->regexp = uri->regexp;
+      uri->stats->method = uri->method;
+
       ret = regcomp(uri->preg, uri->regexp, REG_EXTENDED | REG_NOSUB);
       if (ret != 0)
 	{
@@ -306,7 +426,7 @@ modules_init(void)
 	  return -1;
 	}
 
-      if (modules_handlers_set(m->handlers) != 0)
+      if (modules_handlers_set(m, m->handlers) != 0)
 	{
 	  DPRINTF(E_FATAL, L_HTTPD, "%s handler configuration failed\n", m->name);
 	  return -1;
@@ -404,7 +524,9 @@ httpd_request_handler_set(struct httpd_request *hreq)
 	continue;
 
       hreq->handler = map->handler;
+      hreq->stats = map->stats;
       hreq->is_async = !(map->flags & HTTPD_HANDLER_REALTIME);
+      hreq->is_heavy = (map->flags & HTTPD_HANDLER_HEAVY);
       break;
     }
 }
@@ -446,6 +568,35 @@ httpd_request_etag_matches(struct httpd_request *hreq, const char *etag)
   return false;
 }
 
+/*
+ * Same as httpd_request_etag_matches(), but the ETag is a hash of the response
+ * body, so it can be used for content that has no version or timestamp, e.g.
+ * artwork. If it matches the body is drained, so the caller can reply 304.
+ *
+ * @param req The request with request and response headers, and response body
+ * @return True if the ETag of the body matches "If-None-Match", otherwise false
+ */
+bool
+httpd_request_etag_body_matches(struct httpd_request *hreq)
+{
+  char etag[24];
+  size_t len;
+  uint64_t hash;
+
+  len = evbuffer_get_length(hreq->out_body);
+  if (len == 0 || len > INT_MAX)
+    return false;
+
+  hash = murmur_hash64(evbuffer_pullup(hreq->out_body, -1), len, 0);
+  snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"", hash);
+
+  if (!httpd_request_etag_matches(hreq, etag))
+    return false;
+
+  evbuffer_drain(hreq->out_body, len);
+  return true;
+}
+
 /*
  * Checks if the given timestamp matches the "If-Modified-Since" request header
  *
@@ -497,9 +648,10 @@ serve_file(struct httpd_request *hreq)
   char path[PATH_MAX];
   char deref[PATH_MAX];
   const char *ctype;
+  const char *encoding = NULL;
   struct stat sb;
+  struct stat sb_compressed;
   int fd;
-  uint8_t buf[4096];
   bool slashed;
   int ret;
 
@@ -580,13 +732,27 @@ serve_file(struct httpd_request *hreq)
       return;
     }
 
+  // The response depends on Accept-Encoding if there are precompressed files
+  httpd_header_add(hreq->out_headers, "Vary", "Accept-Encoding");
+
   if (httpd_request_not_modified_since(hreq, sb.st_mtime))
     {
       httpd_send_reply(hreq, HTTP_NOTMODIFIED, NULL, HTTPD_SEND_NO_GZIP);
       return;
     }
 
-  fd = open(deref, O_RDONLY);
+  if (path_is_hashed(deref))
+    {
+      httpd_header_remove(hreq->out_headers, "Cache-Control");
+      httpd_header_add(hreq->out_headers, "Cache-Control", "public,max-age=31536000,immutable");
+    }
+
+  fd = precompressed_open(&encoding, &sb_compressed, hreq, deref);
+  if (fd >= 0)
+    sb = sb_compressed;
+  else
+    fd = open(deref, O_RDONLY);
+
   if (fd < 0)
     {
       DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", deref, strerror(errno));
@@ -595,20 +761,14 @@ serve_file(struct httpd_request *hreq)
       return;
     }
 
-  ret = evbuffer_expand(hreq->out_body, sb.st_size);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Out of memory for htdocs-file\n");
-      goto out_fail;
-    }
-
-  while ((ret = read(fd, buf, sizeof(buf))) > 0)
-    evbuffer_add(hreq->out_body, buf, ret);
-
+  // The evbuffer takes ownership of fd, and libevent will use sendfile() or
+  // mmap() so the file isn't copied through our memory
+  ret = evbuffer_add_file(hreq->out_body, fd, 0, sb.st_size);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not read file into evbuffer\n");
-      goto out_fail;
+      DPRINTF(E_LOG, L_HTTPD, "Could not add %s to evbuffer\n", deref);
+      httpd_send_error(hreq, HTTP_SERVUNAVAIL, "Internal error");
+      return;
     }
 
   ctype = content_type_from_ext(strrchr(path, '.'));
@@ -616,15 +776,10 @@ serve_file(struct httpd_request *hreq)
     ctype = "application/octet-stream";
 
   httpd_header_add(hreq->out_headers, "Content-Type", ctype);
+  if (encoding)
+    httpd_header_add(hreq->out_headers, "Content-Encoding", encoding);
 
   httpd_send_reply(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP);
-
-  close(fd);
-  return;
-
- out_fail:
-  httpd_send_error(hreq, HTTP_SERVUNAVAIL, "Internal error");
-  close(fd);
 }
 
 /* ---------------------------- STREAM HANDLING ----------------------------- */
@@ -650,6 +805,8 @@ stream_free(struct stream_ctx *st)
     event_free(st->ev);
   if (st->fd >= 0)
     close(st->fd);
+  if (st->cache_fd >= 0)
+    cache_stream_close(st->cache_fd, st->cache_key, false);
 
   transcode_cleanup(&st->xcode);
   free(st);
@@ -673,7 +830,7 @@ stream_end_register(struct stream_ctx *st)
       && (st->offset > ((st->size * 80) / 100)))
     {
       st->no_register_playback = true;
-      worker_execute(playcount_inc_cb, &st->id, sizeof(int), 0);
+      worker_execute_priority(playcount_inc_cb, &st->id, sizeof(int), 0, WORKER_PRIORITY_HIGH);
       worker_execute(scrobble_cb, &st->id, sizeof(int), 1);
     }
 }
@@ -685,6 +842,7 @@ stream_new(struct media_file_info *mfi, struct httpd_request *hreq, event_callba
 
   CHECK_NULL(L_HTTPD, st = calloc(1, sizeof(struct stream_ctx)));
   st->fd = -1;
+  st->cache_fd = -1;
 
   st->ev = event_new(hreq->evbase, -1, EV_PERSIST, stream_cb, st);
   if (!st->ev)
@@ -709,8 +867,17 @@ stream_new(struct media_file_info *mfi, struct httpd_request *hreq, event_callba
   return NULL;
 }
 
+// Identifies a transcoded stream in the stream cache
+static void
+stream_cache_key(char *key, size_t len, struct media_file_info *mfi, enum transcode_profile profile)
+{
+  int bit_rate = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
+
+  snprintf(key, len, "%u-%d-%d-%" PRIu32, mfi->id, profile, bit_rate, mfi->time_modified);
+}
+
 static struct stream_ctx *
-stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile, struct httpd_request *hreq,
+stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile, const char *cache_key, struct httpd_request *hreq,
                      int64_t offset, int64_t end_offset, event_callback_fn stream_cb)
 {
   struct transcode_decode_setup_args decode_args = { 0 };
@@ -718,6 +885,7 @@ stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile
   struct media_quality quality = { 0 };
   struct evbuffer *prepared_header = NULL;
   struct stream_ctx *st;
+  off_t pos;
   int cached;
   int ret;
 
@@ -774,6 +942,20 @@ stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile
 
   st->start_offset = offset;
 
+  // With constant bit rate profiles we can jump directly to the Range offset.
+  // Otherwise we transcode from the start and skip until the offset, see
+  // stream_chunk_xcode_cb().
+  if (offset > 0 && (pos = transcode_seek_bytes(st->xcode, offset)) >= 0)
+    st->offset = pos;
+
+  // Without a prepared header the MP4 output would not be the one we want to
+  // serve next time. If we seeked the output is not the full file either.
+  if ((profile != XCODE_MP4_ALAC || prepared_header) && st->offset == 0)
+    {
+      snprintf(st->cache_key, sizeof(st->cache_key), "%s", cache_key);
+      st->cache_fd = cache_stream_create(st->cache_key, st->size);
+    }
+
   if (prepared_header)
     evbuffer_free(prepared_header);
   return st;
@@ -785,39 +967,22 @@ stream_new_transcode(struct media_file_info *mfi, enum transcode_profile profile
   return NULL;
 }
 
+// Takes ownership of fd, also if the stream can't be created
 static struct stream_ctx *
-stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t offset, int64_t end_offset, event_callback_fn stream_cb)
+stream_new_fd(struct media_file_info *mfi, int fd, off_t size, struct httpd_request *hreq, int64_t offset, int64_t end_offset, event_callback_fn stream_cb)
 {
   struct stream_ctx *st;
-  struct stat sb;
   off_t pos;
-  int ret;
 
   st = stream_new(mfi, hreq, stream_cb);
   if (!st)
     {
+      close(fd);
       goto error;
     }
 
-  st->fd = open(mfi->path, O_RDONLY);
-  if (st->fd < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
-
-      httpd_send_error(hreq, HTTP_NOTFOUND, "Not Found");
-      goto error;
-    }
-
-  ret = stat(mfi->path, &sb);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
-
-      httpd_send_error(hreq, HTTP_NOTFOUND, "Not Found");
-      goto error;
-    }
-
-  st->size = sb.st_size;
+  st->fd = fd;
+  st->size = size;
 
   st->stream_size = st->size - offset;
   if (end_offset > 0)
@@ -826,6 +991,7 @@ stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t
   st->start_offset = offset;
   st->offset = offset;
   st->end_offset = end_offset;
+  st->chunk_size = STREAM_CHUNK_SIZE;
 
   pos = lseek(st->fd, offset, SEEK_SET);
   if (pos == (off_t) -1)
@@ -843,13 +1009,74 @@ stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t
   return NULL;
 }
 
+static struct stream_ctx *
+stream_new_raw(struct media_file_info *mfi, struct httpd_request *hreq, int64_t offset, int64_t end_offset, event_callback_fn stream_cb)
+{
+  struct stat sb;
+  int fd;
+  int ret;
+
+  fd = open(mfi->path, O_RDONLY);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
+
+      httpd_send_error(hreq, HTTP_NOTFOUND, "Not Found");
+      return NULL;
+    }
+
+  ret = fstat(fd, &sb);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
+
+      httpd_send_error(hreq, HTTP_NOTFOUND, "Not Found");
+      close(fd);
+      return NULL;
+    }
+
+  return stream_new_fd(mfi, fd, sb.st_size, hreq, offset, end_offset, stream_cb);
+}
+
+static void
+stream_cache_write(struct stream_ctx *st, size_t from)
+{
+  size_t len;
+  ssize_t ret;
+  unsigned char *data;
+
+  len = evbuffer_get_length(st->hreq->out_body) - from;
+  data = evbuffer_pullup(st->hreq->out_body, -1) + from;
+
+  while (len > 0)
+    {
+      ret = write(st->cache_fd, data, len);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      else if (ret <= 0)
+	{
+	  DPRINTF(E_WARN, L_HTTPD, "Could not write to stream cache, file id %d will not be cached: %s\n", st->id, strerror(errno));
+
+	  cache_stream_close(st->cache_fd, st->cache_key, false);
+	  st->cache_fd = -1;
+	  return;
+	}
+
+      data += ret;
+      len -= ret;
+    }
+}
+
 static void
 stream_chunk_xcode_cb(int fd, short event, void *arg)
 {
   struct stream_ctx *st = arg;
+  size_t len;
   int xcoded;
   int ret;
 
+  len = evbuffer_get_length(st->hreq->out_body);
+
   xcoded = transcode(st->hreq->out_body, NULL, st->xcode, STREAM_CHUNK_SIZE);
   if (xcoded <= 0)
     {
@@ -858,10 +1085,20 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
       else
 	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
 
+      if (st->cache_fd >= 0)
+	{
+	  cache_stream_close(st->cache_fd, st->cache_key, (xcoded == 0));
+	  st->cache_fd = -1;
+	}
+
       stream_end(st);
       return;
     }
 
+  // Everything from the start goes to the cache, also if we drain it below
+  if (st->cache_fd >= 0)
+    stream_cache_write(st, len);
+
   DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
 
   // Consume transcoded data until we meet start_offset
@@ -896,11 +1133,41 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
   stream_end_register(st);
 }
 
+// Adds len bytes from the file at st->offset to the reply. The data is added as
+// a file segment, so libevent can send it with sendfile() without copying it
+// into userspace. If that is not possible we read the data the usual way.
+static int
+stream_file_add(struct stream_ctx *st, size_t len)
+{
+  struct evbuffer_file_segment *seg;
+  int ret;
+
+  if (len == 0)
+    return 0;
+
+  seg = evbuffer_file_segment_new(st->fd, st->offset, len, 0);
+  if (!seg)
+    {
+      if (lseek(st->fd, st->offset, SEEK_SET) == (off_t) -1)
+	return -1;
+
+      return evbuffer_read(st->hreq->out_body, st->fd, len);
+    }
+
+  ret = evbuffer_add_file_segment(st->hreq->out_body, seg, 0, len);
+  evbuffer_file_segment_free(seg); // The evbuffer holds a reference
+  if (ret < 0)
+    return -1;
+
+  return len;
+}
+
 static void
 stream_chunk_raw_cb(int fd, short event, void *arg)
 {
   struct stream_ctx *st = arg;
   size_t chunk_size;
+  off_t remaining;
   int ret;
 
   if (st->end_offset && (st->offset > st->end_offset))
@@ -909,12 +1176,17 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
-  if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
-    chunk_size = st->end_offset + 1 - st->offset;
+  if (st->end_offset)
+    remaining = st->end_offset + 1 - st->offset;
   else
-    chunk_size = STREAM_CHUNK_SIZE;  
+    remaining = st->size - st->offset;
 
-  ret = evbuffer_read(st->hreq->out_body, st->fd, chunk_size);
+  chunk_size = MIN(st->chunk_size, MAX(remaining, 0));
+
+  if (st->chunk_size < STREAM_FILE_CHUNK_MAX)
+    st->chunk_size *= 2;
+
+  ret = stream_file_add(st, chunk_size);
   if (ret <= 0)
     {
       if (ret == 0)
@@ -926,7 +1198,7 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
-  DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
+  DPRINTF(E_DBG, L_HTTPD, "Added %d bytes; streaming file id %d\n", ret, st->id);
 
   httpd_send_reply_chunk(st->hreq, stream_chunk_resched_cb, st);
 
@@ -977,6 +1249,70 @@ httpd_speaker_update_handler(short event_mask, void *ctx)
 }
 
 
+/* ------------------------------- STATISTICS ------------------------------- */
+
+static uint64_t
+usec_between(struct timespec *start, struct timespec *end)
+{
+  int64_t usec;
+
+  usec = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+
+  return (usec > 0) ? usec : 0;
+}
+
+static void
+stats_reply_add(struct httpd_request *hreq, int code, size_t bytes)
+{
+  struct httpd_route_stats *stats = hreq->stats;
+
+  if (!stats)
+    return;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  stats->bytes_sent += bytes;
+  if (code >= 400)
+    stats->errors++;
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+}
+
+// Runs the module's request handler and records the time the request waited
+// for a thread and the time spent in the handler
+static void
+request_run(struct httpd_request *hreq)
+{
+  struct httpd_route_stats *stats = hreq->stats;
+  struct timespec received = hreq->received;
+  struct timespec start;
+  struct timespec end;
+  struct trace_span span;
+  uint64_t handler_us;
+  MEM_TAG_SCOPE(MEM_TAG_HTTPD);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The regexp of the handler is used as name, since it lives as long as the
+  // module (the span name isn't copied)
+  trace_begin(&span, "httpd", stats ? stats->regexp : hreq->module->name);
+  hreq->module->request(hreq);
+  trace_end(&span);
+
+  // Don't touch hreq here, the handler may have freed it
+  if (!stats)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  handler_us = usec_between(&start, &end);
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  stats->requests++;
+  stats->handler_total_us += handler_us;
+  histogram_add(&stats->queue_us, usec_between(&received, &start));
+  histogram_add(&stats->handler_us, handler_us);
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+}
+
+
 /* ---------------------------- REQUEST CALLBACKS --------------------------- */
 
 // Worker thread, invoked by request_cb() below
@@ -989,7 +1325,19 @@ request_async_cb(void *arg)
 
   // Some handlers require an evbase to schedule events
   hreq->evbase = worker_evbase_get();
-  hreq->module->request(hreq);
+  request_run(hreq);
+}
+
+// Heavy request thread, invoked by request_cb() below
+static void
+request_heavy_cb(struct evthr *thr, void *arg, void *shared)
+{
+  struct httpd_request *hreq = arg;
+
+  DPRINTF(E_DBG, hreq->module->logdomain, "%s request '%s' (heavy)\n", hreq->module->name, hreq->uri);
+
+  hreq->evbase = evthr_get_base(thr);
+  request_run(hreq);
 }
 
 // httpd thread
@@ -1014,8 +1362,14 @@ request_cb(struct httpd_request *hreq, void *arg)
       return;
     }
 
+  clock_gettime(CLOCK_MONOTONIC, &hreq->received);
+
   httpd_request_handler_set(hreq);
-  if (hreq->module && hreq->is_async)
+  if (hreq->module && hreq->is_async && hreq->is_heavy)
+    {
+      evthr_pool_defer(httpd_heavy_threadpool, request_heavy_cb, hreq);
+    }
+  else if (hreq->module && hreq->is_async)
     {
       worker_execute(request_async_cb, &hreq, sizeof(struct httpd_request *), 0);
     }
@@ -1023,7 +1377,7 @@ request_cb(struct httpd_request *hreq, void *arg)
     {
       DPRINTF(E_DBG, hreq->module->logdomain, "%s request: '%s'\n", hreq->module->name, hreq->uri);
       hreq->evbase = httpd_backend_evbase_get(hreq->backend);
-      hreq->module->request(hreq);
+      request_run(hreq);
     }
   else
     {
@@ -1038,6 +1392,119 @@ request_cb(struct httpd_request *hreq, void *arg)
 
 /* ------------------------------- HTTPD API -------------------------------- */
 
+int
+httpd_route_stats_get(struct httpd_route_stats **stats)
+{
+  struct httpd_module **ptr;
+  struct httpd_uri_map *uri;
+  int n;
+
+  n = 0;
+  for (ptr = httpd_modules; *ptr; ptr++)
+    {
+      for (uri = (*ptr)->handlers; uri && uri->handler; uri++)
+	n += (uri->stats != NULL);
+    }
+
+  CHECK_NULL(L_HTTPD, *stats = calloc(n ? n : 1, sizeof(struct httpd_route_stats)));
+
+  n = 0;
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  for (ptr = httpd_modules; *ptr; ptr++)
+    {
+      for (uri = (*ptr)->handlers; uri && uri->handler; uri++)
+	{
+	  if (uri->stats)
+	    (*stats)[n++] = *uri->stats;
+	}
+    }
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+
+  return n;
+}
+
+char *
+httpd_jsonapi_get(const char *uri)
+{
+  struct httpd_request *hreq;
+  char *reply = NULL;
+  size_t len;
+  int status_code;
+
+  hreq = httpd_request_new(NULL, NULL, uri, NULL);
+  if (!hreq)
+    return NULL;
+
+  hreq->method = HTTPD_METHOD_GET;
+
+  httpd_request_handler_set(hreq);
+  if (!hreq->handler || !hreq->module || hreq->module->type != MODULE_JSONAPI)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Unrecognized JSON API request: '%s'\n", uri);
+      goto out;
+    }
+
+  hreq->in_headers = httpd_headers_new();
+  hreq->out_headers = httpd_headers_new();
+
+  status_code = hreq->handler(hreq);
+  if (status_code != HTTP_OK)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "JSON API request failed with error code %d (%s)\n", status_code, uri);
+      goto out;
+    }
+
+  len = evbuffer_get_length(hreq->out_body);
+  reply = strndup((char *)evbuffer_pullup(hreq->out_body, -1), len);
+
+ out:
+  httpd_headers_free(hreq->in_headers);
+  httpd_headers_free(hreq->out_headers);
+  httpd_request_free(hreq);
+  return reply;
+}
+
+struct evbuffer *
+httpd_dacp_get(const char *uri)
+{
+  struct httpd_request *hreq;
+  struct evbuffer *reply = NULL;
+  int ret;
+
+  hreq = httpd_request_new(NULL, NULL, uri, NULL);
+  if (!hreq)
+    return NULL;
+
+  hreq->method = HTTPD_METHOD_GET;
+
+  httpd_request_handler_set(hreq);
+  if (!hreq->handler || !hreq->module || hreq->module->type != MODULE_DACP)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Unrecognized DACP request: '%s'\n", uri);
+      goto out;
+    }
+
+  hreq->in_headers = httpd_headers_new();
+  hreq->out_headers = httpd_headers_new();
+
+  ret = hreq->handler(hreq);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "DACP request failed (%s)\n", uri);
+      goto out;
+    }
+
+  // Take ownership of the reply
+  reply = hreq->out_body;
+  hreq->out_body = NULL;
+
+ out:
+  httpd_headers_free(hreq->in_headers);
+  httpd_headers_free(hreq->out_headers);
+  httpd_request_free(hreq);
+  return reply;
+}
+
 void
 httpd_stream_file(struct httpd_request *hreq, int id)
 {
@@ -1049,8 +1516,11 @@ httpd_stream_file(struct httpd_request *hreq, int id)
   const char *param_end;
   const char *ctype;
   char buf[64];
+  char cache_key[64];
   int64_t offset = 0;
   int64_t end_offset = 0;
+  off_t size;
+  int fd;
   int ret;
 
   param = httpd_header_find(hreq->in_headers, "Range");
@@ -1122,7 +1592,13 @@ httpd_stream_file(struct httpd_request *hreq, int id)
       if (spk_profile != XCODE_NONE)
 	profile = spk_profile;
 
-      st = stream_new_transcode(mfi, profile, hreq, offset, end_offset, stream_chunk_xcode_cb);
+      // If we have streamed it before, the transcoded stream may be cached
+      stream_cache_key(cache_key, sizeof(cache_key), mfi, profile);
+      fd = cache_stream_open(cache_key, &size);
+      if (fd >= 0)
+	st = stream_new_fd(mfi, fd, size, hreq, offset, end_offset, stream_chunk_raw_cb);
+      else
+	st = stream_new_transcode(mfi, profile, cache_key, hreq, offset, end_offset, stream_chunk_xcode_cb);
       if (!st)
 	goto error;
 
@@ -1173,8 +1649,9 @@ httpd_stream_file(struct httpd_request *hreq, int id)
     {
       // If we are not decoding, send the Content-Length. We don't do that if we
       // are decoding because we can only guesstimate the size in this case and
-      // the error margin is unknown and variable.
-      if (profile == XCODE_NONE)
+      // the error margin is unknown and variable. A cached transcode has a
+      // known size.
+      if (profile == XCODE_NONE || !st->xcode)
 	{
 	  ret = snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)st->size);
 	  if ((ret < 0) || (ret >= sizeof(buf)))
@@ -1183,7 +1660,7 @@ httpd_stream_file(struct httpd_request *hreq, int id)
 	    httpd_header_add(hreq->out_headers, "Content-Length", buf);
 	}
 
-      httpd_send_reply_start(hreq, HTTP_OK, "OK");
+      httpd_send_reply_start(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP);
     }
   else
     {
@@ -1202,7 +1679,7 @@ httpd_stream_file(struct httpd_request *hreq, int id)
       else
 	httpd_header_add(hreq->out_headers, "Content-Length", buf);
 
-      httpd_send_reply_start(hreq, 206, "Partial Content");
+      httpd_send_reply_start(hreq, 206, "Partial Content", HTTPD_SEND_NO_GZIP);
     }
 
 #ifdef HAVE_POSIX_FADVISE
@@ -1261,71 +1738,247 @@ httpd_xcode_profile_get(struct httpd_request *hreq)
   return XCODE_NONE;
 }
 
-struct evbuffer *
-httpd_gzip_deflate(struct evbuffer *in)
+static const char *httpd_encoding_names[] = { NULL, "gzip", "br" };
+
+static struct httpd_compressor *
+compressor_new(enum httpd_encoding encoding)
+{
+  struct httpd_compressor *c;
+  int ret;
+
+  CHECK_NULL(L_HTTPD, c = calloc(1, sizeof(struct httpd_compressor)));
+
+  c->encoding = encoding;
+
+  if (encoding == HTTPD_ENCODING_GZIP)
+    {
+      // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
+      ret = deflateInit2(&c->zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      if (ret != Z_OK)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
+	  goto error;
+	}
+    }
+#ifdef HAVE_LIBBROTLIENC
+  else if (encoding == HTTPD_ENCODING_BROTLI)
+    {
+      c->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+      if (!c->brotli)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "brotli setup failed\n");
+	  goto error;
+	}
+
+      BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_QUALITY, COMPRESS_BROTLI_QUALITY);
+      BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    }
+#endif
+  else
+    goto error;
+
+  return c;
+
+ error:
+  free(c);
+  return NULL;
+}
+
+static void
+compressor_free(struct httpd_compressor *c)
+{
+  if (!c)
+    return;
+
+  if (c->encoding == HTTPD_ENCODING_GZIP)
+    deflateEnd(&c->zstrm);
+#ifdef HAVE_LIBBROTLIENC
+  else if (c->brotli)
+    BrotliEncoderDestroyInstance(c->brotli);
+#endif
+
+  free(c);
+}
+
+static int
+gzip_run(struct httpd_compressor *c, struct evbuffer *out, const uint8_t *in, size_t len, bool finish)
 {
-  struct evbuffer *out;
   struct evbuffer_iovec iovec[1];
-  z_stream strm;
   int ret;
 
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+  c->zstrm.next_in = (uint8_t *)in;
+  c->zstrm.avail_in = len;
 
-  // Just to keep Coverity from complaining about uninitialized values
-  strm.total_in = 0;
-  strm.total_out = 0;
+  do
+    {
+      // We use this to avoid a memcpy. The 64 is some padding for the flush
+      // marker, since deflateBound() is only for a stream that is finished.
+      ret = evbuffer_reserve_space(out, deflateBound(&c->zstrm, c->zstrm.avail_in) + 64, iovec, 1);
+      if (ret < 0)
+	return -1;
+
+      c->zstrm.next_out = iovec[0].iov_base;
+      c->zstrm.avail_out = iovec[0].iov_len;
+
+      ret = deflate(&c->zstrm, finish ? Z_FINISH : Z_SYNC_FLUSH);
+      if (ret == Z_STREAM_ERROR)
+	return -1;
+
+      iovec[0].iov_len -= c->zstrm.avail_out;
+      evbuffer_commit_space(out, iovec, 1);
+    }
+  while (c->zstrm.avail_out == 0);
 
-  // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
-  ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
-  if (ret != Z_OK)
+  return (finish && ret != Z_STREAM_END) ? -1 : 0;
+}
+
+#ifdef HAVE_LIBBROTLIENC
+static int
+brotli_run(struct httpd_compressor *c, struct evbuffer *out, const uint8_t *in, size_t len, bool finish)
+{
+  struct evbuffer_iovec iovec[1];
+  BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+  const uint8_t *next_in = in;
+  size_t avail_in = len;
+  uint8_t *next_out;
+  size_t avail_out;
+  int ret;
+
+  do
     {
-      DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
-      return NULL;
+      ret = evbuffer_reserve_space(out, avail_in + 1024, iovec, 1);
+      if (ret < 0)
+	return -1;
+
+      next_out = iovec[0].iov_base;
+      avail_out = iovec[0].iov_len;
+
+      if (!BrotliEncoderCompressStream(c->brotli, op, &avail_in, &next_in, &avail_out, &next_out, NULL))
+	return -1;
+
+      iovec[0].iov_len -= avail_out;
+      evbuffer_commit_space(out, iovec, 1);
     }
+  while (avail_in > 0 || BrotliEncoderHasMoreOutput(c->brotli) || (finish && !BrotliEncoderIsFinished(c->brotli)));
 
-  strm.next_in = evbuffer_pullup(in, -1);
-  strm.avail_in = evbuffer_get_length(in);
+  return 0;
+}
+#endif
+
+// Compresses len bytes from in and adds the result to out. Unless finish is
+// set, the output is flushed, so the client can decode everything it has been
+// sent so far, and the compressor can be run again with more data.
+static int
+compressor_run(struct httpd_compressor *c, struct evbuffer *out, const uint8_t *in, size_t len, bool finish)
+{
+  if (c->encoding == HTTPD_ENCODING_GZIP)
+    return gzip_run(c, out, in, len, finish);
+#ifdef HAVE_LIBBROTLIENC
+  if (c->encoding == HTTPD_ENCODING_BROTLI)
+    return brotli_run(c, out, in, len, finish);
+#endif
+
+  return -1;
+}
+
+static struct evbuffer *
+compress_buffer(enum httpd_encoding encoding, struct evbuffer *in)
+{
+  struct httpd_compressor *c;
+  struct evbuffer *out;
+  size_t len;
+  int ret;
+
+  c = compressor_new(encoding);
+  if (!c)
+    return NULL;
 
   out = evbuffer_new();
   if (!out)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
-      goto out_deflate_end;
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for compressed reply\n");
+      compressor_free(c);
+      return NULL;
     }
 
-  // We use this to avoid a memcpy. The 512 is an arbitrary padding to make sure
-  // there is enough space, even if the compressed output should be slightly
-  // larger than input (could happen with small inputs).
-  ret = evbuffer_reserve_space(out, strm.avail_in + 512, iovec, 1);
+  len = evbuffer_get_length(in);
+  ret = compressor_run(c, out, evbuffer_pullup(in, -1), len, true);
+  compressor_free(c);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
-      goto out_evbuf_free;
+      DPRINTF(E_LOG, L_HTTPD, "Could not compress reply (%s)\n", httpd_encoding_names[encoding]);
+      evbuffer_free(out);
+      return NULL;
     }
 
-  strm.next_out = iovec[0].iov_base;
-  strm.avail_out = iovec[0].iov_len;
+  return out;
+}
 
-  ret = deflate(&strm, Z_FINISH);
-  if (ret != Z_STREAM_END)
-    goto out_evbuf_free;
+// Replaces the content of hreq->out_body with the compressed content
+static int
+out_body_compress(struct httpd_request *hreq, bool finish)
+{
+  struct evbuffer *raw;
+  size_t len;
+  int ret;
 
-  iovec[0].iov_len -= strm.avail_out;
+  raw = hreq->out_body;
+  CHECK_NULL(L_HTTPD, hreq->out_body = evbuffer_new());
 
-  evbuffer_commit_space(out, iovec, 1);
-  deflateEnd(&strm);
+  len = evbuffer_get_length(raw);
+  ret = compressor_run(hreq->compressor, hreq->out_body, evbuffer_pullup(raw, -1), len, finish);
+  evbuffer_free(raw);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_HTTPD, "Could not compress reply chunk (%s)\n", httpd_encoding_names[hreq->compressor->encoding]);
 
-  return out;
+  return ret;
+}
 
- out_evbuf_free:
-  evbuffer_free(out);
+// Picks the best encoding the client accepts, brotli is preferred since it
+// gives smaller JSON and DAAP replies at about the same speed
+static enum httpd_encoding
+encoding_negotiate(struct httpd_request *hreq, enum httpd_send_flags flags)
+{
+  const char *param;
 
- out_deflate_end:
-  deflateEnd(&strm);
+  if (flags & HTTPD_SEND_NO_GZIP)
+    return HTTPD_ENCODING_NONE;
 
-  return NULL;
+  param = httpd_header_find(hreq->in_headers, "Accept-Encoding");
+  if (!param)
+    return HTTPD_ENCODING_NONE;
+
+#ifdef HAVE_LIBBROTLIENC
+  if (strstr(param, "br"))
+    return HTTPD_ENCODING_BROTLI;
+#endif
+  if (strstr(param, "gzip") || strstr(param, "*"))
+    return HTTPD_ENCODING_GZIP;
+
+  return HTTPD_ENCODING_NONE;
+}
+
+// Sets up hreq for a chunked reply where each chunk is compressed
+static bool
+compressor_setup(struct httpd_request *hreq, enum httpd_encoding encoding)
+{
+  if (encoding == HTTPD_ENCODING_NONE)
+    return false;
+
+  hreq->compressor = compressor_new(encoding);
+  if (!hreq->compressor)
+    return false;
+
+  httpd_header_remove(hreq->out_headers, "Content-Length");
+  httpd_header_add(hreq->out_headers, "Content-Encoding", httpd_encoding_names[encoding]);
+  httpd_header_add(hreq->out_headers, "Vary", "Accept-Encoding");
+  return true;
+}
+
+struct evbuffer *
+httpd_gzip_deflate(struct evbuffer *in)
+{
+  return compress_buffer(HTTPD_ENCODING_GZIP, in);
 }
 
 // The httpd_send functions below can be called from a worker thread (with
@@ -1334,55 +1987,111 @@ httpd_gzip_deflate(struct evbuffer *in)
 // the backend (evhttp) from a worker thread. hreq will be freed (again,
 // possibly async) if the type is either _COMPLETE or _END.
 
+bool
+httpd_request_gzip_accepted(struct httpd_request *hreq)
+{
+  const char *param;
+
+  param = httpd_header_find(hreq->in_headers, "Accept-Encoding");
+
+  return (param && (strstr(param, "gzip") || strstr(param, "*")));
+}
+
+// Sends a large reply as compressed chunks, so the client can start receiving
+// and decoding while we are still compressing the rest
+static void
+send_reply_chunked(struct httpd_request *hreq, int code, const char *reason)
+{
+  struct evbuffer *body;
+  size_t len;
+
+  body = hreq->out_body;
+  CHECK_NULL(L_HTTPD, hreq->out_body = evbuffer_new());
+
+  stats_reply_add(hreq, code, 0);
+  httpd_send(hreq, HTTPD_REPLY_START, code, reason, NULL, NULL);
+
+  while ((len = evbuffer_get_length(body)) > 0)
+    {
+      evbuffer_remove_buffer(body, hreq->out_body, MIN(len, COMPRESS_CHUNK_SIZE));
+      httpd_send_reply_chunk(hreq, NULL, NULL);
+    }
+
+  evbuffer_free(body);
+
+  httpd_send_reply_end(hreq);
+}
+
 void
 httpd_send_reply(struct httpd_request *hreq, int code, const char *reason, enum httpd_send_flags flags)
 {
-  struct evbuffer *gzbuf;
-  struct evbuffer *save;
-  const char *param;
-  int do_gzip;
+  enum httpd_encoding encoding;
+  struct evbuffer *compressed;
+  size_t len;
 
   if (!hreq->backend)
     return;
 
-  do_gzip = ( (!(flags & HTTPD_SEND_NO_GZIP)) &&
-              (evbuffer_get_length(hreq->out_body) > 512) &&
-              (param = httpd_header_find(hreq->in_headers, "Accept-Encoding")) &&
-              (strstr(param, "gzip") || strstr(param, "*"))
-            );
+  len = evbuffer_get_length(hreq->out_body);
+  encoding = (len > COMPRESS_MIN_SIZE) ? encoding_negotiate(hreq, flags) : HTTPD_ENCODING_NONE;
 
   cors_headers_add(hreq, httpd_allow_origin);
 
-  if (do_gzip && (gzbuf = httpd_gzip_deflate(hreq->out_body)))
+  if (len > COMPRESS_STREAM_MIN_SIZE && compressor_setup(hreq, encoding))
     {
-      DPRINTF(E_DBG, L_HTTPD, "Gzipping response\n");
+      DPRINTF(E_DBG, L_HTTPD, "Sending response as %s compressed chunks\n", httpd_encoding_names[encoding]);
+      send_reply_chunked(hreq, code, reason);
+      return;
+    }
+
+  if (encoding != HTTPD_ENCODING_NONE && (compressed = compress_buffer(encoding, hreq->out_body)))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Compressing response with %s\n", httpd_encoding_names[encoding]);
 
-      httpd_header_add(hreq->out_headers, "Content-Encoding", "gzip");
-      save = hreq->out_body;
-      hreq->out_body = gzbuf;
-      evbuffer_free(save);
+      httpd_header_add(hreq->out_headers, "Content-Encoding", httpd_encoding_names[encoding]);
+      httpd_header_add(hreq->out_headers, "Vary", "Accept-Encoding");
+      evbuffer_free(hreq->out_body);
+      hreq->out_body = compressed;
     }
 
+  stats_reply_add(hreq, code, evbuffer_get_length(hreq->out_body));
   httpd_send(hreq, HTTPD_REPLY_COMPLETE, code, reason, NULL, NULL);
 }
 
 void
-httpd_send_reply_start(struct httpd_request *hreq, int code, const char *reason)
+httpd_send_reply_start(struct httpd_request *hreq, int code, const char *reason, enum httpd_send_flags flags)
 {
   cors_headers_add(hreq, httpd_allow_origin);
 
+  compressor_setup(hreq, encoding_negotiate(hreq, flags));
+
+  stats_reply_add(hreq, code, 0);
   httpd_send(hreq, HTTPD_REPLY_START, code, reason, NULL, NULL);
 }
 
 void
 httpd_send_reply_chunk(struct httpd_request *hreq, httpd_connection_chunkcb cb, void *arg)
 {
+  if (hreq->compressor)
+    out_body_compress(hreq, false);
+
+  stats_reply_add(hreq, 0, evbuffer_get_length(hreq->out_body));
   httpd_send(hreq, HTTPD_REPLY_CHUNK, 0, NULL, cb, arg);
 }
 
 void
 httpd_send_reply_end(struct httpd_request *hreq)
 {
+  // Whatever is left in out_body is sent with the end of the compressed stream
+  if (hreq->compressor && out_body_compress(hreq, true) == 0)
+    {
+      stats_reply_add(hreq, 0, evbuffer_get_length(hreq->out_body));
+      httpd_send(hreq, HTTPD_REPLY_CHUNK, 0, NULL, NULL, NULL);
+    }
+
+  compressor_free(hreq->compressor);
+  hreq->compressor = NULL;
+
   httpd_send(hreq, HTTPD_REPLY_END, 0, NULL, NULL, NULL);
 }
 
@@ -1400,12 +2109,18 @@ httpd_send_error(struct httpd_request *hreq, int error, const char *reason)
 
   evbuffer_add_printf(hreq->out_body, ERR_PAGE, error, reason, reason);
 
+  stats_reply_add(hreq, error, evbuffer_get_length(hreq->out_body));
   httpd_send(hreq, HTTPD_REPLY_COMPLETE, error, reason, NULL, NULL);
 }
 
 bool
 httpd_request_is_trusted(struct httpd_request *hreq)
 {
+  // Requests without a connection are made by the server itself, e.g. with
+  // httpd_dacp_get()
+  if (!hreq->backend)
+    return true;
+
   return httpd_backend_peer_is_trusted(hreq->backend);
 }
 
@@ -1541,6 +2256,7 @@ thread_init_cb(struct evthr *thr, void *shared)
   thread_setname(pthread_self(), "httpd");
 
   CHECK_ERR(L_HTTPD, db_perthread_init());
+  db_perthread_reader_init();
   CHECK_NULL(L_HTTPD, evbase = evthr_get_base(thr));
   CHECK_NULL(L_HTTPD, server = httpd_server_new(evbase, httpd_port, request_cb, NULL));
 
@@ -1561,11 +2277,29 @@ thread_exit_cb(struct evthr *thr, void *shared)
   db_perthread_deinit();
 }
 
+static void
+heavy_thread_init_cb(struct evthr *thr, void *shared)
+{
+  thread_setname(pthread_self(), "httpd heavy");
+
+  CHECK_ERR(L_HTTPD, db_perthread_init());
+  db_perthread_reader_init();
+}
+
+static void
+heavy_thread_exit_cb(struct evthr *thr, void *shared)
+{
+  db_perthread_deinit();
+}
+
 /* Thread: main */
 int
 httpd_init(const char *webroot)
 {
   struct stat sb;
+  long ncores;
+  int nthreads;
+  int nheavy;
   int ret;
 
   DPRINTF(E_DBG, L_HTTPD, "Starting web server with root directory '%s'\n", webroot);
@@ -1592,6 +2326,17 @@ httpd_init(const char *webroot)
   if (strlen(httpd_allow_origin) == 0)
     httpd_allow_origin = NULL;
 
+  ncores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncores < 1)
+    ncores = 1;
+
+  nthreads = cfg_getint(cfg_getsec(cfg, "library"), "httpd_threads");
+  if (nthreads <= 0)
+    nthreads = ncores;
+
+  // Half of the cores, so heavy requests can't saturate the machine
+  nheavy = (ncores > 2) ? ncores / 2 : 1;
+
   // Test that the port is free. We do it here because we can make a nicer exit
   // than we can in thread_init_cb(), where the actual binding takes place.
   ret = bind_test(httpd_port);
@@ -1618,7 +2363,21 @@ httpd_init(const char *webroot)
     }
 #endif
 
-  httpd_threadpool = evthr_pool_wexit_new(THREADPOOL_NTHREADS, thread_init_cb, thread_exit_cb, NULL);
+  httpd_heavy_threadpool = evthr_pool_wexit_new(nheavy, heavy_thread_init_cb, heavy_thread_exit_cb, NULL);
+  if (!httpd_heavy_threadpool)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not create httpd thread pool for heavy requests\n");
+      goto error;
+    }
+
+  ret = evthr_pool_start(httpd_heavy_threadpool);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not spawn threads for heavy requests\n");
+      goto error;
+    }
+
+  httpd_threadpool = evthr_pool_wexit_new(nthreads, thread_init_cb, thread_exit_cb, NULL);
   if (!httpd_threadpool)
     {
       DPRINTF(E_LOG, L_HTTPD, "Could not create httpd thread pool\n");
@@ -1632,6 +2391,8 @@ httpd_init(const char *webroot)
       goto error;
     }
 
+  DPRINTF(E_INFO, L_HTTPD, "Web server using %d threads for connections, %d for heavy requests\n", nthreads, nheavy);
+
   // We need to know about speaker format changes so we can ask the cache to
   // start preparing headers for mp4/alac if selected
   listener_add(httpd_speaker_update_handler, LISTENER_SPEAKER, NULL);
@@ -1658,4 +2419,7 @@ httpd_deinit(void)
 
   evthr_pool_stop(httpd_threadpool);
   evthr_pool_free(httpd_threadpool);
+
+  evthr_pool_stop(httpd_heavy_threadpool);
+  evthr_pool_free(httpd_heavy_threadpool);
 }
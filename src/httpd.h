@@ -13,6 +13,27 @@
 struct evbuffer *
 httpd_gzip_deflate(struct evbuffer *in);
 
+/*
+ * Runs a GET request to the JSON API without a http connection, so that other
+ * modules can reuse its replies. Must not be called from the player thread.
+ *
+ * @in  uri      The request uri, e.g. "/api/player"
+ * @return       The JSON reply - must be freed by caller, NULL on error
+ */
+char *
+httpd_jsonapi_get(const char *uri);
+
+/*
+ * Same as httpd_jsonapi_get(), but for a DACP request, e.g.
+ * "/ctrl-int/1/playqueue-contents?span=50". The request is trusted, so no
+ * session-id is required.
+ *
+ * @in  uri      The request uri
+ * @return       The DMAP reply - must be freed by caller, NULL on error
+ */
+struct evbuffer *
+httpd_dacp_get(const char *uri);
+
 int
 httpd_init(const char *webroot);
 
@@ -30,14 +30,18 @@
 #include "player.h"
 #include "artwork.h"
 
+// Seconds that clients may keep sized item and group artwork without asking
+#define ARTWORK_MAX_AGE "3600"
+
 static int
-request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
+request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h, int *format)
 {
   const char *param;
   int ret;
 
   *max_w = 0;
   *max_h = 0;
+  *format = 0;
 
   param = httpd_query_value_find(hreq->query, "maxwidth");
   if (param)
@@ -55,19 +59,44 @@ request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
 	DPRINTF(E_LOG, L_WEB, "Invalid height in request: '%s'\n", hreq->uri);
     }
 
+  // Browsers announce WebP support in the Accept header of image requests, and
+  // WebP images are much smaller than JPEG/PNG at the same quality
+  param = httpd_header_find(hreq->in_headers, "Accept");
+  if (param && strstr(param, "image/webp") && artwork_format_is_supported(ART_FMT_WEBP))
+    *format = ART_FMT_WEBP;
+
+  // The reply depends on the Accept header, caches must take that into account
+  httpd_header_add(hreq->out_headers, "Vary", "Accept");
+
   return 0;
 }
 
+/* The ETag is a hash of the image, so it is the same for all the tracks of an
+ * album, and it changes if the artwork source changes. Sized variants of item
+ * and group artwork don't change often, so clients may keep them for a while
+ * without asking, while nowplaying artwork must always be revalidated.
+ */
 static int
-response_process(struct httpd_request *hreq, int format)
+response_process(struct httpd_request *hreq, int format, bool may_keep)
 {
   if (format == ART_FMT_PNG)
     httpd_header_add(hreq->out_headers, "Content-Type", "image/png");
   else if (format == ART_FMT_JPEG)
     httpd_header_add(hreq->out_headers, "Content-Type", "image/jpeg");
+  else if (format == ART_FMT_WEBP)
+    httpd_header_add(hreq->out_headers, "Content-Type", "image/webp");
   else
     return HTTP_NOCONTENT;
 
+  if (httpd_request_etag_body_matches(hreq))
+    return HTTP_NOTMODIFIED;
+
+  if (may_keep)
+    {
+      httpd_header_remove(hreq->out_headers, "Cache-Control");
+      httpd_header_add(hreq->out_headers, "Cache-Control", "private,max-age=" ARTWORK_MAX_AGE);
+    }
+
   return HTTP_OK;
 }
 
@@ -77,9 +106,10 @@ artworkapi_reply_nowplaying(struct httpd_request *hreq)
   uint32_t max_w;
   uint32_t max_h;
   uint32_t id;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -87,9 +117,9 @@ artworkapi_reply_nowplaying(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_NOTFOUND;
 
-  ret = artwork_get_item(hreq->out_body, id, max_w, max_h, 0);
+  ret = artwork_get_item(hreq->out_body, id, max_w, max_h, format);
 
-  return response_process(hreq, ret);
+  return response_process(hreq, ret, false);
 }
 
 static int
@@ -98,9 +128,10 @@ artworkapi_reply_item(struct httpd_request *hreq)
   uint32_t max_w;
   uint32_t max_h;
   uint32_t id;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -108,9 +139,9 @@ artworkapi_reply_item(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_item(hreq->out_body, id, max_w, max_h, 0);
+  ret = artwork_get_item(hreq->out_body, id, max_w, max_h, format);
 
-  return response_process(hreq, ret);
+  return response_process(hreq, ret, (max_w > 0 || max_h > 0));
 }
 
 static int
@@ -119,9 +150,10 @@ artworkapi_reply_group(struct httpd_request *hreq)
   uint32_t max_w;
   uint32_t max_h;
   uint32_t id;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -129,16 +161,16 @@ artworkapi_reply_group(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_group(hreq->out_body, id, max_w, max_h, 0);
+  ret = artwork_get_group(hreq->out_body, id, max_w, max_h, format);
 
-  return response_process(hreq, ret);
+  return response_process(hreq, ret, (max_w > 0 || max_h > 0));
 }
 
 static struct httpd_uri_map artworkapi_handlers[] =
 {
   { HTTPD_METHOD_GET, "^/artwork/nowplaying$",         artworkapi_reply_nowplaying },
-  { HTTPD_METHOD_GET, "^/artwork/item/[[:digit:]]+$",  artworkapi_reply_item },
-  { HTTPD_METHOD_GET, "^/artwork/group/[[:digit:]]+$", artworkapi_reply_group },
+  { HTTPD_METHOD_GET, "^/artwork/item/[[:digit:]]+$",  artworkapi_reply_item, .flags = HTTPD_HANDLER_HEAVY },
+  { HTTPD_METHOD_GET, "^/artwork/group/[[:digit:]]+$", artworkapi_reply_group, .flags = HTTPD_HANDLER_HEAVY },
   { 0, NULL, NULL }
 };
 
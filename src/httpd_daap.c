@@ -37,8 +37,10 @@
 #include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <uninorm.h>
+#include <unistr.h>
 #include <unistd.h>
 
 #include <event2/event.h>
@@ -53,6 +55,7 @@
 #include "artwork.h"
 #include "dmap_common.h"
 #include "cache.h"
+#include "listener.h"
 
 
 /* Max number of sessions and session timeout
@@ -63,18 +66,34 @@
  * new sessions - see daap_session_cleanup().
  */
 #define DAAP_SESSION_MAX 200
+#define DAAP_SESSION_BUCKETS 256
 #define DAAP_SESSION_TIMEOUT 604800            // One week in seconds
 /* We announce this timeout to the client when returning server capabilities */
 #define DAAP_SESSION_TIMEOUT_CAPABILITY 1800   // 30 minutes
 /* Update requests refresh interval in seconds */
 #define DAAP_UPDATE_REFRESH  0
+/* The revision we give clients is the library revision (see the changes table)
+ * plus this, since clients ask for the current revision with revision 1
+ */
+#define DAAP_REVISION_OFFSET 2
 
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
 
+/* Song lists larger than this are sent with chunked transfer, so we don't have
+ * to keep the entire reply in memory
+ */
+#define DAAP_SONGLIST_STREAM_MIN (1024 * 1024)
+#define DAAP_SONGLIST_CHUNK_SIZE (256 * 1024)
+/* Seconds to wait for the client to read a chunk */
+#define DAAP_SONGLIST_WRITE_TIMEOUT 30
+/* Group replies larger than this are cached regardless of how long they took */
+#define DAAP_CACHE_GROUPS_MIN (64 * 1024)
+
 /* Errors that the reply handlers may return */
 enum daap_reply_result
 {
+  DAAP_REPLY_STREAMED        =  5,
   DAAP_REPLY_LOGOUT          =  4,
   DAAP_REPLY_NONE            =  3,
   DAAP_REPLY_NO_CONTENT      =  2,
@@ -92,18 +111,29 @@ struct daap_session {
   time_t mtime;
   bool is_remote;
 
-  struct daap_session *next;
+  LIST_ENTRY(daap_session) bucket_entry;
+  TAILQ_ENTRY(daap_session) age_entry;
 };
 
 struct daap_update_request {
   struct httpd_request *hreq;
 
-  /* Refresh tiemout */
-  struct event *timeout;
+  /* Library changed or refresh timeout */
+  struct event *updateev;
 
   struct daap_update_request *next;
 };
 
+// A chunk of a streamed song list is being written while the next is made. The
+// state is per thread, since a late write callback must not find it gone.
+struct songlist_stream {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool is_writing;
+};
+
+static __thread struct songlist_stream songlist_stream_state = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
 struct sort_ctx {
   struct evbuffer *headerlist;
   int16_t mshc;
@@ -118,12 +148,18 @@ static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dma
 static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.apple.itunes.smart-playlist";
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
-/* DAAP session tracking */
-static struct daap_session *daap_sessions;
+/* DAAP session tracking. The sessions are in a hash table by id, and in a
+ * queue in order of creation, which is also the order they expire in, since
+ * mtime is the creation time.
+ */
+static LIST_HEAD(, daap_session) daap_session_buckets[DAAP_SESSION_BUCKETS];
+static TAILQ_HEAD(, daap_session) daap_sessions = TAILQ_HEAD_INITIALIZER(daap_sessions);
+static int daap_session_count;
 
-/* Update requests */
+/* Update requests, protected by update_request_lck */
 static int current_rev;
 static struct daap_update_request *update_requests;
+static pthread_mutex_t update_request_lck = PTHREAD_MUTEX_INITIALIZER;
 static struct timeval daap_update_refresh_tv = { DAAP_UPDATE_REFRESH, 0 };
 
 
@@ -135,49 +171,36 @@ daap_session_free(struct daap_session *s)
   free(s);
 }
 
-static void
-daap_session_remove(struct daap_session *s)
+static struct daap_session *
+daap_session_get(int id)
 {
-  struct daap_session *ptr;
-  struct daap_session *prev;
+  struct daap_session *s;
 
-  prev = NULL;
-  for (ptr = daap_sessions; ptr; ptr = ptr->next)
+  LIST_FOREACH(s, &daap_session_buckets[(unsigned)id % DAAP_SESSION_BUCKETS], bucket_entry)
     {
-      if (ptr == s)
-	break;
-
-      prev = ptr;
+      if (id == s->id)
+	return s;
     }
 
-  if (!ptr)
+  return NULL;
+}
+
+static void
+daap_session_remove(struct daap_session *s)
+{
+  if (daap_session_get(s->id) != s)
     {
       DPRINTF(E_LOG, L_DAAP, "Error: Request to remove non-existent or ad-hoc session. BUG!\n");
       return;
     }
 
-  if (!prev)
-    daap_sessions = s->next;
-  else
-    prev->next = s->next;
+  LIST_REMOVE(s, bucket_entry);
+  TAILQ_REMOVE(&daap_sessions, s, age_entry);
+  daap_session_count--;
 
   daap_session_free(s);
 }
 
-static struct daap_session *
-daap_session_get(int id)
-{
-  struct daap_session *s;
-
-  for (s = daap_sessions; s; s = s->next)
-    {
-      if (id == s->id)
-	return s;
-    }
-
-  return NULL;
-}
-
 /* Removes stale sessions and also drops the oldest sessions if DAAP_SESSION_MAX
  * will otherwise be exceeded
  */
@@ -185,24 +208,18 @@ static void
 daap_session_cleanup(void)
 {
   struct daap_session *s;
-  struct daap_session *next;
   time_t now;
-  int count;
 
-  count = 0;
   now = time(NULL);
 
-  for (s = daap_sessions; s; s = next)
+  while ((s = TAILQ_FIRST(&daap_sessions)))
     {
-      count++;
-      next = s->next;
+      if ((difftime(now, s->mtime) <= DAAP_SESSION_TIMEOUT) && (daap_session_count < DAAP_SESSION_MAX))
+	break;
 
-      if ((difftime(now, s->mtime) > DAAP_SESSION_TIMEOUT) || (count > DAAP_SESSION_MAX))
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cleaning up DAAP session (id %d)\n", s->id);
+      DPRINTF(E_LOG, L_DAAP, "Cleaning up DAAP session (id %d)\n", s->id);
 
-	  daap_session_remove(s);
-	}
+      daap_session_remove(s);
     }
 }
 
@@ -235,10 +252,9 @@ daap_session_add(bool is_remote, int request_session_id)
 
   s->is_remote = is_remote;
 
-  if (daap_sessions)
-    s->next = daap_sessions;
-
-  daap_sessions = s;
+  LIST_INSERT_HEAD(&daap_session_buckets[(unsigned)s->id % DAAP_SESSION_BUCKETS], s, bucket_entry);
+  TAILQ_INSERT_TAIL(&daap_sessions, s, age_entry);
+  daap_session_count++;
 
   return s;
 }
@@ -251,8 +267,8 @@ update_free(struct daap_update_request *ur)
   if (!ur)
     return;
 
-  if (ur->timeout)
-    event_free(ur->timeout);
+  if (ur->updateev)
+    event_free(ur->updateev);
 
   free(ur);
 }
@@ -287,16 +303,18 @@ update_refresh_cb(int fd, short event, void *arg)
   struct daap_update_request *ur = arg;
   struct httpd_request *hreq = ur->hreq;
 
-  current_rev++;
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&update_request_lck));
 
   /* Send back current revision */
   dmap_add_container(hreq->out_body, "mupd", 24);
   dmap_add_int(hreq->out_body, "mstt", 200);         /* 12 */
   dmap_add_int(hreq->out_body, "musr", current_rev); /* 12 */
 
-  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
-
   update_remove(ur);
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
+
+  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
 }
 
 static void
@@ -306,7 +324,105 @@ update_fail_cb(void *arg)
 
   DPRINTF(E_DBG, L_DAAP, "Update request: client closed connection\n");
 
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&update_request_lck));
   update_remove(ur);
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
+}
+
+static int
+revision_get(void)
+{
+  int64_t latest;
+
+  if (db_changes_revision_get(NULL, &latest) < 0)
+    return current_rev;
+
+  return latest + DAAP_REVISION_OFFSET;
+}
+
+/* Thread: library (or whoever changed the library) */
+static void
+daap_library_update_handler(short event_mask, void *ctx)
+{
+  struct daap_update_request *ur;
+  int rev;
+
+  rev = revision_get();
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&update_request_lck));
+  if (rev != current_rev)
+    {
+      current_rev = rev;
+      for (ur = update_requests; ur; ur = ur->next)
+	event_active(ur->updateev, 0, 0);
+    }
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
+}
+
+
+/* ---------------------------- DELTA UPDATES ------------------------------- */
+
+// Returns the library revision that the client's delta request is relative to,
+// or -1 if it should get a full list, e.g. because the changes since then have
+// been pruned
+static int64_t
+delta_since_get(struct httpd_request *hreq)
+{
+  const char *param;
+  int64_t oldest;
+  int64_t latest;
+  int64_t since;
+  int32_t delta;
+
+  param = httpd_query_value_find(hreq->query, "delta");
+  if (!param || safe_atoi32(param, &delta) < 0 || delta < DAAP_REVISION_OFFSET)
+    return -1;
+
+  if (db_changes_revision_get(&oldest, &latest) < 0)
+    return -1;
+
+  since = delta - DAAP_REVISION_OFFSET;
+  if (since < oldest || since > latest)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Can't make delta from revision %d, sending everything\n", delta);
+      return -1;
+    }
+
+  return since;
+}
+
+// Limits the query to the items that changed after revision since
+static void
+delta_filter_set(struct query_params *qp, enum db_change_item_type type, int64_t since)
+{
+  char *filter;
+
+  if (qp->filter)
+    filter = safe_asprintf("%s AND f.id IN (SELECT item_id FROM changes WHERE item_type = %d AND id > %" PRIi64 ")", qp->filter, type, since);
+  else
+    filter = safe_asprintf("f.id IN (SELECT item_id FROM changes WHERE item_type = %d AND id > %" PRIi64 ")", type, since);
+
+  free(qp->filter);
+  qp->filter = filter;
+}
+
+// Makes the content of the mudl (deleted id listing) container
+static int
+delta_deleted_make(struct evbuffer *evbuf, enum db_change_item_type type, int64_t since)
+{
+  uint32_t *ids;
+  int nids;
+  int i;
+
+  nids = db_changes_deleted_get(&ids, type, since);
+  if (nids < 0)
+    return -1;
+
+  for (i = 0; i < nids; i++)
+    dmap_add_int(evbuf, "miid", ids[i]); /* 12 */
+
+  free(ids);
+  return nids;
 }
 
 
@@ -359,29 +475,37 @@ daap_sort_context_free(struct sort_ctx *ctx)
   free(ctx);
 }
 
+// Called for every item in the list, so it must be cheap. Normalizing doesn't
+// change ASCII, and for other strings the first letter after normalization only
+// depends on the first character, so only that is normalized.
 static int
 daap_sort_build(struct sort_ctx *ctx, char *str)
 {
   uint8_t *ret;
   size_t len;
+  int n;
   char fl;
 
-  len = strlen(str);
-  if (len > 0)
+  fl = str[0];
+  if (!isascii(fl))
     {
-      ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, len + 1, NULL, &len);
-      if (!ret)
+      n = u8_mblen((uint8_t *)str, strnlen(str, 4));
+      if (n > 0)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
+	  ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, n, NULL, &len);
+	  if (!ret)
+	    {
+	      DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
 
-	  return -1;
-	}
+	      return -1;
+	    }
 
-      fl = ret[0];
-      free(ret);
+	  fl = (len > 0) ? ret[0] : 0;
+	  free(ret);
+	}
+      else
+	fl = 0;
     }
-  else
-    fl = 0;
 
   if (isascii(fl) && isalpha(fl))
     {
@@ -651,6 +775,37 @@ parse_meta(const struct dmap_field ***out_meta, const char *param)
   return nmeta;
 }
 
+/* Limits the columns fetched for a song list to the requested meta tags plus
+ * what the reply needs for transcoding and sort headers
+ */
+static void
+songlist_cols_set(struct query_params *qp, const struct dmap_field **meta, int nmeta, int sort_headers)
+{
+  int i;
+
+  for (i = 0; i < nmeta; i++)
+    {
+      if (meta[i]->dfm && meta[i]->dfm->mfi_offset >= 0)
+	db_query_cols_add(qp, meta[i]->dfm->mfi_offset);
+    }
+
+  db_query_cols_add(qp, dbmfi_offsetof(fname));
+  db_query_cols_add(qp, dbmfi_offsetof(codectype));
+  db_query_cols_add(qp, dbmfi_offsetof(song_length));
+  db_query_cols_add(qp, dbmfi_offsetof(samplerate));
+  db_query_cols_add(qp, dbmfi_offsetof(bits_per_sample));
+  db_query_cols_add(qp, dbmfi_offsetof(channels));
+
+  if (!sort_headers)
+    return;
+
+  db_query_cols_add(qp, dbmfi_offsetof(title_sort));
+  db_query_cols_add(qp, dbmfi_offsetof(artist_sort));
+  db_query_cols_add(qp, dbmfi_offsetof(album_sort));
+  db_query_cols_add(qp, dbmfi_offsetof(album_artist_sort));
+  db_query_cols_add(qp, dbmfi_offsetof(composer_sort));
+}
+
 static void
 daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
 {
@@ -678,6 +833,9 @@ daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
       case DAAP_REPLY_SERVUNAVAIL:
 	httpd_send_error(hreq, HTTP_SERVUNAVAIL, "Internal Server Error");
 	break;
+      case DAAP_REPLY_STREAMED:
+	httpd_send_reply_end(hreq);
+	break;
       case DAAP_REPLY_NO_CONNECTION:
       case DAAP_REPLY_NONE:
 	// Send nothing
@@ -1000,7 +1158,10 @@ daap_reply_update(struct httpd_request *hreq)
       return DAAP_REPLY_ERROR;
     }
 
-  if (reqd_rev == 1) /* Or revision is not valid */
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&update_request_lck));
+
+  /* Client wants the current revision, or it doesn't have it */
+  if (reqd_rev == 1 || reqd_rev != current_rev)
     {
       CHECK_ERR(L_DAAP, evbuffer_expand(hreq->out_body, 32));
 
@@ -1009,9 +1170,12 @@ daap_reply_update(struct httpd_request *hreq)
       dmap_add_int(hreq->out_body, "mstt", 200);         /* 12 */
       dmap_add_int(hreq->out_body, "musr", current_rev); /* 12 */
 
+      CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
       return DAAP_REPLY_OK;
     }
 
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
+
   /* Else, just let the request hang until we have changes to push back */
   ur = calloc(1, sizeof(struct daap_update_request));
   if (!ur)
@@ -1022,35 +1186,39 @@ daap_reply_update(struct httpd_request *hreq)
       return DAAP_REPLY_ERROR;
     }
 
-  if (DAAP_UPDATE_REFRESH > 0)
-    {
-      ur->timeout = evtimer_new(hreq->evbase, update_refresh_cb, ur);
-      if (ur->timeout)
-	ret = evtimer_add(ur->timeout, &daap_update_refresh_tv);
-      else
-	ret = -1;
+  ur->updateev = evtimer_new(hreq->evbase, update_refresh_cb, ur);
+  if (ur->updateev && DAAP_UPDATE_REFRESH > 0)
+    ret = evtimer_add(ur->updateev, &daap_update_refresh_tv);
+  else if (ur->updateev)
+    ret = 0;
+  else
+    ret = -1;
 
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Out of memory for update request event\n");
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for update request event\n");
 
-	  dmap_error_make(hreq->out_body, "mupd", "Could not register timer");	
-	  update_free(ur);
-	  return DAAP_REPLY_ERROR;
-	}
+      dmap_error_make(hreq->out_body, "mupd", "Could not register timer");
+      update_free(ur);
+      return DAAP_REPLY_ERROR;
     }
 
-  /* NOTE: we may need to keep reqd_rev in there too */
   ur->hreq = hreq;
 
-  ur->next = update_requests;
-  update_requests = ur;
-
   /* If the connection fails before we have an update to push out
-   * to the client, we need to know.
+   * to the client, we need to know. Must be set before the request is added
+   * to the list, since after that it may get a reply any time.
    */
   httpd_request_close_cb_set(hreq, update_fail_cb, ur);
 
+  /* The library may have changed since we checked above */
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&update_request_lck));
+  ur->next = update_requests;
+  update_requests = ur;
+  if (reqd_rev != current_rev)
+    event_active(ur->updateev, 0, 0);
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&update_request_lck));
+
   return DAAP_REPLY_NONE;
 }
 
@@ -1135,6 +1303,137 @@ daap_reply_dblist(struct httpd_request *hreq)
   return DAAP_REPLY_OK;
 }
 
+// Sets the fields that are different if the file will be transcoded
+static void
+songlist_item_xcode_set(struct db_media_file_info *dbmfi, struct transcode_metadata_string *xcode_metadata, bool is_remote,
+                        const char *user_agent, const char *accept_codecs, enum transcode_profile spk_profile)
+{
+  enum transcode_profile profile;
+  struct media_quality quality = { 0 };
+  uint32_t len_ms;
+
+  // Not sure if the is_remote path is really needed. Note that if you
+  // change the below you might need to do the same in rsp_reply_playlist()
+  profile = is_remote ? XCODE_WAV : transcode_needed(user_agent, accept_codecs, dbmfi->codectype);
+  if (profile == XCODE_UNKNOWN)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi->fname);
+    }
+  else if (profile != XCODE_NONE)
+    {
+      if (spk_profile != XCODE_NONE)
+	profile = spk_profile;
+
+      if (safe_atou32(dbmfi->song_length, &len_ms) < 0)
+	len_ms = 3 * 60 * 1000; // just a fallback default
+
+      safe_atoi32(dbmfi->samplerate, &quality.sample_rate);
+      safe_atoi32(dbmfi->bits_per_sample, &quality.bits_per_sample);
+      safe_atoi32(dbmfi->channels, &quality.channels);
+      quality.bit_rate = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
+
+      transcode_metadata_strings_set(xcode_metadata, profile, &quality, len_ms);
+      dbmfi->type        = xcode_metadata->type;
+      dbmfi->codectype   = xcode_metadata->codectype;
+      dbmfi->description = xcode_metadata->description;
+      dbmfi->file_size   = xcode_metadata->file_size;
+      dbmfi->bitrate     = xcode_metadata->bitrate;
+    }
+}
+
+// httpd thread, called when the previous chunk has been written
+static void
+songlist_chunk_written_cb(httpd_connection *conn, void *arg)
+{
+  struct songlist_stream *stream = arg;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&stream->lock));
+  stream->is_writing = false;
+  CHECK_ERR(L_DAAP, pthread_cond_signal(&stream->cond));
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&stream->lock));
+}
+
+// Waits for the previous chunk to be written, so that no more than two chunks
+// are in memory, also if the client is slower than the database. If it doesn't
+// get written within the timeout, the client is probably gone.
+static int
+songlist_chunk_wait(struct songlist_stream *stream)
+{
+  struct timespec timeout = { DAAP_SONGLIST_WRITE_TIMEOUT, 0 };
+  struct timespec deadline;
+  bool is_writing;
+
+  deadline = timespec_reltoabs(timeout);
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&stream->lock));
+  while (stream->is_writing && pthread_cond_timedwait(&stream->cond, &stream->lock, &deadline) == 0)
+    ; /* EMPTY */
+  is_writing = stream->is_writing;
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&stream->lock));
+
+  return is_writing ? -1 : 0;
+}
+
+static int
+songlist_chunk_send(struct httpd_request *hreq, struct songlist_stream *stream, struct evbuffer *buf)
+{
+  if (songlist_chunk_wait(stream) < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Timeout writing song list to '%s', aborting\n", hreq->peer_address);
+      return -1;
+    }
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&stream->lock));
+  stream->is_writing = true;
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&stream->lock));
+
+  evbuffer_add_buffer(hreq->out_body, buf);
+  httpd_send_reply_chunk(hreq, songlist_chunk_written_cb, stream);
+  return 0;
+}
+
+// Makes the songlist again and sends it in chunks, skipping the first nskip
+// songs, which the caller has already sent. The last part, which is less than
+// a chunk, is left in songlist.
+static int
+songlist_stream(struct evbuffer *songlist, struct evbuffer *song, struct httpd_request *hreq, struct query_params *qp, int nskip,
+                const struct dmap_field **meta, int nmeta, int sort_headers, const char *accept_codecs, enum transcode_profile spk_profile)
+{
+  struct db_media_file_info dbmfi;
+  struct transcode_metadata_string xcode_metadata;
+  struct daap_session *s = hreq->extra_data;
+  int n;
+  int ret;
+
+  ret = db_query_start(qp);
+  if (ret < 0)
+    return -1;
+
+  n = 0;
+  while ((ret = db_query_fetch_file(&dbmfi, qp)) == 0)
+    {
+      if (n++ < nskip)
+	continue;
+
+      songlist_item_xcode_set(&dbmfi, &xcode_metadata, s->is_remote, hreq->user_agent, accept_codecs, spk_profile);
+
+      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers);
+      if (ret < 0)
+	break;
+
+      if (evbuffer_get_length(songlist) >= DAAP_SONGLIST_CHUNK_SIZE)
+	{
+	  ret = songlist_chunk_send(hreq, &songlist_stream_state, songlist);
+	  if (ret < 0)
+	    break;
+	}
+    }
+
+  db_query_end(qp);
+
+  return (ret == 1) ? 0 : -1;
+}
+
 static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
@@ -1142,6 +1441,8 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   struct db_media_file_info dbmfi;
   struct evbuffer *song;
   struct evbuffer *songlist;
+  struct evbuffer *counted = NULL;
+  struct evbuffer *deleted = NULL;
   struct daap_session *s;
   const struct dmap_field **meta = NULL;
   struct sort_ctx *sctx;
@@ -1149,14 +1450,17 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   const char *accept_codecs;
   const char *tag;
   size_t len;
+  size_t len_streamed;
+  size_t len_deleted;
+  int64_t since;
   enum transcode_profile spk_profile;
-  enum transcode_profile profile;
   struct transcode_metadata_string xcode_metadata;
-  struct media_quality quality = { 0 };
-  uint32_t len_ms;
+  bool in_transaction = false;
+  bool is_streaming = false;
   int nmeta = 0;
   int sort_headers;
   int nsongs;
+  int nkept;
   int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
@@ -1182,6 +1486,12 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       query_params_set(&qp, &sort_headers, hreq, Q_ITEMS);
     }
 
+  // Delta updates are only for the database, songs in playlists always get
+  // the full list
+  since = (playlist == -1) ? delta_since_get(hreq) : -1;
+  if (since >= 0)
+    delta_filter_set(&qp, DB_CHANGE_FILE, since);
+
   CHECK_NULL(L_DAAP, songlist = evbuffer_new());
   CHECK_NULL(L_DAAP, song = evbuffer_new());
   CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
@@ -1208,6 +1518,21 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	}
     }
 
+  // Without meta tags all fields are sent
+  if (nmeta > 0)
+    songlist_cols_set(&qp, meta, nmeta, sort_headers);
+
+  // If the list is large we make it twice, see below, so we need the library
+  // to stay the same. A transaction gives us a consistent snapshot. Replies
+  // made for the cache (no backend) are never streamed, and neither are replies
+  // made in the httpd thread, since we wait for it to write the chunks. Keyset
+  // paging modifies the query params, so it can't be run twice.
+  if (hreq->backend && hreq->is_async && qp.idx_type != I_KEYSET)
+    {
+      db_transaction_begin();
+      in_transaction = true;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1228,39 +1553,15 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   DPRINTF(E_DBG, L_DAAP, "Speaker check of '%s' (codecs '%s') returned %d\n", hreq->user_agent, accept_codecs, spk_profile);
 
   nsongs = 0;
+  nkept = 0;
+  len_streamed = 0;
   while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
     {
       nsongs++;
 
-      // Not sure if the is_remote path is really needed. Note that if you
-      // change the below you might need to do the same in rsp_reply_playlist()
-      profile = s->is_remote ? XCODE_WAV : transcode_needed(hreq->user_agent, accept_codecs, dbmfi.codectype);
-      if (profile == XCODE_UNKNOWN)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
-	}
-      else if (profile != XCODE_NONE)
-	{
-	  if (spk_profile != XCODE_NONE)
-	    profile = spk_profile;
-
-	  if (safe_atou32(dbmfi.song_length, &len_ms) < 0)
-	    len_ms = 3 * 60 * 1000; // just a fallback default
-
-	  safe_atoi32(dbmfi.samplerate, &quality.sample_rate);
-	  safe_atoi32(dbmfi.bits_per_sample, &quality.bits_per_sample);
-	  safe_atoi32(dbmfi.channels, &quality.channels);
-	  quality.bit_rate = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
-
-	  transcode_metadata_strings_set(&xcode_metadata, profile, &quality, len_ms);
-	  dbmfi.type        = xcode_metadata.type;
-	  dbmfi.codectype   = xcode_metadata.codectype;
-	  dbmfi.description = xcode_metadata.description;
-	  dbmfi.file_size   = xcode_metadata.file_size;
-	  dbmfi.bitrate     = xcode_metadata.bitrate;
-	}
+      songlist_item_xcode_set(&dbmfi, &xcode_metadata, s->is_remote, hreq->user_agent, accept_codecs, spk_profile);
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers);
+      ret = dmap_encode_file_metadata(counted ? counted : songlist, song, &dbmfi, meta, nmeta, sort_headers);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1281,6 +1582,21 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	    }
    	}
 
+      // The dmap container length must be known before we can send anything,
+      // so when the list gets large we stop keeping it in memory, and instead
+      // just count the length. The rest is made again while sending.
+      if (counted)
+	{
+	  len_streamed += evbuffer_get_length(counted);
+	  evbuffer_drain(counted, -1);
+	}
+      else if (in_transaction && evbuffer_get_length(songlist) > DAAP_SONGLIST_STREAM_MIN)
+	{
+	  CHECK_NULL(L_DAAP, counted = evbuffer_new());
+	  is_streaming = true;
+	  nkept = nsongs;
+	}
+
       DPRINTF(E_SPAM, L_DAAP, "Done with song\n");
     }
 
@@ -1300,42 +1616,98 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       goto error;
     }
 
+  // Songs deleted since the client's revision go in a mudl container
+  len_deleted = 0;
+  if (since >= 0)
+    {
+      CHECK_NULL(L_DAAP, deleted = evbuffer_new());
+      if (delta_deleted_make(deleted, DB_CHANGE_FILE, since) < 0)
+	{
+	  dmap_error_make(hreq->out_body, tag, "Error fetching deleted songs");
+	  goto error;
+	}
+
+      len_deleted = evbuffer_get_length(deleted) + 8;
+    }
+
   /* Add header to evbuf, add songlist to evbuf */
-  len = evbuffer_get_length(songlist);
+  len = evbuffer_get_length(songlist) + len_streamed;
   if (sort_headers)
     {
       daap_sort_finalize(sctx);
-      dmap_add_container(hreq->out_body, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
+      dmap_add_container(hreq->out_body, tag, len + len_deleted + evbuffer_get_length(sctx->headerlist) + 61);
     }
   else
-    dmap_add_container(hreq->out_body, tag, len + 53);
+    dmap_add_container(hreq->out_body, tag, len + len_deleted + 53);
 
   dmap_add_int(hreq->out_body, "mstt", 200);        /* 12 */
-  dmap_add_char(hreq->out_body, "muty", 0);         /* 9 */
+  dmap_add_char(hreq->out_body, "muty", (since >= 0)); /* 9 */
   dmap_add_int(hreq->out_body, "mtco", qp.results); /* 12 */
   dmap_add_int(hreq->out_body, "mrco", nsongs);     /* 12 */
   dmap_add_container(hreq->out_body, "mlcl", len); /* 8 */
 
+  if (is_streaming)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Streaming song list of %d songs (%zu bytes)\n", nsongs, len);
+
+      songlist_stream_state.is_writing = false;
+
+      // The reply headers and what we have so far go in the first chunk
+      httpd_send_reply_start(hreq, HTTP_OK, "OK", 0);
+      ret = songlist_chunk_send(hreq, &songlist_stream_state, songlist);
+      if (ret == 0)
+	ret = songlist_stream(songlist, song, hreq, &qp, nkept, meta, nmeta, sort_headers, accept_codecs, spk_profile);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DAAP, "Error streaming song list, the client will get an incomplete list\n");
+
+      // The last chunk is sent without the callback, which makes sure the
+      // callback isn't called after we return
+      songlist_chunk_wait(&songlist_stream_state);
+    }
+
   CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, songlist));
 
+  if (deleted)
+    {
+      dmap_add_container(hreq->out_body, "mudl", evbuffer_get_length(deleted)); /* 8 */
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, deleted));
+    }
+
   if (sort_headers)
     {
       len = evbuffer_get_length(sctx->headerlist);
       dmap_add_container(hreq->out_body, "mshl", len); /* 8 */
-
       CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, sctx->headerlist));
     }
 
+  if (is_streaming)
+    httpd_send_reply_chunk(hreq, NULL, NULL);
+
+  if (in_transaction)
+    db_transaction_end();
+
   free(meta);
   daap_sort_context_free(sctx);
+  if (counted)
+    evbuffer_free(counted);
+  if (deleted)
+    evbuffer_free(deleted);
   evbuffer_free(song);
   evbuffer_free(songlist);
   free_query_params(&qp, 1);
 
-  return DAAP_REPLY_OK;
+  // For a streamed reply daap_reply_send() will just end it
+  return is_streaming ? DAAP_REPLY_STREAMED : DAAP_REPLY_OK;
 
  error:
+  if (in_transaction)
+    db_transaction_end();
+
   free(meta);
+  if (counted)
+    evbuffer_free(counted);
+  if (deleted)
+    evbuffer_free(deleted);
   daap_sort_context_free(sctx);
   evbuffer_free(song);
   evbuffer_free(songlist);
@@ -1382,12 +1754,15 @@ daap_reply_playlists(struct httpd_request *hreq)
   struct db_playlist_info dbpli;
   struct evbuffer *playlistlist;
   struct evbuffer *playlist;
+  struct evbuffer *deleted = NULL;
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
   const struct dmap_field **meta = NULL;
   const char *param;
   char **strval;
   size_t len;
+  size_t len_deleted;
+  int64_t since;
   int database;
   int cfg_radiopl;
   int nmeta;
@@ -1412,6 +1787,10 @@ daap_reply_playlists(struct httpd_request *hreq)
   query_params_set(&qp, NULL, hreq, Q_PL);
   qp.sort = S_PLAYLIST; // Only S_PLAYLIST (and S_NONE) works for Q_PL
 
+  since = delta_since_get(hreq);
+  if (since >= 0)
+    delta_filter_set(&qp, DB_CHANGE_PLAYLIST, since);
+
   CHECK_NULL(L_DAAP, playlistlist = evbuffer_new());
   CHECK_NULL(L_DAAP, playlist = evbuffer_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->out_body, 61));
@@ -1566,17 +1945,37 @@ daap_reply_playlists(struct httpd_request *hreq)
       goto error;
     }
 
+  len_deleted = 0;
+  if (since >= 0)
+    {
+      CHECK_NULL(L_DAAP, deleted = evbuffer_new());
+      if (delta_deleted_make(deleted, DB_CHANGE_PLAYLIST, since) < 0)
+	{
+	  dmap_error_make(hreq->out_body, "aply", "Error fetching deleted playlists");
+	  goto error;
+	}
+
+      len_deleted = evbuffer_get_length(deleted) + 8;
+    }
+
   /* Add header to evbuf, add playlistlist to evbuf */
   len = evbuffer_get_length(playlistlist);
-  dmap_add_container(hreq->out_body, "aply", len + 53);
+  dmap_add_container(hreq->out_body, "aply", len + len_deleted + 53);
   dmap_add_int(hreq->out_body, "mstt", 200); /* 12 */
-  dmap_add_char(hreq->out_body, "muty", 0);  /* 9 */
+  dmap_add_char(hreq->out_body, "muty", (since >= 0)); /* 9 */
   dmap_add_int(hreq->out_body, "mtco", qp.results); /* 12 */
   dmap_add_int(hreq->out_body,"mrco", npls); /* 12 */
   dmap_add_container(hreq->out_body, "mlcl", len);
 
   CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, playlistlist));
 
+  if (deleted)
+    {
+      dmap_add_container(hreq->out_body, "mudl", evbuffer_get_length(deleted)); /* 8 */
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, deleted));
+      evbuffer_free(deleted);
+    }
+
   free(meta);
   evbuffer_free(playlist);
   evbuffer_free(playlistlist);
@@ -1585,6 +1984,8 @@ daap_reply_playlists(struct httpd_request *hreq)
   return DAAP_REPLY_OK;
 
  error:
+  if (deleted)
+    evbuffer_free(deleted);
   free(meta);
   evbuffer_free(playlist);
   evbuffer_free(playlistlist);
@@ -1593,6 +1994,122 @@ daap_reply_playlists(struct httpd_request *hreq)
   return DAAP_REPLY_ERROR;
 }
 
+static bool
+group_is_listed(struct db_group_info *dbgri)
+{
+  /* Don't add item if no name (eg blank album name) */
+  if (strlen(dbgri->itemname) == 0)
+    return false;
+
+  /* Don't add single item albums/artists if configured to hide */
+  if (cfg_getbool(cfg_getsec(cfg, "library"), "hide_singles") && (strcmp(dbgri->itemcount, "1") == 0))
+    return false;
+
+  return true;
+}
+
+// Adds the group as a mlit container to grouplist, group is a work buffer
+static int
+group_encode(struct evbuffer *grouplist, struct evbuffer *group, struct db_group_info *dbgri, const struct dmap_field **meta, int nmeta, enum query_type type)
+{
+  const struct dmap_field_map *dfm;
+  const struct dmap_field *df;
+  char **strval;
+  size_t len;
+  int32_t val;
+  int ret;
+  int i;
+
+  for (i = 0; i < nmeta; i++)
+    {
+      df = meta[i];
+      if (!df)
+	continue;
+
+      dfm = df->dfm;
+
+      /* dmap.itemcount - always added */
+      if (dfm == &dfm_dmap_mimc)
+	continue;
+
+      /* Not in struct group_info */
+      if (dfm->gri_offset < 0)
+	continue;
+
+      strval = (char **) ((char *)dbgri + dfm->gri_offset);
+
+      if (!(*strval) || (**strval == '\0'))
+	continue;
+
+      dmap_add_field(group, df, *strval, 0);
+
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+    }
+
+  /* Item count, always added (mimc) */
+  val = 0;
+  ret = safe_atoi32(dbgri->itemcount, &val);
+  if ((ret == 0) && (val > 0))
+    dmap_add_int(group, "mimc", val);
+
+  /* Song album artist (asaa), always added if group-type is albums  */
+  if (type == Q_GROUP_ALBUMS)
+    dmap_add_string(group, "asaa", dbgri->songalbumartist);
+
+  /* Item id (miid) */
+  val = 0;
+  ret = safe_atoi32(dbgri->id, &val);
+  if ((ret == 0) && (val > 0))
+    dmap_add_int(group, "miid", val);
+
+  DPRINTF(E_SPAM, L_DAAP, "Done with group\n");
+
+  len = evbuffer_get_length(group);
+  dmap_add_container(grouplist, "mlit", len);
+
+  return evbuffer_add_buffer(grouplist, group);
+}
+
+// Like songlist_stream(), makes the group list again and sends it in chunks,
+// skipping the first nskip groups
+static int
+grouplist_stream(struct evbuffer *grouplist, struct evbuffer *group, struct httpd_request *hreq, struct query_params *qp, int nskip,
+                 const struct dmap_field **meta, int nmeta)
+{
+  struct db_group_info dbgri;
+  int n;
+  int ret;
+
+  ret = db_query_start(qp);
+  if (ret < 0)
+    return -1;
+
+  n = 0;
+  while ((ret = db_query_fetch_group(&dbgri, qp)) == 0)
+    {
+      if (!group_is_listed(&dbgri))
+	continue;
+
+      if (n++ < nskip)
+	continue;
+
+      ret = group_encode(grouplist, group, &dbgri, meta, nmeta, qp->type);
+      if (ret < 0)
+	break;
+
+      if (evbuffer_get_length(grouplist) >= DAAP_SONGLIST_CHUNK_SIZE)
+	{
+	  ret = songlist_chunk_send(hreq, &songlist_stream_state, grouplist);
+	  if (ret < 0)
+	    break;
+	}
+    }
+
+  db_query_end(qp);
+
+  return (ret == 1) ? 0 : -1;
+}
+
 static enum daap_reply_result
 daap_reply_groups(struct httpd_request *hreq)
 {
@@ -1600,20 +2117,19 @@ daap_reply_groups(struct httpd_request *hreq)
   struct db_group_info dbgri;
   struct evbuffer *group;
   struct evbuffer *grouplist;
-  const struct dmap_field_map *dfm;
-  const struct dmap_field *df;
+  struct evbuffer *counted = NULL;
   const struct dmap_field **meta = NULL;
   struct sort_ctx *sctx;
-  cfg_t *lib;
   const char *param;
-  char **strval;
   char *tag;
   size_t len;
+  size_t len_streamed;
+  bool in_transaction = false;
+  bool is_streaming = false;
   int nmeta;
   int sort_headers;
   int ngrp;
-  int32_t val;
-  int i;
+  int nkept;
   int ret;
 
   param = httpd_query_value_find(hreq->query, "group-type");
@@ -1661,6 +2177,14 @@ daap_reply_groups(struct httpd_request *hreq)
       goto error;
     }
 
+  // Large lists are streamed like song lists, which requires the same
+  // conditions, see daap_reply_songlist_generic()
+  if (hreq->backend && hreq->is_async && qp.idx_type != I_KEYSET)
+    {
+      db_transaction_begin();
+      in_transaction = true;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1671,45 +2195,15 @@ daap_reply_groups(struct httpd_request *hreq)
     }
 
   ngrp = 0;
+  nkept = 0;
+  len_streamed = 0;
   while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
     {
-      /* Don't add item if no name (eg blank album name) */
-      if (strlen(dbgri.itemname) == 0)
-	continue;
-
-      /* Don't add single item albums/artists if configured to hide */
-      lib = cfg_getsec(cfg, "library");
-      if (cfg_getbool(lib, "hide_singles") && (strcmp(dbgri.itemcount, "1") == 0))
+      if (!group_is_listed(&dbgri))
 	continue;
 
       ngrp++;
 
-      for (i = 0; i < nmeta; i++)
-	{
-	  df = meta[i];
-	  if (!df)
-	    continue;
-
-	  dfm = df->dfm;
-
-	  /* dmap.itemcount - always added */
-	  if (dfm == &dfm_dmap_mimc)
-	    continue;
-
-	  /* Not in struct group_info */
-	  if (dfm->gri_offset < 0)
-	    continue;
-
-          strval = (char **) ((char *)&dbgri + dfm->gri_offset);
-
-          if (!(*strval) || (**strval == '\0'))
-            continue;
-
-	  dmap_add_field(group, df, *strval, 0);
-
-	  DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
-	}
-
       if (sort_headers)
 	{
 	  ret = daap_sort_build(sctx, dbgri.itemname_sort);
@@ -1722,27 +2216,7 @@ daap_reply_groups(struct httpd_request *hreq)
 	    }
 	}
 
-      /* Item count, always added (mimc) */
-      val = 0;
-      ret = safe_atoi32(dbgri.itemcount, &val);
-      if ((ret == 0) && (val > 0))
-	dmap_add_int(group, "mimc", val);
-
-      /* Song album artist (asaa), always added if group-type is albums  */
-      if (qp.type == Q_GROUP_ALBUMS)
-        dmap_add_string(group, "asaa", dbgri.songalbumartist);
-
-      /* Item id (miid) */
-      val = 0;
-      ret = safe_atoi32(dbgri.id, &val);
-      if ((ret == 0) && (val > 0))
-	dmap_add_int(group, "miid", val);
-
-      DPRINTF(E_SPAM, L_DAAP, "Done with group\n");
-
-      len = evbuffer_get_length(group);
-      dmap_add_container(grouplist, "mlit", len);
-      ret = evbuffer_add_buffer(grouplist, group);
+      ret = group_encode(counted ? counted : grouplist, group, &dbgri, meta, nmeta, qp.type);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Could not add group to group list for DAAP groups reply\n");
@@ -1750,6 +2224,19 @@ daap_reply_groups(struct httpd_request *hreq)
 	  ret = -100;
 	  break;
 	}
+
+      // Past the threshold we just count the length, see the song list
+      if (counted)
+	{
+	  len_streamed += evbuffer_get_length(counted);
+	  evbuffer_drain(counted, -1);
+	}
+      else if (in_transaction && evbuffer_get_length(grouplist) > DAAP_SONGLIST_STREAM_MIN)
+	{
+	  CHECK_NULL(L_DAAP, counted = evbuffer_new());
+	  is_streaming = true;
+	  nkept = ngrp;
+	}
     }
 
   db_query_end(&qp);
@@ -1769,7 +2256,7 @@ daap_reply_groups(struct httpd_request *hreq)
     }
 
   /* Add header to evbuf, add grouplist to evbuf */
-  len = evbuffer_get_length(grouplist);
+  len = evbuffer_get_length(grouplist) + len_streamed;
   if (sort_headers)
     {
       daap_sort_finalize(sctx);
@@ -1784,6 +2271,22 @@ daap_reply_groups(struct httpd_request *hreq)
   dmap_add_int(hreq->out_body,"mrco", ngrp);        /* 12 */
   dmap_add_container(hreq->out_body, "mlcl", len);  /* 8 */
 
+  if (is_streaming)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Streaming group list of %d groups (%zu bytes)\n", ngrp, len);
+
+      songlist_stream_state.is_writing = false;
+
+      httpd_send_reply_start(hreq, HTTP_OK, "OK", 0);
+      ret = songlist_chunk_send(hreq, &songlist_stream_state, grouplist);
+      if (ret == 0)
+	ret = grouplist_stream(grouplist, group, hreq, &qp, nkept, meta, nmeta);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DAAP, "Error streaming group list, the client will get an incomplete list\n");
+
+      songlist_chunk_wait(&songlist_stream_state);
+    }
+
   CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, grouplist));
 
   if (sort_headers)
@@ -1794,17 +2297,30 @@ daap_reply_groups(struct httpd_request *hreq)
       CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->out_body, sctx->headerlist));
     }
 
+  if (is_streaming)
+    httpd_send_reply_chunk(hreq, NULL, NULL);
+
+  if (in_transaction)
+    db_transaction_end();
+
   free(meta);
   daap_sort_context_free(sctx);
+  if (counted)
+    evbuffer_free(counted);
   evbuffer_free(group);
   evbuffer_free(grouplist);
   free_query_params(&qp, 1);
 
-  return DAAP_REPLY_OK;
+  return is_streaming ? DAAP_REPLY_STREAMED : DAAP_REPLY_OK;
 
  error:
+  if (in_transaction)
+    db_transaction_end();
+
   free(meta);
   daap_sort_context_free(sctx);
+  if (counted)
+    evbuffer_free(counted);
   evbuffer_free(group);
   evbuffer_free(grouplist);
   free_query_params(&qp, 1);
@@ -2163,11 +2679,13 @@ static struct httpd_uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/browse/[^/]+$",
-      .handler = daap_reply_browse
+      .handler = daap_reply_browse,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items$",
-      .handler = daap_reply_dbsonglist
+      .handler = daap_reply_dbsonglist,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+[.][^/]+$",
@@ -2175,7 +2693,8 @@ static struct httpd_uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+/extra_data/artwork$",
-      .handler = daap_reply_extra_data
+      .handler = daap_reply_extra_data,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers$",
@@ -2183,15 +2702,18 @@ static struct httpd_uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers/[[:digit:]]+/items$",
-      .handler = daap_reply_plsonglist
+      .handler = daap_reply_plsonglist,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups$",
-      .handler = daap_reply_groups
+      .handler = daap_reply_groups,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups/[[:digit:]]+/extra_data/artwork$",
-      .handler = daap_reply_extra_data
+      .handler = daap_reply_extra_data,
+      .flags = HTTPD_HANDLER_HEAVY
     },
 #ifdef DMAP_TEST
     {
@@ -2221,6 +2743,8 @@ daap_request(struct httpd_request *hreq)
   struct daap_session session;
   const char *param;
   int32_t id;
+  bool is_gzip;
+  bool is_cacheable;
   int ret;
   int msec;
 
@@ -2264,12 +2788,14 @@ daap_request(struct httpd_request *hreq)
   // video/<type> Content-Type as expected by clients like Front Row.
   httpd_header_add(hreq->out_headers, "Content-Type", "application/x-dmap-tagged");
 
-  // Try the cache
-  ret = cache_daap_get(hreq->out_body, hreq->uri);
+  // Try the cache, which has both a gzipped and a raw reply
+  is_gzip = httpd_request_gzip_accepted(hreq);
+  ret = cache_daap_get(hreq->out_body, hreq->uri, is_gzip);
   if (ret == 0)
     {
-      // The cache will return the data gzipped, so httpd_send_reply won't need to do it
-      httpd_header_add(hreq->out_headers, "Content-Encoding", "gzip");
+      // If gzipped httpd_send_reply won't need to do it
+      if (is_gzip)
+	httpd_header_add(hreq->out_headers, "Content-Encoding", "gzip");
       httpd_send_reply(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP); // TODO not all want this reply
       return;
     }
@@ -2284,7 +2810,14 @@ daap_request(struct httpd_request *hreq)
 
   DPRINTF(E_DBG, L_DAAP, "DAAP request handled in %d milliseconds\n", msec);
 
-  if (ret == DAAP_REPLY_OK && msec > cache_daap_threshold_get() && hreq->user_agent)
+  // Large group lists (e.g. Remote's album view) can be quick to make when the
+  // db is in the page cache, but not when it is cold, so they go in the cache
+  // no matter how long they took. The cache is remade when the library changes.
+  is_cacheable = (msec > cache_daap_threshold_get());
+  if (hreq->handler == daap_reply_groups)
+    is_cacheable |= (ret == DAAP_REPLY_STREAMED || evbuffer_get_length(hreq->out_body) > DAAP_CACHE_GROUPS_MIN);
+
+  if ((ret == DAAP_REPLY_OK || ret == DAAP_REPLY_STREAMED) && is_cacheable && hreq->user_agent)
     cache_daap_add(hreq->uri, hreq->user_agent, ((struct daap_session *)hreq->extra_data)->is_remote, msec);
 
   daap_reply_send(hreq, ret); // hreq is deallocted
@@ -2353,7 +2886,10 @@ static int
 daap_init(void)
 {
   srand((unsigned)time(NULL));
-  current_rev = 2;
+  current_rev = DAAP_REVISION_OFFSET;
+  current_rev = revision_get();
+
+  CHECK_ERR(L_DAAP, listener_add(daap_library_update_handler, LISTENER_DATABASE | LISTENER_RATING, NULL));
 
   return 0;
 }
@@ -2364,11 +2900,10 @@ daap_deinit(void)
   struct daap_session *s;
   struct daap_update_request *ur;
 
-  for (s = daap_sessions; daap_sessions; s = daap_sessions)
-    {
-      daap_sessions = s->next;
-      daap_session_free(s);
-    }
+  listener_remove(daap_library_update_handler);
+
+  while ((s = TAILQ_FIRST(&daap_sessions)))
+    daap_session_remove(s);
 
   for (ur = update_requests; update_requests; ur = update_requests)
     {
@@ -2377,6 +2912,8 @@ daap_deinit(void)
       daap_reply_send(ur->hreq, DAAP_REPLY_SERVUNAVAIL);
       update_free(ur);
     }
+
+  dmap_record_cache_purge();
 }
 
 struct httpd_module httpd_daap =
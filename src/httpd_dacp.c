@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include <pthread.h>
 #include <event2/event.h>
@@ -47,6 +48,9 @@
 
 #define DACP_VOLUME_STEP 5
 
+// Max age of the status snapshot used for getproperty, see status_snapshot_get()
+#define DACP_STATUS_SNAPSHOT_MS 1000
+
 struct dacp_update_request {
   struct httpd_request *hreq;
   struct event *updateev;
@@ -54,6 +58,15 @@ struct dacp_update_request {
   struct dacp_update_request *next;
 };
 
+struct dacp_status_snapshot {
+  // Value of update_current_rev when the snapshot was taken
+  int rev;
+  struct timespec taken;
+
+  struct player_status status;
+  struct db_queue_item *queue_item;
+};
+
 typedef void (*dacp_propget)(struct evbuffer *evbuf, struct player_status *status, struct db_queue_item *queue_item);
 typedef void (*dacp_propset)(const char *value, struct httpd_request *hreq);
 
@@ -129,6 +142,16 @@ static struct dacp_update_request *update_requests;
 static pthread_mutex_t update_request_lck;
 // Next revision number the client should call with
 static int update_current_rev;
+// The reply to the waiting requests is the same for all of them, so it is only
+// made once per revision. Has its own lock, since making it calls the player.
+static struct evbuffer *update_reply;
+static int update_reply_rev;
+static pthread_mutex_t update_reply_lck;
+
+// Remotes poll getproperty, so its player status and now playing item are
+// shared between requests, see status_snapshot_get()
+static struct dacp_status_snapshot status_snapshot;
+static pthread_mutex_t status_snapshot_lck;
 
 // If an item is removed from the library while in the queue, we replace it with this
 static struct media_file_info dummy_mfi;
@@ -701,6 +724,26 @@ make_playstatusupdate(struct evbuffer *evbuf, int current_rev)
   return 0;
 }
 
+static int
+make_playstatusupdate_shared(struct evbuffer *evbuf, int current_rev)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&update_reply_lck);
+  if (update_reply_rev != current_rev)
+    {
+      evbuffer_drain(update_reply, -1);
+      ret = make_playstatusupdate(update_reply, current_rev);
+      update_reply_rev = (ret < 0) ? 0 : current_rev;
+    }
+
+  if (ret == 0)
+    ret = evbuffer_add(evbuf, evbuffer_pullup(update_reply, -1), evbuffer_get_length(update_reply));
+  pthread_mutex_unlock(&update_reply_lck);
+
+  return ret;
+}
+
 static void
 playstatusupdate_cb(int fd, short what, void *arg);
 
@@ -759,7 +802,7 @@ playstatusupdate_cb(int fd, short what, void *arg)
   struct httpd_request *hreq = ur->hreq;
   int ret;
 
-  ret = make_playstatusupdate(hreq->out_body, update_current_rev);
+  ret = make_playstatusupdate_shared(hreq->out_body, update_current_rev);
   if (ret < 0)
     goto error;
 
@@ -801,6 +844,70 @@ dacp_playstatus_update_handler(short event_mask, void *ctx)
 }
 
 
+/* ---------------------------- STATUS SNAPSHOT ----------------------------- */
+
+/* Gets the player status from the shared snapshot, which is refreshed if the
+ * revision changed (player, volume or queue event) or if it is older than
+ * DACP_STATUS_SNAPSHOT_MS. The playing position is extrapolated, so it is also
+ * correct for a cached snapshot. Caller must hold status_snapshot_lck, and the
+ * now playing item in status_snapshot.queue_item is only valid while holding
+ * it.
+ */
+static int
+status_snapshot_get(struct player_status *status)
+{
+  struct dacp_status_snapshot *snapshot = &status_snapshot;
+  struct timespec now;
+  uint64_t age_ms;
+  int rev;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  rev = update_current_rev;
+  if (snapshot->rev != rev)
+    goto refresh;
+
+  age_ms = (now.tv_sec - snapshot->taken.tv_sec) * 1000 + (now.tv_nsec - snapshot->taken.tv_nsec) / 1000000;
+  if (age_ms >= DACP_STATUS_SNAPSHOT_MS)
+    goto refresh;
+
+  *status = snapshot->status;
+  if (status->status == PLAY_PLAYING)
+    {
+      status->pos_ms += age_ms;
+      if (status->len_ms && status->pos_ms > status->len_ms)
+	status->pos_ms = status->len_ms;
+    }
+
+  return 0;
+
+ refresh:
+  if (snapshot->queue_item)
+    free_queue_item(snapshot->queue_item, 0);
+
+  snapshot->queue_item = NULL;
+  snapshot->rev = 0;
+
+  player_get_status(&snapshot->status);
+  if (snapshot->status.status != PLAY_STOPPED)
+    {
+      snapshot->queue_item = db_queue_fetch_byitemid(snapshot->status.item_id);
+      if (!snapshot->queue_item)
+	{
+	  DPRINTF(E_LOG, L_DACP, "Could not fetch queue_item for item-id %d\n", snapshot->status.item_id);
+	  return -1;
+	}
+    }
+
+  snapshot->rev = rev;
+  snapshot->taken = now;
+
+  *status = snapshot->status;
+
+  return 0;
+}
+
+
 /* --------------------- PROPERTIES GETTERS AND SETTERS --------------------- */
 
 static void
@@ -1702,6 +1809,7 @@ dacp_reply_playqueuecontents(struct httpd_request *hreq)
   int start_index;
   struct query_params qp;
   struct db_queue_item queue_item;
+  struct db_queue_item *cur;
 
   /* /ctrl-int/1/playqueue-contents?span=50&session-id=... */
 
@@ -1752,37 +1860,48 @@ dacp_reply_playqueuecontents(struct httpd_request *hreq)
 	  count++;
 	}
     }
-  else
+  else if (status.item_id != 0 && span > 1 && (cur = db_queue_fetch_byitemid(status.item_id)))
     {
+      // Up Next is the span - 1 items after the playing one, so only ask the
+      // db for those (the pos/shuffle_pos index makes this a range scan)
       memset(&qp, 0, sizeof(struct query_params));
 
       if (status.shuffle)
-	qp.sort = S_SHUFFLE_POS;
+	{
+	  qp.sort = S_SHUFFLE_POS;
+	  qp.filter = db_mprintf("shuffle_pos > %d", cur->shuffle_pos);
+	}
+      else
+	qp.filter = db_mprintf("pos > %d", cur->pos);
+
+      qp.idx_type = I_FIRST;
+      qp.limit = span - 1;
+
+      free_queue_item(cur, 0);
 
       ret = db_queue_enum_start(&qp);
       if (ret < 0)
-	goto error;
+	{
+	  free(qp.filter);
+	  goto error;
+	}
 
-      while ((db_queue_enum_fetch(&qp, &queue_item) == 0) && (queue_item.id > 0) && (count < span))
+      count = 1;
+      while ((db_queue_enum_fetch(&qp, &queue_item) == 0) && (queue_item.id > 0))
 	{
-	  if (status.item_id == 0 || status.item_id == queue_item.id)
+	  ret = playqueuecontents_add_queue_item(songlist, &queue_item, count, status.plid);
+	  if (ret < 0)
 	    {
-	      count = 1;
+	      db_queue_enum_end(&qp);
+	      free(qp.filter);
+	      goto error;
 	    }
-	  else if (count > 0)
-	    {
-	      ret = playqueuecontents_add_queue_item(songlist, &queue_item, count, status.plid);
-	      if (ret < 0)
-		{
-		  db_queue_enum_end(&qp);
-		  goto error;
-		}
 
-	      count++;
-	    }
+	  count++;
 	}
 
       db_queue_enum_end(&qp);
+      free(qp.filter);
     }
 
   /* Playlists are hist, curr and main. */
@@ -2313,6 +2432,13 @@ dacp_reply_nowplayingartwork(struct httpd_request *hreq)
 	goto no_artwork;
     }
 
+  // Remotes poll this, and usually the artwork is the same as last time
+  if (httpd_request_etag_body_matches(hreq))
+    {
+      httpd_send_reply(hreq, HTTP_NOTMODIFIED, NULL, HTTPD_SEND_NO_GZIP);
+      return 0;
+    }
+
   httpd_header_remove(hreq->out_headers, "Content-Type");
   httpd_header_add(hreq->out_headers, "Content-Type", ctype);
   snprintf(clen, sizeof(clen), "%ld", (long)len);
@@ -2375,20 +2501,19 @@ dacp_reply_getproperty(struct httpd_request *hreq)
       goto out_free_propstr;
     }
 
-  player_get_status(&status);
+  pthread_mutex_lock(&status_snapshot_lck);
 
-  if (status.status != PLAY_STOPPED)
+  ret = status_snapshot_get(&status);
+  if (ret < 0)
     {
-      queue_item = db_queue_fetch_byitemid(status.item_id);
-      if (!queue_item)
-	{
-	  DPRINTF(E_LOG, L_DACP, "Could not fetch queue_item for item-id %d\n", status.item_id);
+      pthread_mutex_unlock(&status_snapshot_lck);
 
-	  dacp_send_error(hreq, "cmgt", "Server error");
-	  goto out_free_proplist;
-	}
+      dacp_send_error(hreq, "cmgt", "Server error");
+      goto out_free_proplist;
     }
 
+  queue_item = status_snapshot.queue_item;
+
   prop = strtok_r(propstr, ",", &ptr);
   while (prop)
     {
@@ -2406,10 +2531,9 @@ dacp_reply_getproperty(struct httpd_request *hreq)
       prop = strtok_r(NULL, ",", &ptr);
     }
 
-  free(propstr);
+  pthread_mutex_unlock(&status_snapshot_lck);
 
-  if (queue_item)
-    free_queue_item(queue_item, 0);
+  free(propstr);
 
   len = evbuffer_get_length(proplist);
   dmap_add_container(hreq->out_body, "cmgt", 12 + len);
@@ -2817,7 +2941,11 @@ dacp_init(void)
   dummy_queue_item.genre = CFG_NAME_UNKNOWN_GENRE;
 
   CHECK_ERR(L_DACP, mutex_init(&update_request_lck));
+  CHECK_ERR(L_DACP, mutex_init(&update_reply_lck));
+  CHECK_ERR(L_DACP, mutex_init(&status_snapshot_lck));
+  CHECK_NULL(L_DACP, update_reply = evbuffer_new());
   update_current_rev = 2;
+  update_reply_rev = 0;
   listener_add(dacp_playstatus_update_handler, LISTENER_PLAYER | LISTENER_VOLUME | LISTENER_QUEUE, NULL);
 
   return 0;
@@ -2837,6 +2965,13 @@ dacp_deinit(void)
       httpd_send_error(ur->hreq, HTTP_SERVUNAVAIL, "Service Unavailable");
       update_request_free(ur);
     }
+
+  evbuffer_free(update_reply);
+
+  if (status_snapshot.queue_item)
+    free_queue_item(status_snapshot.queue_item, 0);
+  status_snapshot.queue_item = NULL;
+  status_snapshot.rev = 0;
 }
 
 struct httpd_module httpd_dacp =
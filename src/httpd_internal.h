@@ -10,6 +10,8 @@
 # include <config.h>
 #endif
 
+#include "misc.h"
+
 /* Response codes from event2/http.h */
 #define HTTP_CONTINUE          100	/**< client should proceed to send */
 #define HTTP_SWITCH_PROTOCOLS  101	/**< switching to another protocol */
@@ -46,6 +48,8 @@ struct evhttp_connection;
 struct evhttp_request;
 struct evkeyvalq;
 struct httpd_uri_parsed;
+struct httpd_compressor;
+struct httpd_route_stats;
 
 typedef struct httpd_server httpd_server;
 typedef struct evhttp_connection httpd_connection;
@@ -85,6 +89,7 @@ enum httpd_reply_type
 
 enum httpd_send_flags
 {
+  // Don't compress the reply, neither with gzip nor brotli
   HTTPD_SEND_NO_GZIP =   (1 << 0),
 };
 
@@ -101,6 +106,7 @@ enum httpd_modules
   MODULE_STREAMING,
   MODULE_OAUTH,
   MODULE_RSP,
+  MODULE_METRICS,
 };
 
 enum httpd_handler_flags
@@ -109,6 +115,10 @@ enum httpd_handler_flags
   // requests that must be answered quickly. Can only be used for nonblocking
   // handlers.
   HTTPD_HANDLER_REALTIME = (1 << 0),
+  // Handlers that can take long because they return big parts of the library
+  // (e.g. a full song list). These get their own threads, so that they don't
+  // hold up the worker threads that serve control requests.
+  HTTPD_HANDLER_HEAVY = (1 << 1),
 };
 
 struct httpd_module
@@ -140,6 +150,27 @@ struct httpd_uri_map
   int (*handler)(struct httpd_request *hreq);
   void *preg;
   int flags; // See enum httpd_handler_flags
+  struct httpd_route_stats *stats;
+};
+
+/*
+ * Cumulative statistics per handler since startup, see httpd_route_stats_get()
+ */
+struct httpd_route_stats
+{
+  const char *module;
+  const char *regexp;
+  enum httpd_methods method;
+  uint64_t requests;
+  // Replies with a status code of 400 or more
+  uint64_t errors;
+  uint64_t bytes_sent;
+  uint64_t handler_total_us;
+  // Time from the request was received until a thread started handling it
+  struct histogram queue_us;
+  // Time the handler took. Streams continue after this, but their bytes sent
+  // are still counted.
+  struct histogram handler_us;
 };
 
 
@@ -194,10 +225,18 @@ struct httpd_request {
   int (*handler)(struct httpd_request *hreq);
   // Is the processing defered to a worker thread
   bool is_async;
+  // Is it deferred to the thread pool for heavy requests, see HTTPD_HANDLER_HEAVY
+  bool is_heavy;
   // Handler thread's evbase in case the handler needs to scehdule an event
   struct event_base *evbase;
   // A pointer to extra data that the module handling the request might need
   void *extra_data;
+  // Set if the chunks of a chunked reply are being compressed
+  struct httpd_compressor *compressor;
+  // Statistics of the handler, NULL if there is no handler
+  struct httpd_route_stats *stats;
+  // When the request was received, for the queue time in stats
+  struct timespec received;
 };
 
 
@@ -206,6 +245,15 @@ struct httpd_request {
 void
 httpd_stream_file(struct httpd_request *hreq, int id);
 
+/*
+ * Gets a copy of the statistics of all request handlers
+ *
+ * @out stats    Array of stats, must be freed by caller
+ * @return       Number of elements in the array
+ */
+int
+httpd_route_stats_get(struct httpd_route_stats **stats);
+
 int
 httpd_xcode_profile_get(struct httpd_request *hreq);
 
@@ -218,14 +266,17 @@ httpd_request_not_modified_since(struct httpd_request *hreq, time_t mtime);
 bool
 httpd_request_etag_matches(struct httpd_request *hreq, const char *etag);
 
+bool
+httpd_request_etag_body_matches(struct httpd_request *hreq);
+
 void
 httpd_response_not_cachable(struct httpd_request *hreq);
 
 /*
  * This wrapper around evhttp_send_reply should be used whenever a request may
- * come from a browser. It will automatically gzip if feasible, but the caller
- * may direct it not to. It will set CORS headers as appropriate. Should be
- * thread safe.
+ * come from a browser. It will automatically compress with brotli or gzip if
+ * feasible, but the caller may direct it not to. Large compressed replies are
+ * sent chunked. It will set CORS headers as appropriate. Should be thread safe.
  *
  * @in  hreq     The http request struct. NOTE: is automatically deallocated if
  *               this is the final reply.
@@ -237,8 +288,20 @@ httpd_response_not_cachable(struct httpd_request *hreq);
 void
 httpd_send_reply(struct httpd_request *hreq, int code, const char *reason, enum httpd_send_flags flags);
 
+/*
+ * @in  hreq     The http request struct
+ * @return       true if the client accepts a gzip encoded reply
+ */
+bool
+httpd_request_gzip_accepted(struct httpd_request *hreq);
+
+/*
+ * Starts a chunked reply. Unless flags has HTTPD_SEND_NO_GZIP, each chunk will
+ * be compressed with brotli or gzip if the client accepts that. The chunks are
+ * flushed, so the client can decode each chunk as it arrives.
+ */
 void
-httpd_send_reply_start(struct httpd_request *hreq, int code, const char *reason);
+httpd_send_reply_start(struct httpd_request *hreq, int code, const char *reason, enum httpd_send_flags flags);
 
 void
 httpd_send_reply_chunk(struct httpd_request *hreq, httpd_connection_chunkcb cb, void *arg);
@@ -301,6 +364,16 @@ httpd_header_add(httpd_headers *headers, const char *key, const char *val);
 void
 httpd_headers_clear(httpd_headers *headers);
 
+/*
+ * An empty list of headers for requests that don't come from a backend, e.g.
+ * internally built requests. Free with httpd_headers_free().
+ */
+httpd_headers *
+httpd_headers_new(void);
+
+void
+httpd_headers_free(httpd_headers *headers);
+
 void
 httpd_request_close_cb_set(struct httpd_request *hreq, httpd_close_cb cb, void *arg);
 
@@ -39,14 +39,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef HAVE_JSON_C_USERDATA
+# include <printbuf.h>
+#endif
 
 #include "httpd_internal.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
 #include "library.h"
+#include "listener.h"
 #include "listenbrainz.h"
 #include "logger.h"
 #include "misc.h"
@@ -55,6 +60,9 @@
 #include "remote_pairing.h"
 #include "settings.h"
 #include "smartpl_query.h"
+#include "typeahead.h"
+#include "trace.h"
+#include "worker.h"
 #ifdef SPOTIFY
 # include "library/spotify_webapi.h"
 # include "inputs/spotify.h"
@@ -77,6 +85,25 @@ static const struct track_attribs track_attribs[] =
   { LIBRARY_ATTRIB_USERMARK, "usermark", },
 };
 
+/* Listings repeat the same artist, album, genre etc. for many items, so within
+ * a listing these are made into json strings only once and then shared by the
+ * items (json objects are refcounted). See json_strings_get().
+ */
+#define JSON_STRINGS_SIZE 4096 // Must be a power of two
+#define JSON_STRINGS_LEN_MAX 512
+
+struct json_strings_entry
+{
+  uint32_t hash;
+  json_object *obj;
+};
+
+struct json_strings
+{
+  int count;
+  struct json_strings_entry entries[JSON_STRINGS_SIZE];
+};
+
 static bool allow_modifying_stored_playlists;
 static char *default_playlist_directory;
 
@@ -100,6 +127,102 @@ safe_json_add_string(json_object *obj, const char *key, const char *value)
     json_object_object_add(obj, key, json_object_new_string(value));
 }
 
+#ifdef HAVE_JSON_C_USERDATA
+static int
+json_strings_serialize(json_object *obj, struct printbuf *pb, int level, int flags)
+{
+  const char *escaped = json_object_get_userdata(obj);
+
+  return printbuf_memappend(pb, escaped, strlen(escaped));
+}
+
+// A shared string is written for every item that has it, so we keep the
+// escaped form instead of letting json-c escape it each time
+static void
+json_strings_escaped_set(json_object *obj)
+{
+  char *escaped;
+
+  escaped = strdup(json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+  if (!escaped)
+    return;
+
+  json_object_set_serializer(obj, json_strings_serialize, escaped, json_object_free_userdata);
+}
+#endif
+
+static struct json_strings *
+json_strings_new(void)
+{
+  struct json_strings *strings;
+
+  CHECK_NULL(L_WEB, strings = calloc(1, sizeof(struct json_strings)));
+
+  return strings;
+}
+
+static void
+json_strings_free(struct json_strings *strings)
+{
+  int i;
+
+  if (!strings)
+    return;
+
+  for (i = 0; i < JSON_STRINGS_SIZE; i++)
+    {
+      if (strings->entries[i].obj)
+	json_object_put(strings->entries[i].obj);
+    }
+
+  free(strings);
+}
+
+// Returns a json string with the given value, the caller gets a reference. If
+// strings is NULL (or full), the string is not shared.
+static json_object *
+json_strings_get(struct json_strings *strings, const char *value)
+{
+  struct json_strings_entry *entry;
+  json_object *obj;
+  uint32_t hash;
+  size_t len;
+  int i;
+
+  len = strlen(value);
+  if (!strings || len > JSON_STRINGS_LEN_MAX || strings->count >= JSON_STRINGS_SIZE / 2)
+    return json_object_new_string(value);
+
+  hash = djb_hash(value, len);
+  for (i = hash & (JSON_STRINGS_SIZE - 1); strings->entries[i].obj; i = (i + 1) & (JSON_STRINGS_SIZE - 1))
+    {
+      entry = &strings->entries[i];
+      if (entry->hash == hash && strcmp(json_object_get_string(entry->obj), value) == 0)
+	return json_object_get(entry->obj);
+    }
+
+  obj = json_object_new_string(value);
+  if (!obj)
+    return NULL;
+
+#ifdef HAVE_JSON_C_USERDATA
+  json_strings_escaped_set(obj);
+#endif
+
+  strings->entries[i].hash = hash;
+  strings->entries[i].obj = obj;
+  strings->count++;
+
+  return json_object_get(obj);
+}
+
+static inline void
+safe_json_add_string_shared(json_object *obj, const char *key, const char *value, struct json_strings *strings)
+{
+  if (value)
+    json_object_object_add(obj, key, json_strings_get(strings, value));
+}
+
 static inline void
 safe_json_add_string_from_int64(json_object *obj, const char *key, int64_t value)
 {
@@ -193,7 +316,7 @@ safe_json_add_date_from_string(json_object *obj, const char *key, const char *va
 }
 
 static json_object *
-artist_to_json(struct db_group_info *dbgri)
+artist_to_json(struct db_group_info *dbgri, struct json_strings *strings)
 {
   json_object *item;
   int intval;
@@ -219,11 +342,11 @@ artist_to_json(struct db_group_info *dbgri)
 
   ret = safe_atoi32(dbgri->media_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
+    safe_json_add_string_shared(item, "media_kind", db_media_kind_label(intval), strings);
 
   ret = safe_atoi32(dbgri->data_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
+    safe_json_add_string_shared(item, "data_kind", db_data_kind_label(intval), strings);
 
   ret = snprintf(uri, sizeof(uri), "%s:%s:%s", "library", "artist", dbgri->persistentid);
   if (ret < sizeof(uri))
@@ -237,7 +360,7 @@ artist_to_json(struct db_group_info *dbgri)
 }
 
 static json_object *
-album_to_json(struct db_group_info *dbgri)
+album_to_json(struct db_group_info *dbgri, struct json_strings *strings)
 {
   json_object *item;
   int intval;
@@ -250,8 +373,8 @@ album_to_json(struct db_group_info *dbgri)
   safe_json_add_string(item, "id", dbgri->persistentid);
   safe_json_add_string(item, "name", dbgri->itemname);
   safe_json_add_string(item, "name_sort", dbgri->itemname_sort);
-  safe_json_add_string(item, "artist", dbgri->songalbumartist);
-  safe_json_add_string(item, "artist_id", dbgri->songartistid);
+  safe_json_add_string_shared(item, "artist", dbgri->songalbumartist, strings);
+  safe_json_add_string_shared(item, "artist_id", dbgri->songartistid, strings);
   safe_json_add_int_from_string(item, "track_count", dbgri->itemcount);
   safe_json_add_int_from_string(item, "length_ms", dbgri->song_length);
 
@@ -264,11 +387,11 @@ album_to_json(struct db_group_info *dbgri)
 
   ret = safe_atoi32(dbgri->media_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
+    safe_json_add_string_shared(item, "media_kind", db_media_kind_label(intval), strings);
 
   ret = safe_atoi32(dbgri->data_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
+    safe_json_add_string_shared(item, "data_kind", db_data_kind_label(intval), strings);
 
   safe_json_add_date_from_string(item, "date_released", dbgri->date_released);
   safe_json_add_int_from_string(item, "year", dbgri->year);
@@ -285,7 +408,7 @@ album_to_json(struct db_group_info *dbgri)
 }
 
 static json_object *
-track_to_json(struct db_media_file_info *dbmfi)
+track_to_json(struct db_media_file_info *dbmfi, struct json_strings *strings)
 {
   json_object *item;
   char uri[100];
@@ -298,16 +421,16 @@ track_to_json(struct db_media_file_info *dbmfi)
   safe_json_add_int_from_string(item, "id", dbmfi->id);
   safe_json_add_string(item, "title", dbmfi->title);
   safe_json_add_string(item, "title_sort", dbmfi->title_sort);
-  safe_json_add_string(item, "artist", dbmfi->artist);
-  safe_json_add_string(item, "artist_sort", dbmfi->artist_sort);
-  safe_json_add_string(item, "album", dbmfi->album);
-  safe_json_add_string(item, "album_sort", dbmfi->album_sort);
-  safe_json_add_string(item, "album_id", dbmfi->songalbumid);
-  safe_json_add_string(item, "album_artist", dbmfi->album_artist);
-  safe_json_add_string(item, "album_artist_sort", dbmfi->album_artist_sort);
-  safe_json_add_string(item, "album_artist_id", dbmfi->songartistid);
-  safe_json_add_string(item, "composer", dbmfi->composer);
-  safe_json_add_string(item, "genre", dbmfi->genre);
+  safe_json_add_string_shared(item, "artist", dbmfi->artist, strings);
+  safe_json_add_string_shared(item, "artist_sort", dbmfi->artist_sort, strings);
+  safe_json_add_string_shared(item, "album", dbmfi->album, strings);
+  safe_json_add_string_shared(item, "album_sort", dbmfi->album_sort, strings);
+  safe_json_add_string_shared(item, "album_id", dbmfi->songalbumid, strings);
+  safe_json_add_string_shared(item, "album_artist", dbmfi->album_artist, strings);
+  safe_json_add_string_shared(item, "album_artist_sort", dbmfi->album_artist_sort, strings);
+  safe_json_add_string_shared(item, "album_artist_id", dbmfi->songartistid, strings);
+  safe_json_add_string_shared(item, "composer", dbmfi->composer, strings);
+  safe_json_add_string_shared(item, "genre", dbmfi->genre, strings);
   safe_json_add_string(item, "comment", dbmfi->comment);
   safe_json_add_int_from_string(item, "year", dbmfi->year);
   safe_json_add_int_from_string(item, "track_number", dbmfi->track);
@@ -323,7 +446,7 @@ track_to_json(struct db_media_file_info *dbmfi)
   safe_json_add_date_from_string(item, "date_released", dbmfi->date_released);
   safe_json_add_int_from_string(item, "seek_ms", dbmfi->seek);
 
-  safe_json_add_string(item, "type", dbmfi->type);
+  safe_json_add_string_shared(item, "type", dbmfi->type, strings);
   safe_json_add_int_from_string(item, "samplerate", dbmfi->samplerate);
   safe_json_add_int_from_string(item, "bitrate", dbmfi->bitrate);
   safe_json_add_int_from_string(item, "channels", dbmfi->channels);
@@ -331,11 +454,11 @@ track_to_json(struct db_media_file_info *dbmfi)
 
   ret = safe_atoi32(dbmfi->media_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
+    safe_json_add_string_shared(item, "media_kind", db_media_kind_label(intval), strings);
 
   ret = safe_atoi32(dbmfi->data_kind, &intval);
   if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
+    safe_json_add_string_shared(item, "data_kind", db_data_kind_label(intval), strings);
 
   safe_json_add_string(item, "path", dbmfi->path);
 
@@ -451,27 +574,130 @@ directory_to_json(struct directory_info *directory_info)
 }
 
 
+/* The items of a list reply go either into a json array, or for the replies
+ * that are just a list, directly into the reply buffer. The latter means that
+ * we don't need to have the json objects of all the items in memory at once,
+ * which matters for e.g. tracks with a large limit. Each item is still made
+ * with e.g. track_to_json(), but freed as soon as it has been written.
+ */
+struct json_list
+{
+  json_object *array;
+  struct evbuffer *evbuf;
+  int count;
+  // From the "fields" query parameter, e.g. "id,title,uri", or NULL for all
+  const char *fields;
+};
+
+// Returns a json object with only the given members of item, in the order
+// they are listed in fields. Takes ownership of item.
+static json_object *
+json_fields_select(json_object *item, const char *fields)
+{
+  json_object *selected;
+  json_object *val;
+  char key[64];
+  const char *ptr;
+  size_t len;
+
+  if (!fields || !item)
+    return item;
+
+  CHECK_NULL(L_WEB, selected = json_object_new_object());
+
+  for (ptr = fields; *ptr; ptr += len + (ptr[len] == ','))
+    {
+      len = strcspn(ptr, ",");
+      if (len == 0 || len >= sizeof(key))
+	continue;
+
+      memcpy(key, ptr, len);
+      key[len] = '\0';
+
+      if (json_object_object_get_ex(item, key, &val))
+	json_object_object_add(selected, key, json_object_get(val));
+    }
+
+  jparse_free(item);
+  return selected;
+}
+
+// Starts a { "items": [ ... ] } reply in evbuf
+static int
+json_list_stream_start(struct json_list *list, struct evbuffer *evbuf)
+{
+  memset(list, 0, sizeof(struct json_list));
+  list->evbuf = evbuf;
+
+  return evbuffer_add_printf(evbuf, "{ \"items\": [ ");
+}
+
+// Ends the reply, reply has the members that follow the items (e.g. total)
+static int
+json_list_stream_end(struct json_list *list, json_object *reply)
+{
+  int ret;
+
+  ret = evbuffer_add_printf(list->evbuf, " ]");
+  if (ret < 0)
+    return -1;
+
+  json_object_object_foreach(reply, key, val)
+    {
+      ret = evbuffer_add_printf(list->evbuf, ", \"%s\": %s", key, json_object_to_json_string(val));
+      if (ret < 0)
+	return -1;
+    }
+
+  return evbuffer_add_printf(list->evbuf, " }");
+}
+
+// Takes ownership of item
+static int
+json_list_add(struct json_list *list, json_object *item)
+{
+  int ret;
+
+  item = json_fields_select(item, list->fields);
+
+  if (!list->evbuf)
+    {
+      json_object_array_add(list->array, item);
+      list->count++;
+      return 0;
+    }
+
+  ret = evbuffer_add_printf(list->evbuf, "%s%s", (list->count > 0) ? ", " : "", json_object_to_json_string(item));
+  jparse_free(item);
+  if (ret < 0)
+    return -1;
+
+  list->count++;
+  return 0;
+}
+
 static int
-fetch_tracks(struct query_params *query_params, json_object *items, int *total)
+fetch_tracks(struct query_params *query_params, struct json_list *items, int *total)
 {
   struct db_media_file_info dbmfi;
+  struct json_strings *strings;
   json_object *item;
   int ret;
 
+  strings = json_strings_new();
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
 
   while ((ret = db_query_fetch_file(&dbmfi, query_params)) == 0)
     {
-      item = track_to_json(&dbmfi);
-      if (!item)
+      item = track_to_json(&dbmfi, strings);
+      if (!item || json_list_add(items, item) < 0)
 	{
 	  ret = -1;
 	  goto error;
 	}
-
-      json_object_array_add(items, item);
     }
 
   if (total)
@@ -479,17 +705,21 @@ fetch_tracks(struct query_params *query_params, json_object *items, int *total)
 
  error:
   db_query_end(query_params);
+  json_strings_free(strings);
 
   return ret;
 }
 
 static int
-fetch_artists(struct query_params *query_params, json_object *items, int *total)
+fetch_artists(struct query_params *query_params, struct json_list *items, int *total)
 {
   struct db_group_info dbgri;
+  struct json_strings *strings;
   json_object *item;
   int ret = 0;
 
+  strings = json_strings_new();
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -500,14 +730,12 @@ fetch_artists(struct query_params *query_params, json_object *items, int *total)
       if (strlen(dbgri.itemname) == 0)
 	continue;
 
-      item = artist_to_json(&dbgri);
-      if (!item)
+      item = artist_to_json(&dbgri, strings);
+      if (!item || json_list_add(items, item) < 0)
 	{
 	  ret = -1;
 	  goto error;
 	}
-
-      json_object_array_add(items, item);
     }
 
   if (total)
@@ -515,6 +743,7 @@ fetch_artists(struct query_params *query_params, json_object *items, int *total)
 
  error:
   db_query_end(query_params);
+  json_strings_free(strings);
 
   return ret;
 }
@@ -541,7 +770,7 @@ fetch_artist(bool *notfound, const char *artist_id)
 
   if ((ret = db_query_fetch_group(&dbgri, &query_params)) == 0)
     {
-      artist = artist_to_json(&dbgri);
+      artist = artist_to_json(&dbgri, NULL);
       *notfound = false;
     }
 
@@ -553,12 +782,15 @@ fetch_artist(bool *notfound, const char *artist_id)
 }
 
 static int
-fetch_albums(struct query_params *query_params, json_object *items, int *total)
+fetch_albums(struct query_params *query_params, struct json_list *items, int *total)
 {
   struct db_group_info dbgri;
+  struct json_strings *strings;
   json_object *item;
   int ret = 0;
 
+  strings = json_strings_new();
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -569,14 +801,12 @@ fetch_albums(struct query_params *query_params, json_object *items, int *total)
       if (strlen(dbgri.itemname) == 0)
 	continue;
 
-      item = album_to_json(&dbgri);
-      if (!item)
+      item = album_to_json(&dbgri, strings);
+      if (!item || json_list_add(items, item) < 0)
 	{
 	  ret = -1;
 	  goto error;
 	}
-
-      json_object_array_add(items, item);
     }
 
   if (total)
@@ -584,6 +814,7 @@ fetch_albums(struct query_params *query_params, json_object *items, int *total)
 
  error:
   db_query_end(query_params);
+  json_strings_free(strings);
 
   return ret;
 }
@@ -611,7 +842,7 @@ fetch_album(bool *notfound, const char *album_id)
 
   if ((ret = db_query_fetch_group(&dbgri, &query_params)) == 0)
     {
-      album = album_to_json(&dbgri);
+      album = album_to_json(&dbgri, NULL);
       *notfound = false;
     }
 
@@ -784,6 +1015,190 @@ query_params_limit_set(struct query_params *query_params, struct httpd_request *
   return 0;
 }
 
+/*
+ * Keyset paging with the "cursor" query parameter: an empty cursor requests the
+ * first page, and the reply includes the cursor for the next page. Unlike
+ * offset paging, the cost of a page does not depend on how deep the page is.
+ * The cursor is the sort key and id of the last item (base64url encoded).
+ */
+static int
+query_params_cursor_set(struct query_params *query_params, struct httpd_request *hreq)
+{
+  const char *param;
+  char *key;
+  char *ptr;
+
+  param = httpd_query_value_find(hreq->query, "cursor");
+  if (!param)
+    return 0;
+
+  query_params->idx_type = I_KEYSET;
+  query_params->offset = 0;
+
+  if (param[0] == '\0')
+    return 0;
+
+  key = strdup(param);
+  for (ptr = key; *ptr; ptr++)
+    {
+      if (*ptr == '-')
+	*ptr = '+';
+      else if (*ptr == '_')
+	*ptr = '/';
+    }
+
+  ptr = (char *)b64_decode(NULL, key);
+  free(key);
+  if (!ptr)
+    goto invalid;
+
+  key = ptr;
+  ptr = strchr(key, ':');
+  if (ptr)
+    *ptr++ = '\0';
+
+  if (safe_atoi64(key, &query_params->keyset_id) < 0)
+    {
+      free(key);
+      goto invalid;
+    }
+
+  // No value means the sort key of the last item was NULL
+  query_params->keyset_value = safe_strdup(ptr);
+  free(key);
+  return 0;
+
+ invalid:
+  DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'cursor' (%s)\n", param);
+  return -1;
+}
+
+static void
+query_params_cursor_add(json_object *reply, struct query_params *query_params, int64_t prev_id)
+{
+  char *key;
+  char *cursor;
+  char *ptr;
+
+  // Nothing fetched, so this was the last page
+  if (query_params->idx_type != I_KEYSET || query_params->keyset_id == prev_id)
+    return;
+
+  if (query_params->keyset_value)
+    key = safe_asprintf("%" PRIi64 ":%s", query_params->keyset_id, query_params->keyset_value);
+  else
+    key = safe_asprintf("%" PRIi64, query_params->keyset_id);
+
+  cursor = b64_encode((uint8_t *)key, strlen(key));
+  free(key);
+  if (!cursor)
+    return;
+
+  for (ptr = cursor; *ptr; ptr++)
+    {
+      if (*ptr == '+')
+	*ptr = '-';
+      else if (*ptr == '/')
+	*ptr = '_';
+      else if (*ptr == '=')
+	{
+	  *ptr = '\0';
+	  break;
+	}
+    }
+
+  json_object_object_add(reply, "cursor", json_object_new_string(cursor));
+  free(cursor);
+}
+
+/* ------------------------- Aggregate reply cache -------------------------- */
+
+/*
+ * The count and browse replies are GROUP BY aggregates over the whole files
+ * table, and the web UI asks for several of them on every page, so the replies
+ * are cached by request URI. The cache key starts with the ETag, which changes
+ * with each LISTENER_DATABASE event and each library update, so entries of an
+ * old library state are never hit again and just age out of the LRU cache.
+ */
+
+// Replies bigger than this, e.g. all composers of a big library, aren't cached
+#define JSONAPI_AGGREGATE_CACHE_MAX (256 * 1024)
+
+static struct lru_cache aggregate_cache = LRU_CACHE_INITIALIZER(lru_cache_strdup, free);
+static uint32_t aggregate_generation;
+static time_t aggregate_epoch;
+
+static void
+aggregate_listener_cb(short event_mask, void *ctx)
+{
+  __atomic_add_fetch(&aggregate_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void
+aggregate_etag_make(char *etag, size_t len)
+{
+  int64_t db_update = 0;
+  int64_t db_modified = 0;
+
+  db_admin_getint64(&db_update, DB_ADMIN_DB_UPDATE);
+  db_admin_getint64(&db_modified, DB_ADMIN_DB_MODIFIED);
+
+  // The epoch is there because the generation restarts from 0 with the server
+  snprintf(etag, len, "\"%" PRIi64 "-%" PRIi64 "-%" PRIi64 "-%u\"", db_update, db_modified,
+    (int64_t)aggregate_epoch, __atomic_load_n(&aggregate_generation, __ATOMIC_RELAXED));
+}
+
+// Like is_modified(), but also checks and sets an ETag, which is returned in
+// etag. Unlike the db_update timestamp it also changes with e.g. added files.
+static bool
+aggregate_is_modified(struct httpd_request *hreq, char *etag, size_t len)
+{
+  const char *none_match;
+
+  aggregate_etag_make(etag, len);
+
+  if (!is_modified(hreq, DB_ADMIN_DB_UPDATE))
+    return false;
+
+  none_match = httpd_header_find(hreq->in_headers, "If-None-Match");
+  if (none_match && (strcasecmp(none_match, etag) == 0))
+    return false;
+
+  httpd_header_add(hreq->out_headers, "ETag", etag);
+  return true;
+}
+
+static bool
+aggregate_cache_get(struct httpd_request *hreq, const char *etag)
+{
+  char *key;
+  char *reply;
+
+  key = safe_asprintf("%s:%s", etag, hreq->uri);
+  reply = lru_cache_get(&aggregate_cache, key);
+  free(key);
+
+  if (!reply)
+    return false;
+
+  CHECK_ERRNO(L_WEB, evbuffer_add(hreq->out_body, reply, strlen(reply)));
+  free(reply);
+  return true;
+}
+
+static void
+aggregate_cache_add(struct httpd_request *hreq, const char *etag, const char *reply)
+{
+  char *key;
+
+  if (strlen(reply) > JSONAPI_AGGREGATE_CACHE_MAX)
+    return;
+
+  key = safe_asprintf("%s:%s", etag, hreq->uri);
+  lru_cache_add(&aggregate_cache, key, reply);
+  free(key);
+}
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 
 /*
@@ -1610,6 +2025,30 @@ struct outputs_param
   int output_volume;
 };
 
+static json_object *
+speaker_stats_history_to_json(struct output_stats *stats)
+{
+  json_object *history;
+  json_object *sample;
+  int pos;
+  int i;
+
+  history = json_object_new_array();
+
+  // Oldest first
+  pos = (stats->history_pos - stats->history_len + OUTPUTS_STATS_HISTORY) % OUTPUTS_STATS_HISTORY;
+  for (i = 0; i < stats->history_len; i++, pos = (pos + 1) % OUTPUTS_STATS_HISTORY)
+    {
+      sample = json_object_new_object();
+      json_object_object_add(sample, "time", json_object_new_int64(stats->history[pos].time));
+      json_object_object_add(sample, "latency_ms", json_object_new_int(stats->history[pos].latency_ms));
+      json_object_object_add(sample, "drift_ppm", json_object_new_int(stats->history[pos].drift_ppm));
+      json_object_array_add(history, sample);
+    }
+
+  return history;
+}
+
 static json_object *
 speaker_to_json(struct player_speaker_info *spk)
 {
@@ -1638,6 +2077,16 @@ speaker_to_json(struct player_speaker_info *spk)
   json_object_object_add(output, "volume", json_object_new_int(spk->absvol));
   json_object_object_add(output, "format", json_object_new_string(media_format_to_string(spk->format)));
   json_object_object_add(output, "supported_formats", supported_formats);
+  json_object_object_add(output, "resend_hits", json_object_new_int64(spk->stats.resend_hits));
+  json_object_object_add(output, "resend_misses", json_object_new_int64(spk->stats.resend_misses));
+  json_object_object_add(output, "underruns", json_object_new_int64(spk->stats.underruns));
+  json_object_object_add(output, "overruns", json_object_new_int64(spk->stats.overruns));
+  json_object_object_add(output, "rtt_ms", json_object_new_int(spk->stats.rtt_ms));
+  json_object_object_add(output, "latency_ms", json_object_new_int(spk->stats.latency_ms));
+  json_object_object_add(output, "drift_ppm", json_object_new_int(spk->stats.drift_ppm));
+  json_object_object_add(output, "sync_corrections", json_object_new_int64(spk->stats.corrections));
+  json_object_object_add(output, "bytes_sent", json_object_new_int64(spk->stats.bytes_sent));
+  json_object_object_add(output, "stats_history", speaker_stats_history_to_json(&spk->stats));
 
   return output;
 }
@@ -2228,42 +2677,247 @@ jsonapi_reply_player(struct httpd_request *hreq)
 }
 
 static json_object *
-queue_item_to_json(struct db_queue_item *queue_item, char shuffle)
+histogram_to_json(struct histogram *h)
 {
-  json_object *item;
-  char uri[100];
-  char artwork_url[100];
-  int ret;
-
-  item = json_object_new_object();
+  json_object *reply;
+  json_object *buckets;
+  int i;
 
-  json_object_object_add(item, "id", json_object_new_int(queue_item->id));
-  if (shuffle)
-    json_object_object_add(item, "position", json_object_new_int(queue_item->shuffle_pos));
-  else
-    json_object_object_add(item, "position", json_object_new_int(queue_item->pos));
+  reply = json_object_new_object();
+  buckets = json_object_new_array();
 
-  if (queue_item->file_id > 0 && queue_item->file_id != DB_MEDIA_FILE_NON_PERSISTENT_ID)
-    json_object_object_add(item, "track_id", json_object_new_int(queue_item->file_id));
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    json_object_array_add(buckets, json_object_new_int64(h->count[i]));
 
-  safe_json_add_string(item, "title", queue_item->title);
-  safe_json_add_string(item, "artist", queue_item->artist);
-  safe_json_add_string(item, "artist_sort", queue_item->artist_sort);
-  safe_json_add_string(item, "album", queue_item->album);
-  safe_json_add_string(item, "album_sort", queue_item->album_sort);
-  safe_json_add_string_from_int64(item, "album_id", queue_item->songalbumid);
-  safe_json_add_string(item, "album_artist", queue_item->album_artist);
-  safe_json_add_string(item, "album_artist_sort", queue_item->album_artist_sort);
-  safe_json_add_string_from_int64(item, "album_artist_id", queue_item->songartistid);
-  safe_json_add_string(item, "composer", queue_item->composer);
-  safe_json_add_string(item, "genre", queue_item->genre);
+  json_object_object_add(reply, "max", json_object_new_int64(h->max));
+  json_object_object_add(reply, "buckets", buckets);
 
-  json_object_object_add(item, "year", json_object_new_int(queue_item->year));
-  json_object_object_add(item, "track_number", json_object_new_int(queue_item->track));
-  json_object_object_add(item, "disc_number", json_object_new_int(queue_item->disc));
-  json_object_object_add(item, "length_ms", json_object_new_int(queue_item->song_length));
+  return reply;
+}
 
-  safe_json_add_string(item, "media_kind", db_media_kind_label(queue_item->media_kind));
+static int
+jsonapi_reply_player_stats(struct httpd_request *hreq)
+{
+  struct player_stats stats;
+  struct thread_rt_info threads[16];
+  json_object *reply;
+  json_object *outputs;
+  json_object *output;
+  json_object *realtime;
+  json_object *jthreads;
+  json_object *jthread;
+  bool memory_locked;
+  int nthreads;
+  int ret;
+  int i;
+
+  ret = player_stats_get(&stats);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "tick_late_ms", histogram_to_json(&stats.tick_late_ms));
+  json_object_object_add(reply, "read_behind_ms", histogram_to_json(&stats.read_behind_ms));
+  json_object_object_add(reply, "input_fill_ms", histogram_to_json(&stats.input_fill_ms));
+
+  outputs = json_object_new_array();
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      output = json_object_new_object();
+      safe_json_add_string(output, "name", stats.output[i].name);
+      json_object_object_add(output, "write_us", histogram_to_json(&stats.output[i].write_us));
+      json_object_array_add(outputs, output);
+    }
+  json_object_object_add(reply, "outputs", outputs);
+
+  nthreads = thread_realtime_list(threads, ARRAY_SIZE(threads), &memory_locked);
+
+  realtime = json_object_new_object();
+  json_object_object_add(realtime, "memory_locked", json_object_new_boolean(memory_locked));
+  jthreads = json_object_new_array();
+  for (i = 0; i < nthreads; i++)
+    {
+      jthread = json_object_new_object();
+      safe_json_add_string(jthread, "name", threads[i].name);
+      safe_json_add_string(jthread, "policy", threads[i].policy);
+      json_object_object_add(jthread, "priority", json_object_new_int(threads[i].priority));
+      safe_json_add_string(jthread, "cpus", threads[i].cpus);
+      json_object_array_add(jthreads, jthread);
+    }
+  json_object_object_add(realtime, "threads", jthreads);
+  json_object_object_add(reply, "realtime", realtime);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static json_object *
+http_methods_to_json(enum httpd_methods method)
+{
+  json_object *reply;
+
+  reply = json_object_new_array();
+
+  if (method & HTTPD_METHOD_GET)
+    json_object_array_add(reply, json_object_new_string("GET"));
+  if (method & HTTPD_METHOD_POST)
+    json_object_array_add(reply, json_object_new_string("POST"));
+  if (method & HTTPD_METHOD_HEAD)
+    json_object_array_add(reply, json_object_new_string("HEAD"));
+  if (method & HTTPD_METHOD_PUT)
+    json_object_array_add(reply, json_object_new_string("PUT"));
+  if (method & HTTPD_METHOD_DELETE)
+    json_object_array_add(reply, json_object_new_string("DELETE"));
+  if (method & HTTPD_METHOD_OPTIONS)
+    json_object_array_add(reply, json_object_new_string("OPTIONS"));
+  if (method & HTTPD_METHOD_PATCH)
+    json_object_array_add(reply, json_object_new_string("PATCH"));
+
+  return reply;
+}
+
+static int
+jsonapi_reply_httpd_stats(struct httpd_request *hreq)
+{
+  struct httpd_route_stats *stats;
+  json_object *reply;
+  json_object *items;
+  json_object *item;
+  int nstats;
+  int i;
+
+  nstats = httpd_route_stats_get(&stats);
+
+  CHECK_NULL(L_WEB, reply = json_object_new_object());
+  CHECK_NULL(L_WEB, items = json_object_new_array());
+  json_object_object_add(reply, "items", items);
+
+  for (i = 0; i < nstats; i++)
+    {
+      if (stats[i].requests == 0)
+	continue;
+
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      json_object_object_add(item, "module", json_object_new_string(stats[i].module));
+      json_object_object_add(item, "path", json_object_new_string(stats[i].regexp));
+      json_object_object_add(item, "methods", http_methods_to_json(stats[i].method));
+      json_object_object_add(item, "count", json_object_new_int64(stats[i].requests));
+      json_object_object_add(item, "error_count", json_object_new_int64(stats[i].errors));
+      json_object_object_add(item, "bytes_sent", json_object_new_int64(stats[i].bytes_sent));
+      json_object_object_add(item, "total_usec", json_object_new_int64(stats[i].handler_total_us));
+      json_object_object_add(item, "queue_us", histogram_to_json(&stats[i].queue_us));
+      json_object_object_add(item, "handler_us", histogram_to_json(&stats[i].handler_us));
+      json_object_array_add(items, item);
+    }
+
+  free(stats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_memory_stats(struct httpd_request *hreq)
+{
+  struct mem_tag_stats stats[MEM_TAG_MAX];
+  json_object *reply;
+  json_object *items;
+  json_object *item;
+  int nstats;
+  int i;
+
+  nstats = mem_tag_stats_get(stats, ARRAY_SIZE(stats));
+
+  CHECK_NULL(L_WEB, reply = json_object_new_object());
+  CHECK_NULL(L_WEB, items = json_object_new_array());
+  json_object_object_add(reply, "enabled", json_object_new_boolean(nstats > 0));
+  json_object_object_add(reply, "items", items);
+
+  for (i = 0; i < nstats; i++)
+    {
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      json_object_object_add(item, "tag", json_object_new_string(stats[i].name));
+      json_object_object_add(item, "current_bytes", json_object_new_int64(stats[i].current_bytes));
+      json_object_object_add(item, "peak_bytes", json_object_new_int64(stats[i].peak_bytes));
+      json_object_object_add(item, "allocations", json_object_new_int64(stats[i].allocations));
+      json_object_array_add(items, item);
+    }
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply)));
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_trace_get(struct httpd_request *hreq)
+{
+  int ret;
+
+  ret = trace_dump(hreq->out_body);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_trace_put(struct httpd_request *hreq)
+{
+  const char *param;
+
+  param = httpd_query_value_find(hreq->query, "state");
+  if (!param)
+    return HTTP_BADREQUEST;
+
+  trace_enable(strcmp(param, "true") == 0);
+
+  return HTTP_NOCONTENT;
+}
+
+static json_object *
+queue_item_to_json(struct db_queue_item *queue_item, char shuffle)
+{
+  json_object *item;
+  char uri[100];
+  char artwork_url[100];
+  int ret;
+
+  item = json_object_new_object();
+
+  json_object_object_add(item, "id", json_object_new_int(queue_item->id));
+  if (shuffle)
+    json_object_object_add(item, "position", json_object_new_int(queue_item->shuffle_pos));
+  else
+    json_object_object_add(item, "position", json_object_new_int(queue_item->pos));
+
+  if (queue_item->file_id > 0 && queue_item->file_id != DB_MEDIA_FILE_NON_PERSISTENT_ID)
+    json_object_object_add(item, "track_id", json_object_new_int(queue_item->file_id));
+
+  safe_json_add_string(item, "title", queue_item->title);
+  safe_json_add_string(item, "artist", queue_item->artist);
+  safe_json_add_string(item, "artist_sort", queue_item->artist_sort);
+  safe_json_add_string(item, "album", queue_item->album);
+  safe_json_add_string(item, "album_sort", queue_item->album_sort);
+  safe_json_add_string_from_int64(item, "album_id", queue_item->songalbumid);
+  safe_json_add_string(item, "album_artist", queue_item->album_artist);
+  safe_json_add_string(item, "album_artist_sort", queue_item->album_artist_sort);
+  safe_json_add_string_from_int64(item, "album_artist_id", queue_item->songartistid);
+  safe_json_add_string(item, "composer", queue_item->composer);
+  safe_json_add_string(item, "genre", queue_item->genre);
+
+  json_object_object_add(item, "year", json_object_new_int(queue_item->year));
+  json_object_object_add(item, "track_number", json_object_new_int(queue_item->track));
+  json_object_object_add(item, "disc_number", json_object_new_int(queue_item->disc));
+  json_object_object_add(item, "length_ms", json_object_new_int(queue_item->song_length));
+
+  safe_json_add_string(item, "media_kind", db_media_kind_label(queue_item->media_kind));
   safe_json_add_string(item, "data_kind", db_data_kind_label(queue_item->data_kind));
 
   safe_json_add_string(item, "path", queue_item->path);
@@ -2668,12 +3322,21 @@ jsonapi_reply_queue(struct httpd_request *hreq)
   uint32_t count;
   int start_pos, end_pos;
   int version = 0;
+  int order_version = 0;
+  int since_version;
+  uint32_t *removed = NULL;
+  int nremoved = 0;
+  uint32_t *order = NULL;
+  int norder = 0;
+  bool is_delta = false;
   char etag[21];
   struct player_status status;
   struct db_queue_item queue_item;
   json_object *reply;
   json_object *items;
   json_object *item;
+  json_object *ids;
+  int i;
   int ret = 0;
 
   db_admin_getint(&version, DB_ADMIN_QUEUE_VERSION);
@@ -2696,8 +3359,43 @@ jsonapi_reply_queue(struct httpd_request *hreq)
   if (status.shuffle)
     query_params.sort = S_SHUFFLE_POS;
 
+  // With since_version the client only gets the changes since the version it
+  // has, unless the removals since then are no longer known
+  param = httpd_query_value_find(hreq->query, "since_version");
+  if (param && safe_atoi32(param, &since_version) == 0 && since_version <= version)
+    is_delta = (db_queue_removed_get(&removed, &nremoved, since_version) == 0);
+
   param = httpd_query_value_find(hreq->query, "id");
-  if (param && strcmp(param, "now_playing") == 0)
+  if (is_delta)
+    {
+      json_object_object_add(reply, "since_version", json_object_new_int(since_version));
+
+      ids = json_object_new_array();
+      json_object_object_add(reply, "removed", ids);
+      for (i = 0; i < nremoved; i++)
+	json_object_array_add(ids, json_object_new_int(removed[i]));
+
+      // Items can change position without getting a new version, e.g. when an
+      // item before them is removed, so then the client gets the new order
+      db_admin_getint(&order_version, DB_ADMIN_QUEUE_ORDER_VERSION);
+      if (order_version > since_version)
+	{
+	  norder = db_queue_ids_get(&order, status.shuffle);
+	  if (norder < 0)
+	    {
+	      ret = -1;
+	      goto db_start_error;
+	    }
+
+	  ids = json_object_new_array();
+	  json_object_object_add(reply, "order", ids);
+	  for (i = 0; i < norder; i++)
+	    json_object_array_add(ids, json_object_new_int(order[i]));
+	}
+
+      query_params.filter = db_mprintf("queue_version > %d", since_version);
+    }
+  else if (param && strcmp(param, "now_playing") == 0)
     {
       query_params.filter = db_mprintf("id = %d", status.item_id);
     }
@@ -2729,7 +3427,7 @@ jsonapi_reply_queue(struct httpd_request *hreq)
 
   while ((ret = db_queue_enum_fetch(&query_params, &queue_item)) == 0 && queue_item.id > 0)
     {
-      item = queue_item_to_json(&queue_item, status.shuffle);
+      item = json_fields_select(queue_item_to_json(&queue_item, status.shuffle), httpd_query_value_find(hreq->query, "fields"));
       if (!item)
 	goto error;
 
@@ -2745,6 +3443,8 @@ jsonapi_reply_queue(struct httpd_request *hreq)
  db_start_error:
   jparse_free(reply);
   free(query_params.filter);
+  free(removed);
+  free(order);
 
   if (ret < 0)
     return HTTP_INTERNAL;
@@ -2932,7 +3632,8 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   const char *param;
   enum media_kind media_kind;
   json_object *reply;
-  json_object *items;
+  struct json_list items;
+  int64_t cursor_id;
   int total;
   int ret = 0;
 
@@ -2952,8 +3653,6 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
     }
 
   reply = json_object_new_object();
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
 
   memset(&query_params, 0, sizeof(struct query_params));
 
@@ -2961,21 +3660,33 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = json_list_stream_start(&items, hreq->out_body);
+  items.fields = httpd_query_value_find(hreq->query, "fields");
+  if (ret < 0)
+    goto error;
+
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
 
   if (media_kind)
     query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
 
-  ret = fetch_artists(&query_params, items, &total);
+  cursor_id = query_params.keyset_id;
+
+  ret = fetch_artists(&query_params, &items, &total);
   if (ret < 0)
     goto error;
 
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  query_params_cursor_add(reply, &query_params, cursor_id);
 
-  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  ret = json_list_stream_end(&items, reply);
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add artists to response buffer.\n");
 
@@ -3028,7 +3739,7 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   struct query_params query_params;
   const char *artist_id;
   json_object *reply;
-  json_object *items;
+  struct json_list items;
   int total;
   int ret = 0;
 
@@ -3038,8 +3749,6 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   artist_id = hreq->path_parts[3];
 
   reply = json_object_new_object();
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
 
   memset(&query_params, 0, sizeof(struct query_params));
 
@@ -3047,11 +3756,16 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = json_list_stream_start(&items, hreq->out_body);
+  items.fields = httpd_query_value_find(hreq->query, "fields");
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
   query_params.filter = db_mprintf("(f.songartistid = %q)", artist_id);
 
-  ret = fetch_albums(&query_params, items, &total);
+  ret = fetch_albums(&query_params, &items, &total);
   free(query_params.filter);
 
   if (ret < 0)
@@ -3061,7 +3775,7 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
 
-  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  ret = json_list_stream_end(&items, reply);
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add albums to response buffer.\n");
 
@@ -3081,7 +3795,8 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   const char *param;
   enum media_kind media_kind;
   json_object *reply;
-  json_object *items;
+  struct json_list items;
+  int64_t cursor_id;
   int total;
   int ret = 0;
 
@@ -3101,8 +3816,6 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
     }
 
   reply = json_object_new_object();
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
 
   memset(&query_params, 0, sizeof(struct query_params));
 
@@ -3110,21 +3823,33 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = json_list_stream_start(&items, hreq->out_body);
+  items.fields = httpd_query_value_find(hreq->query, "fields");
+  if (ret < 0)
+    goto error;
+
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
 
   if (media_kind)
     query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
 
-  ret = fetch_albums(&query_params, items, &total);
+  cursor_id = query_params.keyset_id;
+
+  ret = fetch_albums(&query_params, &items, &total);
   if (ret < 0)
     goto error;
 
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  query_params_cursor_add(reply, &query_params, cursor_id);
 
-  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  ret = json_list_stream_end(&items, reply);
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add albums to response buffer.\n");
 
@@ -3177,7 +3902,7 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   struct query_params query_params;
   const char *album_id;
   json_object *reply;
-  json_object *items;
+  struct json_list items;
   int total;
   int ret = 0;
 
@@ -3187,8 +3912,6 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   album_id = hreq->path_parts[3];
 
   reply = json_object_new_object();
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
 
   memset(&query_params, 0, sizeof(struct query_params));
 
@@ -3196,11 +3919,16 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = json_list_stream_start(&items, hreq->out_body);
+  items.fields = httpd_query_value_find(hreq->query, "fields");
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_ITEMS;
   query_params.sort = S_ALBUM;
   query_params.filter = db_mprintf("(f.songalbumid = %q)", album_id);
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, &items, &total);
   free(query_params.filter);
 
   if (ret < 0)
@@ -3210,7 +3938,7 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
 
-  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  ret = json_list_stream_end(&items, reply);
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add tracks to response buffer.\n");
 
@@ -3290,7 +4018,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
       goto error;
     }
 
-  reply = track_to_json(&dbmfi);
+  reply = track_to_json(&dbmfi, NULL);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3647,7 +4375,7 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
 {
   struct query_params query_params;
   json_object *reply;
-  json_object *items;
+  struct json_list items;
   int playlist_id;
   int total;
   int ret = 0;
@@ -3664,8 +4392,6 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
     }
 
   reply = json_object_new_object();
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
 
   memset(&query_params, 0, sizeof(struct query_params));
 
@@ -3673,10 +4399,15 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
+  ret = json_list_stream_start(&items, hreq->out_body);
+  items.fields = httpd_query_value_find(hreq->query, "fields");
+  if (ret < 0)
+    goto error;
+
   query_params.type = Q_PLITEMS;
   query_params.id = playlist_id;
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, &items, &total);
   if (ret < 0)
     goto error;
 
@@ -3684,7 +4415,7 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
 
-  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  ret = json_list_stream_end(&items, reply);
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "playlist tracks: Couldn't add tracks to response buffer.\n");
 
@@ -3863,12 +4594,16 @@ jsonapi_reply_library_browse(struct httpd_request *hreq)
   enum media_kind media_kind;
   json_object *reply;
   json_object *items;
+  char etag[100];
   int total;
   int ret;
 
-  if (!is_modified(hreq, DB_ADMIN_DB_UPDATE))
+  if (!aggregate_is_modified(hreq, etag, sizeof(etag)))
     return HTTP_NOTMODIFIED;
 
+  if (aggregate_cache_get(hreq, etag))
+    return HTTP_OK;
+
   browse_type = hreq->path_parts[2];
   DPRINTF(E_DBG, L_WEB, "Browse query with type '%s'\n", browse_type);
 
@@ -3926,6 +4661,8 @@ jsonapi_reply_library_browse(struct httpd_request *hreq)
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add browse items to response buffer.\n");
+  else
+    aggregate_cache_add(hreq, etag, json_object_to_json_string(reply));
 
  error:
   jparse_free(reply);
@@ -4020,11 +4757,15 @@ jsonapi_reply_library_count(struct httpd_request *hreq)
   struct query_params qp;
   struct filecount_info fci;
   json_object *jreply;
+  char etag[100];
   int ret;
 
-  if (!is_modified(hreq, DB_ADMIN_DB_UPDATE))
+  if (!aggregate_is_modified(hreq, etag, sizeof(etag)))
     return HTTP_NOTMODIFIED;
 
+  if (aggregate_cache_get(hreq, etag))
+    return HTTP_OK;
+
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_COUNT_ITEMS;
 
@@ -4053,6 +4794,8 @@ jsonapi_reply_library_count(struct httpd_request *hreq)
       json_object_object_add(jreply, "albums", json_object_new_int(fci.album_count));
       json_object_object_add(jreply, "db_playtime", json_object_new_int64((fci.length / 1000)));
       json_object_object_add(jreply, "file_size", json_object_new_int64((fci.file_size)));
+
+      aggregate_cache_add(hreq, etag, json_object_to_json_string(jreply));
     }
   else
     {
@@ -4067,6 +4810,155 @@ jsonapi_reply_library_count(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static int
+jsonapi_reply_library_query_stats(struct httpd_request *hreq)
+{
+  struct db_query_stats *stats;
+  json_object *jreply;
+  json_object *items;
+  json_object *item;
+  int nstats;
+  int i;
+
+  nstats = db_query_stats_get(&stats);
+  if (nstats < 0)
+    return HTTP_INTERNAL;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+  CHECK_NULL(L_WEB, items = json_object_new_array());
+  json_object_object_add(jreply, "items", items);
+  json_object_object_add(jreply, "slow_query_threshold", json_object_new_int(cfg_getint(cfg_getsec(cfg, "sqlite"), "slow_query_threshold")));
+
+  for (i = 0; i < nstats; i++)
+    {
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      json_object_object_add(item, "type", json_object_new_string(stats[i].name));
+      json_object_object_add(item, "count", json_object_new_int64(stats[i].count));
+      json_object_object_add(item, "slow_count", json_object_new_int64(stats[i].slow_count));
+      json_object_object_add(item, "total_usec", json_object_new_int64(stats[i].total_usec));
+      json_object_object_add(item, "max_usec", json_object_new_int64(stats[i].max_usec));
+      json_object_array_add(items, item);
+    }
+
+  free(stats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_library_cache_stats(struct httpd_request *hreq)
+{
+  struct cache_stats stats;
+  json_object *jreply;
+  json_object *items;
+  json_object *item;
+  uint64_t lookups;
+  int i;
+  int ret;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+  CHECK_NULL(L_WEB, items = json_object_new_array());
+  json_object_object_add(jreply, "items", items);
+
+  for (i = 0; i < CACHE_TYPE_MAX; i++)
+    {
+      ret = cache_stats_get(&stats, i);
+      if (ret < 0)
+	continue;
+
+      lookups = stats.hits + stats.misses;
+
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      safe_json_add_string(item, "type", cache_type_name(i));
+      json_object_object_add(item, "hits", json_object_new_int64(stats.hits));
+      json_object_object_add(item, "misses", json_object_new_int64(stats.misses));
+      json_object_object_add(item, "insertions", json_object_new_int64(stats.insertions));
+      json_object_object_add(item, "evictions", json_object_new_int64(stats.evictions));
+      json_object_object_add(item, "entries", json_object_new_int64(stats.entries));
+      json_object_object_add(item, "bytes", json_object_new_int64(stats.bytes));
+      json_object_object_add(item, "avg_lookup_usec", json_object_new_int64(lookups ? stats.lookup_usec / lookups : 0));
+      json_object_object_add(item, "max_lookup_usec", json_object_new_int64(stats.lookup_max_usec));
+      if (i == CACHE_TYPE_DAAP)
+	{
+	  json_object_object_add(item, "memory_entries", json_object_new_int64(stats.mem_entries));
+	  json_object_object_add(item, "memory_bytes", json_object_new_int64(stats.mem_bytes));
+	}
+      json_object_array_add(items, item);
+    }
+
+  json_object_object_add(jreply, "daap_threshold", json_object_new_int(cache_daap_threshold_get()));
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_library_scan(struct httpd_request *hreq)
+{
+  static const char *phase_names[LIBRARY_SCAN_PHASE_MAX] = { "walk", "stat", "metadata", "save", "playlists", "purge" };
+  struct library_scan_stats stats;
+  json_object *jreply;
+  json_object *phases;
+  json_object *slowest;
+  json_object *item;
+  time_t end;
+  double elapsed;
+  char buf[32];
+  int i;
+
+  library_scan_stats_get(&stats);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  json_object_object_add(jreply, "updating", json_object_new_boolean(stats.scanning));
+
+  if (stats.start)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)stats.start);
+      safe_json_add_time_from_string(jreply, "started_at", buf);
+    }
+  if (stats.end && !stats.scanning)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)stats.end);
+      safe_json_add_time_from_string(jreply, "finished_at", buf);
+    }
+
+  end = stats.scanning ? time(NULL) : stats.end;
+  elapsed = stats.start ? difftime(end, stats.start) : 0;
+
+  json_object_object_add(jreply, "elapsed_sec", json_object_new_int64((int64_t)elapsed));
+  json_object_object_add(jreply, "directories", json_object_new_int64(stats.dirs));
+  json_object_object_add(jreply, "files", json_object_new_int64(stats.files));
+  json_object_object_add(jreply, "files_scanned", json_object_new_int64(stats.files_scanned));
+  json_object_object_add(jreply, "files_per_sec", json_object_new_double(elapsed > 0 ? stats.files / elapsed : 0));
+  json_object_object_add(jreply, "queue_depth", json_object_new_int(stats.queue_depth));
+
+  CHECK_NULL(L_WEB, phases = json_object_new_object());
+  json_object_object_add(jreply, "phase_usec", phases);
+  for (i = 0; i < LIBRARY_SCAN_PHASE_MAX; i++)
+    json_object_object_add(phases, phase_names[i], json_object_new_int64(stats.phase_usec[i]));
+
+  CHECK_NULL(L_WEB, slowest = json_object_new_array());
+  json_object_object_add(jreply, "slowest", slowest);
+  for (i = 0; i < stats.nslowest; i++)
+    {
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      safe_json_add_string(item, "path", stats.slowest[i].path);
+      json_object_object_add(item, "usec", json_object_new_int64(stats.slowest[i].usec));
+      json_object_array_add(slowest, item);
+    }
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
 static int
 jsonapi_reply_library_files(struct httpd_request *hreq)
 {
@@ -4119,7 +5011,7 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   query_params.sort = S_VPATH;
   query_params.filter = db_mprintf("(f.directory_id = %d)", directory_id);
 
-  ret = fetch_tracks(&query_params, tracks_items, &total);
+  ret = fetch_tracks(&query_params, &(struct json_list){ .array = tracks_items, .fields = httpd_query_value_find(hreq->query, "fields") }, &total);
   free(query_params.filter);
 
   if (ret < 0)
@@ -4194,6 +5086,7 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  int64_t cursor_id;
   int total;
   int ret;
 
@@ -4213,10 +5106,15 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
+      ret = query_params_cursor_set(&query_params, hreq);
+      if (ret < 0)
+	goto out;
+
+      query_params.search = strdup(param_query);
+      query_params.search_field = "title";
+
       if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
     }
   else
     {
@@ -4231,13 +5129,16 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 	}
     }
 
-  ret = fetch_tracks(&query_params, items, &total);
+  cursor_id = query_params.keyset_id;
+
+  ret = fetch_tracks(&query_params, &(struct json_list){ .array = items, .fields = httpd_query_value_find(hreq->query, "fields") }, &total);
   if (ret < 0)
     goto out;
 
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  query_params_cursor_add(type, &query_params, cursor_id);
 
  out:
   free_query_params(&query_params, 1);
@@ -4245,6 +5146,70 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
   return ret;
 }
 
+// Default number of results for typeahead searches
+#define JSONAPI_TYPEAHEAD_LIMIT 10
+
+/*
+ * With typeahead=true artists and albums are found with the prefix index of
+ * typeahead.c instead of a search of the library, which is much faster, but
+ * only matches the start of names. Only the first page can be requested, and
+ * the media_kind filter isn't supported, so a search with it is a normal one.
+ */
+static bool
+typeahead_requested(struct httpd_request *hreq, const char *param_query, enum media_kind media_kind)
+{
+  const char *param;
+
+  param = httpd_query_value_find(hreq->query, "typeahead");
+
+  return (param && strcmp(param, "true") == 0 && param_query && !media_kind);
+}
+
+// Sets a filter for the groups with the given column found by typeahead_search()
+static int
+typeahead_filter_set(struct query_params *query_params, int *total, enum typeahead_kind kind, const char *column, const char *param_query)
+{
+  int64_t *ids;
+  char *filter;
+  char *tmp;
+  int nids;
+  int i;
+
+  if (query_params->limit <= 0)
+    query_params->limit = JSONAPI_TYPEAHEAD_LIMIT;
+
+  query_params->idx_type = I_SUB;
+  query_params->offset = 0;
+
+  nids = typeahead_search(&ids, total, kind, param_query, query_params->limit);
+  if (nids < 0)
+    return -1;
+
+  // Matches nothing
+  filter = safe_strdup("0");
+  for (i = 0; i < nids; i++)
+    {
+      tmp = filter;
+      if (i == 0)
+	filter = safe_asprintf("%s IN (%" PRIi64, column, ids[i]);
+      else
+	filter = safe_asprintf("%s, %" PRIi64, tmp, ids[i]);
+      free(tmp);
+    }
+
+  if (nids > 0)
+    {
+      tmp = filter;
+      filter = safe_asprintf("%s)", tmp);
+      free(tmp);
+    }
+
+  free(ids);
+
+  query_params->filter = filter;
+  return 0;
+}
+
 static int
 search_artists(json_object *reply, struct httpd_request *hreq, const char *param_query, struct smartpl *smartpl_expression, enum media_kind media_kind)
 {
@@ -4252,6 +5217,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
   json_object *items;
   struct query_params query_params;
   int total;
+  int typeahead_total = -1;
   int ret;
 
   memset(&query_params, 0, sizeof(struct query_params));
@@ -4272,12 +5238,19 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
   if (ret < 0)
     goto out;
 
-  if (param_query)
+  if (typeahead_requested(hreq, param_query, media_kind))
     {
+      ret = typeahead_filter_set(&query_params, &typeahead_total, TYPEAHEAD_ARTIST, "f.songartistid", param_query);
+      if (ret < 0)
+	goto out;
+    }
+  else if (param_query)
+    {
+      query_params.search = strdup(param_query);
+      query_params.search_field = "album_artist";
+
       if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
     }
   else
     {
@@ -4293,10 +5266,13 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 	}
     }
 
-  ret = fetch_artists(&query_params, items, &total);
+  ret = fetch_artists(&query_params, &(struct json_list){ .array = items, .fields = httpd_query_value_find(hreq->query, "fields") }, &total);
   if (ret < 0)
     goto out;
 
+  if (typeahead_total >= 0)
+    total = typeahead_total;
+
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
@@ -4314,6 +5290,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object *items;
   struct query_params query_params;
   int total;
+  int typeahead_total = -1;
   int ret;
 
   memset(&query_params, 0, sizeof(struct query_params));
@@ -4334,12 +5311,19 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
   if (ret < 0)
     goto out;
 
-  if (param_query)
+  if (typeahead_requested(hreq, param_query, media_kind))
+    {
+      ret = typeahead_filter_set(&query_params, &typeahead_total, TYPEAHEAD_ALBUM, "f.songalbumid", param_query);
+      if (ret < 0)
+	goto out;
+    }
+  else if (param_query)
     {
+      query_params.search = strdup(param_query);
+      query_params.search_field = "album";
+
       if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
     }
   else
     {
@@ -4355,10 +5339,13 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 	}
     }
 
-  ret = fetch_albums(&query_params, items, &total);
+  ret = fetch_albums(&query_params, &(struct json_list){ .array = items, .fields = httpd_query_value_find(hreq->query, "fields") }, &total);
   if (ret < 0)
     goto out;
 
+  if (typeahead_total >= 0)
+    total = typeahead_total;
+
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
@@ -4398,10 +5385,11 @@ search_composers(json_object *reply, struct httpd_request *hreq, const char *par
 
   if (param_query)
     {
+      query_params.search = strdup(param_query);
+      query_params.search_field = "composer";
+
       if (media_kind)
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
     }
   else
     {
@@ -4460,10 +5448,11 @@ search_genres(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
+      query_params.search = strdup(param_query);
+      query_params.search_field = "genre";
+
       if (media_kind)
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
     }
   else
     {
@@ -4643,19 +5632,392 @@ jsonapi_reply_search(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+// Pause between the steps of a backup, so that it doesn't hold up other users
+// of the database
+#define JSONAPI_BACKUP_STEP_INTERVAL_MS 20
+
+// Only used from the worker thread that runs the backup
+static struct event *backup_step_ev;
+
+// Thread: worker
+static void
+backup_step_cb(int fd, short what, void *arg)
+{
+  struct timeval tv = { 0, JSONAPI_BACKUP_STEP_INTERVAL_MS * 1000 };
+
+  if (db_backup_step() > 0)
+    {
+      evtimer_add(backup_step_ev, &tv);
+      return;
+    }
+
+  event_free(backup_step_ev);
+  backup_step_ev = NULL;
+}
+
+// Thread: worker
+static void
+backup_start(void *arg)
+{
+  struct timeval tv = { 0, JSONAPI_BACKUP_STEP_INTERVAL_MS * 1000 };
+  int ret;
+
+  ret = db_backup_start();
+  if (ret < 0)
+    return;
+
+  // The steps must be made from this thread, so use its event base
+  CHECK_NULL(L_WEB, backup_step_ev = evtimer_new(worker_evbase_get(), backup_step_cb, NULL));
+  evtimer_add(backup_step_ev, &tv);
+}
+
 static int
 jsonapi_reply_library_backup(struct httpd_request *hreq)
 {
+  struct db_backup_status status;
+
+  if (!cfg_getstr(cfg_getsec(cfg, "general"), "db_backup_path"))
+    {
+      DPRINTF(E_LOG, L_WEB, "Backup not enabled, 'db_backup_path' is unset\n");
+      return HTTP_SERVUNAVAIL;
+    }
+
+  db_backup_status_get(&status);
+  if (status.running)
+    return HTTP_OK;
+
+  // The backup is made in the background, use GET for the progress
+  worker_execute(backup_start, NULL, 0, 0);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_library_backup_get(struct httpd_request *hreq)
+{
+  struct db_backup_status status;
+  json_object *jreply;
+  char buf[32];
+
+  db_backup_status_get(&status);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  json_object_object_add(jreply, "running", json_object_new_boolean(status.running));
+  json_object_object_add(jreply, "pages_total", json_object_new_int(status.pages_total));
+  json_object_object_add(jreply, "pages_remaining", json_object_new_int(status.pages_remaining));
+
+  if (status.started)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)status.started);
+      safe_json_add_time_from_string(jreply, "started_at", buf);
+    }
+  if (status.finished && !status.running)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)status.finished);
+      safe_json_add_time_from_string(jreply, "finished_at", buf);
+      json_object_object_add(jreply, "error", json_object_new_boolean(status.result < 0));
+    }
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+
+/* ------------------------------- Federation ------------------------------- */
+
+// Default and max number of changes (or files, for a full copy) per page
+#define JSONAPI_CHANGES_LIMIT 1000
+#define JSONAPI_CHANGES_LIMIT_MAX 10000
+
+// Adds a row to "tables": { "<table>": { "columns": [...], "rows": [[...]] } }
+static void
+library_changes_row_add(const char *table, int ncols, const char **cols, const char **values, void *arg)
+{
+  json_object *jtables = arg;
+  json_object *jtable;
+  json_object *jcols;
+  json_object *jrows;
+  json_object *jrow;
+  int i;
+
+  if (!json_object_object_get_ex(jtables, table, &jtable))
+    {
+      CHECK_NULL(L_WEB, jtable = json_object_new_object());
+      json_object_object_add(jtables, table, jtable);
+
+      CHECK_NULL(L_WEB, jcols = json_object_new_array());
+      for (i = 0; i < ncols; i++)
+	json_object_array_add(jcols, json_object_new_string(cols[i]));
+      json_object_object_add(jtable, "columns", jcols);
+
+      CHECK_NULL(L_WEB, jrows = json_object_new_array());
+      json_object_object_add(jtable, "rows", jrows);
+    }
+  else
+    json_object_object_get_ex(jtable, "rows", &jrows);
+
+  CHECK_NULL(L_WEB, jrow = json_object_new_array());
+  for (i = 0; i < ncols; i++)
+    json_object_array_add(jrow, values[i] ? json_object_new_string(values[i]) : NULL);
+  json_object_array_add(jrows, jrow);
+}
+
+static json_object *
+library_changes_deleted_get(enum db_change_item_type type, int64_t since)
+{
+  json_object *jdeleted;
+  uint32_t *ids;
+  int n;
+  int i;
+
+  CHECK_NULL(L_WEB, jdeleted = json_object_new_array());
+
+  n = db_changes_deleted_get(&ids, type, since);
+  for (i = 0; i < n; i++)
+    json_object_array_add(jdeleted, json_object_new_int64(ids[i]));
+
+  free(ids);
+  return jdeleted;
+}
+
+/*
+ * Changes of the library for replica instances (see library/federation.c).
+ *
+ * GET /api/library/changes?since=<revision>&after=<file id>&limit=<count>
+ *
+ * If the changes since the revision are no longer available (or since is 0),
+ * the reply is a page of a full copy ("reset": true) with the files after the
+ * given id. Otherwise it has the files and playlists changed in the next
+ * <limit> revisions, and the ids of deleted items. The replica continues until
+ * "done" is true.
+ */
+static int
+jsonapi_reply_library_changes(struct httpd_request *hreq)
+{
+  json_object *jreply;
+  json_object *jtables;
+  const char *param;
+  int64_t since = 0;
+  int64_t oldest;
+  int64_t latest;
+  int64_t until;
+  uint32_t after = 0;
+  uint32_t last_id;
+  int32_t limit = JSONAPI_CHANGES_LIMIT;
+  bool reset;
+  bool done;
   int ret;
-  ret = db_backup();
+
+  if ((param = httpd_query_value_find(hreq->query, "since")) && safe_atoi64(param, &since) < 0)
+    return HTTP_BADREQUEST;
+  if ((param = httpd_query_value_find(hreq->query, "after")) && safe_atou32(param, &after) < 0)
+    return HTTP_BADREQUEST;
+  if ((param = httpd_query_value_find(hreq->query, "limit")) && (safe_atoi32(param, &limit) < 0 || limit <= 0))
+    return HTTP_BADREQUEST;
+
+  limit = MIN(limit, JSONAPI_CHANGES_LIMIT_MAX);
+
+  if (db_changes_revision_get(&oldest, &latest) < 0)
+    return HTTP_INTERNAL;
+
+  // since > latest if the replica was following a library that was recreated
+  reset = (since <= 0 || since < oldest || since > latest);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+  CHECK_NULL(L_WEB, jtables = json_object_new_object());
+
+  if (reset)
+    {
+      ret = db_replica_snapshot_get(library_changes_row_add, jtables, &last_id, &done, after, limit);
+
+      json_object_object_add(jreply, "after", json_object_new_int64(last_id));
+      json_object_object_add(jreply, "revision", json_object_new_int64(latest));
+    }
+  else
+    {
+      until = MIN(latest, since + limit);
+      ret = db_replica_delta_get(library_changes_row_add, jtables, since, until);
+      done = (until == latest);
+
+      json_object_object_add(jreply, "deleted_files", library_changes_deleted_get(DB_CHANGE_FILE, since));
+      json_object_object_add(jreply, "deleted_playlists", library_changes_deleted_get(DB_CHANGE_PLAYLIST, since));
+      json_object_object_add(jreply, "revision", json_object_new_int64(until));
+    }
 
   if (ret < 0)
-  {
-    if (ret == -2)
-      return HTTP_SERVUNAVAIL;  // not enabled by config
+    {
+      json_object_put(jtables);
+      jparse_free(jreply);
+      return HTTP_INTERNAL;
+    }
+
+  json_object_object_add(jreply, "reset", json_object_new_boolean(reset));
+  json_object_object_add(jreply, "done", json_object_new_boolean(done));
+  json_object_object_add(jreply, "tables", jtables);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+
+/* --------------------------------- Batch ---------------------------------- */
+
+// Max number of sub-requests in a request to /api/batch
+#define JSONAPI_BATCH_MAX 50
+
+static int jsonapi_reply_batch(struct httpd_request *hreq);
+
+static enum httpd_methods
+batch_method_get(const char *method)
+{
+  if (!method || strcasecmp(method, "GET") == 0)
+    return HTTPD_METHOD_GET;
+  else if (strcasecmp(method, "POST") == 0)
+    return HTTPD_METHOD_POST;
+  else if (strcasecmp(method, "PUT") == 0)
+    return HTTPD_METHOD_PUT;
+  else if (strcasecmp(method, "DELETE") == 0)
+    return HTTPD_METHOD_DELETE;
+
+  return 0;
+}
+
+// Runs one sub-request of a batch directly with the handler the http request
+// would have been dispatched to, and returns its status code and reply body
+static json_object *
+batch_item_run(struct httpd_request *hreq, json_object *item)
+{
+  struct httpd_request *subreq = NULL;
+  json_object *result;
+  json_object *body;
+  const char *uri;
+  enum httpd_methods method;
+  int status_code;
+
+  result = json_object_new_object();
+
+  uri = jparse_str_from_obj(item, "uri");
+  method = batch_method_get(jparse_str_from_obj(item, "method"));
+  if (!uri || strncmp(uri, "/api/", strlen("/api/")) != 0 || method == 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid sub-request in batch: '%s'\n", json_object_to_json_string(item));
+      status_code = HTTP_BADREQUEST;
+      goto out;
+    }
+
+  subreq = httpd_request_new(NULL, NULL, uri, hreq->user_agent);
+  if (!subreq)
+    {
+      status_code = HTTP_BADREQUEST;
+      goto out;
+    }
+
+  subreq->method = method;
+  subreq->peer_address = hreq->peer_address;
+  subreq->peer_port = hreq->peer_port;
+  subreq->evbase = hreq->evbase;
+
+  httpd_request_handler_set(subreq);
+  if (!subreq->handler || !subreq->module || subreq->module->type != MODULE_JSONAPI || subreq->handler == jsonapi_reply_batch)
+    {
+      DPRINTF(E_LOG, L_WEB, "Unrecognized JSON API request in batch: '%s'\n", uri);
+      status_code = HTTP_BADREQUEST;
+      goto out;
+    }
+
+  // The handlers may look for e.g. If-None-Match, so they must have headers,
+  // but we don't pass on the ones of the batch request
+  subreq->in_headers = httpd_headers_new();
+  subreq->out_headers = httpd_headers_new();
+
+  if (json_object_object_get_ex(item, "body", &body))
+    {
+      CHECK_NULL(L_WEB, subreq->in_body = evbuffer_new());
+      CHECK_ERRNO(L_WEB, evbuffer_add_printf(subreq->in_body, "%s", json_object_to_json_string(body)));
+    }
+
+  status_code = subreq->handler(subreq);
+
+  if (status_code >= 400)
+    DPRINTF(E_LOG, L_WEB, "JSON api request in batch failed with error code %d (%s)\n", status_code, uri);
+
+  if (status_code == HTTP_OK && evbuffer_get_length(subreq->out_body) > 0)
+    json_object_object_add(result, "body", jparse_obj_from_evbuffer(subreq->out_body));
+
+ out:
+  json_object_object_add(result, "status", json_object_new_int(status_code));
+
+  if (subreq)
+    {
+      if (subreq->in_body)
+	evbuffer_free(subreq->in_body);
+      httpd_headers_free(subreq->in_headers);
+      httpd_headers_free(subreq->out_headers);
+      httpd_request_free(subreq);
+    }
+
+  return result;
+}
 
+/*
+ * Executes a list of API requests and returns a list of their results, so that
+ * e.g. a dashboard can get player, queue and outputs status with one request.
+ *
+ * Example request body:
+ *
+ * [
+ *   { "method": "GET", "uri": "/api/player" },
+ *   { "method": "PUT", "uri": "/api/player/volume?volume=50" },
+ *   { "method": "PUT", "uri": "/api/outputs/123", "body": { "selected": true } }
+ * ]
+ *
+ * The reply has an item with "status" (the HTTP status code) and "body" (the
+ * JSON reply, only for status 200) for each request, in the same order.
+ */
+static int
+jsonapi_reply_batch(struct httpd_request *hreq)
+{
+  json_object *request;
+  json_object *reply;
+  size_t len;
+  size_t i;
+  int ret;
+
+  request = jparse_obj_from_evbuffer(hreq->in_body);
+  if (!request || !json_object_is_type(request, json_type_array))
+    {
+      DPRINTF(E_LOG, L_WEB, "Missing or invalid request body for batch request\n");
+      jparse_free(request);
+      return HTTP_BADREQUEST;
+    }
+
+  len = json_object_array_length(request);
+  if (len > JSONAPI_BATCH_MAX)
+    {
+      DPRINTF(E_LOG, L_WEB, "Batch request with %zu sub-requests exceeds max of %d\n", len, JSONAPI_BATCH_MAX);
+      jparse_free(request);
+      return HTTP_BADREQUEST;
+    }
+
+  reply = json_object_new_array();
+
+  for (i = 0; i < len; i++)
+    json_object_array_add(reply, batch_item_run(hreq, json_object_array_get_idx(request, i)));
+
+  ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
+  if (ret < 0)
+    DPRINTF(E_LOG, L_WEB, "batch: Couldn't add results to response buffer.\n");
+
+  jparse_free(reply);
+  jparse_free(request);
+
+  if (ret < 0)
     return HTTP_INTERNAL;
-  }
 
   return HTTP_OK;
 }
@@ -4664,6 +6026,11 @@ jsonapi_reply_library_backup(struct httpd_request *hreq)
 static struct httpd_uri_map adm_handlers[] =
   {
     { HTTPD_METHOD_GET,    "^/api/config$",                                jsonapi_reply_config },
+    { HTTPD_METHOD_POST,   "^/api/batch$",                                 jsonapi_reply_batch },
+    { HTTPD_METHOD_GET,    "^/api/httpd/stats$",                           jsonapi_reply_httpd_stats },
+    { HTTPD_METHOD_GET,    "^/api/memory/stats$",                          jsonapi_reply_memory_stats },
+    { HTTPD_METHOD_GET,    "^/api/trace$",                                 jsonapi_reply_trace_get, .flags = HTTPD_HANDLER_HEAVY },
+    { HTTPD_METHOD_PUT,    "^/api/trace$",                                 jsonapi_reply_trace_put },
     { HTTPD_METHOD_GET,    "^/api/settings$",                              jsonapi_reply_settings_get },
     { HTTPD_METHOD_GET,    "^/api/settings/[A-Za-z0-9_]+$",                jsonapi_reply_settings_category_get },
     { HTTPD_METHOD_GET,    "^/api/settings/[A-Za-z0-9_]+/[A-Za-z0-9_]+$",  jsonapi_reply_settings_option_get },
@@ -4690,6 +6057,7 @@ static struct httpd_uri_map adm_handlers[] =
     { HTTPD_METHOD_PUT,    "^/api/outputs/[[:digit:]]+/toggle$",           jsonapi_reply_outputs_toggle_byid },
 
     { HTTPD_METHOD_GET,    "^/api/player$",                                jsonapi_reply_player },
+    { HTTPD_METHOD_GET,    "^/api/player/stats$",                          jsonapi_reply_player_stats },
     { HTTPD_METHOD_PUT,    "^/api/player/play$",                           jsonapi_reply_player_play },
     { HTTPD_METHOD_PUT,    "^/api/player/pause$",                          jsonapi_reply_player_pause },
     { HTTPD_METHOD_PUT,    "^/api/player/stop$",                           jsonapi_reply_player_stop },
@@ -4713,30 +6081,35 @@ static struct httpd_uri_map adm_handlers[] =
     { HTTPD_METHOD_GET,    "^/api/library/playlists$",                     jsonapi_reply_library_playlists },
     { HTTPD_METHOD_GET,    "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_get },
     { HTTPD_METHOD_PUT,    "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_put },
-    { HTTPD_METHOD_GET,    "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlist_tracks },
+    { HTTPD_METHOD_GET,    "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlist_tracks, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_PUT,    "^/api/library/playlists/[[:digit:]]+/tracks",  jsonapi_reply_library_playlist_tracks_put_byid},
 //    { HTTPD_METHOD_POST,   "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlists_tracks },
     { HTTPD_METHOD_DELETE, "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_delete },
     { HTTPD_METHOD_GET,    "^/api/library/playlists/[[:digit:]]+/playlists", jsonapi_reply_library_playlist_playlists },
-    { HTTPD_METHOD_GET,    "^/api/library/artists$",                       jsonapi_reply_library_artists },
+    { HTTPD_METHOD_GET,    "^/api/library/artists$",                       jsonapi_reply_library_artists, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_GET,    "^/api/library/artists/[[:digit:]]+$",          jsonapi_reply_library_artist },
-    { HTTPD_METHOD_GET,    "^/api/library/artists/[[:digit:]]+/albums$",   jsonapi_reply_library_artist_albums },
-    { HTTPD_METHOD_GET,    "^/api/library/albums$",                        jsonapi_reply_library_albums },
+    { HTTPD_METHOD_GET,    "^/api/library/artists/[[:digit:]]+/albums$",   jsonapi_reply_library_artist_albums, .flags = HTTPD_HANDLER_HEAVY },
+    { HTTPD_METHOD_GET,    "^/api/library/albums$",                        jsonapi_reply_library_albums, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_GET,    "^/api/library/albums/[[:digit:]]+$",           jsonapi_reply_library_album },
-    { HTTPD_METHOD_GET,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks },
+    { HTTPD_METHOD_GET,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_PUT,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks_put_byid },
     { HTTPD_METHOD_PUT,    "^/api/library/tracks$",                        jsonapi_reply_library_tracks_put },
     { HTTPD_METHOD_GET,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_get_byid },
     { HTTPD_METHOD_PUT,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_put_byid },
     { HTTPD_METHOD_GET,    "^/api/library/tracks/[[:digit:]]+/playlists$", jsonapi_reply_library_track_playlists },
-    { HTTPD_METHOD_GET,    "^/api/library/(genres|composers)$",            jsonapi_reply_library_browse },
-    { HTTPD_METHOD_GET,    "^/api/library/(genres|composers)/.*$",         jsonapi_reply_library_browseitem },
+    { HTTPD_METHOD_GET,    "^/api/library/(genres|composers)$",            jsonapi_reply_library_browse, .flags = HTTPD_HANDLER_HEAVY },
+    { HTTPD_METHOD_GET,    "^/api/library/(genres|composers)/.*$",         jsonapi_reply_library_browseitem, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_GET,    "^/api/library/count$",                         jsonapi_reply_library_count },
-    { HTTPD_METHOD_GET,    "^/api/library/files$",                         jsonapi_reply_library_files },
+    { HTTPD_METHOD_GET,    "^/api/library/query_stats$",                   jsonapi_reply_library_query_stats },
+    { HTTPD_METHOD_GET,    "^/api/library/scan$",                          jsonapi_reply_library_scan },
+    { HTTPD_METHOD_GET,    "^/api/library/cache_stats$",                   jsonapi_reply_library_cache_stats },
+    { HTTPD_METHOD_GET,    "^/api/library/files$",                         jsonapi_reply_library_files, .flags = HTTPD_HANDLER_HEAVY },
     { HTTPD_METHOD_POST,   "^/api/library/add$",                           jsonapi_reply_library_add },
     { HTTPD_METHOD_PUT,    "^/api/library/backup$",                        jsonapi_reply_library_backup },
+    { HTTPD_METHOD_GET,    "^/api/library/backup$",                        jsonapi_reply_library_backup_get },
+    { HTTPD_METHOD_GET,    "^/api/library/changes$",                       jsonapi_reply_library_changes, .flags = HTTPD_HANDLER_HEAVY },
 
-    { HTTPD_METHOD_GET,    "^/api/search$",                                jsonapi_reply_search },
+    { HTTPD_METHOD_GET,    "^/api/search$",                                jsonapi_reply_search, .flags = HTTPD_HANDLER_HEAVY },
 
     { HTTPD_METHOD_GET,    "^/api/listenbrainz$",                          jsonapi_reply_listenbrainz },
     { HTTPD_METHOD_POST,   "^/api/listenbrainz/token$",                    jsonapi_reply_listenbrainz_token_add },
@@ -4752,6 +6125,7 @@ static void
 jsonapi_request(struct httpd_request *hreq)
 {
   int status_code;
+  MEM_TAG_SCOPE(MEM_TAG_JSON);
 
   if (!httpd_request_is_authorized(hreq))
     {
@@ -4806,6 +6180,9 @@ jsonapi_init(void)
 {
   char *temp_path;
 
+  aggregate_epoch = time(NULL);
+  CHECK_ERR(L_WEB, listener_add(aggregate_listener_cb, LISTENER_DATABASE, NULL));
+
   default_playlist_directory = NULL;
   allow_modifying_stored_playlists = cfg_getbool(cfg_getsec(cfg, "library"), "allow_modifying_stored_playlists");
   if (allow_modifying_stored_playlists)
@@ -4835,7 +6212,9 @@ jsonapi_init(void)
 static void
 jsonapi_deinit(void)
 {
+  listener_remove(aggregate_listener_cb);
   free(default_playlist_directory);
+  typeahead_deinit();
 }
 
 struct httpd_module httpd_jsonapi =
@@ -436,6 +436,27 @@ httpd_headers_clear(httpd_headers *headers)
   evhttp_clear_headers(headers);
 }
 
+httpd_headers *
+httpd_headers_new(void)
+{
+  httpd_headers *headers;
+
+  CHECK_NULL(L_HTTPD, headers = malloc(sizeof(httpd_headers)));
+  TAILQ_INIT(headers);
+
+  return headers;
+}
+
+void
+httpd_headers_free(httpd_headers *headers)
+{
+  if (!headers)
+    return;
+
+  evhttp_clear_headers(headers);
+  free(headers);
+}
+
 void
 httpd_request_close_cb_set(struct httpd_request *hreq, httpd_close_cb cb, void *arg)
 {
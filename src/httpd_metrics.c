@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Serves /metrics in the Prometheus text format, so that one scrape gets the
+ * statistics that the subsystems collect anyway (and that the JSON API also
+ * exposes in pieces). Nothing here is collected on the hot paths, the values
+ * are read from the subsystems when the endpoint is requested.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "httpd_internal.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "cache.h"
+#include "library.h"
+#include "player.h"
+#include "outputs.h"
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+// Used for the labels of the per output metrics
+#define METRICS_OUTPUTS_MAX 64
+
+struct metrics_output
+{
+  char labels[512];
+  struct output_stats stats;
+};
+
+struct metrics_outputs
+{
+  struct metrics_output output[METRICS_OUTPUTS_MAX];
+  int n;
+};
+
+
+/* -------------------------------- Helpers --------------------------------- */
+
+// Label values must have backslash, double quote and newline escaped
+static void
+label_value_escape(char *buf, size_t len, const char *value)
+{
+  size_t i = 0;
+
+  for (; value && *value && i + 2 < len; value++)
+    {
+      if (*value == '\\' || *value == '"')
+	{
+	  buf[i++] = '\\';
+	  buf[i++] = *value;
+	}
+      else if (*value == '\n')
+	{
+	  buf[i++] = '\\';
+	  buf[i++] = 'n';
+	}
+      else
+	buf[i++] = *value;
+    }
+
+  buf[i] = '\0';
+}
+
+static void
+family_add(struct evbuffer *evbuf, const char *name, const char *type, const char *help)
+{
+  evbuffer_add_printf(evbuf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+value_add(struct evbuffer *evbuf, const char *name, const char *labels, uint64_t value)
+{
+  if (labels && *labels)
+    evbuffer_add_printf(evbuf, "%s{%s} %" PRIu64 "\n", name, labels, value);
+  else
+    evbuffer_add_printf(evbuf, "%s %" PRIu64 "\n", name, value);
+}
+
+static void
+gauge_signed_add(struct evbuffer *evbuf, const char *name, const char *labels, int64_t value)
+{
+  if (labels && *labels)
+    evbuffer_add_printf(evbuf, "%s{%s} %" PRIi64 "\n", name, labels, value);
+  else
+    evbuffer_add_printf(evbuf, "%s %" PRIi64 "\n", name, value);
+}
+
+static void
+seconds_add(struct evbuffer *evbuf, const char *name, const char *labels, uint64_t usec)
+{
+  if (labels && *labels)
+    evbuffer_add_printf(evbuf, "%s{%s} %.6f\n", name, labels, usec / 1e6);
+  else
+    evbuffer_add_printf(evbuf, "%s %.6f\n", name, usec / 1e6);
+}
+
+// Converts a struct histogram to Prometheus buckets. Bucket 0 has values of 0
+// and bucket n values up to 2^n - 1, so those are the upper bounds, scaled to
+// seconds with unit_per_sec. Our histograms don't keep a sum, so _sum is only
+// added if the caller has it (sum_usec >= 0).
+static void
+histogram_metric_add(struct evbuffer *evbuf, const char *name, const char *labels, struct histogram *h, double unit_per_sec, int64_t sum_usec)
+{
+  const char *sep = (labels && *labels) ? "," : "";
+  char series[128];
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+    {
+      total += h->count[i];
+      evbuffer_add_printf(evbuf, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels ? labels : "", sep,
+	(double)((UINT64_C(1) << i) - 1) / unit_per_sec, total);
+    }
+
+  total += h->count[HISTOGRAM_BUCKETS - 1];
+  evbuffer_add_printf(evbuf, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels ? labels : "", sep, total);
+
+  if (sum_usec >= 0)
+    {
+      snprintf(series, sizeof(series), "%s_sum", name);
+      seconds_add(evbuf, series, labels, sum_usec);
+    }
+
+  snprintf(series, sizeof(series), "%s_count", name);
+  value_add(evbuf, series, labels, total);
+}
+
+
+/* ------------------------------- Subsystems ------------------------------- */
+
+static void
+db_metrics_add(struct evbuffer *evbuf)
+{
+  struct db_query_stats *stats;
+  char labels[128];
+  int nstats;
+  int i;
+
+  nstats = db_query_stats_get(&stats);
+  if (nstats < 0)
+    return;
+
+  family_add(evbuf, "owntone_db_queries_total", "counter", "Database queries by type");
+  for (i = 0; i < nstats; i++)
+    {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", stats[i].name);
+      value_add(evbuf, "owntone_db_queries_total", labels, stats[i].count);
+    }
+
+  family_add(evbuf, "owntone_db_slow_queries_total", "counter", "Database queries slower than slow_query_threshold");
+  for (i = 0; i < nstats; i++)
+    {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", stats[i].name);
+      value_add(evbuf, "owntone_db_slow_queries_total", labels, stats[i].slow_count);
+    }
+
+  family_add(evbuf, "owntone_db_query_seconds_total", "counter", "Time spent on database queries");
+  for (i = 0; i < nstats; i++)
+    {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", stats[i].name);
+      seconds_add(evbuf, "owntone_db_query_seconds_total", labels, stats[i].total_usec);
+    }
+
+  family_add(evbuf, "owntone_db_query_max_seconds", "gauge", "Slowest database query");
+  for (i = 0; i < nstats; i++)
+    {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", stats[i].name);
+      seconds_add(evbuf, "owntone_db_query_max_seconds", labels, stats[i].max_usec);
+    }
+
+  free(stats);
+}
+
+static void
+cache_metrics_add(struct evbuffer *evbuf)
+{
+  struct cache_stats stats[CACHE_TYPE_MAX];
+  bool ok[CACHE_TYPE_MAX];
+  char labels[CACHE_TYPE_MAX][64];
+  int i;
+
+  for (i = 0; i < CACHE_TYPE_MAX; i++)
+    {
+      ok[i] = (cache_stats_get(&stats[i], i) == 0);
+      snprintf(labels[i], sizeof(labels[i]), "cache=\"%s\"", cache_type_name(i));
+    }
+
+#define CACHE_METRIC(name, type, help, field) \
+  family_add(evbuf, name, type, help); \
+  for (i = 0; i < CACHE_TYPE_MAX; i++) \
+    if (ok[i]) \
+      value_add(evbuf, name, labels[i], stats[i].field);
+
+  CACHE_METRIC("owntone_cache_hits_total", "counter", "Cache lookups that found an entry", hits);
+  CACHE_METRIC("owntone_cache_misses_total", "counter", "Cache lookups that found nothing", misses);
+  CACHE_METRIC("owntone_cache_insertions_total", "counter", "Entries added to the cache", insertions);
+  CACHE_METRIC("owntone_cache_evictions_total", "counter", "Entries removed from the cache", evictions);
+  CACHE_METRIC("owntone_cache_entries", "gauge", "Entries in the cache", entries);
+  CACHE_METRIC("owntone_cache_bytes", "gauge", "Size of the cache", bytes);
+
+#undef CACHE_METRIC
+
+  family_add(evbuf, "owntone_cache_lookup_seconds_total", "counter", "Time spent on cache lookups");
+  for (i = 0; i < CACHE_TYPE_MAX; i++)
+    if (ok[i])
+      seconds_add(evbuf, "owntone_cache_lookup_seconds_total", labels[i], stats[i].lookup_usec);
+
+  if (ok[CACHE_TYPE_DAAP])
+    {
+      family_add(evbuf, "owntone_cache_memory_bytes", "gauge", "Size of the in-memory part of the cache");
+      value_add(evbuf, "owntone_cache_memory_bytes", labels[CACHE_TYPE_DAAP], stats[CACHE_TYPE_DAAP].mem_bytes);
+    }
+}
+
+static void
+player_metrics_add(struct evbuffer *evbuf)
+{
+  struct player_stats stats;
+  char name[255];
+  char labels[512];
+  int i;
+
+  if (player_stats_get(&stats) < 0)
+    return;
+
+  family_add(evbuf, "owntone_player_tick_late_seconds", "histogram", "How late the playback timer was handled");
+  histogram_metric_add(evbuf, "owntone_player_tick_late_seconds", NULL, &stats.tick_late_ms, 1000, -1);
+
+  family_add(evbuf, "owntone_player_read_behind_seconds", "histogram", "How much the input was behind (read deficit) each tick");
+  histogram_metric_add(evbuf, "owntone_player_read_behind_seconds", NULL, &stats.read_behind_ms, 1000, -1);
+
+  family_add(evbuf, "owntone_player_input_fill_seconds", "histogram", "Amount of audio in the input buffer each tick");
+  histogram_metric_add(evbuf, "owntone_player_input_fill_seconds", NULL, &stats.input_fill_ms, 1000, -1);
+
+  family_add(evbuf, "owntone_output_write_seconds", "histogram", "Duration of writes to each output");
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      label_value_escape(name, sizeof(name), stats.output[i].name);
+      snprintf(labels, sizeof(labels), "output=\"%s\"", name);
+      histogram_metric_add(evbuf, "owntone_output_write_seconds", labels, &stats.output[i].write_us, 1000000, -1);
+    }
+}
+
+static void
+speaker_enum_cb(struct player_speaker_info *spk, void *arg)
+{
+  struct metrics_outputs *outputs = arg;
+  struct metrics_output *output;
+  char name[255];
+  char type[64];
+
+  if (outputs->n >= METRICS_OUTPUTS_MAX)
+    return;
+
+  output = &outputs->output[outputs->n++];
+
+  label_value_escape(name, sizeof(name), spk->name);
+  label_value_escape(type, sizeof(type), spk->output_type);
+  snprintf(output->labels, sizeof(output->labels), "id=\"%" PRIu64 "\",name=\"%s\",type=\"%s\"", spk->id, name, type);
+  output->stats = spk->stats;
+}
+
+static void
+outputs_metrics_add(struct evbuffer *evbuf)
+{
+  struct metrics_outputs *outputs;
+  int i;
+
+  CHECK_NULL(L_WEB, outputs = calloc(1, sizeof(struct metrics_outputs)));
+
+  player_speaker_enumerate(speaker_enum_cb, outputs);
+
+#define OUTPUT_METRIC(name, type, help, field) \
+  family_add(evbuf, name, type, help); \
+  for (i = 0; i < outputs->n; i++) \
+    gauge_signed_add(evbuf, name, outputs->output[i].labels, outputs->output[i].stats.field);
+
+  OUTPUT_METRIC("owntone_output_resend_hits_total", "counter", "Retransmit requests for packets that were still buffered", resend_hits);
+  OUTPUT_METRIC("owntone_output_resend_misses_total", "counter", "Retransmit requests for packets that were no longer buffered", resend_misses);
+  OUTPUT_METRIC("owntone_output_underruns_total", "counter", "Output buffer underruns", underruns);
+  OUTPUT_METRIC("owntone_output_overruns_total", "counter", "Output buffer overruns", overruns);
+  OUTPUT_METRIC("owntone_output_sync_corrections_total", "counter", "Playback adjustments made to keep the output in sync", corrections);
+  OUTPUT_METRIC("owntone_output_sent_bytes_total", "counter", "Audio bytes sent to the output", bytes_sent);
+  OUTPUT_METRIC("owntone_output_rtt_milliseconds", "gauge", "Smoothed round trip time of audio packets", rtt_ms);
+  OUTPUT_METRIC("owntone_output_latency_milliseconds", "gauge", "Latest latency measurement", latency_ms);
+  OUTPUT_METRIC("owntone_output_drift_ppm", "gauge", "Latest clock drift measurement", drift_ppm);
+
+#undef OUTPUT_METRIC
+
+  free(outputs);
+}
+
+static void
+httpd_metrics_add(struct evbuffer *evbuf)
+{
+  struct httpd_route_stats *stats;
+  char **labels;
+  char path[256];
+  int nstats;
+  int i;
+
+  nstats = httpd_route_stats_get(&stats);
+
+  CHECK_NULL(L_WEB, labels = calloc(nstats ? nstats : 1, sizeof(char *)));
+  for (i = 0; i < nstats; i++)
+    {
+      if (stats[i].requests == 0)
+	continue;
+
+      label_value_escape(path, sizeof(path), stats[i].regexp);
+      labels[i] = safe_asprintf("module=\"%s\",path=\"%s\"", stats[i].module, path);
+    }
+
+  family_add(evbuf, "owntone_http_requests_total", "counter", "Http requests by handler");
+  for (i = 0; i < nstats; i++)
+    if (labels[i])
+      value_add(evbuf, "owntone_http_requests_total", labels[i], stats[i].requests);
+
+  family_add(evbuf, "owntone_http_errors_total", "counter", "Http replies with a status code of 400 or more");
+  for (i = 0; i < nstats; i++)
+    if (labels[i])
+      value_add(evbuf, "owntone_http_errors_total", labels[i], stats[i].errors);
+
+  family_add(evbuf, "owntone_http_sent_bytes_total", "counter", "Bytes sent in reply bodies");
+  for (i = 0; i < nstats; i++)
+    if (labels[i])
+      value_add(evbuf, "owntone_http_sent_bytes_total", labels[i], stats[i].bytes_sent);
+
+  family_add(evbuf, "owntone_http_queue_seconds", "histogram", "Time from a request was received until a thread started handling it");
+  for (i = 0; i < nstats; i++)
+    if (labels[i])
+      histogram_metric_add(evbuf, "owntone_http_queue_seconds", labels[i], &stats[i].queue_us, 1000000, -1);
+
+  family_add(evbuf, "owntone_http_handler_seconds", "histogram", "Time spent in the request handler");
+  for (i = 0; i < nstats; i++)
+    if (labels[i])
+      histogram_metric_add(evbuf, "owntone_http_handler_seconds", labels[i], &stats[i].handler_us, 1000000, stats[i].handler_total_us);
+
+  for (i = 0; i < nstats; i++)
+    free(labels[i]);
+  free(labels);
+  free(stats);
+}
+
+static void
+library_metrics_add(struct evbuffer *evbuf)
+{
+  static const char *phase_names[LIBRARY_SCAN_PHASE_MAX] = { "walk", "stat", "metadata", "save", "playlists", "purge" };
+  struct library_scan_stats stats;
+  char labels[64];
+  int i;
+
+  library_scan_stats_get(&stats);
+
+  family_add(evbuf, "owntone_library_scanning", "gauge", "1 if a library scan is running");
+  value_add(evbuf, "owntone_library_scanning", NULL, stats.scanning);
+
+  family_add(evbuf, "owntone_library_scan_dirs", "gauge", "Directories read by the current or last scan");
+  value_add(evbuf, "owntone_library_scan_dirs", NULL, stats.dirs);
+
+  family_add(evbuf, "owntone_library_scan_files", "gauge", "Files processed by the current or last scan");
+  value_add(evbuf, "owntone_library_scan_files", NULL, stats.files);
+
+  family_add(evbuf, "owntone_library_scan_files_scanned", "gauge", "Files that had their metadata read by the current or last scan");
+  value_add(evbuf, "owntone_library_scan_files_scanned", NULL, stats.files_scanned);
+
+  family_add(evbuf, "owntone_library_scan_queue_depth", "gauge", "Files waiting for a metadata worker");
+  gauge_signed_add(evbuf, "owntone_library_scan_queue_depth", NULL, stats.queue_depth);
+
+  family_add(evbuf, "owntone_library_scan_phase_seconds", "gauge", "Time spent in each phase by the current or last scan");
+  for (i = 0; i < LIBRARY_SCAN_PHASE_MAX; i++)
+    {
+      snprintf(labels, sizeof(labels), "phase=\"%s\"", phase_names[i]);
+      seconds_add(evbuf, "owntone_library_scan_phase_seconds", labels, stats.phase_usec[i]);
+    }
+}
+
+static void
+memory_metrics_add(struct evbuffer *evbuf)
+{
+  struct mem_tag_stats stats[MEM_TAG_MAX];
+  char labels[MEM_TAG_MAX][32];
+  int nstats;
+  int i;
+
+  // Only if built with --enable-memaccounting
+  nstats = mem_tag_stats_get(stats, ARRAY_SIZE(stats));
+  if (nstats <= 0)
+    return;
+
+  for (i = 0; i < nstats; i++)
+    snprintf(labels[i], sizeof(labels[i]), "tag=\"%s\"", stats[i].name);
+
+  family_add(evbuf, "owntone_memory_allocated_bytes", "gauge", "Memory currently allocated, by subsystem");
+  for (i = 0; i < nstats; i++)
+    gauge_signed_add(evbuf, "owntone_memory_allocated_bytes", labels[i], stats[i].current_bytes);
+
+  family_add(evbuf, "owntone_memory_allocated_peak_bytes", "gauge", "Most memory allocated at once, by subsystem");
+  for (i = 0; i < nstats; i++)
+    gauge_signed_add(evbuf, "owntone_memory_allocated_peak_bytes", labels[i], stats[i].peak_bytes);
+
+  family_add(evbuf, "owntone_memory_allocations_total", "counter", "Number of allocations, by subsystem");
+  for (i = 0; i < nstats; i++)
+    value_add(evbuf, "owntone_memory_allocations_total", labels[i], stats[i].allocations);
+}
+
+static void
+process_metrics_add(struct evbuffer *evbuf)
+{
+  unsigned long size;
+  unsigned long resident;
+  long pagesize;
+  FILE *f;
+  int ret;
+
+  // Only on Linux, elsewhere the memory metrics are just left out
+  f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return;
+
+  ret = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  pagesize = sysconf(_SC_PAGESIZE);
+  if (ret != 2 || pagesize <= 0)
+    return;
+
+  family_add(evbuf, "owntone_process_virtual_memory_bytes", "gauge", "Virtual memory size");
+  value_add(evbuf, "owntone_process_virtual_memory_bytes", NULL, (uint64_t)size * pagesize);
+
+  family_add(evbuf, "owntone_process_resident_memory_bytes", "gauge", "Resident memory size");
+  value_add(evbuf, "owntone_process_resident_memory_bytes", NULL, (uint64_t)resident * pagesize);
+}
+
+
+/* ---------------------------- REPLY HANDLERS ------------------------------ */
+
+static int
+metrics_reply(struct httpd_request *hreq)
+{
+  struct evbuffer *evbuf = hreq->out_body;
+
+  db_metrics_add(evbuf);
+  cache_metrics_add(evbuf);
+  player_metrics_add(evbuf);
+  outputs_metrics_add(evbuf);
+  httpd_metrics_add(evbuf);
+  library_metrics_add(evbuf);
+  memory_metrics_add(evbuf);
+  process_metrics_add(evbuf);
+
+  return HTTP_OK;
+}
+
+static struct httpd_uri_map metrics_handlers[] =
+{
+  { HTTPD_METHOD_GET, "^/metrics$", metrics_reply },
+  { 0, NULL, NULL }
+};
+
+
+/* ------------------------------- METRICS API ------------------------------ */
+
+static void
+metrics_request(struct httpd_request *hreq)
+{
+  int status_code;
+
+  if (!httpd_request_is_authorized(hreq))
+    return;
+
+  if (!hreq->handler)
+    {
+      DPRINTF(E_LOG, L_WEB, "Unrecognized path in metrics request: '%s'\n", hreq->uri);
+
+      httpd_send_error(hreq, HTTP_NOTFOUND, "Not Found");
+      return;
+    }
+
+  status_code = hreq->handler(hreq);
+  if (status_code != HTTP_OK)
+    {
+      httpd_send_error(hreq, HTTP_INTERNAL, "Internal Server Error");
+      return;
+    }
+
+  httpd_header_add(hreq->out_headers, "Content-Type", METRICS_CONTENT_TYPE);
+  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
+}
+
+struct httpd_module httpd_metrics =
+{
+  .name = "Metrics",
+  .type = MODULE_METRICS,
+  .logdomain = L_WEB,
+  .fullpaths = { "/metrics", NULL },
+  .handlers = metrics_handlers,
+  .request = metrics_request,
+};
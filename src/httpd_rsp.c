@@ -56,6 +56,9 @@ struct field_map {
 
 static char rsp_filter_files[32];
 
+// Filters made from the latest RSP queries, by the query param
+static struct lru_cache rsp_query_cache = LRU_CACHE_INITIALIZER(lru_cache_strdup, free);
+
 static const struct field_map pl_fields[] =
   {
     { "id",           dbpli_offsetof(id),           F_ALWAYS },
@@ -166,6 +169,80 @@ rsp_xml_response_new(xml_node **response_ptr, int errorcode, const char *errorst
   return 0;
 }
 
+/* Streaming XML writer for the replies with lists, which can be very long (a
+ * playlist with the whole library). Writes directly to the evbuffer while the
+ * rows are fetched, so we don't first make a tree and a string of the reply.
+ * The output is the same as libxml's for the trees, except that non-ASCII is
+ * written as UTF-8 instead of character references.
+ */
+static void
+xml_text_add(struct evbuffer *evbuf, const char *text)
+{
+  const char *start;
+  const char *entity;
+
+  for (start = text; *text; text++)
+    {
+      switch (*text)
+	{
+	  case '&':
+	    entity = "&amp;";
+	    break;
+	  case '<':
+	    entity = "&lt;";
+	    break;
+	  case '>':
+	    entity = "&gt;";
+	    break;
+	  case '\r':
+	    entity = "&#13;";
+	    break;
+	  default:
+	    continue;
+	}
+
+      evbuffer_add(evbuf, start, text - start);
+      evbuffer_add(evbuf, entity, strlen(entity));
+      start = text + 1;
+    }
+
+  evbuffer_add(evbuf, start, text - start);
+}
+
+static void
+xml_element_add(struct evbuffer *evbuf, const char *name, const char *val)
+{
+  if (!val)
+    {
+      evbuffer_add_printf(evbuf, "<%s/>", name);
+      return;
+    }
+
+  evbuffer_add_printf(evbuf, "<%s>", name);
+  xml_text_add(evbuf, val);
+  evbuffer_add_printf(evbuf, "</%s>", name);
+}
+
+static void
+xml_element_add_int(struct evbuffer *evbuf, const char *name, int val)
+{
+  evbuffer_add_printf(evbuf, "<%s>%d</%s>", name, val, name);
+}
+
+// Streaming version of rsp_xml_response_new(), caller must close <response>
+static void
+rsp_xml_response_start(struct evbuffer *evbuf, int errorcode, const char *errorstring, int records, int totalrecords)
+{
+  evbuffer_add_printf(evbuf, "%s<response><status>", RSP_XML_DECLARATION);
+
+  xml_element_add_int(evbuf, "errorcode", errorcode);
+  xml_element_add(evbuf, "errorstring", errorstring);
+  xml_element_add_int(evbuf, "records", records);
+  xml_element_add_int(evbuf, "totalrecords", totalrecords);
+
+  evbuffer_add_printf(evbuf, "</status>");
+}
+
 static void
 rsp_send_error(struct httpd_request *hreq, char *errmsg)
 {
@@ -230,6 +307,9 @@ query_params_set(struct query_params *qp, struct httpd_request *hreq)
 
   qp->filter = NULL;
   param = httpd_query_value_find(hreq->query, "query");
+  if (param && (qp->filter = lru_cache_get(&rsp_query_cache, param)))
+    return 0;
+
   if (param)
     {
       ret = snprintf(query, sizeof(query), "%s", param);
@@ -252,7 +332,10 @@ query_params_set(struct query_params *qp, struct httpd_request *hreq)
       if (rsp_lex_parse(&parse_result, query) != 0)
 	DPRINTF(E_LOG, L_RSP, "Ignoring improper RSP query: %s\n", query);
       else
-	qp->filter = safe_asprintf("(%s) AND %s", parse_result.str, rsp_filter_files);
+	{
+	  qp->filter = safe_asprintf("(%s) AND %s", parse_result.str, rsp_filter_files);
+	  lru_cache_add(&rsp_query_cache, param, qp->filter);
+	}
     }
 
   // Always filter to include only files (not streams and Spotify)
@@ -262,6 +345,16 @@ query_params_set(struct query_params *qp, struct httpd_request *hreq)
   return 0;
 }
 
+// Sends the reply already written to hreq->out_body
+static void
+rsp_send_body(struct httpd_request *hreq)
+{
+  httpd_header_add(hreq->out_headers, "Content-Type", "text/xml; charset=utf-8");
+  httpd_header_add(hreq->out_headers, "Connection", "close");
+
+  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
+}
+
 static void
 rsp_send_reply(struct httpd_request *hreq, xml_node *reply)
 {
@@ -276,10 +369,7 @@ rsp_send_reply(struct httpd_request *hreq, xml_node *reply)
       return;
     }
 
-  httpd_header_add(hreq->out_headers, "Content-Type", "text/xml; charset=utf-8");
-  httpd_header_add(hreq->out_headers, "Connection", "close");
-
-  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
+  rsp_send_body(hreq);
 }
 
 static int
@@ -344,9 +434,6 @@ rsp_reply_db(struct httpd_request *hreq)
   struct query_params qp;
   struct db_playlist_info dbpli;
   char **strval;
-  xml_node *response;
-  xml_node *pls;
-  xml_node *pl;
   int i;
   int ret;
 
@@ -364,11 +451,10 @@ rsp_reply_db(struct httpd_request *hreq)
       return -1;
     }
 
-  CHECK_ERR(L_RSP, rsp_xml_response_new(&response, 0, "", qp.results, qp.results));
-
-  pls = xml_new_node(response, "playlists", NULL);
+  rsp_xml_response_start(hreq->out_body, 0, "", qp.results, qp.results);
 
   /* Playlists block (all playlists) */
+  evbuffer_add_printf(hreq->out_body, "<playlists>");
   while (((ret = db_query_fetch_pl(&dbpli, &qp)) == 0) && (dbpli.id))
     {
       // Skip non-local playlists, can't be streamed to the device
@@ -376,7 +462,7 @@ rsp_reply_db(struct httpd_request *hreq)
 	continue;
 
       /* Playlist block (one playlist) */
-      pl = xml_new_node(pls, "playlist", NULL);
+      evbuffer_add_printf(hreq->out_body, "<playlist>");
 
       for (i = 0; pl_fields[i].field; i++)
 	{
@@ -384,38 +470,36 @@ rsp_reply_db(struct httpd_request *hreq)
 	    {
 	      strval = (char **) ((char *)&dbpli + pl_fields[i].offset);
 
-	      xml_new_node(pl, pl_fields[i].field, *strval);
+	      xml_element_add(hreq->out_body, pl_fields[i].field, *strval);
             }
         }
+
+      evbuffer_add_printf(hreq->out_body, "</playlist>");
     }
 
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
 
-      xml_free(response);
+      evbuffer_drain(hreq->out_body, -1);
       db_query_end(&qp);
       rsp_send_error(hreq, "Error fetching query results");
       return -1;
     }
 
-  /* HACK
-   * Add a dummy empty string to the playlists element if there is no data
-   * to return - this prevents us from sending out an empty <playlists/>
-   * tag that the SoundBridge does not handle. It's hackish, but it works.
-   */
-  if (qp.results == 0)
-    xml_new_text(pls, "");
+  // Always with a closing tag, since the SoundBridge does not handle an empty
+  // <playlists/>
+  evbuffer_add_printf(hreq->out_body, "</playlists></response>");
 
   db_query_end(&qp);
 
-  rsp_send_reply(hreq, response);
+  rsp_send_body(hreq);
 
   return 0;
 }
 
 static int
-item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_profile, const char *user_agent, const char *accept_codecs, int mode)
+item_add(struct evbuffer *evbuf, struct query_params *qp, enum transcode_profile spk_profile, const char *user_agent, const char *accept_codecs, int mode)
 {
   struct media_quality quality = { 0 };
   struct db_media_file_info dbmfi;
@@ -423,7 +507,6 @@ item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_p
   enum transcode_profile profile;
   const char *orgcodec = NULL;
   uint32_t len_ms;
-  xml_node *item;
   char **strval;
   int ret;
   int i;
@@ -461,7 +544,7 @@ item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_p
     }
 
   // Now add block with content
-  item = xml_new_node(parent, "item", NULL);
+  evbuffer_add_printf(evbuf, "<item>");
 
   for (i = 0; rsp_fields[i].field; i++)
     {
@@ -472,13 +555,15 @@ item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_p
       if (!(*strval) || (strlen(*strval) == 0))
 	continue;
 
-      xml_new_node(item, rsp_fields[i].field, *strval);
+      xml_element_add(evbuf, rsp_fields[i].field, *strval);
 
       // In case we are transcoding
       if (rsp_fields[i].offset == dbmfi_offsetof(codectype) && orgcodec)
-	xml_new_node(item, "original_codec", orgcodec);
+	xml_element_add(evbuf, "original_codec", orgcodec);
     }
 
+  evbuffer_add_printf(evbuf, "</item>");
+
   return 0;
 }
 
@@ -489,8 +574,6 @@ rsp_reply_playlist(struct httpd_request *hreq)
   const char *param;
   const char *accept_codecs;
   enum transcode_profile spk_profile;
-  xml_node *response;
-  xml_node *items;
   int mode;
   int records;
   int ret;
@@ -554,13 +637,13 @@ rsp_reply_playlist(struct httpd_request *hreq)
   if (qp.limit && (records > qp.limit))
     records = qp.limit;
 
-  CHECK_ERR(L_RSP, rsp_xml_response_new(&response, 0, "", records, qp.results));
+  rsp_xml_response_start(hreq->out_body, 0, "", records, qp.results);
 
   // Add a parent items block (all items), and then one item per file
-  items = xml_new_node(response, "items", NULL);
+  evbuffer_add_printf(hreq->out_body, "<items>");
   do
     {
-      ret = item_add(items, &qp, spk_profile, hreq->user_agent, accept_codecs, mode);
+      ret = item_add(hreq->out_body, &qp, spk_profile, hreq->user_agent, accept_codecs, mode);
     }
   while (ret == 0);
 
@@ -570,23 +653,19 @@ rsp_reply_playlist(struct httpd_request *hreq)
     {
       DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
 
-      xml_free(response);
+      evbuffer_drain(hreq->out_body, -1);
       db_query_end(&qp);
       rsp_send_error(hreq, "Error fetching query results");
       return -1;
     }
 
-  /* HACK
-   * Add a dummy empty string to the items element if there is no data
-   * to return - this prevents us from sending out an empty <items/>
-   * tag that the SoundBridge does not handle. It's hackish, but it works.
-   */
-  if (qp.results == 0)
-    xml_new_text(items, "");
+  // Always with a closing tag, since the SoundBridge does not handle an empty
+  // <items/>
+  evbuffer_add_printf(hreq->out_body, "</items></response>");
 
   db_query_end(&qp);
 
-  rsp_send_reply(hreq, response);
+  rsp_send_body(hreq);
 
   return 0;
 }
@@ -596,8 +675,6 @@ rsp_reply_browse(struct httpd_request *hreq)
 {
   struct query_params qp;
   char *browse_item;
-  xml_node *response;
-  xml_node *items;
   int records;
   int ret;
 
@@ -658,14 +735,13 @@ rsp_reply_browse(struct httpd_request *hreq)
   if (qp.limit && (records > qp.limit))
     records = qp.limit;
 
-  CHECK_ERR(L_RSP, rsp_xml_response_new(&response, 0, "", records, qp.results));
-
-  items = xml_new_node(response, "items", NULL);
+  rsp_xml_response_start(hreq->out_body, 0, "", records, qp.results);
 
   /* Items block (all items) */
+  evbuffer_add_printf(hreq->out_body, "<items>");
   while (((ret = db_query_fetch_string(&browse_item, &qp)) == 0) && (browse_item))
     {
-      xml_new_node(items, "item", browse_item);
+      xml_element_add(hreq->out_body, "item", browse_item);
     }
 
   if (qp.filter)
@@ -675,23 +751,18 @@ rsp_reply_browse(struct httpd_request *hreq)
     {
       DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
 
-      xml_free(response);
+      evbuffer_drain(hreq->out_body, -1);
       db_query_end(&qp);
       rsp_send_error(hreq, "Error fetching query results");
       return -1;
     }
 
-  /* HACK
-   * Add a dummy empty string to the items element if there is no data
-   * to return - this prevents us from sending out an empty <items/>
-   * tag that the SoundBridge does not handle. It's hackish, but it works.
-   */
-  if (qp.results == 0)
-    xml_new_text(items, "");
+  // Always with a closing tag, see rsp_reply_playlist()
+  evbuffer_add_printf(hreq->out_body, "</items></response>");
 
   db_query_end(&qp);
 
-  rsp_send_reply(hreq, response);
+  rsp_send_body(hreq);
 
   return 0;
 }
@@ -747,11 +818,13 @@ static struct httpd_uri_map rsp_handlers[] =
     },
     {
       .regexp = "^/rsp/db/[[:digit:]]+$",
-      .handler = rsp_reply_playlist
+      .handler = rsp_reply_playlist,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/rsp/db/[[:digit:]]+/[^/]+$",
-      .handler = rsp_reply_browse
+      .handler = rsp_reply_browse,
+      .flags = HTTPD_HANDLER_HEAVY
     },
     {
       .regexp = "^/rsp/stream/[[:digit:]]+$",
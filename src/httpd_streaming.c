@@ -26,6 +26,7 @@
 #include <uninorm.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -34,22 +35,78 @@
 #include "player.h"
 #include "logger.h"
 #include "conffile.h"
+#include "outputs/streaming.h"
 
 #define STREAMING_ICY_METALEN_MAX      4080  // 255*16 incl header/footer (16bytes)
 #define STREAMING_ICY_METATITLELEN_MAX 4064  // STREAMING_ICY_METALEN_MAX -16 (not incl header/footer)
 
+// An ICY metadata block is made once per title and shared by all the sessions.
+// It is added to their output by reference, so it is refcounted.
+struct icy_meta {
+  int refcount;
+  char *title;
+  unsigned len;
+  uint8_t data[STREAMING_ICY_METALEN_MAX + 1];
+};
+
 struct streaming_session {
   struct httpd_request *hreq;
 
   int id;
   struct event *audioev;
-  struct event *metadataev;
   struct evbuffer *audiobuf;
   size_t bytes_sent;
 
+  // Waiting for the last chunk we sent to be written to the client
+  bool chunk_pending;
+
   bool icy_is_requested;
   size_t icy_remaining;
   char icy_title[STREAMING_ICY_METATITLELEN_MAX];
+  struct icy_meta *icy_meta;
+};
+
+/* HLS is made from the same mp3 as /stream.mp3, cut into segments of about
+ * HLS_SEGMENT_SECONDS (at mp3 frame boundaries). Each segment is made once and
+ * then served to all the listeners from memory, and since a segment never
+ * changes a reverse proxy or CDN can cache it. The segments are "packed audio"
+ * (RFC 8216, 3.4), i.e. plain mp3 that starts with an ID3 tag that has the
+ * timestamp of the segment. Encoding for HLS stops when there hasn't been a
+ * request for HLS_IDLE_SECONDS.
+ */
+#define HLS_SEGMENT_SECONDS 4
+// Segments that are kept, which must be more than are listed in the playlist,
+// since a client may fetch a segment just after it was removed from the list
+#define HLS_SEGMENTS_MAX 8
+#define HLS_PLAYLIST_SEGMENTS 4
+#define HLS_IDLE_SECONDS 30
+#define HLS_ID3_OWNER "com.apple.streaming.transportStreamTimestamp"
+#define HLS_ID3_LEN (10 + 10 + sizeof(HLS_ID3_OWNER) + 8)
+
+struct hls_segment {
+  int refcount;
+  unsigned seq;
+  double duration;
+  size_t len;
+  uint8_t *data;
+};
+
+struct hls_ctx {
+  bool is_started;
+  int id;
+  struct event *audioev;
+  struct event *idleev;
+  struct evbuffer *audiobuf;
+  struct timespec last_request;
+
+  // The segment being made and the number of audio bytes it has
+  struct evbuffer *segbuf;
+  size_t seg_audio_len;
+  // Audio bytes since start, for the timestamps
+  uint64_t audio_len;
+
+  unsigned seq_next;
+  struct hls_segment *segments[HLS_SEGMENTS_MAX];
 };
 
 static struct media_quality streaming_default_quality = {
@@ -59,6 +116,21 @@ static struct media_quality streaming_default_quality = {
   .bit_rate = 128000,
 };
 
+// libopus only supports 48000 (and lower rates that we don't want)
+static struct media_quality streaming_opus_quality = {
+  .sample_rate = 48000,
+  .bits_per_sample = 16,
+  .channels = 2,
+  .bit_rate = 96000,
+};
+
+// Lossless, so no bit rate. The sample rate is set from the config.
+static struct media_quality streaming_flac_quality = {
+  .sample_rate = 44100,
+  .bits_per_sample = 16,
+  .channels = 2,
+};
+
 static void
 session_free(struct streaming_session *session);
 
@@ -73,6 +145,10 @@ session_free(struct streaming_session *session);
 // ICY_METAINT can lead to stuttering as observed on a Roku Soundbridge
 static unsigned short streaming_icy_metaint = 16384;
 
+// The block for the latest title, so that the sessions can share it
+static struct icy_meta *streaming_icy_meta;
+static pthread_mutex_t streaming_icy_meta_lck;
+
 // We know that the icymeta is limited to 1+255*16 (ie 4081) bytes so caller must
 // provide a buf of this size to avoid needless mallocs
 //
@@ -124,10 +200,50 @@ icy_meta_create(uint8_t buf[STREAMING_ICY_METALEN_MAX+1], unsigned *buflen, cons
 }
 
 static void
-icy_meta_splice(struct evbuffer *out, struct evbuffer *in, size_t *icy_remaining, char *title)
+icy_meta_unref(struct icy_meta *meta)
+{
+  if (!meta || __atomic_sub_fetch(&meta->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  free(meta->title);
+  free(meta);
+}
+
+static void
+icy_meta_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  icy_meta_unref(extra);
+}
+
+// Returns a reference to the block for the title, which is only made if the
+// title is not the same as the one of the last block
+static struct icy_meta *
+icy_meta_get(const char *title)
+{
+  struct icy_meta *meta;
+
+  pthread_mutex_lock(&streaming_icy_meta_lck);
+  if (!streaming_icy_meta || strcmp(streaming_icy_meta->title, title) != 0)
+    {
+      CHECK_NULL(L_STREAMING, meta = calloc(1, sizeof(struct icy_meta)));
+      CHECK_NULL(L_STREAMING, meta->title = strdup(title));
+      icy_meta_create(meta->data, &meta->len, title);
+      meta->refcount = 1;
+
+      icy_meta_unref(streaming_icy_meta);
+      streaming_icy_meta = meta;
+    }
+
+  meta = streaming_icy_meta;
+  __atomic_add_fetch(&meta->refcount, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&streaming_icy_meta_lck);
+
+  return meta;
+}
+
+static void
+icy_meta_splice(struct evbuffer *out, struct evbuffer *in, size_t *icy_remaining, struct icy_meta *meta)
 {
-  uint8_t meta[STREAMING_ICY_METALEN_MAX + 1];
-  unsigned metalen;
   size_t buf_remaining;
   size_t consume;
 
@@ -138,15 +254,234 @@ icy_meta_splice(struct evbuffer *out, struct evbuffer *in, size_t *icy_remaining
       *icy_remaining -= consume;
       if (*icy_remaining == 0)
 	{
-	  icy_meta_create(meta, &metalen, title);
-
-	  evbuffer_add(out, meta, metalen);
+	  __atomic_add_fetch(&meta->refcount, 1, __ATOMIC_RELAXED);
+	  evbuffer_add_reference(out, meta->data, meta->len, icy_meta_cleanup_cb, meta);
 	  *icy_remaining = streaming_icy_metaint;
 	}
     }
 }
 
 
+/* ---------------------------------- HLS ----------------------------------- */
+
+static struct hls_ctx streaming_hls;
+static pthread_mutex_t streaming_hls_lck;
+
+static void
+hls_segment_unref(struct hls_segment *segment)
+{
+  if (!segment || __atomic_sub_fetch(&segment->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  free(segment->data);
+  free(segment);
+}
+
+static void
+hls_segment_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  hls_segment_unref(extra);
+}
+
+// Starts a segment with an ID3 tag with a PRIV frame that has the timestamp
+// (90 kHz, 33 bits) of its first sample. This is required for packed audio.
+static void
+hls_segment_begin(struct hls_ctx *hls)
+{
+  uint8_t tag[HLS_ID3_LEN] = { 0 };
+  uint64_t ts;
+  size_t len;
+  int i;
+
+  ts = (hls->audio_len * 90000 / (streaming_default_quality.bit_rate / 8)) & 0x1ffffffffULL;
+
+  // Header, version 2.4, size is syncsafe but less than 128
+  memcpy(tag, "ID3\x04\x00\x00", 6);
+  tag[9] = HLS_ID3_LEN - 10;
+
+  // PRIV frame
+  len = sizeof(HLS_ID3_OWNER) + 8;
+  memcpy(tag + 10, "PRIV", 4);
+  tag[17] = len;
+  memcpy(tag + 20, HLS_ID3_OWNER, sizeof(HLS_ID3_OWNER));
+  for (i = 0; i < 8; i++)
+    tag[20 + sizeof(HLS_ID3_OWNER) + i] = (ts >> (56 - 8 * i)) & 0xff;
+
+  evbuffer_add(hls->segbuf, tag, sizeof(tag));
+  hls->seg_audio_len = 0;
+}
+
+static void
+hls_segment_end(struct hls_ctx *hls)
+{
+  struct hls_segment *segment;
+  int idx;
+
+  CHECK_NULL(L_STREAMING, segment = calloc(1, sizeof(struct hls_segment)));
+
+  segment->len = evbuffer_get_length(hls->segbuf);
+  CHECK_NULL(L_STREAMING, segment->data = malloc(segment->len));
+  evbuffer_remove(hls->segbuf, segment->data, segment->len);
+
+  segment->refcount = 1;
+  segment->seq = hls->seq_next++;
+  segment->duration = (double)hls->seg_audio_len / (streaming_default_quality.bit_rate / 8);
+
+  idx = segment->seq % HLS_SEGMENTS_MAX;
+  hls_segment_unref(hls->segments[idx]);
+  hls->segments[idx] = segment;
+
+  DPRINTF(E_SPAM, L_STREAMING, "HLS segment %u done (%zu bytes, %.3f sec)\n", segment->seq, segment->len, segment->duration);
+}
+
+// Must be called with the lock held. What was running is moved to stopped,
+// which must be given to hls_free() after the lock is released, since freeing
+// an event waits for its callback, and that may be waiting for the lock.
+static void
+hls_stop(struct hls_ctx *stopped, struct hls_ctx *hls)
+{
+  *stopped = *hls;
+  memset(hls, 0, sizeof(struct hls_ctx));
+}
+
+static void
+hls_free(struct hls_ctx *hls)
+{
+  int i;
+
+  if (!hls->is_started)
+    return;
+
+  DPRINTF(E_INFO, L_STREAMING, "Stopping HLS streaming\n");
+
+  if (hls->id >= 0)
+    player_streaming_deregister(hls->id);
+
+  event_free(hls->audioev);
+  event_free(hls->idleev);
+  evbuffer_free(hls->audiobuf);
+  evbuffer_free(hls->segbuf);
+
+  for (i = 0; i < HLS_SEGMENTS_MAX; i++)
+    hls_segment_unref(hls->segments[i]);
+}
+
+// Activated by the streaming output when there is new audio. The reads are
+// whole mp3 frames, so a segment can end after any of them.
+static void
+hls_audio_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct hls_ctx *hls = arg;
+  struct hls_ctx stopped = { 0 };
+  char title[64];
+  bool title_changed;
+  int len;
+
+  pthread_mutex_lock(&streaming_hls_lck);
+  if (!hls->is_started)
+    goto out;
+
+  len = streaming_session_read(hls->audiobuf, title, sizeof(title), &title_changed, hls->id);
+  if (len < 0)
+    {
+      hls_stop(&stopped, hls);
+      goto out;
+    }
+
+  hls->seg_audio_len += len;
+  hls->audio_len += len;
+  evbuffer_add_buffer(hls->segbuf, hls->audiobuf);
+
+  if (hls->seg_audio_len >= HLS_SEGMENT_SECONDS * (streaming_default_quality.bit_rate / 8))
+    {
+      hls_segment_end(hls);
+      hls_segment_begin(hls);
+    }
+
+ out:
+  pthread_mutex_unlock(&streaming_hls_lck);
+
+  hls_free(&stopped);
+}
+
+static void
+hls_idle_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct hls_ctx *hls = arg;
+  struct hls_ctx stopped = { 0 };
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&streaming_hls_lck);
+  if (hls->is_started && now.tv_sec - hls->last_request.tv_sec >= HLS_IDLE_SECONDS)
+    hls_stop(&stopped, hls);
+  pthread_mutex_unlock(&streaming_hls_lck);
+
+  hls_free(&stopped);
+}
+
+// Must be called with the lock held. The events are added to evbase, which
+// must be a base that will be running for as long as HLS is. If starting fails
+// stopped must be given to hls_free(), like with hls_stop().
+static int
+hls_start(struct hls_ctx *stopped, struct hls_ctx *hls, struct event_base *evbase)
+{
+  struct timeval tv = { HLS_IDLE_SECONDS, 0 };
+
+  CHECK_NULL(L_STREAMING, hls->audiobuf = evbuffer_new());
+  CHECK_NULL(L_STREAMING, hls->segbuf = evbuffer_new());
+  CHECK_NULL(L_STREAMING, hls->audioev = event_new(evbase, -1, 0, hls_audio_cb, hls));
+  CHECK_NULL(L_STREAMING, hls->idleev = event_new(evbase, -1, EV_PERSIST, hls_idle_cb, hls));
+
+  // Segments from an earlier start may still be cached by a proxy, so the
+  // numbering must not start over. We are far from making a segment per second.
+  hls->seq_next = (unsigned)time(NULL);
+  hls->is_started = true;
+
+  hls->id = player_streaming_register(hls->audioev, MEDIA_FORMAT_MP3, streaming_default_quality);
+  if (hls->id < 0)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not start HLS streaming\n");
+      hls_stop(stopped, hls);
+      return -1;
+    }
+
+  evtimer_add(hls->idleev, &tv);
+  hls_segment_begin(hls);
+
+  DPRINTF(E_INFO, L_STREAMING, "Starting HLS streaming\n");
+  return 0;
+}
+
+static void
+hls_playlist_make(struct evbuffer *evbuf, struct hls_ctx *hls)
+{
+  struct hls_segment *segment;
+  unsigned first;
+  unsigned seq;
+
+  // Just after start there are fewer segments than we list
+  for (first = hls->seq_next - HLS_PLAYLIST_SEGMENTS; first != hls->seq_next; first++)
+    {
+      segment = hls->segments[first % HLS_SEGMENTS_MAX];
+      if (segment && segment->seq == first)
+	break;
+    }
+
+  evbuffer_add_printf(evbuf, "#EXTM3U\n");
+  evbuffer_add_printf(evbuf, "#EXT-X-VERSION:3\n");
+  evbuffer_add_printf(evbuf, "#EXT-X-TARGETDURATION:%d\n", HLS_SEGMENT_SECONDS + 1);
+  evbuffer_add_printf(evbuf, "#EXT-X-MEDIA-SEQUENCE:%u\n", first);
+
+  for (seq = first; seq != hls->seq_next; seq++)
+    {
+      segment = hls->segments[seq % HLS_SEGMENTS_MAX];
+      evbuffer_add_printf(evbuf, "#EXTINF:%.3f,\n%u.mp3\n", segment->duration, segment->seq);
+    }
+}
+
+
 /* ----------------------------- Event callbacks ---------------------------- */
 
 static void
@@ -157,56 +492,62 @@ conn_close_cb(void *arg)
   session_free(session);
 }
 
+static void
+chunk_written_cb(httpd_connection *conn, void *arg)
+{
+  struct streaming_session *session = arg;
+
+  session->chunk_pending = false;
+
+  // Read whatever was encoded while we were waiting
+  event_active(session->audioev, 0, 0);
+}
+
+// Activated by the streaming output when there is new audio
 static void
 audio_cb(evutil_socket_t fd, short event, void *arg)
 {
   struct streaming_session *session = arg;
   struct httpd_request *hreq;
+  bool title_changed;
   int len;
 
   CHECK_NULL(L_STREAMING, hreq = session->hreq);
 
-  len = evbuffer_read(session->audiobuf, fd, -1);
-  if (len < 0 && errno != EAGAIN)
+  // A slow client will make us wait here, and if it falls too far behind the
+  // streaming output will skip it ahead
+  if (session->chunk_pending)
+    return;
+
+  len = streaming_session_read(session->audiobuf, session->icy_title, sizeof(session->icy_title), &title_changed, session->id);
+  if (len < 0)
     {
-      DPRINTF(E_INFO, L_STREAMING, "Stopping mp3 streaming to %s:%d\n", session->hreq->peer_address, (int)session->hreq->peer_port);
+      DPRINTF(E_INFO, L_STREAMING, "Stopping streaming to %s:%d\n", session->hreq->peer_address, (int)session->hreq->peer_port);
 
       httpd_send_reply_end(session->hreq);
       session_free(session);
       return;
     }
+  else if (len == 0)
+    return;
+
+  if (session->icy_is_requested && title_changed)
+    {
+      icy_meta_unref(session->icy_meta);
+      session->icy_meta = icy_meta_get(session->icy_title);
+    }
 
   if (session->icy_is_requested)
-    icy_meta_splice(hreq->out_body, session->audiobuf, &session->icy_remaining, session->icy_title);
+    icy_meta_splice(hreq->out_body, session->audiobuf, &session->icy_remaining, session->icy_meta);
   else
     evbuffer_add_buffer(hreq->out_body, session->audiobuf);
 
-  httpd_send_reply_chunk(hreq, NULL, NULL);
+  session->chunk_pending = true;
+  httpd_send_reply_chunk(hreq, chunk_written_cb, session);
 
   session->bytes_sent += len;
 }
 
-static void
-metadata_cb(evutil_socket_t fd, short event, void *arg)
-{
-  struct streaming_session *session = arg;
-  struct evbuffer *evbuf;
-  int len;
-
-  CHECK_NULL(L_STREAMING, evbuf = evbuffer_new());
-
-  len = evbuffer_read(evbuf, fd, -1);
-  if (len < 0)
-    goto out;
-
-  len = sizeof(session->icy_title);
-  evbuffer_remove(evbuf, session->icy_title, len);
-  session->icy_title[len - 1] = '\0';
-
- out:
-  evbuffer_free(evbuf);
-}
-
 
 /* ----------------------------- Session helpers ---------------------------- */
 
@@ -220,9 +561,8 @@ session_free(struct streaming_session *session)
 
   if (session->audioev)
     event_free(session->audioev);
-  if (session->metadataev)
-    event_free(session->metadataev);
 
+  icy_meta_unref(session->icy_meta);
   evbuffer_free(session->audiobuf);
   free(session);
 }
@@ -231,8 +571,6 @@ static struct streaming_session *
 session_new(struct httpd_request *hreq, bool icy_is_requested, enum media_format format, struct media_quality quality)
 {
   struct streaming_session *session;
-  int audio_fd;
-  int metadata_fd;
 
   CHECK_NULL(L_STREAMING, session = calloc(1, sizeof(struct streaming_session)));
   CHECK_NULL(L_STREAMING, session->audiobuf = evbuffer_new());
@@ -240,17 +578,17 @@ session_new(struct httpd_request *hreq, bool icy_is_requested, enum media_format
   session->hreq = hreq;
   session->icy_is_requested = icy_is_requested;
   session->icy_remaining = streaming_icy_metaint;
+  if (icy_is_requested)
+    session->icy_meta = icy_meta_get(session->icy_title);
 
-  // Ask streaming output module for a fd to read mp3 from
-  session->id = player_streaming_register(&audio_fd, &metadata_fd, format, quality);
+  // The streaming output module will activate the event when there is audio to
+  // read with streaming_session_read()
+  CHECK_NULL(L_STREAMING, session->audioev = event_new(hreq->evbase, -1, 0, audio_cb, session));
+
+  session->id = player_streaming_register(session->audioev, format, quality);
   if (session->id < 0)
     goto error;
 
-  CHECK_NULL(L_STREAMING, session->audioev = event_new(hreq->evbase, audio_fd, EV_READ | EV_PERSIST, audio_cb, session));
-  event_add(session->audioev, NULL);
-  CHECK_NULL(L_STREAMING, session->metadataev = event_new(hreq->evbase, metadata_fd, EV_READ | EV_PERSIST, metadata_cb, session));
-  event_add(session->metadataev, NULL);
-
   return session;
 
  error:
@@ -261,8 +599,10 @@ session_new(struct httpd_request *hreq, bool icy_is_requested, enum media_format
 
 /* -------------------------- Module implementation ------------------------- */
 
+// Sessions for the same format and quality share the encoding, see
+// outputs/streaming.c
 static int
-streaming_mp3_handler(struct httpd_request *hreq)
+streaming_handler(struct httpd_request *hreq, enum media_format format, struct media_quality quality, const char *content_type)
 {
   struct streaming_session *session = NULL;
   const char *name = cfg_getstr(cfg_getsec(cfg, "library"), "name");
@@ -270,8 +610,9 @@ streaming_mp3_handler(struct httpd_request *hreq)
   bool icy_is_requested;
   char buf[9];
 
+  // ICY metadata is only for mp3, in ogg and flac the players don't expect it
   param = httpd_header_find(hreq->in_headers, "Icy-MetaData");
-  icy_is_requested = (param && strcmp(param, "1") == 0);
+  icy_is_requested = (format == MEDIA_FORMAT_MP3 && param && strcmp(param, "1") == 0);
   if (icy_is_requested)
     {
       httpd_header_add(hreq->out_headers, "icy-name", name);
@@ -279,19 +620,110 @@ streaming_mp3_handler(struct httpd_request *hreq)
       httpd_header_add(hreq->out_headers, "icy-metaint", buf);
     }
 
-  session = session_new(hreq, icy_is_requested, MEDIA_FORMAT_MP3, streaming_default_quality);
+  session = session_new(hreq, icy_is_requested, format, quality);
   if (!session)
     return -1; // Error sent by caller
 
   httpd_request_close_cb_set(hreq, conn_close_cb, session);
 
-  httpd_header_add(hreq->out_headers, "Content-Type", "audio/mpeg");
+  httpd_header_add(hreq->out_headers, "Content-Type", content_type);
   httpd_header_add(hreq->out_headers, "Server", PACKAGE_NAME "/" VERSION);
   httpd_header_add(hreq->out_headers, "Cache-Control", "no-cache");
   httpd_header_add(hreq->out_headers, "Pragma", "no-cache");
   httpd_header_add(hreq->out_headers, "Expires", "Mon, 31 Aug 2015 06:00:00 GMT");
 
-  httpd_send_reply_start(hreq, HTTP_OK, "OK");
+  httpd_send_reply_start(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP);
+
+  return 0;
+}
+
+static int
+streaming_mp3_handler(struct httpd_request *hreq)
+{
+  return streaming_handler(hreq, MEDIA_FORMAT_MP3, streaming_default_quality, "audio/mpeg");
+}
+
+static int
+streaming_opus_handler(struct httpd_request *hreq)
+{
+  return streaming_handler(hreq, MEDIA_FORMAT_OPUS, streaming_opus_quality, "audio/ogg");
+}
+
+static int
+streaming_flac_handler(struct httpd_request *hreq)
+{
+  return streaming_handler(hreq, MEDIA_FORMAT_FLAC, streaming_flac_quality, "audio/flac");
+}
+
+// Not realtime, since the HLS events need the worker evbase, see hls_start()
+static int
+streaming_hls_playlist_handler(struct httpd_request *hreq)
+{
+  struct hls_ctx stopped = { 0 };
+  int ret;
+
+  pthread_mutex_lock(&streaming_hls_lck);
+  clock_gettime(CLOCK_MONOTONIC, &streaming_hls.last_request);
+  if (!streaming_hls.is_started)
+    {
+      ret = hls_start(&stopped, &streaming_hls, hreq->evbase);
+      if (ret < 0)
+	{
+	  pthread_mutex_unlock(&streaming_hls_lck);
+	  hls_free(&stopped);
+	  return -1; // Error sent by caller
+	}
+    }
+
+  hls_playlist_make(hreq->out_body, &streaming_hls);
+  pthread_mutex_unlock(&streaming_hls_lck);
+
+  // The playlist changes with every segment
+  httpd_header_remove(hreq->out_headers, "Cache-Control");
+  httpd_header_add(hreq->out_headers, "Cache-Control", "public,max-age=1");
+  httpd_header_add(hreq->out_headers, "Content-Type", "application/vnd.apple.mpegurl");
+
+  httpd_send_reply(hreq, HTTP_OK, "OK", 0);
+
+  return 0;
+}
+
+static int
+streaming_hls_segment_handler(struct httpd_request *hreq)
+{
+  struct hls_segment *segment;
+  unsigned seq;
+
+  if (sscanf(hreq->path, "/hls/%u.mp3", &seq) != 1)
+    {
+      httpd_send_error(hreq, HTTP_BADREQUEST, "Bad Request");
+      return 0;
+    }
+
+  pthread_mutex_lock(&streaming_hls_lck);
+  clock_gettime(CLOCK_MONOTONIC, &streaming_hls.last_request);
+  segment = streaming_hls.segments[seq % HLS_SEGMENTS_MAX];
+  if (segment && segment->seq == seq)
+    __atomic_add_fetch(&segment->refcount, 1, __ATOMIC_RELAXED);
+  else
+    segment = NULL;
+  pthread_mutex_unlock(&streaming_hls_lck);
+
+  if (!segment)
+    {
+      httpd_send_error(hreq, HTTP_NOTFOUND, NULL);
+      return 0;
+    }
+
+  // Shared by all the listeners, so not copied
+  evbuffer_add_reference(hreq->out_body, segment->data, segment->len, hls_segment_cleanup_cb, segment);
+
+  // A segment never changes
+  httpd_header_remove(hreq->out_headers, "Cache-Control");
+  httpd_header_add(hreq->out_headers, "Cache-Control", "public,max-age=31536000,immutable");
+  httpd_header_add(hreq->out_headers, "Content-Type", "audio/mpeg");
+
+  httpd_send_reply(hreq, HTTP_OK, "OK", HTTPD_SEND_NO_GZIP);
 
   return 0;
 }
@@ -303,6 +735,24 @@ static struct httpd_uri_map streaming_handlers[] =
       .handler = streaming_mp3_handler,
       .flags = HTTPD_HANDLER_REALTIME,
     },
+    {
+      .regexp = "^/stream.ogg$",
+      .handler = streaming_opus_handler,
+      .flags = HTTPD_HANDLER_REALTIME,
+    },
+    {
+      .regexp = "^/stream.flac$",
+      .handler = streaming_flac_handler,
+      .flags = HTTPD_HANDLER_REALTIME,
+    },
+    {
+      .regexp = "^/hls/stream.m3u8$",
+      .handler = streaming_hls_playlist_handler,
+    },
+    {
+      .regexp = "^/hls/[0-9]+.mp3$",
+      .handler = streaming_hls_segment_handler,
+    },
     {
       .regexp = NULL,
       .handler = NULL
@@ -337,7 +787,7 @@ streaming_init(void)
   if (val % 11025 > 0 && val % 12000 > 0 && val % 8000 > 0)
     DPRINTF(E_LOG, L_STREAMING, "Unsupported streaming sample_rate=%d, defaulting\n", val);
   else
-    streaming_default_quality.sample_rate = val;
+    streaming_default_quality.sample_rate = streaming_flac_quality.sample_rate = val;
 
   val = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
   switch (val)
@@ -358,6 +808,12 @@ streaming_init(void)
     streaming_default_quality.sample_rate, streaming_default_quality.bits_per_sample,
     streaming_default_quality.channels, streaming_default_quality.bit_rate/1000);
 
+  val = cfg_getint(cfg_getsec(cfg, "streaming"), "opus_bit_rate");
+  if (val >= 6 && val <= 510)
+    streaming_opus_quality.bit_rate = val*1000;
+  else
+    DPRINTF(E_LOG, L_STREAMING, "Unsupported streaming opus_bit_rate=%d, supported range: 6..510, defaulting\n", val);
+
   val = cfg_getint(cfg_getsec(cfg, "streaming"), "icy_metaint");
   // Too low a value forces server to send more meta than data
   if (val >= 4096 && val <= 131072)
@@ -365,16 +821,39 @@ streaming_init(void)
   else
     DPRINTF(E_INFO, L_STREAMING, "Unsupported icy_metaint=%d, supported range: 4096..131072, defaulting to %d\n", val, streaming_icy_metaint);
 
+  CHECK_ERR(L_STREAMING, mutex_init(&streaming_icy_meta_lck));
+  CHECK_ERR(L_STREAMING, mutex_init(&streaming_hls_lck));
+
   return 0;
 }
 
+static void
+streaming_deinit(void)
+{
+  struct hls_ctx stopped;
+
+  icy_meta_unref(streaming_icy_meta);
+  streaming_icy_meta = NULL;
+
+  pthread_mutex_destroy(&streaming_icy_meta_lck);
+
+  pthread_mutex_lock(&streaming_hls_lck);
+  hls_stop(&stopped, &streaming_hls);
+  pthread_mutex_unlock(&streaming_hls_lck);
+
+  hls_free(&stopped);
+  pthread_mutex_destroy(&streaming_hls_lck);
+}
+
 struct httpd_module httpd_streaming =
 {
   .name = "Streaming",
   .type = MODULE_STREAMING,
   .logdomain = L_STREAMING,
-  .fullpaths = { "/stream.mp3", NULL },
+  .subpaths = { "/hls/", NULL },
+  .fullpaths = { "/stream.mp3", "/stream.ogg", "/stream.flac", NULL },
   .handlers = streaming_handlers,
   .init = streaming_init,
+  .deinit = streaming_deinit,
   .request = streaming_request,
 };
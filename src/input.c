@@ -28,6 +28,10 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -37,12 +41,18 @@
 #include "logger.h"
 #include "conffile.h"
 #include "commands.h"
+#include "worker.h"
 #include "input.h"
 
-// Disallow further writes to the buffer when its size exceeds this threshold.
-// The below gives us room to buffer 2 seconds of 48000/16/2 audio.
-#define INPUT_BUFFER_THRESHOLD STOB(96000, 16, 2)
-// How long (in nsec) to wait when the input buffer is full before looping
+// Disallow further writes to the buffer when it holds more than this threshold.
+// The threshold is time based, so the number of bytes depends on the quality of
+// the input. Until we know the quality we assume 48000/16/2.
+#define INPUT_BUFFER_THRESHOLD_QUALITY { 48000, 16, 2, 0 }
+// Initial size of the ring buffer, must be a power of two. The buffer will grow
+// if that isn't enough for the threshold and what the input may write on top of
+// it, e.g. for hi-res audio.
+#define INPUT_BUFFER_SIZE (1 << 20)
+// How long (in nsec) input_wait() waits for the player to read
 #define INPUT_LOOP_TIMEOUT_NSEC 10000000
 // How long (in sec) to keep an input open without the player reading from it
 #define INPUT_OPEN_TIMEOUT 600
@@ -92,28 +102,54 @@ struct marker
   struct marker *prev;
 };
 
+/* The buffer is a ring with one writer (the input thread or e.g. the spotify
+ * thread) and one reader (the player thread). The writer and the reader each
+ * have their own lock, so they never wait for each other. Only flush() and
+ * growing the ring take both locks. The positions are shared atomically: the
+ * writer copies data to the ring before it publishes the new bytes_written,
+ * and the reader copies data out before it publishes the new bytes_read.
+ */
 struct input_buffer
 {
   // Raw pcm stream data
-  struct evbuffer *evbuf;
+  uint8_t *data;
+  size_t size; // Power of two
+
+  // Total bytes written and read since last flush, the difference is what is
+  // in the ring. Written by one thread, read by both, so use atomic access.
+  uint64_t bytes_written;
+  uint64_t bytes_read;
 
   // If an input makes a write with a flag or a changed sample rate etc, we add
   // a marker to head, and when we read we check from the tail to see if there
-  // are updates to the player.
+  // are updates to the player. Protected by marker_lck. The position of the
+  // tail is kept in marker_pos (UINT64_MAX if none), so the reader only needs
+  // to take the lock when it reaches a marker.
   struct marker *marker_tail;
+  uint64_t marker_pos;
+  pthread_mutex_t marker_lck;
 
-  // Optional callback to player if buffer is full
+  // Optional callback to player if buffer is full, protected by write_lck
   input_cb full_cb;
 
+  // Number of bytes that is considered full, see threshold_update(). Written
+  // by the writer, read by both, so use atomic access.
+  size_t threshold;
+
   // Quality of write/read data
   struct media_quality cur_write_quality;
   struct media_quality cur_read_quality;
 
-  size_t bytes_written;
-  size_t bytes_read;
+  pthread_mutex_t write_lck;
+  pthread_mutex_t read_lck;
 
-  // Locks for sharing the buffer between input and player thread
-  pthread_mutex_t mutex;
+  // If set the writer is waiting for space, and the reader will signal when
+  // the length drops below the threshold. The input thread waits for the
+  // space_fd to become readable, other threads use input_wait().
+  bool wait_space;
+  int space_fd[2];
+  int nwaiters;
+  pthread_mutex_t wait_lck;
   pthread_cond_t cond;
 };
 
@@ -123,6 +159,23 @@ struct input_arg
   int seek_ms;
 };
 
+enum input_prepare_state
+{
+  INPUT_PREPARE_NONE,
+  INPUT_PREPARE_REQUESTED, // Waiting for the current source to near its end
+  INPUT_PREPARE_RUNNING,   // Being set up by a worker thread
+  INPUT_PREPARE_READY,
+};
+
+// The next item in the queue, set up ahead so that input_start() doesn't have
+// to wait for a slow source. Only touched by the input thread.
+struct input_prepared
+{
+  enum input_prepare_state state;
+  uint32_t item_id;
+  struct input_source source;
+};
+
 /* --- Globals --- */
 // Input thread
 static pthread_t tid_input;
@@ -131,14 +184,28 @@ static pthread_t tid_input;
 static struct event_base *evbase_input;
 static struct commands_base *cmdbase;
 static struct event *input_ev;
+static struct event *input_space_ev;
 static bool input_initialized;
 
 // The source we are reading now
 static struct input_source input_now_reading;
 
+// Where in the buffer and in the track we started writing input_now_reading
+static uint64_t input_now_reading_start_pos;
+static int input_now_reading_start_ms;
+
+// The next source, and how long before the end of input_now_reading to set it
+// up (0 = disabled)
+static struct input_prepared input_next;
+static int input_prepare_ms;
+
 // Input buffer
 static struct input_buffer input_buffer;
 
+// How much audio to buffer for local and network inputs
+static int input_buffer_ms;
+static int input_buffer_network_ms;
+
 // Timeout waiting in playback loop
 static struct timespec input_loop_timeout = { 0, INPUT_LOOP_TIMEOUT_NSEC };
 
@@ -156,6 +223,33 @@ int debug_underrun_trigger;
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
+static inline size_t
+buffer_threshold(void)
+{
+  return __atomic_load_n(&input_buffer.threshold, __ATOMIC_RELAXED);
+}
+
+// Sets the threshold so the buffer holds the configured duration of audio in
+// the given quality. Network inputs get a longer buffer, since they are the
+// ones that may stall. Only the writer calls this.
+static void
+threshold_update(enum input_types type, struct media_quality *quality)
+{
+  size_t threshold;
+  int ms;
+
+  ms = inputs[type]->network ? input_buffer_network_ms : input_buffer_ms;
+
+  threshold = STOB((uint64_t)quality->sample_rate * ms / 1000, quality->bits_per_sample, quality->channels);
+  if (threshold == 0 || threshold == input_buffer.threshold)
+    return;
+
+  DPRINTF(E_DBG, L_PLAYER, "Input buffer threshold is now %zu bytes (%d ms of %d/%d/%d)\n",
+    threshold, ms, quality->sample_rate, quality->bits_per_sample, quality->channels);
+
+  __atomic_store_n(&input_buffer.threshold, threshold, __ATOMIC_RELAXED);
+}
+
 static int
 map_data_kind(int data_kind)
 {
@@ -248,7 +342,7 @@ marker_free(struct marker *marker)
 }
 
 static void
-marker_add(size_t pos, short flag, void *flagdata)
+marker_add(uint64_t pos, short flag, void *flagdata)
 {
   struct marker *insert;
   struct marker *compare;
@@ -260,6 +354,8 @@ marker_add(size_t pos, short flag, void *flagdata)
   marker->flag = flag;
   marker->data = flagdata;
 
+  pthread_mutex_lock(&input_buffer.marker_lck);
+
   // We want the list to be ordered by pos, so we reverse through it and compare
   // each element with pos. Only if the element's pos is less than or equal to
   // pos do we keep reversing. If no reversing is possible then we insert as new
@@ -283,43 +379,84 @@ marker_add(size_t pos, short flag, void *flagdata)
       marker->prev = input_buffer.marker_tail;
       input_buffer.marker_tail = marker;
     }
+
+  __atomic_store_n(&input_buffer.marker_pos, input_buffer.marker_tail->pos, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&input_buffer.marker_lck);
+}
+
+// Returns the tail marker if it is at or before pos
+static struct marker *
+marker_pop(uint64_t pos)
+{
+  struct marker *marker;
+
+  if (__atomic_load_n(&input_buffer.marker_pos, __ATOMIC_ACQUIRE) > pos)
+    return NULL;
+
+  pthread_mutex_lock(&input_buffer.marker_lck);
+
+  marker = input_buffer.marker_tail;
+  if (marker && marker->pos <= pos)
+    {
+      input_buffer.marker_tail = marker->prev;
+      __atomic_store_n(&input_buffer.marker_pos, input_buffer.marker_tail ? input_buffer.marker_tail->pos : UINT64_MAX, __ATOMIC_RELEASE);
+    }
+  else
+    marker = NULL;
+
+  pthread_mutex_unlock(&input_buffer.marker_lck);
+
+  return marker;
 }
 
+// Must be called before the data from pos_start to pos_end is published, so
+// that the reader can't read past a marker before it is added
 static void
-markers_set(short flags, size_t write_size)
+markers_set(short flags, uint64_t pos_start, uint64_t pos_end)
 {
   struct media_quality *quality;
   struct input_metadata *metadata;
+  uint64_t bytes_read;
 
   if (flags & INPUT_FLAG_QUALITY)
     {
       quality = malloc(sizeof(struct media_quality));
       *quality = input_buffer.cur_write_quality;
-      marker_add(input_buffer.bytes_written - write_size, INPUT_FLAG_QUALITY, quality);
+      marker_add(pos_start, INPUT_FLAG_QUALITY, quality);
     }
 
   if (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR))
     {
+      bytes_read = __atomic_load_n(&input_buffer.bytes_read, __ATOMIC_ACQUIRE);
+
       // This controls when the player will open the next track in the queue
-      if (input_buffer.bytes_read + INPUT_BUFFER_THRESHOLD < input_buffer.bytes_written)
+      if (bytes_read + buffer_threshold() < pos_end)
 	// The player's read is behind, tell it to open when it reaches where
 	// we are minus the buffer size
-	marker_add(input_buffer.bytes_written - INPUT_BUFFER_THRESHOLD, INPUT_FLAG_START_NEXT, NULL);
+	marker_add(pos_end - buffer_threshold(), INPUT_FLAG_START_NEXT, NULL);
       else
 	// The player's read is close to our write, so open right away
-	marker_add(input_buffer.bytes_read, INPUT_FLAG_START_NEXT, NULL);
+	marker_add(bytes_read, INPUT_FLAG_START_NEXT, NULL);
 
-      marker_add(input_buffer.bytes_written, flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR), NULL);
+      marker_add(pos_end, flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR), NULL);
     }
 
   if (flags & INPUT_FLAG_METADATA)
     {
       metadata = metadata_get(&input_now_reading);
       if (metadata)
-	marker_add(input_buffer.bytes_written, INPUT_FLAG_METADATA, metadata);
+	marker_add(pos_end, INPUT_FLAG_METADATA, metadata);
     }
 }
 
+static inline size_t
+buffer_len(void)
+{
+  return __atomic_load_n(&input_buffer.bytes_written, __ATOMIC_ACQUIRE) - __atomic_load_n(&input_buffer.bytes_read, __ATOMIC_ACQUIRE);
+}
+
+// Must be called with write_lck held
 static inline void
 buffer_full_cb(void)
 {
@@ -330,6 +467,107 @@ buffer_full_cb(void)
   input_buffer.full_cb = NULL;
 }
 
+// Doubles the ring until it has room for len more bytes. Must be called with
+// write_lck held, and doesn't happen unless an input makes a very large write.
+static void
+buffer_grow(size_t len)
+{
+  uint8_t *data;
+  uint64_t pos;
+  size_t size;
+
+  pthread_mutex_lock(&input_buffer.read_lck);
+
+  size = input_buffer.size;
+  while (size - buffer_len() < len)
+    size *= 2;
+
+  DPRINTF(E_DBG, L_PLAYER, "Growing input buffer from %zu to %zu bytes\n", input_buffer.size, size);
+
+  CHECK_NULL(L_PLAYER, data = malloc(size));
+
+  for (pos = input_buffer.bytes_read; pos < input_buffer.bytes_written; pos++)
+    data[pos & (size - 1)] = input_buffer.data[pos & (input_buffer.size - 1)];
+
+  free(input_buffer.data);
+  input_buffer.data = data;
+  input_buffer.size = size;
+
+  pthread_mutex_unlock(&input_buffer.read_lck);
+}
+
+static void
+space_signal(void)
+{
+#ifdef HAVE_EVENTFD
+  eventfd_write(input_buffer.space_fd[1], 1);
+#else
+  uint8_t dummy = 1;
+
+  if (write(input_buffer.space_fd[1], &dummy, sizeof(dummy)) < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not signal input buffer space: %s\n", strerror(errno));
+#endif
+
+  if (__atomic_load_n(&input_buffer.nwaiters, __ATOMIC_ACQUIRE) > 0)
+    {
+      pthread_mutex_lock(&input_buffer.wait_lck);
+      pthread_cond_broadcast(&input_buffer.cond);
+      pthread_mutex_unlock(&input_buffer.wait_lck);
+    }
+}
+
+static void
+space_drain(void)
+{
+#ifdef HAVE_EVENTFD
+  eventfd_t count;
+
+  eventfd_read(input_buffer.space_fd[0], &count);
+#else
+  uint8_t dummy[16];
+
+  while (read(input_buffer.space_fd[0], dummy, sizeof(dummy)) > 0)
+    ; // Just emptying the pipe
+#endif
+}
+
+static int
+space_init(void)
+{
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  ret = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  input_buffer.space_fd[0] = input_buffer.space_fd[1] = ret;
+#else
+# ifdef HAVE_PIPE2
+  ret = pipe2(input_buffer.space_fd, O_CLOEXEC | O_NONBLOCK);
+# else
+  ret = pipe(input_buffer.space_fd);
+  if (ret == 0)
+    {
+      fcntl(input_buffer.space_fd[0], F_SETFL, O_NONBLOCK);
+      fcntl(input_buffer.space_fd[1], F_SETFL, O_NONBLOCK);
+    }
+# endif
+#endif
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not create input buffer signal fd: %s\n", strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+space_deinit(void)
+{
+  close(input_buffer.space_fd[0]);
+  if (input_buffer.space_fd[1] != input_buffer.space_fd[0])
+    close(input_buffer.space_fd[1]);
+}
+
 
 /* ------------------------- INPUT SOURCE HANDLING -------------------------- */
 
@@ -347,7 +585,8 @@ flush(short *flagptr)
   short flags;
   size_t len;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
+  pthread_mutex_lock(&input_buffer.read_lck);
 
   // We will return an OR of all the unread marker flags
   flags = 0;
@@ -358,19 +597,19 @@ flush(short *flagptr)
       marker_free(marker);
     }
 
-  len = evbuffer_get_length(input_buffer.evbuf);
-
-  evbuffer_drain(input_buffer.evbuf, len);
+  len = buffer_len();
 
   memset(&input_buffer.cur_read_quality, 0, sizeof(struct media_quality));
   memset(&input_buffer.cur_write_quality, 0, sizeof(struct media_quality));
 
-  input_buffer.bytes_read = 0;
-  input_buffer.bytes_written = 0;
+  __atomic_store_n(&input_buffer.marker_pos, UINT64_MAX, __ATOMIC_RELEASE);
+  __atomic_store_n(&input_buffer.bytes_read, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&input_buffer.bytes_written, 0, __ATOMIC_RELEASE);
 
   input_buffer.full_cb = NULL;
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.read_lck);
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
 #ifdef DEBUG_INPUT
   DPRINTF(E_DBG, L_PLAYER, "Flushing %zu bytes with flags %d\n", len, flags);
@@ -387,6 +626,8 @@ stop(void)
 
   event_del(input_open_timeout_ev);
   event_del(input_ev);
+  event_del(input_space_ev);
+  __atomic_store_n(&input_buffer.wait_space, false, __ATOMIC_RELEASE);
 
   type = input_now_reading.type;
 
@@ -468,6 +709,183 @@ setup(struct input_source *source, struct db_queue_item *queue_item, int seek_ms
   return -1;
 }
 
+/* ------------------------ PREPARING THE NEXT SOURCE ----------------------- */
+
+static void
+prepare_discard(void)
+{
+  if (input_next.state == INPUT_PREPARE_READY)
+    {
+      if (inputs[input_next.source.type]->stop && input_next.source.open)
+	inputs[input_next.source.type]->stop(&input_next.source);
+
+      clear(&input_next.source);
+    }
+
+  // If a worker is running it will discard the result, see prepare_done()
+  input_next.state = INPUT_PREPARE_NONE;
+  input_next.item_id = 0;
+}
+
+// Thread: input. The result from prepare_worker().
+static enum command_state
+prepare_done(void *arg, int *retval)
+{
+  struct input_source *source = arg;
+
+  if (input_next.state != INPUT_PREPARE_RUNNING || source->item_id != input_next.item_id || !source->open)
+    {
+      if (source->open && inputs[source->type]->stop)
+	inputs[source->type]->stop(source);
+      clear(source);
+
+      if (input_next.state == INPUT_PREPARE_RUNNING && source->item_id == input_next.item_id)
+	input_next.state = INPUT_PREPARE_NONE; // Setup failed
+      goto out;
+    }
+
+  DPRINTF(E_DBG, L_PLAYER, "Next input item '%s' (item id %" PRIu32 ") is ready\n", source->path, source->item_id);
+
+  input_next.source = *source; // Takes over ownership of the content
+  input_next.state = INPUT_PREPARE_READY;
+
+ out:
+  *retval = 0;
+  return COMMAND_END;
+}
+
+// Thread: worker
+static void
+prefetch_worker(void *arg)
+{
+  struct input_arg *cmdarg = arg;
+  struct db_queue_item *queue_item;
+  int type;
+
+  queue_item = db_queue_fetch_byitemid(cmdarg->item_id);
+  if (!queue_item)
+    return;
+
+  type = map_data_kind(queue_item->data_kind);
+  if (type >= 0 && inputs[type]->prefetch && !inputs[type]->disabled)
+    inputs[type]->prefetch(queue_item->path);
+
+  free_queue_item(queue_item, 0);
+}
+
+// Thread: worker. Only sources where setup only involves transcode (and thus
+// doesn't use the evbase of the input thread) are prepared.
+static void
+prepare_worker(void *arg)
+{
+  struct input_arg *cmdarg = arg;
+  struct db_queue_item *queue_item;
+  struct input_source *source;
+
+  CHECK_NULL(L_PLAYER, source = calloc(1, sizeof(struct input_source)));
+
+  queue_item = db_queue_fetch_byitemid(cmdarg->item_id);
+  if (queue_item && (queue_item->data_kind == DATA_KIND_FILE || queue_item->data_kind == DATA_KIND_HTTP))
+    setup(source, queue_item, 0);
+
+  free_queue_item(queue_item, 0);
+
+  // setup() clears the source on failure, but prepare_done() needs the id
+  source->item_id = cmdarg->item_id;
+
+  if (!input_initialized)
+    {
+      if (source->open && inputs[source->type]->stop)
+	inputs[source->type]->stop(source);
+      clear(source);
+      free(source);
+      return;
+    }
+
+  commands_exec_async(cmdbase, prepare_done, source);
+}
+
+// Starts setting up the next source when the writing of the current one is
+// input_prepare_ms from the end
+static void
+prepare_check(void)
+{
+  struct media_quality *quality = &input_buffer.cur_write_quality;
+  struct input_arg cmdarg;
+  uint64_t bytes_per_ms;
+  uint64_t pos_ms;
+
+  if (input_next.state != INPUT_PREPARE_REQUESTED || input_now_reading.len_ms == 0)
+    return;
+
+  bytes_per_ms = STOB(quality->sample_rate, quality->bits_per_sample, quality->channels) / 1000;
+  if (bytes_per_ms == 0)
+    return;
+
+  pos_ms = input_now_reading_start_ms + (__atomic_load_n(&input_buffer.bytes_written, __ATOMIC_ACQUIRE) - input_now_reading_start_pos) / bytes_per_ms;
+  if (pos_ms + input_prepare_ms < input_now_reading.len_ms && input_now_reading.open)
+    return;
+
+  DPRINTF(E_DBG, L_PLAYER, "Preparing next input item (item id %" PRIu32 ")\n", input_next.item_id);
+
+  cmdarg.item_id = input_next.item_id;
+  cmdarg.seek_ms = 0;
+
+  input_next.state = INPUT_PREPARE_RUNNING;
+  worker_execute(prepare_worker, &cmdarg, sizeof(struct input_arg), 0);
+}
+
+static enum command_state
+prepare(void *arg, int *retval)
+{
+  struct input_arg *cmdarg = arg;
+
+  if (input_next.state != INPUT_PREPARE_NONE && input_next.item_id == cmdarg->item_id)
+    goto out;
+
+  prepare_discard();
+
+  input_next.state = INPUT_PREPARE_REQUESTED;
+  input_next.item_id = cmdarg->item_id;
+
+  // Until the item is set up we can at least let the input get the data moving
+  worker_execute(prefetch_worker, cmdarg, sizeof(struct input_arg), 0);
+
+ out:
+  *retval = 0;
+  return COMMAND_END;
+}
+
+// Hands over the prepared source to input_now_reading. Returns the seek result
+// like setup().
+static int
+prepared_use(struct input_source *source, int seek_ms)
+{
+  int ret;
+
+  DPRINTF(E_DBG, L_PLAYER, "Using prepared input item '%s' (item id %" PRIu32 ")\n", input_next.source.path, input_next.source.item_id);
+
+  *source = input_next.source;
+  memset(&input_next.source, 0, sizeof(struct input_source));
+  input_next.state = INPUT_PREPARE_NONE;
+  input_next.item_id = 0;
+
+  if (seek_ms <= 0)
+    return 0;
+
+  ret = seek(source, seek_ms);
+  if (ret < 0)
+    {
+      stop();
+      return -1;
+    }
+
+  return ret;
+}
+
+
+/* ------------------------------- INPUT COMMANDS --------------------------- */
+
 static enum command_state
 start(void *arg, int *retval)
 {
@@ -484,6 +902,15 @@ start(void *arg, int *retval)
       if (ret < 0)
 	DPRINTF(E_WARN, L_PLAYER, "Ignoring failed seek to %d ms in '%s'\n", cmdarg->seek_ms, input_now_reading.path);
     }
+  else if (input_next.state == INPUT_PREPARE_READY && cmdarg->item_id == input_next.item_id)
+    {
+      if (input_now_reading.open)
+	stop();
+
+      ret = prepared_use(&input_now_reading, cmdarg->seek_ms);
+      if (ret < 0)
+	goto error;
+    }
   else
     {
       if (input_now_reading.open)
@@ -506,6 +933,9 @@ start(void *arg, int *retval)
   DPRINTF(E_DBG, L_PLAYER, "Starting input read loop for item '%s' (item id %" PRIu32 "), seek %d\n",
     input_now_reading.path, input_now_reading.item_id, cmdarg->seek_ms);
 
+  input_now_reading_start_pos = __atomic_load_n(&input_buffer.bytes_written, __ATOMIC_ACQUIRE);
+  input_now_reading_start_ms = (ret > 0) ? ret : 0;
+
   event_add(input_open_timeout_ev, &input_open_timeout);
   event_active(input_ev, 0, 0);
 
@@ -545,6 +975,7 @@ static enum command_state
 stop_cmd(void *arg, int *retval)
 {
   stop();
+  prepare_discard();
 
   *retval = 0;
   return COMMAND_END;
@@ -553,7 +984,7 @@ stop_cmd(void *arg, int *retval)
 static void
 timeout_cb(int fd, short what, void *arg)
 {
-  if (input_buffer.bytes_read > 0)
+  if (__atomic_load_n(&input_buffer.bytes_read, __ATOMIC_ACQUIRE) > 0)
     return;
 
   DPRINTF(E_WARN, L_PLAYER, "Timed out after %d sec without any reading from input source\n", INPUT_OPEN_TIMEOUT);
@@ -569,11 +1000,15 @@ timeout_cb(int fd, short what, void *arg)
 int
 input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 {
+  uint64_t pos_start;
+  uint64_t pos;
+  size_t offset;
+  size_t chunk;
   bool read_end;
   size_t len;
   int ret;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
 
   read_end = (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR));
   if (read_end)
@@ -582,7 +1017,10 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
       input_now_reading.open = false;
     }
 
-  if ((evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD) && evbuf)
+  if (quality)
+    threshold_update(input_now_reading.type, quality);
+
+  if ((buffer_len() > buffer_threshold()) && evbuf)
     {
       buffer_full_cb();
 
@@ -590,7 +1028,7 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
       // buffer is full. There is no point in holding back the input in that case.
       if (!read_end)
 	{
-	  pthread_mutex_unlock(&input_buffer.mutex);
+	  pthread_mutex_unlock(&input_buffer.write_lck);
 	  return EAGAIN;
 	}
     }
@@ -603,6 +1041,7 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 
   ret = 0;
   len = 0;
+  pos_start = input_buffer.bytes_written; // Only we change it
   if (evbuf)
     {
       len = evbuffer_get_length(evbuf);
@@ -616,35 +1055,103 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 	  len = 0;
 	}
 #endif
-      input_buffer.bytes_written += len;
-      ret = evbuffer_add_buffer(input_buffer.evbuf, evbuf);
-      if (ret < 0)
+      if (input_buffer.size - buffer_len() < len)
+	buffer_grow(len);
+
+      // Copy to the ring, in two chunks if we wrap around
+      for (pos = pos_start; pos < pos_start + len; pos += chunk)
 	{
-	  DPRINTF(E_LOG, L_PLAYER, "Error adding stream data to input buffer, stopping\n");
-	  input_stop();
-	  flags |= INPUT_FLAG_ERROR;
+	  offset = pos & (input_buffer.size - 1);
+	  chunk = MIN(pos_start + len - pos, input_buffer.size - offset);
+	  if (evbuffer_remove(evbuf, input_buffer.data + offset, chunk) != chunk)
+	    {
+	      DPRINTF(E_LOG, L_PLAYER, "Error adding stream data to input buffer, stopping\n");
+	      input_stop();
+	      flags |= INPUT_FLAG_ERROR;
+	      ret = -1;
+	      len = pos - pos_start;
+	      break;
+	    }
 	}
     }
 
   if (flags)
-    markers_set(flags, len);
+    markers_set(flags, pos_start, pos_start + len);
+
+  // Publish the data to the reader
+  __atomic_store_n(&input_buffer.bytes_written, pos_start + len, __ATOMIC_RELEASE);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
   return ret;
 }
 
+int
+input_write_fd(int fd, size_t size, struct media_quality *quality, short flags)
+{
+  uint64_t pos_start;
+  size_t offset;
+  ssize_t len;
+
+  pthread_mutex_lock(&input_buffer.write_lck);
+
+  threshold_update(input_now_reading.type, quality);
+
+  if (buffer_len() > buffer_threshold())
+    {
+      buffer_full_cb();
+      pthread_mutex_unlock(&input_buffer.write_lck);
+      errno = EAGAIN;
+      return -1;
+    }
+
+  if (input_buffer.size - buffer_len() < size)
+    buffer_grow(size);
+
+  // Only read up to the end of the ring, the next call will continue from the
+  // start of it
+  pos_start = input_buffer.bytes_written; // Only we change it
+  offset = pos_start & (input_buffer.size - 1);
+  len = read(fd, input_buffer.data + offset, MIN(size, input_buffer.size - offset));
+  if (len <= 0)
+    {
+      pthread_mutex_unlock(&input_buffer.write_lck);
+      return len;
+    }
+
+  if (!quality_is_equal(quality, &input_buffer.cur_write_quality))
+    {
+      input_buffer.cur_write_quality = *quality;
+      flags |= INPUT_FLAG_QUALITY;
+    }
+
+  if (flags)
+    markers_set(flags, pos_start, pos_start + len);
+
+  // Publish the data to the reader
+  __atomic_store_n(&input_buffer.bytes_written, pos_start + len, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&input_buffer.write_lck);
+
+  return len;
+}
+
 int
 input_wait(void)
 {
   struct timespec ts;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.wait_lck);
+
+  __atomic_add_fetch(&input_buffer.nwaiters, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&input_buffer.wait_space, true, __ATOMIC_RELEASE);
 
   ts = timespec_reltoabs(input_loop_timeout);
-  pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
+  pthread_cond_timedwait(&input_buffer.cond, &input_buffer.wait_lck, &ts);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  __atomic_sub_fetch(&input_buffer.nwaiters, 1, __ATOMIC_ACQ_REL);
+
+  pthread_mutex_unlock(&input_buffer.wait_lck);
   return 0;
 }
 
@@ -656,6 +1163,8 @@ input(void *arg)
 {
   int ret;
 
+  thread_realtime_apply("input");
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -678,30 +1187,30 @@ input(void *arg)
   pthread_exit(NULL);
 }
 
+// Returns -1 if the buffer is full, in which case input_space_ev will fire when
+// the player has read enough
 static int
 wait_buffer_ready(void)
 {
-  struct timespec ts;
-
-  pthread_mutex_lock(&input_buffer.mutex);
+  if (buffer_len() <= buffer_threshold())
+    return 0;
 
-  // Is the buffer full? Then wait for a read or for loop_timeout to elapse
-  if (evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD)
-    {
-      buffer_full_cb();
+  pthread_mutex_lock(&input_buffer.write_lck);
+  buffer_full_cb();
+  pthread_mutex_unlock(&input_buffer.write_lck);
 
-      ts = timespec_reltoabs(input_loop_timeout);
-      pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
+  // Set the flag before checking again, so we don't miss a read in between
+  __atomic_store_n(&input_buffer.wait_space, true, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-      if (evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD)
-	{
-	  pthread_mutex_unlock(&input_buffer.mutex);
-	  return -1;
-	}
+  if (buffer_len() <= buffer_threshold())
+    {
+      __atomic_store_n(&input_buffer.wait_space, false, __ATOMIC_RELEASE);
+      return 0;
     }
 
-  pthread_mutex_unlock(&input_buffer.mutex);
-  return 0;
+  event_add(input_space_ev, NULL);
+  return -1;
 }
 
 static void
@@ -715,67 +1224,99 @@ play(evutil_socket_t fd, short flags, void *arg)
   if (!inputs[input_now_reading.type]->play)
     return;
 
-  // If the buffer is full we wait until either the player has consumed enough
-  // data or INPUT_LOOP_TIMEOUT has elapsed (so we don't hang the input event
-  // thread when the player doesn't consume data quickly). If the return is
-  // negative then the buffer is still full, so we loop.
+  // If the buffer is full we wait until the player has consumed enough data,
+  // which will trigger input_space_ev
   ret = wait_buffer_ready();
   if (ret < 0)
-    {
-      event_add(input_ev, &tv);
-      return;
-    }
+    return;
 
   // Return will be negative if there is an error or EOF. Here, we just don't
   // loop any more. input_write() will pass the message to the player.
   ret = inputs[input_now_reading.type]->play(&input_now_reading);
+
+  if (input_prepare_ms > 0)
+    prepare_check();
+
   if (ret < 0)
     {
       input_now_reading.open = false;
       return; // Error or EOF, so don't come back
     }
 
+  // The input wants a break, e.g. before reconnecting
+  tv.tv_sec = ret / 1000;
+  tv.tv_usec = (ret % 1000) * 1000;
+
   event_add(input_ev, &tv);
 }
 
+static void
+space_cb(evutil_socket_t fd, short flags, void *arg)
+{
+  struct timeval tv = { 0, 0 };
+
+  space_drain();
+
+  if (input_now_reading.open)
+    event_add(input_ev, &tv);
+}
+
 
 /* ---------------------- Interface towards player thread ------------------- */
 /*                                Thread: player                              */
 
+size_t
+input_buffer_fill(void)
+{
+  return buffer_len();
+}
+
 int
 input_read(void *data, size_t size, short *flag, void **flagdata)
 {
   struct marker *marker;
-  int len;
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  size_t offset;
+  size_t chunk;
+  size_t len;
 
   *flag = 0;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.read_lck);
+
+  // Only we change bytes_read (except flush, which holds our lock)
+  bytes_read = input_buffer.bytes_read;
+  bytes_written = __atomic_load_n(&input_buffer.bytes_written, __ATOMIC_ACQUIRE);
+  size = MIN(size, bytes_written - bytes_read);
 
   // First we check if there is a marker in the requested samples. If there is,
   // we only return data up until that marker. That way we don't have to deal
   // with multiple markers, and we don't return data that contains mixed sample
   // rates, bits per sample or an EOF in the middle.
-  marker = input_buffer.marker_tail;
-  if (marker && marker->pos <= input_buffer.bytes_read + size)
+  marker = marker_pop(bytes_read + size);
+  if (marker)
     {
       *flag = marker->flag;
       *flagdata = marker->data;
 
-      size = marker->pos - input_buffer.bytes_read;
-      input_buffer.marker_tail = marker->prev;
+      size = (marker->pos > bytes_read) ? marker->pos - bytes_read : 0;
       free(marker);
     }
 
-  len = evbuffer_remove(input_buffer.evbuf, data, size);
-  if (len < 0)
+  // Copy from the ring, in two chunks if we wrap around
+  for (len = 0; len < size; len += chunk)
     {
-      DPRINTF(E_LOG, L_PLAYER, "Error reading stream data from input buffer\n");
-      *flag = INPUT_FLAG_ERROR;
-      goto out_unlock;
+      offset = (bytes_read + len) & (input_buffer.size - 1);
+      chunk = MIN(size - len, input_buffer.size - offset);
+      memcpy((uint8_t *)data + len, input_buffer.data + offset, chunk);
     }
 
-  input_buffer.bytes_read += len;
+  __atomic_store_n(&input_buffer.bytes_read, bytes_read + len, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in wait_buffer_ready(), so that either we see that the
+  // writer is waiting, or the writer sees what we just read
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
 #ifdef DEBUG_INPUT
   // Logs if flags present or each 10 seconds
@@ -788,25 +1329,30 @@ input_read(void *data, size_t size, short *flag, void **flagdata)
   if (*flag || (debug_elapsed > 10 * one_sec_size))
     {
       debug_elapsed = 0;
-      DPRINTF(E_DBG, L_PLAYER, "READ %zu bytes (%d/%d/%d), WROTE %zu bytes (%d/%d/%d), DIFF %zu, SIZE %zu/%d, FLAGS %04x\n",
-        input_buffer.bytes_read,
+      DPRINTF(E_DBG, L_PLAYER, "READ %" PRIu64 " bytes (%d/%d/%d), WROTE %" PRIu64 " bytes (%d/%d/%d), DIFF %" PRIu64 ", SIZE %zu/%zu, FLAGS %04x\n",
+        bytes_read + len,
         input_buffer.cur_read_quality.sample_rate,
         input_buffer.cur_read_quality.bits_per_sample,
         input_buffer.cur_read_quality.channels,
-        input_buffer.bytes_written,
+        bytes_written,
         input_buffer.cur_write_quality.sample_rate,
         input_buffer.cur_write_quality.bits_per_sample,
         input_buffer.cur_write_quality.channels,
-        input_buffer.bytes_written - input_buffer.bytes_read,
-        evbuffer_get_length(input_buffer.evbuf),
-        INPUT_BUFFER_THRESHOLD,
+        bytes_written - bytes_read - len,
+        input_buffer.size,
+        buffer_threshold(),
         *flag);
     }
 #endif
 
- out_unlock:
-  pthread_cond_signal(&input_buffer.cond);
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.read_lck);
+
+  // Wake the writer if it is waiting for space
+  if (__atomic_load_n(&input_buffer.wait_space, __ATOMIC_RELAXED) && buffer_len() <= buffer_threshold())
+    {
+      if (__atomic_exchange_n(&input_buffer.wait_space, false, __ATOMIC_ACQ_REL))
+	space_signal();
+    }
 
   return len;
 }
@@ -814,10 +1360,10 @@ input_read(void *data, size_t size, short *flag, void **flagdata)
 void
 input_buffer_full_cb(input_cb cb)
 {
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_buffer.write_lck);
   input_buffer.full_cb = cb;
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_buffer.write_lck);
 }
 
 int
@@ -869,6 +1415,22 @@ input_stop_sync(void)
   commands_exec_sync(cmdbase, stop_cmd, NULL, NULL);
 }
 
+void
+input_prepare(uint32_t item_id)
+{
+  struct input_arg *cmdarg;
+
+  if (input_prepare_ms == 0)
+    return;
+
+  CHECK_NULL(L_PLAYER, cmdarg = malloc(sizeof(struct input_arg)));
+
+  cmdarg->item_id = item_id;
+  cmdarg->seek_ms = 0;
+
+  commands_exec_async(cmdbase, prepare, cmdarg);
+}
+
 void
 input_flush(short *flags)
 {
@@ -890,12 +1452,26 @@ input_init(void)
   int i;
 
   // Prepare input buffer
-  CHECK_ERR(L_PLAYER, mutex_init(&input_buffer.mutex));
+  CHECK_ERR(L_PLAYER, mutex_init(&input_buffer.write_lck));
+  CHECK_ERR(L_PLAYER, mutex_init(&input_buffer.read_lck));
+  CHECK_ERR(L_PLAYER, mutex_init(&input_buffer.marker_lck));
+  CHECK_ERR(L_PLAYER, mutex_init(&input_buffer.wait_lck));
   CHECK_ERR(L_PLAYER, pthread_cond_init(&input_buffer.cond, NULL));
+  CHECK_ERR(L_PLAYER, space_init());
+
+  input_prepare_ms = 1000 * cfg_getint(cfg_getsec(cfg, "general"), "prepare_next_seconds");
+
+  input_buffer_ms = cfg_getint(cfg_getsec(cfg, "general"), "input_buffer_ms");
+  input_buffer_network_ms = cfg_getint(cfg_getsec(cfg, "general"), "input_buffer_network_ms");
+  threshold_update(INPUT_TYPE_FILE, &(struct media_quality)INPUT_BUFFER_THRESHOLD_QUALITY);
+
+  input_buffer.size = INPUT_BUFFER_SIZE;
+  input_buffer.marker_pos = UINT64_MAX;
+  CHECK_NULL(L_PLAYER, input_buffer.data = malloc(input_buffer.size));
 
   CHECK_NULL(L_PLAYER, evbase_input = event_base_new());
-  CHECK_NULL(L_PLAYER, input_buffer.evbuf = evbuffer_new());
   CHECK_NULL(L_PLAYER, input_ev = event_new(evbase_input, -1, EV_PERSIST, play, NULL));
+  CHECK_NULL(L_PLAYER, input_space_ev = event_new(evbase_input, input_buffer.space_fd[0], EV_READ, space_cb, NULL));
   CHECK_NULL(L_PLAYER, input_open_timeout_ev = evtimer_new(evbase_input, timeout_cb, NULL));
 
   no_input = 1;
@@ -940,9 +1516,11 @@ input_init(void)
   commands_base_free(cmdbase);
  input_fail:
   event_free(input_open_timeout_ev);
+  event_free(input_space_ev);
   event_free(input_ev);
-  evbuffer_free(input_buffer.evbuf);
   event_base_free(evbase_input);
+  free(input_buffer.data);
+  space_deinit();
   return -1;
 }
 
@@ -974,11 +1552,16 @@ input_deinit(void)
     }
 
   pthread_cond_destroy(&input_buffer.cond);
-  pthread_mutex_destroy(&input_buffer.mutex);
+  pthread_mutex_destroy(&input_buffer.wait_lck);
+  pthread_mutex_destroy(&input_buffer.marker_lck);
+  pthread_mutex_destroy(&input_buffer.read_lck);
+  pthread_mutex_destroy(&input_buffer.write_lck);
 
   event_free(input_open_timeout_ev);
+  event_free(input_space_ev);
   event_free(input_ev);
-  evbuffer_free(input_buffer.evbuf);
   event_base_free(evbase_input);
+  free(input_buffer.data);
+  space_deinit();
 }
 
@@ -111,10 +111,15 @@ struct input_definition
   // Set to 1 if the input initialization failed
   char disabled;
 
+  // Set to 1 if the input reads from the network, so it should buffer more
+  char network;
+
   // Prepare a playback session
   int (*setup)(struct input_source *source);
 
-  // One iteration of the playback loop (= a read operation from source)
+  // One iteration of the playback loop (= a read operation from source). Returns
+  // negative on error or EOF, otherwise the number of ms to wait before the next
+  // iteration (normally 0)
   int (*play)(struct input_source *source);
 
   // Cleans up (only required when stopping source before it ends itself)
@@ -126,6 +131,10 @@ struct input_definition
   // Return metadata
   int (*metadata_get)(struct input_metadata *metadata, struct input_source *source);
 
+  // Optional hint that the item with the given path is up next. Called from a
+  // worker thread, so it may block, e.g. while a disk spins up.
+  void (*prefetch)(const char *path);
+
   // Initialization function called during startup
   int (*init)(void);
 
@@ -150,6 +159,20 @@ struct input_definition
 int
 input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags);
 
+/*
+ * Like input_write(), but reads the data directly from a file descriptor into
+ * the input buffer, which saves a copy.
+ *
+ * @in  fd       File descriptor to read from (should be non-blocking)
+ * @in  size     Max number of bytes to read
+ * @in  quality  Quality of the data (input backend should keep it in memory)
+ * @in  flags    One or more INPUT_FLAG_*, only set if data was read
+ * @return       Bytes read, 0 on EOF, -1 on error with errno set. The errno
+ *               is EAGAIN if there was no data or the input buffer is full.
+ */
+int
+input_write_fd(int fd, size_t size, struct media_quality *quality, short flags);
+
 /*
  * Input modules can use this to wait for the player to read, so the module's
  * playback-loop doesn't spin out of control.
@@ -173,6 +196,12 @@ input_wait(void);
 int
 input_read(void *data, size_t size, short *flag, void **flagdata);
 
+/*
+ * Returns the number of bytes currently in the input buffer. Will not block.
+ */
+size_t
+input_buffer_fill(void);
+
 /*
  * Player can set this to get a callback from the input when the input buffer
  * is full. The player may use this to resume playback after an underrun.
@@ -219,6 +248,16 @@ input_resume(uint32_t item_id, int seek_ms);
 void
 input_stop(void);
 
+/*
+ * Tells the input which item will be started after the current one. The input
+ * will set it up a bit before the current item has been read, so that it can
+ * start without delay (async).
+ *
+ * @in  item_id  Queue item id of the next item
+ */
+void
+input_prepare(uint32_t item_id);
+
 /*
  * Flush input buffer. Output flags will be the same as input_read(). Call with
  * null pointer is valid.
@@ -16,14 +16,21 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <fcntl.h>
 
 #include <event2/buffer.h>
 
 #include "transcode.h"
+#include "cache.h"
+#include "conffile.h"
 #include "misc.h"
 #include "logger.h"
 #include "input.h"
@@ -33,6 +40,69 @@
 // Important! If you change any of the below then consider if the change also
 // should be made in http.c
 
+// Asks the kernel to read the beginning of the file into the page cache, so
+// that slow storage (spun down disks, NFS) doesn't stall playback. May block
+// while the storage wakes up, so setup() only calls this after ffmpeg has
+// opened the file.
+static void
+readahead_hint(const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+  off_t len;
+  int fd;
+  int ret;
+
+  len = (off_t)cfg_getint(cfg_getsec(cfg, "general"), "file_readahead_mb") * 1024 * 1024;
+  if (len <= 0)
+    return;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  ret = posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+  if (ret != 0)
+    DPRINTF(E_DBG, L_PLAYER, "posix_fadvise() failed for '%s' with error %d\n", path, ret);
+
+  close(fd);
+#endif
+}
+
+static void
+seek_index_load(struct input_source *source, struct transcode_ctx *ctx)
+{
+  struct evbuffer *evbuf;
+  int cached;
+  int ret;
+
+  if (source->id == 0)
+    return;
+
+  CHECK_NULL(L_PLAYER, evbuf = evbuffer_new());
+
+  ret = cache_xcode_seekindex_get(evbuf, &cached, source->id);
+  if (ret == 0 && cached && transcode_seek_index_set(ctx, evbuf) == 0)
+    DPRINTF(E_DBG, L_PLAYER, "Using cached seek index for '%s'\n", source->path);
+
+  evbuffer_free(evbuf);
+}
+
+static void
+seek_index_save(struct input_source *source, struct transcode_ctx *ctx)
+{
+  struct evbuffer *evbuf;
+
+  if (!ctx || source->id == 0)
+    return;
+
+  CHECK_NULL(L_PLAYER, evbuf = evbuffer_new());
+
+  if (transcode_seek_index_get(evbuf, ctx) == 0)
+    cache_xcode_seekindex_add(source->id, evbuf);
+
+  evbuffer_free(evbuf);
+}
+
 static int
 setup(struct input_source *source)
 {
@@ -50,6 +120,10 @@ setup(struct input_source *source)
   source->quality.bits_per_sample = transcode_encode_query(ctx->encode_ctx, "bits_per_sample");
   source->quality.channels = transcode_encode_query(ctx->encode_ctx, "channels");
 
+  seek_index_load(source, ctx);
+
+  readahead_hint(source->path);
+
   source->input_ctx = ctx;
 
   return 0;
@@ -60,6 +134,7 @@ stop(struct input_source *source)
 {
   struct transcode_ctx *ctx = source->input_ctx;
 
+  seek_index_save(source, ctx);
   transcode_cleanup(&ctx);
 
   if (source->evbuf)
@@ -104,6 +179,12 @@ seek(struct input_source *source, int seek_ms)
   return transcode_seek(source->input_ctx, seek_ms);
 }
 
+static void
+prefetch(const char *path)
+{
+  readahead_hint(path);
+}
+
 struct input_definition input_file =
 {
   .name = "file",
@@ -113,4 +194,5 @@ struct input_definition input_file =
   .play = play,
   .stop = stop,
   .seek = seek,
+  .prefetch = prefetch,
 };
@@ -27,6 +27,7 @@
 #include <event2/buffer.h>
 
 #include "transcode.h"
+#include "cache.h"
 #include "http.h"
 #include "misc.h"
 #include "misc_json.h"
@@ -36,6 +37,33 @@
 #include "worker.h"
 #include "input.h"
 
+// How many times in a row we try to reopen a stream that failed
+#define HTTP_RECONNECT_MAX 5
+// Wait between attempts, multiplied by the number of the attempt
+#define HTTP_RECONNECT_DELAY_MS 1000
+// If a stream with a known length ends this long before it should, we assume
+// that the connection was dropped
+#define HTTP_EOF_SLACK_MS 10000
+
+struct http_ctx
+{
+  struct transcode_ctx *xcode;
+
+  // Bytes of decoded audio we have delivered, so we know where to resume
+  uint64_t bytes;
+  // Value of the above at the last reconnect, lets us detect streams that are
+  // just shorter than their length says
+  uint64_t bytes_at_reconnect;
+
+  // Number of consecutive failed reconnect attempts
+  int failures;
+  bool reconnect_pending;
+  int reconnects;
+};
+
+// Total number of reconnects since startup
+static int http_reconnects_total;
+
 struct prepared_metadata
 {
   // Parsed metadata goes here
@@ -279,7 +307,9 @@ metadata_prepare(struct input_source *source)
   struct http_icy_metadata *m;
   int changed;
 
-  m = transcode_metadata(source->input_ctx, &changed);
+  struct http_ctx *hctx = source->input_ctx;
+
+  m = transcode_metadata(hctx->xcode, &changed);
   if (!m)
     return -1;
 
@@ -312,12 +342,123 @@ metadata_prepare(struct input_source *source)
 // Important! If you change any of the below then consider if the change also
 // should be made in file.c
 
-static int
-setup(struct input_source *source)
+static void
+seek_index_load(struct input_source *source, struct transcode_ctx *ctx)
+{
+  struct evbuffer *evbuf;
+  int cached;
+  int ret;
+
+  if (source->id == 0)
+    return;
+
+  CHECK_NULL(L_PLAYER, evbuf = evbuffer_new());
+
+  ret = cache_xcode_seekindex_get(evbuf, &cached, source->id);
+  if (ret == 0 && cached && transcode_seek_index_set(ctx, evbuf) == 0)
+    DPRINTF(E_DBG, L_PLAYER, "Using cached seek index for '%s'\n", source->path);
+
+  evbuffer_free(evbuf);
+}
+
+static void
+seek_index_save(struct input_source *source, struct transcode_ctx *ctx)
+{
+  struct evbuffer *evbuf;
+
+  if (!ctx || source->id == 0)
+    return;
+
+  CHECK_NULL(L_PLAYER, evbuf = evbuffer_new());
+
+  if (transcode_seek_index_get(evbuf, ctx) == 0)
+    cache_xcode_seekindex_add(source->id, evbuf);
+
+  evbuffer_free(evbuf);
+}
+
+static uint64_t
+bytes_per_ms(struct media_quality *quality)
 {
-  struct transcode_decode_setup_args decode_args = { .profile = XCODE_PCM_NATIVE, .is_http = true, .len_ms = source->len_ms };
+  return STOB(quality->sample_rate, quality->bits_per_sample, quality->channels) / 1000;
+}
+
+static struct transcode_ctx *
+xcode_open(struct input_source *source)
+{
+  struct transcode_decode_setup_args decode_args = { .profile = XCODE_PCM_NATIVE, .is_http = true, .len_ms = source->len_ms, .path = source->path };
   struct transcode_encode_setup_args encode_args = { .profile = XCODE_PCM_NATIVE, };
   struct transcode_ctx *ctx;
+
+  ctx = transcode_setup(decode_args, encode_args);
+  if (!ctx)
+    return NULL;
+
+  source->quality.sample_rate = transcode_encode_query(ctx->encode_ctx, "sample_rate");
+  source->quality.bits_per_sample = transcode_encode_query(ctx->encode_ctx, "bits_per_sample");
+  source->quality.channels = transcode_encode_query(ctx->encode_ctx, "channels");
+
+  return ctx;
+}
+
+// Reopens the stream, and if it has a known length, resumes from where we got
+// to (ffmpeg will make a range request). Live streams just start over.
+static int
+reconnect(struct input_source *source)
+{
+  struct http_ctx *hctx = source->input_ctx;
+  uint64_t bpms;
+  int seek_ms;
+  int ret;
+
+  bpms = bytes_per_ms(&source->quality);
+  seek_ms = (source->len_ms > 0 && bpms > 0) ? hctx->bytes / bpms : 0;
+
+  transcode_cleanup(&hctx->xcode);
+
+  hctx->xcode = xcode_open(source);
+  if (!hctx->xcode)
+    return -1;
+
+  if (seek_ms > 0)
+    {
+      ret = transcode_seek(hctx->xcode, seek_ms);
+      if (ret < 0)
+	{
+	  transcode_cleanup(&hctx->xcode);
+	  return -1;
+	}
+    }
+
+  hctx->bytes_at_reconnect = hctx->bytes;
+  hctx->reconnects++;
+  http_reconnects_total++;
+
+  DPRINTF(E_INFO, L_PLAYER, "Reconnected to '%s' at %d ms (reconnects %d, total since startup %d)\n",
+    source->path, seek_ms, hctx->reconnects, http_reconnects_total);
+
+  return 0;
+}
+
+// Returns true if the stream ended long before its length says it should, and
+// we got some data since the last reconnect
+static bool
+eof_is_premature(struct input_source *source)
+{
+  struct http_ctx *hctx = source->input_ctx;
+  uint64_t bpms;
+
+  bpms = bytes_per_ms(&source->quality);
+  if (source->len_ms == 0 || bpms == 0 || hctx->bytes == hctx->bytes_at_reconnect)
+    return false;
+
+  return (hctx->bytes / bpms + HTTP_EOF_SLACK_MS < source->len_ms);
+}
+
+static int
+setup(struct input_source *source)
+{
+  struct http_ctx *hctx;
   char *url;
 
   if (http_stream_setup(&url, source->path) < 0)
@@ -325,19 +466,21 @@ setup(struct input_source *source)
 
   free(source->path);
   source->path = url;
-  decode_args.path = url;
 
-  ctx = transcode_setup(decode_args, encode_args);
-  if (!ctx)
-    return -1;
+  CHECK_NULL(L_PLAYER, hctx = calloc(1, sizeof(struct http_ctx)));
+
+  hctx->xcode = xcode_open(source);
+  if (!hctx->xcode)
+    {
+      free(hctx);
+      return -1;
+    }
 
   CHECK_NULL(L_PLAYER, source->evbuf = evbuffer_new());
 
-  source->quality.sample_rate = transcode_encode_query(ctx->encode_ctx, "sample_rate");
-  source->quality.bits_per_sample = transcode_encode_query(ctx->encode_ctx, "bits_per_sample");
-  source->quality.channels = transcode_encode_query(ctx->encode_ctx, "channels");
+  seek_index_load(source, hctx->xcode);
 
-  source->input_ctx = ctx;
+  source->input_ctx = hctx;
 
   return 0;
 }
@@ -345,9 +488,14 @@ setup(struct input_source *source)
 static int
 stop(struct input_source *source)
 {
-  struct transcode_ctx *ctx = source->input_ctx;
+  struct http_ctx *hctx = source->input_ctx;
 
-  transcode_cleanup(&ctx);
+  if (hctx)
+    {
+      seek_index_save(source, hctx->xcode);
+      transcode_cleanup(&hctx->xcode);
+      free(hctx);
+    }
 
   if (source->evbuf)
     evbuffer_free(source->evbuf);
@@ -361,44 +509,81 @@ stop(struct input_source *source)
 static int
 play(struct input_source *source)
 {
-  struct transcode_ctx *ctx = source->input_ctx;
+  struct http_ctx *hctx = source->input_ctx;
   int icy_timer;
   int ret;
   short flags;
 
+  if (hctx->reconnect_pending)
+    {
+      ret = reconnect(source);
+      if (ret < 0)
+	goto reconnect;
+
+      hctx->reconnect_pending = false;
+      return 0;
+    }
+
   // We set "wanted" to 1 because the read size doesn't matter to us
   // TODO optimize?
-  ret = transcode(source->evbuf, &icy_timer, ctx, 1);
-  if (ret == 0)
+  ret = transcode(source->evbuf, &icy_timer, hctx->xcode, 1);
+  if (ret < 0 || (ret == 0 && eof_is_premature(source)))
     {
-      input_write(source->evbuf, &source->quality, INPUT_FLAG_EOF);
-      stop(source);
-      return -1;
+      DPRINTF(E_WARN, L_PLAYER, "Connection to '%s' was lost, will try to reconnect\n", source->path);
+
+      // Whatever we got before the connection dropped is still good
+      hctx->bytes += evbuffer_get_length(source->evbuf);
+      input_write(source->evbuf, &source->quality, 0);
+      goto reconnect;
     }
-  else if (ret < 0)
+  else if (ret == 0)
     {
-      input_write(NULL, NULL, INPUT_FLAG_ERROR);
+      input_write(source->evbuf, &source->quality, INPUT_FLAG_EOF);
       stop(source);
       return -1;
     }
 
+  hctx->failures = 0;
+  hctx->bytes += evbuffer_get_length(source->evbuf);
+
   flags = (icy_timer && metadata_prepare(source) == 0) ? INPUT_FLAG_METADATA : 0;
 
   input_write(source->evbuf, &source->quality, flags);
 
   return 0;
+
+ reconnect:
+  if (hctx->failures >= HTTP_RECONNECT_MAX)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Giving up on '%s' after %d reconnect attempts\n", source->path, hctx->failures);
+      input_write(NULL, NULL, INPUT_FLAG_ERROR);
+      stop(source);
+      return -1;
+    }
+
+  // The input buffer keeps the player going in the meantime
+  hctx->reconnect_pending = true;
+  hctx->failures++;
+  return (hctx->failures - 1) * HTTP_RECONNECT_DELAY_MS;
 }
 
 static int
 seek(struct input_source *source, int seek_ms)
 {
+  struct http_ctx *hctx = source->input_ctx;
+  int ret;
+
   // Stream is live/unknown length so can't seek. We return 0 anyway, because
   // it is valid for the input to request a seek, since the input is not
   // supposed to concern itself about this.
-  if (source->len_ms == 0)
+  if (source->len_ms == 0 || !hctx->xcode)
     return 0;
 
-  return transcode_seek(source->input_ctx, seek_ms);
+  ret = transcode_seek(hctx->xcode, seek_ms);
+  if (ret >= 0)
+    hctx->bytes = hctx->bytes_at_reconnect = ret * bytes_per_ms(&source->quality);
+
+  return ret;
 }
 
 static int
@@ -434,6 +619,7 @@ struct input_definition input_http =
   .name = "http",
   .type = INPUT_TYPE_HTTP,
   .disabled = 0,
+  .network = 1,
   .setup = setup,
   .play = play,
   .stop = stop,
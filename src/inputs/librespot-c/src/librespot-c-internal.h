@@ -70,6 +70,12 @@
 // large enough that the file can be probed from the first chunk.
 #define SP_CHUNK_LEN_WORDS 1024 * 8
 
+// When a chunk is complete we request the next one right away, instead of
+// waiting until the audio has been written to the pipe, as long as less than
+// this is waiting to be written. Otherwise the download stalls for a round trip
+// between each chunk.
+#define SP_READAHEAD_LEN (4 * 4 * SP_CHUNK_LEN_WORDS)
+
 // Used to create default sysinfo, which should be librespot_[short sha]_[random 8 characters build id],
 // ref https://github.com/plietar/librespot/pull/218. User may override, but
 // as of 20220516 Spotify seems to have whitelisting of client name.
@@ -300,6 +306,8 @@ struct sp_channel
 
   bool is_data_mode;
   bool is_spotify_header_received;
+  // Set while a chunk requested ahead (see SP_READAHEAD_LEN) is in flight
+  bool is_chunk_requested;
   size_t seek_pos;
   size_t seek_align;
 
@@ -330,7 +330,9 @@ audio_write_cb(int fd, short what, void *arg)
 	event_add(channel->audio_write_ev, NULL);
 	break;
       case SP_OK_DONE:
-	event_active(session->continue_ev, 0, 0);
+	// If a chunk is in flight, response_cb will continue when it arrives
+	if (!channel->is_chunk_requested)
+	  event_active(session->continue_ev, 0, 0);
 	break;
       default:
 	goto error;
@@ -386,12 +388,25 @@ response_cb(int fd, short what, void *arg)
       case SP_OK_WAIT: // Incomplete, wait for more data
 	break;
       case SP_OK_DATA:
+	event_del(conn->timeout_ev);
+
+	channel->is_chunk_requested = false;
         if (channel->state == SP_CHANNEL_STATE_PLAYING && !channel->file.end_of_file)
-	  session->msg_type_next = MSG_TYPE_CHUNK_REQUEST;
+	  {
+	    if (evbuffer_get_length(channel->audio_buf) < SP_READAHEAD_LEN)
+	      {
+		ret = request_make(MSG_TYPE_CHUNK_REQUEST, session);
+		if (ret < 0)
+		  goto error;
+
+		channel->is_chunk_requested = true;
+	      }
+	    else
+	      session->msg_type_next = MSG_TYPE_CHUNK_REQUEST; // After the write
+	  }
 	if (channel->progress_cb)
 	  channel->progress_cb(channel->audio_fd[0], channel->cb_arg, 4 * channel->file.received_words - SP_OGG_HEADER_LEN, 4 * channel->file.len_words - SP_OGG_HEADER_LEN);
 
-	event_del(conn->timeout_ev);
 	event_add(channel->audio_write_ev, NULL);
 	break;
       case SP_OK_DONE: // Got the response we expected, but possibly more to process
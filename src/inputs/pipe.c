@@ -62,6 +62,7 @@
 #include "player.h"
 #include "worker.h"
 #include "commands.h"
+#include "artwork.h"
 
 // Maximum number of pipes to watch for data
 #define PIPE_MAX_WATCH 4
@@ -71,9 +72,8 @@
 #define PIPE_METADATA_BUFLEN_MAX 1048576
 // Ignore pictures with larger size than this
 #define PIPE_PICTURE_SIZE_MAX 1048576
-// Where we store pictures for the artwork module to read
-#define PIPE_TMPFILE_TEMPLATE "/tmp/" PACKAGE_NAME ".XXXXXX.ext"
-#define PIPE_TMPFILE_TEMPLATE_EXTLEN 4
+// Name of the pictures we register with the artwork module
+#define PIPE_ARTWORK_NAME "pipe"
 
 enum pipetype
 {
@@ -108,9 +108,6 @@ struct pipe_metadata_prepared
 {
   // Progress, artist etc goes here
   struct input_metadata input_metadata;
-  // Picture (artwork) data
-  int pict_tmpfile_fd;
-  char pict_tmpfile_path[sizeof(PIPE_TMPFILE_TEMPLATE)];
   // Volume
   int volume;
   // Mutex to share the prepared metadata
@@ -124,6 +121,9 @@ struct pipe_metadata
   struct pipe *pipe;
   // We read metadata into this evbuffer
   struct evbuffer *evbuf;
+  // How much of evbuf has been searched for the end of an item, so we don't
+  // search the same data again when more arrives
+  size_t evbuf_scanned;
   // Storage of current metadata
   struct pipe_metadata_prepared prepared;
   // True if there is new metadata to push to the player
@@ -333,48 +333,6 @@ pipelist_find(struct pipe *list, int id)
   return NULL;
 }
 
-static void
-pict_tmpfile_close(int fd, const char *path)
-{
-  if (fd < 0)
-    return;
-
-  close(fd);
-  unlink(path);
-}
-
-// Opens a tmpfile to store metadata artwork in. *ext is the extension to use
-// for the tmpfile, eg .jpg or .png. Extension cannot be longer than
-// PIPE_TMPFILE_TEMPLATE_EXTLEN. If fd is set (non-negative) then the file is
-// closed first and deleted (using unlink, so path must be valid). The path
-// buffer will be updated with the new tmpfile, and the fd is returned.
-static int
-pict_tmpfile_recreate(char *path, size_t path_size, int fd, const char *ext)
-{
-  int offset = strlen(PIPE_TMPFILE_TEMPLATE) - PIPE_TMPFILE_TEMPLATE_EXTLEN;
-
-  if (strlen(ext) > PIPE_TMPFILE_TEMPLATE_EXTLEN)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Invalid extension provided to pict_tmpfile_recreate: '%s'\n", ext);
-      return -1;
-    }
-
-  if (path_size < sizeof(PIPE_TMPFILE_TEMPLATE))
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Invalid path buffer provided to pict_tmpfile_recreate\n");
-      return -1;
-    }
-
-  pict_tmpfile_close(fd, path);
-
-  strcpy(path, PIPE_TMPFILE_TEMPLATE);
-  strcpy(path + offset, ext);
-
-  fd = mkstemps(path, PIPE_TMPFILE_TEMPLATE_EXTLEN);
-
-  return fd;
-}
-
 static int
 parse_progress(struct pipe_metadata_prepared *prepared, char *progress)
 {
@@ -467,8 +425,6 @@ static int
 parse_picture(struct pipe_metadata_prepared *prepared, uint8_t *data, int data_len)
 {
   struct input_metadata *m = &prepared->input_metadata;
-  const char *ext;
-  ssize_t ret;
 
   free(m->artwork_url);
   m->artwork_url = NULL;
@@ -479,38 +435,17 @@ parse_picture(struct pipe_metadata_prepared *prepared, uint8_t *data, int data_l
       goto error;
     }
 
-  if (data[0] == 0xff && data[1] == 0xd8)
-    ext = ".jpg";
-  else if (data[0] == 0x89 && data[1] == 0x50)
-    ext = ".png";
-  else
+  if (!(data[0] == 0xff && data[1] == 0xd8) && !(data[0] == 0x89 && data[1] == 0x50))
     {
       DPRINTF(E_LOG, L_PLAYER, "Unsupported picture format from Shairport metadata pipe\n");
       goto error;
     }
 
-  prepared->pict_tmpfile_fd = pict_tmpfile_recreate(prepared->pict_tmpfile_path, sizeof(prepared->pict_tmpfile_path), prepared->pict_tmpfile_fd, ext);
-  if (prepared->pict_tmpfile_fd < 0)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Could not open tmpfile for pipe artwork '%s': %s\n", prepared->pict_tmpfile_path, strerror(errno));
-      goto error;
-    }
-
-  ret = write(prepared->pict_tmpfile_fd, data, data_len);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Error writing artwork from metadata pipe to '%s': %s\n", prepared->pict_tmpfile_path, strerror(errno));
-      goto error;
-    }
-  else if (ret != data_len)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Incomplete write of artwork to '%s' (%zd/%d)\n", prepared->pict_tmpfile_path, ret, data_len);
-      goto error;
-    }
+  // Kept in memory by the artwork module, so we don't write a file on every
+  // track change (which is bad for e.g. SD cards)
+  m->artwork_url = artwork_mem_register(PIPE_ARTWORK_NAME, data, data_len);
 
-  DPRINTF(E_DBG, L_PLAYER, "Wrote pipe artwork to '%s'\n", prepared->pict_tmpfile_path);
-
-  m->artwork_url = safe_asprintf("file:%s", prepared->pict_tmpfile_path);
+  DPRINTF(E_DBG, L_PLAYER, "Registered pipe artwork as '%s'\n", m->artwork_url);
 
   return 9;
 
@@ -657,15 +592,24 @@ parse_item(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepa
 }
 
 static char *
-extract_item(struct evbuffer *evbuf)
+extract_item(struct evbuffer *evbuf, size_t *scanned)
 {
   struct evbuffer_ptr evptr;
+  struct evbuffer_ptr start;
   size_t size;
   char *item;
 
-  evptr = evbuffer_search(evbuf, "</item>", strlen("</item>"), NULL);
+  // The tag may have been split between the previous read and this one
+  evbuffer_ptr_set(evbuf, &start, (*scanned > strlen("</item>")) ? *scanned - strlen("</item>") : 0, EVBUFFER_PTR_SET);
+
+  evptr = evbuffer_search(evbuf, "</item>", strlen("</item>"), &start);
   if (evptr.pos < 0)
-    return NULL;
+    {
+      *scanned = evbuffer_get_length(evbuf);
+      return NULL;
+    }
+
+  *scanned = 0;
 
   size = evptr.pos + strlen("</item>") + 1;
   item = malloc(size);
@@ -683,14 +627,14 @@ extract_item(struct evbuffer *evbuf)
 // PIPE_METADATA_MSG_VOLUME | PIPE_METADATA_MSG_METADATA. Returns -1 if the
 // evbuf could not be parsed.
 static int
-pipe_metadata_parse(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepared, struct evbuffer *evbuf)
+pipe_metadata_parse(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepared, struct evbuffer *evbuf, size_t *scanned)
 {
   enum pipe_metadata_msg message;
   char *item;
   int ret;
 
   *out_msg = 0;
-  while ((item = extract_item(evbuf)))
+  while ((item = extract_item(evbuf, scanned)))
     {
       ret = parse_item(&message, prepared, item);
       free(item);
@@ -837,8 +781,7 @@ pipe_metadata_watch_del(void *arg)
   pipe_free(pipe_metadata.pipe);
   pipe_metadata.pipe = NULL;
 
-  pict_tmpfile_close(pipe_metadata.prepared.pict_tmpfile_fd, pipe_metadata.prepared.pict_tmpfile_path);
-  pipe_metadata.prepared.pict_tmpfile_fd = -1;
+  artwork_mem_unregister(PIPE_ARTWORK_NAME);
 }
 
 // Some metadata arrived on a pipe we watch
@@ -870,6 +813,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
     {
       DPRINTF(E_LOG, L_PLAYER, "Buffer for metadata pipe '%s' is full, discarding %zu bytes\n", pipe_metadata.pipe->path, len);
       evbuffer_drain(pipe_metadata.evbuf, len);
+      pipe_metadata.evbuf_scanned = 0;
       goto readd;
     }
 
@@ -877,7 +821,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
   // Note that this means _parse() must not do anything that could cause a
   // deadlock (e.g. make a sync call to the player thread).
   pthread_mutex_lock(&pipe_metadata.prepared.lock);
-  ret = pipe_metadata_parse(&message, &pipe_metadata.prepared, pipe_metadata.evbuf);
+  ret = pipe_metadata_parse(&message, &pipe_metadata.prepared, pipe_metadata.evbuf, &pipe_metadata.evbuf_scanned);
   pthread_mutex_unlock(&pipe_metadata.prepared.lock);
   if (ret < 0)
     {
@@ -913,6 +857,7 @@ pipe_metadata_watch_add(void *arg)
 
   pipe_metadata.pipe = pipe_create(path, 0, PIPE_METADATA, pipe_metadata_read_cb);
   pipe_metadata.evbuf = evbuffer_new();
+  pipe_metadata.evbuf_scanned = 0;
 
   ret = watch_add(pipe_metadata.pipe);
   if (ret < 0)
@@ -1035,8 +980,6 @@ setup(struct input_source *source)
   if (fd < 0)
     return -1;
 
-  CHECK_NULL(L_PLAYER, source->evbuf = evbuffer_new());
-
   pipe = pipe_create(source->path, source->id, PIPE_PCM, NULL);
 
   pipe->fd = fd;
@@ -1092,10 +1035,12 @@ play(struct input_source *source)
   short flags;
   int ret;
 
-  ret = evbuffer_read(source->evbuf, pipe->fd, PIPE_READ_MAX);
+  // Reads straight into the input buffer, so no copying via an evbuffer
+  flags = (pipe_metadata.is_new ? INPUT_FLAG_METADATA : 0);
+  ret = input_write_fd(pipe->fd, PIPE_READ_MAX, &source->quality, flags);
   if ((ret == 0) && (pipe->is_autostarted))
     {
-      input_write(source->evbuf, NULL, INPUT_FLAG_EOF); // Autostop
+      input_write(NULL, NULL, INPUT_FLAG_EOF); // Autostop
       stop(source);
       return -1;
     }
@@ -1112,10 +1057,8 @@ play(struct input_source *source)
       return -1;
     }
 
-  flags = (pipe_metadata.is_new ? INPUT_FLAG_METADATA : 0);
-  pipe_metadata.is_new = 0;
-
-  input_write(source->evbuf, &source->quality, flags);
+  if (flags)
+    pipe_metadata.is_new = 0;
 
   return 0;
 }
@@ -1141,8 +1084,6 @@ init(void)
 {
   CHECK_ERR(L_PLAYER, mutex_init(&pipe_metadata.prepared.lock));
 
-  pipe_metadata.prepared.pict_tmpfile_fd = -1;
-
   pipe_autostart = cfg_getbool(cfg_getsec(cfg, "library"), "pipe_autostart");
   if (pipe_autostart)
     {
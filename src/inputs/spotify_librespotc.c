@@ -628,6 +628,7 @@ struct input_definition input_spotify =
   .name = "Spotify",
   .type = INPUT_TYPE_SPOTIFY,
   .disabled = 0,
+  .network = 1,
   .setup = setup,
   .stop = stop,
   .play = play,
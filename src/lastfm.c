@@ -29,6 +29,7 @@
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <gcrypt.h>
 #include <event2/buffer.h>
@@ -42,6 +43,18 @@
 #include "misc.h"
 #include "misc_xml.h"
 #include "http.h"
+#include "worker.h"
+
+// Last.fm accepts up to 50 scrobbles per request
+#define LASTFM_BATCH_MAX 50
+
+// Seconds to wait before retrying after a failed submit, doubled after each
+// failure up to the max
+#define LASTFM_RETRY_DELAY_MIN 30
+#define LASTFM_RETRY_DELAY_MAX 3600
+
+// Returned by request_post() when the request should be retried later
+#define LASTFM_ERR_RETRY -2
 
 // LastFM becomes disabled if we get a scrobble, try initialising session,
 // but can't (probably no session key in db because user does not use LastFM)
@@ -60,6 +73,11 @@ static const char *auth_url = "https://ws.audioscrobbler.com/2.0/";
 // Session key
 static char *lastfm_session_key = NULL;
 
+// Protects the submit of the scrobble queue, which runs in the worker threads
+static pthread_mutex_t lastfm_submit_lck = PTHREAD_MUTEX_INITIALIZER;
+static int lastfm_retry_delay;
+static bool lastfm_retry_scheduled;
+
 
 
 /* --------------------------------- HELPERS ------------------------------- */
@@ -228,6 +246,8 @@ response_process(struct http_client_ctx *ctx, char **errmsg)
  * @param url API endpoint url
  * @param kv Alphabetically sorted post parameters
  * @param errmsg (Optional) returns the error message (or NULL) if request failed
+ * @return 0 if ok, LASTFM_ERR_RETRY if Last.fm could not be reached or is
+ *         unavailable, otherwise -1
  */
 static int
 request_post(const char *url, struct keyval *kv, char **errmsg)
@@ -258,8 +278,12 @@ request_post(const char *url, struct keyval *kv, char **errmsg)
   ctx.input_body = evbuffer_new();
 
   ret = http_client_request(&ctx, NULL);
-  if (ret < 0)
-    goto out_free_ctx;
+  if (ret < 0 || ctx.response_code == 429 || ctx.response_code >= 500)
+    {
+      DPRINTF(E_WARN, L_SCROBBLE, "lastfm: Request failed, response code: %d\n", ctx.response_code);
+      ret = LASTFM_ERR_RETRY;
+      goto out_free_ctx;
+    }
 
   ret = response_process(&ctx, errmsg);
 
@@ -271,72 +295,203 @@ request_post(const char *url, struct keyval *kv, char **errmsg)
 }
 
 static int
-scrobble(int id)
+scrobble_params_add(struct keyval *kv, struct db_scrobble *scrobble, int i)
 {
-  struct media_file_info *mfi;
-  struct keyval *kv;
-  char duration[4];
-  char trackNumber[4];
-  char timestamp[16];
+  char name[32];
+  char value[32];
   int ret;
 
-  mfi = db_file_fetch_byid(id);
-  if (!mfi)
+  snprintf(name, sizeof(name), "artist[%d]", i);
+  ret = keyval_add(kv, name, scrobble->artist);
+  snprintf(name, sizeof(name), "track[%d]", i);
+  ret |= keyval_add(kv, name, scrobble->title);
+  snprintf(name, sizeof(name), "timestamp[%d]", i);
+  snprintf(value, sizeof(value), "%" PRIi64, scrobble->listened_at);
+  ret |= keyval_add(kv, name, value);
+  if (ret < 0)
+    return -1;
+
+  snprintf(name, sizeof(name), "duration[%d]", i);
+  snprintf(value, sizeof(value), "%" PRIu32, scrobble->song_length / 1000);
+  ret = keyval_add(kv, name, value);
+  snprintf(name, sizeof(name), "trackNumber[%d]", i);
+  snprintf(value, sizeof(value), "%" PRIu32, scrobble->track);
+  ret |= keyval_add(kv, name, value);
+  if (scrobble->album)
     {
-      DPRINTF(E_LOG, L_SCROBBLE, "lastfm: Scrobble failed, track id %d is unknown\n", id);
-      return -1;
+      snprintf(name, sizeof(name), "album[%d]", i);
+      ret |= keyval_add(kv, name, scrobble->album);
+    }
+  if (scrobble->album_artist)
+    {
+      snprintf(name, sizeof(name), "albumArtist[%d]", i);
+      ret |= keyval_add(kv, name, scrobble->album_artist);
     }
 
-  // Don't scrobble songs which are shorter than 30 sec
-  if (mfi->song_length < 30000)
-    goto noscrobble;
-
-  // Don't scrobble non-music and radio stations
-  if ((mfi->media_kind != MEDIA_KIND_MUSIC) || (mfi->data_kind == DATA_KIND_HTTP))
-    goto noscrobble;
+  return ret;
+}
 
-  // Don't scrobble songs with unknown artist
-  if (strcmp(mfi->artist, CFG_NAME_UNKNOWN_ARTIST) == 0)
-    goto noscrobble;
+static int
+scrobbles_submit(struct db_scrobble *scrobbles, int n)
+{
+  struct keyval *kv;
+  int count;
+  int ret;
+  int i;
 
   kv = keyval_alloc();
   if (!kv)
-    goto noscrobble;
-
-  snprintf(duration, sizeof(duration), "%" PRIu32, mfi->song_length);
-  snprintf(trackNumber, sizeof(trackNumber), "%" PRIu32, mfi->track);
-  snprintf(timestamp, sizeof(timestamp), "%" PRIi64, (int64_t)time(NULL));
+    return -1;
 
   ret = (
-	  (keyval_add(kv, "album", mfi->album) == 0) &&
-	  (keyval_add(kv, "albumArtist", mfi->album_artist) == 0) &&
 	  (keyval_add(kv, "api_key", lastfm_api_key) == 0) &&
-	  (keyval_add(kv, "artist", mfi->artist) == 0) &&
-	  (keyval_add(kv, "duration", duration) == 0) &&
 	  (keyval_add(kv, "method", "track.scrobble") == 0) &&
-	  (keyval_add(kv, "sk", lastfm_session_key) == 0) &&
-	  (keyval_add(kv, "timestamp", timestamp) == 0) &&
-	  (keyval_add(kv, "track", mfi->title) == 0) &&
-	  (keyval_add(kv, "trackNumber", trackNumber) == 0)
+	  (keyval_add(kv, "sk", lastfm_session_key) == 0)
       );
+  if (!ret)
+    {
+      ret = -1;
+      goto out;
+    }
 
-  free_mfi(mfi, 0);
+  for (i = 0, count = 0; i < n; i++)
+    {
+      if (!scrobbles[i].artist || !scrobbles[i].title)
+	{
+	  DPRINTF(E_LOG, L_SCROBBLE, "lastfm: Not scrobbling track without artist or title\n");
+	  continue;
+	}
 
-  if (!ret)
+      ret = scrobble_params_add(kv, &scrobbles[i], count);
+      if (ret < 0)
+	goto out;
+
+      count++;
+    }
+
+  if (count == 0)
     {
-      keyval_clear(kv);
-      free(kv);
-      return -1;
+      ret = -1;
+      goto out;
     }
 
-  DPRINTF(E_INFO, L_SCROBBLE, "lastfm: Scrobbling '%s' by '%s'\n", keyval_get(kv, "track"), keyval_get(kv, "artist"));
+  // The signature requires the params sorted by name
+  keyval_sort(kv);
+
+  DPRINTF(E_INFO, L_SCROBBLE, "lastfm: Scrobbling %d track(s), first is '%s' by '%s'\n", count, scrobbles[0].title, scrobbles[0].artist);
 
   ret = request_post(api_url, kv, NULL);
 
+ out:
   keyval_clear(kv);
   free(kv);
 
   return ret;
+}
+
+static void
+queue_submit_cb(void *arg);
+
+static void
+queue_submit_retry(void)
+{
+  if (lastfm_retry_delay == 0)
+    lastfm_retry_delay = LASTFM_RETRY_DELAY_MIN;
+  else
+    lastfm_retry_delay = MIN(2 * lastfm_retry_delay, LASTFM_RETRY_DELAY_MAX);
+
+  DPRINTF(E_INFO, L_SCROBBLE, "lastfm: Will retry submitting scrobbles in %d seconds\n", lastfm_retry_delay);
+
+  worker_execute(queue_submit_cb, NULL, 0, lastfm_retry_delay);
+  lastfm_retry_scheduled = true;
+}
+
+// Submits the queued plays in batches. If Last.fm can't be reached the plays
+// stay in the queue, and the submit is retried with backoff.
+static int
+queue_submit(void)
+{
+  struct db_scrobble *scrobbles;
+  int n;
+  int ret = 0;
+
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_lock(&lastfm_submit_lck));
+
+  // A retry is pending, the plays will be submitted then
+  if (lastfm_retry_scheduled)
+    goto out;
+
+  do
+    {
+      if (lastfm_disabled)
+	break;
+
+      n = db_scrobbles_get(&scrobbles, DB_SCROBBLE_LASTFM, LASTFM_BATCH_MAX);
+      if (n <= 0)
+	break;
+
+      ret = scrobbles_submit(scrobbles, n);
+      if (ret == LASTFM_ERR_RETRY)
+	{
+	  queue_submit_retry();
+	  db_scrobbles_free(scrobbles, n);
+	  break;
+	}
+
+      // Retrying won't fix other errors, so the plays are removed in any case
+      db_scrobbles_delete(DB_SCROBBLE_LASTFM, scrobbles[n - 1].id);
+      db_scrobbles_free(scrobbles, n);
+      lastfm_retry_delay = 0;
+    }
+  while (n == LASTFM_BATCH_MAX);
+
+ out:
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_unlock(&lastfm_submit_lck));
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static void
+queue_submit_cb(void *arg)
+{
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_lock(&lastfm_submit_lck));
+  lastfm_retry_scheduled = false;
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_unlock(&lastfm_submit_lck));
+
+  queue_submit();
+}
+
+static int
+scrobble(int id)
+{
+  struct media_file_info *mfi;
+  int ret;
+
+  mfi = db_file_fetch_byid(id);
+  if (!mfi)
+    {
+      DPRINTF(E_LOG, L_SCROBBLE, "lastfm: Scrobble failed, track id %d is unknown\n", id);
+      return -1;
+    }
+
+  // Don't scrobble songs which are shorter than 30 sec
+  if (mfi->song_length < 30000)
+    goto noscrobble;
+
+  // Don't scrobble non-music and radio stations
+  if ((mfi->media_kind != MEDIA_KIND_MUSIC) || (mfi->data_kind == DATA_KIND_HTTP))
+    goto noscrobble;
+
+  // Don't scrobble songs with unknown artist
+  if (strcmp(mfi->artist, CFG_NAME_UNKNOWN_ARTIST) == 0)
+    goto noscrobble;
+
+  ret = db_scrobble_add(DB_SCROBBLE_LASTFM, mfi, time(NULL));
+  free_mfi(mfi, 0);
+  if (ret < 0)
+    return -1;
+
+  return queue_submit();
 
  noscrobble:
   free_mfi(mfi, 0);
@@ -345,7 +500,6 @@ scrobble(int id)
 }
 
 
-
 /* ---------------------------- Our lastfm API  --------------------------- */
 
 /* Thread: filescanner, httpd */
@@ -413,6 +567,7 @@ void
 lastfm_logout(void)
 {
   stop_scrobbling();
+  db_scrobbles_delete(DB_SCROBBLE_LASTFM, INT64_MAX);
   listener_notify(LISTENER_LASTFM);
 }
 
@@ -447,8 +602,13 @@ lastfm_init(void)
     {
       DPRINTF(E_DBG, L_SCROBBLE, "lastfm: No valid LastFM session key\n");
       lastfm_disabled = true;
+      return 0;
     }
 
+  // Submit what was queued when we last ran, if anything
+  lastfm_retry_scheduled = true;
+  worker_execute(queue_submit_cb, NULL, 0, LASTFM_RETRY_DELAY_MIN);
+
   return 0;
 }
 
@@ -33,6 +33,7 @@
 #include <event2/event.h>
 
 #include "library.h"
+#include "artwork.h"
 #include "cache.h"
 #include "commands.h"
 #include "conffile.h"
@@ -85,6 +86,7 @@ extern struct library_source filescanner;
 extern struct library_source spotifyscanner;
 #endif
 extern struct library_source rssscanner;
+extern struct library_source federation;
 
 static struct library_source *sources[] = {
     &filescanner,
@@ -92,9 +94,13 @@ static struct library_source *sources[] = {
     &spotifyscanner,
 #endif
     &rssscanner,
+    &federation,
     NULL
 };
 
+// True if the library is copied from a primary instance (see federation.c)
+static bool is_replica;
+
 /* Flag for aborting scan on exit */
 static bool scan_exit;
 
@@ -113,6 +119,16 @@ static bool scanning;
 static struct timeval library_update_wait = { 5, 0 };
 static struct event *updateev;
 
+// Database maintenance (see db_maintenance) is run this often, but postponed
+// while scanning or playing
+static struct timeval library_maintenance_interval = { 3600, 0 };
+static struct timeval library_maintenance_retry = { 300, 0 };
+static struct event *maintenanceev;
+
+// With queue_in_memory, the queue is saved this often (see db_queue_snapshot)
+static struct timeval library_queue_snapshot_interval = { 60, 0 };
+static struct event *queuesnapshotev;
+
 // Counts the number of changes made to the database between to DATABASE
 // event notifications
 static unsigned int deferred_update_notifications;
@@ -121,6 +137,16 @@ static short deferred_update_events;
 // Stores callbacks that backends may have requested
 static struct library_callback_register library_cb_register[LIBRARY_MAX_CALLBACKS];
 
+// Telemetry of the running or last scan. Written by the library thread and
+// the scanners' worker threads, read by the web interface (any thread).
+static struct library_scan_stats scan_stats;
+static pthread_mutex_t scan_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// While scanning, send LISTENER_UPDATE at most this often (seconds) so that
+// clients can show the progress
+#define SCAN_STATS_NOTIFY_INTERVAL 5
+static time_t scan_stats_notified;
+
 
 /* ------------------- CALLED BY LIBRARY SOURCE MODULES -------------------- */
 
@@ -275,6 +301,89 @@ library_callback_schedule(library_cb cb, void *arg, struct timeval *wait, enum l
 }
 
 
+uint64_t
+library_scan_stats_phase_add(enum library_scan_phase phase, struct timespec *start)
+{
+  struct timespec now;
+  uint64_t usec;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  usec = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  if (scan_stats.scanning)
+    scan_stats.phase_usec[phase] += usec;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  return usec;
+}
+
+void
+library_scan_stats_dir_add(void)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  if (scan_stats.scanning)
+    scan_stats.dirs++;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
+void
+library_scan_stats_file_add(const char *path, uint64_t usec)
+{
+  struct library_scan_file *slowest = scan_stats.slowest;
+  time_t now;
+  int i;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+
+  if (!scan_stats.scanning)
+    {
+      CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+      return;
+    }
+
+  scan_stats.files++;
+
+  if (usec > 0)
+    {
+      scan_stats.files_scanned++;
+
+      // Insertion into the list of slowest files, which is sorted descending
+      for (i = scan_stats.nslowest; i > 0 && slowest[i - 1].usec < usec; i--)
+	{
+	  if (i < LIBRARY_SCAN_SLOWEST_MAX)
+	    slowest[i] = slowest[i - 1];
+	}
+
+      if (i < LIBRARY_SCAN_SLOWEST_MAX)
+	{
+	  snprintf(slowest[i].path, sizeof(slowest[i].path), "%s", path);
+	  slowest[i].usec = usec;
+	  if (scan_stats.nslowest < LIBRARY_SCAN_SLOWEST_MAX)
+	    scan_stats.nslowest++;
+	}
+    }
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  now = time(NULL);
+  if (now - scan_stats_notified >= SCAN_STATS_NOTIFY_INTERVAL)
+    {
+      scan_stats_notified = now;
+      listener_notify(LISTENER_UPDATE);
+    }
+}
+
+void
+library_scan_stats_queue_set(int depth)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  if (scan_stats.scanning)
+    scan_stats.queue_depth = depth;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
 /* ---------------------- LIBRARY ABSTRACTION --------------------- */
 /*                          thread: library                         */
 
@@ -297,9 +406,39 @@ handle_deferred_update_notifications(void)
   return ret;
 }
 
+static void
+scan_stats_begin(time_t start)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  memset(&scan_stats, 0, sizeof(struct library_scan_stats));
+  scan_stats.scanning = true;
+  scan_stats.start = start;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  scan_stats_notified = start;
+}
+
+static void
+scan_stats_end(time_t end)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  scan_stats.scanning = false;
+  scan_stats.end = end;
+  scan_stats.queue_depth = 0;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
 static void
 purge_cruft(time_t start, enum scan_kind scan_kind)
 {
+  struct timespec purge_start;
+
+  // The library comes from the primary, which also does the purging
+  if (is_replica)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &purge_start);
+
   DPRINTF(E_DBG, L_LIB, "Purging old library content\n");
   if (scan_kind > 0)
     db_purge_cruft_bysource(start, scan_kind);
@@ -313,6 +452,8 @@ purge_cruft(time_t start, enum scan_kind scan_kind)
       DPRINTF(E_DBG, L_LIB, "Purging old artwork content\n");
       cache_artwork_purge_cruft(start);
     }
+
+  library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_PURGE, &purge_start);
 }
 
 static enum command_state
@@ -326,6 +467,8 @@ rescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin(starttime);
+  db_write_batch_begin();
 
   scan_kind = arg;
 
@@ -354,7 +497,11 @@ rescan(void *arg, int *ret)
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
 
+  db_write_batch_end();
+
   endtime = time(NULL);
+  scan_stats_end(endtime);
+  artwork_prerender_start();
   DPRINTF(E_LOG, L_LIB, "Library rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
   scanning = false;
 
@@ -378,6 +525,8 @@ metarescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library meta rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin(starttime);
+  db_write_batch_begin();
 
   scan_kind = arg;
 
@@ -406,7 +555,11 @@ metarescan(void *arg, int *ret)
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
 
+  db_write_batch_end();
+
   endtime = time(NULL);
+  scan_stats_end(endtime);
+  artwork_prerender_start();
   DPRINTF(E_LOG, L_LIB, "Library meta rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
   scanning = false;
 
@@ -425,16 +578,21 @@ fullrescan(void *arg, int *ret)
 {
   time_t starttime;
   time_t endtime;
+  bool bulk_load;
   int i;
 
   DPRINTF(E_LOG, L_LIB, "Library full-rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin(starttime);
+  db_write_batch_begin();
 
   player_playback_stop();
   db_queue_clear(0);
   db_purge_all(); // Clears files, playlists, playlistitems, inotify and groups, incl RSS
 
+  bulk_load = db_bulk_load_begin();
+
   for (i = 0; sources[i]; i++)
     {
       if (!sources[i]->disabled && sources[i]->fullrescan)
@@ -448,7 +606,14 @@ fullrescan(void *arg, int *ret)
 	}
     }
 
+  if (bulk_load)
+    db_bulk_load_end();
+
+  db_write_batch_end();
+
   endtime = time(NULL);
+  scan_stats_end(endtime);
+  artwork_prerender_start();
   DPRINTF(E_LOG, L_LIB, "Library full-rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
   scanning = false;
 
@@ -727,6 +892,33 @@ update_trigger_cb(int fd, short what, void *arg)
     }
 }
 
+static void
+maintenance_cb(int fd, short what, void *arg)
+{
+  struct player_status status;
+
+  // Not while playing, since it would compete with the player for the disk
+  // and CPU, which on e.g. a Pi can cause underruns with many outputs
+  if (scanning || (player_get_status(&status) == 0 && status.status == PLAY_PLAYING))
+    {
+      DPRINTF(E_DBG, L_LIB, "Library or player busy, postponing database maintenance\n");
+      evtimer_add(maintenanceev, &library_maintenance_retry);
+      return;
+    }
+
+  db_maintenance();
+
+  evtimer_add(maintenanceev, &library_maintenance_interval);
+}
+
+static void
+queue_snapshot_cb(int fd, short what, void *arg)
+{
+  db_queue_snapshot();
+
+  evtimer_add(queuesnapshotev, &library_queue_snapshot_interval);
+}
+
 static enum command_state
 update_trigger(void *arg, int *retval)
 {
@@ -803,11 +995,15 @@ initscan()
   time_t starttime;
   time_t endtime;
   bool clear_queue_disabled;
+  bool filescan_disabled;
+  bool bulk_load;
   int i;
 
   scanning = true;
   starttime = time(NULL);
+  scan_stats_begin(starttime);
   listener_notify(LISTENER_UPDATE);
+  db_write_batch_begin();
 
   // Only clear the queue if enabled (default) in config
   clear_queue_disabled = cfg_getbool(cfg_getsec(cfg, "library"), "clear_queue_on_stop_disable");
@@ -824,21 +1020,32 @@ initscan()
       db_queue_clear(0);
     }
 
+  bulk_load = db_bulk_load_begin();
+
   for (i = 0; sources[i]; i++)
     {
       if (!sources[i]->disabled && sources[i]->initscan)
 	sources[i]->initscan();
     }
 
-  if (! (cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable")))
-    {
-      purge_cruft(starttime, 0);
+  filescan_disabled = cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable");
+  if (!filescan_disabled)
+    purge_cruft(starttime, 0);
 
+  // Creating the deferred indices includes the post scan jobs
+  if (bulk_load)
+    db_bulk_load_end();
+  else if (!filescan_disabled)
+    {
       DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
       db_hook_post_scan();
     }
 
+  db_write_batch_end();
+
   endtime = time(NULL);
+  scan_stats_end(endtime);
+  artwork_prerender_start();
   DPRINTF(E_LOG, L_LIB, "Library init scan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
 
   scanning = false;
@@ -849,6 +1056,15 @@ initscan()
     listener_notify(LISTENER_UPDATE);
 }
 
+static enum command_state
+initscan_cmd(void *arg, int *ret)
+{
+  initscan();
+
+  *ret = 0;
+  return COMMAND_END;
+}
+
 bool
 library_is_scanning()
 {
@@ -861,6 +1077,14 @@ library_set_scanning(bool is_scanning)
   scanning = is_scanning;
 }
 
+void
+library_scan_stats_get(struct library_scan_stats *stats)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  *stats = scan_stats;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
 bool
 library_is_exiting()
 {
@@ -1003,6 +1227,7 @@ library_exec_async(command_function func, void *arg)
 static void *
 library(void *arg)
 {
+  int scan_nice;
   int ret;
 
 #ifdef __linux__
@@ -1020,6 +1245,13 @@ library(void *arg)
     }
 #endif
 
+  // Also applies to the scan worker threads, which we start
+  scan_nice = cfg_getint(cfg_getsec(cfg, "library"), "scan_nice");
+  if (scan_nice > 0 && thread_nice_set(scan_nice) < 0)
+    DPRINTF(E_LOG, L_LIB, "Warning: Could not set nice value of library thread to %d\n", scan_nice);
+  if (cfg_getbool(cfg_getsec(cfg, "library"), "scan_io_idle") && thread_io_idle_set(true) < 0)
+    DPRINTF(E_LOG, L_LIB, "Warning: Could not set I/O priority of library thread to idle\n");
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -1028,8 +1260,6 @@ library(void *arg)
       pthread_exit(NULL);
     }
 
-  initscan();
-
   event_base_dispatch(evbase_lib);
 
   if (!scan_exit)
@@ -1049,13 +1279,32 @@ library_init(void)
   int ret;
 
   scan_exit = false;
-  scanning = false;
+  // Until library_initscan_start() the initial scan counts as running, so that
+  // rescan requests are refused like they would be during the scan
+  scanning = true;
 
   CHECK_NULL(L_LIB, evbase_lib = event_base_new());
   CHECK_NULL(L_LIB, updateev = evtimer_new(evbase_lib, update_trigger_cb, NULL));
+  CHECK_NULL(L_LIB, maintenanceev = evtimer_new(evbase_lib, maintenance_cb, NULL));
+  evtimer_add(maintenanceev, &library_maintenance_interval);
+
+  if (cfg_getbool(cfg_getsec(cfg, "sqlite"), "queue_in_memory"))
+    {
+      if (cfg_getint(cfg_getsec(cfg, "sqlite"), "queue_snapshot_interval") > 0)
+	library_queue_snapshot_interval.tv_sec = cfg_getint(cfg_getsec(cfg, "sqlite"), "queue_snapshot_interval");
+
+      CHECK_NULL(L_LIB, queuesnapshotev = evtimer_new(evbase_lib, queue_snapshot_cb, NULL));
+      evtimer_add(queuesnapshotev, &library_queue_snapshot_interval);
+    }
+
+  // A replica has no sources of its own, and the others have no primary
+  is_replica = (cfg_getstr(cfg_getsec(cfg, "library"), "federation_primary") != NULL);
 
   for (i = 0; sources[i]; i++)
     {
+      if (is_replica != (sources[i] == &federation))
+	sources[i]->disabled = 1;
+
       if (!sources[i]->initscan || !sources[i]->rescan || !sources[i]->metarescan || !sources[i]->fullrescan)
 	{
 	  DPRINTF(E_FATAL, L_LIB, "BUG: library source '%s' is missing a scanning method\n", db_scan_kind_label(sources[i]->scan_kind));
@@ -1079,6 +1328,13 @@ library_init(void)
   return 0;
 }
 
+/* Thread: main */
+void
+library_initscan_start(void)
+{
+  commands_exec_async(cmdbase, initscan_cmd, NULL);
+}
+
 /* Thread: main */
 void
 library_deinit()
@@ -1110,5 +1366,8 @@ library_deinit()
     }
 
   event_free(updateev);
+  event_free(maintenanceev);
+  if (queuesnapshotev)
+    event_free(queuesnapshotev);
   event_base_free(evbase_lib);
 }
@@ -19,7 +19,9 @@
 #ifndef SRC_LIBRARY_H_
 #define SRC_LIBRARY_H_
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -129,6 +131,60 @@ struct library_source
   int (*queue_item_add)(const char *path, int position, char reshuffle, uint32_t item_id, int *count, int *new_item_id);
 };
 
+/*
+ * Phases of a library scan that have their duration recorded in the scan stats
+ */
+enum library_scan_phase
+{
+  // Reading directories
+  LIBRARY_SCAN_PHASE_WALK,
+  // lstat()/stat() of directory entries
+  LIBRARY_SCAN_PHASE_STAT,
+  // Reading metadata of media files (summed over all metadata workers)
+  LIBRARY_SCAN_PHASE_METADATA,
+  // Saving media files to the library
+  LIBRARY_SCAN_PHASE_SAVE,
+  // Processing playlists
+  LIBRARY_SCAN_PHASE_PLAYLISTS,
+  // Purging library content not found by the scan
+  LIBRARY_SCAN_PHASE_PURGE,
+  LIBRARY_SCAN_PHASE_MAX,
+};
+
+#define LIBRARY_SCAN_SLOWEST_MAX 5
+
+struct library_scan_file
+{
+  char path[PATH_MAX];
+  uint64_t usec;
+};
+
+/*
+ * Progress and timings of the running (or if none, the last) library scan
+ */
+struct library_scan_stats
+{
+  bool scanning;
+  time_t start;
+  time_t end;
+
+  // Directories read, files processed one by one (i.e. not pinged together
+  // with an unchanged directory) and files that had their metadata read
+  uint32_t dirs;
+  uint32_t files;
+  uint32_t files_scanned;
+
+  // Files waiting for a metadata worker
+  int queue_depth;
+
+  // Cumulative time in usec per enum library_scan_phase
+  uint64_t phase_usec[LIBRARY_SCAN_PHASE_MAX];
+
+  // Files that took longest to read metadata from, slowest first
+  struct library_scan_file slowest[LIBRARY_SCAN_SLOWEST_MAX];
+  int nslowest;
+};
+
 /* --------------------- Interface towards source backends ----------------- */
 
 /*
@@ -168,6 +224,41 @@ library_callback_schedule(library_cb cb, void *arg, struct timeval *wait, enum l
 bool
 library_is_exiting();
 
+/*
+ * Adds the time elapsed since 'start' (CLOCK_MONOTONIC) to the scan stats of
+ * the given phase. Can be called from any thread. Like the other
+ * library_scan_stats_* functions this has no effect if no scan is running.
+ *
+ * @param phase Scan phase
+ * @param start Time the phase started
+ * @return      Elapsed time in usec
+ */
+uint64_t
+library_scan_stats_phase_add(enum library_scan_phase phase, struct timespec *start);
+
+/*
+ * Counts a directory in the scan stats
+ */
+void
+library_scan_stats_dir_add(void);
+
+/*
+ * Counts a file in the scan stats. If its metadata was read, 'usec' is how long
+ * that took, otherwise 0. Also sends LISTENER_UPDATE now and then, so that
+ * clients can follow the progress of the scan.
+ *
+ * @param path  Path of the file
+ * @param usec  Time spent reading metadata
+ */
+void
+library_scan_stats_file_add(const char *path, uint64_t usec);
+
+/*
+ * @param depth Number of files waiting for a metadata worker
+ */
+void
+library_scan_stats_queue_set(int depth);
+
 
 /* ------------------------ Library external interface --------------------- */
 
@@ -207,6 +298,15 @@ library_is_scanning();
 void
 library_set_scanning(bool is_scanning);
 
+/*
+ * Copies the stats of the running or last library scan. Can be called from any
+ * thread.
+ *
+ * @out stats  Scan stats
+ */
+void
+library_scan_stats_get(struct library_scan_stats *stats);
+
 /*
  * Trigger for sending the DATABASE event
  *
@@ -260,6 +360,14 @@ library_exec_async(command_function func, void *arg);
 int
 library_init();
 
+/*
+ * Starts the initial scan of all enabled sources in the library thread. Called
+ * by main when startup is otherwise complete, since the scan includes logging
+ * in to online sources.
+ */
+void
+library_initscan_start(void);
+
 void
 library_deinit();
 
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Library source for a replica instance, i.e. an instance that doesn't scan
+ * anything itself, but gets its library from a primary instance. The replica
+ * polls the primary's /api/library/changes with the revision it has, and
+ * applies the rows it gets (see db_replica_*). The ids are kept, so the rows
+ * can be saved as they are. Everything else (queue, outputs, settings) is the
+ * replica's own.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "db.h"
+#include "http.h"
+#include "misc.h"
+#include "misc_json.h"
+#include "listener.h"
+#include "library.h"
+
+// Number of changes (or files when making a full copy) to ask for per request
+#define FEDERATION_LIMIT 1000
+
+// Order of the tables in a reply, so that the rows they reference exist
+static const char *federation_tables[] = { "directories", "files", "playlists", "playlistitems", NULL };
+
+static char *federation_primary;
+static struct timeval federation_interval = { 10, 0 };
+
+static void
+federation_refresh(void *arg);
+
+
+/* ------------------------------ Applying rows ----------------------------- */
+
+static int
+rows_save(const char *table, json_object *jtable)
+{
+  json_object *jcols;
+  json_object *jrows;
+  json_object *jrow;
+  json_object *jval;
+  const char *cols[DB_REPLICA_COLS_MAX];
+  const char *values[DB_REPLICA_COLS_MAX];
+  const char *val;
+  int ncols;
+  int nrows;
+  int i;
+  int j;
+  int ret;
+
+  if (!json_object_object_get_ex(jtable, "columns", &jcols) || !json_object_object_get_ex(jtable, "rows", &jrows))
+    return -1;
+
+  ncols = json_object_array_length(jcols);
+  if (ncols <= 0 || ncols > DB_REPLICA_COLS_MAX)
+    return -1;
+
+  for (i = 0; i < ncols; i++)
+    {
+      cols[i] = json_object_get_string(json_object_array_get_idx(jcols, i));
+      if (!cols[i])
+	return -1;
+    }
+
+  nrows = json_object_array_length(jrows);
+  for (i = 0; i < nrows; i++)
+    {
+      jrow = json_object_array_get_idx(jrows, i);
+      if (json_object_array_length(jrow) != ncols)
+	return -1;
+
+      for (j = 0; j < ncols; j++)
+	{
+	  jval = json_object_array_get_idx(jrow, j);
+	  values[j] = jval ? json_object_get_string(jval) : NULL;
+	}
+
+      // The items of a changed playlist are all sent, so remove the old ones
+      if (strcmp(table, "playlists") == 0 && (val = values[0]))
+	db_replica_playlistitems_clear(strtoul(val, NULL, 10));
+
+      ret = db_replica_row_save(table, ncols, cols, values);
+      if (ret < 0)
+	return -1;
+    }
+
+  return nrows;
+}
+
+static int
+deleted_apply(json_object *jreply, const char *key, enum db_change_item_type type)
+{
+  json_object *jdeleted;
+  int n;
+  int i;
+
+  if (!jparse_array_from_obj(jreply, key, &jdeleted))
+    return 0;
+
+  n = json_object_array_length(jdeleted);
+  for (i = 0; i < n; i++)
+    db_replica_item_delete(type, json_object_get_int64(json_object_array_get_idx(jdeleted, i)));
+
+  return n;
+}
+
+// Applies a reply from the primary, returns the number of changed items
+static int
+reply_apply(json_object *jreply, bool reset, uint32_t after)
+{
+  json_object *jtables;
+  json_object *jtable;
+  int count = 0;
+  int ret;
+  int i;
+
+  if (!json_object_object_get_ex(jreply, "tables", &jtables))
+    return -1;
+
+  if (reset && after == 0)
+    {
+      DPRINTF(E_LOG, L_LIB, "Copying library from primary '%s'\n", federation_primary);
+
+      // If the copy is interrupted it must start over
+      db_purge_all();
+      db_admin_setint64(DB_ADMIN_FEDERATION_REVISION, 0);
+    }
+
+  if (!reset)
+    {
+      count += deleted_apply(jreply, "deleted_files", DB_CHANGE_FILE);
+      count += deleted_apply(jreply, "deleted_playlists", DB_CHANGE_PLAYLIST);
+    }
+
+  for (i = 0; federation_tables[i]; i++)
+    {
+      if (!json_object_object_get_ex(jtables, federation_tables[i], &jtable))
+	continue;
+
+      ret = rows_save(federation_tables[i], jtable);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LIB, "Invalid or unsaveable '%s' rows from primary '%s'\n", federation_tables[i], federation_primary);
+	  return -1;
+	}
+
+      count += ret;
+    }
+
+  return count;
+}
+
+
+/* --------------------------------- Sync ----------------------------------- */
+
+static json_object *
+changes_fetch(int64_t since, uint32_t after)
+{
+  struct http_client_ctx ctx;
+  struct evbuffer *evbuf;
+  json_object *jreply;
+  char url[2048];
+  int ret;
+
+  ret = snprintf(url, sizeof(url), "%s/api/library/changes?since=%" PRIi64 "&after=%" PRIu32 "&limit=%d", federation_primary, since, after, FEDERATION_LIMIT);
+  if (ret < 0 || ret >= (int)sizeof(url))
+    return NULL;
+
+  CHECK_NULL(L_LIB, evbuf = evbuffer_new());
+
+  memset(&ctx, 0, sizeof(struct http_client_ctx));
+  ctx.url = url;
+  ctx.input_body = evbuf;
+
+  ret = http_client_request(&ctx, NULL);
+  if (ret < 0 || ctx.response_code != HTTP_OK)
+    {
+      DPRINTF(E_LOG, L_LIB, "Request for library changes from primary '%s' failed (code %d)\n", federation_primary, ctx.response_code);
+      evbuffer_free(evbuf);
+      return NULL;
+    }
+
+  jreply = jparse_obj_from_evbuffer(evbuf);
+  evbuffer_free(evbuf);
+  if (!jreply)
+    DPRINTF(E_LOG, L_LIB, "Could not parse library changes from primary '%s'\n", federation_primary);
+
+  return jreply;
+}
+
+static void
+federation_sync(void)
+{
+  json_object *jreply;
+  json_object *jval;
+  int64_t revision = 0;
+  int64_t next;
+  uint32_t after = 0;
+  bool reset;
+  bool done;
+  int changes = 0;
+  int ret;
+
+  db_admin_getint64(&revision, DB_ADMIN_FEDERATION_REVISION);
+
+  while (!library_is_exiting())
+    {
+      jreply = changes_fetch(revision, after);
+      if (!jreply)
+	break;
+
+      reset = jparse_bool_from_obj(jreply, "reset");
+      done = jparse_bool_from_obj(jreply, "done");
+      jval = JPARSE_SELECT(jreply, "revision");
+      next = jval ? json_object_get_int64(jval) : 0;
+      jval = JPARSE_SELECT(jreply, "after");
+      if (reset && !jval)
+	{
+	  DPRINTF(E_LOG, L_LIB, "Invalid library changes from primary '%s'\n", federation_primary);
+	  jparse_free(jreply);
+	  break;
+	}
+
+      db_transaction_begin();
+
+      ret = reply_apply(jreply, reset, after);
+      if (ret < 0)
+	{
+	  db_transaction_rollback();
+	  jparse_free(jreply);
+	  break;
+	}
+
+      // A copy is only complete when all of it has been saved, until then we
+      // keep asking with the old revision and the last file id
+      if (reset && !done)
+	after = json_object_get_int64(jval);
+      else
+	{
+	  db_admin_setint64(DB_ADMIN_FEDERATION_REVISION, next);
+	  revision = next;
+	  after = 0;
+	}
+
+      db_transaction_end();
+      jparse_free(jreply);
+
+      changes += ret;
+
+      // When a copy is done we continue with the changes made while copying,
+      // unless the primary has no revision yet (then it will always reset)
+      if (done && (!reset || revision == 0))
+	break;
+    }
+
+  if (changes == 0)
+    return;
+
+  db_groups_cleanup();
+  db_queue_cleanup();
+
+  DPRINTF(E_INFO, L_LIB, "Applied %d library changes from primary '%s', now at revision %" PRIi64 "\n", changes, federation_primary, revision);
+
+  library_update_trigger(LISTENER_DATABASE);
+}
+
+static void
+federation_refresh(void *arg)
+{
+  federation_sync();
+
+  library_callback_schedule(federation_refresh, NULL, &federation_interval, LIBRARY_CB_ADD_OR_REPLACE);
+}
+
+
+/* ------------------------- Library source interface ----------------------- */
+
+static int
+federation_rescan(void)
+{
+  federation_refresh(NULL);
+
+  return LIBRARY_OK;
+}
+
+static int
+federation_fullrescan(void)
+{
+  // The library has been purged, so a full copy is needed
+  db_admin_setint64(DB_ADMIN_FEDERATION_REVISION, 0);
+
+  federation_refresh(NULL);
+
+  return LIBRARY_OK;
+}
+
+static int
+federation_init(void)
+{
+  cfg_t *lib = cfg_getsec(cfg, "library");
+  const char *primary;
+  int interval;
+
+  primary = cfg_getstr(lib, "federation_primary");
+  if (!primary)
+    return -1;
+
+  federation_primary = safe_strdup(primary);
+
+  // Remove trailing slash, we add one when making the url
+  if (strlen(federation_primary) > 0 && federation_primary[strlen(federation_primary) - 1] == '/')
+    federation_primary[strlen(federation_primary) - 1] = '\0';
+
+  interval = cfg_getint(lib, "federation_interval");
+  if (interval > 0)
+    federation_interval.tv_sec = interval;
+
+  DPRINTF(E_LOG, L_LIB, "Library is a replica of '%s', checking for changes every %d sec\n", federation_primary, (int)federation_interval.tv_sec);
+
+  return 0;
+}
+
+static void
+federation_deinit(void)
+{
+  free(federation_primary);
+  federation_primary = NULL;
+}
+
+struct library_source federation =
+{
+  .scan_kind = SCAN_KIND_FEDERATION,
+  .disabled = 0,
+  .init = federation_init,
+  .deinit = federation_deinit,
+  .initscan = federation_rescan,
+  .rescan = federation_rescan,
+  .metarescan = federation_rescan,
+  .fullrescan = federation_fullrescan,
+};
@@ -35,6 +35,10 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/inotify.h>
+#ifdef HAVE_FANOTIFY
+# include <sys/fanotify.h>
+# include <sys/statfs.h>
+#endif
 #include <fcntl.h>
 #include <dirent.h>
 #include <pthread.h>
@@ -115,6 +119,32 @@ struct stacked_dir {
 
 static int inofd;
 static struct event *inoev;
+
+#ifdef HAVE_FANOTIFY
+/* Optional fanotify backend (the library "fanotify" option). Instead of an
+ * inotify watch per directory, each filesystem with a library directory gets
+ * one mark, so there is no max_user_watches limit and nothing to set up per
+ * directory. Directories are still added to the watch table (with made up
+ * wds), and events for a directory in it are translated to inotify events
+ * (the mask bits are the same), so processing is the same as for inotify.
+ * Requires CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH.
+ */
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+#define FANOTIFY_MOUNTS_MAX 16
+
+struct fanotify_mount {
+  int fd; // Directory on the filesystem, for open_by_handle_at()
+  __kernel_fsid_t fsid;
+};
+
+static int fanfd = -1;
+static struct event *fanev;
+static struct fanotify_mount fanotify_mounts[FANOTIFY_MOUNTS_MAX];
+static int fanotify_nmounts;
+static int fanotify_wd_last;
+static uint32_t fanotify_cookie;
+static bool fanotify_cookie_pending;
+#endif
 static struct deferred_pl *playlists;
 static struct stacked_dir *dirstack;
 
@@ -139,6 +169,75 @@ static struct event *deferred_inoev;
 /* Count of files scanned during a bulk scan */
 static int counter;
 
+/* Start time of a bulk scan that was interrupted (e.g. by a restart) and that
+ * we are now resuming, 0 if none. See bulk_scan_journal_begin(). */
+static time_t scan_resume_start;
+
+/* Metadata extraction pool used by the bulk scan when scan_workers > 1. Jobs
+ * are kept in submission order, so that results can be saved in the same
+ * order as if scanning sequentially. Only the workers run ffmpeg, everything
+ * else (incl. all db access) stays in the library thread.
+ */
+struct scan_job {
+  struct media_file_info mfi;
+  time_t mtime;
+  int flags;
+  int ret;
+  uint64_t usec; // Time spent reading metadata
+  bool done;
+  struct scan_job *next;
+};
+
+struct scan_pool {
+  pthread_t *tids;
+  int nthreads;
+  int max_pending;
+
+  pthread_mutex_t lck;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+
+  struct scan_job *head;  // Oldest job, next to be saved
+  struct scan_job *tail;
+  struct scan_job *todo;  // Next job to be picked up by a worker
+  int pending;
+  bool quit;
+};
+
+static struct scan_pool *scan_pool;
+
+/* Stat pool, also used by the bulk scan when scan_workers > 1. On network
+ * storage every lstat() is a round trip, so process_directory() reads a batch
+ * of entries and then has the workers (and itself) stat them concurrently,
+ * before processing the results in readdir order.
+ */
+#define STAT_BATCH_SIZE 256
+
+struct stat_entry {
+  char *path;
+  char *resolved_path; // NULL if read_attributes() failed
+  enum file_type file_type;
+  struct stat sb;
+  int is_link;
+};
+
+struct stat_pool {
+  pthread_t *tids;
+  int nthreads;
+
+  pthread_mutex_t lck;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+
+  struct stat_entry *entries; // Current batch, NULL if none
+  int nentries;
+  int next;     // Next entry to be picked up by a worker
+  int pending;  // Entries of the batch not done yet
+  bool quit;
+};
+
+static struct stat_pool *stat_pool;
+
 /* When copying into the lib (eg. if a file is moved to the lib by copying into
  * a Samba network share) inotify might give us IN_CREATE -> n x IN_ATTRIB ->
  * IN_CLOSE_WRITE, but we don't want to do any scanning before the
@@ -149,6 +248,31 @@ static int counter;
 static int incomingfiles_idx;
 static uint32_t incomingfiles_buffer[INCOMINGFILES_BUFFER_SIZE];
 
+/* Taggers and rsync can produce a storm of events where the same file gets
+ * IN_CLOSE_WRITE several times, or a directory is created and then filled. The
+ * events that only mean "(re)scan this" (IN_CLOSE_WRITE for files, IN_CREATE
+ * for directories) are held back for INOTIFY_COALESCE_SECS after the last event,
+ * and duplicates are dropped. A pending directory also absorbs the events for
+ * files below it, since the directory scan will cover those. Any other event is
+ * order sensitive (moves, deletes), so it flushes the pending events first.
+ */
+#define INOTIFY_COALESCE_SECS 2
+#define INOTIFY_COALESCE_MAX 1000
+
+struct coalesced_event {
+  struct watch_info wi;
+  struct inotify_event ie; /* ie->name not copied, so don't use in process_inotify_* */
+  char path[PATH_MAX];
+  bool is_dir;
+
+  struct coalesced_event *next;
+};
+
+static struct coalesced_event *coalesced_head;
+static struct coalesced_event *coalesced_tail;
+static int coalesced_count;
+static struct event *coalesced_ev;
+
 /* Forward */
 static void
 bulk_scan(int flags);
@@ -550,6 +674,8 @@ process_deferred_playlists(void)
 {
   struct deferred_pl *pl;
 
+  scan_playlist_batch_begin();
+
   while ((pl = playlists))
     {
       playlists = pl->next;
@@ -560,16 +686,284 @@ process_deferred_playlists(void)
       free(pl);
 
       if (library_is_exiting())
-	return;
+	break;
+    }
+
+  scan_playlist_batch_end();
+}
+
+static void
+regular_file_save(struct media_file_info *mfi, time_t mtime, int flags)
+{
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  library_media_save(mfi);
+
+  cache_artwork_ping(mfi->path, mtime, !(flags & F_SCAN_BULK));
+  // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
+
+  library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_SAVE, &start);
+}
+
+static int
+regular_file_metadata_read(struct media_file_info *mfi, uint64_t *usec)
+{
+  struct timespec start;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ret = scan_metadata_ffmpeg(mfi, mfi->path);
+
+  *usec = library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_METADATA, &start);
+
+  return ret;
+}
+
+static void *
+scan_pool_worker(void *arg)
+{
+  struct scan_pool *pool = arg;
+  struct scan_job *job;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  for (;;)
+    {
+      while (!pool->todo && !pool->quit)
+	CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->work_cond, &pool->lck));
+
+      if (!pool->todo)
+	break;
+
+      job = pool->todo;
+      pool->todo = job->next;
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+      // If we are exiting the file is left unsaved, see scan_pool_job_finish()
+      if (library_is_exiting())
+	job->ret = -2;
+      else
+	job->ret = regular_file_metadata_read(&job->mfi, &job->usec);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+      job->done = true;
+      CHECK_ERR(L_SCAN, pthread_cond_signal(&pool->done_cond));
+    }
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  pthread_exit(NULL);
+}
+
+static void
+scan_pool_job_finish(struct scan_job *job)
+{
+  library_scan_stats_file_add(job->mfi.path, job->usec);
+
+  if (job->ret == 0)
+    regular_file_save(&job->mfi, job->mtime, job->flags);
+  else if (job->ret == -2)
+    db_directory_timestamp_reset(job->mfi.directory_id); // So the dir isn't considered unchanged next time
+
+  free_mfi(&job->mfi, 1);
+  free(job);
+}
+
+// Saves the results of finished jobs in submission order, waiting for jobs
+// until no more than max_pending are left
+static void
+scan_pool_drain(int max_pending)
+{
+  struct scan_pool *pool = scan_pool;
+  struct scan_job *job;
+
+  if (!pool)
+    return;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  while (pool->head && (pool->head->done || pool->pending > max_pending))
+    {
+      if (!pool->head->done)
+	{
+	  CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->done_cond, &pool->lck));
+	  continue;
+	}
+
+      job = pool->head;
+      pool->head = job->next;
+      if (!pool->head)
+	pool->tail = NULL;
+      pool->pending--;
+      library_scan_stats_queue_set(pool->pending);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+      scan_pool_job_finish(job);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+    }
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+}
+
+// Takes ownership of the content of mfi
+static void
+scan_pool_submit(struct media_file_info *mfi, time_t mtime, int flags)
+{
+  struct scan_pool *pool = scan_pool;
+  struct scan_job *job;
+
+  CHECK_NULL(L_SCAN, job = calloc(1, sizeof(struct scan_job)));
+
+  job->mfi = *mfi;
+  job->mtime = mtime;
+  job->flags = flags;
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+
+  if (!pool->todo)
+    pool->todo = job;
+  pool->pending++;
+  library_scan_stats_queue_set(pool->pending);
+
+  CHECK_ERR(L_SCAN, pthread_cond_signal(&pool->work_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  scan_pool_drain(pool->max_pending);
+}
+
+static void
+scan_pool_start(void)
+{
+  struct scan_pool *pool;
+  int nthreads;
+  int i;
+  int ret;
+
+  nthreads = cfg_getint(cfg_getsec(cfg, "library"), "scan_workers");
+  if (nthreads <= 1)
+    return;
+
+  CHECK_NULL(L_SCAN, pool = calloc(1, sizeof(struct scan_pool)));
+  CHECK_NULL(L_SCAN, pool->tids = calloc(nthreads, sizeof(pthread_t)));
+
+  // Limits memory use, but still keeps the workers busy while we save
+  pool->max_pending = 4 * nthreads;
+
+  CHECK_ERR(L_SCAN, mutex_init(&pool->lck));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->work_cond, NULL));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->done_cond, NULL));
+
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&pool->tids[i], NULL, scan_pool_worker, pool);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not spawn metadata worker: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(pool->tids[i], "scanworker");
+    }
+
+  pool->nthreads = i;
+  if (pool->nthreads == 0)
+    {
+      pthread_cond_destroy(&pool->done_cond);
+      pthread_cond_destroy(&pool->work_cond);
+      pthread_mutex_destroy(&pool->lck);
+      free(pool->tids);
+      free(pool);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_SCAN, "Using %d metadata workers for bulk scan\n", pool->nthreads);
+
+  scan_pool = pool;
+}
+
+static void
+scan_pool_stop(void)
+{
+  struct scan_pool *pool = scan_pool;
+  int i;
+
+  if (!pool)
+    return;
+
+  scan_pool_drain(0);
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+  pool->quit = true;
+  CHECK_ERR(L_SCAN, pthread_cond_broadcast(&pool->work_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->tids[i], NULL);
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lck);
+  free(pool->tids);
+  free(pool);
+
+  scan_pool = NULL;
+}
+
+/* If the file is new to the library, but matches (by inode, size and mtime) an
+ * entry whose path no longer holds that file, then the file was moved while we
+ * weren't watching. In that case the entry is pointed to the new path, which
+ * preserves play counts, ratings etc. and saves reading the file again.
+ */
+static int
+regular_file_move_detect(const char *file, struct stat *sb, const char *virtual_path, int dir_id)
+{
+  struct stat old_sb;
+  char *old_path;
+  int id;
+  int ret;
+
+  if (!S_ISREG(sb->st_mode))
+    return -1;
+
+  old_path = db_file_path_byinode(&id, sb->st_ino, sb->st_size, sb->st_mtime);
+  if (!old_path)
+    return -1;
+
+  // Still there (e.g. a hard link), so not a move
+  if (stat(old_path, &old_sb) == 0 && old_sb.st_ino == sb->st_ino && old_sb.st_dev == sb->st_dev)
+    {
+      free(old_path);
+      return -1;
     }
+
+  DPRINTF(E_INFO, L_SCAN, "File '%s' was moved to '%s'\n", old_path, file);
+
+  ret = db_file_update_path(id, file, filename_from_path(file), virtual_path, dir_id);
+  free(old_path);
+
+  return (ret > 0) ? 0 : -1;
 }
 
 static void
 process_regular_file(const char *file, struct stat *sb, int type, int flags, int dir_id)
 {
-  bool is_bulkscan = (flags & F_SCAN_BULK);
   struct media_file_info mfi;
   char virtual_path[PATH_MAX];
+  uint64_t usec = 0;
   int ret;
 
   if (!(flags & F_SCAN_METARESCAN))
@@ -580,7 +974,10 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
       // always scan.
       ret = db_file_ping_bypath(file, sb->st_mtime);
       if ((sb->st_mtime != 0) && (ret != 0))
-        return;
+	{
+	  library_scan_stats_file_add(file, 0);
+	  return;
+	}
     }
 
   // File is new or modified - (re)scan metadata and update file in library
@@ -589,13 +986,25 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   // Sets id=0 if file is not in the library already
   mfi.id = db_file_id_bypath(file);
 
+  snprintf(virtual_path, PATH_MAX, "/file:%s", file);
+
+  if (mfi.id == 0 && !(flags & F_SCAN_METARESCAN))
+    {
+      ret = regular_file_move_detect(file, sb, virtual_path, dir_id);
+      if (ret == 0)
+	{
+	  library_scan_stats_file_add(file, 0);
+	  return;
+	}
+    }
+
   mfi.fname = strdup(filename_from_path(file));
   mfi.path = strdup(file);
 
   mfi.time_modified = sb->st_mtime;
   mfi.file_size = sb->st_size;
+  mfi.inode = sb->st_ino;
 
-  snprintf(virtual_path, PATH_MAX, "/file:%s", file);
   mfi.virtual_path = strdup(virtual_path);
 
   mfi.directory_id = dir_id;
@@ -625,18 +1034,24 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	  mfi.album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
 	}
 
-      ret = scan_metadata_ffmpeg(&mfi, file);
+      if (scan_pool && (flags & F_SCAN_BULK))
+	{
+	  scan_pool_submit(&mfi, sb->st_mtime, flags);
+	  return;
+	}
+
+      ret = regular_file_metadata_read(&mfi, &usec);
       if (ret < 0)
 	{
+	  library_scan_stats_file_add(file, usec);
 	  free_mfi(&mfi, 1);
 	  return;
 	}
     }
 
-  library_media_save(&mfi);
+  library_scan_stats_file_add(file, usec);
 
-  cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
-  // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
+  regular_file_save(&mfi, sb->st_mtime, flags);
 
   free_mfi(&mfi, 1);
 }
@@ -645,6 +1060,11 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 static void
 process_file(char *file, struct stat *sb, enum file_type file_type, int scan_type, int flags, int dir_id)
 {
+  // Only the library thread processes files
+  static unsigned int throttle_ms;
+
+  player_pressure_throttle(&throttle_ms);
+
   switch (file_type)
     {
       case FILE_REGULAR:
@@ -808,118 +1228,385 @@ read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_
 }
 
 static void
-process_directory(char *path, int parent_id, int flags)
+stat_entry_read(struct stat_entry *e)
 {
-  DIR *dirp;
-  struct dirent *de;
-  char entry[PATH_MAX];
   char resolved_path[PATH_MAX];
-  struct stat sb;
-  int is_link;
-  int follow_symlinks;
-  struct watch_info wi;
-  int scan_type;
-  enum file_type file_type;
-  char virtual_path[PATH_MAX];
-  int dir_id;
   int ret;
 
-  DPRINTF(E_DBG, L_SCAN, "Processing directory %s (flags = 0x%x)\n", path, flags);
-
-  dirp = opendir(path);
-  if (!dirp)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Could not open directory %s: %s\n", path, strerror(errno));
-      return;
-    }
-
-  /* Add/update directories table */
-
-  ret = virtual_path_make(virtual_path, sizeof(virtual_path), path);
+  ret = read_attributes(resolved_path, e->path, &e->sb, &e->is_link);
   if (ret < 0)
     {
-      closedir(dirp);
+      DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", e->path);
       return;
     }
 
-  dir_id = library_directory_save(virtual_path, path, 0, parent_id, SCAN_KIND_FILES);
-  if (dir_id <= 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Insert or update of directory failed '%s'\n", virtual_path);
-    }
+  CHECK_NULL(L_SCAN, e->resolved_path = strdup(resolved_path));
+}
 
-  /* Check if compilation and/or podcast directory */
-  scan_type = 0;
-  if (check_speciallib(path, "compilations"))
-    scan_type |= F_SCAN_TYPE_COMPILATION;
-  if (check_speciallib(path, "podcasts"))
-    scan_type |= F_SCAN_TYPE_PODCAST;
-  if (check_speciallib(path, "audiobooks"))
-    scan_type |= F_SCAN_TYPE_AUDIOBOOK;
+static void *
+stat_pool_worker(void *arg)
+{
+  struct stat_pool *pool = arg;
+  struct stat_entry *e;
 
-  follow_symlinks = cfg_getbool(cfg_getsec(cfg, "library"), "follow_symlinks");
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
 
   for (;;)
     {
-      if (library_is_exiting())
+      while (!(pool->entries && pool->next < pool->nentries) && !pool->quit)
+	CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->work_cond, &pool->lck));
+
+      if (pool->quit)
 	break;
 
-      errno = 0;
-      de = readdir(dirp);
-      if (errno)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "readdir error in %s: %s\n", path, strerror(errno));
-	  break;
-	}
+      e = &pool->entries[pool->next];
+      pool->next++;
 
-      if (!de)
-	break;
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
 
-      if (de->d_name[0] == '.')
-	continue;
+      stat_entry_read(e);
 
-      ret = snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
-      if ((ret < 0) || (ret >= sizeof(entry)))
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", path, de->d_name);
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
 
-	  continue;
-	}
+      pool->pending--;
+      if (pool->pending == 0)
+	CHECK_ERR(L_SCAN, pthread_cond_signal(&pool->done_cond));
+    }
 
-      file_type = file_type_get(entry);
-      if (file_type == FILE_IGNORE)
-	continue;
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
 
-      ret = read_attributes(resolved_path, entry, &sb, &is_link);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", entry);
-	  continue;
-	}
+  pthread_exit(NULL);
+}
 
-      if (is_link && !follow_symlinks)
-        {
-          DPRINTF(E_DBG, L_SCAN, "Ignore symlink %s\n", entry);
-          continue;
-        }
+// Stats all the entries, concurrently if the pool is running. Returns when all
+// are done.
+static void
+stat_batch_read(struct stat_entry *entries, int nentries)
+{
+  struct stat_pool *pool = stat_pool;
+  struct stat_entry *e;
+  int i;
 
-      if (S_ISDIR(sb.st_mode))
-	{
-	  push_dir(&dirstack, resolved_path, dir_id);
-	}
-      else if (!(flags & F_SCAN_FAST))
+  if (!pool || nentries < 2)
+    {
+      for (i = 0; i < nentries; i++)
+	stat_entry_read(&entries[i]);
+      return;
+    }
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  pool->entries = entries;
+  pool->nentries = nentries;
+  pool->next = 0;
+  pool->pending = nentries;
+  CHECK_ERR(L_SCAN, pthread_cond_broadcast(&pool->work_cond));
+
+  // We don't just wait, we also help
+  while (pool->next < pool->nentries)
+    {
+      e = &pool->entries[pool->next];
+      pool->next++;
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+      stat_entry_read(e);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+      pool->pending--;
+    }
+
+  while (pool->pending > 0)
+    CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->done_cond, &pool->lck));
+
+  pool->entries = NULL;
+  pool->nentries = 0;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+}
+
+static void
+stat_batch_clear(struct stat_entry *entries, int nentries)
+{
+  int i;
+
+  for (i = 0; i < nentries; i++)
+    {
+      free(entries[i].path);
+      free(entries[i].resolved_path);
+    }
+
+  memset(entries, 0, nentries * sizeof(struct stat_entry));
+}
+
+static void
+stat_pool_start(void)
+{
+  struct stat_pool *pool;
+  int nthreads;
+  int i;
+  int ret;
+
+  nthreads = cfg_getint(cfg_getsec(cfg, "library"), "scan_workers");
+  if (nthreads <= 1)
+    return;
+
+  CHECK_NULL(L_SCAN, pool = calloc(1, sizeof(struct stat_pool)));
+  CHECK_NULL(L_SCAN, pool->tids = calloc(nthreads, sizeof(pthread_t)));
+
+  CHECK_ERR(L_SCAN, mutex_init(&pool->lck));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->work_cond, NULL));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->done_cond, NULL));
+
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&pool->tids[i], NULL, stat_pool_worker, pool);
+      if (ret != 0)
 	{
-	  if (S_ISREG(sb.st_mode) || S_ISFIFO(sb.st_mode))
-	    process_file(resolved_path, &sb, file_type, scan_type, flags, dir_id);
-	  else
-	    DPRINTF(E_LOG, L_SCAN, "Skipping %s, not a directory, symlink, pipe nor regular file\n", entry);
+	  DPRINTF(E_LOG, L_SCAN, "Could not spawn stat worker: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(pool->tids[i], "statworker");
+    }
+
+  pool->nthreads = i;
+  if (pool->nthreads == 0)
+    {
+      pthread_cond_destroy(&pool->done_cond);
+      pthread_cond_destroy(&pool->work_cond);
+      pthread_mutex_destroy(&pool->lck);
+      free(pool->tids);
+      free(pool);
+      return;
+    }
+
+  stat_pool = pool;
+}
+
+static void
+stat_pool_stop(void)
+{
+  struct stat_pool *pool = stat_pool;
+  int i;
+
+  if (!pool)
+    return;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+  pool->quit = true;
+  CHECK_ERR(L_SCAN, pthread_cond_broadcast(&pool->work_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->tids[i], NULL);
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lck);
+  free(pool->tids);
+  free(pool);
+
+  stat_pool = NULL;
+}
+
+static void
+process_directory(char *path, int parent_id, int flags)
+{
+  DIR *dirp;
+  struct dirent *de;
+  char entry[PATH_MAX];
+  struct stat_entry *batch;
+  struct stat_entry *e;
+  int nbatch;
+  bool is_done;
+  struct stat sb;
+  int follow_symlinks;
+  struct watch_info wi;
+  int scan_type;
+  enum file_type file_type;
+  char virtual_path[PATH_MAX];
+  time_t dir_scanned;
+  bool dir_unchanged;
+  struct timespec start;
+  int dir_id;
+  int ret;
+  int i;
+
+  DPRINTF(E_DBG, L_SCAN, "Processing directory %s (flags = 0x%x)\n", path, flags);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  dirp = opendir(path);
+  library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_WALK, &start);
+  if (!dirp)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not open directory %s: %s\n", path, strerror(errno));
+      return;
+    }
+
+  library_scan_stats_dir_add();
+
+  /* Add/update directories table */
+
+  ret = virtual_path_make(virtual_path, sizeof(virtual_path), path);
+  if (ret < 0)
+    {
+      closedir(dirp);
+      return;
+    }
+
+  // In a bulk scan, a directory that is unchanged since it was last scanned can
+  // have its files pinged in one go instead of one by one. Files are only added
+  // or removed if the directory mtime changes, so only files with a newer mtime
+  // than the last scan (i.e. modified in place) need to be processed.
+  dir_scanned = 0;
+  if ((flags & F_SCAN_BULK) && !(flags & F_SCAN_METARESCAN) && !(flags & F_SCAN_FAST))
+    {
+      dir_scanned = db_directory_timestamp_byvirtualpath(virtual_path);
+      if (dir_scanned > 0 && (stat(path, &sb) < 0 || sb.st_mtime >= dir_scanned))
+	dir_scanned = 0;
+
+      // If the interrupted scan got to this directory we can't know if all its
+      // files were saved, so ping them one by one (they won't be re-read)
+      if (scan_resume_start > 0 && dir_scanned >= scan_resume_start)
+	dir_scanned = 0;
+    }
+
+  dir_unchanged = (dir_scanned > 0);
+
+  dir_id = library_directory_save(virtual_path, path, 0, parent_id, SCAN_KIND_FILES);
+  if (dir_id <= 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Insert or update of directory failed '%s'\n", virtual_path);
+      dir_unchanged = false;
+    }
+
+  if (dir_unchanged)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Directory unchanged since last scan, pinging files in %s\n", path);
+
+      db_file_ping_bydirectory(dir_id);
+      cache_artwork_ping_bydir(path);
+    }
+  else
+    {
+      // Could be that an artwork file was added
+      cache_artwork_misses_delete_bydir(path);
+    }
+
+  /* Check if compilation and/or podcast directory */
+  scan_type = 0;
+  if (check_speciallib(path, "compilations"))
+    scan_type |= F_SCAN_TYPE_COMPILATION;
+  if (check_speciallib(path, "podcasts"))
+    scan_type |= F_SCAN_TYPE_PODCAST;
+  if (check_speciallib(path, "audiobooks"))
+    scan_type |= F_SCAN_TYPE_AUDIOBOOK;
+
+  follow_symlinks = cfg_getbool(cfg_getsec(cfg, "library"), "follow_symlinks");
+
+  CHECK_NULL(L_SCAN, batch = calloc(STAT_BATCH_SIZE, sizeof(struct stat_entry)));
+
+  for (is_done = false; !is_done;)
+    {
+      // Read a batch of entries, so they can be stat'ed concurrently
+      nbatch = 0;
+      while (nbatch < STAT_BATCH_SIZE)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  errno = 0;
+	  de = readdir(dirp);
+	  library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_WALK, &start);
+	  if (errno)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "readdir error in %s: %s\n", path, strerror(errno));
+	      is_done = true;
+	      break;
+	    }
+
+	  if (!de)
+	    {
+	      is_done = true;
+	      break;
+	    }
+
+	  if (de->d_name[0] == '.')
+	    continue;
+
+	  ret = snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
+	  if ((ret < 0) || (ret >= sizeof(entry)))
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", path, de->d_name);
+
+	      continue;
+	    }
+
+	  file_type = file_type_get(entry);
+	  if (file_type == FILE_IGNORE)
+	    continue;
+
+	  CHECK_NULL(L_SCAN, batch[nbatch].path = strdup(entry));
+	  batch[nbatch].file_type = file_type;
+	  nbatch++;
 	}
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      stat_batch_read(batch, nbatch);
+      library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_STAT, &start);
+
+      for (i = 0; i < nbatch; i++)
+	{
+	  if (library_is_exiting())
+	    {
+	      // The files we didn't get to must not be considered unchanged next time
+	      if (dir_id > 0)
+		db_directory_timestamp_reset(dir_id);
+	      is_done = true;
+	      break;
+	    }
+
+	  e = &batch[i];
+	  if (!e->resolved_path)
+	    continue;
+
+	  if (e->is_link && !follow_symlinks)
+	    {
+	      DPRINTF(E_DBG, L_SCAN, "Ignore symlink %s\n", e->path);
+	      continue;
+	    }
+
+	  if (S_ISDIR(e->sb.st_mode))
+	    {
+	      push_dir(&dirstack, e->resolved_path, dir_id);
+	    }
+	  else if (!(flags & F_SCAN_FAST))
+	    {
+	      if (dir_unchanged && e->file_type == FILE_REGULAR && S_ISREG(e->sb.st_mode) && e->sb.st_mtime != 0 && e->sb.st_mtime < dir_scanned)
+		continue; // Already pinged with the directory
+	      else if (S_ISREG(e->sb.st_mode) || S_ISFIFO(e->sb.st_mode))
+		process_file(e->resolved_path, &e->sb, e->file_type, scan_type, flags, dir_id);
+	      else
+		DPRINTF(E_LOG, L_SCAN, "Skipping %s, not a directory, symlink, pipe nor regular file\n", e->path);
+	    }
+	}
+
+      stat_batch_clear(batch, nbatch);
     }
 
+  free(batch);
+
   closedir(dirp);
 
   memset(&wi, 0, sizeof(struct watch_info));
 
+#ifdef HAVE_FANOTIFY
+  // The fanotify mark covers the directory, it just needs to be in the watch
+  // table so that its events can be matched
+  if (fanfd >= 0)
+    wi.wd = ++fanotify_wd_last;
+  else
+#endif
   // Add inotify watch (for FreeBSD we limit the flags so only dirs will be
   // opened, otherwise we will be opening way too many files)
   wi.wd = inotify_add_watch(inofd, path, INOTIFY_FLAGS);
@@ -1004,6 +1691,38 @@ process_directories(char *root, int parent_id, int flags)
 
 
 /* Thread: scan */
+/* The scan journal is the start time of the current bulk scan, persisted in the
+ * admin table until the scan has completed. Files are committed while scanning
+ * and skipped by the next scan if unchanged, so an interrupted scan can resume
+ * from where it got to. The journal tells the next scan that the directory
+ * timestamps from the interrupted scan can't be trusted, since the directory
+ * may not have been completed.
+ */
+static void
+bulk_scan_journal_begin(time_t start)
+{
+  int64_t journal_start = 0;
+
+  db_admin_getint64(&journal_start, DB_ADMIN_SCAN_START);
+
+  scan_resume_start = journal_start;
+  if (scan_resume_start > 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Resuming interrupted library scan from %s", ctime(&scan_resume_start));
+      return;
+    }
+
+  db_admin_setint64(DB_ADMIN_SCAN_START, (int64_t)start);
+}
+
+static void
+bulk_scan_journal_end(void)
+{
+  scan_resume_start = 0;
+
+  db_admin_delete(DB_ADMIN_SCAN_START);
+}
+
 static void
 bulk_scan(int flags)
 {
@@ -1013,6 +1732,7 @@ bulk_scan(int flags)
   char *deref;
   time_t start;
   time_t end;
+  struct timespec pl_start;
   int parent_id;
   int i;
   char virtual_path[PATH_MAX];
@@ -1026,6 +1746,14 @@ bulk_scan(int flags)
   lib = cfg_getsec(cfg, "library");
   counter = 0;
 
+  if (!(flags & F_SCAN_FAST))
+    {
+      bulk_scan_journal_begin(start);
+      scan_pool_start();
+    }
+
+  stat_pool_start();
+
   ndirs = cfg_size(lib, "directories");
   for (i = 0; i < ndirs; i++)
     {
@@ -1057,16 +1785,27 @@ bulk_scan(int flags)
       db_transaction_begin();
 
       process_directories(deref, parent_id, flags);
+      scan_pool_drain(0);
       db_transaction_end();
 
       free(deref);
 
       if (library_is_exiting())
-	return;
+	break;
     }
 
+  scan_pool_stop();
+  stat_pool_stop();
+
+  if (library_is_exiting())
+    return;
+
   if (!(flags & F_SCAN_FAST) && playlists)
-    process_deferred_playlists();
+    {
+      clock_gettime(CLOCK_MONOTONIC, &pl_start);
+      process_deferred_playlists();
+      library_scan_stats_phase_add(LIBRARY_SCAN_PHASE_PLAYLISTS, &pl_start);
+    }
 
   if (library_is_exiting())
     return;
@@ -1074,6 +1813,9 @@ bulk_scan(int flags)
   if (dirstack)
     DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
 
+  if (!(flags & F_SCAN_FAST))
+    bulk_scan_journal_end();
+
   end = time(NULL);
 
   if (flags & F_SCAN_FAST)
@@ -1502,6 +2244,122 @@ process_inotify_file_defer(struct watch_info *wi, char *path, struct inotify_eve
 #endif
 
 
+/* Thread: scan */
+static void
+inotify_coalesced_flush(void)
+{
+  struct coalesced_event *ce;
+
+  if (!coalesced_head)
+    return;
+
+  evtimer_del(coalesced_ev);
+
+  DPRINTF(E_DBG, L_SCAN, "Processing %d coalesced inotify events\n", coalesced_count);
+
+  db_transaction_begin();
+
+  while ((ce = coalesced_head))
+    {
+      coalesced_head = ce->next;
+      if (!coalesced_head)
+	coalesced_tail = NULL;
+      coalesced_count--;
+
+      if (ce->is_dir)
+	process_inotify_dir(&ce->wi, ce->path, &ce->ie);
+      else
+	process_inotify_file(&ce->wi, ce->path, &ce->ie);
+
+      free_wi(&ce->wi, 1);
+      free(ce);
+    }
+
+  db_transaction_end();
+}
+
+static void
+inotify_coalesced_cb(int fd, short what, void *arg)
+{
+  inotify_coalesced_flush();
+}
+
+static void
+inotify_coalesced_clear(void)
+{
+  struct coalesced_event *ce;
+
+  while ((ce = coalesced_head))
+    {
+      coalesced_head = ce->next;
+      free_wi(&ce->wi, 1);
+      free(ce);
+    }
+
+  coalesced_tail = NULL;
+  coalesced_count = 0;
+}
+
+static bool
+inotify_is_coalescable(struct inotify_event *ie, bool is_dir)
+{
+  if (is_dir)
+    return (ie->len > 0) && ((ie->mask & ~IN_ISDIR) == IN_CREATE);
+  else
+    return (ie->mask == IN_CLOSE_WRITE);
+}
+
+// Returns true if the event was queued (or dropped as duplicate), false if the
+// caller should process it now
+static bool
+inotify_coalesce(struct watch_info *wi, const char *path, struct inotify_event *ie, bool is_dir)
+{
+  struct timeval tv = { INOTIFY_COALESCE_SECS, 0 };
+  struct coalesced_event *ce;
+  size_t len;
+
+  if (!inotify_is_coalescable(ie, is_dir))
+    {
+      inotify_coalesced_flush();
+      return false;
+    }
+
+  for (ce = coalesced_head; ce; ce = ce->next)
+    {
+      if (strcmp(ce->path, path) == 0)
+	goto queued;
+
+      // File or directory below a directory that will be scanned anyway
+      len = strlen(ce->path);
+      if (ce->is_dir && strncmp(ce->path, path, len) == 0 && path[len] == '/')
+	goto queued;
+    }
+
+  if (coalesced_count >= INOTIFY_COALESCE_MAX)
+    inotify_coalesced_flush();
+
+  CHECK_NULL(L_SCAN, ce = calloc(1, sizeof(struct coalesced_event)));
+
+  ce->wi = *wi;
+  ce->wi.path = safe_strdup(wi->path);
+  ce->ie = *ie;
+  ce->ie.len = 0;
+  ce->is_dir = is_dir;
+  snprintf(ce->path, sizeof(ce->path), "%s", path);
+
+  if (coalesced_tail)
+    coalesced_tail->next = ce;
+  else
+    coalesced_head = ce;
+  coalesced_tail = ce;
+  coalesced_count++;
+
+ queued:
+  // Restart the timer, so we only process when the storm has settled
+  evtimer_add(coalesced_ev, &tv);
+  return true;
+}
+
 /* Thread: scan */
 static void
 inotify_cb(int fd, short event, void *arg)
@@ -1511,6 +2369,7 @@ inotify_cb(int fd, short event, void *arg)
   uint8_t *buf;
   uint8_t *ptr;
   char path[PATH_MAX];
+  bool is_dir;
   int size;
   int namelen;
   int ret;
@@ -1598,7 +2457,10 @@ inotify_cb(int fd, short event, void *arg)
        * General watch events like IN_UNMOUNT and IN_IGNORED do not come
        * with the IN_ISDIR flag set.
        */
-      if ((ie->mask & IN_ISDIR) || (ie->len == 0))
+      is_dir = (ie->mask & IN_ISDIR) || (ie->len == 0);
+      if (inotify_coalesce(&wi, path, ie, is_dir))
+	;
+      else if (is_dir)
 	process_inotify_dir(&wi, path, ie);
       else
 #ifdef __linux__
@@ -1614,6 +2476,255 @@ inotify_cb(int fd, short event, void *arg)
   event_add(inoev, NULL);
 }
 
+#ifdef HAVE_FANOTIFY
+static int
+fanotify_dir_resolve(char *dir, size_t dir_size, __kernel_fsid_t *fsid, struct file_handle *fh)
+{
+  char proc_path[64];
+  ssize_t len;
+  int mount_fd;
+  int fd;
+  int i;
+
+  mount_fd = -1;
+  for (i = 0; i < fanotify_nmounts; i++)
+    {
+      if (memcmp(&fanotify_mounts[i].fsid, fsid, sizeof(__kernel_fsid_t)) == 0)
+	{
+	  mount_fd = fanotify_mounts[i].fd;
+	  break;
+	}
+    }
+
+  if (mount_fd < 0)
+    return -1;
+
+  // Fails with ESTALE if the directory has been deleted
+  fd = open_by_handle_at(mount_fd, fh, O_RDONLY | O_PATH);
+  if (fd < 0)
+    return -1;
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  len = readlink(proc_path, dir, dir_size - 1);
+  close(fd);
+  if (len < 0)
+    return -1;
+
+  dir[len] = '\0';
+  return 0;
+}
+
+/* Thread: scan */
+static void
+fanotify_event_process(struct fanotify_event_metadata *meta)
+{
+  struct fanotify_event_info_fid *fid;
+  struct file_handle *fh;
+  struct inotify_event ie;
+  struct watch_info wi;
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  const char *name;
+  uint32_t cookie;
+  bool is_dir;
+  int ret;
+
+  fid = (struct fanotify_event_info_fid *)(meta + 1);
+  if ((uint8_t *)fid + sizeof(struct fanotify_event_info_fid) > (uint8_t *)meta + meta->event_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+    return;
+
+  fh = (struct file_handle *)fid->handle;
+  name = (const char *)fh->f_handle + fh->handle_bytes;
+
+  // fanotify has no cookies, but a rename gives a MOVED_FROM that is followed
+  // directly by the MOVED_TO. Must be done before filtering, so that a move
+  // from outside the library doesn't get the cookie of an earlier move.
+  cookie = 0;
+  if (meta->mask & FAN_MOVED_FROM)
+    cookie = ++fanotify_cookie;
+  else if ((meta->mask & FAN_MOVED_TO) && fanotify_cookie_pending)
+    cookie = fanotify_cookie;
+  else if (meta->mask & FAN_MOVED_TO)
+    cookie = ++fanotify_cookie; // Not known, so it is like a new file
+  fanotify_cookie_pending = (meta->mask & FAN_MOVED_FROM);
+
+  ret = fanotify_dir_resolve(dir, sizeof(dir), &fid->fsid, fh);
+  if (ret < 0)
+    return;
+
+  // Also filters out events that are outside the library
+  memset(&wi, 0, sizeof(struct watch_info));
+  ret = db_watch_get_bypath(&wi, dir);
+  if (ret < 0)
+    return;
+
+  ret = snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((ret < 0) || (ret >= sizeof(path)))
+    {
+      DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", dir, name);
+
+      free_wi(&wi, 1);
+      return;
+    }
+
+  is_dir = (meta->mask & FAN_ONDIR);
+
+  memset(&ie, 0, sizeof(struct inotify_event));
+  ie.wd = wi.wd;
+  ie.mask = meta->mask & (IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+  ie.mask |= is_dir ? IN_ISDIR : 0;
+  ie.cookie = cookie;
+  ie.len = strlen(name) + 1; // Not an event on the watched directory itself
+
+  // With inotify the watch of a deleted directory goes away by itself
+  if (is_dir && (ie.mask & IN_DELETE))
+    {
+      db_watch_delete_bypath(path);
+      db_watch_delete_bymatch(path);
+    }
+
+  if (inotify_coalesce(&wi, path, &ie, is_dir))
+    ;
+  else if (is_dir)
+    process_inotify_dir(&wi, path, &ie);
+  else
+    process_inotify_file(&wi, path, &ie);
+
+  free_wi(&wi, 1);
+}
+
+/* Thread: scan */
+static void
+fanotify_cb(int fd, short event, void *arg)
+{
+  struct fanotify_event_metadata *meta;
+  uint8_t buf[8192] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+  ssize_t len;
+
+  for (;;)
+    {
+      len = read(fd, buf, sizeof(buf));
+      if (len < 0 && errno == EAGAIN)
+	break;
+      else if (len <= 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "fanotify read failed: %s\n", strerror(errno));
+	  break;
+	}
+
+      for (meta = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len))
+	{
+	  if (meta->vers != FANOTIFY_METADATA_VERSION)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Unexpected fanotify metadata version %d\n", meta->vers);
+	      break;
+	    }
+
+	  if (meta->mask & FAN_Q_OVERFLOW)
+	    {
+	      DPRINTF(E_WARN, L_SCAN, "fanotify queue overflow, some library changes were missed\n");
+	      continue;
+	    }
+
+	  fanotify_event_process(meta);
+	}
+    }
+
+  event_add(fanev, NULL);
+}
+
+/* Thread: main & scan */
+static void
+fanotify_event_unset(void)
+{
+  int i;
+
+  if (fanev)
+    event_free(fanev);
+  fanev = NULL;
+
+  for (i = 0; i < fanotify_nmounts; i++)
+    close(fanotify_mounts[i].fd);
+  fanotify_nmounts = 0;
+
+  if (fanfd >= 0)
+    close(fanfd);
+  fanfd = -1;
+}
+
+/* Thread: main & scan */
+static int
+fanotify_event_set(void)
+{
+  cfg_t *lib = cfg_getsec(cfg, "library");
+  struct statfs sfs;
+  const char *path;
+  int ndirs;
+  int fd;
+  int i;
+  int j;
+  int ret;
+
+  fanfd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+  if (fanfd < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not create fanotify fd, will use inotify: %s\n", strerror(errno));
+      return -1;
+    }
+
+  ndirs = cfg_size(lib, "directories");
+  for (i = 0; i < ndirs; i++)
+    {
+      path = cfg_getnstr(lib, "directories", i);
+
+      fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0 || fstatfs(fd, &sfs) < 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not open library directory '%s' for fanotify, will use inotify: %s\n", path, strerror(errno));
+	  if (fd >= 0)
+	    close(fd);
+	  goto error;
+	}
+
+      // One mark per filesystem
+      for (j = 0; j < fanotify_nmounts; j++)
+	{
+	  if (memcmp(&fanotify_mounts[j].fsid, &sfs.f_fsid, sizeof(__kernel_fsid_t)) == 0)
+	    break;
+	}
+
+      if (j < fanotify_nmounts)
+	{
+	  close(fd);
+	  continue;
+	}
+
+      ret = (fanotify_nmounts < FANOTIFY_MOUNTS_MAX) ? fanotify_mark(fanfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path) : -1;
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not add fanotify mark for '%s', will use inotify: %s\n", path, strerror(errno));
+	  close(fd);
+	  goto error;
+	}
+
+      fanotify_mounts[fanotify_nmounts].fd = fd;
+      memcpy(&fanotify_mounts[fanotify_nmounts].fsid, &sfs.f_fsid, sizeof(__kernel_fsid_t));
+      fanotify_nmounts++;
+    }
+
+  CHECK_NULL(L_SCAN, fanev = event_new(evbase_lib, fanfd, EV_READ, fanotify_cb, NULL));
+  event_add(fanev, NULL);
+
+  DPRINTF(E_INFO, L_SCAN, "Using fanotify for %d filesystem(s)\n", fanotify_nmounts);
+
+  return 0;
+
+ error:
+  fanotify_event_unset();
+  return -1;
+}
+#endif
+
 /* Thread: main & scan */
 static int
 inofd_event_set(void)
@@ -1626,8 +2737,22 @@ inofd_event_set(void)
       return -1;
     }
 
+#ifdef HAVE_FANOTIFY
+  // If it doesn't work we just continue with inotify
+  if (cfg_getbool(cfg_getsec(cfg, "library"), "fanotify"))
+    fanotify_event_set();
+#endif
+
   inoev = event_new(evbase_lib, inofd, EV_READ, inotify_cb, NULL);
 
+  coalesced_ev = evtimer_new(evbase_lib, inotify_coalesced_cb, NULL);
+  if (!coalesced_ev)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not create coalesced inotify event\n");
+
+      return -1;
+    }
+
 #ifndef __linux__
   deferred_inoev = evtimer_new(evbase_lib, inotify_deferred_cb, NULL);
   if (!deferred_inoev)
@@ -1648,8 +2773,13 @@ inofd_event_unset(void)
 #ifndef __linux__
   event_free(deferred_inoev);
 #endif
+  inotify_coalesced_clear();
+  event_free(coalesced_ev);
   event_free(inoev);
   close(inofd);
+#ifdef HAVE_FANOTIFY
+  fanotify_event_unset();
+#endif
 }
 
 /* Thread: scan */
@@ -1969,7 +3099,8 @@ playlist_add_files(FILE *fp, int pl_id, const char *virtual_path)
   qp.type = Q_ITEMS;
   qp.sort = S_ARTIST;
   qp.idx_type = I_NONE;
-  qp.filter = db_mprintf("(f.virtual_path = %Q OR f.virtual_path LIKE '%q/%%')", virtual_path, virtual_path);
+  qp.filter = db_mprintf("(daap_fold(f.virtual_path) = daap_fold(%Q) OR (daap_fold(f.virtual_path) > daap_fold('%q/') AND daap_fold(f.virtual_path) < daap_fold('%q/') || char(1114111)))",
+			 virtual_path, virtual_path, virtual_path);
 
   ret = db_query_start(&qp);
   if (ret < 0)
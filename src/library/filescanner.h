@@ -16,6 +16,16 @@ scan_metadata_stream(struct media_file_info *mfi, const char *path);
 void
 scan_playlist(const char *file, time_t mtime, int dir_id);
 
+/* Loads a map of all library files by filename, which scan_playlist() then uses
+ * instead of a query per playlist entry. Call before scanning a batch of
+ * playlists and free with scan_playlist_batch_end() when done.
+ */
+void
+scan_playlist_batch_begin(void);
+
+void
+scan_playlist_batch_end(void);
+
 void
 scan_smartpl(const char *file, time_t mtime, int dir_id);
 
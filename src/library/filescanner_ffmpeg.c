@@ -23,7 +23,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -62,8 +64,9 @@ struct metadata_map {
   int flags;
 };
 
-// Used for passing errors to DPRINTF (can't count on av_err2str being present)
-static char errbuf[64];
+// Used for passing errors to DPRINTF (can't count on av_err2str being present).
+// Thread local since the bulk scan may run scan_metadata_ffmpeg() in workers.
+static __thread char errbuf[64];
 
 static inline char *
 err2str(int errnum)
@@ -411,6 +414,250 @@ extract_metadata(struct media_file_info *mfi, AVFormatContext *ctx, AVStream *au
   return mdcount;
 }
 
+/* ------------------------- Native FLAC reader ----------------------------- */
+
+/* For FLAC files everything we need is in the metadata blocks at the start of
+ * the file: STREAMINFO has the audio properties incl. the exact number of
+ * samples, and VORBIS_COMMENT has the tags. Reading those directly saves the
+ * probing that avformat_find_stream_info() does, which matters on network
+ * storage. The comments are put in an AVDictionary the same way ffmpeg's
+ * demuxer would, so the md_maps and parse_xxx() handlers work unchanged. If
+ * anything is unexpected (e.g. an ID3v2 tag in front of the stream, or unknown
+ * length) we return -1 and leave it to ffmpeg.
+ */
+
+#define FLAC_BLOCK_STREAMINFO     0
+#define FLAC_BLOCK_VORBIS_COMMENT 4
+#define FLAC_BLOCK_PICTURE        6
+
+struct flac_info {
+  uint32_t samplerate;
+  uint32_t channels;
+  uint32_t bits_per_sample;
+  uint64_t total_samples;
+  bool has_picture;
+  AVDictionary *md;
+};
+
+static inline uint32_t
+flac_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int
+flac_streaminfo_parse(struct flac_info *fi, const uint8_t *b, size_t len)
+{
+  if (len < 34)
+    return -1;
+
+  fi->samplerate = ((uint32_t)b[10] << 12) | ((uint32_t)b[11] << 4) | (b[12] >> 4);
+  fi->channels = ((b[12] >> 1) & 0x07) + 1;
+  fi->bits_per_sample = (((b[12] & 0x01) << 4) | (b[13] >> 4)) + 1;
+  fi->total_samples = ((uint64_t)(b[13] & 0x0f) << 32) | ((uint64_t)b[14] << 24) | ((uint64_t)b[15] << 16) | ((uint64_t)b[16] << 8) | b[17];
+
+  return 0;
+}
+
+// Same key conversion as ffmpeg's ff_vorbiscomment_metadata_conv
+static const char *
+flac_comment_key_conv(const char *key)
+{
+  if (strcasecmp(key, "ALBUMARTIST") == 0)
+    return "album_artist";
+  if (strcasecmp(key, "TRACKNUMBER") == 0)
+    return "track";
+  if (strcasecmp(key, "DISCNUMBER") == 0)
+    return "disc";
+  if (strcasecmp(key, "DESCRIPTION") == 0)
+    return "comment";
+
+  return key;
+}
+
+static int
+flac_comments_parse(struct flac_info *fi, const uint8_t *b, size_t len)
+{
+  const uint8_t *end = b + len;
+  char key[64];
+  const char *value;
+  char *comment;
+  uint32_t clen;
+  uint32_t count;
+  size_t klen;
+
+  if (len < 4 || flac_le32(b) > len - 4)
+    return -1;
+
+  b += 4 + flac_le32(b); // Skip vendor string
+
+  if (end - b < 4)
+    return -1;
+
+  count = flac_le32(b);
+  b += 4;
+
+  for (; count > 0; count--)
+    {
+      if (end - b < 4 || flac_le32(b) > end - b - 4)
+	return -1;
+
+      clen = flac_le32(b);
+      b += 4;
+
+      comment = strndup((const char *)b, clen);
+      b += clen;
+      if (!comment)
+	return -1;
+
+      value = strchr(comment, '=');
+      klen = value ? value - comment : 0;
+      if (klen == 0 || klen >= sizeof(key) || *(value + 1) == '\0')
+	{
+	  free(comment);
+	  continue;
+	}
+
+      memcpy(key, comment, klen);
+      key[klen] = '\0';
+      value++;
+
+      if (strcasecmp(key, "METADATA_BLOCK_PICTURE") == 0)
+	fi->has_picture = true;
+      else if (strncasecmp(key, "CHAPTER", 7) != 0)
+	{
+	  // Like ffmpeg, multiple values for the same key are joined with ';'
+	  if (av_dict_get(fi->md, flac_comment_key_conv(key), NULL, 0))
+	    av_dict_set(&fi->md, flac_comment_key_conv(key), ";", AV_DICT_APPEND);
+	  av_dict_set(&fi->md, flac_comment_key_conv(key), value, AV_DICT_APPEND);
+	}
+
+      free(comment);
+    }
+
+  return 0;
+}
+
+static int
+flac_info_read(struct flac_info *fi, const char *file)
+{
+  uint8_t header[4];
+  uint8_t *block;
+  uint32_t len;
+  bool has_streaminfo = false;
+  int type;
+  int last;
+  int fd;
+  int ret;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (read(fd, header, 4) != 4 || memcmp(header, "fLaC", 4) != 0)
+    goto error;
+
+  do
+    {
+      if (read(fd, header, 4) != 4)
+	goto error;
+
+      last = header[0] & 0x80;
+      type = header[0] & 0x7f;
+      len = ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+
+      if (type == FLAC_BLOCK_STREAMINFO || type == FLAC_BLOCK_VORBIS_COMMENT)
+	{
+	  block = malloc(len);
+	  if (!block || read(fd, block, len) != len)
+	    {
+	      free(block);
+	      goto error;
+	    }
+
+	  if (type == FLAC_BLOCK_STREAMINFO)
+	    {
+	      ret = flac_streaminfo_parse(fi, block, len);
+	      has_streaminfo = (ret == 0);
+	    }
+	  else
+	    ret = flac_comments_parse(fi, block, len);
+
+	  free(block);
+	  if (ret < 0)
+	    goto error;
+	}
+      else
+	{
+	  if (type == FLAC_BLOCK_PICTURE)
+	    fi->has_picture = true;
+
+	  if (lseek(fd, len, SEEK_CUR) < 0)
+	    goto error;
+	}
+    }
+  while (!last);
+
+  close(fd);
+
+  if (!has_streaminfo || fi->samplerate == 0 || fi->total_samples == 0)
+    return -1;
+
+  return 0;
+
+ error:
+  close(fd);
+  return -1;
+}
+
+static int
+scan_metadata_flac(struct media_file_info *mfi, const char *file)
+{
+  struct flac_info fi = { 0 };
+  int mdcount;
+
+  if (flac_info_read(&fi, file) < 0)
+    {
+      av_dict_free(&fi.md);
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_SCAN, "FLAC (native reader)\n");
+
+  mfi->samplerate = fi.samplerate;
+  mfi->channels = fi.channels;
+  // ffmpeg's FLAC decoder outputs S16 for up to 16 bits and S32 for more
+  mfi->bits_per_sample = (fi.bits_per_sample <= 16) ? 16 : 32;
+  mfi->song_length = fi.total_samples * 1000 / fi.samplerate;
+  if (mfi->song_length > 0)
+    mfi->bitrate = (mfi->file_size * 8) / mfi->song_length;
+  if (fi.has_picture)
+    mfi->artwork = ARTWORK_EMBEDDED;
+
+  mfi->type = strdup("flac");
+  mfi->codectype = strdup("flac");
+  mfi->description = strdup("FLAC audio file");
+
+  mdcount = 0;
+  if (fi.md)
+    {
+      mdcount += extract_metadata_from_dict(mfi, fi.md, md_map_vorbis);
+      mdcount += extract_metadata_from_dict(mfi, fi.md, md_map_generic);
+    }
+
+  av_dict_free(&fi.md);
+
+  DPRINTF(E_DBG, L_SCAN, "Duration %d ms, bitrate %d kbps, samplerate %d channels %d, %d tags\n", mfi->song_length, mfi->bitrate, mfi->samplerate, mfi->channels, mdcount);
+
+  if (mdcount == 0)
+    DPRINTF(E_WARN, L_SCAN, "Native reader could not extract any metadata\n");
+
+  if (mfi->title == NULL)
+    mfi->title = strdup(mfi->fname);
+
+  return 0;
+}
+
 /*
  * Fills metadata read with ffmpeg/libav from the given path into the given mfi
  *
@@ -435,7 +682,9 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
   enum AVSampleFormat sample_fmt;
   AVStream *video_stream;
   AVStream *audio_stream;
-  char *path;
+  const char *path;
+  const char *ext;
+  char *http_path;
   int mdcount;
   int sample_rate;
   int channels;
@@ -444,7 +693,8 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
 
   ctx = NULL;
   options = NULL;
-  path = strdup(file);
+  path = file;
+  http_path = NULL;
 
   if (mfi->data_kind == DATA_KIND_HTTP)
     {
@@ -454,19 +704,26 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
       ctx->probesize = 64000;
 #endif
 
-      free(path);
-      ret = http_stream_setup(&path, file);
+      ret = http_stream_setup(&http_path, file);
       if (ret < 0)
 	return -1;
 
+      path = http_path;
+
       av_dict_set(&options, "icy", "1", 0);
     }
   else if (mfi->data_kind == DATA_KIND_FILE && mfi->file_size == 0)
     {
       // a 0-byte mp3 will make ffmpeg die with arithmetic exception (with 3.2.15-0+deb9u4)
-      free(path);
       return -1;
     }
+  else if (mfi->data_kind == DATA_KIND_FILE && (ext = strrchr(file, '.')) && strcasecmp(ext, ".flac") == 0)
+    {
+      // Only reads the file headers, so much faster than probing with ffmpeg
+      ret = scan_metadata_flac(mfi, file);
+      if (ret == 0)
+	return 0;
+    }
 
   ret = avformat_open_input(&ctx, path, NULL, &options);
 
@@ -477,7 +734,7 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
     {
       DPRINTF(E_WARN, L_SCAN, "Cannot open media file '%s': %s\n", path, err2str(ret));
 
-      free(path);
+      free(http_path);
       return -1;
     }
 
@@ -487,11 +744,11 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
       DPRINTF(E_WARN, L_SCAN, "Cannot get stream info of '%s': %s\n", path, err2str(ret));
 
       avformat_close_input(&ctx);
-      free(path);
+      free(http_path);
       return -1;
     }
 
-  free(path);
+  free(http_path);
 
 #if 0
   /* Dump input format as determined by ffmpeg */
@@ -919,6 +1176,389 @@ file_copy_to_tmp(char *dst, size_t dst_size, const char *src)
   return -1;
 }
 
+/* In-place rating updates
+ *
+ * Rewriting the whole file through ffmpeg (see file_write_rating) means that
+ * rating a large file copies all of it, twice. Usually the tag block has room
+ * to spare, so instead we replace only the block, with the same size, keeping
+ * the tag ffmpeg reads as "rating": the Vorbis comment in FLAC, and the TXXX
+ * frame in ID3v2. If it doesn't fit, the file is rewritten as before.
+ */
+#define FLAC_BLOCK_PADDING 1
+#define FLAC_BLOCK_VORBIS_COMMENT 4
+#define FLAC_BLOCK_HEADER_LEN 4
+#define ID3V2_HEADER_LEN 10
+#define ID3V2_FRAME_HEADER_LEN 10
+
+static uint32_t
+be24_get(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint32_t
+be32_get(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t
+le32_get(const uint8_t *p)
+{
+  return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t
+syncsafe_get(const uint8_t *p)
+{
+  return ((uint32_t)(p[0] & 0x7f) << 21) | ((uint32_t)(p[1] & 0x7f) << 14) | ((uint32_t)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+static void
+be24_put(uint8_t *p, uint32_t val)
+{
+  p[0] = (val >> 16) & 0xff;
+  p[1] = (val >> 8) & 0xff;
+  p[2] = val & 0xff;
+}
+
+static void
+be32_put(uint8_t *p, uint32_t val)
+{
+  p[0] = (val >> 24) & 0xff;
+  be24_put(p + 1, val);
+}
+
+static void
+le32_put(uint8_t *p, uint32_t val)
+{
+  p[0] = val & 0xff;
+  p[1] = (val >> 8) & 0xff;
+  p[2] = (val >> 16) & 0xff;
+  p[3] = (val >> 24) & 0xff;
+}
+
+static void
+syncsafe_put(uint8_t *p, uint32_t val)
+{
+  p[0] = (val >> 21) & 0x7f;
+  p[1] = (val >> 14) & 0x7f;
+  p[2] = (val >> 7) & 0x7f;
+  p[3] = val & 0x7f;
+}
+
+static int
+block_write(int fd, const uint8_t *buf, size_t len, off_t offset, const char *path)
+{
+  ssize_t bytes;
+
+  bytes = pwrite(fd, buf, len, offset);
+  if (bytes < 0 || (size_t)bytes != len)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error writing rating metadata to '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+// Builds a Vorbis comment like the one in src, but with the rating replaced.
+// Returns the length of the new comment, or 0 if src is invalid.
+static uint32_t
+vorbis_comment_rating_set(uint8_t *dst, const uint8_t *src, uint32_t len, const char *rating)
+{
+  uint32_t vendor_len;
+  uint32_t count;
+  uint32_t count_new = 0;
+  uint32_t entry_len;
+  uint32_t pos;
+  uint32_t dpos;
+  uint32_t i;
+
+  if (len < 8)
+    return 0;
+
+  vendor_len = le32_get(src);
+  if (vendor_len > len - 8)
+    return 0;
+
+  memcpy(dst, src, 4 + vendor_len);
+  pos = 4 + vendor_len;
+  count = le32_get(src + pos);
+  pos += 4;
+  dpos = pos;
+
+  for (i = 0; i < count; i++)
+    {
+      if (len - pos < 4)
+	return 0;
+
+      entry_len = le32_get(src + pos);
+      if (entry_len > len - pos - 4)
+	return 0;
+
+      if (!(entry_len >= strlen("rating=") && strncasecmp((const char *)src + pos + 4, "rating=", strlen("rating=")) == 0))
+	{
+	  memcpy(dst + dpos, src + pos, 4 + entry_len);
+	  dpos += 4 + entry_len;
+	  count_new++;
+	}
+
+      pos += 4 + entry_len;
+    }
+
+  entry_len = strlen("rating=") + strlen(rating);
+  le32_put(dst + dpos, entry_len);
+  memcpy(dst + dpos + 4, "rating=", strlen("rating="));
+  memcpy(dst + dpos + 4 + strlen("rating="), rating, strlen(rating));
+  dpos += 4 + entry_len;
+
+  le32_put(dst + 4 + vendor_len, count_new + 1);
+
+  return dpos;
+}
+
+// Replaces the Vorbis comment block and a padding block right after it, if
+// any, with a new comment and what is left of the padding
+static int
+flac_rating_write(int fd, const char *path, const char *rating)
+{
+  uint8_t hdr[FLAC_BLOCK_HEADER_LEN];
+  uint8_t *comment = NULL;
+  uint8_t *region = NULL;
+  off_t offset;
+  off_t comment_offset = -1;
+  uint32_t comment_len = 0;
+  uint32_t region_len = 0;
+  uint32_t new_len;
+  uint32_t len;
+  bool region_last = false;
+  bool last;
+  int type;
+  int ret = 1;
+
+  if (pread(fd, hdr, 4, 0) != 4 || memcmp(hdr, "fLaC", 4) != 0)
+    return 1;
+
+  for (offset = 4, last = false; !last; offset += FLAC_BLOCK_HEADER_LEN + len)
+    {
+      if (pread(fd, hdr, sizeof(hdr), offset) != sizeof(hdr))
+	return 1;
+
+      last = hdr[0] & 0x80;
+      type = hdr[0] & 0x7f;
+      len = be24_get(hdr + 1);
+
+      if (type == FLAC_BLOCK_VORBIS_COMMENT && comment_offset < 0)
+	{
+	  comment_offset = offset;
+	  comment_len = len;
+	  region_len = FLAC_BLOCK_HEADER_LEN + len;
+	  region_last = last;
+	}
+      else if (type == FLAC_BLOCK_PADDING && comment_offset >= 0 && offset == comment_offset + region_len)
+	{
+	  region_len += FLAC_BLOCK_HEADER_LEN + len;
+	  region_last = last;
+	}
+    }
+
+  if (comment_offset < 0)
+    return 1;
+
+  CHECK_NULL(L_SCAN, comment = malloc(comment_len));
+  CHECK_NULL(L_SCAN, region = calloc(1, region_len + strlen("rating=") + strlen(rating) + 4));
+
+  if (pread(fd, comment, comment_len, comment_offset + FLAC_BLOCK_HEADER_LEN) != comment_len)
+    goto out;
+
+  new_len = vorbis_comment_rating_set(region + FLAC_BLOCK_HEADER_LEN, comment, comment_len, rating);
+  if (new_len == 0)
+    goto out;
+
+  // The new comment either fills the region exactly, or is followed by a
+  // padding block with the rest
+  if (FLAC_BLOCK_HEADER_LEN + new_len == region_len)
+    {
+      region[0] = FLAC_BLOCK_VORBIS_COMMENT | (region_last ? 0x80 : 0);
+      be24_put(region + 1, new_len);
+    }
+  else if (2 * FLAC_BLOCK_HEADER_LEN + new_len <= region_len)
+    {
+      region[0] = FLAC_BLOCK_VORBIS_COMMENT;
+      be24_put(region + 1, new_len);
+
+      len = region_len - 2 * FLAC_BLOCK_HEADER_LEN - new_len;
+      region[FLAC_BLOCK_HEADER_LEN + new_len] = FLAC_BLOCK_PADDING | (region_last ? 0x80 : 0);
+      be24_put(region + FLAC_BLOCK_HEADER_LEN + new_len + 1, len);
+      memset(region + 2 * FLAC_BLOCK_HEADER_LEN + new_len, 0, len);
+    }
+  else
+    goto out;
+
+  ret = block_write(fd, region, region_len, comment_offset, path);
+
+ out:
+  free(comment);
+  free(region);
+  return ret;
+}
+
+// Checks if the data of a TXXX frame has the description ffmpeg uses as key
+// for the "rating" tag
+static bool
+id3v2_txxx_is_rating(const uint8_t *data, uint32_t len)
+{
+  const char *key = "rating";
+  unsigned int c;
+  uint32_t pos;
+  int width;
+  bool le = false;
+  int i;
+
+  if (len < 1)
+    return false;
+
+  switch (data[0])
+    {
+      case 0: // ISO-8859-1
+      case 3: // UTF-8
+	width = 1;
+	pos = 1;
+	break;
+      case 1: // UTF-16 with BOM
+	if (len < 3)
+	  return false;
+	width = 2;
+	le = (data[1] == 0xff && data[2] == 0xfe);
+	pos = 3;
+	break;
+      case 2: // UTF-16BE
+	width = 2;
+	pos = 1;
+	break;
+      default:
+	return false;
+    }
+
+  for (i = 0; ; i++, pos += width)
+    {
+      if (pos + width > len)
+	return false;
+
+      if (width == 1)
+	c = data[pos];
+      else
+	c = le ? (data[pos] | (data[pos + 1] << 8)) : ((data[pos] << 8) | data[pos + 1]);
+
+      if (key[i] == '\0')
+	return (c == 0);
+      if (c > 127 || tolower(c) != key[i])
+	return false;
+    }
+}
+
+// Rebuilds the frames of the tag without the old rating and with a new one,
+// which works if the padding has room for it
+static int
+id3v2_rating_write(int fd, const char *path, const char *rating)
+{
+  uint8_t hdr[ID3V2_HEADER_LEN];
+  uint8_t *tag = NULL;
+  uint8_t *frames = NULL;
+  uint32_t tag_len;
+  uint32_t frame_len;
+  uint32_t pos;
+  uint32_t dpos;
+  int version;
+  int ret = 1;
+
+  if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, "ID3", 3) != 0)
+    return 1;
+
+  // Only v2.3 and v2.4, and not with unsynchronisation, an extended header or
+  // a footer, since then we would have to deal with them
+  version = hdr[3];
+  if ((version != 3 && version != 4) || (hdr[5] & 0xd0))
+    return 1;
+
+  tag_len = syncsafe_get(hdr + 6);
+  if (tag_len == 0)
+    return 1;
+
+  CHECK_NULL(L_SCAN, tag = malloc(tag_len));
+  CHECK_NULL(L_SCAN, frames = calloc(1, tag_len));
+
+  if (pread(fd, tag, tag_len, ID3V2_HEADER_LEN) != tag_len)
+    goto out;
+
+  // Frames end at the padding (zero bytes) or the end of the tag
+  for (pos = 0, dpos = 0; pos + ID3V2_FRAME_HEADER_LEN <= tag_len && tag[pos] != 0; pos += ID3V2_FRAME_HEADER_LEN + frame_len)
+    {
+      frame_len = (version == 4) ? syncsafe_get(tag + pos + 4) : be32_get(tag + pos + 4);
+      if (frame_len > tag_len - pos - ID3V2_FRAME_HEADER_LEN)
+	goto out;
+
+      if (memcmp(tag + pos, "TXXX", 4) == 0 && id3v2_txxx_is_rating(tag + pos + ID3V2_FRAME_HEADER_LEN, frame_len))
+	continue;
+
+      memcpy(frames + dpos, tag + pos, ID3V2_FRAME_HEADER_LEN + frame_len);
+      dpos += ID3V2_FRAME_HEADER_LEN + frame_len;
+    }
+
+  // TXXX frame with ISO-8859-1 encoding, "rating" + 0 + value
+  frame_len = 1 + strlen("rating") + 1 + strlen(rating);
+  if (dpos + ID3V2_FRAME_HEADER_LEN + frame_len > tag_len)
+    goto out;
+
+  memcpy(frames + dpos, "TXXX", 4);
+  if (version == 4)
+    syncsafe_put(frames + dpos + 4, frame_len);
+  else
+    be32_put(frames + dpos + 4, frame_len);
+  frames[dpos + 8] = 0;
+  frames[dpos + 9] = 0;
+  dpos += ID3V2_FRAME_HEADER_LEN;
+
+  frames[dpos] = 0;
+  memcpy(frames + dpos + 1, "rating", strlen("rating") + 1);
+  memcpy(frames + dpos + 1 + strlen("rating") + 1, rating, strlen(rating));
+
+  // The rest is already zero, i.e. padding
+  ret = block_write(fd, frames, tag_len, ID3V2_HEADER_LEN, path);
+
+ out:
+  free(tag);
+  free(frames);
+  return ret;
+}
+
+// Returns 0 if written, 1 if there is no room (or the format isn't supported)
+// and -1 if writing failed
+static int
+file_write_rating_inplace(const char *path, const char *format, const char *rating)
+{
+  int fd;
+  int ret;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error opening '%s' for metadata update: %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  if (strcmp(format, "flac") == 0)
+    ret = flac_rating_write(fd, path, rating);
+  else if (strcmp(format, "mp3") == 0)
+    ret = id3v2_rating_write(fd, path, rating);
+  else
+    ret = 1;
+
+  close(fd);
+  return ret;
+}
+
 // based on FFmpeg's doc/examples and in particular mux.c
 static int
 file_write_rating(const char *dst, const char *src, const char *rating)
@@ -1141,6 +1781,15 @@ write_metadata_ffmpeg(struct media_file_info *mfi)
   if (file_rating_matches(mfi->path, rating_str))
     return 0;
 
+  ret = file_write_rating_inplace(mfi->path, mfi->type, rating_str);
+  if (ret < 0)
+    return -1;
+  else if (ret == 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Wrote rating metadata in place to '%s'\n", mfi->path);
+      return 0;
+    }
+
   ret = file_copy_to_tmp(tmpfile, sizeof(tmpfile), mfi->path);
   if (ret < 0)
     return -1;
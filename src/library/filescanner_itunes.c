@@ -27,16 +27,14 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
 
-#include <sys/mman.h>
-
 #include <stdint.h>
 #include <inttypes.h>
 
 #include <plist/plist.h>
+#include <libxml/xmlreader.h>
 
 #include <event2/http.h>
 
@@ -48,14 +46,20 @@
 #include "misc.h"
 
 
-/* Mapping between iTunes library IDs and our DB IDs using a "hash" table of
- * size ID_MAP_SIZE
+/* Mapping between iTunes library IDs and our DB IDs. This is an open addressing
+ * hash table with linear probing, starting at ID_MAP_SIZE entries and doubled
+ * when it gets half full. Entries with db_id 0 are empty.
  */
 #define ID_MAP_SIZE 16384
 struct itml_to_db_map {
   uint64_t itml_id;
   uint32_t db_id;
-  struct itml_to_db_map *next;
+};
+
+struct id_map {
+  struct itml_to_db_map *entries;
+  uint32_t size;
+  uint32_t count;
 };
 
 /* Mapping between iTunes library metadata keys and the offset
@@ -133,64 +137,91 @@ static struct metadata_map md_map[] =
     { NULL,           0, 0 }
   };
 
-static void
-id_map_free(struct itml_to_db_map **id_map)
+static struct id_map *
+id_map_new(void)
 {
-  struct itml_to_db_map *map;
-  int i;
+  struct id_map *id_map;
 
+  CHECK_NULL(L_SCAN, id_map = calloc(1, sizeof(struct id_map)));
+  CHECK_NULL(L_SCAN, id_map->entries = calloc(ID_MAP_SIZE, sizeof(struct itml_to_db_map)));
+  id_map->size = ID_MAP_SIZE;
+
+  return id_map;
+}
+
+static void
+id_map_free(struct id_map *id_map)
+{
   if (!id_map)
     return;
 
-  for (i = 0; i < ID_MAP_SIZE; i++)
-    {
-      if (!id_map[i])
-	continue;
+  free(id_map->entries);
+  free(id_map);
+}
 
-      for (map = id_map[i]; id_map[i]; map = id_map[i])
-	{
-	  id_map[i] = map->next;
-	  free(map);
-	}
-    }
+static inline uint32_t
+id_map_slot(uint32_t size, uint64_t itml_id)
+{
+  // Fibonacci hashing, size is a power of two
+  return (uint32_t)((itml_id * UINT64_C(11400714819323198485)) >> 32) & (size - 1);
+}
 
-  free(id_map);
+// Returns 1 if the entry is new, 0 if an existing entry was updated
+static int
+id_map_insert(struct itml_to_db_map *entries, uint32_t size, uint64_t itml_id, uint32_t db_id)
+{
+  uint32_t i;
+  int is_new;
+
+  for (i = id_map_slot(size, itml_id); entries[i].db_id && entries[i].itml_id != itml_id; i = (i + 1) & (size - 1))
+    ;
+
+  is_new = (entries[i].db_id == 0);
+  entries[i].itml_id = itml_id;
+  entries[i].db_id = db_id;
+
+  return is_new;
 }
 
-/* Inserts a linked list item into "hash" position in the id_table */
 static int
-id_map_add(struct itml_to_db_map **id_map, uint64_t itml_id, uint32_t db_id)
+id_map_add(struct id_map *id_map, uint64_t itml_id, uint32_t db_id)
 {
-  struct itml_to_db_map *new_map;
-  struct itml_to_db_map *cur_map;
-  int i;
+  struct itml_to_db_map *entries;
+  uint32_t size;
+  uint32_t i;
 
-  new_map = malloc(sizeof(struct itml_to_db_map));
-  if (!new_map)
-    return -1;
+  if (2 * (id_map->count + 1) > id_map->size)
+    {
+      size = 2 * id_map->size;
+      entries = calloc(size, sizeof(struct itml_to_db_map));
+      if (!entries)
+	return -1;
 
-  new_map->itml_id = itml_id;
-  new_map->db_id = db_id;
+      for (i = 0; i < id_map->size; i++)
+	{
+	  if (id_map->entries[i].db_id)
+	    id_map_insert(entries, size, id_map->entries[i].itml_id, id_map->entries[i].db_id);
+	}
 
-  i = itml_id % ID_MAP_SIZE;
-  cur_map = id_map[i];
-  new_map->next = cur_map;
-  id_map[i] = new_map;
+      free(id_map->entries);
+      id_map->entries = entries;
+      id_map->size = size;
+    }
+
+  id_map->count += id_map_insert(id_map->entries, id_map->size, itml_id, db_id);
 
   return 0;
 }
 
 static uint32_t
-id_map_get(struct itml_to_db_map **id_map, uint64_t itml_id)
+id_map_get(struct id_map *id_map, uint64_t itml_id)
 {
-  struct itml_to_db_map *map;
-  int i;
+  uint32_t i;
 
-  i = itml_id % ID_MAP_SIZE;
-  for (map = id_map[i]; map; map = map->next)
+  for (i = id_map_slot(id_map->size, itml_id); id_map->entries[i].db_id; i = (i + 1) & (id_map->size - 1))
     {
-      if (itml_id == map->itml_id)
-	return map->db_id;
+      if (id_map->entries[i].itml_id == itml_id)
+	return id_map->entries[i].db_id;
     }
 
   return 0;
@@ -580,91 +611,206 @@ process_track_stream(plist_t trk)
   return ret;
 }
 
+/* ------------------------ Streaming iTunes XML reader ---------------------- */
+
+/* The iTunes XML can be hundreds of MB, so instead of loading it all with
+ * plist_from_xml() we walk it with a libxml2 text reader, and only convert a
+ * single track, playlist item etc. to a plist node at a time.
+ *
+ *   <plist version="1.0">                depth 0
+ *   <dict>                               depth 1
+ *     <key>Major Version</key>           depth 2
+ *     ...
+ *     <key>Tracks</key>
+ *     <dict>
+ *       <key>615</key>                   depth 3
+ *       <dict>...</dict>                 depth 3
+ *     </dict>
+ *     <key>Playlists</key>
+ *     <array>
+ *       <dict>...</dict>                 depth 3
+ *     </array>
+ *   </dict>
+ *   </plist>
+ */
+
+// Moves the reader forward to the next element at the given depth. Returns 1
+// if found, 0 if the parent element ended first, and -1 on error.
 static int
-process_tracks(struct itml_to_db_map **id_map, plist_t tracks)
+itml_element_find(xmlTextReaderPtr reader, int depth, int ret)
+{
+  while (ret == 1)
+    {
+      if (xmlTextReaderDepth(reader) < depth)
+	return 0;
+
+      if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT)
+	return 1;
+
+      ret = xmlTextReaderNext(reader);
+    }
+
+  return (ret < 0) ? -1 : 0;
+}
+
+// Reader must be at a dict or array element, moves to its first child element
+static int
+itml_child_first(xmlTextReaderPtr reader)
+{
+  int depth;
+
+  if (xmlTextReaderIsEmptyElement(reader))
+    return 0;
+
+  depth = xmlTextReaderDepth(reader) + 1;
+
+  return itml_element_find(reader, depth, xmlTextReaderRead(reader));
+}
+
+// Reader must be at a child element, moves to the next sibling element without
+// descending into the current one
+static int
+itml_child_next(xmlTextReaderPtr reader)
+{
+  int depth;
+
+  depth = xmlTextReaderDepth(reader);
+
+  return itml_element_find(reader, depth, xmlTextReaderNext(reader));
+}
+
+static bool
+itml_element_is(xmlTextReaderPtr reader, const char *name)
+{
+  return xmlStrEqual(xmlTextReaderConstName(reader), BAD_CAST name);
+}
+
+// Returns the content of the <key> element the reader is at, or NULL if the
+// reader is at some other element. Caller must free with xmlFree().
+static xmlChar *
+itml_key_get(xmlTextReaderPtr reader)
+{
+  if (!itml_element_is(reader, "key"))
+    return NULL;
+
+  return xmlTextReaderReadString(reader);
+}
+
+// Converts the element the reader is at, including its children, to a plist
+// node. Caller must free with plist_free().
+static plist_t
+itml_node_read(xmlTextReaderPtr reader)
+{
+  plist_t node = NULL;
+  xmlChar *xml;
+  char *doc;
+
+  xml = xmlTextReaderReadOuterXml(reader);
+  if (!xml)
+    return NULL;
+
+  doc = safe_asprintf("<plist version=\"1.0\">%s</plist>", (char *)xml);
+  plist_from_xml(doc, strlen(doc), &node);
+
+  free(doc);
+  xmlFree(xml);
+
+  return node;
+}
+
+// Returns -1 if the track was skipped, 0 if it was processed but not found in
+// our library, and 1 if it was added to the id map
+static int
+process_track(struct id_map *id_map, plist_t trk)
 {
-  plist_t trk;
-  plist_dict_iter iter;
   char *str;
   uint64_t trk_id;
   uint8_t disabled;
-  int ntracks;
-  int nloaded;
   int mfi_id;
   int ret;
 
-  if (plist_dict_get_size(tracks) == 0)
+  if (plist_get_node_type(trk) != PLIST_DICT)
+    return -1;
+
+  ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
+  if (ret < 0)
     {
-      DPRINTF(E_WARN, L_SCAN, "No tracks in iTunes library\n");
-      return 0;
+      DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
+      return -1;
     }
 
-  db_transaction_begin();
-
-  ntracks = 0;
-  nloaded = 0;
+  ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
+      return -1;
+    }
 
-  iter = NULL;
-  plist_dict_new_iter(tracks, &iter);
+  if (disabled)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
+      return -1;
+    }
 
-  plist_dict_next_item(tracks, iter, NULL, &trk);
-  while (trk)
+  ret = get_dictval_string_from_key(trk, "Track Type", &str);
+  if (ret < 0)
     {
-      if (plist_get_node_type(trk) != PLIST_DICT)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+      DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+      return -1;
+    }
 
-      ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
+  if (strcmp(str, "URL") == 0)
+    mfi_id = process_track_stream(trk);
+  else if (strcmp(str, "File") == 0)
+    mfi_id = process_track_file(trk);
+  else
+    {
+      DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
+      free(str);
+      return -1;
+    }
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  free(str);
 
-      ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
+  if (mfi_id <= 0)
+    return 0;
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  ret = id_map_add(id_map, trk_id, mfi_id);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
 
-      if (disabled)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
+  return 1;
+}
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+// Reader must be at the Tracks dict
+static int
+process_tracks(struct id_map *id_map, xmlTextReaderPtr reader)
+{
+  plist_t trk;
+  int ntracks;
+  int nloaded;
+  int found;
+  int ret;
 
-      ret = get_dictval_string_from_key(trk, "Track Type", &str);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+  db_transaction_begin();
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  ntracks = 0;
+  nloaded = 0;
 
-      if (strcmp(str, "URL") == 0)
-	mfi_id = process_track_stream(trk);
-      else if (strcmp(str, "File") == 0)
-	mfi_id = process_track_file(trk);
-      else
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
+  for (found = itml_child_first(reader); found == 1; found = itml_child_next(reader))
+    {
+      // Skip the <key> with the track id, the track dict also has it
+      if (!itml_element_is(reader, "dict"))
+	continue;
 
-	  free(str);
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+      trk = itml_node_read(reader);
+      if (!trk)
+	continue;
 
-      free(str);
+      ret = process_track(id_map, trk);
+      plist_free(trk);
+      if (ret < 0)
+	continue;
 
       ntracks++;
       if (ntracks % 200 == 0)
@@ -674,52 +820,54 @@ process_tracks(struct itml_to_db_map **id_map, plist_t tracks)
 	  db_transaction_begin();
 	}
 
-      if (mfi_id <= 0)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      ret = id_map_add(id_map, trk_id, mfi_id);
-      if (ret < 0)
-	DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
+      if (ret > 0)
+	nloaded++;
+    }
 
-      nloaded++;
+  db_transaction_end();
 
-      plist_dict_next_item(tracks, iter, NULL, &trk);
+  if (found < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error reading tracks from iTunes XML\n");
+      return -1;
     }
 
-  free(iter);
-
-  db_transaction_end();
+  if (ntracks == 0)
+    DPRINTF(E_WARN, L_SCAN, "No tracks in iTunes library\n");
 
   return nloaded;
 }
 
+// Reader must be at the Playlist Items array
 static void
-process_pl_items(plist_t items, int pl_id, const char *name, struct itml_to_db_map **id_map)
+process_pl_items(xmlTextReaderPtr reader, int pl_id, const char *name, struct id_map *id_map)
 {
   plist_t trk;
   uint64_t itml_id;
   uint32_t db_id;
-  uint32_t alen;
   uint32_t i;
   int ntracks;
+  int found;
   int ret;
 
   db_transaction_begin();
 
   ntracks = 0;
 
-  alen = plist_array_get_size(items);
-  for (i = 0; i < alen; i++)
+  for (found = itml_child_first(reader), i = 0; found == 1; found = itml_child_next(reader), i++)
     {
-      trk = plist_array_get_item(items, i);
+      trk = itml_node_read(reader);
+      if (!trk)
+	continue;
 
       if (plist_get_node_type(trk) != PLIST_DICT)
-	continue;
+	{
+	  plist_free(trk);
+	  continue;
+	}
 
       ret = get_dictval_int_from_key(trk, "Track ID", &itml_id);
+      plist_free(trk);
       if (ret < 0)
 	{
 	  DPRINTF(E_WARN, L_SCAN, "No Track ID found for playlist item %u in '%s'\n", i, name);
@@ -785,79 +933,116 @@ ignore_pl(plist_t pl, const char *name)
   return false;
 }
 
-static void
-process_pls(plist_t playlists, const char *file, struct itml_to_db_map **id_map)
+// Saves the playlist described by pl, returns the playlist id, 0 if the
+// playlist should be ignored, or -1 on error
+static int
+pl_save(plist_t pl, const char *file, const char *name)
 {
-  plist_t pl;
-  plist_t items;
   struct playlist_info pli;
-  char *name;
   uint64_t id;
-  uint32_t alen;
-  uint32_t i;
   int ret;
 
-  alen = plist_array_get_size(playlists);
-  for (i = 0; i < alen; i++)
+  ret = get_dictval_int_from_key(pl, "Playlist ID", &id);
+  if (ret < 0)
     {
-      pl = plist_array_get_item(playlists, i);
+      DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
+      return 0;
+    }
 
-      if (plist_get_node_type(pl) != PLIST_DICT)
-	continue;
+  if (ignore_pl(pl, name))
+    return 0;
 
-      ret = get_dictval_int_from_key(pl, "Playlist ID", &id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
-	  continue;
-	}
+  playlist_fill(&pli, file);
 
-      ret = get_dictval_string_from_key(pl, "Name", &name);
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
-	  continue;
-	}
+  free(pli.title);
+  pli.title = strdup(name);
+  free(pli.virtual_path);
+  pli.virtual_path = safe_asprintf("/file:%s/%s", file, name);
 
-      if (ignore_pl(pl, name))
-	{
-	  free(name);
-	  continue;
-	}
+  ret = library_playlist_save(&pli);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, file);
 
-      ret = get_dictval_array_from_key(pl, "Playlist Items", &items);
-      if (ret < 0)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
+      free_pli(&pli, 1);
+      return -1;
+    }
 
-	  free(name);
-	  continue;
-	}
+  DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", ret);
 
-      playlist_fill(&pli, file);
+  free_pli(&pli, 1);
 
-      free(pli.title);
-      pli.title = strdup(name);
-      free(pli.virtual_path);
-      pli.virtual_path = safe_asprintf("/file:%s/%s", file, name);
+  return ret;
+}
 
-      ret = library_playlist_save(&pli);
-      if (ret < 0)
+// Reader must be at a playlist dict. The playlist's properties are collected
+// until we get to the Playlist Items, which iTunes puts last, so that the items
+// can be streamed into the playlist.
+static void
+process_pl(xmlTextReaderPtr reader, const char *file, struct id_map *id_map)
+{
+  plist_t pl;
+  plist_t node;
+  xmlChar *key;
+  char *name;
+  bool has_items;
+  int pl_id;
+  int found;
+
+  pl = plist_new_dict();
+  name = NULL;
+  has_items = false;
+
+  found = itml_child_first(reader);
+  while (found == 1)
+    {
+      key = itml_key_get(reader);
+      found = itml_child_next(reader);
+      if (!key)
+	continue;
+      if (found != 1)
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, file);
+	  xmlFree(key);
+	  break;
+	}
 
-	  free_pli(&pli, 1);
-	  free(name);
-	  continue;
+      if (strcmp((char *)key, "Playlist Items") == 0 && itml_element_is(reader, "array"))
+	{
+	  has_items = true;
+
+	  if (!name && get_dictval_string_from_key(pl, "Name", &name) < 0)
+	    DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
+	  else if ((pl_id = pl_save(pl, file, name)) > 0)
+	    process_pl_items(reader, pl_id, name, id_map);
 	}
+      else if ((node = itml_node_read(reader)))
+	plist_dict_set_item(pl, (char *)key, node);
 
-      DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", ret);
+      xmlFree(key);
+      found = itml_child_next(reader);
+    }
 
-      process_pl_items(items, ret, name, id_map);
+  if (!has_items && get_dictval_string_from_key(pl, "Name", &name) == 0)
+    DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
 
-      free_pli(&pli, 1);
-      free(name);
+  free(name);
+  plist_free(pl);
+}
+
+// Reader must be at the Playlists array
+static void
+process_pls(xmlTextReaderPtr reader, const char *file, struct id_map *id_map)
+{
+  int found;
+
+  for (found = itml_child_first(reader); found == 1; found = itml_child_next(reader))
+    {
+      if (itml_element_is(reader, "dict"))
+	process_pl(reader, file, id_map);
     }
+
+  if (found < 0)
+    DPRINTF(E_LOG, L_SCAN, "Error reading playlists from iTunes XML '%s'\n", file);
 }
 
 static bool
@@ -920,12 +1105,14 @@ itml_is_modified(const char *path, time_t mtime)
 void
 scan_itunes_itml(const char *path, time_t mtime, int dir_id)
 {
-  struct stat sb;
-  struct itml_to_db_map **id_map = NULL;
-  char *itml_xml;
-  plist_t itml = NULL;
+  xmlTextReaderPtr reader = NULL;
+  struct id_map *id_map = NULL;
+  plist_t meta = NULL;
   plist_t node;
-  int fd = -1;
+  xmlChar *key;
+  bool has_pls;
+  int ntracks;
+  int found;
   int ret;
 
   if (!itml_is_modified(path, mtime))
@@ -933,100 +1120,115 @@ scan_itunes_itml(const char *path, time_t mtime, int dir_id)
       return;
     }
 
-  fd = open(path, O_RDONLY);
-  if (fd < 0)
+  reader = xmlReaderForFile(path, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS | XML_PARSE_HUGE);
+  if (!reader)
     {
-      DPRINTF(E_LOG, L_SCAN, "Could not open iTunes library '%s': %s\n", path, strerror(errno));
+      DPRINTF(E_LOG, L_SCAN, "Could not open iTunes library '%s'\n", path);
       goto error;
     }
 
-  ret = fstat(fd, &sb);
-  if (ret < 0)
+  // Position the reader at the top <dict> in <plist>
+  found = itml_element_find(reader, 0, xmlTextReaderRead(reader));
+  if (found == 1 && itml_element_is(reader, "plist"))
+    found = itml_child_first(reader);
+  if (found != 1 || !itml_element_is(reader, "dict"))
     {
-      DPRINTF(E_LOG, L_SCAN, "Could not stat iTunes library '%s': %s\n", path, strerror(errno));
+      DPRINTF(E_LOG, L_SCAN, "Malformed iTunes XML playlist '%s'\n", path);
       goto error;
     }
 
-  itml_xml = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (itml_xml == MAP_FAILED)
+  meta = plist_new_dict();
+  id_map = id_map_new();
+  ntracks = 0;
+  has_pls = false;
+
+  found = itml_child_first(reader);
+  while (found == 1)
     {
-      DPRINTF(E_LOG, L_SCAN, "Could not map iTunes library '%s': %s\n", path, strerror(errno));
-      goto error;
-    }
+      key = itml_key_get(reader);
+      found = itml_child_next(reader);
+      if (!key)
+	continue;
+      if (found != 1)
+	{
+	  xmlFree(key);
+	  break;
+	}
 
-  plist_from_xml(itml_xml, sb.st_size, &itml);
+      if (strcmp((char *)key, "Tracks") == 0 && itml_element_is(reader, "dict"))
+	{
+	  xmlFree(key);
+
+	  /* Meta data, which comes before the tracks */
+	  ret = check_meta(meta);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Missing meta elements in iTunes XML playlist '%s'\n", path);
+	      goto error;
+	    }
+
+	  ntracks = process_tracks(id_map, reader);
+	  if (ntracks <= 0)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", path);
+	      goto error;
+	    }
+
+	  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", ntracks, path);
+	}
+      else if (strcmp((char *)key, "Playlists") == 0 && itml_element_is(reader, "array"))
+	{
+	  xmlFree(key);
 
-  ret = munmap(itml_xml, sb.st_size);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_SCAN, "Could not unmap iTunes library '%s': %s\n", path, strerror(errno));
+	  if (ntracks == 0)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Could not find Tracks dict in '%s'\n", path);
+	      goto error;
+	    }
 
-  close(fd);
-  fd = -1;
+	  process_pls(reader, path, id_map);
+	  has_pls = true;
+	}
+      else
+	{
+	  if (ntracks == 0 && (node = itml_node_read(reader)))
+	    plist_dict_set_item(meta, (char *)key, node);
 
-  if (!itml)
-    {
-      DPRINTF(E_LOG, L_SCAN, "iTunes XML playlist '%s' failed to parse\n", path);
-      goto error;
-    }
+	  xmlFree(key);
+	}
 
-  if (plist_get_node_type(itml) != PLIST_DICT)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Malformed iTunes XML playlist '%s'\n", path);
-      goto error;
+      found = itml_child_next(reader);
     }
 
-  /* Meta data */
-  ret = check_meta(itml);
-  if (ret < 0)
+  if (found < 0)
     {
-      DPRINTF(E_LOG, L_SCAN, "Missing meta elements in iTunes XML playlist '%s'\n", path);
+      DPRINTF(E_LOG, L_SCAN, "iTunes XML playlist '%s' failed to parse\n", path);
       goto error;
     }
 
-  /* Tracks */
-  ret = get_dictval_dict_from_key(itml, "Tracks", &node);
-  if (ret < 0)
+  if (ntracks == 0)
     {
       DPRINTF(E_LOG, L_SCAN, "Could not find Tracks dict in '%s'\n", path);
       goto error;
     }
 
-  id_map = calloc(ID_MAP_SIZE, sizeof(struct itml_to_db_map *));
-  if (!id_map)
-    {
-      DPRINTF(E_LOG, L_SCAN, "iTunes library parser could not allocate ID map\n");
-      goto error;
-    }
-
-  ret = process_tracks(id_map, node);
-  if (ret <= 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", path);
-      goto error;
-    }
-
-  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", ret, path);
-
-  /* Playlists */
-  ret = get_dictval_array_from_key(itml, "Playlists", &node);
-  if (ret < 0)
+  if (!has_pls)
     {
       DPRINTF(E_LOG, L_SCAN, "Could not find Playlists dict in '%s'\n", path);
       goto error;
     }
 
-  process_pls(node, path, id_map);
-
   id_map_free(id_map);
-  plist_free(itml);
+  plist_free(meta);
+  xmlFreeTextReader(reader);
 
   return;
 
  error:
-  if (fd >= 0)
-    close(fd);
-  if (itml)
-    plist_free(itml);
+  if (reader)
+    xmlFreeTextReader(reader);
+  if (meta)
+    plist_free(meta);
 
   id_map_free(id_map);
 
@@ -47,6 +47,34 @@ enum playlist_type
   PLAYLIST_SMART,
 };
 
+// During a batch of playlist scans (see scan_playlist_batch_begin) all library
+// files are held in a map keyed by the case folded filename, so that resolving
+// a playlist entry doesn't require a query per entry
+#define PL_FILEMAP_SIZE 16384
+
+// Max number of items inserted by a single db_pl_add_items_bypath()
+#define PL_ITEMS_BATCH 200
+
+struct pl_file
+{
+  char *fname;
+  char *path;
+  struct pl_file *next;
+};
+
+struct pl_filemap
+{
+  struct pl_file *buckets[PL_FILEMAP_SIZE];
+  int count;
+};
+
+static struct pl_filemap *pl_filemap;
+
+// Items of the playlist being scanned that are waiting to be inserted
+static int pl_items_plid;
+static char *pl_items[PL_ITEMS_BATCH];
+static int pl_items_count;
+
 static enum playlist_type
 playlist_type(const char *path)
 {
@@ -176,6 +204,69 @@ scan_metadata_stream(struct media_file_info *mfi, const char *path)
     mfi->title = strdup(mfi->fname);
 }
 
+// djb hash of the filename, case folded like COLLATE NOCASE
+static unsigned int
+pl_filemap_hash(const char *fname)
+{
+  unsigned int hash = 5381;
+
+  for (; *fname; fname++)
+    hash = ((hash << 5) + hash) + tolower((unsigned char)*fname);
+
+  return hash % PL_FILEMAP_SIZE;
+}
+
+static void
+pl_filemap_free(struct pl_filemap *map)
+{
+  struct pl_file *plf;
+  int i;
+
+  for (i = 0; i < PL_FILEMAP_SIZE; i++)
+    {
+      while ((plf = map->buckets[i]))
+	{
+	  map->buckets[i] = plf->next;
+	  free(plf->fname);
+	  free(plf->path);
+	  free(plf);
+	}
+    }
+
+  free(map);
+}
+
+static void
+pl_items_flush(void)
+{
+  int i;
+
+  if (pl_items_count == 0)
+    return;
+
+  db_pl_add_items_bypath(pl_items_plid, (const char **)pl_items, pl_items_count);
+
+  for (i = 0; i < pl_items_count; i++)
+    free(pl_items[i]);
+
+  pl_items_count = 0;
+}
+
+// Queues the item for insertion, flush with pl_items_flush() when the playlist
+// is done. Items are queued in playlist order, also urls, so order is kept.
+static void
+pl_item_add(int pl_id, const char *path)
+{
+  if (pl_items_count > 0 && pl_items_plid != pl_id)
+    pl_items_flush();
+
+  pl_items_plid = pl_id;
+  pl_items[pl_items_count++] = strdup(path);
+
+  if (pl_items_count == PL_ITEMS_BATCH)
+    pl_items_flush();
+}
+
 static int
 process_nested_playlist(int parent_id, const char *path)
 {
@@ -279,34 +370,86 @@ process_url(int pl_id, const char *path, struct media_file_info *mfi)
   if (ret < 0)
     return -1;
 
-  return db_pl_add_item_bypath(pl_id, path);
+  pl_item_add(pl_id, path);
+
+  return 0;
 }
 
-static int
-process_regular_file(int pl_id, char *path)
+// The library file with the most parent dirs in common with the playlist entry
+// wins, a tie gives no winner
+static void
+winner_update(char **winner, int *score, const char *path, const char *dbpath)
 {
-  struct query_params qp;
-  char filter[PATH_MAX];
   const char *a;
   const char *b;
-  char *dbpath;
+  int i;
+
+  for (i = 0, a = NULL, b = NULL; (parent_dir(&a, path) == 0) && (parent_dir(&b, dbpath) == 0) && (strcasecmp(a, b) == 0); i++)
+    ;
+
+  DPRINTF(E_SPAM, L_SCAN, "Comparison of '%s' and '%s' gave score %d\n", dbpath, path, i);
+
+  if (i > *score)
+    {
+      free(*winner);
+      *winner = strdup(dbpath);
+      *score = i;
+    }
+  else if (i == *score)
+    {
+      free(*winner);
+      *winner = NULL;
+    }
+}
+
+static char *
+winner_from_filemap(int *results, const char *path)
+{
+  struct pl_file *plf;
+  const char *fname;
   char *winner;
   int score;
-  int i;
-  int ret;
 
-  // Playlist might be from Windows so we change backslash to forward slash
-  for (i = 0; i < strlen(path); i++)
+  fname = filename_from_path(path);
+
+  *results = 0;
+  for (plf = pl_filemap->buckets[pl_filemap_hash(fname)]; plf; plf = plf->next)
     {
-      if (path[i] == '\\')
-	path[i] = '/';
+      if (strcasecmp(plf->fname, fname) == 0)
+	(*results)++;
     }
 
+  winner = NULL;
+  score = 0;
+  for (plf = pl_filemap->buckets[pl_filemap_hash(fname)]; plf; plf = plf->next)
+    {
+      if (strcasecmp(plf->fname, fname) != 0)
+	continue;
+
+      if (*results == 1)
+	return strdup(plf->path);
+
+      winner_update(&winner, &score, path, plf->path);
+    }
+
+  return winner;
+}
+
+static char *
+winner_from_db(int *results, const char *path)
+{
+  struct query_params qp;
+  char filter[PATH_MAX];
+  char *dbpath;
+  char *winner;
+  int score;
+  int ret;
+
   ret = db_snprintf(filter, sizeof(filter), "f.fname = '%q' COLLATE NOCASE", filename_from_path(path));
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_SCAN, "Path in playlist is too long: '%s'\n", path);
-      return -1;
+      return NULL;
     }
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -319,7 +462,7 @@ process_regular_file(int pl_id, char *path)
   if (ret < 0)
     {
       db_query_end(&qp);
-      return -1;
+      return NULL;
     }
 
   winner = NULL;
@@ -333,25 +476,35 @@ process_regular_file(int pl_id, char *path)
 	  break;
 	}
 
-      for (i = 0, a = NULL, b = NULL; (parent_dir(&a, path) == 0) && (parent_dir(&b, dbpath) == 0) && (strcasecmp(a, b) == 0); i++)
-	;
+      winner_update(&winner, &score, path, dbpath);
+    }
 
-      DPRINTF(E_SPAM, L_SCAN, "Comparison of '%s' and '%s' gave score %d\n", dbpath, path, i);
+  *results = qp.results;
 
-      if (i > score)
-	{
-	  free(winner);
-	  winner = strdup(dbpath);
-	  score = i;
-	}
-      else if (i == score)
-	{
-	  free(winner);
-	  winner = NULL;
-	}
+  db_query_end(&qp);
+
+  return winner;
+}
+
+static int
+process_regular_file(int pl_id, char *path)
+{
+  char *winner;
+  int results;
+  int i;
+
+  // Playlist might be from Windows so we change backslash to forward slash
+  for (i = 0; i < strlen(path); i++)
+    {
+      if (path[i] == '\\')
+	path[i] = '/';
     }
 
-  db_query_end(&qp);
+  results = 0;
+  if (pl_filemap)
+    winner = winner_from_filemap(&results, path);
+  else
+    winner = winner_from_db(&results, path);
 
   if (!winner)
     {
@@ -359,9 +512,9 @@ process_regular_file(int pl_id, char *path)
       return -1;
     }
 
-  DPRINTF(E_DBG, L_SCAN, "Adding '%s' to playlist %d (results %d)\n", winner, pl_id, qp.results);
+  DPRINTF(E_DBG, L_SCAN, "Adding '%s' to playlist %d (results %d)\n", winner, pl_id, results);
 
-  db_pl_add_item_bypath(pl_id, winner);
+  pl_item_add(pl_id, winner);
   free(winner);
 
   return 0;
@@ -505,6 +658,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       if (ntracks % 200 == 0)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Processed %d items...\n", ntracks);
+	  pl_items_flush();
 	  db_transaction_end();
 	  db_transaction_begin();
 	}
@@ -516,6 +670,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       free_mfi(&mfi, 1);
     }
 
+  pl_items_flush();
   db_transaction_end();
 
   // In case we had some m3u ext metadata that we never got to use, free it now
@@ -529,3 +684,69 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
 
   fclose(fp);
 }
+
+void
+scan_playlist_batch_begin(void)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  struct pl_file *plf;
+  unsigned int hash;
+  int ret;
+
+  if (pl_filemap)
+    return;
+
+  memset(&qp, 0, sizeof(struct query_params));
+
+  qp.type = Q_ITEMS;
+  qp.sort = S_NONE;
+  db_query_cols_add(&qp, dbmfi_offsetof(fname));
+  db_query_cols_add(&qp, dbmfi_offsetof(path));
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      db_query_end(&qp);
+      return; // Playlist entries will be resolved with a query each
+    }
+
+  CHECK_NULL(L_SCAN, pl_filemap = calloc(1, sizeof(struct pl_filemap)));
+
+  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+    {
+      if (!dbmfi.fname || !dbmfi.path)
+	continue;
+
+      CHECK_NULL(L_SCAN, plf = malloc(sizeof(struct pl_file)));
+      plf->fname = strdup(dbmfi.fname);
+      plf->path = strdup(dbmfi.path);
+
+      hash = pl_filemap_hash(plf->fname);
+      plf->next = pl_filemap->buckets[hash];
+      pl_filemap->buckets[hash] = plf;
+      pl_filemap->count++;
+    }
+
+  db_query_end(&qp);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error building file map for playlist scan, falling back to queries\n");
+      pl_filemap_free(pl_filemap);
+      pl_filemap = NULL;
+      return;
+    }
+
+  DPRINTF(E_DBG, L_SCAN, "Playlist file map holds %d files\n", pl_filemap->count);
+}
+
+void
+scan_playlist_batch_end(void)
+{
+  if (!pl_filemap)
+    return;
+
+  pl_filemap_free(pl_filemap);
+  pl_filemap = NULL;
+}
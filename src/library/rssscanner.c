@@ -37,6 +37,7 @@
 #define _XOPEN_SOURCE
 #endif
 #include <time.h>
+#include <pthread.h>
 
 #include <event2/buffer.h>
 
@@ -53,6 +54,7 @@
 #define APPLE_PODCASTS_SERVER "https://podcasts.apple.com/"
 #define APPLE_ITUNES_SERVER "https://itunes.apple.com/"
 #define RSS_LIMIT_DEFAULT 10
+#define RSS_FETCH_THREADS 8
 
 enum rss_scan_type {
   RSS_SCAN_RESCAN,
@@ -67,6 +69,35 @@ struct rss_item_info {
   const char *type;
 };
 
+// A download of a feed. The validators (ETag, Last-Modified) from the previous
+// download are sent with the request, so that the server can reply with 304 if
+// the feed is unchanged. In that case xml will be NULL and not_modified true.
+struct rss_fetch {
+  char *path;
+  char *etag;
+  char *modified;
+
+  xml_node *xml;
+  bool not_modified;
+
+  struct rss_fetch *next;
+};
+
+// Runs a bounded number of downloads in parallel for rss_scan_all()
+struct rss_fetch_pool {
+  pthread_t tids[RSS_FETCH_THREADS];
+  int nthreads;
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  struct rss_fetch *todo;
+  struct rss_fetch *done;
+  int pending; // Started or done, but not yet collected by rss_scan_all()
+  int remaining; // Not yet collected
+  bool quit;
+};
+
 static struct timeval rss_refresh_interval = { 3600, 0 };
 
 // Forward
@@ -232,33 +263,99 @@ playlist_fetch(bool *is_new, const char *path)
   return NULL;
 }
 
-static xml_node *
-rss_xml_get(const char *url)
+static struct rss_fetch *
+rss_fetch_new(const char *path, const char *etag, const char *modified)
+{
+  struct rss_fetch *fetch;
+
+  CHECK_NULL(L_LIB, fetch = calloc(1, sizeof(struct rss_fetch)));
+  fetch->path = strdup(path);
+  fetch->etag = safe_strdup(etag);
+  fetch->modified = safe_strdup(modified);
+
+  return fetch;
+}
+
+static void
+rss_fetch_free(struct rss_fetch *fetch)
+{
+  if (!fetch)
+    return;
+
+  xml_free(fetch->xml);
+  free(fetch->path);
+  free(fetch->etag);
+  free(fetch->modified);
+  free(fetch);
+}
+
+// Downloads and parses the feed. Doesn't touch the database, so can run in any
+// thread. Returns 0 if the feed was retrieved or is unmodified, otherwise -1.
+static int
+rss_fetch_run(struct rss_fetch *fetch)
 {
   struct http_client_ctx ctx = { 0 };
+  struct keyval kv_out = { 0 };
+  struct keyval kv_in = { 0 };
   const char *raw = NULL;
-  xml_node *xml = NULL;
+  const char *val;
   char *feedurl;
   int ret;
 
   // Is it an apple podcast stream?
   // ie https://podcasts.apple.com/is/podcast/cgp-grey/id974722423
-  if (strncmp(url, APPLE_PODCASTS_SERVER, strlen(APPLE_PODCASTS_SERVER)) == 0)
+  if (strncmp(fetch->path, APPLE_PODCASTS_SERVER, strlen(APPLE_PODCASTS_SERVER)) == 0)
     {
-      feedurl = apple_rss_feedurl_get(url);
+      feedurl = apple_rss_feedurl_get(fetch->path);
       if (!feedurl)
-	return NULL;
+	return -1;
     }
   else
-    feedurl = strdup(url);
+    feedurl = strdup(fetch->path);
+
+  if (fetch->etag)
+    keyval_add(&kv_out, "If-None-Match", fetch->etag);
+  if (fetch->modified)
+    keyval_add(&kv_out, "If-Modified-Since", fetch->modified);
 
   CHECK_NULL(L_LIB, ctx.input_body = evbuffer_new());
   ctx.url = feedurl;
+  ctx.output_headers = &kv_out;
+  ctx.input_headers = &kv_in;
 
   ret = http_client_request(&ctx, NULL);
-  if (ret < 0 || ctx.response_code != HTTP_OK)
+  if (ret < 0 || (ctx.response_code != HTTP_OK && ctx.response_code != HTTP_NOTMODIFIED))
     {
       DPRINTF(E_LOG, L_LIB, "Failed to fetch RSS from '%s' (return %d, error code %d)\n", ctx.url, ret, ctx.response_code);
+      ret = -1;
+      goto cleanup;
+    }
+
+  // Keep the validators of the last request, a server could stop sending them
+  if (ctx.response_code == HTTP_OK)
+    {
+      free(fetch->etag);
+      fetch->etag = NULL;
+      free(fetch->modified);
+      fetch->modified = NULL;
+    }
+
+  if ((val = keyval_get(&kv_in, "ETag")))
+    {
+      free(fetch->etag);
+      fetch->etag = strdup(val);
+    }
+  if ((val = keyval_get(&kv_in, "Last-Modified")))
+    {
+      free(fetch->modified);
+      fetch->modified = strdup(val);
+    }
+
+  if (ctx.response_code == HTTP_NOTMODIFIED)
+    {
+      DPRINTF(E_DBG, L_LIB, "RSS from '%s' not modified\n", ctx.url);
+      fetch->not_modified = true;
+      ret = 0;
       goto cleanup;
     }
 
@@ -266,17 +363,22 @@ rss_xml_get(const char *url)
 
   raw = (const char*)evbuffer_pullup(ctx.input_body, -1);
 
-  xml = xml_from_string(raw);
-  if (!xml)
+  fetch->xml = xml_from_string(raw);
+  if (!fetch->xml)
     {
       DPRINTF(E_LOG, L_LIB, "Failed to parse RSS XML from '%s'\n", ctx.url);
+      ret = -1;
       goto cleanup;
     }
 
+  ret = 0;
+
  cleanup:
+  keyval_clear(&kv_out);
+  keyval_clear(&kv_in);
   evbuffer_free(ctx.input_body);
   free(feedurl);
-  return xml;
+  return ret;
 }
 
 static int
@@ -362,9 +464,8 @@ mfi_metadata_fixup(struct media_file_info *mfi, struct rss_item_info *ri, const
 }
 
 static int
-rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
+rss_save(struct playlist_info *pli, xml_node *xml, int *count, enum rss_scan_type scan_type)
 {
-  xml_node *xml;
   xml_node *item;
   const char *feed_title;
   const char *feed_author;
@@ -374,18 +475,10 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
   uint32_t time_added;
   int ret;
 
-  xml = rss_xml_get(pli->path);
-  if (!xml)
-    {
-      DPRINTF(E_LOG, L_LIB, "Could not get RSS/xml from '%s' (id %d)\n", pli->path, pli->id);
-      return -1;
-    }
-
   ret = feed_metadata_from_xml(&feed_title, &feed_author, &feed_artwork, xml);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_LIB, "Invalid RSS/xml received from '%s' (id %d)\n", pli->path, pli->id);
-      xml_free(xml);
       return -1;
     }
 
@@ -413,7 +506,6 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
       if (library_is_exiting())
 	{
 	  db_transaction_rollback();
-	  xml_free(xml);
 	  return -1;
 	}
 
@@ -455,32 +547,50 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
     }
 
   db_transaction_end();
-  xml_free(xml);
 
   return 0;
 }
 
 static int
-rss_scan(const char *path, enum rss_scan_type scan_type)
+rss_scan(struct rss_fetch *fetch, enum rss_scan_type scan_type)
 {
   struct playlist_info *pli;
   bool pl_is_new;
   int count;
   int ret;
 
+  if (!fetch->xml && !fetch->not_modified)
+    {
+      DPRINTF(E_LOG, L_LIB, "Could not get RSS/xml from '%s'\n", fetch->path);
+      return -1;
+    }
+
   // Fetches or creates playlist
-  pli = playlist_fetch(&pl_is_new, path);
+  pli = playlist_fetch(&pl_is_new, fetch->path);
   if (!pli)
     return -1;
 
-  // Retrieves the RSS and reads the feed, saving each item as a track, and also
-  // adds the relationship to playlistitems. The pli will also be updated with
-  // metadata from the RSS.
-  //
-  // playlistitems are only cleared if we are ready to add entries
-  ret = rss_save(pli, &count, scan_type);
-  if (ret < 0)
-    goto error;
+  if (fetch->not_modified)
+    {
+      // Protect this feed's items from purge after scan
+      db_pl_ping_items_bymatch("http://", pli->id);
+      db_pl_ping_items_bymatch("https://", pli->id);
+      count = 0;
+    }
+  else
+    {
+      // Reads the feed, saving each item as a track, and also adds the
+      // relationship to playlistitems. The pli will also be updated with
+      // metadata from the RSS.
+      //
+      // playlistitems are only cleared if we are ready to add entries
+      ret = rss_save(pli, fetch->xml, &count, scan_type);
+      if (ret < 0)
+	goto error;
+    }
+
+  swap_pointers(&pli->http_etag, &fetch->etag);
+  swap_pointers(&pli->http_modified, &fetch->modified);
 
   // Save the playlist again, title etc may have been modified by rss_save().
   // This also updates the db_timestamp which protects the RSS from deletion.
@@ -488,7 +598,10 @@ rss_scan(const char *path, enum rss_scan_type scan_type)
   if (ret < 0)
     goto error;
 
-  DPRINTF(E_INFO, L_SCAN, "Added or updated %d items from RSS feed '%s' (id %d)\n", count, path, pli->id);
+  if (fetch->not_modified)
+    DPRINTF(E_INFO, L_SCAN, "RSS feed '%s' (id %d) is unchanged\n", fetch->path, pli->id);
+  else
+    DPRINTF(E_INFO, L_SCAN, "Added or updated %d items from RSS feed '%s' (id %d)\n", count, fetch->path, pli->id);
 
   free_pli(pli, 0);
   return 0;
@@ -500,13 +613,140 @@ rss_scan(const char *path, enum rss_scan_type scan_type)
   return -1;
 }
 
+static void *
+rss_fetch_worker(void *arg)
+{
+  struct rss_fetch_pool *pool = arg;
+  struct rss_fetch *fetch;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&pool->lck));
+
+  while (!pool->quit && pool->todo)
+    {
+      // Don't let downloaded feeds pile up if the library thread is slow
+      if (pool->pending >= 2 * RSS_FETCH_THREADS)
+	{
+	  CHECK_ERR(L_LIB, pthread_cond_wait(&pool->cond, &pool->lck));
+	  continue;
+	}
+
+      fetch = pool->todo;
+      pool->todo = fetch->next;
+      pool->pending++;
+
+      CHECK_ERR(L_LIB, pthread_mutex_unlock(&pool->lck));
+
+      rss_fetch_run(fetch);
+
+      CHECK_ERR(L_LIB, pthread_mutex_lock(&pool->lck));
+
+      fetch->next = pool->done;
+      pool->done = fetch;
+      CHECK_ERR(L_LIB, pthread_cond_broadcast(&pool->cond));
+    }
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&pool->lck));
+
+  pthread_exit(NULL);
+}
+
+// Returns the next finished download, or NULL when all have been collected
+static struct rss_fetch *
+rss_fetch_pool_collect(struct rss_fetch_pool *pool)
+{
+  struct rss_fetch *fetch;
+
+  if (pool->remaining == 0)
+    return NULL;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&pool->lck));
+
+  while (!pool->done)
+    CHECK_ERR(L_LIB, pthread_cond_wait(&pool->cond, &pool->lck));
+
+  fetch = pool->done;
+  pool->done = fetch->next;
+  pool->pending--;
+  pool->remaining--;
+  CHECK_ERR(L_LIB, pthread_cond_broadcast(&pool->cond));
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&pool->lck));
+
+  return fetch;
+}
+
+static void
+rss_fetch_pool_stop(struct rss_fetch_pool *pool)
+{
+  struct rss_fetch *fetch;
+  int i;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&pool->lck));
+  pool->quit = true;
+  CHECK_ERR(L_LIB, pthread_cond_broadcast(&pool->cond));
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&pool->lck));
+
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->tids[i], NULL);
+
+  while ((fetch = pool->todo))
+    {
+      pool->todo = fetch->next;
+      rss_fetch_free(fetch);
+    }
+  while ((fetch = pool->done))
+    {
+      pool->done = fetch->next;
+      rss_fetch_free(fetch);
+    }
+
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lck);
+}
+
+// Starts downloading the feeds in todo, returns the number of threads started
+static int
+rss_fetch_pool_start(struct rss_fetch_pool *pool, struct rss_fetch *todo, int nfeeds)
+{
+  int ret;
+  int i;
+
+  memset(pool, 0, sizeof(struct rss_fetch_pool));
+
+  CHECK_ERR(L_LIB, mutex_init(&pool->lck));
+  CHECK_ERR(L_LIB, pthread_cond_init(&pool->cond, NULL));
+
+  pool->todo = todo;
+  pool->remaining = nfeeds;
+
+  for (i = 0; i < RSS_FETCH_THREADS && i < nfeeds; i++)
+    {
+      ret = pthread_create(&pool->tids[i], NULL, rss_fetch_worker, pool);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_LIB, "Could not spawn RSS download thread: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(pool->tids[i], "rssfetch");
+    }
+
+  pool->nthreads = i;
+
+  return pool->nthreads;
+}
+
 static void
 rss_scan_all(enum rss_scan_type scan_type)
 {
   struct query_params qp = { 0 };
   struct db_playlist_info dbpli;
+  struct rss_fetch_pool pool;
+  struct rss_fetch *todo;
+  struct rss_fetch *fetch;
   time_t start;
   time_t end;
+  int nfeeds;
   int count;
   int ret;
 
@@ -526,17 +766,54 @@ rss_scan_all(enum rss_scan_type scan_type)
       return;
     }
 
-  count = 0;
+  // A metascan should reread everything, so no validators in that case
+  todo = NULL;
+  nfeeds = 0;
   while (((ret = db_query_fetch_pl(&dbpli, &qp)) == 0) && (dbpli.path))
     {
-      ret = rss_scan(dbpli.path, scan_type);
-      if (ret == 0)
-	count++;
+      if (scan_type == RSS_SCAN_RESCAN)
+	fetch = rss_fetch_new(dbpli.path, dbpli.http_etag, dbpli.http_modified);
+      else
+	fetch = rss_fetch_new(dbpli.path, NULL, NULL);
+
+      fetch->next = todo;
+      todo = fetch;
+      nfeeds++;
     }
 
   db_query_end(&qp);
   free(qp.filter);
 
+  if (nfeeds == 0)
+    return;
+
+  // The downloads run in parallel, while we save the results here in the
+  // library thread, which is the only one allowed to write to the db
+  ret = rss_fetch_pool_start(&pool, todo, nfeeds);
+  if (ret == 0)
+    {
+      rss_fetch_pool_stop(&pool);
+      return;
+    }
+
+  count = 0;
+  while ((fetch = rss_fetch_pool_collect(&pool)))
+    {
+      if (library_is_exiting())
+	{
+	  rss_fetch_free(fetch);
+	  break;
+	}
+
+      ret = rss_scan(fetch, scan_type);
+      if (ret == 0)
+	count++;
+
+      rss_fetch_free(fetch);
+    }
+
+  rss_fetch_pool_stop(&pool);
+
   end = time(NULL);
 
   if (count == 0)
@@ -579,6 +856,7 @@ rss_fullscan(void)
 static int
 rss_add(const char *path)
 {
+  struct rss_fetch *fetch;
   int ret;
 
   if (!net_is_http_or_https(path))
@@ -589,7 +867,13 @@ rss_add(const char *path)
 
   DPRINTF(E_DBG, L_LIB, "Adding RSS '%s'\n", path);
 
-  ret = rss_scan(path, RSS_SCAN_RESCAN);
+  fetch = rss_fetch_new(path, NULL, NULL);
+
+  ret = rss_fetch_run(fetch);
+  if (ret == 0)
+    ret = rss_scan(fetch, RSS_SCAN_RESCAN);
+
+  rss_fetch_free(fetch);
   if (ret < 0)
     return LIBRARY_PATH_INVALID;
 
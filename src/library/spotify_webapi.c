@@ -21,10 +21,13 @@
 
 #include <event2/event.h>
 #include <json.h>
+#include <ctype.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "artwork.h"
 #include "cache.h"
@@ -112,6 +115,7 @@ struct spotify_playlist
   const char *uri;
 
   const char *href;
+  const char *snapshot_id;
 
   const char *tracks_href;
   int tracks_count;
@@ -147,6 +151,17 @@ static int spotify_base_plid;
 // Flag to avoid triggering playlist change events while the (re)scan is running
 static bool scanning;
 
+// Artwork url lists of the scanned tracks, added to the cache in batches
+#define ARTWORK_URLS_BATCH_SIZE 100
+struct artwork_urls_batch
+{
+  char *uris[ARTWORK_URLS_BATCH_SIZE];
+  char *images[ARTWORK_URLS_BATCH_SIZE];
+  int count;
+};
+
+static struct artwork_urls_batch artwork_urls_batch;
+
 
 // Endpoints and credentials for the web api
 static const char *spotify_client_id     = "0e684a5422384114a8ae7ac020f01789";
@@ -168,6 +183,15 @@ static const char *spotify_shows_uri           = "https://api.spotify.com/v1/me/
 static const char *spotify_shows_episodes_uri  = "https://api.spotify.com/v1/shows/%s/episodes";
 static const char *spotify_episode_uri         = "https://api.spotify.com/v1/episodes/%s";
 
+// Playlist track pages are large, since each track has the full album object
+// with e.g. available_markets. Asking for just the fields that
+// parse_metadata_track(), parse_metadata_album() and image_list_make() read
+// makes the responses, and so the json-c trees, a fraction of the size.
+#define SPOTIFY_PLAYLIST_TRACKS_FIELDS \
+  "fields=next,offset,limit,total,items(added_at,track(" \
+  "album(album_type,artists(name),id,images,label,name,release_date,release_date_precision,type,uri)," \
+  "artists(name),disc_number,duration_ms,id,is_playable,linked_from(uri),name,restrictions,track_number,type,uri))"
+
 
 static enum spotify_item_type
 parse_type_from_uri(const char *uri)
@@ -390,6 +414,11 @@ free_http_client_ctx(struct http_client_ctx *ctx)
       keyval_clear(ctx->output_headers);
       free(ctx->output_headers);
     }
+  if (ctx->input_headers)
+    {
+      keyval_clear(ctx->input_headers);
+      free(ctx->input_headers);
+    }
   free(ctx);
 }
 
@@ -477,19 +506,80 @@ request_access_tokens(struct keyval *kv, const char **err)
   return ret;
 }
 
+// Catalog items rarely change, so responses for these are cached (see
+// cache_webapi_add). The user's own data, like /me and playlists, is not.
+static const char *response_cache_prefixes[] =
+{
+  "https://api.spotify.com/v1/albums/",
+  "https://api.spotify.com/v1/artists/",
+  "https://api.spotify.com/v1/tracks/",
+  "https://api.spotify.com/v1/episodes/",
+  "https://api.spotify.com/v1/shows/",
+};
+
+static bool
+response_is_cacheable(const char *uri)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(response_cache_prefixes); i++)
+    {
+      if (strncmp(uri, response_cache_prefixes[i], strlen(response_cache_prefixes[i])) == 0)
+	return true;
+    }
+
+  return false;
+}
+
+// Returns when a response expires according to its Cache-Control header, or
+// -1 if it must not be saved. Without max-age it is stale right away, but can
+// still be revalidated if it has an etag.
+static time_t
+response_expires_get(struct keyval *headers)
+{
+  const char *cache_control;
+  const char *max_age;
+  long age;
+
+  cache_control = keyval_get(headers, "Cache-Control");
+  if (!cache_control)
+    return time(NULL);
+
+  if (strstr(cache_control, "no-store"))
+    return -1;
+
+  max_age = strstr(cache_control, "max-age=");
+  if (!max_age)
+    return time(NULL);
+
+  age = strtol(max_age + strlen("max-age="), NULL, 10);
+  if (age <= 0)
+    return time(NULL);
+
+  return time(NULL) + age;
+}
+
 /*
  * Request the api endpoint at 'href' and returns the response body as
  * an allocated JSON object (must be freed by the caller) or NULL.
  *
+ * Responses for catalog endpoints are cached. A fresh response is used without
+ * making a request, a stale one is revalidated with If-None-Match.
+ *
  * @param href The spotify endpoint uri
+ * @param session The http session to use, NULL for the shared session
  * @return Response as JSON object or NULL
  */
 static json_object *
-request_endpoint(const char *uri)
+request_endpoint_session(const char *uri, struct http_client_session *session)
 {
   struct http_client_ctx *ctx;
+  struct evbuffer *cached = NULL;
   char bearer_token[1024];
   char *response_body;
+  char *etag = NULL;
+  const char *new_etag;
+  time_t expires;
   json_object *json_response = NULL;
   int ret;
 
@@ -499,6 +589,22 @@ request_endpoint(const char *uri)
 
   ctx->url = uri;
 
+  if (response_is_cacheable(uri))
+    {
+      CHECK_NULL(L_SPOTIFY, cached = evbuffer_new());
+      CHECK_NULL(L_SPOTIFY, ctx->input_headers = calloc(1, sizeof(struct keyval)));
+
+      ret = cache_webapi_get(cached, &etag, &expires, uri);
+      if (ret == 0 && expires > time(NULL))
+	{
+	  DPRINTF(E_DBG, L_SPOTIFY, "Using cached response for '%s'\n", uri);
+	  evbuffer_add_buffer(ctx->input_body, cached);
+	  goto parse;
+	}
+      else if (ret == 0 && etag)
+	keyval_add(ctx->output_headers, "If-None-Match", etag);
+    }
+
   credentials_get_auth_header(bearer_token, sizeof(bearer_token));
   if (keyval_add(ctx->output_headers, "Authorization", bearer_token) < 0)
     {
@@ -508,15 +614,39 @@ request_endpoint(const char *uri)
 
   DPRINTF(E_DBG, L_SPOTIFY, "Making request to '%s'\n", uri);
 
-  CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&spotify_http_session.lock));
-  ret = http_client_request(ctx, &spotify_http_session.session);
-  CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&spotify_http_session.lock));
+  if (session)
+    ret = http_client_request(ctx, session);
+  else
+    {
+      CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&spotify_http_session.lock));
+      ret = http_client_request(ctx, &spotify_http_session.session);
+      CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&spotify_http_session.lock));
+    }
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_SPOTIFY, "Request for '%s' failed\n", uri);
       goto out;
     }
 
+  if (cached && ctx->response_code == HTTP_NOTMODIFIED)
+    {
+      DPRINTF(E_DBG, L_SPOTIFY, "Cached response for '%s' is still valid\n", uri);
+      evbuffer_drain(ctx->input_body, evbuffer_get_length(ctx->input_body));
+      evbuffer_add_buffer(ctx->input_body, cached);
+
+      expires = response_expires_get(ctx->input_headers);
+      if (expires >= 0)
+	cache_webapi_add(uri, etag, expires, ctx->input_body);
+    }
+  else if (cached && ctx->response_code == HTTP_OK)
+    {
+      new_etag = keyval_get(ctx->input_headers, "ETag");
+      expires = response_expires_get(ctx->input_headers);
+      if (expires > time(NULL) || (expires >= 0 && new_etag))
+	cache_webapi_add(uri, new_etag, expires, ctx->input_body);
+    }
+
+ parse:
   // 0-terminate for safety
   evbuffer_add(ctx->input_body, "", 1);
 
@@ -537,10 +667,19 @@ request_endpoint(const char *uri)
 
  out:
   free_http_client_ctx(ctx);
+  if (cached)
+    evbuffer_free(cached);
+  free(etag);
 
   return json_response;
 }
 
+static json_object *
+request_endpoint(const char *uri)
+{
+  return request_endpoint_session(uri, NULL);
+}
+
 /*
  * Request user information
  *
@@ -688,6 +827,248 @@ request_endpoint_with_token_refresh(const char *href)
 typedef int (*paging_request_cb)(void *arg);
 typedef int (*paging_item_cb)(json_object *item, int index, int total, enum spotify_request_type request_type, void *arg);
 
+/* Number of threads requesting the pages of a paging object concurrently, and
+ * how many pages they may get ahead of the processing of the items
+ */
+#define PAGING_THREADS 4
+#define PAGING_WINDOW 8
+
+struct paging_page
+{
+  char *href;
+  json_object *response;
+  bool done;
+};
+
+struct paging_prefetch
+{
+  struct paging_page *pages;
+  int npages;
+  int next;          // Next page to request
+  int window_end;    // Only pages before this one may be requested
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  pthread_t tids[PAGING_THREADS];
+  int nthreads;
+};
+
+static void
+paging_items_process(json_object *response, const char *href, paging_item_cb item_cb, enum spotify_request_type request_type, void *arg)
+{
+  json_object *items;
+  json_object *item;
+  int count;
+  int offset;
+  int total;
+  int i;
+  int ret;
+
+  offset = jparse_int_from_obj(response, "offset");
+  total = jparse_int_from_obj(response, "total");
+
+  if (jparse_array_from_obj(response, "items", &items) < 0)
+    return;
+
+  count = json_object_array_length(items);
+  for (i = 0; i < count; i++)
+    {
+      item = json_object_array_get_idx(items, i);
+      if (!item)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Unexpected JSON: no item at index %d in '%s' (API endpoint: '%s')\n",
+		  i, json_object_to_json_string(items), href);
+	  continue;
+	}
+
+      ret = item_cb(item, (i + offset), total, request_type, arg);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Couldn't add item at index %d '%s' (API endpoint: '%s')\n",
+		  i, json_object_to_json_string(item), href);
+	}
+    }
+}
+
+// Returns a copy of the "next" uri of a paging object, but with the offset
+// parameter changed, or NULL if there is no offset parameter
+static char *
+paging_href_with_offset(const char *next_href, int offset)
+{
+  const char *param;
+  const char *rest;
+
+  param = strstr(next_href, "?offset=");
+  if (!param)
+    param = strstr(next_href, "&offset=");
+  if (!param)
+    return NULL;
+
+  param += strlen("?offset=");
+  for (rest = param; isdigit(*rest); rest++)
+    ;
+
+  return safe_asprintf("%.*s%d%s", (int)(param - next_href), next_href, offset, rest);
+}
+
+/* Thread: paging */
+static void *
+paging_prefetch_worker(void *arg)
+{
+  struct paging_prefetch *pf = arg;
+  struct http_client_session session;
+  json_object *response;
+  int i;
+
+  // Each thread has its own session, since the shared one is serialized
+  http_client_session_init(&session);
+
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&pf->lck));
+
+  while (pf->next < pf->npages)
+    {
+      if (pf->next >= pf->window_end)
+	{
+	  CHECK_ERR(L_SPOTIFY, pthread_cond_wait(&pf->cond, &pf->lck));
+	  continue;
+	}
+
+      i = pf->next++;
+
+      CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&pf->lck));
+
+      response = request_endpoint_session(pf->pages[i].href, &session);
+
+      // The library thread will retry failed requests itself
+      if (response && json_object_object_get_ex(response, "error", NULL))
+	{
+	  DPRINTF(E_DBG, L_SPOTIFY, "Error response for '%s': %s\n", pf->pages[i].href, json_object_to_json_string(response));
+	  jparse_free(response);
+	  response = NULL;
+	}
+
+      CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&pf->lck));
+
+      pf->pages[i].response = response;
+      pf->pages[i].done = true;
+      CHECK_ERR(L_SPOTIFY, pthread_cond_broadcast(&pf->cond));
+    }
+
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&pf->lck));
+
+  http_client_session_deinit(&session);
+
+  pthread_exit(NULL);
+}
+
+// Starts threads that request the pages from the given offset, returns -1 if
+// there is nothing to gain from that (or it isn't possible)
+static int
+paging_prefetch_start(struct paging_prefetch *pf, const char *next_href, int offset, int limit, int total)
+{
+  int npages;
+  int ret;
+  int i;
+
+  if (limit <= 0 || offset >= total)
+    return -1;
+
+  npages = (total - offset + limit - 1) / limit;
+  if (npages < 2)
+    return -1;
+
+  memset(pf, 0, sizeof(struct paging_prefetch));
+
+  CHECK_NULL(L_SPOTIFY, pf->pages = calloc(npages, sizeof(struct paging_page)));
+  for (i = 0; i < npages; i++)
+    {
+      pf->pages[i].href = paging_href_with_offset(next_href, offset + i * limit);
+      if (!pf->pages[i].href)
+	goto error;
+    }
+
+  pf->npages = npages;
+  pf->window_end = PAGING_WINDOW;
+
+  CHECK_ERR(L_SPOTIFY, mutex_init(&pf->lck));
+  CHECK_ERR(L_SPOTIFY, pthread_cond_init(&pf->cond, NULL));
+
+  for (i = 0; i < PAGING_THREADS && i < npages; i++)
+    {
+      ret = pthread_create(&pf->tids[i], NULL, paging_prefetch_worker, pf);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Could not spawn paging thread: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(pf->tids[i], "spotifypaging");
+    }
+
+  pf->nthreads = i;
+  if (pf->nthreads == 0)
+    {
+      pthread_cond_destroy(&pf->cond);
+      pthread_mutex_destroy(&pf->lck);
+      goto error;
+    }
+
+  return 0;
+
+ error:
+  for (i = 0; i < npages; i++)
+    free(pf->pages[i].href);
+  free(pf->pages);
+  return -1;
+}
+
+// Waits for page i, returns the response (caller must free) or NULL if the
+// request failed. Pages must be retrieved in order.
+static json_object *
+paging_prefetch_get(struct paging_prefetch *pf, int i)
+{
+  json_object *response;
+
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&pf->lck));
+
+  while (!pf->pages[i].done)
+    CHECK_ERR(L_SPOTIFY, pthread_cond_wait(&pf->cond, &pf->lck));
+
+  response = pf->pages[i].response;
+  pf->pages[i].response = NULL;
+
+  pf->window_end = i + 1 + PAGING_WINDOW;
+  CHECK_ERR(L_SPOTIFY, pthread_cond_broadcast(&pf->cond));
+
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&pf->lck));
+
+  return response;
+}
+
+static void
+paging_prefetch_stop(struct paging_prefetch *pf)
+{
+  int i;
+
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_lock(&pf->lck));
+  pf->next = pf->npages;
+  CHECK_ERR(L_SPOTIFY, pthread_cond_broadcast(&pf->cond));
+  CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&pf->lck));
+
+  for (i = 0; i < pf->nthreads; i++)
+    pthread_join(pf->tids[i], NULL);
+
+  for (i = 0; i < pf->npages; i++)
+    {
+      jparse_free(pf->pages[i].response);
+      free(pf->pages[i].href);
+    }
+  free(pf->pages);
+
+  pthread_cond_destroy(&pf->cond);
+  pthread_mutex_destroy(&pf->lck);
+}
+
 /*
  * Request the spotify endpoint at 'href'
  *
@@ -705,7 +1086,9 @@ typedef int (*paging_item_cb)(json_object *item, int index, int total, enum spot
  * If "next" is set in the response, after processing all items, the next uri
  * is requested and the callback is invoked for every item of this request.
  * The function returns after all items are processed and there is no "next"
- * request.
+ * request. The pages after the first are requested concurrently by
+ * PAGING_THREADS threads, but the callbacks are always invoked in the calling
+ * thread and in the order of the items.
  *
  * @param endpoint_uri The endpont uri
  * @param item_cb The callback function invoked for every item
@@ -720,21 +1103,88 @@ static int
 request_pagingobject_endpoint(const char *href, paging_item_cb item_cb, paging_request_cb pre_request_cb, paging_request_cb post_request_cb,
                               bool with_market, enum spotify_request_type request_type, void *arg)
 {
+  struct paging_prefetch pf;
   char *next_href;
   json_object *response;
-  json_object *items;
-  json_object *item;
-  int count;
-  int i;
   int offset;
+  int limit;
   int total;
-  int ret;
+  int i;
 
   if (!with_market)
     next_href = safe_strdup(href);
   else
     next_href = credentials_query_param_market(href);
 
+  if (!next_href)
+    return 0;
+
+  // The first page tells us how many pages there are
+  if (pre_request_cb)
+    pre_request_cb(arg);
+
+  response = request_endpoint_with_token_refresh(next_href);
+  if (!response)
+    {
+      DPRINTF(E_LOG, L_SPOTIFY, "Unexpected JSON: no response for paging endpoint (API endpoint: '%s')\n", next_href);
+
+      if (post_request_cb)
+	post_request_cb(arg);
+
+      free(next_href);
+      return -1;
+    }
+
+  free(next_href);
+  next_href = safe_strdup(jparse_str_from_obj(response, "next"));
+
+  offset = jparse_int_from_obj(response, "offset");
+  limit = jparse_int_from_obj(response, "limit");
+  total = jparse_int_from_obj(response, "total");
+
+  paging_items_process(response, href, item_cb, request_type, arg);
+
+  if (post_request_cb)
+    post_request_cb(arg);
+
+  jparse_free(response);
+
+  // Request the remaining pages concurrently, but process them in order
+  if (next_href && paging_prefetch_start(&pf, next_href, offset + limit, limit, total) == 0)
+    {
+      free(next_href);
+
+      for (i = 0; i < pf.npages; i++)
+	{
+	  if (pre_request_cb)
+	    pre_request_cb(arg);
+
+	  response = paging_prefetch_get(&pf, i);
+	  if (!response) // E.g. the token expired, so retry with a refresh
+	    response = request_endpoint_with_token_refresh(pf.pages[i].href);
+	  if (!response)
+	    {
+	      DPRINTF(E_LOG, L_SPOTIFY, "Unexpected JSON: no response for paging endpoint (API endpoint: '%s')\n", pf.pages[i].href);
+
+	      if (post_request_cb)
+		post_request_cb(arg);
+
+	      paging_prefetch_stop(&pf);
+	      return -1;
+	    }
+
+	  paging_items_process(response, href, item_cb, request_type, arg);
+
+	  if (post_request_cb)
+	    post_request_cb(arg);
+
+	  jparse_free(response);
+	}
+
+      paging_prefetch_stop(&pf);
+      return 0;
+    }
+
   while (next_href)
     {
       if (pre_request_cb)
@@ -756,30 +1206,7 @@ request_pagingobject_endpoint(const char *href, paging_item_cb item_cb, paging_r
       free(next_href);
       next_href = safe_strdup(jparse_str_from_obj(response, "next"));
 
-      offset = jparse_int_from_obj(response, "offset");
-      total = jparse_int_from_obj(response, "total");
-
-      if (jparse_array_from_obj(response, "items", &items) == 0)
-        {
-	  count = json_object_array_length(items);
-	  for (i = 0; i < count; i++)
-	    {
-	      item = json_object_array_get_idx(items, i);
-	      if (!item)
-	        {
-		  DPRINTF(E_LOG, L_SPOTIFY, "Unexpected JSON: no item at index %d in '%s' (API endpoint: '%s')\n",
-			  i, json_object_to_json_string(items), href);
-		  continue;
-		}
-
-	      ret = item_cb(item, (i + offset), total, request_type, arg);
-	      if (ret < 0)
-		{
-		  DPRINTF(E_LOG, L_SPOTIFY, "Couldn't add item at index %d '%s' (API endpoint: '%s')\n",
-			  i, json_object_to_json_string(item), href);
-		}
-	    }
-	}
+      paging_items_process(response, href, item_cb, request_type, arg);
 
       if (post_request_cb)
 	post_request_cb(arg);
@@ -790,6 +1217,26 @@ request_pagingobject_endpoint(const char *href, paging_item_cb item_cb, paging_r
   return 0;
 }
 
+// Find first image that has a smaller width than the given max_w (this should
+// avoid the need for resizing and improve performance at the cost of some
+// quality loss). If no sufficiently small image available, return smallest
+// best alternative. Special case is if no max width (max_w = 0) is given, the
+// widest images will be used.
+//
+// Note that Spotify should return the images ordered descending by width
+// (widest image first), but at one point had a bug that meant they didn't, so
+// we don't rely on that here.
+static bool
+image_is_better(int width, int candidate_width, int max_w)
+{
+  if (max_w == 0 || candidate_width == 0)
+    return (width > candidate_width);
+  else if (candidate_width > max_w)
+    return (width < candidate_width);
+  else
+    return (candidate_width < width && width <= max_w);
+}
+
 static const char *
 get_album_image(json_object *jsonalbum, int max_w)
 {
@@ -800,7 +1247,6 @@ get_album_image(json_object *jsonalbum, int max_w)
   int width;
   int candidate_width;
   const char *artwork_url = NULL;
-  bool use_image;
 
   if (!json_object_object_get_ex(jsonalbum, "images", &jsonimages))
     {
@@ -808,15 +1254,6 @@ get_album_image(json_object *jsonalbum, int max_w)
       return NULL;
     }
 
-  // Find first image that has a smaller width than the given max_w (this should
-  // avoid the need for resizing and improve performance at the cost of some
-  // quality loss). If no sufficiently small image available, return smallest
-  // best alternative. Special case is if no max width (max_w = 0) is given, the
-  // widest images will be used.
-  //
-  // Note that Spotify should return the images ordered descending by width
-  // (widest image first), but at one point had a bug that meant they didn't, so
-  // we don't rely on that here.
   image_count = json_object_array_length(jsonimages);
   for (index = 0, candidate_width = 0; index < image_count; index++)
     {
@@ -825,15 +1262,7 @@ get_album_image(json_object *jsonalbum, int max_w)
 	continue;
 
       width = jparse_int_from_obj(jsonimage, "width");
-
-      if (max_w == 0 || candidate_width == 0)
-	use_image = (width > candidate_width);
-      else if (candidate_width > max_w)
-	use_image = (width < candidate_width);
-      else
-	use_image = (candidate_width < width && width <= max_w);
-
-      if (!use_image)
+      if (!image_is_better(width, candidate_width, max_w))
 	continue;
 
       candidate_width = width;
@@ -843,6 +1272,75 @@ get_album_image(json_object *jsonalbum, int max_w)
   return artwork_url;
 }
 
+/* The images of an album or show as lines of "<width> <url>", which is how
+ * they are kept in the artwork url cache, so that the image for any max_w can
+ * be selected later without a web api request.
+ */
+static char *
+image_list_make(json_object *jsonalbum)
+{
+  json_object *jsonimages;
+  json_object *jsonimage;
+  const char *url;
+  char *list;
+  char *prev;
+  int image_count;
+  int index;
+
+  if (!json_object_object_get_ex(jsonalbum, "images", &jsonimages))
+    return NULL;
+
+  list = NULL;
+  image_count = json_object_array_length(jsonimages);
+  for (index = 0; index < image_count; index++)
+    {
+      jsonimage = json_object_array_get_idx(jsonimages, index);
+      if (!jsonimage)
+	continue;
+
+      url = jparse_str_from_obj(jsonimage, "url");
+      if (!url || strchr(url, '\n'))
+	continue;
+
+      prev = list;
+      list = safe_asprintf("%s%d %s\n", prev ? prev : "", jparse_int_from_obj(jsonimage, "width"), url);
+      free(prev);
+    }
+
+  return list;
+}
+
+// Same as get_album_image(), but from a list made by image_list_make()
+static char *
+image_list_select(const char *list, int max_w)
+{
+  const char *line;
+  const char *url;
+  const char *end;
+  const char *artwork_url = NULL;
+  size_t artwork_url_len = 0;
+  int width;
+  int candidate_width;
+
+  for (line = list, candidate_width = 0; line && *line; line = end ? end + 1 : NULL)
+    {
+      end = strchr(line, '\n');
+      url = strchr(line, ' ');
+      if (!url || (end && url > end))
+	continue;
+
+      width = atoi(line);
+      if (!image_is_better(width, candidate_width, max_w))
+	continue;
+
+      candidate_width = width;
+      artwork_url = url + 1;
+      artwork_url_len = end ? (size_t)(end - artwork_url) : strlen(artwork_url);
+    }
+
+  return artwork_url ? strndup(artwork_url, artwork_url_len) : NULL;
+}
+
 static void
 parse_metadata_track(json_object *jsontrack, struct spotify_track *track, int max_w)
 {
@@ -948,6 +1446,7 @@ parse_metadata_playlist(json_object *jsonplaylist, struct spotify_playlist *play
   playlist->uri = jparse_str_from_obj(jsonplaylist, "uri");
   playlist->id = jparse_str_from_obj(jsonplaylist, "id");
   playlist->href = jparse_str_from_obj(jsonplaylist, "href");
+  playlist->snapshot_id = jparse_str_from_obj(jsonplaylist, "snapshot_id");
 
   if (json_object_object_get_ex(jsonplaylist, "owner", &needle))
     playlist->owner = jparse_str_from_obj(needle, "id");
@@ -1028,6 +1527,21 @@ get_id_from_uri(const char *uri, char **id)
   return 0;
 }
 
+// Takes ownership of href, returns it with the fields filter added
+static char *
+playlist_tracks_href_with_fields(char *href)
+{
+  char *href_with_fields;
+
+  if (!href || strstr(href, "fields="))
+    return href;
+
+  href_with_fields = safe_asprintf("%s%c%s", href, strchr(href, '?') ? '&' : '?', SPOTIFY_PLAYLIST_TRACKS_FIELDS);
+  free(href);
+
+  return href_with_fields;
+}
+
 static char *
 get_playlist_tracks_endpoint_uri(const char *uri)
 {
@@ -1042,7 +1556,7 @@ get_playlist_tracks_endpoint_uri(const char *uri)
       goto out;
     }
 
-  endpoint_uri = safe_asprintf(spotify_playlist_tracks_uri, id);
+  endpoint_uri = playlist_tracks_href_with_fields(safe_asprintf(spotify_playlist_tracks_uri, id));
 
  out:
   free(id);
@@ -1618,6 +2132,62 @@ playlist_add_or_update(struct playlist_info *pli)
   return library_playlist_save(pli);
 }
 
+/* Thread: library */
+static void
+artwork_urls_flush(void)
+{
+  struct artwork_urls_batch *batch = &artwork_urls_batch;
+  char **uris;
+  char **images;
+  int i;
+
+  if (batch->count == 0)
+    return;
+
+  uris = malloc(batch->count * sizeof(char *));
+  images = malloc(batch->count * sizeof(char *));
+  if (!uris || !images)
+    {
+      DPRINTF(E_LOG, L_SPOTIFY, "Out of memory for artwork url batch\n");
+      for (i = 0; i < batch->count; i++)
+	{
+	  free(batch->uris[i]);
+	  free(batch->images[i]);
+	}
+      free(uris);
+      free(images);
+      batch->count = 0;
+      return;
+    }
+
+  memcpy(uris, batch->uris, batch->count * sizeof(char *));
+  memcpy(images, batch->images, batch->count * sizeof(char *));
+
+  cache_artwork_urls_add(uris, images, batch->count);
+  batch->count = 0;
+}
+
+/* Thread: library
+ *
+ * The scan responses include the album images, so by caching them here the
+ * artwork for the tracks can later be found without a web api request
+ */
+static void
+artwork_urls_prefill(const char *uri, const char *images)
+{
+  struct artwork_urls_batch *batch = &artwork_urls_batch;
+
+  if (!uri || !images)
+    return;
+
+  batch->uris[batch->count] = strdup(uri);
+  batch->images[batch->count] = strdup(images);
+  batch->count++;
+
+  if (batch->count == ARTWORK_URLS_BATCH_SIZE)
+    artwork_urls_flush();
+}
+
 /*
  * Add a saved album to the library
  */
@@ -1630,6 +2200,7 @@ saved_album_add(json_object *item, int index, int total, enum spotify_request_ty
   json_object *needle;
   json_object *jsontracks;
   json_object *jsontrack;
+  char *images;
   int track_count;
   int dir_id;
   int i;
@@ -1655,6 +2226,8 @@ saved_album_add(json_object *item, int index, int total, enum spotify_request_ty
   album.added_at = jparse_str_from_obj(item, "added_at");
   album.mtime = jparse_time_from_obj(item, "added_at");
 
+  images = image_list_make(jsonalbum);
+
   // Now map the album tracks and insert/update them in the files database
   db_transaction_begin();
 
@@ -1671,11 +2244,14 @@ saved_album_add(json_object *item, int index, int total, enum spotify_request_ty
       parse_metadata_track(jsontrack, &track, 0);
       track.mtime = album.mtime;
 
-      track_add(&track, &album, NULL, dir_id, request_type);
+      if (track_add(&track, &album, NULL, dir_id, request_type) == 0)
+	artwork_urls_prefill(track.uri, images);
     }
 
   db_transaction_end();
 
+  free(images);
+
   if ((index + 1) >= total || ((index + 1) % 10 == 0))
     DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved albums\n", (index + 1), total);
 
@@ -1781,6 +2357,7 @@ saved_playlist_tracks_add(json_object *item, int index, int total, enum spotify_
   json_object *jsontrack;
   json_object *jsonalbum;
   struct playlist_info *pli;
+  char *images;
   int dir_id;
   int ret;
 
@@ -1817,6 +2394,13 @@ saved_playlist_tracks_add(json_object *item, int index, int total, enum spotify_
   if (ret == 0)
     db_pl_add_item_bypath(pli->id, track.uri);
 
+  if (ret == 0 && json_object_object_get_ex(jsontrack, "album", &jsonalbum))
+    {
+      images = image_list_make(jsonalbum);
+      artwork_urls_prefill(track.uri, images);
+      free(images);
+    }
+
   return 0;
 }
 
@@ -1824,10 +2408,14 @@ saved_playlist_tracks_add(json_object *item, int index, int total, enum spotify_
 static int
 scan_playlist_tracks(const char *playlist_tracks_endpoint_uri, struct playlist_info *pli, enum spotify_request_type request_type)
 {
+  char *href;
   int ret;
 
-  ret = request_pagingobject_endpoint(playlist_tracks_endpoint_uri, saved_playlist_tracks_add, transaction_start, transaction_end, true, request_type, pli);
+  href = playlist_tracks_href_with_fields(safe_strdup(playlist_tracks_endpoint_uri));
 
+  ret = request_pagingobject_endpoint(href, saved_playlist_tracks_add, transaction_start, transaction_end, true, request_type, pli);
+
+  free(href);
   return ret;
 }
 
@@ -1850,6 +2438,56 @@ map_playlist_to_pli(struct playlist_info *pli, struct spotify_playlist *playlist
     pli->virtual_path = safe_asprintf("/spotify:/%s", playlist->name);
 }
 
+/*
+ * If the playlist's snapshot id is the same as the one we saved last time, we
+ * don't need to request the tracks again. Instead we just ping the playlist
+ * and its tracks, so they don't get purged.
+ */
+static bool
+playlist_is_unchanged(struct spotify_playlist *playlist)
+{
+  struct query_params qp = { 0 };
+  struct db_media_file_info dbmfi;
+  struct playlist_info *pli;
+  bool unchanged;
+
+  if (!playlist->snapshot_id)
+    return false;
+
+  pli = db_pl_fetch_bypath(playlist->uri);
+  if (!pli)
+    return false;
+
+  unchanged = pli->http_etag && (strcmp(pli->http_etag, playlist->snapshot_id) == 0);
+  if (!unchanged)
+    goto out;
+
+  DPRINTF(E_DBG, L_SPOTIFY, "Playlist '%s' (%s) is unchanged (snapshot %s)\n", playlist->name, playlist->uri, playlist->snapshot_id);
+
+  db_pl_ping(pli->id);
+  db_pl_ping_items_bymatch("spotify:", pli->id);
+
+  // Also protect the tracks' artwork from purge, like track_add() does
+  qp.type = Q_PLITEMS;
+  qp.id = pli->id;
+  db_query_cols_add(&qp, dbmfi_offsetof(path));
+
+  if (db_query_start(&qp) == 0)
+    {
+      while (db_query_fetch_file(&dbmfi, &qp) == 0)
+	{
+	  if (dbmfi.path)
+	    cache_artwork_ping(dbmfi.path, 1, 0);
+	}
+    }
+
+  db_query_end(&qp);
+
+ out:
+  free_pli(pli, 0);
+  return unchanged;
+}
+
 /*
  * Add a saved playlist to the library
  */
@@ -1871,13 +2509,27 @@ saved_playlist_add(json_object *item, int index, int total, enum spotify_request
       return 0; // Ignore
     }
 
+  if (request_type == SPOTIFY_REQUEST_TYPE_RESCAN && playlist_is_unchanged(&playlist))
+    {
+      DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved playlists (playlist unchanged)\n", (index + 1), total);
+      return 0;
+    }
+
   map_playlist_to_pli(&pli, &playlist);
 
   pl_id = playlist_add_or_update(&pli);
   pli.id = pl_id;
 
   if (pl_id > 0)
-    scan_playlist_tracks(playlist.tracks_href, &pli, request_type);
+    {
+      // Only save the snapshot id when we have all the tracks, so that we try
+      // again next time if something fails
+      if (scan_playlist_tracks(playlist.tracks_href, &pli, request_type) == 0 && playlist.snapshot_id)
+	{
+	  pli.http_etag = strdup(playlist.snapshot_id);
+	  library_playlist_save(&pli);
+	}
+    }
   else
     DPRINTF(E_LOG, L_SPOTIFY, "Error adding playlist: '%s' (%s) \n", playlist.name, playlist.uri);
 
@@ -1962,6 +2614,7 @@ scan(enum spotify_request_type request_type)
     scan_saved_shows(request_type);
 
   scanning = false;
+  artwork_urls_flush();
   end = time(NULL);
 
   DPRINTF(E_LOG, L_SPOTIFY, "Spotify scan completed in %.f sec\n", difftime(end, start));
@@ -2240,21 +2893,43 @@ spotifywebapi_artwork_url_get(const char *uri, int max_w, int max_h)
 {
   enum spotify_item_type type;
   json_object *response;
+  json_object *jsonalbum;
   struct spotify_track track;
   char *artwork_url;
+  char *images;
+  char **uris_add;
+  char **images_add;
 
+  if (cache_artwork_urls_get(&images, uri) == 0)
+    {
+      artwork_url = image_list_select(images, max_w);
+      free(images);
+      if (artwork_url)
+	{
+	  DPRINTF(E_DBG, L_SPOTIFY, "Got cached track artwork url: '%s' (%s) \n", artwork_url, uri);
+	  return artwork_url;
+	}
+    }
+
+  jsonalbum = NULL;
   type = parse_type_from_uri(uri);
   if (type == SPOTIFY_ITEM_TYPE_TRACK)
     {
       response = request_track(uri);
       if (response)
-	parse_metadata_track(response, &track, max_w);
+	{
+	  parse_metadata_track(response, &track, max_w);
+	  json_object_object_get_ex(response, "album", &jsonalbum);
+	}
     }
   else if (type == SPOTIFY_ITEM_TYPE_EPISODE)
     {
       response = request_episode(uri);
       if (response)
-	parse_metadata_episode(response, &track, max_w);
+	{
+	  parse_metadata_episode(response, &track, max_w);
+	  json_object_object_get_ex(response, "show", &jsonalbum);
+	}
     }
   else
     {
@@ -2270,6 +2945,18 @@ spotifywebapi_artwork_url_get(const char *uri, int max_w, int max_h)
   DPRINTF(E_DBG, L_SPOTIFY, "Got track artwork url: '%s' (%s) \n", track.artwork_url, track.uri);
 
   artwork_url = safe_strdup(track.artwork_url);
+
+  // Not the scan batch, since this is called from other threads
+  images = jsonalbum ? image_list_make(jsonalbum) : NULL;
+  if (images)
+    {
+      CHECK_NULL(L_SPOTIFY, uris_add = malloc(sizeof(char *)));
+      CHECK_NULL(L_SPOTIFY, images_add = malloc(sizeof(char *)));
+      uris_add[0] = safe_strdup(uri);
+      images_add[0] = images;
+      cache_artwork_urls_add(uris_add, images_add, 1);
+    }
+
   jparse_free(response);
 
   return artwork_url;
@@ -0,0 +1,762 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for the library response paths: DAAP song lists and groups, the
+ * JSON API and MPD's listallinfo. A synthetic library is generated in a work
+ * directory, and then each request is made a number of times in-process, with
+ * the latency percentiles, the size of the reply and the peak RSS reported.
+ * Build with "make library_bench", then e.g.:
+ *
+ *   ./library_bench -c /etc/owntone.conf -w /tmp/bench -n 100000
+ *
+ * The database (songs3.db) and the cache are kept in the work directory, so
+ * the library is only generated again if the number of tracks changes. The
+ * web server and the MPD server are started on the ports given with -p, which
+ * must be free.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <getopt.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "listener.h"
+#include "worker.h"
+#include "cache.h"
+#include "library.h"
+#include "httpd.h"
+#include "httpd_daap.h"
+#ifdef MPD
+# include "mpd.h"
+#endif
+
+#define LIBRARY_BENCH_CONFFILE CONFDIR "/owntone.conf"
+#define LIBRARY_BENCH_SQLITE_EXT PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so"
+#define LIBRARY_BENCH_TRACKS_MIN 10000
+#define LIBRARY_BENCH_TRACKS_MAX 500000
+// Web server port, the MPD server gets the next one
+#define LIBRARY_BENCH_PORT 13689
+// Number of inserts per transaction when generating the library
+#define LIBRARY_BENCH_COMMIT_SIZE 1000
+// Average number of tracks per artist in the generated library
+#define LIBRARY_BENCH_ARTIST_TRACKS 40
+
+// Normally defined in main.c, referenced by some of the modules
+struct event_base *evbase_main;
+
+enum bench_kind
+{
+  BENCH_DAAP,
+  BENCH_JSONAPI,
+  BENCH_MPD,
+};
+
+struct bench_case
+{
+  const char *name;
+  enum bench_kind kind;
+  const char *request;
+};
+
+static struct bench_case bench_cases[] =
+{
+  { "daap_songlist", BENCH_DAAP, "/databases/1/items?type=music&meta=dmap.itemkind,dmap.itemid,dmap.itemname,daap.songalbum,daap.songartist,daap.songalbumartist,daap.songgenre,daap.songtime,daap.songtracknumber,daap.songdiscnumber,daap.songyear,daap.songdatakind,dmap.containeritemid" },
+  { "daap_groups_albums", BENCH_DAAP, "/databases/1/groups?type=music&group-type=albums&sort=album&include-sort-headers=1&meta=dmap.itemname,dmap.itemid,dmap.persistentid,daap.songartist,daap.songalbumartist,dmap.itemcount" },
+  { "daap_groups_artists", BENCH_DAAP, "/databases/1/groups?type=music&group-type=artists&sort=artist&include-sort-headers=1&meta=dmap.itemname,dmap.itemid,dmap.persistentid,dmap.itemcount" },
+  { "json_tracks", BENCH_JSONAPI, "/api/search?type=tracks&expression=media_kind+is+music" },
+  { "json_albums", BENCH_JSONAPI, "/api/library/albums?media_kind=music" },
+  { "json_artists", BENCH_JSONAPI, "/api/library/artists?media_kind=music" },
+  { "json_search", BENCH_JSONAPI, "/api/search?type=tracks,artists,albums&query=love&limit=50" },
+  { "mpd_listallinfo", BENCH_MPD, "listallinfo" },
+};
+
+struct bench_result
+{
+  double *ms; // Latency of each run
+  int runs;
+  size_t bytes;
+  long rss_kib;
+};
+
+static const char *bench_genres[] =
+{
+  "Rock", "Pop", "Electronic", "Jazz", "Hip-Hop", "Classical", "Alternative",
+  "Folk", "Soul", "Metal", "Blues", "Country", "Reggae", "Soundtrack", "Latin",
+  "Punk", "Ambient", "World", "Gospel", "Children's Music",
+};
+
+static const char *bench_words[] =
+{
+  "love", "night", "blue", "fire", "heart", "dream", "river", "city", "light",
+  "road", "rain", "summer", "shadow", "gold", "home", "time", "wild", "dance",
+  "ocean", "star", "stone", "electric", "silent", "broken", "golden",
+  "midnight", "sweet", "lost", "north", "paper", "velvet", "glass", "winter",
+  "morning", "echo", "empire", "garden", "machine", "mirror", "thunder",
+  "honey", "radio", "desert", "island", "ghost", "saint", "crystal", "neon",
+};
+
+static uint32_t bench_rand_state;
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+ms_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static long
+rss_peak_kib_get(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+// Own generator (xorshift32), so the library is the same on all platforms
+static uint32_t
+rand_get(void)
+{
+  uint32_t x = bench_rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  bench_rand_state = x;
+
+  return x;
+}
+
+// Index in [0, n) where the low indices are much more likely, which is how
+// e.g. the number of tracks per artist or genre is distributed in a library
+static int
+rand_skewed(int n)
+{
+  double u = (rand_get() % 100000) / 100000.0;
+
+  return (int)(n * u * u * u);
+}
+
+static char *
+words_make(uint32_t seed, int nwords)
+{
+  const char *word;
+  char buf[256];
+  int len;
+  int i;
+
+  len = 0;
+  for (i = 0; i < nwords && len < sizeof(buf) - 32; i++)
+    {
+      word = bench_words[seed % ARRAY_SIZE(bench_words)];
+      seed = seed / ARRAY_SIZE(bench_words) + seed * 2654435761U;
+
+      len += snprintf(buf + len, sizeof(buf) - len, "%s%c%s", (i > 0) ? " " : "", toupper(word[0]), word + 1);
+    }
+
+  return strdup(buf);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+
+  return (da > db) - (da < db);
+}
+
+static double
+percentile_get(double *sorted, int n, int pct)
+{
+  return sorted[(int)((n - 1) * pct / 100.0 + 0.5)];
+}
+
+
+/* ---------------------------- Library generation -------------------------- */
+
+// Artists are made from their index, so the artist of the n'th most popular
+// index is the same every time
+static char *
+artist_make(int index)
+{
+  char *words;
+  char *artist;
+
+  words = words_make(index + 1, 1 + index % 3);
+  if (index % 4 == 0)
+    artist = safe_asprintf("The %s", words);
+  else
+    artist = strdup(words);
+
+  free(words);
+  return artist;
+}
+
+static void
+track_make(struct media_file_info *mfi, int n, const char *album_artist, const char *album, const char *genre, uint32_t year, bool is_compilation, int nartists)
+{
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  mfi->title = words_make(rand_get(), 1 + rand_get() % 4);
+  mfi->artist = is_compilation ? artist_make(rand_skewed(nartists)) : strdup(album_artist);
+  mfi->album_artist = strdup(album_artist);
+  mfi->album = strdup(album);
+  mfi->genre = strdup(genre);
+  mfi->compilation = is_compilation;
+  mfi->year = year;
+
+  mfi->path = safe_asprintf("/bench/%s/%s/%06d %s.mp3", album_artist, album, n, mfi->title);
+  mfi->virtual_path = safe_asprintf("/file:%s", mfi->path);
+  mfi->fname = strdup(strrchr(mfi->path, '/') + 1);
+  mfi->directory_id = DIR_FILE;
+
+  mfi->type = strdup("mp3");
+  mfi->codectype = strdup("mpeg");
+  mfi->description = strdup("MPEG audio file");
+  mfi->bitrate = 320;
+  mfi->samplerate = 44100;
+  mfi->bits_per_sample = 16;
+  mfi->channels = 2;
+  mfi->song_length = (120 + rand_get() % 300) * 1000;
+  mfi->file_size = (int64_t)mfi->song_length * 40;
+
+  mfi->data_kind = DATA_KIND_FILE;
+  mfi->media_kind = MEDIA_KIND_MUSIC;
+  mfi->item_kind = 2; // music
+  mfi->time_modified = time(NULL) - rand_get() % (5 * 365 * 24 * 3600);
+  mfi->time_added = mfi->time_modified;
+  mfi->play_count = (rand_get() % 3 == 0) ? rand_skewed(100) : 0;
+  mfi->rating = (rand_get() % 10 == 0) ? 20 * (1 + rand_get() % 5) : 0;
+}
+
+static int
+library_generate(int ntracks)
+{
+  struct media_file_info mfi;
+  bool bulk_load;
+  bool is_compilation;
+  char *album_artist;
+  char *album;
+  const char *genre;
+  uint32_t year;
+  int nartists;
+  int album_tracks;
+  int album_discs;
+  int disc_tracks;
+  int n;
+  int i;
+  int ret;
+
+  nartists = ntracks / LIBRARY_BENCH_ARTIST_TRACKS + 1;
+
+  printf("Generating library with %d tracks\n", ntracks);
+
+  bulk_load = db_bulk_load_begin();
+  db_transaction_begin();
+
+  for (n = 0; n < ntracks; )
+    {
+      is_compilation = (rand_get() % 20 == 0);
+      album_artist = is_compilation ? strdup("Various Artists") : artist_make(rand_skewed(nartists));
+      album = words_make(rand_get(), 1 + rand_get() % 3);
+      genre = bench_genres[rand_skewed(ARRAY_SIZE(bench_genres))];
+      year = 2025 - rand_skewed(70);
+
+      album_tracks = 6 + rand_get() % 12;
+      album_discs = (rand_get() % 10 == 0) ? 2 : 1;
+      disc_tracks = (album_tracks + album_discs - 1) / album_discs;
+
+      for (i = 0; i < album_tracks && n < ntracks; i++, n++)
+	{
+	  track_make(&mfi, n, album_artist, album, genre, year, is_compilation, nartists);
+	  mfi.track = i % disc_tracks + 1;
+	  mfi.total_tracks = disc_tracks;
+	  mfi.disc = i / disc_tracks + 1;
+	  mfi.total_discs = album_discs;
+
+	  ret = db_file_add(&mfi);
+	  free_mfi(&mfi, 1);
+	  if (ret < 0)
+	    {
+	      fprintf(stderr, "Could not add generated track %d\n", n);
+	      db_transaction_rollback();
+	      free(album_artist);
+	      free(album);
+	      return -1;
+	    }
+
+	  if ((n + 1) % LIBRARY_BENCH_COMMIT_SIZE == 0)
+	    {
+	      db_transaction_end();
+	      db_transaction_begin();
+	    }
+	}
+
+      free(album_artist);
+      free(album);
+    }
+
+  db_transaction_end();
+
+  if (bulk_load)
+    db_bulk_load_end();
+  else
+    db_hook_post_scan();
+
+  return 0;
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+static int
+mpd_connect(unsigned short port)
+{
+  struct sockaddr_in sin;
+  char greeting[128];
+  ssize_t len;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0)
+    {
+      fprintf(stderr, "Could not connect to MPD server on port %hu: %s\n", port, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+  // "OK MPD <version>\n"
+  len = read(fd, greeting, sizeof(greeting) - 1);
+  if (len <= 0 || strncmp(greeting, "OK MPD", 6) != 0)
+    {
+      fprintf(stderr, "Unexpected greeting from MPD server\n");
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+// Returns the size of the reply, which is read until the final "OK\n"
+static ssize_t
+mpd_request(int fd, const char *command)
+{
+  char buf[65536];
+  char tail[4] = { 0 };
+  size_t total;
+  ssize_t len;
+  char *line;
+  int i;
+
+  line = safe_asprintf("%s\n", command);
+  len = send(fd, line, strlen(line), MSG_NOSIGNAL);
+  free(line);
+  if (len < 0)
+    return -1;
+
+  total = 0;
+  for (;;)
+    {
+      len = read(fd, buf, sizeof(buf));
+      if (len <= 0)
+	return -1;
+
+      if (total == 0 && strncmp(buf, "ACK", 3) == 0)
+	{
+	  fprintf(stderr, "MPD server error: %.*s", (int)len, buf);
+	  return -1;
+	}
+
+      total += len;
+
+      // Keep the last 4 bytes, the reply ends with "\nOK\n" (or is just "OK\n")
+      for (i = (len > 4) ? len - 4 : 0; i < len; i++)
+	{
+	  memmove(tail, tail + 1, 3);
+	  tail[3] = buf[i];
+	}
+
+      if (memcmp(tail, "\nOK\n", 4) == 0 || (total == 3 && memcmp(tail + 1, "OK\n", 3) == 0))
+	break;
+    }
+
+  return total;
+}
+
+static ssize_t
+bench_request(struct bench_case *bc, int mpd_fd)
+{
+  struct evbuffer *evbuf;
+  char *reply;
+  ssize_t bytes;
+
+  switch (bc->kind)
+    {
+      case BENCH_DAAP:
+	evbuf = daap_reply_build(bc->request, "library_bench", 0);
+	if (!evbuf)
+	  return -1;
+	bytes = evbuffer_get_length(evbuf);
+	evbuffer_free(evbuf);
+	return bytes;
+
+      case BENCH_JSONAPI:
+	reply = httpd_jsonapi_get(bc->request);
+	if (!reply)
+	  return -1;
+	bytes = strlen(reply);
+	free(reply);
+	return bytes;
+
+      case BENCH_MPD:
+	if (mpd_fd < 0)
+	  return -1;
+	return mpd_request(mpd_fd, bc->request);
+    }
+
+  return -1;
+}
+
+static int
+bench_run(struct bench_result *result, struct bench_case *bc, int runs, int mpd_fd)
+{
+  ssize_t bytes;
+  double start;
+  int i;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  CHECK_NULL(L_MAIN, result->ms = calloc(runs, sizeof(double)));
+
+  // Warm up, so that the first run isn't the only one reading from disk
+  bytes = bench_request(bc, mpd_fd);
+  if (bytes < 0)
+    {
+      fprintf(stderr, "Request '%s' failed\n", bc->name);
+      free(result->ms);
+      return -1;
+    }
+
+  for (i = 0; i < runs; i++)
+    {
+      start = ms_get();
+      bytes = bench_request(bc, mpd_fd);
+      result->ms[i] = ms_get() - start;
+      if (bytes < 0)
+	{
+	  fprintf(stderr, "Request '%s' failed\n", bc->name);
+	  free(result->ms);
+	  return -1;
+	}
+    }
+
+  result->runs = runs;
+  result->bytes = bytes;
+  result->rss_kib = rss_peak_kib_get();
+
+  qsort(result->ms, runs, sizeof(double), compare_double);
+
+  return 0;
+}
+
+static void
+result_print(struct bench_case *bc, struct bench_result *result)
+{
+  printf("%-22s %9.2f %9.2f %9.2f %9.2f %12zu %10ld\n",
+    bc->name,
+    percentile_get(result->ms, result->runs, 50),
+    percentile_get(result->ms, result->runs, 90),
+    percentile_get(result->ms, result->runs, 99),
+    result->ms[result->runs - 1],
+    result->bytes, result->rss_kib);
+}
+
+static int
+bench_setup(const char *workdir, int port)
+{
+  cfg_t *general = cfg_getsec(cfg, "general");
+  char *path;
+
+  if (mkdir(workdir, 0755) < 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create work directory '%s': %s\n", workdir, strerror(errno));
+      return -1;
+    }
+
+  path = safe_asprintf("%s/songs3.db", workdir);
+  cfg_setstr(general, "db_path", path);
+  free(path);
+
+  path = safe_asprintf("%s/", workdir);
+  cfg_setstr(general, "cache_dir", path);
+  free(path);
+
+  cfg_setint(cfg_getsec(cfg, "library"), "port", port);
+  cfg_setint(cfg_getsec(cfg, "mpd"), "port", port + 1);
+
+  return 0;
+}
+
+static void
+usage(char *program)
+{
+  int i;
+
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>       Use <file> as the configuration file\n");
+  printf("  -w <dir>        Work directory for the database and cache (default /tmp/owntone-bench)\n");
+  printf("  -n <number>     Number of tracks in the library (%d-%d, default 50000)\n", LIBRARY_BENCH_TRACKS_MIN, LIBRARY_BENCH_TRACKS_MAX);
+  printf("  -r <number>     Runs per request (default 20)\n");
+  printf("  -b <name,name>  Requests to run (default all)\n");
+  printf("  -p <port>       Web server port, MPD uses the next (default %d)\n", LIBRARY_BENCH_PORT);
+  printf("  -s <path>       Path to the sqlite extension\n");
+  printf("  -S <number>     Seed for the library generation\n");
+  printf("  -d <number>     Log level (0-5)\n");
+  printf("\n");
+  printf("Requests:");
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    printf(" %s", bench_cases[i].name);
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_result result;
+  char *configfile = LIBRARY_BENCH_CONFFILE;
+  char *sqlite_ext = LIBRARY_BENCH_SQLITE_EXT;
+  char *workdir = "/tmp/owntone-bench";
+  char *caselist = NULL;
+  uint32_t nitems;
+  int ntracks = 50000;
+  int runs = 20;
+  int port = LIBRARY_BENCH_PORT;
+  int loglevel = E_LOG;
+  int mpd_fd = -1;
+  int option;
+  int errors = 0;
+  int ret = EXIT_FAILURE;
+  int i;
+
+  bench_rand_state = 0x5eed;
+
+  while ((option = getopt(argc, argv, "c:w:n:r:b:p:s:S:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'w':
+	    workdir = optarg;
+	    break;
+
+	  case 'n':
+	    ntracks = atoi(optarg);
+	    break;
+
+	  case 'r':
+	    runs = atoi(optarg);
+	    break;
+
+	  case 'b':
+	    caselist = optarg;
+	    break;
+
+	  case 'p':
+	    port = atoi(optarg);
+	    break;
+
+	  case 's':
+	    sqlite_ext = optarg;
+	    break;
+
+	  case 'S':
+	    bench_rand_state = strtoul(optarg, NULL, 0);
+	    if (bench_rand_state == 0)
+	      bench_rand_state = 1; // xorshift would only return 0
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (ntracks < LIBRARY_BENCH_TRACKS_MIN || ntracks > LIBRARY_BENCH_TRACKS_MAX || runs < 1 || port <= 0 || port >= 65535)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (conffile_load(configfile) != 0)
+    {
+      fprintf(stderr, "Config file errors; please fix your config\n");
+      goto conffile_fail;
+    }
+
+  if (bench_setup(workdir, port) < 0)
+    goto setup_fail;
+
+  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
+
+  if (db_init(sqlite_ext) < 0 || db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not initialize the database\n");
+      goto db_fail;
+    }
+
+  if (worker_init() < 0)
+    goto worker_fail;
+
+  listener_init();
+
+  if (cache_init() < 0)
+    goto cache_fail;
+
+  // Doesn't scan, since library_initscan_start() isn't called
+  if (library_init() < 0)
+    goto library_fail;
+
+  db_files_get_count(&nitems, NULL, NULL);
+  if (nitems != ntracks)
+    {
+      if (nitems > 0)
+	db_purge_all();
+
+      if (library_generate(ntracks) < 0)
+	goto generate_fail;
+    }
+  else
+    printf("Using existing library with %d tracks\n", ntracks);
+
+  if (httpd_init("/") < 0)
+    {
+      fprintf(stderr, "Could not start the web server on port %d\n", port);
+      goto httpd_fail;
+    }
+
+#ifdef MPD
+  if (mpd_init() < 0)
+    {
+      fprintf(stderr, "Could not start the MPD server on port %d\n", port + 1);
+      goto mpd_fail;
+    }
+
+  mpd_fd = mpd_connect(port + 1);
+#endif
+
+  printf("%-22s %9s %9s %9s %9s %12s %10s\n",
+    "request", "p50_ms", "p90_ms", "p99_ms", "max_ms", "bytes", "rss_kib");
+
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    {
+      if (caselist && !strstr(caselist, bench_cases[i].name))
+	continue;
+
+      if (bench_run(&result, &bench_cases[i], runs, mpd_fd) < 0)
+	{
+	  errors++;
+	  continue;
+	}
+
+      result_print(&bench_cases[i], &result);
+      free(result.ms);
+    }
+
+  if (mpd_fd >= 0)
+    close(mpd_fd);
+
+  ret = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+#ifdef MPD
+  mpd_deinit();
+ mpd_fail:
+#endif
+  httpd_deinit();
+ httpd_fail:
+ generate_fail:
+  library_deinit();
+ library_fail:
+  cache_deinit();
+ cache_fail:
+  listener_deinit();
+  worker_deinit();
+ worker_fail:
+  db_perthread_deinit();
+  db_deinit();
+ db_fail:
+  event_base_free(evbase_main);
+ setup_fail:
+  conffile_unload();
+ conffile_fail:
+  logger_deinit();
+
+  return ret;
+}
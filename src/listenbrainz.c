@@ -23,6 +23,7 @@
 #include <event2/event.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "conffile.h"
 #include "db.h"
@@ -30,6 +31,19 @@
 #include "listenbrainz.h"
 #include "logger.h"
 #include "misc_json.h"
+#include "worker.h"
+
+// ListenBrainz takes up to 1000 listens per import, but we keep the payload
+// moderate
+#define LISTENBRAINZ_BATCH_MAX 50
+
+// Seconds to wait before retrying after a failed submit, doubled after each
+// failure up to the max
+#define LISTENBRAINZ_RETRY_DELAY_MIN 30
+#define LISTENBRAINZ_RETRY_DELAY_MAX 3600
+
+// Returned by submit_listens() when the request should be retried later
+#define LISTENBRAINZ_ERR_RETRY -2
 
 static const char *listenbrainz_submit_listens_url = "https://api.listenbrainz.org/1/submit-listens";
 static const char *listenbrainz_validate_token_url = "https://api.listenbrainz.org/1/validate-token";
@@ -37,8 +51,43 @@ static bool listenbrainz_disabled = true;
 static char *listenbrainz_token = NULL;
 static time_t listenbrainz_rate_limited_until = 0;
 
+// Protects the submit of the scrobble queue, which runs in the worker threads
+static pthread_mutex_t listenbrainz_submit_lck = PTHREAD_MUTEX_INITIALIZER;
+static int listenbrainz_retry_delay;
+static bool listenbrainz_retry_scheduled;
+
+static json_object *
+listen_new(struct db_scrobble *scrobble)
+{
+  json_object *listen;
+  json_object *track_metadata;
+  json_object *additional_info;
+
+  listen = json_object_new_object();
+  json_object_object_add(listen, "listened_at", json_object_new_int64(scrobble->listened_at));
+  track_metadata = json_object_new_object();
+  json_object_object_add(listen, "track_metadata", track_metadata);
+  json_object_object_add(track_metadata, "artist_name", json_object_new_string(scrobble->artist));
+  if (scrobble->album)
+    json_object_object_add(track_metadata, "release_name", json_object_new_string(scrobble->album));
+  json_object_object_add(track_metadata, "track_name", json_object_new_string(scrobble->title));
+  additional_info = json_object_new_object();
+  json_object_object_add(track_metadata, "additional_info", additional_info);
+  json_object_object_add(additional_info, "media_player", json_object_new_string(PACKAGE_NAME));
+  json_object_object_add(additional_info, "media_player_version", json_object_new_string(PACKAGE_VERSION));
+  json_object_object_add(additional_info, "submission_client", json_object_new_string(PACKAGE_NAME));
+  json_object_object_add(additional_info, "submission_client_version", json_object_new_string(PACKAGE_VERSION));
+  json_object_object_add(additional_info, "duration_ms", json_object_new_int((int32_t)scrobble->song_length));
+
+  return listen;
+}
+
+/*
+ * @return 0 if ok, LISTENBRAINZ_ERR_RETRY if ListenBrainz could not be reached,
+ *         is unavailable or rate limits us, otherwise -1
+ */
 static int
-submit_listens(struct media_file_info *mfi)
+submit_listens(struct db_scrobble *scrobbles, int n)
 {
   struct http_client_ctx ctx = { 0 };
   struct keyval kv_out = { 0 };
@@ -46,12 +95,11 @@ submit_listens(struct media_file_info *mfi)
   char auth_token[1024];
   json_object *request_body;
   json_object *listens;
-  json_object *listen;
-  json_object *track_metadata;
-  json_object *additional_info;
   const char *x_rate_limit_reset_in;
   int32_t rate_limit_seconds = -1;
+  int count;
   int ret;
+  int i;
 
   ctx.url = listenbrainz_submit_listens_url;
 
@@ -61,51 +109,57 @@ submit_listens(struct media_file_info *mfi)
   keyval_add(ctx.output_headers, "Authorization", auth_token);
   keyval_add(ctx.output_headers, "Content-Type", "application/json");
 
-  // Set request body
-  request_body = json_object_new_object();
-  json_object_object_add(request_body, "listen_type", json_object_new_string("single"));
+  // Set request body, the listen type for more than one listen is "import"
   listens = json_object_new_array();
+  for (i = 0, count = 0; i < n; i++)
+    {
+      if (!scrobbles[i].artist || !scrobbles[i].title)
+	{
+	  DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Not scrobbling track without artist or title\n");
+	  continue;
+	}
+
+      json_object_array_add(listens, listen_new(&scrobbles[i]));
+      count++;
+    }
+
+  request_body = json_object_new_object();
+  json_object_object_add(request_body, "listen_type", json_object_new_string((count == 1) ? "single" : "import"));
   json_object_object_add(request_body, "payload", listens);
-  listen = json_object_new_object();
-  json_object_array_add(listens, listen);
-  json_object_object_add(listen, "listened_at", json_object_new_int64((int64_t)time(NULL)));
-  track_metadata = json_object_new_object();
-  json_object_object_add(listen, "track_metadata", track_metadata);
-  json_object_object_add(track_metadata, "artist_name", json_object_new_string(mfi->artist));
-  json_object_object_add(track_metadata, "release_name", json_object_new_string(mfi->album));
-  json_object_object_add(track_metadata, "track_name", json_object_new_string(mfi->title));
-  additional_info = json_object_new_object();
-  json_object_object_add(track_metadata, "additional_info", additional_info);
-  json_object_object_add(additional_info, "media_player", json_object_new_string(PACKAGE_NAME));
-  json_object_object_add(additional_info, "media_player_version", json_object_new_string(PACKAGE_VERSION));
-  json_object_object_add(additional_info, "submission_client", json_object_new_string(PACKAGE_NAME));
-  json_object_object_add(additional_info, "submission_client_version", json_object_new_string(PACKAGE_VERSION));
-  json_object_object_add(additional_info, "duration_ms", json_object_new_int((int32_t)mfi->song_length));
   ctx.output_body = json_object_to_json_string(request_body);
 
+  if (count == 0)
+    {
+      ret = -1;
+      goto out;
+    }
+
   // Create input evbuffer for the response body and keyval for response headers
   ctx.input_headers = &kv_in;
 
+  DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Scrobbling %d track(s), first is '%s' by '%s'\n", count, scrobbles[0].title, scrobbles[0].artist);
+
   // Send POST request for submit-listens endpoint
   ret = http_client_request(&ctx, NULL);
 
   // Process response
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble '%s' by '%s'\n", mfi->title, mfi->artist);
+      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble, request failed\n");
+      ret = LISTENBRAINZ_ERR_RETRY;
       goto out;
     }
 
   if (ctx.response_code == HTTP_OK)
     {
-      DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Scrobbled '%s' by '%s'\n", mfi->title, mfi->artist);
+      DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Scrobbled %d track(s)\n", count);
       listenbrainz_rate_limited_until = 0;
     }
   else if (ctx.response_code == 401)
     {
-      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble '%s' by '%s', unauthorized, disable scrobbling\n", mfi->title,
-          mfi->artist);
+      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble, unauthorized, disable scrobbling\n");
       listenbrainz_disabled = true;
+      ret = LISTENBRAINZ_ERR_RETRY;
     }
   else if (ctx.response_code == 429)
     {
@@ -115,13 +169,18 @@ submit_listens(struct media_file_info *mfi)
 	{
 	  listenbrainz_rate_limited_until = time(NULL) + rate_limit_seconds;
 	}
-      DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Failed to scrobble '%s' by '%s', rate limited for %d seconds\n", mfi->title,
-          mfi->artist, rate_limit_seconds);
+      DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Failed to scrobble, rate limited for %d seconds\n", rate_limit_seconds);
+      ret = LISTENBRAINZ_ERR_RETRY;
+    }
+  else if (ctx.response_code >= 500)
+    {
+      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble, response code: %d\n", ctx.response_code);
+      ret = LISTENBRAINZ_ERR_RETRY;
     }
   else
     {
-      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble '%s' by '%s', response code: %d\n", mfi->title, mfi->artist,
-          ctx.response_code);
+      DPRINTF(E_LOG, L_SCROBBLE, "lbrainz: Failed to scrobble, response code: %d\n", ctx.response_code);
+      ret = -1;
     }
 
 out:
@@ -134,6 +193,87 @@ out:
   return ret;
 }
 
+static void
+queue_submit_cb(void *arg);
+
+static void
+queue_submit_retry(void)
+{
+  int rate_limit_seconds;
+
+  if (listenbrainz_retry_delay == 0)
+    listenbrainz_retry_delay = LISTENBRAINZ_RETRY_DELAY_MIN;
+  else
+    listenbrainz_retry_delay = MIN(2 * listenbrainz_retry_delay, LISTENBRAINZ_RETRY_DELAY_MAX);
+
+  // Don't come back before the rate limit has lifted
+  rate_limit_seconds = listenbrainz_rate_limited_until - time(NULL);
+  if (rate_limit_seconds > listenbrainz_retry_delay)
+    listenbrainz_retry_delay = rate_limit_seconds;
+
+  DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Will retry submitting scrobbles in %d seconds\n", listenbrainz_retry_delay);
+
+  worker_execute(queue_submit_cb, NULL, 0, listenbrainz_retry_delay);
+  listenbrainz_retry_scheduled = true;
+}
+
+// Submits the queued listens in batches. If ListenBrainz can't be reached the
+// listens stay in the queue, and the submit is retried with backoff.
+static int
+queue_submit(void)
+{
+  struct db_scrobble *scrobbles;
+  int n;
+  int ret = 0;
+
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_lock(&listenbrainz_submit_lck));
+
+  // A retry is pending, the listens will be submitted then
+  if (listenbrainz_retry_scheduled)
+    goto out;
+
+  do
+    {
+      // If the token is rejected the listens are kept until a new one is set
+      if (listenbrainz_disabled)
+	break;
+
+      n = db_scrobbles_get(&scrobbles, DB_SCROBBLE_LISTENBRAINZ, LISTENBRAINZ_BATCH_MAX);
+      if (n <= 0)
+	break;
+
+      ret = submit_listens(scrobbles, n);
+      if (ret == LISTENBRAINZ_ERR_RETRY)
+	{
+	  if (!listenbrainz_disabled)
+	    queue_submit_retry();
+	  db_scrobbles_free(scrobbles, n);
+	  break;
+	}
+
+      // Retrying won't fix other errors, so the listens are removed in any case
+      db_scrobbles_delete(DB_SCROBBLE_LISTENBRAINZ, scrobbles[n - 1].id);
+      db_scrobbles_free(scrobbles, n);
+      listenbrainz_retry_delay = 0;
+    }
+  while (n == LISTENBRAINZ_BATCH_MAX);
+
+ out:
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_unlock(&listenbrainz_submit_lck));
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static void
+queue_submit_cb(void *arg)
+{
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_lock(&listenbrainz_submit_lck));
+  listenbrainz_retry_scheduled = false;
+  CHECK_ERR(L_SCROBBLE, pthread_mutex_unlock(&listenbrainz_submit_lck));
+
+  queue_submit();
+}
+
 static int
 validate_token(struct listenbrainz_status *status)
 {
@@ -200,12 +340,6 @@ listenbrainz_scrobble(int mfi_id)
   if (listenbrainz_disabled)
     return -1;
 
-  if (listenbrainz_rate_limited_until > 0 && time(NULL) < listenbrainz_rate_limited_until)
-    {
-      DPRINTF(E_INFO, L_SCROBBLE, "lbrainz: Rate limited, not scrobbling\n");
-      return -2;
-    }
-
   mfi = db_file_fetch_byid(mfi_id);
   if (!mfi)
     {
@@ -225,8 +359,13 @@ listenbrainz_scrobble(int mfi_id)
   if (strcmp(mfi->artist, CFG_NAME_UNKNOWN_ARTIST) == 0)
     goto noscrobble;
 
-  ret = submit_listens(mfi);
-  return ret;
+  ret = db_scrobble_add(DB_SCROBBLE_LISTENBRAINZ, mfi, time(NULL));
+  free_mfi(mfi, 0);
+  if (ret < 0)
+    return -1;
+
+  // If rate limited, a retry is scheduled and the listen will be sent then
+  return queue_submit();
 
 noscrobble:
   free_mfi(mfi, 0);
@@ -256,7 +395,11 @@ listenbrainz_token_set(const char *token)
       listenbrainz_token = NULL;
       ret = db_admin_get(&listenbrainz_token, DB_ADMIN_LISTENBRAINZ_TOKEN);
       if (ret == 0)
-	listenbrainz_disabled = false;
+	{
+	  listenbrainz_disabled = false;
+	  // Send the listens that were kept while the token was rejected
+	  worker_execute(queue_submit_cb, NULL, 0, 0);
+	}
     }
 
   return ret;
@@ -277,6 +420,7 @@ listenbrainz_token_delete(void)
       free(listenbrainz_token);
       listenbrainz_token = NULL;
       listenbrainz_disabled = true;
+      db_scrobbles_delete(DB_SCROBBLE_LISTENBRAINZ, INT64_MAX);
     }
 
   return ret;
@@ -321,7 +465,12 @@ listenbrainz_init(void)
   if (listenbrainz_disabled)
     {
       DPRINTF(E_DBG, L_SCROBBLE, "lbrainz: No valid ListenBrainz token\n");
+      return 0;
     }
 
+  // Submit what was queued when we last ran, if anything
+  listenbrainz_retry_scheduled = true;
+  worker_execute(queue_submit_cb, NULL, 0, LISTENBRAINZ_RETRY_DELAY_MIN);
+
   return 0;
 }
@@ -16,12 +16,30 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <event2/event.h>
 
+#include "conffile.h"
 #include "listener.h"
+#include "logger.h"
+#include "misc.h"
+#include "worker.h"
+
+// Events that aren't urgent, and that may come in bursts, e.g. during a library
+// scan. They are merged and delivered at most once per batch interval. The
+// first event after a quiet period is delivered right away.
+#define LISTENER_BATCH_EVENTS (LISTENER_DATABASE | LISTENER_UPDATE | LISTENER_STORED_PLAYLIST | LISTENER_RATING)
 
 struct listener
 {
@@ -33,6 +51,15 @@ struct listener
 
 struct listener *listener_list = NULL;
 
+static pthread_mutex_t listener_batch_lck = PTHREAD_MUTEX_INITIALIZER;
+// Batching is disabled if 0, and until listener_init() has been called
+static int listener_batch_interval_ms;
+static short listener_batch_events;
+static bool listener_batch_scheduled;
+static struct timespec listener_batch_last;
+// Only used by the worker thread
+static struct event *listener_batch_ev;
+
 int
 listener_add(notify notify_cb, short events, void *ctx)
 {
@@ -81,8 +108,8 @@ listener_remove(notify notify_cb)
   return 0;
 }
 
-void
-listener_notify(short event_mask)
+static void
+dispatch(short event_mask)
 {
   struct listener *listener;
 
@@ -94,3 +121,105 @@ listener_notify(short event_mask)
       listener = listener->next;
     }
 }
+
+static int
+ms_since(struct timespec *ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+/* Thread: worker */
+static void
+batch_cb(int fd, short what, void *arg)
+{
+  short event_mask;
+
+  event_free(listener_batch_ev);
+  listener_batch_ev = NULL;
+
+  pthread_mutex_lock(&listener_batch_lck);
+  event_mask = listener_batch_interval_ms ? listener_batch_events : 0;
+  listener_batch_events = 0;
+  listener_batch_scheduled = false;
+  clock_gettime(CLOCK_MONOTONIC, &listener_batch_last);
+  pthread_mutex_unlock(&listener_batch_lck);
+
+  if (event_mask)
+    dispatch(event_mask);
+}
+
+/* Thread: worker */
+static void
+batch_schedule(void *arg)
+{
+  int delay_ms = *(int *)arg;
+  struct timeval tv = { delay_ms / 1000, (delay_ms % 1000) * 1000 };
+
+  CHECK_NULL(L_MAIN, listener_batch_ev = evtimer_new(worker_evbase_get(), batch_cb, NULL));
+  evtimer_add(listener_batch_ev, &tv);
+}
+
+void
+listener_notify(short event_mask)
+{
+  short batched;
+  int elapsed_ms;
+  int delay_ms;
+
+  pthread_mutex_lock(&listener_batch_lck);
+  batched = listener_batch_interval_ms ? (event_mask & LISTENER_BATCH_EVENTS) : 0;
+  pthread_mutex_unlock(&listener_batch_lck);
+
+  if (event_mask & ~batched)
+    dispatch(event_mask & ~batched);
+
+  if (!batched)
+    return;
+
+  pthread_mutex_lock(&listener_batch_lck);
+  if (listener_batch_scheduled)
+    {
+      listener_batch_events |= batched;
+      pthread_mutex_unlock(&listener_batch_lck);
+      return;
+    }
+
+  elapsed_ms = ms_since(&listener_batch_last);
+  if (elapsed_ms >= listener_batch_interval_ms)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &listener_batch_last);
+      pthread_mutex_unlock(&listener_batch_lck);
+      dispatch(batched);
+      return;
+    }
+
+  listener_batch_events |= batched;
+  listener_batch_scheduled = true;
+  delay_ms = listener_batch_interval_ms - elapsed_ms;
+  pthread_mutex_unlock(&listener_batch_lck);
+
+  worker_execute_priority(batch_schedule, &delay_ms, sizeof(int), 0, WORKER_PRIORITY_HIGH);
+}
+
+void
+listener_init(void)
+{
+  pthread_mutex_lock(&listener_batch_lck);
+  listener_batch_interval_ms = cfg_getint(cfg_getsec(cfg, "general"), "notify_batch_ms");
+  if (listener_batch_interval_ms < 0)
+    listener_batch_interval_ms = 0;
+  pthread_mutex_unlock(&listener_batch_lck);
+}
+
+void
+listener_deinit(void)
+{
+  // A batch that is still scheduled will now not be delivered
+  pthread_mutex_lock(&listener_batch_lck);
+  listener_batch_interval_ms = 0;
+  pthread_mutex_unlock(&listener_batch_lck);
+}
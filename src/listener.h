@@ -65,4 +65,18 @@ listener_remove(notify notify_cb);
 void
 listener_notify(short event_mask);
 
+/*
+ * Enables batching of the non-urgent events (library changes and updates, see
+ * listener.c), which uses the worker thread, so it must be running. Until then
+ * all events are delivered right away.
+ */
+void
+listener_init(void);
+
+/*
+ * Disables batching, must be called before the worker thread is stopped
+ */
+void
+listener_deinit(void);
+
 #endif /* !__LISTENER_H__ */
@@ -25,10 +25,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <ctype.h> // for isprint()
 
@@ -40,6 +43,10 @@
 #include "misc.h"
 
 #define LOGGER_REPEAT_MAX 10
+// Number of messages the async log queue can hold, must be a power of 2
+#define LOGGER_QUEUE_SIZE 4096
+// Max time that the writer thread keeps messages before writing them
+#define LOGGER_FLUSH_INTERVAL_MS 250
 
 /* We need our own check to avoid nested locking or recursive calls */
 #define LOGGER_CHECK_ERR(f) \
@@ -51,8 +58,9 @@
 
 static pthread_mutex_t logger_lck;
 static int logger_initialized;
-static int logdomains;
-static int threshold;
+// Until logger_init() everything is logged
+int logger_threshold = E_SPAM;
+unsigned int logger_domain_mask = ~0U;
 static int console = 1;
 static uint32_t logger_repeat_counter;
 static uint32_t logger_last_hash;
@@ -61,6 +69,37 @@ static FILE *logfile;
 static char *labels[] = { "config", "daap", "db", "httpd", "http", "main", "mdns", "misc", "rsp", "scan", "xcode", "event", "remote", "dacp", "ffmpeg", "artwork", "player", "raop", "laudio", "dmap", "dbperf", "spotify", "scrobble", "cache", "mpd", "stream", "cast", "fifo", "lib", "web", "airplay", "rcp" };
 static char *severities[] = { "FATAL", "LOG", "WARN", "INFO", "DEBUG", "SPAM" };
 
+/*
+ * With the async logger (see logger_async_start) the threads that log just
+ * format the message and add it to a lock-free queue (Vyukov's bounded MPMC
+ * queue), and the writer thread writes the messages in batches. If the queue
+ * is full messages are dropped and counted. E_FATAL messages and hexdumps are
+ * written directly, after the messages that are queued.
+ */
+struct logger_msg
+{
+  char *line;
+  size_t prefix_len; // Length of the "[timestamp] [severity] ..." part of line
+  uint32_t hash; // Hash of the message for repeat_count()
+};
+
+struct logger_cell
+{
+  size_t seq;
+  struct logger_msg msg;
+};
+
+static struct logger_cell logger_queue[LOGGER_QUEUE_SIZE];
+static size_t logger_queue_head;
+static size_t logger_queue_tail;
+static uint32_t logger_dropped;
+static bool logger_async;
+static pthread_t tid_logger;
+static pthread_mutex_t logger_wait_lck;
+static pthread_cond_t logger_wait_cond;
+static bool logger_writer_sleeping;
+static bool logger_writer_exit;
+
 
 static int
 set_logdomains(char *domains)
@@ -69,7 +108,7 @@ set_logdomains(char *domains)
   char *d;
   int i;
 
-  logdomains = 0;
+  logger_domain_mask = 0;
 
   while ((d = strtok_r(domains, " ,", &ptr)))
     {
@@ -79,7 +118,7 @@ set_logdomains(char *domains)
 	{
 	  if (strcmp(d, labels[i]) == 0)
 	    {
-	      logdomains |= (1 << i);
+	      logger_domain_mask |= (1U << i);
 	      break;
 	    }
 	}
@@ -95,12 +134,8 @@ set_logdomains(char *domains)
 }
 
 static int
-repeat_count(const char *fmt)
+repeat_count(uint32_t hash)
 {
-  uint32_t hash;
-
-  hash = djb_hash(fmt, strlen(fmt));
-
   if (hash == logger_last_hash)
     logger_repeat_counter++;
   else
@@ -133,7 +168,16 @@ logger_write(const char *fmt, ...)
 }
 
 static void
-logger_write_with_label(int severity, int domain, const char *content)
+logger_write_buf(const char *buf, size_t len)
+{
+  if (logfile)
+    fwrite(buf, 1, len, logfile);
+  if (console)
+    fwrite(buf, 1, len, stderr);
+}
+
+static int
+label_make(char *buf, size_t len, int severity, int domain)
 {
   char stamp[32];
   char thread_nametid[32];
@@ -148,25 +192,50 @@ logger_write_with_label(int severity, int domain, const char *content)
   if (ret == 0)
     stamp[0] = '\0';
 
-  logger_write("[%s] [%5s] [%16s] %8s: %s", stamp, severities[severity], thread_nametid, labels[domain], content);
+  ret = snprintf(buf, len, "[%s] [%5s] [%16s] %8s: ", stamp, severities[severity], thread_nametid, labels[domain]);
+  if (ret < 0)
+    {
+      buf[0] = '\0';
+      return 0;
+    }
+
+  return (ret < len) ? ret : len - 1;
 }
 
 static void
-vlogger_writer(int severity, int domain, const char *fmt, va_list args)
+logger_write_with_label(int severity, int domain, const char *content)
+{
+  char label[128];
+
+  label_make(label, sizeof(label), severity, domain);
+
+  logger_write("%s%s", label, content);
+}
+
+static void
+content_make(char *content, size_t len, const char *fmt, va_list args)
 {
   va_list ap;
-  char content[2048];
   int ret;
 
   va_copy(ap, args);
-  ret = vsnprintf(content, sizeof(content), fmt, ap);
+  ret = vsnprintf(content, len, fmt, ap);
   if (ret < 0)
     strcpy(content, "(LOGGING SKIPPED - error printing log message)\n");
-  else if (ret >= sizeof(content))
-    strcpy(content + sizeof(content) - 8, "...\n");
+  else if (ret >= len)
+    strcpy(content + len - 8, "...\n");
   va_end(ap);
+}
 
-  ret = repeat_count(content);
+static void
+vlogger_writer(int severity, int domain, const char *fmt, va_list args)
+{
+  char content[2048];
+  int ret;
+
+  content_make(content, sizeof(content), fmt, args);
+
+  ret = repeat_count(djb_hash(content, strlen(content)));
   if (ret == LOGGER_REPEAT_MAX)
     strcpy(content, "(LOGGING SKIPPED - above log message is repeating)\n");
   else if (ret > LOGGER_REPEAT_MAX)
@@ -185,6 +254,222 @@ vlogger_fatal(const char *fmt, ...)
   va_end(ap);
 }
 
+
+/* ------------------------------ Async logger ------------------------------ */
+
+static bool
+queue_push(struct logger_msg *msg)
+{
+  struct logger_cell *cell;
+  size_t pos;
+  size_t seq;
+  intptr_t dif;
+
+  pos = __atomic_load_n(&logger_queue_head, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      cell = &logger_queue[pos & (LOGGER_QUEUE_SIZE - 1)];
+      seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+      dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0)
+	{
+	  if (__atomic_compare_exchange_n(&logger_queue_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if (dif < 0)
+	return false; // Full
+      else
+	pos = __atomic_load_n(&logger_queue_head, __ATOMIC_RELAXED);
+    }
+
+  cell->msg = *msg;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static bool
+queue_pop(struct logger_msg *msg)
+{
+  struct logger_cell *cell;
+  size_t pos;
+  size_t seq;
+  intptr_t dif;
+
+  pos = __atomic_load_n(&logger_queue_tail, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      cell = &logger_queue[pos & (LOGGER_QUEUE_SIZE - 1)];
+      seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+      dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0)
+	{
+	  if (__atomic_compare_exchange_n(&logger_queue_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if (dif < 0)
+	return false; // Empty
+      else
+	pos = __atomic_load_n(&logger_queue_tail, __ATOMIC_RELAXED);
+    }
+
+  *msg = cell->msg;
+  __atomic_store_n(&cell->seq, pos + LOGGER_QUEUE_SIZE, __ATOMIC_RELEASE);
+  return true;
+}
+
+static bool
+queue_is_empty(void)
+{
+  size_t pos = __atomic_load_n(&logger_queue_tail, __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&logger_queue[pos & (LOGGER_QUEUE_SIZE - 1)].seq, __ATOMIC_SEQ_CST) != pos + 1;
+}
+
+// Approximate, since producers may be adding messages at the same time
+static size_t
+queue_used(void)
+{
+  return __atomic_load_n(&logger_queue_head, __ATOMIC_RELAXED) - __atomic_load_n(&logger_queue_tail, __ATOMIC_RELAXED);
+}
+
+static void
+msg_write(struct logger_msg *msg)
+{
+  const char *skipped = "(LOGGING SKIPPED - above log message is repeating)\n";
+  int ret;
+
+  ret = repeat_count(msg->hash);
+  if (ret == LOGGER_REPEAT_MAX)
+    {
+      logger_write_buf(msg->line, msg->prefix_len);
+      logger_write_buf(skipped, strlen(skipped));
+    }
+  else if (ret < LOGGER_REPEAT_MAX)
+    logger_write_buf(msg->line, strlen(msg->line));
+
+  free(msg->line);
+}
+
+// Writes the queued messages, caller must have logger_lck
+static void
+queue_drain(void)
+{
+  struct logger_msg msg;
+  uint32_t dropped;
+  bool written = false;
+
+  while (queue_pop(&msg))
+    {
+      msg_write(&msg);
+      written = true;
+    }
+
+  dropped = __atomic_exchange_n(&logger_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0)
+    logger_write_with_label(E_LOG, L_MISC, "(LOGGING SKIPPED - log queue was full, dropped messages)\n");
+
+  if (written && logfile)
+    fflush(logfile);
+}
+
+static void
+vlogger_async(int severity, int domain, const char *fmt, va_list args)
+{
+  struct logger_msg msg;
+  char label[128];
+  char content[2048];
+  size_t content_len;
+
+  content_make(content, sizeof(content), fmt, args);
+  content_len = strlen(content);
+
+  msg.prefix_len = label_make(label, sizeof(label), severity, domain);
+  msg.hash = djb_hash(content, content_len);
+  msg.line = malloc(msg.prefix_len + content_len + 1);
+  if (!msg.line)
+    {
+      __atomic_add_fetch(&logger_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+  memcpy(msg.line, label, msg.prefix_len);
+  memcpy(msg.line + msg.prefix_len, content, content_len + 1);
+
+  if (!queue_push(&msg))
+    {
+      __atomic_add_fetch(&logger_dropped, 1, __ATOMIC_RELAXED);
+      free(msg.line);
+      return;
+    }
+
+  // Messages up to E_WARN are written right away, the rest in batches, unless
+  // the queue is filling up
+  if ((severity <= E_WARN || queue_used() > LOGGER_QUEUE_SIZE / 4) && __atomic_load_n(&logger_writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_wait_lck));
+      LOGGER_CHECK_ERR(pthread_cond_signal(&logger_wait_cond));
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_wait_lck));
+    }
+}
+
+static void *
+logger_writer(void *arg)
+{
+  struct timespec deadline;
+  bool exit = false;
+
+  thread_setname(pthread_self(), "logger");
+
+  while (!exit)
+    {
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+      queue_drain();
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOGGER_FLUSH_INTERVAL_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_wait_lck));
+      __atomic_store_n(&logger_writer_sleeping, true, __ATOMIC_SEQ_CST);
+      if (queue_is_empty() && !logger_writer_exit)
+	pthread_cond_timedwait(&logger_wait_cond, &logger_wait_lck, &deadline);
+      __atomic_store_n(&logger_writer_sleeping, false, __ATOMIC_SEQ_CST);
+      exit = logger_writer_exit;
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_wait_lck));
+    }
+
+  pthread_exit(NULL);
+}
+
+static void
+logger_async_stop(void)
+{
+  if (!logger_async)
+    return;
+
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_wait_lck));
+  logger_writer_exit = true;
+  LOGGER_CHECK_ERR(pthread_cond_signal(&logger_wait_cond));
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_wait_lck));
+
+  pthread_join(tid_logger, NULL);
+
+  __atomic_store_n(&logger_async, false, __ATOMIC_RELEASE);
+
+  // Anything logged by other threads since the writer's last drain
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+  queue_drain();
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+
+  pthread_cond_destroy(&logger_wait_cond);
+  pthread_mutex_destroy(&logger_wait_lck);
+}
+
+
+/* ------------------------------------------------------------------------- */
+
 static void
 vlogger(int severity, int domain, const char *fmt, va_list args)
 {
@@ -196,9 +481,16 @@ vlogger(int severity, int domain, const char *fmt, va_list args)
       return;
     }
 
-  if (!((1 << domain) & logdomains) || (severity > threshold))
+  if (!LOGGER_ENABLED(severity, domain))
     return;
 
+  if (severity != E_FATAL && __atomic_load_n(&logger_async, __ATOMIC_ACQUIRE))
+    {
+      if (logfile || console)
+	vlogger_async(severity, domain, fmt, args);
+      return;
+    }
+
   LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
 
   if (!logfile && !console)
@@ -207,6 +499,9 @@ vlogger(int severity, int domain, const char *fmt, va_list args)
       return;
     }
 
+  // Keeps the order if there are queued messages
+  queue_drain();
+
   vlogger_writer(severity, domain, fmt, args);
 
   LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
@@ -224,6 +519,9 @@ hexdump(int severity, int domain, const unsigned char *data, int len, const char
 
   LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
 
+  // Written directly, but after the queued messages
+  queue_drain();
+
   if (heading)
     logger_write_with_label(severity, domain, heading);
 
@@ -258,16 +556,12 @@ hexdump(int severity, int domain, const unsigned char *data, int len, const char
   LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
 }
 
+// DPRINTF checks the log configuration before calling this
 void
-DPRINTF(int severity, int domain, const char *fmt, ...)
+logger_printf(int severity, int domain, const char *fmt, ...)
 {
   va_list ap;
 
-  // If domain and severity do not match the current log configuration, return early to
-  // save some unnecessary code execution (tiny performance gain)
-  if (logger_initialized && (!((1 << domain) & logdomains) || (severity > threshold)))
-    return;
-
   va_start(ap, fmt);
   vlogger(severity, domain, fmt, ap);
   va_end(ap);
@@ -276,22 +570,16 @@ DPRINTF(int severity, int domain, const char *fmt, ...)
 void
 DVPRINTF(int severity, int domain, const char *fmt, va_list ap)
 {
-  // If domain and severity do not match the current log configuration, return early to
-  // safe some unnecessary code execution (tiny performance gain)
-  if (logger_initialized && (!((1 << domain) & logdomains) || (severity > threshold)))
+  if (!LOGGER_ENABLED(severity, domain))
     return;
 
   vlogger(severity, domain, fmt, ap);
 }
 
+// DHEXDUMP checks the log configuration before calling this
 void
-DHEXDUMP(int severity, int domain, const unsigned char *data, int data_len, const char *heading)
+logger_hexdump(int severity, int domain, const unsigned char *data, int data_len, const char *heading)
 {
-  // If domain and severity do not match the current log configuration, return early to
-  // save some unnecessary code execution (tiny performance gain)
-  if (logger_initialized && (!((1 << domain) & logdomains) || (severity > threshold)))
-    return;
-
   hexdump(severity, domain, data, data_len, heading);
 }
 
@@ -384,7 +672,7 @@ logger_reinit(void)
 int
 logger_severity(void)
 {
-  return threshold;
+  return logger_threshold;
 }
 
 /* The functions below are used at init time with a single thread running */
@@ -420,7 +708,7 @@ logger_init(char *file, char *domains, int severity)
     }
 
   console = 1;
-  threshold = severity;
+  logger_threshold = severity;
 
   if (domains)
     {
@@ -429,7 +717,7 @@ logger_init(char *file, char *domains, int severity)
 	return ret;
     }
   else
-    logdomains = ~0;
+    logger_domain_mask = ~0U;
 
   if (!file)
     return 0;
@@ -460,9 +748,44 @@ logger_init(char *file, char *domains, int severity)
   return 0;
 }
 
+int
+logger_async_start(void)
+{
+  int i;
+  int ret;
+
+  if (!logger_initialized || logger_async)
+    return 0;
+
+  for (i = 0; i < LOGGER_QUEUE_SIZE; i++)
+    logger_queue[i].seq = i;
+
+  logger_queue_head = 0;
+  logger_queue_tail = 0;
+  logger_writer_exit = false;
+
+  CHECK_ERR(L_MISC, mutex_init(&logger_wait_lck));
+  CHECK_ERR(L_MISC, pthread_cond_init(&logger_wait_cond, NULL));
+
+  ret = pthread_create(&tid_logger, NULL, logger_writer, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Could not spawn logger thread: %s\n", strerror(ret));
+      pthread_cond_destroy(&logger_wait_cond);
+      pthread_mutex_destroy(&logger_wait_lck);
+      return -1;
+    }
+
+  __atomic_store_n(&logger_async, true, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
 void
 logger_deinit(void)
 {
+  logger_async_stop();
+
   if (logfile)
     {
       fclose(logfile);
@@ -49,16 +49,39 @@
 #define E_DBG     4
 #define E_SPAM    5
 
+/* Building with --disable-spamlog compiles out E_SPAM messages */
+#ifdef LOGGER_WITHOUT_SPAM
+# define LOGGER_SEVERITY_MAX E_DBG
+#else
+# define LOGGER_SEVERITY_MAX E_SPAM
+#endif
+
+/* Current log configuration, only here for LOGGER_ENABLED, don't change */
+extern int logger_threshold;
+extern unsigned int logger_domain_mask;
+
+#define LOGGER_ENABLED(severity, domain) \
+  ((severity) <= LOGGER_SEVERITY_MAX && (severity) <= logger_threshold && ((1U << (domain)) & logger_domain_mask))
+
+/* DPRINTF and DHEXDUMP are macros so that nothing is formatted, and the
+ * arguments are not evaluated, if the message won't be logged.
+ */
+#define DPRINTF(severity, domain, ...) \
+  do { if (LOGGER_ENABLED(severity, domain)) logger_printf(severity, domain, __VA_ARGS__); } while (0)
+
+#define DHEXDUMP(severity, domain, data, data_len, heading) \
+  do { if (LOGGER_ENABLED(severity, domain)) logger_hexdump(severity, domain, data, data_len, heading); } while (0)
+
 
 
 void
-DPRINTF(int severity, int domain, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+logger_printf(int severity, int domain, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
 void
 DVPRINTF(int severity, int domain, const char *fmt, va_list ap);
 
 void
-DHEXDUMP(int severity, int domain, const unsigned char *data, int data_len, const char *heading);
+logger_hexdump(int severity, int domain, const unsigned char *data, int data_len, const char *heading);
 
 void
 logger_ffmpeg(void *ptr, int level, const char *fmt, va_list ap);
@@ -86,6 +109,13 @@ logger_detach(void);
 int
 logger_init(char *file, char *domains, int severity);
 
+/* Starts a thread that writes the log, so that threads that log don't wait for
+ * disk writes. Must be called after forking, since the thread doesn't survive
+ * that. The thread is stopped by logger_deinit().
+ */
+int
+logger_async_start(void);
+
 void
 logger_deinit(void);
 
@@ -63,12 +63,15 @@
 #include "misc.h"
 #include "cache.h"
 #include "httpd.h"
+#include "http.h"
 #include "mpd.h"
 #include "mdns.h"
 #include "remote_pairing.h"
 #include "player.h"
 #include "worker.h"
 #include "library.h"
+#include "listener.h"
+#include "trace.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -83,6 +86,26 @@ struct event_base *evbase_main;
 static struct event *sig_event;
 static int main_exit;
 
+#define STARTUP_STEPS_MAX 16
+
+struct startup_step
+{
+  const char *name;
+  int ms;
+};
+
+// Timeline of the init steps, logged when startup is complete
+static struct startup_step startup_steps[STARTUP_STEPS_MAX];
+static int startup_nsteps;
+static struct timespec startup_begin;
+
+struct db_init_arg
+{
+  char *sqlite_extension_path;
+  int ret;
+  int ms;
+};
+
 static void
 version(void)
 {
@@ -390,7 +413,10 @@ signal_signalfd_cb(int fd, short event, void *arg)
 	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
 
 	    if (!main_exit)
-	      logger_reinit();
+	      {
+		logger_reinit();
+		cache_stats_log();
+	      }
 	    break;
 	}
     }
@@ -435,7 +461,10 @@ signal_kqueue_cb(int fd, short event, void *arg)
 	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
 
 	    if (!main_exit)
-	      logger_reinit();
+	      {
+		logger_reinit();
+		cache_stats_log();
+	      }
 	    break;
 	}
     }
@@ -447,6 +476,66 @@ signal_kqueue_cb(int fd, short event, void *arg)
 }
 #endif
 
+static int
+ms_since(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void
+startup_step_record(const char *name, int ms)
+{
+  DPRINTF(E_DBG, L_MAIN, "Startup: %s init took %d ms\n", name, ms);
+
+  if (startup_nsteps >= STARTUP_STEPS_MAX)
+    return;
+
+  startup_steps[startup_nsteps].name = name;
+  startup_steps[startup_nsteps].ms = ms;
+  startup_nsteps++;
+}
+
+// Records the time since start and sets start to now, so that consecutive
+// steps can share the same timestamp
+static void
+startup_step_end(const char *name, struct timespec *start)
+{
+  startup_step_record(name, ms_since(start));
+  clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static void
+startup_timeline_log(void)
+{
+  char buf[512];
+  int len;
+  int i;
+
+  buf[0] = '\0';
+  for (i = 0, len = 0; i < startup_nsteps && len < sizeof(buf); i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s %d ms", (i > 0) ? ", " : "", startup_steps[i].name, startup_steps[i].ms);
+
+  DPRINTF(E_LOG, L_MAIN, "Startup completed in %d ms (%s)\n", ms_since(&startup_begin), buf);
+}
+
+// Thread: dbinit
+static void *
+db_init_thread(void *arg)
+{
+  struct db_init_arg *dbinit = arg;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  dbinit->ret = db_init(dbinit->sqlite_extension_path);
+  dbinit->ms = ms_since(&start);
+
+  return NULL;
+}
+
 #if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
 static int
 ffmpeg_lockmgr(void **pmutex, enum AVLockOp op)
@@ -504,6 +593,10 @@ main(int argc, char **argv)
   const char *gcry_version;
   sigset_t sigs;
   int sigfd;
+  struct db_init_arg dbinit;
+  pthread_t tid_dbinit;
+  bool dbinit_threaded;
+  struct timespec step_start;
 #ifdef HAVE_KQUEUE
   struct kevent ke_sigs[4];
 #endif
@@ -686,6 +779,7 @@ main(int argc, char **argv)
 
   /* Initialize libcurl */
   curl_global_init(CURL_GLOBAL_DEFAULT);
+  http_client_init();
 
   gcry_version = gcry_check_version(GCRYPT_VERSION);
   if (!gcry_version)
@@ -731,25 +825,54 @@ main(int argc, char **argv)
       goto daemon_fail;
     }
 
+  /* Log from a separate thread (after forking), if that fails we just log
+   * synchronously */
+  logger_async_start();
+
   /* Initialize event base (after forking) */
   CHECK_NULL(L_MAIN, evbase_main = event_base_new());
 
   CHECK_ERR(L_MAIN, evthread_use_pthreads());
 
+  clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+  step_start = startup_begin;
+
+  /* Initialize the database before starting. This may include a schema upgrade
+   * or an integrity check, so it runs in a thread of its own while mDNS, which
+   * doesn't use the database, is initialized.
+   */
+  DPRINTF(E_INFO, L_MAIN, "Initializing database\n");
+  dbinit.sqlite_extension_path = sqlite_extension_path;
+  dbinit_threaded = (pthread_create(&tid_dbinit, NULL, db_init_thread, &dbinit) == 0);
+  if (dbinit_threaded)
+    thread_setname(tid_dbinit, "dbinit");
+  else
+    db_init_thread(&dbinit);
+
   DPRINTF(E_LOG, L_MAIN, "mDNS init\n");
   ret = mdns_init();
+  startup_step_end("mdns", &step_start);
+
+  if (dbinit_threaded)
+    {
+      CHECK_ERR(L_MAIN, pthread_join(tid_dbinit, NULL));
+      clock_gettime(CLOCK_MONOTONIC, &step_start);
+    }
+
+  startup_step_record("db", dbinit.ms);
+
   if (ret != 0)
     {
       DPRINTF(E_FATAL, L_MAIN, "mDNS init failed\n");
 
+      if (dbinit.ret == 0)
+	db_deinit();
+
       ret = EXIT_FAILURE;
       goto mdns_fail;
     }
 
-  /* Initialize the database before starting */
-  DPRINTF(E_INFO, L_MAIN, "Initializing database\n");
-  ret = db_init(sqlite_extension_path);
-  if (ret < 0)
+  if (dbinit.ret < 0)
     {
       DPRINTF(E_FATAL, L_MAIN, "Database init failed\n");
 
@@ -777,6 +900,9 @@ main(int argc, char **argv)
       goto worker_fail;
     }
 
+  listener_init();
+  startup_step_end("worker", &step_start);
+
   /* Spawn cache thread */
   ret = cache_init();
   if (ret != 0)
@@ -787,6 +913,8 @@ main(int argc, char **argv)
       goto cache_fail;
     }
 
+  startup_step_end("cache", &step_start);
+
   /* Spawn library scan thread */
   ret = library_init();
   if (ret != 0)
@@ -797,6 +925,8 @@ main(int argc, char **argv)
       goto library_fail;
     }
 
+  startup_step_end("library", &step_start);
+
   /* Spawn player thread */
   ret = player_init();
   if (ret != 0)
@@ -807,6 +937,8 @@ main(int argc, char **argv)
       goto player_fail;
     }
 
+  startup_step_end("player", &step_start);
+
   /* Spawn HTTPd thread */
   ret = httpd_init(webroot);
   if (ret != 0)
@@ -817,6 +949,8 @@ main(int argc, char **argv)
       goto httpd_fail;
     }
 
+  startup_step_end("httpd", &step_start);
+
 #ifdef MPD
   /* Spawn MPD thread */
   ret = mpd_init();
@@ -827,6 +961,8 @@ main(int argc, char **argv)
       ret = EXIT_FAILURE;
       goto mpd_fail;
     }
+
+  startup_step_end("mpd", &step_start);
 #else
   mdns_no_mpd = true;
 #endif
@@ -854,6 +990,8 @@ main(int argc, char **argv)
       goto mdns_reg_fail;
     }
 
+  startup_step_end("services", &step_start);
+
   /* Register this CNAME with mDNS for OAuth */
   if (!mdns_no_cname)
     {
@@ -908,6 +1046,14 @@ main(int argc, char **argv)
 
   event_add(sig_event, NULL);
 
+  /* The initial library scan includes logging in to online sources like
+   * Spotify, so it is held back until the servers above are up, then it runs
+   * in the library thread while we serve requests.
+   */
+  library_initscan_start();
+
+  startup_timeline_log();
+
   /* Run the loop */
   if (!testrun)
     event_base_dispatch(evbase_main);
@@ -953,6 +1099,8 @@ main(int argc, char **argv)
   cache_deinit();
 
  cache_fail:
+  listener_deinit();
+
   DPRINTF(E_LOG, L_MAIN, "Worker deinit\n");
   worker_deinit();
 
@@ -987,6 +1135,7 @@ main(int argc, char **argv)
 
  signal_block_fail:
  gcrypt_init_fail:
+  http_client_deinit();
   curl_global_cleanup();
 #if HAVE_DECL_AVFORMAT_NETWORK_INIT
   avformat_network_deinit();
@@ -997,6 +1146,8 @@ main(int argc, char **argv)
  ffmpeg_init_fail:
 #endif
 
+  trace_deinit();
+
   DPRINTF(E_LOG, L_MAIN, "Exiting.\n");
   conffile_unload();
   logger_deinit();
@@ -27,8 +27,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -62,6 +64,16 @@
 // Seconds to wait before timing out when making device connection test
 #define MDNS_CONNECT_TEST_TIMEOUT 2
 
+// Resolvers call back every time a service re-announces itself, which some
+// devices do all the time. If nothing changed since we last reported the
+// service within this number of seconds, we don't report it again.
+#define MDNS_SERVICE_TTL 120
+// Seconds a service must stay removed before we report the removal, so that
+// devices that drop off and reappear don't flap in the speaker list
+#define MDNS_REMOVE_DEBOUNCE 5
+// Updates are collected and reported together after this delay (in ms)
+#define MDNS_FLUSH_DELAY_MS 250
+
 /* Main event base, from main.c */
 extern struct event_base *evbase_main;
 
@@ -363,9 +375,39 @@ struct mdns_record_browser {
   char *domain;
   struct keyval *txt_kv;
 
+  AvahiProtocol proto;
   int port;
 };
 
+// Cache of services we have resolved, also holds updates waiting to be passed
+// to the browser callback
+struct mdns_service
+{
+  struct mdns_browser *mb;
+  char *name;
+  char *domain;
+  AvahiProtocol proto;
+
+  // Hash of the last resolver result, and when we last reported the service
+  uint64_t hash;
+  time_t reported;
+  // True if the browser callback has been called with an address
+  bool present;
+
+  // Update for next flush, either a removal or the below address data
+  bool pending;
+  bool removed;
+  time_t removed_at;
+
+  char *hostname;
+  char *address;
+  int family;
+  int port;
+  struct keyval *txt;
+
+  struct mdns_service *next;
+};
+
 struct mdns_resolver
 {
   char *name;
@@ -395,6 +437,8 @@ struct mdns_group_entry
 static struct mdns_browser *browser_list;
 static struct mdns_resolver *resolver_list;
 static struct mdns_group_entry *group_entries;
+static struct mdns_service *service_list;
+static struct event *service_flush_ev;
 
 #define IPV4LL_NETWORK 0xA9FE0000
 #define IPV4LL_NETMASK 0xFFFF0000
@@ -575,6 +619,230 @@ browser_remove_all(struct mdns_browser **head)
     }
 }
 
+
+/* -------------------------------- Service cache --------------------------- */
+
+static void
+service_pending_clear(struct mdns_service *s)
+{
+  free(s->hostname);
+  free(s->address);
+  keyval_clear(s->txt);
+  free(s->txt);
+
+  s->hostname = NULL;
+  s->address = NULL;
+  s->txt = NULL;
+  s->pending = false;
+}
+
+static void
+service_free(struct mdns_service *s)
+{
+  service_pending_clear(s);
+  free(s->name);
+  free(s->domain);
+  free(s);
+}
+
+static void
+service_remove_all(struct mdns_service **head)
+{
+  struct mdns_service *s;
+
+  for (s = *head; *head; s = *head)
+    {
+      *head = s->next;
+      service_free(s);
+    }
+}
+
+static struct mdns_service *
+service_get(struct mdns_browser *mb, const char *name, const char *domain, AvahiProtocol proto, bool create)
+{
+  struct mdns_service *s;
+
+  for (s = service_list; s; s = s->next)
+    {
+      if (s->mb == mb && s->proto == proto && strcmp(s->name, name) == 0)
+	return s;
+    }
+
+  if (!create)
+    return NULL;
+
+  CHECK_NULL(L_MDNS, s = calloc(1, sizeof(struct mdns_service)));
+  CHECK_NULL(L_MDNS, s->name = strdup(name));
+  CHECK_NULL(L_MDNS, s->domain = strdup(domain));
+  s->mb = mb;
+  s->proto = proto;
+
+  s->next = service_list;
+  service_list = s;
+
+  return s;
+}
+
+static uint64_t
+service_hash(const char *hostname, const char *address, int port, struct keyval *txt)
+{
+  struct onekeyval *okv;
+  uint64_t hash;
+
+  hash = murmur_hash64(hostname, strlen(hostname), port);
+  hash = murmur_hash64(address, strlen(address), hash);
+  for (okv = txt->head; okv; okv = okv->next)
+    {
+      hash = murmur_hash64(okv->name, strlen(okv->name), hash);
+      hash = murmur_hash64(okv->value, strlen(okv->value), hash);
+    }
+
+  return hash;
+}
+
+static void
+service_flush_schedule(int delay_ms)
+{
+  struct timeval tv = { delay_ms / 1000, (delay_ms % 1000) * 1000 };
+
+  if (!service_flush_ev || evtimer_pending(service_flush_ev, NULL))
+    return;
+
+  evtimer_add(service_flush_ev, &tv);
+}
+
+// Passes all pending updates to the browser callbacks in one go
+static void
+service_flush_cb(int fd, short what, void *arg)
+{
+  struct mdns_service *s;
+  struct mdns_service **prev;
+  time_t now;
+  int family;
+  bool waiting = false;
+
+  now = time(NULL);
+
+  for (prev = &service_list, s = service_list; s; s = *prev)
+    {
+      if (!s->pending)
+	{
+	  prev = &s->next;
+	  continue;
+	}
+
+      if (s->removed)
+	{
+	  if (now - s->removed_at < MDNS_REMOVE_DEBOUNCE)
+	    {
+	      waiting = true;
+	      prev = &s->next;
+	      continue;
+	    }
+
+	  DPRINTF(E_DBG, L_MDNS, "Service '%s' type '%s' proto %d is gone, reporting removal\n", s->name, s->mb->type, s->proto);
+
+	  family = avahi_proto_to_af(s->proto);
+	  if (s->present && family != AF_UNSPEC)
+	    s->mb->cb(s->name, s->mb->type, s->domain, NULL, family, NULL, -1, NULL);
+
+	  *prev = s->next;
+	  service_free(s);
+	  continue;
+	}
+
+      s->mb->cb(s->name, s->mb->type, s->domain, s->hostname, s->family, s->address, s->port, s->txt);
+
+      s->present = true;
+      s->reported = now;
+      service_pending_clear(s);
+      prev = &s->next;
+    }
+
+  if (waiting)
+    service_flush_schedule(1000);
+}
+
+// Queues a service with an address for the next flush, replacing any update
+// already waiting
+static void
+service_update(struct mdns_browser *mb, const char *name, const char *domain, AvahiProtocol proto,
+               const char *hostname, int family, const char *address, int port, struct keyval *txt)
+{
+  struct mdns_service *s;
+  struct onekeyval *okv;
+
+  s = service_get(mb, name, domain, proto, true);
+
+  service_pending_clear(s);
+
+  CHECK_NULL(L_MDNS, s->hostname = strdup(hostname));
+  CHECK_NULL(L_MDNS, s->address = strdup(address));
+  CHECK_NULL(L_MDNS, s->txt = keyval_alloc());
+  for (okv = txt->head; okv; okv = okv->next)
+    keyval_add(s->txt, okv->name, okv->value);
+
+  s->family = family;
+  s->port = port;
+  s->removed = false;
+  s->pending = true;
+
+  service_flush_schedule(MDNS_FLUSH_DELAY_MS);
+}
+
+// The removal is only reported if the service doesn't come back within
+// MDNS_REMOVE_DEBOUNCE
+static void
+service_remove(struct mdns_browser *mb, const char *name, AvahiProtocol proto)
+{
+  struct mdns_service *s;
+
+  s = service_get(mb, name, NULL, proto, false);
+  if (!s || s->removed)
+    return;
+
+  service_pending_clear(s);
+
+  s->removed = true;
+  s->removed_at = time(NULL);
+  s->pending = true;
+
+  service_flush_schedule(MDNS_FLUSH_DELAY_MS);
+}
+
+// Returns true if the resolver gave us the same as last time, in which case
+// there is no reason to check the address and report it again
+static bool
+service_is_unchanged(struct mdns_browser *mb, const char *name, const char *domain, AvahiProtocol proto,
+                     const char *hostname, const char *address, int port, struct keyval *txt)
+{
+  struct mdns_service *s;
+  uint64_t hash;
+
+  hash = service_hash(hostname, address, port, txt);
+
+  s = service_get(mb, name, domain, proto, true);
+  if (s->hash != hash)
+    {
+      s->hash = hash;
+      return false;
+    }
+
+  if (s->removed)
+    {
+      if (!s->present)
+	return false;
+
+      // Back before we reported the removal, so nothing to report at all
+      DPRINTF(E_DBG, L_MDNS, "Service '%s' type '%s' proto %d is back, cancelling removal\n", name, mb->type, proto);
+      s->removed = false;
+      s->pending = false;
+      return true;
+    }
+
+  return (s->pending || time(NULL) - s->reported < MDNS_SERVICE_TTL);
+}
+
 static int
 connection_test(int family, const char *address, const char *address_log, int port)
 {
@@ -760,9 +1028,9 @@ browse_record_callback(AvahiRecordBrowser *b, AvahiIfIndex intf, AvahiProtocol p
   if (ret < 0)
     return;
 
-  // Execute callback (mb->cb) with all the data
+  // Queue callback (mb->cb) with all the data
   family = avahi_proto_to_af(addr.proto);
-  rb_data->mb->cb(rb_data->name, rb_data->mb->type, rb_data->domain, hostname, family, address, rb_data->port, rb_data->txt_kv);
+  service_update(rb_data->mb, rb_data->name, rb_data->domain, rb_data->proto, hostname, family, address, rb_data->port, rb_data->txt_kv);
 
   // Stop record browser, we found an address (or there was an error)
  out_free_record_browser:
@@ -806,9 +1074,7 @@ browse_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex intf, AvahiProtoco
       else
 	DPRINTF(E_LOG, L_MDNS, "Avahi Resolver empty callback\n");
 
-      family = avahi_proto_to_af(proto);
-      if (family != AF_UNSPEC)
-	mb->cb(name, type, domain, NULL, family, NULL, -1, NULL);
+      service_remove(mb, name, proto);
 
       // We don't clean up resolvers because we want a notification from them if
       // the service reappears (e.g. if device was switched off and then on)
@@ -840,6 +1106,14 @@ browse_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex intf, AvahiProtoco
       avahi_free(key);
     }
 
+  if (service_is_unchanged(mb, name, domain, proto, hostname, address, port, txt_kv))
+    {
+      DPRINTF(E_SPAM, L_MDNS, "Avahi Resolver: service '%s' type '%s' proto %d is unchanged\n", name, type, proto);
+      keyval_clear(txt_kv);
+      free(txt_kv);
+      return;
+    }
+
   // We need to implement a record browser because the announcement from some
   // devices (e.g. ApEx 1 gen) will include multiple records, and we need to
   // filter out those records that won't work (notably link-local). The value of
@@ -852,6 +1126,7 @@ browse_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex intf, AvahiProtoco
       rb_data->name = strdup(name);
       rb_data->domain = strdup(domain);
       rb_data->mb = mb;
+      rb_data->proto = proto;
       rb_data->port = port;
       rb_data->txt_kv = txt_kv;
 
@@ -873,8 +1148,8 @@ browse_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex intf, AvahiProtoco
 
   family = avahi_proto_to_af(addr->proto);
 
-  // Execute callback (mb->cb) with all the data
-  mb->cb(name, mb->type, domain, hostname, family, address, port, txt_kv);
+  // Queue callback (mb->cb) with all the data
+  service_update(mb, name, domain, proto, hostname, family, address, port, txt_kv);
 
   keyval_clear(txt_kv);
   free(txt_kv);
@@ -913,9 +1188,7 @@ browse_callback(AvahiServiceBrowser *b, AvahiIfIndex intf, AvahiProtocol proto,
       case AVAHI_BROWSER_REMOVE:
 	DPRINTF(E_DBG, L_MDNS, "Avahi Browser: REMOVE service '%s' type '%s' proto %d\n", name, type, proto);
 
-	family = avahi_proto_to_af(proto);
-	if (family != AF_UNSPEC)
-	  mb->cb(name, type, domain, NULL, family, NULL, -1, NULL);
+	service_remove(mb, name, proto);
 
 	resolver_remove(&resolver_list, name, proto);
 
@@ -1161,6 +1434,8 @@ mdns_init(void)
       mdns_interface = interface_index_get(cfgaddr);
     }
 
+  CHECK_NULL(L_MDNS, service_flush_ev = evtimer_new(evbase_main, service_flush_cb, NULL));
+
   mdns_client = avahi_client_new(&ev_poll_api, AVAHI_CLIENT_NO_FAIL, client_callback, NULL, &error);
   if (!mdns_client)
     {
@@ -1177,6 +1452,11 @@ mdns_deinit(void)
   group_entry_remove_all(&group_entries);
   browser_remove_all(&browser_list);
   resolver_remove_all(&resolver_list);
+  service_remove_all(&service_list);
+
+  if (service_flush_ev)
+    event_free(service_flush_ev);
+  service_flush_ev = NULL;
 
   if (mdns_client)
     avahi_client_free(mdns_client); // Also frees all_w and all_t
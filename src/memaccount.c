@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Memory accounting by subsystem (see mem_tag_set() in misc.h), only built with
+ * --enable-memaccounting. Replaces the allocator functions, which glibc allows,
+ * and puts a small header before each allocation with its size and the tag it
+ * was counted towards, so that free() can subtract it again. The allocation
+ * itself is still done by glibc. The overhead is the header and two atomic
+ * additions per allocation and free, so this is for diagnosing, not for
+ * normal use.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "misc.h"
+
+// __GLIBC__ is defined by the includes above
+#if defined(MEM_ACCOUNTING) && defined(__GLIBC__)
+
+// Must keep the alignment that malloc guarantees
+#define MEMACCOUNT_HDR_SIZE 16
+
+struct memaccount_hdr
+{
+  size_t size;
+  uint32_t tag;
+  uint32_t offset; // From the start of the glibc allocation to the user pointer
+};
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static inline struct memaccount_hdr *
+hdr_get(void *ptr)
+{
+  return (struct memaccount_hdr *)((char *)ptr - MEMACCOUNT_HDR_SIZE);
+}
+
+static inline void *
+hdr_set(void *mem, size_t offset, size_t size)
+{
+  struct memaccount_hdr *hdr;
+  void *ptr;
+  enum mem_tag tag;
+
+  ptr = (char *)mem + offset;
+  tag = mem_tag_get();
+
+  hdr = hdr_get(ptr);
+  hdr->size = size;
+  hdr->tag = tag;
+  hdr->offset = offset;
+
+  mem_tag_account(tag, size);
+
+  return ptr;
+}
+
+void *
+malloc(size_t size)
+{
+  void *mem;
+
+  if (size > SIZE_MAX - MEMACCOUNT_HDR_SIZE)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  mem = __libc_malloc(size + MEMACCOUNT_HDR_SIZE);
+  if (!mem)
+    return NULL;
+
+  return hdr_set(mem, MEMACCOUNT_HDR_SIZE, size);
+}
+
+void
+free(void *ptr)
+{
+  struct memaccount_hdr *hdr;
+
+  if (!ptr)
+    return;
+
+  hdr = hdr_get(ptr);
+  mem_tag_account(hdr->tag, -(int64_t)hdr->size);
+
+  __libc_free((char *)ptr - hdr->offset);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  void *mem;
+  size_t total;
+
+  if (__builtin_mul_overflow(nmemb, size, &total) || total > SIZE_MAX - MEMACCOUNT_HDR_SIZE)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  mem = __libc_calloc(1, total + MEMACCOUNT_HDR_SIZE);
+  if (!mem)
+    return NULL;
+
+  return hdr_set(mem, MEMACCOUNT_HDR_SIZE, total);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  struct memaccount_hdr *hdr;
+  void *mem;
+  void *new;
+
+  if (!ptr)
+    return malloc(size);
+
+  if (size == 0)
+    {
+      free(ptr);
+      return NULL;
+    }
+
+  hdr = hdr_get(ptr);
+
+  // Aligned allocations have their user pointer further in, so they can't be
+  // passed to glibc's realloc
+  if (hdr->offset != MEMACCOUNT_HDR_SIZE)
+    {
+      new = malloc(size);
+      if (!new)
+	return NULL;
+
+      memcpy(new, ptr, (hdr->size < size) ? hdr->size : size);
+      free(ptr);
+      return new;
+    }
+
+  if (size > SIZE_MAX - MEMACCOUNT_HDR_SIZE)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  mem_tag_account(hdr->tag, -(int64_t)hdr->size);
+
+  mem = __libc_realloc((char *)ptr - MEMACCOUNT_HDR_SIZE, size + MEMACCOUNT_HDR_SIZE);
+  if (!mem)
+    {
+      // The old allocation is still valid
+      mem_tag_account(hdr->tag, hdr->size);
+      return NULL;
+    }
+
+  return hdr_set(mem, MEMACCOUNT_HDR_SIZE, size);
+}
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+  size_t total;
+
+  if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  return realloc(ptr, total);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+  void *mem;
+
+  if (alignment <= MEMACCOUNT_HDR_SIZE)
+    return malloc(size);
+
+  if ((alignment & (alignment - 1)) != 0 || alignment > UINT32_MAX)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  if (size > SIZE_MAX - alignment)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  // The header goes in the end of the first alignment block
+  mem = __libc_memalign(alignment, size + alignment);
+  if (!mem)
+    return NULL;
+
+  return hdr_set(mem, alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if ((alignment % sizeof(void *)) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  ptr = memalign(alignment, size);
+  if (!ptr)
+    return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+void *
+valloc(size_t size)
+{
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *
+pvalloc(size_t size)
+{
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+
+  return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t
+malloc_usable_size(void *ptr)
+{
+  return ptr ? hdr_get(ptr)->size : 0;
+}
+
+#endif /* MEM_ACCOUNTING && __GLIBC__ */
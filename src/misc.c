@@ -38,6 +38,12 @@
 #include <limits.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#ifdef __linux__
+# include <sys/resource.h>
+# include <sys/syscall.h>
+# include <sched.h>
+#endif
+#include <sys/mman.h>
 #ifndef CLOCK_REALTIME
 #include <sys/time.h>
 #endif
@@ -58,6 +64,10 @@
 #include <unistr.h>
 #include <uniconv.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include <libavutil/base64.h>
 
 #include "logger.h"
@@ -915,19 +925,61 @@ safe_snreplace(char *s, size_t sz, const char *pattern, const char *replacement)
 }
 
 
+// Returns the length of the initial part of str that is ASCII. Most tags and
+// names are plain ASCII, and checking that 16 (or 8) bytes at a time is much
+// faster than the full UTF-8 validation.
+static size_t
+ascii_prefix_len(const char *str, size_t len)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  int mask;
+
+  for (; i + 16 <= len; i += 16)
+    {
+      mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + i)));
+      if (mask)
+	return i + __builtin_ctz(mask);
+    }
+#else
+  uint64_t word;
+
+  for (; i + 8 <= len; i += 8)
+    {
+      memcpy(&word, str + i, sizeof(word));
+      if (word & 0x8080808080808080ULL)
+	break;
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      if ((unsigned char)str[i] & 0x80)
+	break;
+    }
+
+  return i;
+}
+
 char *
 unicode_fixup_string(char *str, const char *fromcode)
 {
   uint8_t *ret;
   size_t len;
+  size_t ascii_len;
 
   if (!str)
     return NULL;
 
   len = strlen(str);
 
-  /* String is valid UTF-8 */
-  if (!u8_check((uint8_t *)str, len))
+  /* Plain ASCII is valid UTF-8 and can't have a byte-order mark */
+  ascii_len = ascii_prefix_len(str, len);
+  if (ascii_len == len)
+    return str;
+
+  /* String is valid UTF-8, no need to check the ASCII part */
+  if (!u8_check((uint8_t *)str + ascii_len, len - ascii_len))
     {
       if (len >= 3)
 	{
@@ -1239,6 +1291,97 @@ murmur_hash64(const void *key, int len, uint32_t seed)
 
 /* --------------------------- Key/value functions -------------------------- */
 
+// Below this many items a linear search is as fast as a lookup in the index
+#define KEYVAL_INDEX_MIN 8
+
+// Case insensitive, since names are compared with strcasecmp
+static uint32_t
+keyval_hash(const char *name)
+{
+  uint32_t hash = 2166136261u; // FNV-1a
+
+  for (; *name; name++)
+    {
+      hash ^= (unsigned char)tolower((unsigned char)*name);
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+static void
+keyval_index_insert(struct keyval *kv, struct onekeyval *okv)
+{
+  unsigned int mask = kv->index_size - 1;
+  unsigned int i;
+
+  for (i = keyval_hash(okv->name) & mask; kv->index[i]; i = (i + 1) & mask)
+    ; // Names are unique, so no need to compare
+
+  kv->index[i] = okv;
+}
+
+// Makes a new index that is at least twice the size of the list, so the load
+// factor stays below 0.5. On allocation failure we just keep the old index,
+// or do linear searches if there is none.
+static void
+keyval_index_rebuild(struct keyval *kv)
+{
+  struct onekeyval **index;
+  struct onekeyval *okv;
+  unsigned int size;
+
+  for (size = 16; size < 2 * kv->count; size *= 2)
+    ;
+
+  index = calloc(size, sizeof(struct onekeyval *));
+  if (!index)
+    return;
+
+  free(kv->index);
+  kv->index = index;
+  kv->index_size = size;
+
+  for (okv = kv->head; okv; okv = okv->next)
+    keyval_index_insert(kv, okv);
+}
+
+static void
+keyval_index_free(struct keyval *kv)
+{
+  free(kv->index);
+  kv->index = NULL;
+  kv->index_size = 0;
+}
+
+static struct onekeyval *
+keyval_find(struct keyval *kv, const char *name)
+{
+  struct onekeyval *okv;
+  unsigned int mask;
+  unsigned int i;
+
+  if (!kv->index)
+    {
+      for (okv = kv->head; okv; okv = okv->next)
+	{
+	  if (strcasecmp(okv->name, name) == 0)
+	    return okv;
+	}
+
+      return NULL;
+    }
+
+  mask = kv->index_size - 1;
+  for (i = keyval_hash(name) & mask; (okv = kv->index[i]); i = (i + 1) & mask)
+    {
+      if (strcasecmp(okv->name, name) == 0)
+	return okv;
+    }
+
+  return NULL;
+}
+
 struct keyval *
 keyval_alloc(void)
 {
@@ -1269,7 +1412,7 @@ keyval_add_size(struct keyval *kv, const char *name, const char *value, size_t s
   if (val)
     {
       /* Same value, fine */
-      if (strcmp(val, value) == 0)
+      if (strncmp(val, value, size) == 0 && val[size] == '\0')
         return 0;
       else /* Different value, bad */
         return -1;
@@ -1314,6 +1457,12 @@ keyval_add_size(struct keyval *kv, const char *name, const char *value, size_t s
     kv->tail->next = okv;
 
   kv->tail = okv;
+  kv->count++;
+
+  if (kv->index && 2 * kv->count <= kv->index_size)
+    keyval_index_insert(kv, okv);
+  else if (kv->count >= KEYVAL_INDEX_MIN)
+    keyval_index_rebuild(kv);
 
   return 0;
 }
@@ -1351,6 +1500,16 @@ keyval_remove(struct keyval *kv, const char *name)
   if (pokv)
     pokv->next = okv->next;
 
+  kv->count--;
+
+  // Removals are rare, so instead of deleting from the index we remake it
+  if (kv->index)
+    {
+      keyval_index_free(kv);
+      if (kv->count >= KEYVAL_INDEX_MIN)
+	keyval_index_rebuild(kv);
+    }
+
   free(okv->name);
   free(okv->value);
   free(okv);
@@ -1364,13 +1523,9 @@ keyval_get(struct keyval *kv, const char *name)
   if (!kv)
     return NULL;
 
-  for (okv = kv->head; okv; okv = okv->next)
-    {
-      if (strcasecmp(okv->name, name) == 0)
-        return okv->value;
-    }
+  okv = keyval_find(kv, name);
 
-  return NULL;
+  return okv ? okv->value : NULL;
 }
 
 void
@@ -1395,6 +1550,9 @@ keyval_clear(struct keyval *kv)
 
   kv->head = NULL;
   kv->tail = NULL;
+  kv->count = 0;
+
+  keyval_index_free(kv);
 }
 
 void
@@ -1523,6 +1681,177 @@ ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf)
 }
 
 
+/* -------------------------------- Histogram ------------------------------- */
+
+void
+histogram_add(struct histogram *h, uint64_t value)
+{
+  int bucket;
+
+  bucket = value ? 64 - __builtin_clzll(value) : 0;
+  if (bucket >= HISTOGRAM_BUCKETS)
+    bucket = HISTOGRAM_BUCKETS - 1;
+
+  h->count[bucket]++;
+  if (value > h->max)
+    h->max = value;
+}
+
+
+/* --------------------------- Memory accounting ---------------------------- */
+
+struct mem_tag_counters
+{
+  int64_t current_bytes;
+  int64_t peak_bytes;
+  uint64_t allocations;
+};
+
+static struct mem_tag_counters mem_tag_counters[MEM_TAG_MAX];
+static __thread enum mem_tag mem_tag_current;
+
+enum mem_tag
+mem_tag_set(enum mem_tag tag)
+{
+  enum mem_tag prev = mem_tag_current;
+
+  mem_tag_current = tag;
+  return prev;
+}
+
+void
+mem_tag_restore(enum mem_tag *prev)
+{
+  mem_tag_current = *prev;
+}
+
+enum mem_tag
+mem_tag_get(void)
+{
+  return mem_tag_current;
+}
+
+// Called from the allocator, so must not allocate or log
+void
+mem_tag_account(enum mem_tag tag, int64_t bytes)
+{
+  struct mem_tag_counters *c = &mem_tag_counters[tag];
+  int64_t current;
+  int64_t peak;
+
+  current = __atomic_add_fetch(&c->current_bytes, bytes, __ATOMIC_RELAXED);
+  if (bytes <= 0)
+    return;
+
+  __atomic_add_fetch(&c->allocations, 1, __ATOMIC_RELAXED);
+
+  peak = __atomic_load_n(&c->peak_bytes, __ATOMIC_RELAXED);
+  while (current > peak && !__atomic_compare_exchange_n(&c->peak_bytes, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ; // peak was updated by the failed exchange
+}
+
+int
+mem_tag_stats_get(struct mem_tag_stats *stats, int max)
+{
+#ifdef MEM_ACCOUNTING
+  static const char *mem_tag_names[MEM_TAG_MAX] = { "other", "db", "httpd", "json", "outputs", "xcode", "artwork", "cache" };
+  int i;
+
+  for (i = 0; i < MEM_TAG_MAX && i < max; i++)
+    {
+      stats[i].name = mem_tag_names[i];
+      stats[i].current_bytes = __atomic_load_n(&mem_tag_counters[i].current_bytes, __ATOMIC_RELAXED);
+      stats[i].peak_bytes = __atomic_load_n(&mem_tag_counters[i].peak_bytes, __ATOMIC_RELAXED);
+      stats[i].allocations = __atomic_load_n(&mem_tag_counters[i].allocations, __ATOMIC_RELAXED);
+    }
+
+  return i;
+#else
+  return 0;
+#endif
+}
+
+
+/* -------------------------------- LRU cache ------------------------------- */
+
+void *
+lru_cache_get(struct lru_cache *cache, const char *key)
+{
+  struct lru_cache_entry *entry;
+  void *value = NULL;
+  int i;
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&cache->lock));
+
+  for (i = 0; i < LRU_CACHE_SIZE; i++)
+    {
+      entry = &cache->entries[i];
+      if (entry->key && strcmp(entry->key, key) == 0)
+	{
+	  entry->last_used = ++cache->clock;
+	  value = cache->dup(entry->value);
+	  break;
+	}
+    }
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&cache->lock));
+
+  return value;
+}
+
+void
+lru_cache_add(struct lru_cache *cache, const char *key, const void *value)
+{
+  struct lru_cache_entry *entry;
+  char *key_copy;
+  void *value_copy;
+  int i;
+
+  key_copy = strdup(key);
+  value_copy = cache->dup(value);
+  if (!key_copy || !value_copy)
+    {
+      free(key_copy);
+      if (value_copy)
+	cache->free(value_copy);
+      return;
+    }
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&cache->lock));
+
+  // Use an entry with the same key (another thread may have added it), or an
+  // empty entry, or else the least recently used
+  entry = &cache->entries[0];
+  for (i = 0; i < LRU_CACHE_SIZE; i++)
+    {
+      if (cache->entries[i].key && strcmp(cache->entries[i].key, key) == 0)
+	{
+	  entry = &cache->entries[i];
+	  break;
+	}
+
+      if (entry->key && (!cache->entries[i].key || cache->entries[i].last_used < entry->last_used))
+	entry = &cache->entries[i];
+    }
+
+  free(entry->key);
+  if (entry->value)
+    cache->free(entry->value);
+
+  entry->key = key_copy;
+  entry->value = value_copy;
+  entry->last_used = ++cache->clock;
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&cache->lock));
+}
+
+void *
+lru_cache_strdup(const void *value)
+{
+  return strdup(value);
+}
+
+
 /* ------------------------- Clock utility functions ------------------------ */
 
 int
@@ -1744,6 +2073,8 @@ media_format_from_string(const char *s)
     return MEDIA_FORMAT_ALAC;
   if (strcmp(s, "opus") == 0)
     return MEDIA_FORMAT_OPUS;
+  if (strcmp(s, "flac") == 0)
+    return MEDIA_FORMAT_FLAC;
 
   return MEDIA_FORMAT_UNKNOWN;
 }
@@ -1761,6 +2092,8 @@ media_format_to_string(enum media_format format)
     return "alac";
   if (format == MEDIA_FORMAT_OPUS)
     return "opus";
+  if (format == MEDIA_FORMAT_FLAC)
+    return "flac";
 
   return "unknown";
 }
@@ -1834,6 +2167,187 @@ thread_setname(pthread_t thread, const char *name)
 #endif
 }
 
+int
+thread_nice_set(int nice)
+{
+#ifdef __linux__
+  return setpriority(PRIO_PROCESS, thread_gettid(), nice);
+#else
+  return -1;
+#endif
+}
+
+// From linux/ioprio.h, which isn't always installed
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+
+int
+thread_io_idle_set(bool idle)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // Class none means that the I/O priority follows the nice value
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, idle ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT : 0);
+#else
+  return -1;
+#endif
+}
+
+// Threads that thread_realtime_apply() was called for, by name
+#define THREAD_RT_MAX 16
+static struct thread_rt_info thread_rt[THREAD_RT_MAX];
+static int thread_rt_count;
+static bool thread_rt_memory_locked;
+static pthread_mutex_t thread_rt_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+thread_rt_register(struct thread_rt_info *info)
+{
+  int i;
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&thread_rt_lck));
+
+  for (i = 0; i < thread_rt_count && strcmp(thread_rt[i].name, info->name) != 0; i++)
+    ; // EMPTY
+
+  if (i < THREAD_RT_MAX)
+    {
+      thread_rt[i] = *info;
+      if (i == thread_rt_count)
+	thread_rt_count++;
+    }
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&thread_rt_lck));
+}
+
+/*
+ * Gives the calling thread the real-time priority and CPU affinity from the
+ * config (realtime_priority, realtime_policy and realtime_cpus). If that isn't
+ * permitted the thread keeps its scheduling, so this is safe to call.
+ *
+ * @in name name of the thread for the log and thread_realtime_list()
+ */
+void
+thread_realtime_apply(const char *name)
+{
+  cfg_t *gen = cfg_getsec(cfg, "general");
+  struct thread_rt_info info = { 0 };
+#ifdef __linux__
+  struct sched_param param = { 0 };
+  cpu_set_t cpuset;
+  const char *policy_str;
+  int policy;
+  int priority;
+  int ncpus;
+  int cpu;
+  int i;
+  int ret;
+#endif
+
+  snprintf(info.name, sizeof(info.name), "%s", name);
+  snprintf(info.policy, sizeof(info.policy), "other");
+
+#ifdef __linux__
+  priority = cfg_getint(gen, "realtime_priority");
+  if (priority > 0)
+    {
+      policy_str = cfg_getstr(gen, "realtime_policy");
+      policy = (policy_str && strcasecmp(policy_str, "rr") == 0) ? SCHED_RR : SCHED_FIFO;
+
+      param.sched_priority = MIN(MAX(priority, sched_get_priority_min(policy)), sched_get_priority_max(policy));
+
+      ret = pthread_setschedparam(pthread_self(), policy, &param);
+      if (ret == 0)
+	{
+	  snprintf(info.policy, sizeof(info.policy), "%s", (policy == SCHED_RR) ? "rr" : "fifo");
+	  info.priority = param.sched_priority;
+	}
+      else
+	DPRINTF(E_WARN, L_MISC, "Could not give %s thread real-time priority %d: %s (requires CAP_SYS_NICE or RLIMIT_RTPRIO)\n", name, param.sched_priority, strerror(ret));
+    }
+
+  ncpus = cfg_size(gen, "realtime_cpus");
+  if (ncpus > 0)
+    {
+      CPU_ZERO(&cpuset);
+      for (i = 0; i < ncpus; i++)
+	{
+	  cpu = cfg_getnint(gen, "realtime_cpus", i);
+	  if (cpu < 0 || cpu >= CPU_SETSIZE)
+	    continue;
+
+	  CPU_SET(cpu, &cpuset);
+	  safe_snprintf_cat(info.cpus, sizeof(info.cpus), "%s%d", (info.cpus[0] != '\0') ? "," : "", cpu);
+	}
+
+      ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+      if (ret != 0)
+	{
+	  DPRINTF(E_WARN, L_MISC, "Could not pin %s thread to CPUs %s: %s\n", name, info.cpus, strerror(ret));
+	  info.cpus[0] = '\0';
+	}
+    }
+#endif
+
+  if (info.priority > 0 || info.cpus[0] != '\0')
+    DPRINTF(E_LOG, L_MISC, "Scheduling of %s thread: policy %s, priority %d, CPUs %s\n", name, info.policy, info.priority, (info.cpus[0] != '\0') ? info.cpus : "any");
+
+  thread_rt_register(&info);
+}
+
+/*
+ * @out list the threads thread_realtime_apply() was called for
+ * @in  max size of list
+ * @out memory_locked true if memory_lock() succeeded
+ * @return number of threads in list
+ */
+int
+thread_realtime_list(struct thread_rt_info *list, int max, bool *memory_locked)
+{
+  int n;
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&thread_rt_lck));
+
+  n = MIN(max, thread_rt_count);
+  memcpy(list, thread_rt, n * sizeof(struct thread_rt_info));
+  *memory_locked = thread_rt_memory_locked;
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&thread_rt_lck));
+
+  return n;
+}
+
+// Locks current and future memory if lock_memory is set, so that playback
+// never waits for memory to be paged in
+void
+memory_lock(void)
+{
+  int flags = MCL_CURRENT | MCL_FUTURE;
+  int ret;
+
+  if (!cfg_getbool(cfg_getsec(cfg, "general"), "lock_memory"))
+    return;
+
+#ifdef MCL_ONFAULT
+  // Only locks pages when they are used, so untouched reservations (e.g.
+  // thread stacks) don't count
+  flags |= MCL_ONFAULT;
+#endif
+
+  ret = mlockall(flags);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_MISC, "Could not lock memory: %s (check RLIMIT_MEMLOCK)\n", strerror(errno));
+      return;
+    }
+
+  DPRINTF(E_LOG, L_MISC, "Memory is locked\n");
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&thread_rt_lck));
+  thread_rt_memory_locked = true;
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&thread_rt_lck));
+}
+
 #ifdef HAVE_UUID
 void
 uuid_make(char *str)
@@ -160,9 +160,16 @@ struct onekeyval {
   struct onekeyval *sort;
 };
 
+// The list keeps the insertion order. When it grows beyond a few items an
+// index (open addressing, linear probing) is made for the lookups. A zeroed
+// struct is an empty keyval.
 struct keyval {
   struct onekeyval *head;
   struct onekeyval *tail;
+
+  struct onekeyval **index;
+  unsigned int index_size; // Power of 2, or 0 if there is no index
+  unsigned int count;
 };
 
 struct keyval *
@@ -211,6 +218,111 @@ size_t
 ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf);
 
 
+/* -------------------------------- Histogram ------------------------------- */
+
+// Bucket 0 counts values of 0, bucket n counts values in [2^(n-1), 2^n), and
+// the last bucket counts everything above that
+#define HISTOGRAM_BUCKETS 16
+
+struct histogram {
+  uint64_t count[HISTOGRAM_BUCKETS];
+  uint64_t max;
+};
+
+void
+histogram_add(struct histogram *h, uint64_t value);
+
+
+/* --------------------------- Memory accounting ---------------------------- */
+
+// With --enable-memaccounting (glibc only) every allocation is counted towards
+// the tag that the allocating thread has set, see memaccount.c. It is a rough
+// attribution: e.g. an evbuffer that httpd gets from the db is counted towards
+// what was active when each chunk was allocated. Frees are subtracted from the
+// tag the allocation was counted towards.
+enum mem_tag
+{
+  MEM_TAG_OTHER,
+  MEM_TAG_DB,
+  MEM_TAG_HTTPD,
+  MEM_TAG_JSON,
+  MEM_TAG_OUTPUTS,
+  MEM_TAG_XCODE,
+  MEM_TAG_ARTWORK,
+  MEM_TAG_CACHE,
+  MEM_TAG_MAX,
+};
+
+struct mem_tag_stats
+{
+  const char *name;
+  int64_t current_bytes;
+  int64_t peak_bytes;
+  uint64_t allocations;
+};
+
+// Sets the tag of the calling thread, returns the previous one
+enum mem_tag
+mem_tag_set(enum mem_tag tag);
+
+void
+mem_tag_restore(enum mem_tag *prev);
+
+// Sets the tag until the end of the enclosing block
+#define MEM_TAG_SCOPE(tag) \
+  enum mem_tag mem_tag_prev __attribute__((cleanup(mem_tag_restore))) = mem_tag_set(tag)
+
+enum mem_tag
+mem_tag_get(void);
+
+// For memaccount.c
+void
+mem_tag_account(enum mem_tag tag, int64_t bytes);
+
+// Returns the number of stats, which is 0 unless built with memory accounting
+int
+mem_tag_stats_get(struct mem_tag_stats *stats, int max);
+
+
+/* -------------------------------- LRU cache ------------------------------- */
+
+#include <pthread.h>
+
+#define LRU_CACHE_SIZE 64
+
+struct lru_cache_entry {
+  char *key;
+  void *value;
+  uint64_t last_used;
+};
+
+// Small thread safe cache of values by string key, meant for results that are
+// expensive to make, like parsed queries. The cache keeps its own copies of the
+// values, made with dup, and lru_cache_get() also returns a copy.
+struct lru_cache {
+  pthread_mutex_t lock;
+  void *(*dup)(const void *value);
+  void (*free)(void *value);
+  uint64_t clock;
+  struct lru_cache_entry entries[LRU_CACHE_SIZE];
+};
+
+#define LRU_CACHE_INITIALIZER(dup_fn, free_fn) { .lock = PTHREAD_MUTEX_INITIALIZER, .dup = dup_fn, .free = free_fn }
+
+// Returns a copy of the value cached for key, or NULL
+void *
+lru_cache_get(struct lru_cache *cache, const char *key);
+
+// Adds a copy of value, replacing the least recently used entry if the cache
+// is full
+void
+lru_cache_add(struct lru_cache *cache, const char *key, const void *value);
+
+// For caches of strings
+void *
+lru_cache_strdup(const void *value);
+
+
 /* ------------------------- Clock utility functions ------------------------ */
 
 #include <time.h>
@@ -280,11 +392,12 @@ enum media_format {
   MEDIA_FORMAT_MP3     = (1 << 2),
   MEDIA_FORMAT_ALAC    = (1 << 3),
   MEDIA_FORMAT_OPUS    = (1 << 4),
+  MEDIA_FORMAT_FLAC    = (1 << 5),
 };
 
 // For iteration
 #define MEDIA_FORMAT_FIRST MEDIA_FORMAT_PCM
-#define MEDIA_FORMAT_LAST MEDIA_FORMAT_OPUS
+#define MEDIA_FORMAT_LAST MEDIA_FORMAT_FLAC
 #define MEDIA_FORMAT_NEXT(f) (f << 1)
 
 // Remember to adjust quality_is_equal() if adding elements
@@ -331,6 +444,33 @@ thread_getnametid(char *buf, size_t len);
 void
 thread_setname(pthread_t thread, const char *name);
 
+// Sets the nice value of the calling thread, only raising is allowed without
+// privileges (Linux only, elsewhere it would apply to the whole process)
+int
+thread_nice_set(int nice);
+
+// Puts the calling thread in the idle I/O class, or back to the default
+int
+thread_io_idle_set(bool idle);
+
+// Scheduling applied by thread_realtime_apply(), see thread_realtime_list()
+struct thread_rt_info
+{
+  char name[16];
+  char policy[8]; // "fifo", "rr" or "other" if real-time wasn't applied
+  int priority;
+  char cpus[64];  // The CPUs the thread is pinned to, empty if not pinned
+};
+
+void
+thread_realtime_apply(const char *name);
+
+int
+thread_realtime_list(struct thread_rt_info *list, int max, bool *memory_locked);
+
+void
+memory_lock(void);
+
 void
 uuid_make(char *str);
 
@@ -110,6 +110,15 @@
 #define MPD_BINARY_SIZE 8192  /* MPD MAX_BINARY_SIZE */
 #define MPD_BINARY_SIZE_MIN 64  /* min size from MPD ClientCommands.cxx */
 
+// A directory listing (e.g. listallinfo /) is paused when there is more than
+// the high watermark waiting to be sent to the client, and continued when it is
+// down to the low watermark
+#define MPD_OUTPUT_HIGH_WATERMARK (256*1024)
+#define MPD_OUTPUT_LOW_WATERMARK (64*1024)
+
+// Listener events are collected for this long before idle clients are notified
+#define MPD_IDLE_COALESCE_MS 50
+
 // MPD error codes (taken from ack.h)
 enum mpd_ack_error
 {
@@ -172,6 +181,16 @@ struct mpd_client_ctx
   // connection.
   bool must_disconnect;
 
+  // Set while a directory listing is paused waiting for the client to read
+  // the output. Other commands from the client wait until it is done.
+  struct mpd_dir_listing *dir_listing;
+
+  // Artwork of the latest albumart/readpicture, so that it doesn't have to be
+  // made again for each chunk the client requests
+  struct evbuffer *artwork;
+  int artwork_id;
+  int artwork_format;
+
   struct mpd_client_ctx *next;
 };
 
@@ -216,6 +235,55 @@ struct mpd_command
   int (*handler)(struct mpd_command_output *out, struct mpd_command_input *in, struct mpd_client_ctx *ctx);
   int min_argc;
   int wants_num;
+  // Only changes the queue from the mpd thread, so it can be part of a queue
+  // batch, see mpd_process_command_list()
+  bool queue_batch;
+};
+
+struct mpd_subdir
+{
+  uint32_t id;
+  char *virtual_path;
+};
+
+// A directory in a listing, and how far we have got with it
+struct mpd_dir_listing_frame
+{
+  int directory_id;
+  bool playlists_done;
+  bool subdirs_loaded;
+  struct mpd_subdir *subdirs;
+  int nsubdirs;
+  int subdir_idx;
+  int files_offset;
+};
+
+// State of a listing made by lsinfo, listall or listallinfo, see
+// mpd_dir_listing_run(). Nothing is kept open in the db while the listing is
+// paused, so it is continued with a new query from the saved position.
+struct mpd_dir_listing
+{
+  char *cmd_name;
+  bool listall;
+  bool listinfo;
+  bool stored_playlists;
+
+  // Stack of directories, the last one is being listed
+  struct mpd_dir_listing_frame *frames;
+  int nframes;
+  int frames_size;
+};
+
+// The parts of an mpd_result we need, for mpd_query_cache
+struct mpd_parsed_query
+{
+  char *where;
+  char *order;
+  char *group;
+  char *tagtype;
+  char *position;
+  int offset;
+  int limit;
 };
 
 struct param_output
@@ -239,8 +307,17 @@ static int mpd_plugin_httpd_shortid = -1;
 static char *default_pl_dir;
 static bool allow_modifying_stored_playlists;
 
+// Listener events waiting to be sent to idle clients, see mpd_listener_cb()
+static short idle_pending_events;
+static struct event *idle_notify_ev;
+
+// Player status taken when a queue batch starts, see mpd_process_command_list()
+static struct player_status *queue_batch_status;
+
 // Forward
 static struct mpd_command mpd_handlers[];
+static void
+dir_listing_free(struct mpd_dir_listing *listing);
 
 // List of all connected mpd clients
 struct mpd_client_ctx *mpd_clients;
@@ -319,6 +396,9 @@ client_ctx_free(struct mpd_client_ctx *client_ctx)
   if (!client_ctx)
     return;
 
+  dir_listing_free(client_ctx->dir_listing);
+  if (client_ctx->artwork)
+    evbuffer_free(client_ctx->artwork);
   evbuffer_free(client_ctx->cmd_list_buffer);
   free(client_ctx);
 }
@@ -805,6 +885,47 @@ args_reassemble(char *args, size_t args_size, int argc, char **argv)
   return (strlen(args) + 1 < args_size) ? 0 : -1;
 }
 
+static void *
+parsed_query_dup(const void *value)
+{
+  const struct mpd_parsed_query *in = value;
+  struct mpd_parsed_query *out;
+
+  out = calloc(1, sizeof(struct mpd_parsed_query));
+  if (!out)
+    return NULL;
+
+  out->where = safe_strdup(in->where);
+  out->order = safe_strdup(in->order);
+  out->group = safe_strdup(in->group);
+  out->tagtype = safe_strdup(in->tagtype);
+  out->position = safe_strdup(in->position);
+  out->offset = in->offset;
+  out->limit = in->limit;
+
+  return out;
+}
+
+static void
+parsed_query_free(void *value)
+{
+  struct mpd_parsed_query *query = value;
+
+  if (!query)
+    return;
+
+  free(query->where);
+  free(query->order);
+  free(query->group);
+  free(query->tagtype);
+  free(query->position);
+  free(query);
+}
+
+// Clients repeat the same filters while browsing, so the latest parsed queries
+// are kept by the reassembled arguments
+static struct lru_cache mpd_query_cache = LRU_CACHE_INITIALIZER(parsed_query_dup, parsed_query_free);
+
 /*
  * Invokes a lexer/parser to read a supported command
  *
@@ -817,6 +938,8 @@ static int
 parse_command(struct query_params *qp, char **pos, char **tagtype, struct mpd_command_input *in)
 {
   struct mpd_result result;
+  struct mpd_parsed_query parsed;
+  struct mpd_parsed_query *query;
   char args_reassembled[8192];
   int ret;
 
@@ -835,28 +958,53 @@ parse_command(struct query_params *qp, char **pos, char **tagtype, struct mpd_co
       return -1;
     }
 
-  DPRINTF(E_DBG, L_MPD, "Parse mpd query input '%s'\n", args_reassembled);
-
-  ret = mpd_lex_parse(&result, args_reassembled);
-  if (ret != 0)
+  query = lru_cache_get(&mpd_query_cache, args_reassembled);
+  if (!query)
     {
-      DPRINTF(E_LOG, L_MPD, "Could not parse '%s': %s\n", args_reassembled, result.errmsg);
-      return -1;
+      DPRINTF(E_DBG, L_MPD, "Parse mpd query input '%s'\n", args_reassembled);
+
+      ret = mpd_lex_parse(&result, args_reassembled);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_MPD, "Could not parse '%s': %s\n", args_reassembled, result.errmsg);
+	  return -1;
+	}
+
+      parsed.where = (char *)result.where;
+      parsed.order = (char *)result.order;
+      parsed.group = (char *)result.group;
+      parsed.tagtype = (char *)result.tagtype;
+      parsed.position = (char *)result.position;
+      parsed.offset = result.offset;
+      parsed.limit = result.limit;
+
+      lru_cache_add(&mpd_query_cache, args_reassembled, &parsed);
+
+      query = parsed_query_dup(&parsed);
+      if (!query)
+	return -1;
     }
 
-  qp->filter = safe_strdup(result.where);
-  qp->order = safe_strdup(result.order);
-  qp->group = safe_strdup(result.group);
+  // Ownership of the strings passes to the caller
+  qp->filter = query->where;
+  qp->order = query->order;
+  qp->group = query->group;
 
-  qp->limit = result.limit;
-  qp->offset = result.offset;
+  qp->limit = query->limit;
+  qp->offset = query->offset;
   qp->idx_type = (qp->limit || qp->offset) ? I_SUB : I_NONE;
 
   if (pos)
-    *pos = safe_strdup(result.position);
+    *pos = query->position;
+  else
+    free(query->position);
 
   if (tagtype)
-    *tagtype = safe_strdup(result.tagtype);
+    *tagtype = query->tagtype;
+  else
+    free(query->tagtype);
+
+  free(query);
 
   return 0;
 }
@@ -1562,6 +1710,33 @@ mpd_command_stop(struct mpd_command_output *out, struct mpd_command_input *in, s
   return 0;
 }
 
+static void
+queue_batch_begin(struct player_status *status)
+{
+  // While in the batch we hold the database write lock, so we must not wait
+  // for the player (which may be waiting for the lock)
+  player_get_status(status);
+  queue_batch_status = status;
+
+  db_queue_batch_begin();
+}
+
+static void
+queue_batch_end(void)
+{
+  db_queue_batch_end();
+  queue_batch_status = NULL;
+}
+
+static void
+queue_player_status_get(struct player_status *status)
+{
+  if (queue_batch_status)
+    *status = *queue_batch_status;
+  else
+    player_get_status(status);
+}
+
 /*
  * Add media file item with given virtual path to the queue
  *
@@ -1579,12 +1754,13 @@ mpd_queue_add(char *path, bool exact_match, int position)
 
   new_item_id = 0;
 
+  // Case-insensitive like LIKE, but using idx_file_vpath_fold
   if (exact_match)
-    CHECK_NULL(L_MPD, qp.filter = db_mprintf("f.disabled = 0 AND f.virtual_path LIKE '/%q'", path));
+    CHECK_NULL(L_MPD, qp.filter = db_mprintf("f.disabled = 0 AND daap_fold(f.virtual_path) = daap_fold('/%q')", path));
   else
-    CHECK_NULL(L_MPD, qp.filter = db_mprintf("f.disabled = 0 AND f.virtual_path LIKE '/%q%%'", path));
+    CHECK_NULL(L_MPD, qp.filter = db_mprintf("f.disabled = 0 AND daap_fold(f.virtual_path) >= daap_fold('/%q') AND daap_fold(f.virtual_path) < daap_fold('/%q') || char(1114111)", path, path));
 
-  player_get_status(&status);
+  queue_player_status_get(&status);
 
   ret = db_queue_add_by_query(&qp, status.shuffle, status.item_id, position, NULL, &new_item_id);
 
@@ -1614,6 +1790,10 @@ mpd_command_add(struct mpd_command_output *out, struct mpd_command_input *in, st
 
   if (ret == 0)
     {
+      // The library thread will add the item, which it can't while we hold
+      // the queue batch transaction
+      queue_batch_end();
+
       player_get_status(&status);
 
       // Given path is not in the library, check if it is possible to add as a non-library queue item
@@ -1650,6 +1830,9 @@ mpd_command_addid(struct mpd_command_output *out, struct mpd_command_input *in,
   ret = mpd_queue_add(path, true, to_pos);
   if (ret == 0)
     {
+      // See mpd_command_add()
+      queue_batch_end();
+
       player_get_status(&status);
 
       // Given path is not in the library, directly add it as a new queue item
@@ -1894,7 +2077,6 @@ mpd_command_playlistinfo(struct mpd_command_output *out, struct mpd_command_inpu
 /*
  * playlistfind {FILTER} [sort {TYPE}] [window {START:END}]
  * Searches for songs that match in the queue
- * TODO add support for window (currently not supported by db_queue_enum_x)
  */
 static int
 mpd_command_playlistfind(struct mpd_command_output *out, struct mpd_command_input *in, struct mpd_client_ctx *ctx)
@@ -1972,6 +2154,7 @@ mpd_command_playlistsearch(struct mpd_command_output *out, struct mpd_command_in
 static int
 plchanges_build_queryparams(struct query_params *qp, uint32_t version, const char *range)
 {
+  int order_version = 0;
   int start_pos;
   int end_pos;
   int ret;
@@ -1990,7 +2173,17 @@ plchanges_build_queryparams(struct query_params *qp, uint32_t version, const cha
 	DPRINTF(E_DBG, L_MPD, "Invalid range '%s', will return entire queue\n", range);
     }
 
-  if (start_pos < 0 || end_pos <= 0)
+  // Items that only changed position (e.g. because an item before them was
+  // removed) don't get a new queue_version, so if the order changed since the
+  // client's version all items in the range are returned
+  db_admin_getint(&order_version, DB_ADMIN_QUEUE_ORDER_VERSION);
+
+  if ((uint32_t)order_version > version)
+    {
+      if (start_pos >= 0 && end_pos > 0)
+	qp->filter = db_mprintf("(pos >= %d AND pos < %d)", start_pos, end_pos);
+    }
+  else if (start_pos < 0 || end_pos <= 0)
     qp->filter = db_mprintf("(queue_version > %d)", version);
   else
     qp->filter = db_mprintf("(queue_version > %d AND pos >= %d AND pos < %d)", version, start_pos, end_pos);
@@ -2375,10 +2568,9 @@ mpd_command_albumart(struct mpd_command_output *out, struct mpd_command_input *i
 {
   char *virtual_path;
   uint32_t offset = in->argv_u32val[2];
-  struct evbuffer *artwork;
+  unsigned char *data;
   size_t total_size;
   size_t len;
-  int format;
   int id;
 
   virtual_path = prepend_slash(in->argv[1]);
@@ -2387,31 +2579,48 @@ mpd_command_albumart(struct mpd_command_output *out, struct mpd_command_input *i
   if (id <= 0)
     RETURN_ERROR(ACK_ERROR_ARG, "Invalid path");
 
-  CHECK_NULL(L_MPD, artwork = evbuffer_new());
+  // A transfer starts with offset 0, and then the client requests the next
+  // chunks, which we serve from the artwork we got for the first
+  if (!ctx->artwork || offset == 0 || id != ctx->artwork_id)
+    {
+      if (ctx->artwork)
+	evbuffer_drain(ctx->artwork, -1);
+      else
+	CHECK_NULL(L_MPD, ctx->artwork = evbuffer_new());
+
+      ctx->artwork_id = id;
+      ctx->artwork_format = artwork_get_item(ctx->artwork, id, ART_DEFAULT_WIDTH, ART_DEFAULT_HEIGHT, 0);
+    }
 
   // Ref. docs: "If the song file was recognized, but there is no picture, the
   // response is successful, but is otherwise empty"
-  format = artwork_get_item(artwork, id, ART_DEFAULT_WIDTH, ART_DEFAULT_HEIGHT, 0);
-  if (format == ART_FMT_PNG)
+  if (ctx->artwork_format == ART_FMT_PNG)
     evbuffer_add_printf(out->evbuf, "type: image/png\n");
-  else if (format == ART_FMT_JPEG)
+  else if (ctx->artwork_format == ART_FMT_JPEG)
     evbuffer_add_printf(out->evbuf, "type: image/jpeg\n");
   else
-    goto out;
+    return 0;
 
-  total_size = evbuffer_get_length(artwork);
+  total_size = evbuffer_get_length(ctx->artwork);
   evbuffer_add_printf(out->evbuf, "size: %zu\n", total_size);
 
-  evbuffer_drain(artwork, offset);
-
-  len = MIN(ctx->binarylimit, evbuffer_get_length(artwork));
+  len = (offset < total_size) ? MIN(ctx->binarylimit, total_size - offset) : 0;
   evbuffer_add_printf(out->evbuf, "binary: %zu\n", len);
 
-  evbuffer_remove_buffer(artwork, out->evbuf, len);
+  if (len > 0)
+    {
+      data = evbuffer_pullup(ctx->artwork, -1);
+      evbuffer_add(out->evbuf, data + offset, len);
+    }
   evbuffer_add(out->evbuf, "\n", 1);
 
- out:
-  evbuffer_free(artwork);
+  // Transfer complete, no need to keep the artwork
+  if (offset + len >= total_size)
+    {
+      evbuffer_free(ctx->artwork);
+      ctx->artwork = NULL;
+    }
+
   return 0;
 }
 
@@ -2617,20 +2826,81 @@ mpd_command_list(struct mpd_command_output *out, struct mpd_command_input *in, s
   return 0;
 }
 
+static void
+dir_listing_frame_clear(struct mpd_dir_listing_frame *frame)
+{
+  int i;
+
+  for (i = 0; i < frame->nsubdirs; i++)
+    free(frame->subdirs[i].virtual_path);
+
+  free(frame->subdirs);
+  memset(frame, 0, sizeof(struct mpd_dir_listing_frame));
+}
+
+static void
+dir_listing_push(struct mpd_dir_listing *listing, int directory_id)
+{
+  if (listing->nframes == listing->frames_size)
+    {
+      listing->frames_size = listing->frames_size ? 2 * listing->frames_size : 8;
+      CHECK_NULL(L_MPD, listing->frames = realloc(listing->frames, listing->frames_size * sizeof(struct mpd_dir_listing_frame)));
+    }
+
+  memset(&listing->frames[listing->nframes], 0, sizeof(struct mpd_dir_listing_frame));
+  listing->frames[listing->nframes].directory_id = directory_id;
+  listing->nframes++;
+}
+
+static struct mpd_dir_listing *
+dir_listing_new(const char *cmd_name, int directory_id, bool listall, bool listinfo, bool stored_playlists)
+{
+  struct mpd_dir_listing *listing;
+
+  CHECK_NULL(L_MPD, listing = calloc(1, sizeof(struct mpd_dir_listing)));
+  listing->cmd_name = safe_strdup(cmd_name);
+  listing->listall = listall;
+  listing->listinfo = listinfo;
+  listing->stored_playlists = stored_playlists;
+
+  dir_listing_push(listing, directory_id);
+
+  return listing;
+}
+
+static void
+dir_listing_free(struct mpd_dir_listing *listing)
+{
+  int i;
+
+  if (!listing)
+    return;
+
+  for (i = 0; i < listing->nframes; i++)
+    dir_listing_frame_clear(&listing->frames[i]);
+
+  free(listing->frames);
+  free(listing->cmd_name);
+  free(listing);
+}
+
+static bool
+dir_listing_must_pause(struct evbuffer *evbuf, bool can_pause)
+{
+  return can_pause && (evbuffer_get_length(evbuf) > MPD_OUTPUT_HIGH_WATERMARK);
+}
+
 static int
-mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall, int listinfo)
+dir_listing_playlists_add(struct mpd_command_output *out, struct mpd_dir_listing *listing, struct mpd_dir_listing_frame *frame)
 {
-  struct directory_info subdir;
   struct query_params qp = { .type = Q_PL, .idx_type = I_NONE, .sort = S_PLAYLIST };
-  struct directory_enum dir_enum;
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
   int ret;
 
   // Load playlists for dir-id
-  qp.filter = db_mprintf("(f.directory_id = %d AND (f.type = %d OR f.type = %d))", directory_id, PL_PLAIN, PL_SMART);
+  qp.filter = db_mprintf("(f.directory_id = %d AND (f.type = %d OR f.type = %d))", frame->directory_id, PL_PLAIN, PL_SMART);
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2644,7 +2914,7 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
 	  DPRINTF(E_LOG, L_MPD, "Error converting time modified to uint32_t: %s\n", dbpli.db_timestamp);
 	}
 
-      if (listinfo)
+      if (listing->listinfo)
 	{
 	  mpd_time(modified, sizeof(modified), time_modified);
 	  evbuffer_add_printf(out->evbuf,
@@ -2663,43 +2933,59 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
   db_query_end(&qp);
   free_query_params(&qp, 1);
 
+  frame->playlists_done = true;
+  return 0;
+}
+
+static int
+dir_listing_subdirs_load(struct mpd_command_output *out, struct mpd_dir_listing_frame *frame)
+{
+  struct directory_enum dir_enum;
+  struct directory_info subdir;
+  int size = 0;
+  int ret;
+
   // Load sub directories for dir-id
   memset(&dir_enum, 0, sizeof(struct directory_enum));
-  dir_enum.parent_id = directory_id;
+  dir_enum.parent_id = frame->directory_id;
   ret = db_directory_enum_start(&dir_enum);
   if (ret < 0)
     RETURN_ERROR(ACK_ERROR_UNKNOWN, "Failed to start directory enum");
 
   while ((ret = db_directory_enum_fetch(&dir_enum, &subdir)) == 0 && subdir.id > 0)
     {
-      if (listinfo)
-	{
-	  evbuffer_add_printf(out->evbuf,
-	    "directory: %s\n"
-	    "Last-Modified: %s\n",
-	    (subdir.virtual_path + 1),
-	    "2015-12-01 00:00");
-	}
-      else
+      if (frame->nsubdirs == size)
 	{
-	  evbuffer_add_printf(out->evbuf,
-	    "directory: %s\n",
-	    (subdir.virtual_path + 1));
+	  size = size ? 2 * size : 16;
+	  CHECK_NULL(L_MPD, frame->subdirs = realloc(frame->subdirs, size * sizeof(struct mpd_subdir)));
 	}
 
-      if (listall)
-	{
-	  mpd_add_directory(out, subdir.id, listall, listinfo);
-	}
+      frame->subdirs[frame->nsubdirs].id = subdir.id;
+      frame->subdirs[frame->nsubdirs].virtual_path = safe_strdup(subdir.virtual_path);
+      frame->nsubdirs++;
     }
   db_directory_enum_end(&dir_enum);
 
-  // Load files for dir-id
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.type = Q_ITEMS;
-  qp.sort = S_ARTIST;
-  qp.idx_type = I_NONE;
-  qp.filter = db_mprintf("(f.directory_id = %d)", directory_id);
+  frame->subdirs_loaded = true;
+  return 0;
+}
+
+// Returns 1 if paused, which may be in the middle of the files
+static int
+dir_listing_files_add(struct mpd_command_output *out, struct mpd_dir_listing *listing, struct mpd_dir_listing_frame *frame, bool can_pause)
+{
+  struct query_params qp = { .type = Q_ITEMS, .sort = S_ARTIST };
+  struct db_media_file_info dbmfi;
+  int ret;
+
+  // Most directories in a music library only have sub directories
+  if (db_directory_file_count(frame->directory_id) == 0)
+    return 0;
+
+  // Load files for dir-id, continuing from where we paused
+  qp.idx_type = frame->files_offset ? I_SUB : I_NONE;
+  qp.offset = frame->files_offset;
+  qp.filter = db_mprintf("(f.directory_id = %d)", frame->directory_id);
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2708,7 +2994,7 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
     }
   while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
     {
-      if (listinfo)
+      if (listing->listinfo)
 	{
 	  ret = mpd_add_db_media_file_info(out->evbuf, &dbmfi);
 	  if (ret < 0)
@@ -2722,13 +3008,129 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
 	    "file: %s\n",
 	    (dbmfi.virtual_path + 1));
 	}
+
+      frame->files_offset++;
+
+      if (dir_listing_must_pause(out->evbuf, can_pause))
+	{
+	  ret = 1;
+	  break;
+	}
     }
   db_query_end(&qp);
   free_query_params(&qp, 1);
 
+  return (ret == 1) ? 1 : 0;
+}
+
+/*
+ * Adds the listing to the output. If can_pause is true, the listing is paused
+ * when the output buffer reaches MPD_OUTPUT_HIGH_WATERMARK, and must then be
+ * continued with another call when the client has read some of the output.
+ *
+ * @return 0 when the listing is complete, 1 if paused, -1 on error
+ */
+static int
+mpd_dir_listing_run(struct mpd_command_output *out, struct mpd_dir_listing *listing, bool can_pause)
+{
+  struct mpd_dir_listing_frame *frame;
+  struct mpd_subdir *subdir;
+  int ret;
+
+  while (listing->nframes > 0)
+    {
+      if (dir_listing_must_pause(out->evbuf, can_pause))
+	return 1;
+
+      frame = &listing->frames[listing->nframes - 1];
+
+      if (!frame->playlists_done)
+	{
+	  ret = dir_listing_playlists_add(out, listing, frame);
+	  if (ret < 0)
+	    return -1;
+
+	  continue;
+	}
+
+      if (!frame->subdirs_loaded)
+	{
+	  ret = dir_listing_subdirs_load(out, frame);
+	  if (ret < 0)
+	    return -1;
+
+	  continue;
+	}
+
+      if (frame->subdir_idx < frame->nsubdirs)
+	{
+	  subdir = &frame->subdirs[frame->subdir_idx++];
+
+	  if (listing->listinfo)
+	    {
+	      evbuffer_add_printf(out->evbuf,
+		"directory: %s\n"
+		"Last-Modified: %s\n",
+		(subdir->virtual_path + 1),
+		"2015-12-01 00:00");
+	    }
+	  else
+	    {
+	      evbuffer_add_printf(out->evbuf,
+		"directory: %s\n",
+		(subdir->virtual_path + 1));
+	    }
+
+	  // The sub directory is listed before we continue with the next one
+	  // (note that the push invalidates frame)
+	  if (listing->listall)
+	    dir_listing_push(listing, subdir->id);
+
+	  continue;
+	}
+
+      ret = dir_listing_files_add(out, listing, frame, can_pause);
+      if (ret != 0)
+	return ret;
+
+      dir_listing_frame_clear(frame);
+      listing->nframes--;
+    }
+
+  // lsinfo of the root directory also returns the stored playlists
+  if (listing->stored_playlists)
+    {
+      listing->stored_playlists = false;
+      return mpd_command_listplaylists(out, NULL, NULL);
+    }
+
   return 0;
 }
 
+/*
+ * Lists the directory. Outside command lists, a long listing is paused when
+ * the client's output buffer is full, and then continued by mpd_write_cb. That
+ * also sends the final OK, and the client's other commands wait until then.
+ */
+static int
+mpd_add_directory(struct mpd_command_output *out, struct mpd_client_ctx *ctx, const char *cmd_name, int directory_id, bool listall, bool listinfo, bool stored_playlists)
+{
+  struct mpd_dir_listing *listing;
+  int ret;
+
+  listing = dir_listing_new(cmd_name, directory_id, listall, listinfo, stored_playlists);
+
+  ret = mpd_dir_listing_run(out, listing, (ctx->cmd_list_type == COMMAND_LIST_NONE));
+  if (ret == 1)
+    {
+      ctx->dir_listing = listing;
+      return 0;
+    }
+
+  dir_listing_free(listing);
+  return ret;
+}
+
 static int
 mpd_command_listall(struct mpd_command_output *out, struct mpd_command_input *in, struct mpd_client_ctx *ctx)
 {
@@ -2758,7 +3160,7 @@ mpd_command_listall(struct mpd_command_output *out, struct mpd_command_input *in
   if (dir_id == 0)
     RETURN_ERROR(ACK_ERROR_NO_EXIST, "Directory info not found for virtual-path '%s'", parent);
 
-  return mpd_add_directory(out, dir_id, 1, 0);
+  return mpd_add_directory(out, ctx, in->argv[0], dir_id, true, false, false);
 }
 
 static int
@@ -2790,7 +3192,7 @@ mpd_command_listallinfo(struct mpd_command_output *out, struct mpd_command_input
   if (dir_id == 0)
     RETURN_ERROR(ACK_ERROR_NO_EXIST, "Directory info not found for virtual-path '%s'", parent);
 
-  return mpd_add_directory(out, dir_id, 1, 1);
+  return mpd_add_directory(out, ctx, in->argv[0], dir_id, true, true, false);
 }
 
 /*
@@ -2839,15 +3241,9 @@ mpd_command_lsinfo(struct mpd_command_output *out, struct mpd_command_input *in,
   if (dir_id == 0)
     RETURN_ERROR(ACK_ERROR_NO_EXIST, "Directory info not found for virtual-path '%s'", parent);
 
-  ret = mpd_add_directory(out, dir_id, 0, 1);
-
-  // If the root directory was passed as argument add the stored playlists to the response
-  if (ret == 0 && print_playlists)
-    {
-      return mpd_command_listplaylists(out, in, ctx);
-    }
-
-  return ret;
+  // If the root directory was passed as argument the stored playlists are added
+  // to the response after the directory contents
+  return mpd_add_directory(out, ctx, in->argv[0], dir_id, false, true, print_playlists);
 }
 
 /*
@@ -3017,7 +3413,8 @@ mpd_sticker_find(struct mpd_command_output *out, struct mpd_command_input *in, c
       rating_arg = 0;
     }
 
-  qp.filter = db_mprintf("(f.virtual_path LIKE '%s%%' AND f.rating > 0 AND f.rating %s %d)", virtual_path, operator, rating_arg);
+  qp.filter = db_mprintf("(daap_fold(f.virtual_path) >= daap_fold('%q') AND daap_fold(f.virtual_path) < daap_fold('%q') || char(1114111) AND f.rating > 0 AND f.rating %s %d)",
+			 virtual_path, virtual_path, operator, rating_arg);
 
   ret = db_query_start(&qp);
   if (ret < 0)
@@ -3589,13 +3986,13 @@ static struct mpd_command mpd_handlers[] =
     { "stop",                       mpd_command_stop,                       -1 },
 
     // The current playlist
-    { "add",                        mpd_command_add,                         2 },
-    { "addid",                      mpd_command_addid,                       2 },
+    { "add",                        mpd_command_add,                         2,              MPD_WANTS_NUM_NONE,      true },
+    { "addid",                      mpd_command_addid,                       2,              MPD_WANTS_NUM_NONE,      true },
     { "clear",                      mpd_command_clear,                      -1 },
-    { "delete",                     mpd_command_delete,                     -1 },
-    { "deleteid",                   mpd_command_deleteid,                    2,              MPD_WANTS_NUM_ARG1_UVAL },
-    { "move",                       mpd_command_move,                        3 },
-    { "moveid",                     mpd_command_moveid,                      3,              MPD_WANTS_NUM_ARG1_UVAL },
+    { "delete",                     mpd_command_delete,                     -1,              MPD_WANTS_NUM_NONE,      true },
+    { "deleteid",                   mpd_command_deleteid,                    2,              MPD_WANTS_NUM_ARG1_UVAL, true },
+    { "move",                       mpd_command_move,                        3,              MPD_WANTS_NUM_NONE,      true },
+    { "moveid",                     mpd_command_moveid,                      3,              MPD_WANTS_NUM_ARG1_UVAL, true },
     { "playlist",                   mpd_command_playlistinfo,               -1 }, // According to the mpd protocol the use of "playlist" is deprecated
     { "playlistfind",               mpd_command_playlistfind,                2 },
     { "playlistid",                 mpd_command_playlistid,                  1,              MPD_WANTS_NUM_ARG1_UVAL },
@@ -3864,7 +4261,7 @@ mpd_process_command_line(struct evbuffer *evbuf, const char *line, int cmd_num,
       goto error;
     }
 
-  if (client_ctx->cmd_list_type == COMMAND_LIST_NONE && !client_ctx->is_idle)
+  if (client_ctx->cmd_list_type == COMMAND_LIST_NONE && !client_ctx->is_idle && !client_ctx->dir_listing)
     evbuffer_add_printf(out.evbuf, "OK\n");
 
   mpd_command_input_free(in);
@@ -3891,12 +4288,57 @@ mpd_process_command_line(struct evbuffer *evbuf, const char *line, int cmd_num,
 // error is returned. If command_list_ok_begin is used, list_OK is returned
 // for each successful command executed in the command list.
 // On success for all commands, OK is returned.
+// Returns true if all the commands in the list can be part of a queue batch,
+// and there is more than one
+static bool
+command_list_is_queue_batch(struct evbuffer *cmd_list_buffer)
+{
+  struct evbuffer_ptr pos;
+  struct evbuffer_ptr eol;
+  struct mpd_command *command;
+  char name[32];
+  size_t eol_len;
+  size_t len;
+  int count = 0;
+
+  evbuffer_ptr_set(cmd_list_buffer, &pos, 0, EVBUFFER_PTR_SET);
+  while (1)
+    {
+      eol = evbuffer_search_eol(cmd_list_buffer, &pos, &eol_len, EVBUFFER_EOL_NUL);
+      if (eol.pos < 0)
+	break;
+
+      len = MIN(eol.pos - pos.pos, sizeof(name) - 1);
+      evbuffer_copyout_from(cmd_list_buffer, &pos, name, len);
+      name[len] = '\0';
+      name[strcspn(name, " \t")] = '\0';
+
+      command = mpd_find_command(name);
+      if (!command || !command->queue_batch)
+	return false;
+
+      count++;
+
+      evbuffer_ptr_set(cmd_list_buffer, &pos, eol.pos + eol_len, EVBUFFER_PTR_SET);
+    }
+
+  return (count > 1);
+}
+
 static void
 mpd_process_command_list(struct evbuffer *evbuf, struct mpd_client_ctx *client_ctx)
 {
+  struct player_status status;
   char *line;
   enum mpd_ack_error ack_error = ACK_ERROR_NONE;
   int cmd_num = 0;
+  bool is_queue_batch;
+
+  // Clients may add thousands of songs with one list of add commands, so such
+  // lists are made in one queue transaction with just one queue change event
+  is_queue_batch = command_list_is_queue_batch(client_ctx->cmd_list_buffer);
+  if (is_queue_batch)
+    queue_batch_begin(&status);
 
   while ((line = evbuffer_readln(client_ctx->cmd_list_buffer, NULL, EVBUFFER_EOL_NUL)))
     {
@@ -3913,6 +4355,9 @@ mpd_process_command_list(struct evbuffer *evbuf, struct mpd_client_ctx *client_c
 	evbuffer_add_printf(evbuf, "list_OK\n");
     }
 
+  if (is_queue_batch)
+    queue_batch_end();
+
   if (ack_error == ACK_ERROR_NONE)
     evbuffer_add_printf(evbuf, "OK\n");
 
@@ -3938,6 +4383,10 @@ mpd_read_cb(struct bufferevent *bev, void *arg)
   struct evbuffer *output;
   char *line;
 
+  // The next commands are processed when the listing is done, see mpd_write_cb
+  if (client_ctx->dir_listing)
+    return;
+
   // Contains the command sequence received from the client
   input = bufferevent_get_input(bev);
   // Used to send the server response to the client
@@ -3956,6 +4405,13 @@ mpd_read_cb(struct bufferevent *bev, void *arg)
 
       if (client_ctx->must_disconnect)
         goto disconnect;
+
+      // A directory listing was paused, stop reading until it is done
+      if (client_ctx->dir_listing)
+	{
+	  bufferevent_disable(bev, EV_READ);
+	  return;
+	}
     }
 
   return;
@@ -3971,6 +4427,44 @@ mpd_read_cb(struct bufferevent *bev, void *arg)
   bufferevent_free(bev);
 }
 
+/*
+ * The write callback is invoked when the output to the client is down to
+ * MPD_OUTPUT_LOW_WATERMARK, which is when we continue a paused directory
+ * listing.
+ */
+static void
+mpd_write_cb(struct bufferevent *bev, void *arg)
+{
+  struct mpd_client_ctx *client_ctx = arg;
+  struct mpd_dir_listing *listing = client_ctx->dir_listing;
+  struct mpd_command_output out = { .evbuf = bufferevent_get_output(bev), .ack_error = ACK_ERROR_NONE };
+  int ret;
+
+  if (!listing)
+    return;
+
+  ret = mpd_dir_listing_run(&out, listing, true);
+  if (ret == 1)
+    return;
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MPD, "Error processing command '%s': %s\n", listing->cmd_name, out.errmsg);
+
+      evbuffer_add_printf(out.evbuf, "ACK [%d@%d] {%s} %s\n", out.ack_error, 0, listing->cmd_name, out.errmsg);
+      free(out.errmsg);
+    }
+  else
+    evbuffer_add_printf(out.evbuf, "OK\n");
+
+  dir_listing_free(listing);
+  client_ctx->dir_listing = NULL;
+
+  // Continue with the commands the client sent in the meantime
+  bufferevent_enable(bev, EV_READ);
+  mpd_read_cb(bev, client_ctx);
+}
+
 /*
  * Callback when an event occurs on the bufferevent
  */
@@ -4056,8 +4550,15 @@ mpd_accept_conn_cb(struct evconnlistener *listener,
   struct bufferevent *bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
   struct mpd_client_ctx *client_ctx = client_ctx_add();
 
+  // With a high watermark on the socket, the filter only passes on output when
+  // the socket has room, so our output buffer reflects what the client hasn't
+  // read yet, and the filter's low watermark makes mpd_write_cb run when the
+  // client is catching up
+  bufferevent_setwatermark(bev, EV_WRITE, 0, MPD_OUTPUT_HIGH_WATERMARK);
+
   bev = bufferevent_filter_new(bev, mpd_input_filter, NULL, BEV_OPT_CLOSE_ON_FREE, client_ctx_remove, client_ctx);
-  bufferevent_setcb(bev, mpd_read_cb, NULL, mpd_event_cb, client_ctx);
+  bufferevent_setcb(bev, mpd_read_cb, mpd_write_cb, mpd_event_cb, client_ctx);
+  bufferevent_setwatermark(bev, EV_WRITE, MPD_OUTPUT_LOW_WATERMARK, 0);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
 
   client_ctx->evbuffer = bufferevent_get_output(bev);
@@ -4090,14 +4591,15 @@ mpd_accept_error_cb(struct evconnlistener *listener, void *ctx)
   DPRINTF(E_LOG, L_MPD, "Error occured %d (%s) on the listener.\n", err, evutil_socket_error_to_string(err));
 }
 
-static enum command_state
-mpd_notify_idle(void *arg, int *retval)
+static void
+mpd_notify_idle_cb(int fd, short what, void *arg)
 {
   short event_mask;
   struct mpd_client_ctx *client;
   int i;
 
-  event_mask = *(short *)arg;
+  // Events from now on will schedule a new notification
+  event_mask = __atomic_exchange_n(&idle_pending_events, 0, __ATOMIC_SEQ_CST);
   DPRINTF(E_DBG, L_MPD, "Notify clients waiting for idle results: %d\n", event_mask);
 
   i = 0;
@@ -4111,20 +4613,35 @@ mpd_notify_idle(void *arg, int *retval)
       client = client->next;
       i++;
     }
+}
+
+static enum command_state
+mpd_notify_idle_schedule(void *arg, int *retval)
+{
+  struct timeval tv = { 0, MPD_IDLE_COALESCE_MS * 1000 };
+
+  evtimer_add(idle_notify_ev, &tv);
 
   *retval = 0;
   return COMMAND_END;
 }
 
+/*
+ * Bursts of events, e.g. during a library scan or while the volume is being
+ * changed, would wake up the idle clients for each event. Instead the events
+ * are collected, and the first one schedules a notification of all clients
+ * with the combined events after MPD_IDLE_COALESCE_MS.
+ */
 static void
 mpd_listener_cb(short event_mask, void *ctx)
 {
-  short *ptr;
+  short prev_mask;
 
-  ptr = (short *)malloc(sizeof(short));
-  *ptr = event_mask;
   DPRINTF(E_DBG, L_MPD, "Asynchronous listener callback called with event type %d.\n", event_mask);
-  commands_exec_async(cmdbase, mpd_notify_idle, ptr);
+
+  prev_mask = __atomic_fetch_or(&idle_pending_events, event_mask, __ATOMIC_SEQ_CST);
+  if (prev_mask == 0)
+    commands_exec_async(cmdbase, mpd_notify_idle_schedule, NULL);
 }
 
 /*
@@ -4258,6 +4775,8 @@ mpd(void *arg)
       pthread_exit(NULL);
     }
 
+  db_perthread_reader_init();
+
   event_base_dispatch(evbase_mpd);
 
   db_perthread_deinit();
@@ -4322,6 +4841,7 @@ mpd_init(void)
     }
 
   CHECK_NULL(L_MPD, evbase_mpd = event_base_new());
+  CHECK_NULL(L_MPD, idle_notify_ev = evtimer_new(evbase_mpd, mpd_notify_idle_cb, NULL));
   CHECK_NULL(L_MPD, cmdbase = commands_base_new(evbase_mpd, NULL));
 
   mpd_sockfd = net_bind(&port, SOCK_STREAM, "mpd");
@@ -4393,6 +4913,7 @@ mpd_init(void)
   close(mpd_sockfd);
  bind_fail:
   commands_base_free(cmdbase);
+  event_free(idle_notify_ev);
   event_base_free(evbase_mpd);
   evbase_mpd = NULL;
 
@@ -4435,6 +4956,8 @@ mpd_deinit(void)
 
   close(mpd_sockfd);
 
+  event_free(idle_notify_ev);
+
   // Free event base (should free events too)
   event_base_free(evbase_mpd);
 
@@ -31,12 +31,15 @@
 
 #include <event2/event.h>
 
+#include "conffile.h"
 #include "logger.h"
 #include "misc.h"
 #include "transcode.h"
+#include "pcm.h"
 #include "db.h"
 #include "player.h" //TODO remove me when player_pmap is removed again
 #include "worker.h"
+#include "listener.h"
 #include "outputs.h"
 
 extern struct output_definition output_raop;
@@ -87,6 +90,9 @@ static struct output_definition *outputs[] = {
 // (value is in seconds)
 #define OUTPUTS_STOP_TIMEOUT 10
 
+// Min seconds between notifying clients about new output stats
+#define OUTPUTS_STATS_NOTIFY_INTERVAL 10
+
 #define OUTPUTS_MAX_CALLBACKS 64
 
 struct outputs_callback_register
@@ -106,7 +112,10 @@ struct output_quality_subscription
 {
   int count;
   struct media_quality quality;
+  struct transcode_resample resample;
   struct encode_ctx *encode_ctx;
+  // If only the bit depth is different we convert with pcm.c instead
+  bool pcm_convert;
 };
 
 // Buffer used to pass data to the backends
@@ -118,11 +127,62 @@ static int outputs_master_volume;
 static struct outputs_callback_register outputs_cb_register[OUTPUTS_MAX_CALLBACKS];
 static struct event *outputs_deferredev;
 static struct timeval outputs_stop_timeout = { OUTPUTS_STOP_TIMEOUT, 0 };
+static time_t outputs_stats_notify_last;
 
 // Last element is a zero terminator
 static struct output_quality_subscription output_quality_subscriptions[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS + 1];
+
+// Frames are shared by all the outputs that hold a reference to them, and when
+// the last one lets go it returns to the pool
+struct output_frame
+{
+  int refcount;
+  struct evbuffer *evbuf;
+  struct output_frame *next;
+};
+
+// Max number of unused frames to keep in the pool
+#define OUTPUTS_FRAME_POOL_MAX 64
+
+static struct output_frame *outputs_frame_pool;
+static int outputs_frame_pool_count;
+static pthread_mutex_t outputs_frame_pool_lck;
+
+// Duration of calls to the write function of each output in microseconds
+static struct histogram outputs_write_stats[ARRAY_SIZE(outputs) - 1];
+
+// Max number of buffers (ticks) queued for an output with a writer thread.
+// If the output falls further behind the oldest are dropped.
+#define OUTPUTS_WRITER_QUEUE_MAX 32
+
+// For outputs that set "threaded", write() is called from a thread of its
+// own, so that a backend that blocks doesn't hold up the player and the other
+// outputs.
+struct output_writer
+{
+  pthread_t tid;
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  struct output_buffer *queue[OUTPUTS_WRITER_QUEUE_MAX];
+  int head;
+  int count;
+
+  int dropped;
+  bool stop;
+};
+
+static struct output_writer *outputs_writers[ARRAY_SIZE(outputs) - 1];
 static bool outputs_got_new_subscription;
 
+// Outputs that let us choose the quality, see outputs_quality_caps_add()
+static struct output_quality_caps *outputs_quality_caps;
+static bool outputs_got_new_caps;
+static const int outputs_quality_rates[] = OUTPUTS_QUALITY_RATES;
+
+static void
+quality_caps_update(struct media_quality *source, bool source_changed);
+
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
@@ -198,6 +258,24 @@ callback_add(struct output_device *device, output_status_cb cb)
   return callback_id;
 };
 
+static void
+start_latency_log(struct output_device *device, enum output_device_state state)
+{
+  struct timespec ts;
+  long ms;
+
+  if (device->start_ts.tv_sec == 0 && device->start_ts.tv_nsec == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ms = (ts.tv_sec - device->start_ts.tv_sec) * 1000L + (ts.tv_nsec - device->start_ts.tv_nsec) / 1000000L;
+
+  DPRINTF(E_INFO, L_PLAYER, "The %s device '%s' replied to start in %ld ms (state %d)\n", device->type_name, device->name, ms, state);
+
+  device->start_ts.tv_sec = 0;
+  device->start_ts.tv_nsec = 0;
+}
+
 static void
 deferred_cb(int fd, short what, void *arg)
 {
@@ -228,7 +306,10 @@ deferred_cb(int fd, short what, void *arg)
 	      device = NULL;
 	    }
 	  else if (device)
-	    device->state = state;
+	    {
+	      device->state = state;
+	      start_latency_log(device, state);
+	    }
 
 	  DPRINTF(E_DBG, L_PLAYER, "Making deferred callback to %s, id was %d\n", player_pmap(cb), callback_id);
 
@@ -277,12 +358,14 @@ quality_to_xcode(struct media_quality *quality)
   return XCODE_UNKNOWN;
 }
 
+// The resamplers are pooled, so when tracks alternate between qualities, or a
+// new subscription is added, the ones we already had are reused
 static int
 encoding_reset(struct media_quality *quality)
 {
-  struct transcode_encode_setup_args encode_args = { 0 };
   struct output_quality_subscription *subscription;
   enum transcode_profile profile;
+  enum transcode_profile dst_profile;
   int i;
 
   profile = quality_to_xcode(quality);
@@ -293,59 +376,152 @@ encoding_reset(struct media_quality *quality)
       return -1;
     }
 
-  encode_args.src_ctx = transcode_decode_setup_raw(profile, quality);
-  if (!encode_args.src_ctx)
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
     {
-      DPRINTF(E_LOG, L_PLAYER, "Could not create subscription decoding context (profile %d)\n", profile);
-      return -1;
+      subscription = &output_quality_subscriptions[i]; // Just for short-hand
+
+      transcode_encode_release(&subscription->encode_ctx); // Will also point the ctx to NULL
+      subscription->pcm_convert = false;
     }
 
   for (i = 0; output_quality_subscriptions[i].count > 0; i++)
     {
-      subscription = &output_quality_subscriptions[i]; // Just for short-hand
-
-      transcode_encode_cleanup(&subscription->encode_ctx); // Will also point the ctx to NULL
+      subscription = &output_quality_subscriptions[i];
 
       if (quality_is_equal(quality, &subscription->quality))
 	continue; // No resampling required
 
-      encode_args.profile = quality_to_xcode(&subscription->quality);
-      encode_args.quality = &subscription->quality;
-      if (encode_args.profile != XCODE_UNKNOWN)
-	subscription->encode_ctx = transcode_encode_setup(encode_args);
-      else
+      // Reducing bits with pcm.c means no dithering, so leave that to ffmpeg
+      if (quality->sample_rate == subscription->quality.sample_rate &&
+	  quality->channels == subscription->quality.channels &&
+	  pcm_convert_supported(subscription->quality.bits_per_sample, quality->bits_per_sample) &&
+	  (subscription->quality.bits_per_sample > quality->bits_per_sample || !subscription->resample.dither))
+	{
+	  subscription->pcm_convert = true;
+	  continue;
+	}
+
+      dst_profile = quality_to_xcode(&subscription->quality);
+      if (dst_profile != XCODE_UNKNOWN)
+	subscription->encode_ctx = transcode_encode_setup_pooled(dst_profile, &subscription->quality, profile, quality, &subscription->resample);
+
+      if (!subscription->encode_ctx)
 	DPRINTF(E_LOG, L_PLAYER, "Could not setup resampling to %d/%d/%d for output\n",
 	  subscription->quality.sample_rate, subscription->quality.bits_per_sample, subscription->quality.channels);
     }
 
-  transcode_decode_cleanup(&encode_args.src_ctx);
-
   return 0;
 }
 
+static struct output_frame *
+frame_get(void)
+{
+  struct output_frame *frame;
+
+  pthread_mutex_lock(&outputs_frame_pool_lck);
+  frame = outputs_frame_pool;
+  if (frame)
+    {
+      outputs_frame_pool = frame->next;
+      outputs_frame_pool_count--;
+    }
+  pthread_mutex_unlock(&outputs_frame_pool_lck);
+
+  if (!frame)
+    {
+      CHECK_NULL(L_PLAYER, frame = calloc(1, sizeof(struct output_frame)));
+      CHECK_NULL(L_PLAYER, frame->evbuf = evbuffer_new());
+    }
+
+  frame->refcount = 1;
+  frame->next = NULL;
+
+  return frame;
+}
+
+static void
+frame_ref(struct output_frame *frame)
+{
+  __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+frame_unref(struct output_frame *frame)
+{
+  if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  evbuffer_drain(frame->evbuf, -1);
+
+  pthread_mutex_lock(&outputs_frame_pool_lck);
+  if (outputs_frame_pool_count < OUTPUTS_FRAME_POOL_MAX)
+    {
+      frame->next = outputs_frame_pool;
+      outputs_frame_pool = frame;
+      outputs_frame_pool_count++;
+      frame = NULL;
+    }
+  pthread_mutex_unlock(&outputs_frame_pool_lck);
+
+  if (frame)
+    {
+      evbuffer_free(frame->evbuf);
+      free(frame);
+    }
+}
+
+static void
+frame_pool_clear(void)
+{
+  struct output_frame *frame;
+
+  pthread_mutex_lock(&outputs_frame_pool_lck);
+  while ((frame = outputs_frame_pool))
+    {
+      outputs_frame_pool = frame->next;
+      evbuffer_free(frame->evbuf);
+      free(frame);
+    }
+  outputs_frame_pool_count = 0;
+  pthread_mutex_unlock(&outputs_frame_pool_lck);
+}
+
 static void
 buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_quality *quality, int nsamples, struct timespec *pts)
 {
   transcode_frame *frame;
+  struct output_frame *oframe;
+  struct evbuffer_iovec iov;
+  bool quality_changed;
+  size_t len;
   int ret;
   int i;
   int n;
 
   obuf->pts = *pts;
 
+  quality_changed = !quality_is_equal(quality, &obuf->data[0].quality);
+
+  // Must come before the below, since it may change the subscriptions
+  if (quality_changed || outputs_got_new_caps)
+    {
+      quality_caps_update(quality, quality_changed);
+      outputs_got_new_caps = false;
+    }
+
   // The resampling/encoding (transcode) contexts work for a given input quality,
   // so if the quality changes we need to reset the contexts. We also do that if
   // we have received a subscription for a new quality.
-  if (!quality_is_equal(quality, &obuf->data[0].quality) || outputs_got_new_subscription)
+  if (quality_changed || outputs_got_new_subscription)
     {
       encoding_reset(quality);
       outputs_got_new_subscription = false;
     }
 
-  // The first element of the output_buffer is always just the raw input data
-  // TODO can we avoid the copy below? we can't use evbuffer_add_buffer_reference,
-  // because then the outputs can't use it and we would need to copy there instead
-  evbuffer_add(obuf->data[0].evbuf, buf, bufsize);
+  // The first element of the output_buffer is always just the raw input data.
+  // It is borrowed from the player, so it is only copied if an output takes a
+  // reference to it.
+  obuf->data[0].frame = NULL;
   obuf->data[0].buffer = buf;
   obuf->data[0].bufsize = bufsize;
   obuf->data[0].quality = *quality;
@@ -356,6 +532,31 @@ buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_
       if (quality_is_equal(&output_quality_subscriptions[i].quality, quality))
 	continue; // Skip, no resampling required and we have the data in element 0
 
+      if (output_quality_subscriptions[i].pcm_convert)
+	{
+	  oframe = frame_get();
+
+	  len = STOB(nsamples, output_quality_subscriptions[i].quality.bits_per_sample, quality->channels);
+	  if (evbuffer_reserve_space(oframe->evbuf, len, &iov, 1) != 1)
+	    {
+	      frame_unref(oframe);
+	      continue;
+	    }
+
+	  pcm_convert(iov.iov_base, output_quality_subscriptions[i].quality.bits_per_sample, buf, quality->bits_per_sample, nsamples * quality->channels);
+
+	  iov.iov_len = len;
+	  evbuffer_commit_space(oframe->evbuf, &iov, 1);
+
+	  obuf->data[n].frame   = oframe;
+	  obuf->data[n].buffer  = evbuffer_pullup(oframe->evbuf, -1);
+	  obuf->data[n].bufsize = len;
+	  obuf->data[n].quality = output_quality_subscriptions[i].quality;
+	  obuf->data[n].samples = nsamples;
+	  n++;
+	  continue;
+	}
+
       if (!output_quality_subscriptions[i].encode_ctx)
 	continue;
 
@@ -363,13 +564,19 @@ buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_
       if (!frame)
 	continue;
 
-      ret = transcode_encode(obuf->data[n].evbuf, output_quality_subscriptions[i].encode_ctx, frame, 0);
+      oframe = frame_get();
+
+      ret = transcode_encode(oframe->evbuf, output_quality_subscriptions[i].encode_ctx, frame, 0);
       transcode_frame_free(frame);
       if (ret < 0)
-	continue;
+	{
+	  frame_unref(oframe);
+	  continue;
+	}
 
-      obuf->data[n].buffer  = evbuffer_pullup(obuf->data[n].evbuf, -1);
-      obuf->data[n].bufsize = evbuffer_get_length(obuf->data[n].evbuf);
+      obuf->data[n].frame   = oframe;
+      obuf->data[n].buffer  = evbuffer_pullup(oframe->evbuf, -1);
+      obuf->data[n].bufsize = evbuffer_get_length(oframe->evbuf);
       obuf->data[n].quality = output_quality_subscriptions[i].quality;
       obuf->data[n].samples = BTOS(obuf->data[n].bufsize, obuf->data[n].quality.bits_per_sample, obuf->data[n].quality.channels);
       n++;
@@ -383,7 +590,9 @@ buffer_drain(struct output_buffer *obuf)
 
   for (i = 0; obuf->data[i].buffer; i++)
     {
-      evbuffer_drain(obuf->data[i].evbuf, obuf->data[i].bufsize);
+      if (obuf->data[i].frame)
+	frame_unref(obuf->data[i].frame);
+      obuf->data[i].frame   = NULL;
       obuf->data[i].buffer  = NULL;
       obuf->data[i].bufsize = 0;
       // We don't reset quality and samples, would be a waste of time
@@ -391,30 +600,39 @@ buffer_drain(struct output_buffer *obuf)
 }
 
 static struct output_buffer *
-buffer_copy(struct output_buffer *obuf)
+buffer_ref(struct output_buffer *obuf)
 {
-  struct output_buffer *copy;
+  struct output_buffer *ref;
+  struct output_frame *frame;
   int i;
 
   if (!obuf)
     return NULL;
 
-  CHECK_NULL(L_PLAYER, copy = malloc(sizeof(struct output_buffer)));
+  CHECK_NULL(L_PLAYER, ref = malloc(sizeof(struct output_buffer)));
 
-  memcpy(copy, obuf, sizeof(struct output_buffer));
+  memcpy(ref, obuf, sizeof(struct output_buffer));
 
   for (i = 0; obuf->data[i].buffer; i++)
     {
-      CHECK_NULL(L_PLAYER, copy->data[i].evbuf = evbuffer_new());
-      evbuffer_add(copy->data[i].evbuf, obuf->data[i].buffer, obuf->data[i].bufsize);
-      copy->data[i].buffer = evbuffer_pullup(copy->data[i].evbuf, -1);
+      if (obuf->data[i].frame)
+	{
+	  frame_ref(obuf->data[i].frame);
+	  continue;
+	}
+
+      // The player will reuse its buffer, so this is the one we must copy
+      frame = frame_get();
+      evbuffer_add(frame->evbuf, obuf->data[i].buffer, obuf->data[i].bufsize);
+      ref->data[i].frame = frame;
+      ref->data[i].buffer = evbuffer_pullup(frame->evbuf, -1);
     }
 
-  return copy;
+  return ref;
 }
 
 static void
-buffer_free(struct output_buffer *obuf)
+buffer_unref(struct output_buffer *obuf)
 {
   int i;
 
@@ -422,11 +640,167 @@ buffer_free(struct output_buffer *obuf)
     return;
 
   for (i = 0; obuf->data[i].buffer; i++)
-    evbuffer_free(obuf->data[i].evbuf);
+    frame_unref(obuf->data[i].frame);
 
   free(obuf);
 }
 
+
+/* ----------------------------- Writer threads ----------------------------- */
+
+/* Thread: output writer */
+static void *
+writer_thread(void *arg)
+{
+  struct output_definition *od = arg;
+  struct output_writer *writer = outputs_writers[od->type];
+  struct output_buffer *obuf;
+  char name[16];
+
+  snprintf(name, sizeof(name), "write %s", od->name);
+  thread_realtime_apply(name);
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&writer->lck));
+
+  while (!writer->stop)
+    {
+      if (writer->count == 0)
+	{
+	  CHECK_ERR(L_PLAYER, pthread_cond_wait(&writer->cond, &writer->lck));
+	  continue;
+	}
+
+      obuf = writer->queue[writer->head];
+      writer->head = (writer->head + 1) % OUTPUTS_WRITER_QUEUE_MAX;
+      writer->count--;
+
+      CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&writer->lck));
+
+      od->write(obuf);
+      buffer_unref(obuf);
+
+      CHECK_ERR(L_PLAYER, pthread_mutex_lock(&writer->lck));
+    }
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&writer->lck));
+
+  pthread_exit(NULL);
+}
+
+// Takes ownership of obuf
+static void
+writer_queue_add(struct output_writer *writer, struct output_buffer *obuf, const char *name)
+{
+  struct output_buffer *dropped = NULL;
+  int dropped_count = 0;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&writer->lck));
+
+  if (writer->count == OUTPUTS_WRITER_QUEUE_MAX)
+    {
+      dropped = writer->queue[writer->head];
+      writer->head = (writer->head + 1) % OUTPUTS_WRITER_QUEUE_MAX;
+      writer->count--;
+      dropped_count = ++writer->dropped;
+    }
+
+  writer->queue[(writer->head + writer->count) % OUTPUTS_WRITER_QUEUE_MAX] = obuf;
+  writer->count++;
+
+  CHECK_ERR(L_PLAYER, pthread_cond_signal(&writer->cond));
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&writer->lck));
+
+  if (!dropped)
+    return;
+
+  buffer_unref(dropped);
+
+  // Log the first and then every 100th, the output may be stuck for a while
+  if (dropped_count % 100 == 1)
+    DPRINTF(E_WARN, L_PLAYER, "Output '%s' is not keeping up, %d buffers dropped so far\n", name, dropped_count);
+}
+
+// Drops what is queued, e.g. before a flush, so that old audio isn't written
+// after it. A write that is in progress is not affected.
+static void
+writer_queue_clear(struct output_writer *writer)
+{
+  struct output_buffer *queue[OUTPUTS_WRITER_QUEUE_MAX];
+  int count;
+  int i;
+
+  if (!writer)
+    return;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&writer->lck));
+
+  for (i = 0; i < writer->count; i++)
+    queue[i] = writer->queue[(writer->head + i) % OUTPUTS_WRITER_QUEUE_MAX];
+
+  count = writer->count;
+  writer->head = 0;
+  writer->count = 0;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&writer->lck));
+
+  for (i = 0; i < count; i++)
+    buffer_unref(queue[i]);
+}
+
+static int
+writer_start(struct output_definition *od)
+{
+  struct output_writer *writer;
+  char name[16];
+  int ret;
+
+  CHECK_NULL(L_PLAYER, writer = calloc(1, sizeof(struct output_writer)));
+  CHECK_ERR(L_PLAYER, mutex_init(&writer->lck));
+  CHECK_ERR(L_PLAYER, pthread_cond_init(&writer->cond, NULL));
+
+  outputs_writers[od->type] = writer;
+
+  ret = pthread_create(&writer->tid, NULL, writer_thread, od);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not spawn writer thread for output '%s': %s\n", od->name, strerror(ret));
+
+      outputs_writers[od->type] = NULL;
+      pthread_cond_destroy(&writer->cond);
+      pthread_mutex_destroy(&writer->lck);
+      free(writer);
+      return -1;
+    }
+
+  snprintf(name, sizeof(name), "write %s", od->name);
+  thread_setname(writer->tid, name);
+
+  return 0;
+}
+
+static void
+writer_stop(struct output_definition *od)
+{
+  struct output_writer *writer = outputs_writers[od->type];
+
+  if (!writer)
+    return;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&writer->lck));
+  writer->stop = true;
+  CHECK_ERR(L_PLAYER, pthread_cond_signal(&writer->cond));
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&writer->lck));
+
+  CHECK_ERR(L_PLAYER, pthread_join(writer->tid, NULL));
+
+  writer_queue_clear(writer);
+
+  outputs_writers[od->type] = NULL;
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->lck);
+  free(writer);
+}
+
 static void
 device_list_sort(void)
 {
@@ -530,7 +904,7 @@ metadata_send(enum output_types type, uint32_t item_id, bool startup, output_met
   metadata->ev = event_new(evbase_player, -1, 0, metadata_cb_send, metadata);
 
   if (outputs[type]->metadata_prepare)
-    worker_execute(metadata_cb_prepare, &metadata, sizeof(struct output_metadata *), 0);
+    worker_execute_priority(metadata_cb_prepare, &metadata, sizeof(struct output_metadata *), 0, WORKER_PRIORITY_HIGH);
   else
     outputs[type]->metadata_send(metadata);
 }
@@ -643,11 +1017,74 @@ outputs_device_session_remove(uint64_t device_id)
   return;
 }
 
+// Reads the resampler settings from the config section of the output type.
+// Types without a section of their own get ffmpeg's defaults.
+static void
+resample_settings_get(struct transcode_resample *resample, enum output_types type)
+{
+  cfg_t *cfg_section;
+  const char *quality;
+
+  memset(resample, 0, sizeof(struct transcode_resample));
+
+  switch (type)
+    {
+      case OUTPUT_TYPE_RAOP:
+      case OUTPUT_TYPE_AIRPLAY:
+	cfg_section = cfg_getsec(cfg, "airplay_shared");
+	break;
+      case OUTPUT_TYPE_ALSA:
+      case OUTPUT_TYPE_PULSE:
+	cfg_section = cfg_getsec(cfg, "audio");
+	break;
+      case OUTPUT_TYPE_FIFO:
+	cfg_section = cfg_getsec(cfg, "fifo");
+	break;
+      case OUTPUT_TYPE_STREAMING:
+	cfg_section = cfg_getsec(cfg, "streaming");
+	break;
+      default:
+	return;
+    }
+
+  quality = cfg_getstr(cfg_section, "resample_quality");
+  if (strcasecmp(quality, "low") == 0)
+    resample->quality = XCODE_RESAMPLE_LOW;
+  else if (strcasecmp(quality, "medium") == 0)
+    resample->quality = XCODE_RESAMPLE_MEDIUM;
+  else if (strcasecmp(quality, "high") == 0)
+    resample->quality = XCODE_RESAMPLE_HIGH;
+  else
+    DPRINTF(E_WARN, L_PLAYER, "Invalid resample_quality '%s' for output type %s, using default\n", quality, outputs_name(type));
+
+  resample->dither = cfg_getbool(cfg_section, "resample_dither");
+}
+
+// Outputs sharing a quality level share the encoder, so they get the highest
+// resampler quality any of them asked for
+static void
+resample_settings_merge(struct output_quality_subscription *subscription, struct transcode_resample *resample)
+{
+  if (resample->quality > subscription->resample.quality)
+    {
+      subscription->resample.quality = resample->quality;
+      outputs_got_new_subscription = true;
+    }
+  if (resample->dither && !subscription->resample.dither)
+    {
+      subscription->resample.dither = true;
+      outputs_got_new_subscription = true;
+    }
+}
+
 int
-outputs_quality_subscribe(struct media_quality *quality)
+outputs_quality_subscribe(struct media_quality *quality, enum output_types type)
 {
+  struct transcode_resample resample;
   int i;
 
+  resample_settings_get(&resample, type);
+
   // If someone else is already subscribing to this quality we just increase the
   // reference count.
   for (i = 0; output_quality_subscriptions[i].count > 0; i++)
@@ -656,6 +1093,7 @@ outputs_quality_subscribe(struct media_quality *quality)
 	continue;
 
       output_quality_subscriptions[i].count++;
+      resample_settings_merge(&output_quality_subscriptions[i], &resample);
 
       DPRINTF(E_DBG, L_PLAYER, "Subscription request for quality %d/%d/%d (now %d subscribers)\n",
 	quality->sample_rate, quality->bits_per_sample, quality->channels, output_quality_subscriptions[i].count);
@@ -670,6 +1108,7 @@ outputs_quality_subscribe(struct media_quality *quality)
     }
 
   output_quality_subscriptions[i].quality = *quality;
+  output_quality_subscriptions[i].resample = resample;
   output_quality_subscriptions[i].count++;
 
   DPRINTF(E_DBG, L_PLAYER, "Subscription request for quality %d/%d/%d (now %d subscribers)\n",
@@ -707,13 +1146,147 @@ outputs_quality_unsubscribe(struct media_quality *quality)
   if (output_quality_subscriptions[i].count > 0)
     return;
 
-  transcode_encode_cleanup(&output_quality_subscriptions[i].encode_ctx);
+  transcode_encode_release(&output_quality_subscriptions[i].encode_ctx);
 
   // Shift elements
   for (; i < ARRAY_SIZE(output_quality_subscriptions) - 1; i++)
     output_quality_subscriptions[i] = output_quality_subscriptions[i + 1];
 }
 
+static bool
+quality_caps_supports(struct output_quality_caps *caps, struct media_quality *quality)
+{
+  int i;
+
+  if (quality->channels != caps->channels || !(caps->bits_per_sample & OUTPUTS_QUALITY_BITS(quality->bits_per_sample)))
+    return false;
+
+  for (i = 0; i < ARRAY_SIZE(outputs_quality_rates); i++)
+    {
+      if (outputs_quality_rates[i] == quality->sample_rate)
+	return (caps->sample_rates & (1 << i));
+    }
+
+  return false;
+}
+
+// Selects the quality requiring the least work. The cheapest is the source
+// quality, then one that we are producing anyway for another output, then just
+// a change of bit depth (pcm.c) and last a resample to the fallback quality.
+static void
+quality_caps_select(struct media_quality *selected, struct output_quality_caps *caps, struct media_quality *source)
+{
+  struct media_quality candidate;
+  int bits[] = { 16, 32, 24 };
+  int i;
+
+  if (quality_caps_supports(caps, source))
+    {
+      *selected = *source;
+      return;
+    }
+
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
+    {
+      if (quality_caps_supports(caps, &output_quality_subscriptions[i].quality))
+	{
+	  *selected = output_quality_subscriptions[i].quality;
+	  return;
+	}
+    }
+
+  candidate = *source;
+  for (i = 0; i < ARRAY_SIZE(bits); i++)
+    {
+      candidate.bits_per_sample = bits[i];
+      if (pcm_convert_supported(bits[i], source->bits_per_sample) && quality_caps_supports(caps, &candidate))
+	{
+	  *selected = candidate;
+	  return;
+	}
+    }
+
+  *selected = caps->fallback;
+}
+
+// Called before encoding_reset() so that the subscriptions are in place for the
+// first buffer with a new source quality
+static void
+quality_caps_update(struct media_quality *source, bool source_changed)
+{
+  struct output_quality_caps *caps;
+  struct media_quality selected;
+
+  for (caps = outputs_quality_caps; caps; caps = caps->next)
+    {
+      // Already running outputs keep their quality until the source changes
+      if (!source_changed && caps->selected.sample_rate != 0)
+	continue;
+
+      if (caps->subscribed)
+	outputs_quality_unsubscribe(&caps->selected);
+      caps->subscribed = false;
+
+      quality_caps_select(&selected, caps, source);
+      if (!quality_is_equal(&selected, source))
+	{
+	  if (outputs_quality_subscribe(&selected, caps->type) < 0)
+	    selected = *source; // The output will fail when it doesn't get the quality it can play
+	  else
+	    caps->subscribed = true;
+	}
+
+      if (!quality_is_equal(&selected, &caps->selected))
+	DPRINTF(E_DBG, L_PLAYER, "Selected quality %d/%d/%d for %s output (source is %d/%d/%d)\n",
+	  selected.sample_rate, selected.bits_per_sample, selected.channels, outputs_name(caps->type),
+	  source->sample_rate, source->bits_per_sample, source->channels);
+
+      caps->selected = selected;
+    }
+}
+
+int
+outputs_quality_caps_add(struct output_quality_caps *caps, enum output_types type)
+{
+  caps->type = type;
+  caps->subscribed = false;
+  memset(&caps->selected, 0, sizeof(struct media_quality));
+
+  if (caps->channels <= 0 || caps->fallback.sample_rate == 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Invalid quality capabilities from %s output\n", outputs_name(type));
+      return -1;
+    }
+
+  caps->next = outputs_quality_caps;
+  outputs_quality_caps = caps;
+
+  // Selection is made with the next buffer_fill(), when we know the source
+  outputs_got_new_caps = true;
+
+  return 0;
+}
+
+void
+outputs_quality_caps_remove(struct output_quality_caps *caps)
+{
+  struct output_quality_caps **p;
+
+  for (p = &outputs_quality_caps; *p && *p != caps; p = &(*p)->next)
+    ; /* EMPTY */
+
+  if (!*p)
+    return;
+
+  *p = caps->next;
+
+  if (caps->subscribed)
+    outputs_quality_unsubscribe(&caps->selected);
+
+  caps->subscribed = false;
+  caps->next = NULL;
+}
+
 // Output backends call back through the below wrapper to make sure that:
 // 1. Callbacks are always deferred
 // 2. The callback never has a dangling pointer to a device (a device that has been removed from our list)
@@ -744,15 +1317,15 @@ outputs_metadata_free(struct output_metadata *metadata)
 }
 
 struct output_buffer *
-outputs_buffer_copy(struct output_buffer *buffer)
+outputs_buffer_ref(struct output_buffer *buffer)
 {
-  return buffer_copy(buffer);
+  return buffer_ref(buffer);
 }
 
 void
-outputs_buffer_free(struct output_buffer *buffer)
+outputs_buffer_unref(struct output_buffer *buffer)
 {
-  buffer_free(buffer);
+  buffer_unref(buffer);
 }
 
 /* ---------------------------- Called by player ---------------------------- */
@@ -935,12 +1508,17 @@ outputs_device_start(struct output_device *device, output_status_cb cb, bool onl
   if (device->session)
     return 0; // Device is already running, nothing to do
 
+  clock_gettime(CLOCK_MONOTONIC, &device->start_ts);
+
   if (only_probe)
     ret = outputs[device->type]->device_probe(device, callback_add(device, cb));
   else
     ret = outputs[device->type]->device_start(device, callback_add(device, cb));
 
-  return device_state_update(device, ret);;
+  if (ret <= 0)
+    memset(&device->start_ts, 0, sizeof(device->start_ts));
+
+  return device_state_update(device, ret);
 }
 
 int
@@ -954,6 +1532,8 @@ outputs_device_stop(struct output_device *device, output_status_cb cb)
   if (!device->session)
     return 0; // Device is already stopped, nothing to do
 
+  writer_queue_clear(outputs_writers[device->type]);
+
   ret = outputs[device->type]->device_stop(device, callback_add(device, cb));
 
   return device_state_update(device, ret);
@@ -986,6 +1566,8 @@ outputs_device_flush(struct output_device *device, output_status_cb cb)
   if (!device->session)
     return 0; // Nothing to flush
 
+  writer_queue_clear(outputs_writers[device->type]);
+
   ret = outputs[device->type]->device_flush(device, callback_add(device, cb));
 
   return ret; // We don't change device state just because of a failed flush
@@ -1068,6 +1650,50 @@ outputs_device_cb_set(struct output_device *device, output_status_cb cb)
   outputs[device->type]->device_cb_set(device, callback_add(device, cb));
 }
 
+// Hands the pending callbacks to from_cb over to to_cb, including the ones the
+// backends have made that haven't been delivered yet
+void
+outputs_cb_replace(output_status_cb from_cb, output_status_cb to_cb)
+{
+  int callback_id;
+
+  for (callback_id = 0; callback_id < ARRAY_SIZE(outputs_cb_register); callback_id++)
+    {
+      if (outputs_cb_register[callback_id].cb == from_cb)
+	outputs_cb_register[callback_id].cb = to_cb;
+    }
+}
+
+// Stores a latency/drift measurement in the device's stats, and tells clients
+// that outputs changed, though not more often than OUTPUTS_STATS_NOTIFY_INTERVAL.
+void
+outputs_device_stats_sample(struct output_device *device, int latency_ms, int drift_ppm)
+{
+  struct output_stats *stats = &device->stats;
+  struct output_stats_sample *sample;
+  time_t now;
+
+  now = time(NULL);
+
+  stats->latency_ms = latency_ms;
+  stats->drift_ppm = drift_ppm;
+
+  sample = &stats->history[stats->history_pos];
+  sample->time = now;
+  sample->latency_ms = latency_ms;
+  sample->drift_ppm = drift_ppm;
+
+  stats->history_pos = (stats->history_pos + 1) % OUTPUTS_STATS_HISTORY;
+  if (stats->history_len < OUTPUTS_STATS_HISTORY)
+    stats->history_len++;
+
+  if (now - outputs_stats_notify_last < OUTPUTS_STATS_NOTIFY_INTERVAL)
+    return;
+
+  outputs_stats_notify_last = now;
+  listener_notify(LISTENER_SPEAKER);
+}
+
 void
 outputs_device_free(struct output_device *device)
 {
@@ -1225,22 +1851,51 @@ outputs_sessions_count(void)
   return count;
 }
 
+// Returns true if none of the running sessions need low latency writes. Note
+// that streaming sessions are not in the device list, but they are buffered.
+bool
+outputs_sessions_buffered(void)
+{
+  struct output_device *device;
+
+  for (device = outputs_device_list; device; device = device->next)
+    if (device->session && !outputs[device->type]->buffered)
+      return false;
+
+  return true;
+}
+
 void
 outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *quality, struct timespec *pts)
 {
+  struct output_buffer *shared = NULL;
+  struct timespec start;
+  struct timespec end;
   int i;
 
   buffer_fill(&output_buffer, buf, bufsize, quality, nsamples, pts);
 
   for (i = 0; outputs[i]; i++)
     {
-      if (outputs[i]->disabled)
+      if (outputs[i]->disabled || !outputs[i]->write)
 	continue;
 
-      if (outputs[i]->write)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (outputs_writers[i])
+	{
+	  // The player's data is copied once, the writers share the copy
+	  if (!shared)
+	    shared = buffer_ref(&output_buffer);
+	  writer_queue_add(outputs_writers[i], buffer_ref(shared), outputs[i]->name);
+	}
+      else
 	outputs[i]->write(&output_buffer);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      histogram_add(&outputs_write_stats[i], (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000);
     }
 
+  buffer_unref(shared);
   buffer_drain(&output_buffer);
 }
 
@@ -1284,6 +1939,25 @@ outputs_name(enum output_types type)
   return outputs[type]->name;
 }
 
+int
+outputs_stats_get(struct player_stats_output *stats, int max)
+{
+  int n;
+  int i;
+
+  for (i = 0, n = 0; outputs[i] && n < max; i++)
+    {
+      if (outputs[i]->disabled || !outputs[i]->write)
+	continue;
+
+      stats[n].name = outputs[i]->name;
+      stats[n].write_us = outputs_write_stats[i];
+      n++;
+    }
+
+  return n;
+}
+
 struct output_device *
 outputs_list(void)
 {
@@ -1299,6 +1973,10 @@ outputs_init(void)
 
   outputs_master_volume = -1;
 
+  pcm_init();
+
+  CHECK_ERR(L_PLAYER, mutex_init(&outputs_frame_pool_lck));
+
   CHECK_NULL(L_PLAYER, outputs_deferredev = evtimer_new(evbase_player, deferred_cb, NULL));
 
   no_output = 1;
@@ -1323,17 +2001,21 @@ outputs_init(void)
 
       ret = outputs[i]->init();
       if (ret < 0)
-	outputs[i]->disabled = 1;
-      else
-	no_output = 0;
+	{
+	  outputs[i]->disabled = 1;
+	  continue;
+	}
+
+      no_output = 0;
+
+      // If there is no thread the output still works, just not isolated
+      if (outputs[i]->threaded && outputs[i]->write)
+	writer_start(outputs[i]);
     }
 
   if (no_output)
     return -1;
 
-  for (i = 0; i < ARRAY_SIZE(output_buffer.data); i++)
-    output_buffer.data[i].evbuf = evbuffer_new();
-
   return 0;
 }
 
@@ -1349,6 +2031,8 @@ outputs_deinit(void)
       if (outputs[i]->disabled)
 	continue;
 
+      writer_stop(outputs[i]);
+
       if (outputs[i]->deinit)
         outputs[i]->deinit();
     }
@@ -1361,7 +2045,10 @@ outputs_deinit(void)
 	memset(&output_quality_subscriptions[i], 0, sizeof(struct output_quality_subscription));
       }
 
-  for (i = 0; i < ARRAY_SIZE(output_buffer.data); i++)
-    evbuffer_free(output_buffer.data[i].evbuf);
+  transcode_encode_pool_clear();
+
+  buffer_drain(&output_buffer);
+  frame_pool_clear();
+  pthread_mutex_destroy(&outputs_frame_pool_lck);
 }
 
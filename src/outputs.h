@@ -35,6 +35,13 @@
 // as one.
 #define OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS 5
 
+// Outputs that can play more than one quality (like ALSA and Pulseaudio) should
+// instead tell the output module what they support, see struct
+// output_quality_caps. The sample rates are given as a bitmask, where each bit
+// is the index of the rate in the below list.
+#define OUTPUTS_QUALITY_RATES { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000 }
+#define OUTPUTS_QUALITY_BITS(bits_per_sample) (1 << ((bits_per_sample) / 8))
+
 // Number of seconds the outputs should buffer before starting playback. Note
 // this value cannot freely be changed because 1) some Airplay devices ignore
 // the values we give and stick to 2 seconds, 2) those devices that can handle
@@ -94,6 +101,46 @@ enum output_device_state
 
 /* Linked list of device info used by the player for each device
  */
+// Number of latency/drift samples kept in struct output_stats
+#define OUTPUTS_STATS_HISTORY 32
+
+struct output_stats_sample
+{
+  time_t time;
+  int latency_ms;
+  int drift_ppm;
+};
+
+// Measurements and counters that backends fill in to help diagnose sync and
+// network issues. Backends only set what applies to them, the rest stays 0.
+struct output_stats
+{
+  // Packets that the device asked to have retransmitted, split by whether we
+  // still had them (RTP based backends)
+  uint32_t resend_hits;
+  uint32_t resend_misses;
+
+  // Buffer underruns and overruns (local audio and fifo)
+  uint32_t underruns;
+  uint32_t overruns;
+
+  // Number of times the backend adjusted playback to keep sync
+  uint32_t corrections;
+
+  uint64_t bytes_sent;
+
+  // Smoothed round trip time of audio packets (Chromecast)
+  int rtt_ms;
+
+  // Latest latency and drift measurement, and a ring with the recent ones,
+  // set with outputs_device_stats_sample()
+  int latency_ms;
+  int drift_ppm;
+  struct output_stats_sample history[OUTPUTS_STATS_HISTORY];
+  int history_pos;
+  int history_len;
+};
+
 struct output_device
 {
   // Device id
@@ -135,6 +182,12 @@ struct output_device
   // Quality of audio output
   struct media_quality quality;
 
+  // Diagnostics filled in by the backend
+  struct output_stats stats;
+
+  // When the device was asked to start, zero when it has replied
+  struct timespec start_ts;
+
   // selected_format only set (not UNKNOWN) in case of active user selection
   enum media_format selected_format;
   enum media_format default_format;
@@ -146,9 +199,8 @@ struct output_device
   short v4_port;
   short v6_port;
 
-  // Only used for streaming
-  int audio_fd;
-  int metadata_fd;
+  // Only used for streaming, activated when there is new audio to read
+  struct event *audio_ev;
 
   struct event *stop_timer;
 
@@ -179,10 +231,37 @@ struct output_metadata
   output_metadata_finalize_cb finalize_cb;
 };
 
+// Registered with outputs_quality_caps_add(). Each time the source quality
+// changes the output module selects the supported quality that requires the
+// least conversion: The source quality itself, a quality that other outputs
+// have subscribed to or one that pcm.c can convert to. The fallback is only
+// used if none of those are supported.
+struct output_quality_caps
+{
+  // Set by the backend
+  uint32_t sample_rates; // Bitmask of indices in OUTPUTS_QUALITY_RATES
+  uint32_t bits_per_sample; // Bitmask of OUTPUTS_QUALITY_BITS()
+  int channels;
+  struct media_quality fallback;
+
+  // Set by outputs.c, this is the quality the backend will find in the
+  // output_buffer
+  struct media_quality selected;
+
+  enum output_types type;
+  bool subscribed;
+  struct output_quality_caps *next;
+};
+
+// Refcounted storage of audio data, see outputs_buffer_ref()
+struct output_frame;
+
 struct output_data
 {
   struct media_quality quality;
-  struct evbuffer *evbuf;
+  // Owner of buffer. NULL if the buffer is the player's, which is only valid
+  // during the output's write().
+  struct output_frame *frame;
   uint8_t *buffer;
   size_t bufsize;
   int samples;
@@ -214,6 +293,18 @@ struct output_definition
   // Set to 1 if the output initialization failed
   int disabled;
 
+  // Set to 1 if the output has a deep buffer (e.g. a pipe), so that it doesn't
+  // need a write every tick, but can take several ticks of data at a time
+  int buffered;
+
+  // Set to 1 if write() may block, e.g. on a full device buffer. It is then
+  // called from a writer thread with a queue of buffer refs, so that it can't
+  // hold up the player and the other outputs. The backend must make write()
+  // safe against its other callbacks, which are still called by the player
+  // thread, and only call outputs_* functions from the player thread. Queued
+  // buffers are dropped before device_stop() and device_flush().
+  int threaded;
+
   // Initialization function called during startup
   // Output must call device_cb when an output device becomes available/unavailable
   int (*init)(void);
@@ -285,22 +376,31 @@ void
 outputs_device_session_remove(uint64_t device_id);
 
 int
-outputs_quality_subscribe(struct media_quality *quality);
+outputs_quality_subscribe(struct media_quality *quality, enum output_types type);
 
 void
 outputs_quality_unsubscribe(struct media_quality *quality);
 
+int
+outputs_quality_caps_add(struct output_quality_caps *caps, enum output_types type);
+
+void
+outputs_quality_caps_remove(struct output_quality_caps *caps);
+
 void
 outputs_cb(int callback_id, uint64_t device_id, enum output_device_state);
 
 void
 outputs_metadata_free(struct output_metadata *metadata);
 
+// For outputs that need to keep the data after write() returns. Instead of
+// copying the data, the returned buffer holds a reference to it, which must be
+// released with outputs_buffer_unref(). Thread safe.
 struct output_buffer *
-outputs_buffer_copy(struct output_buffer *buffer);
+outputs_buffer_ref(struct output_buffer *buffer);
 
 void
-outputs_buffer_free(struct output_buffer *buffer);
+outputs_buffer_unref(struct output_buffer *buffer);
 
 /* ---------------------------- Called by player ---------------------------- */
 
@@ -349,6 +449,12 @@ outputs_device_authorize(struct output_device *device, const char *pin, output_s
 void
 outputs_device_cb_set(struct output_device *device, output_status_cb cb);
 
+void
+outputs_cb_replace(output_status_cb from_cb, output_status_cb to_cb);
+
+void
+outputs_device_stats_sample(struct output_device *device, int latency_ms, int drift_ppm);
+
 void
 outputs_device_free(struct output_device *device);
 
@@ -373,6 +479,14 @@ outputs_stop_delayed_cancel(void);
 int
 outputs_sessions_count(void);
 
+bool
+outputs_sessions_buffered(void);
+
+struct player_stats_output;
+
+int
+outputs_stats_get(struct player_stats_output *stats, int max);
+
 void
 outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *quality, struct timespec *pts);
 
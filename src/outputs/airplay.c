@@ -104,6 +104,9 @@
 // https://github.com/owntone/owntone-server/issues/734#issuecomment-622959334
 #define AIRPLAY_KEEP_ALIVE_INTERVAL   25
 
+// Max number of RTSP requests sent before getting the replies
+#define AIRPLAY_RTSP_PIPELINE_MAX     4
+
 // This is an arbitrary value which just needs to be kept in sync with the config
 #define AIRPLAY_CONFIG_MAX_VOLUME     11
 
@@ -223,6 +226,12 @@ struct airplay_master_session
   // compared to the rtptimes of the corresponding RTP packages we are sending)
   int output_buffer_samples;
 
+  // Time spent encoding and encrypting since the cost was last logged, see
+  // packets_cost_log()
+  uint64_t encode_ns;
+  uint64_t encrypt_ns;
+  int ticks;
+
   struct airplay_master_session *next;
 };
 
@@ -283,6 +292,10 @@ struct airplay_session
   gcry_cipher_hd_t packet_cipher_hd;
 
   int server_fd;
+  // Audio packets waiting to be sent on server_fd
+  struct rtp_batch *batch;
+  // The encrypted packet last added to batch, valid during packets_send()
+  uint8_t *queued;
 
   struct airplay_service *timing_svc;
   struct airplay_service *control_svc;
@@ -302,6 +315,9 @@ struct airplay_service
   int fd;
   unsigned short port;
   struct event *ev;
+
+  // Packets to send to devices on this service's socket
+  struct rtp_batch *batch;
 };
 
 /* NTP timestamp definitions */
@@ -466,6 +482,20 @@ sequence_continue(struct airplay_seq_ctx *seq_ctx);
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
+// The retransmit buffer adapts to the devices, within bounds set in the config
+static void
+pktbuf_bounds_set(struct rtp_session *rtp_session, struct media_quality *quality)
+{
+  cfg_t *cfg_airplay = cfg_getsec(cfg, "airplay_shared");
+  size_t min;
+  size_t max;
+
+  min = (size_t)cfg_getint(cfg_airplay, "retransmit_buffer_min_ms") * quality->sample_rate / 1000 / AIRPLAY_SAMPLES_PER_PACKET;
+  max = (size_t)cfg_getint(cfg_airplay, "retransmit_buffer_max_ms") * quality->sample_rate / 1000 / AIRPLAY_SAMPLES_PER_PACKET;
+
+  rtp_session_pktbuf_adapt(rtp_session, min, max);
+}
+
 static inline int
 alac_encode(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, uint8_t *rawbuf, size_t rawbuf_size, int nsamples, struct media_quality *quality)
 {
@@ -1076,7 +1106,7 @@ master_session_free(struct airplay_master_session *rms)
   outputs_quality_unsubscribe(&rms->rtp_session->quality);
   rtp_session_free(rms->rtp_session);
 
-  transcode_encode_cleanup(&rms->encode_ctx);
+  transcode_encode_release(&rms->encode_ctx);
 
   if (rms->input_buffer)
     evbuffer_free(rms->input_buffer);
@@ -1120,7 +1150,6 @@ static struct airplay_master_session *
 master_session_make(struct media_quality *quality)
 {
   struct airplay_master_session *rms;
-  struct transcode_encode_setup_args encode_args = { .profile = XCODE_ALAC, .quality = quality };
   int ret;
 
   // First check if we already have a suitable session
@@ -1131,7 +1160,7 @@ master_session_make(struct media_quality *quality)
     }
 
   // Let's create a master session
-  ret = outputs_quality_subscribe(quality);
+  ret = outputs_quality_subscribe(quality, OUTPUT_TYPE_AIRPLAY);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Could not subscribe to required audio quality (%d/%d/%d)\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
@@ -1141,20 +1170,15 @@ master_session_make(struct media_quality *quality)
   CHECK_NULL(L_AIRPLAY, rms = calloc(1, sizeof(struct airplay_master_session)));
 
   rms->rtp_session = rtp_session_new(quality, AIRPLAY_PACKET_BUFFER_SIZE, 0);
+  if (rms->rtp_session)
+    pktbuf_bounds_set(rms->rtp_session, quality);
   if (!rms->rtp_session)
     {
       goto error;
     }
 
-  encode_args.src_ctx = transcode_decode_setup_raw(XCODE_PCM16, quality);
-  if (!encode_args.src_ctx)
-    {
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not create decoding context\n");
-      goto error;
-    }
-
-  rms->encode_ctx = transcode_encode_setup(encode_args);
-  transcode_decode_cleanup(&encode_args.src_ctx);
+  // Sessions come and go with the speakers, so reuse the encoder if possible
+  rms->encode_ctx = transcode_encode_setup_pooled(XCODE_ALAC, quality, XCODE_PCM16, quality, NULL);
   if (!rms->encode_ctx)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Will not be able to stream AirPlay 2, ffmpeg has no ALAC encoder\n");
@@ -1201,6 +1225,8 @@ session_free(struct airplay_session *rs)
   if (rs->server_fd >= 0)
     close(rs->server_fd);
 
+  rtp_batch_free(rs->batch);
+
   chacha_close(rs->packet_cipher_hd);
 
   pair_setup_free(rs->pair_setup_ctx);
@@ -1384,6 +1410,10 @@ session_connection_setup(struct airplay_session *rs, struct output_device *rd, i
 
   evrtsp_connection_set_base(rs->ctrl, evbase_player);
 
+  // Metadata and volume updates are queued as independent sequences, which can
+  // then be sent without waiting for each reply
+  evrtsp_connection_set_pipelining(rs->ctrl, AIRPLAY_RTSP_PIPELINE_MAX);
+
   rs->address = strdup(address);
   rs->family = family;
 
@@ -1538,6 +1568,7 @@ session_make(struct output_device *rd, int callback_id)
   rs->callback_id = callback_id;
 
   rs->server_fd = -1;
+  CHECK_NULL(L_AIRPLAY, rs->batch = rtp_batch_new());
 
   rs->password = rd->password;
 
@@ -1845,8 +1876,12 @@ airplay_keep_alive_timer_cb(int fd, short what, void *arg)
 
 /* -------------------- Creation and sending of RTP packets  ---------------- */
 
+// Length of the encrypted packet, which has the authtag and part of the nonce
+// appended, see packet_encrypt()
+#define PACKET_ENCRYPTED_LEN(pkt) ((pkt)->data_len + 16 + 12 - 4)
+
 static int
-packet_encrypt(uint8_t **out, size_t *out_len, struct rtp_packet *pkt, struct airplay_session *rs)
+packet_encrypt(uint8_t *out, struct rtp_packet *pkt, struct airplay_session *rs)
 {
   uint8_t authtag[16];
   uint8_t nonce[12] = { 0 };
@@ -1854,10 +1889,7 @@ packet_encrypt(uint8_t **out, size_t *out_len, struct rtp_packet *pkt, struct ai
   uint8_t *write_ptr;
   int ret;
 
-  // Alloc so authtag and nonce can be appended
-  *out_len = pkt->data_len + sizeof(authtag) + sizeof(nonce) - nonce_offset;
-  *out = malloc(*out_len);
-  write_ptr = *out;
+  write_ptr = out;
 
   // Using seqnum as nonce not very secure, but means that when we resend
   // packets they will be identical to the original
@@ -1865,15 +1897,12 @@ packet_encrypt(uint8_t **out, size_t *out_len, struct rtp_packet *pkt, struct ai
 
   // The RTP header is not encrypted
   memcpy(write_ptr, pkt->header, pkt->header_len);
-  write_ptr = *out + pkt->header_len;
+  write_ptr = out + pkt->header_len;
 
   // Timestamp and SSRC are used as AAD = pkt->header + 4, len 8
   ret = chacha_encrypt(write_ptr, pkt->payload, pkt->payload_len, pkt->header + 4, 8, authtag, sizeof(authtag), nonce, sizeof(nonce), rs->packet_cipher_hd);
   if (ret < 0)
-    {
-      free(*out);
-      return -1;
-    }
+    return -1;
 
   write_ptr += pkt->payload_len;
   memcpy(write_ptr, authtag, sizeof(authtag));
@@ -1884,21 +1913,11 @@ packet_encrypt(uint8_t **out, size_t *out_len, struct rtp_packet *pkt, struct ai
 }
 
 static int
-packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+packets_flush(struct airplay_session *rs)
 {
-  uint8_t *encrypted;
-  size_t encrypted_len;
   int ret;
 
-  if (!rs)
-    return -1;
-
-  ret = packet_encrypt(&encrypted, &encrypted_len, pkt, rs);
-  if (ret < 0)
-    return -1;
-
-  ret = send(rs->server_fd, encrypted, encrypted_len, 0);
-  free(encrypted);
+  ret = rtp_batch_flush(rs->batch, rs->server_fd);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Send error for '%s': %s\n", rs->devname, strerror(errno));
@@ -1908,12 +1927,42 @@ packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
       deferred_session_failure(rs);
       return -1;
     }
-  else if (ret != encrypted_len)
+
+  return 0;
+}
+
+// Queues the packet, the caller must call packets_flush() when done
+static int
+packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  uint8_t *encrypted;
+  size_t encrypted_len;
+  int ret;
+
+  if (!rs)
+    return -1;
+
+  // Encrypted straight into the batch
+  encrypted_len = PACKET_ENCRYPTED_LEN(pkt);
+  encrypted = rtp_batch_next(rs->batch, encrypted_len, NULL, 0);
+  if (!encrypted)
     {
-      DPRINTF(E_WARN, L_AIRPLAY, "Partial send (%d) for '%s'\n", ret, rs->devname);
+      if (packets_flush(rs) < 0)
+	return -1;
+
+      encrypted = rtp_batch_next(rs->batch, encrypted_len, NULL, 0);
+    }
+
+  ret = packet_encrypt(encrypted, pkt, rs);
+  if (ret < 0)
+    {
+      // Drop it again
+      rs->batch->count--;
       return -1;
     }
 
+  rs->queued = encrypted;
+
 /*  DPRINTF(E_DBG, L_AIRPLAY, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
     rs->master_session->rtp_session->seqnum,
     rs->master_session->rtp_session->pos,
@@ -1924,11 +1973,21 @@ packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
   return 0;
 }
 
+static void
+control_packets_flush(struct airplay_service *svc)
+{
+  int ret;
+
+  ret = rtp_batch_flush(svc->batch, svc->fd);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_AIRPLAY, "Could not send playback sync to devices: %s\n", strerror(errno));
+}
+
 static void
 control_packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
 {
   socklen_t addrlen;
-  int ret;
+  uint8_t *data;
 
   switch (rs->family)
     {
@@ -1947,9 +2006,16 @@ control_packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
 	return;
     }
 
-  ret = sendto(rs->control_svc->fd, pkt->data, pkt->data_len, 0, &rs->naddr.sa, addrlen);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_AIRPLAY, "Could not send playback sync to device '%s': %s\n", rs->devname, strerror(errno));
+  // Queued, so that sync packets for all devices can go in one system call,
+  // see control_packets_flush()
+  data = rtp_batch_next(rs->control_svc->batch, pkt->data_len, &rs->naddr.sa, addrlen);
+  if (!data)
+    {
+      control_packets_flush(rs->control_svc);
+      data = rtp_batch_next(rs->control_svc->batch, pkt->data_len, &rs->naddr.sa, addrlen);
+    }
+
+  memcpy(data, pkt->data, pkt->data_len);
 }
 
 static void
@@ -1957,7 +2023,9 @@ packets_resend(struct airplay_session *rs, uint16_t seqnum, int len)
 {
   struct rtp_session *rtp_session;
   struct rtp_packet *pkt;
+  struct output_device *device;
   uint16_t s;
+  int hits = 0;
   int i;
   bool pkt_missing = false;
 
@@ -1971,23 +2039,87 @@ packets_resend(struct airplay_session *rs, uint16_t seqnum, int len)
     {
       pkt = rtp_packet_get(rtp_session, s);
       if (pkt)
-	packet_send(rs, pkt);
+	{
+	  packet_send(rs, pkt);
+	  hits++;
+	}
       else
 	pkt_missing = true;
     }
 
+  packets_flush(rs);
+
+  device = outputs_device_get(rs->device_id);
+  if (device)
+    {
+      device->stats.resend_hits += hits;
+      device->stats.resend_misses += len - hits;
+    }
+
   if (pkt_missing)
     DPRINTF(E_WARN, L_AIRPLAY, "Device '%s' retransmit request for seqnum %" PRIu16 " (len %d) is outside buffer range (next seqnum %" PRIu16 ", len %zu)\n",
       rs->devname, seqnum, len, rtp_session->seqnum, rtp_session->pktbuf_len);
 }
 
+// Queues a copy of a packet that was encrypted for another session
+static int
+packet_send_copy(struct airplay_session *rs, uint8_t *encrypted, size_t encrypted_len)
+{
+  uint8_t *data;
+
+  data = rtp_batch_next(rs->batch, encrypted_len, NULL, 0);
+  if (!data)
+    {
+      if (packets_flush(rs) < 0)
+	return -1;
+
+      data = rtp_batch_next(rs->batch, encrypted_len, NULL, 0);
+    }
+
+  memcpy(data, encrypted, encrypted_len);
+  rs->queued = data;
+
+  return 0;
+}
+
+// Returns a session that the current packet has already been encrypted for
+// with the same key and state, so the result can just be copied
+static struct airplay_session *
+packet_twin_find(struct airplay_session *rs)
+{
+  struct airplay_session *twin;
+
+  for (twin = airplay_sessions; twin && twin != rs; twin = twin->next)
+    {
+      if (twin->master_session == rs->master_session && twin->queued && twin->state == rs->state &&
+	  memcmp(twin->shared_secret, rs->shared_secret, AIRPLAY_AUDIO_KEY_LEN) == 0)
+	return twin;
+    }
+
+  return NULL;
+}
+
+static inline uint64_t
+clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static int
 packets_send(struct airplay_master_session *rms)
 {
   struct rtp_packet *pkt;
   struct airplay_session *rs;
+  struct airplay_session *twin;
+  uint64_t start_ns;
   int len;
 
+  start_ns = clock_ns();
+
+  // Encoded once for all the sessions in the master session
   len = alac_encode(rms->encoded_buffer, rms->encode_ctx, rms->rawbuf, rms->rawbuf_size, rms->samples_per_packet, &rms->quality);
   if (len < 0)
     return -1;
@@ -1996,6 +2128,12 @@ packets_send(struct airplay_master_session *rms)
 
   evbuffer_remove(rms->encoded_buffer, pkt->payload, pkt->payload_len);
 
+  rms->encode_ns += clock_ns() - start_ns;
+  start_ns = clock_ns();
+
+  for (rs = airplay_sessions; rs; rs = rs->next)
+    rs->queued = NULL;
+
   for (rs = airplay_sessions; rs; rs = rs->next)
     {
       if (rs->master_session != rms)
@@ -2003,17 +2141,22 @@ packets_send(struct airplay_master_session *rms)
 
       // Device just joined
       if (rs->state == AIRPLAY_STATE_CONNECTED)
-	{
-	  pkt->header[1] = (1 << 7) | AIRPLAY_RTP_PAYLOADTYPE;
-	  packet_send(rs, pkt);
-	}
+	pkt->header[1] = (1 << 7) | AIRPLAY_RTP_PAYLOADTYPE;
       else if (rs->state == AIRPLAY_STATE_STREAMING)
-	{
-	  pkt->header[1] = AIRPLAY_RTP_PAYLOADTYPE;
-	  packet_send(rs, pkt);
-	}
+	pkt->header[1] = AIRPLAY_RTP_PAYLOADTYPE;
+      else
+	continue;
+
+      // Devices normally have their own keys, but if not we only encrypt once
+      twin = packet_twin_find(rs);
+      if (twin)
+	packet_send_copy(rs, twin->queued, PACKET_ENCRYPTED_LEN(pkt));
+      else
+	packet_send(rs, pkt);
     }
 
+  rms->encrypt_ns += clock_ns() - start_ns;
+
   // Commits packet to retransmit buffer, and prepares the session for the next packet
   rtp_packet_commit(rms->rtp_session, pkt);
 
@@ -2058,6 +2201,33 @@ timestamp_set(struct airplay_master_session *rms, struct timespec ts)
   rms->cur_stamp.pos = rms->rtp_session->pos + rms->input_buffer_samples - rms->output_buffer_samples;
 }
 
+static void
+packets_cost_log(struct airplay_master_session *rms)
+{
+  if (rms->ticks == 0)
+    return;
+
+  DPRINTF(E_SPAM, L_AIRPLAY, "Cost per tick for %d/%d/%d: encode %" PRIu64 " us, encrypt %" PRIu64 " us (avg of %d ticks)\n",
+    rms->quality.sample_rate, rms->quality.bits_per_sample, rms->quality.channels,
+    rms->encode_ns / rms->ticks / 1000, rms->encrypt_ns / rms->ticks / 1000, rms->ticks);
+
+  rms->encode_ns = 0;
+  rms->encrypt_ns = 0;
+  rms->ticks = 0;
+}
+
+static void
+session_stats_update(struct airplay_session *rs)
+{
+  struct output_device *device;
+
+  device = outputs_device_get(rs->device_id);
+  if (device)
+    device->stats.bytes_sent += rs->batch->bytes_sent;
+
+  rs->batch->bytes_sent = 0;
+}
+
 static void
 packets_sync_send(struct airplay_master_session *rms)
 {
@@ -2068,6 +2238,8 @@ packets_sync_send(struct airplay_master_session *rms)
 
   // Check if it is time send a sync packet to sessions that are already running
   is_sync_time = rtp_sync_is_time(rms->rtp_session);
+  if (is_sync_time)
+    packets_cost_log(rms);
 
   // Just used for logging, the clock shouldn't be too far from rms->cur_stamp.ts
   clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -2090,8 +2262,12 @@ packets_sync_send(struct airplay_master_session *rms)
 	{
 	  sync_pkt = rtp_sync_packet_next(rms->rtp_session, rms->cur_stamp, 0x80);
 	  control_packet_send(rs, sync_pkt);
+
+	  session_stats_update(rs);
 	}
     }
+
+  control_packets_flush(&airplay_control_svc);
 }
 
 
@@ -2106,9 +2282,12 @@ service_stop(struct airplay_service *svc)
   if (svc->fd >= 0)
     close(svc->fd);
 
+  rtp_batch_free(svc->batch);
+
   svc->ev = NULL;
   svc->fd = -1;
   svc->port = 0;
+  svc->batch = NULL;
 }
 
 static int
@@ -2133,6 +2312,7 @@ service_start(struct airplay_service *svc, event_callback_fn cb, unsigned short
   event_add(svc->ev, NULL);
 
   svc->port = port;
+  svc->batch = rtp_batch_new();
 
   return 0;
 
@@ -2733,6 +2913,13 @@ payload_make_pair_setup3(struct evrtsp_request *req, struct airplay_session *rs,
   return payload_make_pair_generic(3, req, rs);
 }
 
+/* Note that pair verify can't be skipped on reconnects by caching the result.
+ * The control channel keys are derived from the ephemeral X25519 keys of this
+ * particular verify, and receivers require a verify on each new connection,
+ * since unlike HAP over IP, AirPlay has no pair-resume. The cost is about two
+ * round trips and a few curve operations (ms), so not worth keeping idle
+ * connections open for.
+ */
 static int
 payload_make_pair_verify1(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
 {
@@ -3976,6 +4163,7 @@ airplay_write(struct output_buffer *obuf)
 	  // TODO avoid this copy
 	  evbuffer_add(rms->input_buffer, obuf->data[i].buffer, obuf->data[i].bufsize);
 	  rms->input_buffer_samples += obuf->data[i].samples;
+	  rms->ticks++;
 
 	  // Send as many packets as we have data for (one packet requires rawbuf_size bytes)
 	  while (evbuffer_get_length(rms->input_buffer) >= rms->rawbuf_size)
@@ -3988,6 +4176,11 @@ airplay_write(struct output_buffer *obuf)
 	}
     }
 
+  // The packets from packets_send() are queued, so each session gets all of
+  // them with one system call
+  for (rs = airplay_sessions; rs; rs = rs->next)
+    packets_flush(rs);
+
   // Check for devices that have joined since last write (we have already sent them
   // initialization sync and rtp packets via packets_sync_send and packets_send)
   for (rs = airplay_sessions; rs; rs = rs->next)
@@ -94,6 +94,9 @@ struct alsa_playback_session
 {
   snd_pcm_t *pcm;
 
+  // True if the pcm was opened with mmap access
+  bool mmap;
+
   int buffer_nsamp;
 
   uint32_t pos;
@@ -118,6 +121,10 @@ struct alsa_playback_session
   // Here we buffer samples during startup
   struct ringbuffer prebuf;
 
+  // For stats, bytes_written is moved to the device once per second
+  uint64_t device_id;
+  uint64_t bytes_written;
+
   struct alsa_playback_session *next;
 };
 
@@ -128,6 +135,9 @@ struct alsa_extra
   const char *mixer_name;
   const char *mixer_device_name;
   int offset_ms;
+  bool mmap;
+  int buffer_time_ms;
+  int period_time_ms;
 };
 
 struct alsa_session
@@ -145,6 +155,17 @@ struct alsa_session
 
   int offset_ms;
 
+  // Transfer mode and sizing requested in the config, 0 for the defaults
+  bool mmap;
+  int buffer_time_ms;
+  int period_time_ms;
+
+  // Number of buffer underruns since the session was started
+  int xruns;
+
+  // What the device can play, probed when the session starts
+  struct output_quality_caps caps;
+
   // A session will have multiple playback sessions when the quality changes
   struct alsa_playback_session *pb;
 
@@ -156,8 +177,8 @@ static struct alsa_session *sessions;
 static bool alsa_sync_disable;
 static int alsa_latency_history_size;
 
-// We will try to play the music with the source quality, but if the card
-// doesn't support that we resample to the fallback quality
+// The output module picks the quality from what the card supports, but if we
+// can't probe the card we resample to the fallback quality
 static struct media_quality alsa_fallback_quality = { 44100, 16, 2, 0 };
 static struct media_quality alsa_last_quality;
 
@@ -505,11 +526,14 @@ mixer_close(struct alsa_mixer *mixer, const char *mixer_device_name)
 }
 
 static int
-pcm_open(snd_pcm_t **pcm, const char *device_name, struct media_quality *quality)
+pcm_open(snd_pcm_t **pcm, bool *use_mmap, struct alsa_session *as, struct media_quality *quality)
 {
+  const char *device_name = as->devname;
   snd_pcm_t *hdl;
   snd_pcm_hw_params_t *hw_params;
   snd_pcm_uframes_t bufsize;
+  snd_pcm_uframes_t period_size;
+  unsigned int usec;
   int ret;
 
   ret = snd_pcm_open(&hdl, device_name, SND_PCM_STREAM_PLAYBACK, 0);
@@ -537,11 +561,27 @@ pcm_open(snd_pcm_t **pcm, const char *device_name, struct media_quality *quality
       goto out_fail;
     }
 
-  ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-  if (ret < 0)
+  // With mmap the samples are copied straight into the device buffer, which
+  // saves the copy and syscall of a regular write. Not all devices support it
+  // (e.g. some plugins), so we fall back to regular writes.
+  *use_mmap = false;
+  if (as->mmap)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not set access method: %s\n", snd_strerror(ret));
-      goto out_fail;
+      ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+      if (ret == 0)
+	*use_mmap = true;
+      else
+	DPRINTF(E_WARN, L_LAUDIO, "Device '%s' does not support mmap, using regular writes: %s\n", device_name, snd_strerror(ret));
+    }
+
+  if (!*use_mmap)
+    {
+      ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set access method: %s\n", snd_strerror(ret));
+	  goto out_fail;
+	}
     }
 
   ret = snd_pcm_hw_params_set_format(hdl, hw_params, bps2format(quality->bits_per_sample));
@@ -565,21 +605,45 @@ pcm_open(snd_pcm_t **pcm, const char *device_name, struct media_quality *quality
       goto out_fail;
     }
 
-  ret = snd_pcm_hw_params_get_buffer_size_max(hw_params, &bufsize);
-  if (ret < 0)
+  if (as->period_time_ms > 0)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not get max buffer size: %s\n", snd_strerror(ret));
-      goto out_fail;
+      usec = as->period_time_ms * 1000;
+      ret = snd_pcm_hw_params_set_period_time_near(hdl, hw_params, &usec, 0);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set period time to %d ms: %s\n", as->period_time_ms, snd_strerror(ret));
+	  goto out_fail;
+	}
     }
 
-  // Enable this line to simulate devices with low buffer size
-  //bufsize = 32768;
-
-  ret = snd_pcm_hw_params_set_buffer_size_max(hdl, hw_params, &bufsize);
-  if (ret < 0)
+  if (as->buffer_time_ms > 0)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer size to max: %s\n", snd_strerror(ret));
-      goto out_fail;
+      usec = as->buffer_time_ms * 1000;
+      ret = snd_pcm_hw_params_set_buffer_time_near(hdl, hw_params, &usec, 0);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer time to %d ms: %s\n", as->buffer_time_ms, snd_strerror(ret));
+	  goto out_fail;
+	}
+    }
+  else
+    {
+      ret = snd_pcm_hw_params_get_buffer_size_max(hw_params, &bufsize);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not get max buffer size: %s\n", snd_strerror(ret));
+	  goto out_fail;
+	}
+
+      // Enable this line to simulate devices with low buffer size
+      //bufsize = 32768;
+
+      ret = snd_pcm_hw_params_set_buffer_size_max(hdl, hw_params, &bufsize);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer size to max: %s\n", snd_strerror(ret));
+	  goto out_fail;
+	}
     }
 
   ret = snd_pcm_hw_params(hdl, hw_params);
@@ -589,6 +653,11 @@ pcm_open(snd_pcm_t **pcm, const char *device_name, struct media_quality *quality
       goto out_fail;
     }
 
+  if (snd_pcm_hw_params_get_buffer_size(hw_params, &bufsize) == 0 && snd_pcm_hw_params_get_period_size(hw_params, &period_size, NULL) == 0)
+    DPRINTF(E_INFO, L_LAUDIO, "Device '%s' opened with %s access, buffer %lu frames (%lu ms), period %lu frames (%lu ms)\n",
+      device_name, *use_mmap ? "mmap" : "rw", (unsigned long)bufsize, (unsigned long)bufsize * 1000 / quality->sample_rate,
+      (unsigned long)period_size, (unsigned long)period_size * 1000 / quality->sample_rate);
+
   snd_pcm_hw_params_free(hw_params);
 
   *pcm = hdl;
@@ -602,6 +671,73 @@ pcm_open(snd_pcm_t **pcm, const char *device_name, struct media_quality *quality
   return ALSA_ERROR_DEVICE;
 }
 
+// Finds the rates and formats the device supports so the output module can
+// select a quality without trial and error. If the device can't be probed we
+// say that only the fallback quality is supported.
+static void
+pcm_caps_probe(struct output_quality_caps *caps, const char *device_name)
+{
+  static const int rates[] = OUTPUTS_QUALITY_RATES;
+  int bits[] = { 16, 24, 32 };
+  snd_pcm_t *hdl;
+  snd_pcm_hw_params_t *hw_params;
+  int ret;
+  int i;
+
+  memset(caps, 0, sizeof(struct output_quality_caps));
+  caps->fallback = alsa_fallback_quality;
+  caps->channels = alsa_fallback_quality.channels;
+
+  // Non-blocking so we don't hang if a previous session still has the device
+  ret = snd_pcm_open(&hdl, device_name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+  if (ret < 0)
+    goto fallback;
+
+  ret = snd_pcm_hw_params_malloc(&hw_params);
+  if (ret < 0)
+    {
+      snd_pcm_close(hdl);
+      goto fallback;
+    }
+
+  ret = snd_pcm_hw_params_any(hdl, hw_params);
+  if (ret == 0 && snd_pcm_hw_params_test_channels(hdl, hw_params, caps->channels) == 0)
+    {
+      for (i = 0; i < ARRAY_SIZE(rates); i++)
+	{
+	  if (snd_pcm_hw_params_test_rate(hdl, hw_params, rates[i], 0) == 0)
+	    caps->sample_rates |= (1 << i);
+	}
+      for (i = 0; i < ARRAY_SIZE(bits); i++)
+	{
+	  if (snd_pcm_hw_params_test_format(hdl, hw_params, bps2format(bits[i])) == 0)
+	    caps->bits_per_sample |= OUTPUTS_QUALITY_BITS(bits[i]);
+	}
+    }
+
+  snd_pcm_hw_params_free(hw_params);
+  snd_pcm_close(hdl);
+
+  if (caps->sample_rates && caps->bits_per_sample)
+    {
+      DPRINTF(E_DBG, L_LAUDIO, "Device '%s' supports rate mask 0x%x, bits mask 0x%x\n", device_name, caps->sample_rates, caps->bits_per_sample);
+      return;
+    }
+
+ fallback:
+  DPRINTF(E_INFO, L_LAUDIO, "Could not probe the formats supported by '%s', will use %d/%d/%d\n",
+    device_name, alsa_fallback_quality.sample_rate, alsa_fallback_quality.bits_per_sample, alsa_fallback_quality.channels);
+
+  // Marks just the fallback quality as supported
+  caps->sample_rates = 0;
+  for (i = 0; i < ARRAY_SIZE(rates); i++)
+    {
+      if (rates[i] == alsa_fallback_quality.sample_rate)
+	caps->sample_rates = (1 << i);
+    }
+  caps->bits_per_sample = OUTPUTS_QUALITY_BITS(alsa_fallback_quality.bits_per_sample);
+}
+
 static void
 pcm_close(snd_pcm_t *hdl)
 {
@@ -611,6 +747,22 @@ pcm_close(snd_pcm_t *hdl)
   snd_pcm_close(hdl);
 }
 
+static snd_pcm_sframes_t
+pcm_write(struct alsa_playback_session *pb, const void *buf, snd_pcm_uframes_t nsamp)
+{
+  snd_pcm_sframes_t ret;
+
+  if (pb->mmap)
+    ret = snd_pcm_mmap_writei(pb->pcm, buf, nsamp);
+  else
+    ret = snd_pcm_writei(pb->pcm, buf, nsamp);
+
+  if (ret > 0)
+    pb->bytes_written += snd_pcm_frames_to_bytes(pb->pcm, ret);
+
+  return ret;
+}
+
 static int
 pcm_configure(snd_pcm_t *hdl)
 {
@@ -730,14 +882,15 @@ playback_session_add(struct alsa_session *as, struct media_quality *quality, str
     quality->sample_rate, quality->bits_per_sample, quality->channels, as->devname);
 
   CHECK_NULL(L_LAUDIO, pb = calloc(1, sizeof(struct alsa_playback_session)));
+  pb->device_id = as->device_id;
   CHECK_NULL(L_LAUDIO, pb->latency_history = calloc(alsa_latency_history_size, sizeof(double)));
 
-  ret = pcm_open(&pb->pcm, as->devname, quality);
+  ret = pcm_open(&pb->pcm, &pb->mmap, as, quality);
   if (ret == ALSA_ERROR_DEVICE_BUSY)
     {
       DPRINTF(E_LOG, L_LAUDIO, "ALSA device '%s' won't open due to existing session (no support for concurrent audio), truncating audio\n", as->devname);
       playback_session_remove_all(as);
-      ret = pcm_open(&pb->pcm, as->devname, quality);
+      ret = pcm_open(&pb->pcm, &pb->mmap, as, quality);
       if (ret == ALSA_ERROR_DEVICE_BUSY)
 	{
 	  DPRINTF(E_LOG, L_LAUDIO, "ALSA device '%s' failed: Device still busy after closing previous sessions\n", as->devname);
@@ -745,20 +898,15 @@ playback_session_add(struct alsa_session *as, struct media_quality *quality, str
 	}
     }
 
+  // The quality was selected from what the device said it supports, and the
+  // output module doesn't deliver any other, so no point in trying others
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Device '%s' does not support quality (%d/%d/%d), falling back to default\n", as->devname, quality->sample_rate, quality->bits_per_sample, quality->channels);
-      ret = pcm_open(&pb->pcm, as->devname, &alsa_fallback_quality);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_LAUDIO, "ALSA device failed setting fallback quality\n");
-	  goto error;
-	}
-
-      pb->quality = alsa_fallback_quality;
+      DPRINTF(E_LOG, L_LAUDIO, "Device '%s' failed with quality (%d/%d/%d)\n", as->devname, quality->sample_rate, quality->bits_per_sample, quality->channels);
+      goto error;
     }
-  else
-    pb->quality = *quality;
+
+  pb->quality = *quality;
 
   // If this fails it just means we won't get timestamps, which we can handle
   pcm_configure(pb->pcm);
@@ -839,7 +987,7 @@ buffer_write(struct alsa_playback_session *pb, struct output_data *odata, snd_pc
 
       nsamp = snd_pcm_bytes_to_frames(pb->pcm, bufsize);
 
-      ret = snd_pcm_writei(pb->pcm, buf, nsamp);
+      ret = pcm_write(pb, buf, nsamp);
       if (ret < 0)
 	return ret;
 
@@ -861,7 +1009,7 @@ buffer_write(struct alsa_playback_session *pb, struct output_data *odata, snd_pc
 
   nsamp = snd_pcm_bytes_to_frames(pb->pcm, odata->bufsize);
 
-  ret = snd_pcm_writei(pb->pcm, odata->buffer, nsamp);
+  ret = pcm_write(pb, odata->buffer, nsamp);
   if (ret < 0)
     return ret;
 
@@ -874,6 +1022,7 @@ buffer_write(struct alsa_playback_session *pb, struct output_data *odata, snd_pc
 static enum alsa_sync_state
 sync_check(double *drift, double *latency, struct alsa_playback_session *pb, snd_pcm_sframes_t delay)
 {
+  struct output_device *device;
   enum alsa_sync_state sync;
   struct timespec ts;
   int elapsed;
@@ -923,6 +1072,11 @@ sync_check(double *drift, double *latency, struct alsa_playback_session *pb, snd
   // Set *latency to the "average" within the period
   *latency = (*drift) * alsa_latency_history_size / 2 + (*latency);
 
+  // The samples are taken each second, so drift is samples per second
+  device = outputs_device_get(pb->device_id);
+  if (device)
+    outputs_device_stats_sample(device, *latency * 1000 / pb->quality.sample_rate, *drift * 1000000 / pb->quality.sample_rate);
+
   if (fabs(*latency) < ALSA_MAX_LATENCY && fabs(*drift) < ALSA_MAX_DRIFT)
     sync = ALSA_SYNC_OK; // If both latency and drift are within thresholds -> no action
   else if (*latency > 0 && *drift > 0)
@@ -946,6 +1100,7 @@ sync_check(double *drift, double *latency, struct alsa_playback_session *pb, snd
 static void
 sync_correct(struct alsa_playback_session *pb, double drift, double latency, struct timespec pts, snd_pcm_sframes_t delay)
 {
+  struct output_device *device;
   int step;
   int sign;
   int ret;
@@ -967,8 +1122,8 @@ sync_correct(struct alsa_playback_session *pb, double drift, double latency, str
   else if (abs(pb->sync_resample_step) > ALSA_RESAMPLE_STEP_MAX)
     return; // Don't do anything, we have given up
 
-  // Step 0 is the original audio quality (or the fallback quality), which we
-  // will just keep receiving
+  // Step 0 is the quality selected by the output module, which we will just
+  // keep receiving
   if (pb->sync_resample_step != 0)
     outputs_quality_unsubscribe(&pb->quality);
 
@@ -977,7 +1132,7 @@ sync_correct(struct alsa_playback_session *pb, double drift, double latency, str
 
   if (pb->sync_resample_step != 0)
     {
-      ret = outputs_quality_subscribe(&pb->quality);
+      ret = outputs_quality_subscribe(&pb->quality, OUTPUT_TYPE_ALSA);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_LAUDIO, "Error adjusting sample rate to %d to maintain sync\n", pb->quality.sample_rate);
@@ -991,6 +1146,10 @@ sync_correct(struct alsa_playback_session *pb, double drift, double latency, str
   pb->stamp_pts = pts;
 
   DPRINTF(E_INFO, L_LAUDIO, "Adjusted sample rate to %d to sync ALSA device (drift=%f, latency=%f)\n", pb->quality.sample_rate, drift, latency);
+
+  device = outputs_device_get(pb->device_id);
+  if (device)
+    device->stats.corrections++;
 }
 
 static int
@@ -1035,7 +1194,7 @@ playback_drain(struct alsa_playback_session *pb)
 
   nsamp = snd_pcm_bytes_to_frames(pb->pcm, bufsize);
 
-  ret = snd_pcm_writei(pb->pcm, buf, nsamp);
+  ret = pcm_write(pb, buf, nsamp);
 
   return ((ret < 0) ? ALSA_ERROR_SESSION : 0);
 }
@@ -1043,6 +1202,7 @@ playback_drain(struct alsa_playback_session *pb)
 static int
 playback_write(struct alsa_playback_session *pb, struct output_buffer *obuf)
 {
+  struct output_device *device;
   snd_pcm_sframes_t avail;
   snd_pcm_sframes_t delay;
   enum alsa_sync_state sync;
@@ -1078,11 +1238,19 @@ playback_write(struct alsa_playback_session *pb, struct output_buffer *obuf)
     goto alsa_error;
 
   // Check sync each second (or if this is first write where last_pts is zero)
-  if (!alsa_sync_disable && (obuf->pts.tv_sec != pb->last_pts.tv_sec))
+  if (obuf->pts.tv_sec != pb->last_pts.tv_sec)
     {
-      sync = sync_check(&drift, &latency, pb, delay);
-      if (sync != ALSA_SYNC_OK)
-	sync_correct(pb, drift, latency, obuf->pts, delay);
+      device = outputs_device_get(pb->device_id);
+      if (device)
+	device->stats.bytes_sent += pb->bytes_written;
+      pb->bytes_written = 0;
+
+      if (!alsa_sync_disable)
+	{
+	  sync = sync_check(&drift, &latency, pb, delay);
+	  if (sync != ALSA_SYNC_OK)
+	    sync_correct(pb, drift, latency, obuf->pts, delay);
+	}
 
       pb->last_pts = obuf->pts;
     }
@@ -1115,7 +1283,7 @@ alsa_session_free(struct alsa_session *as)
   if (!as)
     return;
 
-  outputs_quality_unsubscribe(&alsa_fallback_quality);
+  outputs_quality_caps_remove(&as->caps);
 
   playback_session_remove_all(as);
 
@@ -1165,6 +1333,9 @@ alsa_session_make(struct output_device *device, int callback_id)
   as->mixer_name = ae->mixer_name;
   as->mixer_device_name = ae->mixer_device_name;
   as->offset_ms = ae->offset_ms;
+  as->mmap = ae->mmap;
+  as->buffer_time_ms = ae->buffer_time_ms;
+  as->period_time_ms = ae->period_time_ms;
 
   ret = mixer_open(&as->mixer, as->mixer_device_name, as->mixer_name);
   if (ret < 0)
@@ -1173,13 +1344,6 @@ alsa_session_make(struct output_device *device, int callback_id)
       goto error_free_session;
     }
 
-  ret = outputs_quality_subscribe(&alsa_fallback_quality);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not subscribe to fallback audio quality\n");
-      goto error_mixer_close;
-    }
-
   as->state = OUTPUT_STATE_CONNECTED;
   as->next = sessions;
   sessions = as;
@@ -1189,8 +1353,6 @@ alsa_session_make(struct output_device *device, int callback_id)
 
   return as;
 
- error_mixer_close:
-  mixer_close(&as->mixer, as->mixer_device_name);
  error_free_session:
   free(as);
   return NULL;
@@ -1213,11 +1375,20 @@ static int
 alsa_device_start(struct output_device *device, int callback_id)
 {
   struct alsa_session *as;
+  int ret;
 
   as = alsa_session_make(device, callback_id);
   if (!as)
     return -1;
 
+  pcm_caps_probe(&as->caps, as->devname);
+  ret = outputs_quality_caps_add(&as->caps, OUTPUT_TYPE_ALSA);
+  if (ret < 0)
+    {
+      alsa_session_cleanup(as);
+      return -1;
+    }
+
   volume_set(&as->mixer, device->volume);
 
   as->state = OUTPUT_STATE_CONNECTED;
@@ -1302,6 +1473,7 @@ alsa_device_free_extra(struct output_device *device)
 static void
 alsa_write(struct output_buffer *obuf)
 {
+  struct output_device *device;
   struct alsa_session *as;
   struct alsa_session *as_next;
   struct alsa_playback_session *pb;
@@ -1316,7 +1488,7 @@ alsa_write(struct output_buffer *obuf)
     {
       if (quality_changed || as->state == OUTPUT_STATE_CONNECTED)
 	{
-	  ret = playback_session_add(as, &obuf->data[0].quality, obuf->pts);
+	  ret = playback_session_add(as, &as->caps.selected, obuf->pts);
 	  if (ret < 0)
 	    {
 	      as->state = OUTPUT_STATE_FAILED;
@@ -1344,7 +1516,15 @@ alsa_write(struct output_buffer *obuf)
 	      if (ret == ALSA_ERROR_WRITE)
 		as->state = OUTPUT_STATE_FAILED;
 	      else if (ret == ALSA_ERROR_UNDERRUN)
-		as->state = OUTPUT_STATE_CONNECTED;
+		{
+		  as->xruns++;
+		  device = outputs_device_get(as->device_id);
+		  if (device)
+		    device->stats.underruns++;
+
+		  DPRINTF(E_INFO, L_LAUDIO, "ALSA device '%s' has had %d underrun(s) since start\n", as->devname, as->xruns);
+		  as->state = OUTPUT_STATE_CONNECTED;
+		}
 	    }
 	}
     }
@@ -1397,6 +1577,16 @@ alsa_device_add(cfg_t* cfg_audio, int id)
       ae->offset_ms = 1000 * (ae->offset_ms/abs(ae->offset_ms));
     }
 
+  ae->mmap = cfg_getbool(cfg_audio, "mmap");
+  ae->buffer_time_ms = cfg_getint(cfg_audio, "buffer_time_ms");
+  ae->period_time_ms = cfg_getint(cfg_audio, "period_time_ms");
+  if (ae->buffer_time_ms < 0 || ae->period_time_ms < 0 || (ae->buffer_time_ms > 0 && ae->period_time_ms > ae->buffer_time_ms))
+    {
+      DPRINTF(E_LOG, L_LAUDIO, "The ALSA buffer_time_ms (%d) and period_time_ms (%d) set in the configuration are invalid, using defaults\n", ae->buffer_time_ms, ae->period_time_ms);
+      ae->buffer_time_ms = 0;
+      ae->period_time_ms = 0;
+    }
+
   DPRINTF(E_INFO, L_LAUDIO, "Adding ALSA device '%s' with name '%s'\n", ae->card_name, device->name);
 
   ret = player_device_add(device);
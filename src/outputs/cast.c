@@ -109,6 +109,13 @@
 // which can be used for delayed transmission (and retransmission)
 #define CAST_PACKET_BUFFER_SIZE 300
 
+// Duration of one packet
+#define CAST_PACKET_DURATION_MS (1000 * CAST_SAMPLES_PER_PACKET / CAST_QUALITY_SAMPLE_RATE_DEFAULT)
+
+// Max number of packets we let be unacked when we need to catch up, see
+// packets_send_paced()
+#define CAST_PACING_WINDOW_MAX 16
+
 // Max number of RTP packets for one artwork image
 #define CAST_PACKET_ARTWORK_SIZE 200
 
@@ -228,6 +235,20 @@ struct cast_session
 
   uint16_t ack_last;
 
+  // For pacing, see packets_send_paced(). We time one packet at a time from
+  // send to ack to get the round trip time, like TCP does.
+  int window;
+  int rtt_ms;
+  struct timespec rtt_ts;
+  uint16_t rtt_seqnum;
+  bool rtt_pending;
+
+  // The playout delay the device reports it is aiming for
+  uint16_t target_delay_ms;
+
+  // For stats, moved to the device when we get an ack that we time
+  uint64_t bytes_sent;
+
   // Outgoing request which have the USE_REQUEST_ID flag get a new id, and a
   // callback is registered. The callback is called when an incoming message
   // from the peer with that request id arrives. If nothing arrives within
@@ -1006,6 +1027,7 @@ packets_make(struct cast_master_session *cms, struct output_data *odata)
   return npkts;
 }
 
+// Returns 0 if sent, 1 if the packet wasn't in our buffer and -1 on error
 static int
 packet_send(struct cast_session *cs, uint16_t seqnum)
 {
@@ -1017,7 +1039,7 @@ packet_send(struct cast_session *cs, uint16_t seqnum)
   if (!pkt)
     {
       DPRINTF(E_WARN, L_CAST, "Packet to '%s' is missing in our buffer\n", cs->devname);
-      return 0; // Don't fail session over a missing packet (or should we?)
+      return 1; // Don't fail session over a missing packet (or should we?)
     }
 
   ret = send(cs->udp_fd, pkt->data, pkt->data_len, 0);
@@ -1026,6 +1048,8 @@ packet_send(struct cast_session *cs, uint16_t seqnum)
       DPRINTF(E_LOG, L_CAST, "Send error for '%s': %s\n", cs->devname, strerror(errno));
       return -1;
     }
+
+  cs->bytes_sent += ret;
   else if (ret != pkt->data_len)
     {
       DPRINTF(E_WARN, L_CAST, "Partial send (%d) for '%s'\n", ret, cs->devname);
@@ -1053,11 +1077,89 @@ packet_send_next(struct cast_session *cs)
   if (ret < 0)
     return ret;
 
+  if (!cs->rtt_pending)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &cs->rtt_ts);
+      cs->rtt_seqnum = cs->seqnum_next;
+      cs->rtt_pending = true;
+    }
+
   cs->seqnum_next++;
 
   return 0;
 }
 
+// Normally we send ping-pong style, one packet and then the next when it has
+// been ack'ed. If we fall behind, e.g. because an ack was lost, that can't
+// catch up, so then we let more packets be in flight. The window grows by one
+// per ack while we are behind, is halved when the device reports loss, and is
+// capped by how many packets fit in the round trip time. With a window of 1,
+// this is the same as ping-pong.
+static int
+packets_send_paced(struct cast_session *cs)
+{
+  uint16_t in_flight;
+  int ret;
+
+  while (cs->seqnum_next != cs->master_session->rtp_session->seqnum)
+    {
+      in_flight = cs->seqnum_next - (uint16_t)(cs->ack_last + 1);
+      if (in_flight >= cs->window)
+	break;
+
+      ret = packet_send_next(cs);
+      if (ret < 0)
+	return ret;
+    }
+
+  return 0;
+}
+
+static void
+pacing_update(struct cast_session *cs, struct cast_rtcp_packet_feedback *feedback)
+{
+  struct output_device *device;
+  struct timespec ts;
+  int window_max;
+  int rtt_ms;
+
+  if (cs->rtt_pending && (int16_t)(cs->ack_last - cs->rtt_seqnum) >= 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      rtt_ms = (ts.tv_sec - cs->rtt_ts.tv_sec) * 1000 + (ts.tv_nsec - cs->rtt_ts.tv_nsec) / 1000000;
+      cs->rtt_ms = cs->rtt_ms ? (7 * cs->rtt_ms + rtt_ms) / 8 : rtt_ms;
+      cs->rtt_pending = false;
+
+      device = outputs_device_get(cs->device_id);
+      if (device)
+	{
+	  device->stats.rtt_ms = cs->rtt_ms;
+	  device->stats.bytes_sent += cs->bytes_sent;
+	}
+      cs->bytes_sent = 0;
+    }
+
+  window_max = MIN(CAST_PACING_WINDOW_MAX, 2 + cs->rtt_ms / CAST_PACKET_DURATION_MS);
+
+  if (feedback->num_lost_fields > 0)
+    cs->window = MAX(1, cs->window / 2);
+  else if (cs->seqnum_next != cs->master_session->rtp_session->seqnum)
+    cs->window = MIN(window_max, cs->window + 1);
+  else
+    cs->window = MIN(window_max, cs->window);
+
+  if (feedback->target_delay_ms != cs->target_delay_ms)
+    {
+      DPRINTF(E_DBG, L_CAST, "Device '%s' now has target delay %" PRIu16 " ms (rtt %d ms, window %d)\n",
+	cs->devname, feedback->target_delay_ms, cs->rtt_ms, cs->window);
+      cs->target_delay_ms = feedback->target_delay_ms;
+
+      device = outputs_device_get(cs->device_id);
+      if (device)
+	outputs_device_stats_sample(device, cs->target_delay_ms, 0);
+    }
+}
+
 /* TODO This does not currently work - need to investigate what sync the devices support
 static void
 packets_sync_send(struct cast_master_session *cms, struct timespec pts)
@@ -1274,7 +1376,9 @@ xr_packet_process(struct cast_session *cs, uint8_t *data, size_t len)
 {
   struct rtcp_packet xrpkt;
   struct cast_rtcp_packet_feedback feedback;
+  struct output_device *device;
   uint16_t seqnum;
+  int hits;
   int ret;
   int i;
 
@@ -1290,21 +1394,38 @@ xr_packet_process(struct cast_session *cs, uint8_t *data, size_t len)
 	return;
 
       // Retransmission
-      for (i = 0; i < feedback.num_lost_fields; i++)
+      for (i = 0, hits = 0; i < feedback.num_lost_fields; i++)
         {
 	  seqnum = frame_id_expand(feedback.lost_fields[i].frame_id, cs->seqnum_next - 1);
 
 	  DPRINTF(E_DBG, L_CAST, "Retransmission to '%s' of lost RTCP frame_id %" PRIu16", packet_id %" PRIu16 ", bitmask %02x\n",
 	    cs->devname, seqnum, feedback.lost_fields[i].packet_id, feedback.lost_fields[i].bitmask);
-	  packet_send(cs, seqnum);
+	  if (packet_send(cs, seqnum) == 0)
+	    hits++;
+
+	  // Don't use a resent packet for timing, since we can't tell which send
+	  // the ack is for
+	  if (cs->rtt_pending && seqnum == cs->rtt_seqnum)
+	    cs->rtt_pending = false;
 	}
 
-      // Expand the 8 bit value into a seqnum by comparing with last sent seqnum
-      cs->ack_last = frame_id_expand(feedback.frame_id_last, cs->seqnum_next - 1);
-      if (cs->ack_last + 1 == cs->seqnum_next)
+      if (feedback.num_lost_fields > 0)
 	{
-	  packet_send_next(cs); // Last packet was ack'ed, let's send a new packet
+	  device = outputs_device_get(cs->device_id);
+	  if (device)
+	    {
+	      device->stats.resend_hits += hits;
+	      device->stats.resend_misses += feedback.num_lost_fields - hits;
+	    }
 	}
+
+      // Expand the 8 bit value into a seqnum by comparing with last sent seqnum
+      cs->ack_last = frame_id_expand(feedback.frame_id_last, cs->seqnum_next - 1);
+
+      pacing_update(cs, &feedback);
+
+      // Send new packets if the ack made room in the window
+      packets_send_paced(cs);
     }
 /*  else if (xrpkt.packet_type == CAST_RTCP_PT_FEEDBACK && xrpkt.ic == 1)
     picturelost_packet_process(&xrpkt);
@@ -1841,7 +1962,7 @@ master_session_make(struct media_quality *quality)
     return cast_master_session;
 
   // Let's create a master session
-  ret = outputs_quality_subscribe(quality);
+  ret = outputs_quality_subscribe(quality, OUTPUT_TYPE_CAST);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_CAST, "Could not subscribe to required audio quality (%d/%d/%d)\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
@@ -1953,6 +2074,8 @@ cast_session_make(struct output_device *device, int family, int callback_id)
   cs->offset_ts.tv_sec  = (offset_ms / 1000);
   cs->offset_ts.tv_nsec = (offset_ms % 1000) * 1000000UL;
 
+  cs->window = 1;
+
   DPRINTF(E_DBG, L_CAST, "Offset is set to %ld:%09ld\n", (long)cs->offset_ts.tv_sec, (long)cs->offset_ts.tv_nsec);
 
   cs->ev = event_new(evbase_player, cs->server_fd, EV_READ | EV_PERSIST, cast_listen_cb, cs);
@@ -2251,6 +2374,8 @@ cast_write(struct output_buffer *obuf)
 	  // Sets that playback will start at time = start_pts with the packet that comes after seqnum_last
 	  cs->start_pts = timespec_add(obuf->pts, cs->offset_ts);
 	  cs->seqnum_next = cast_master_session->rtp_session->seqnum;
+	  cs->window = 1;
+	  cs->rtt_pending = false;
 	  cs->state = CAST_STATE_BUFFERING;
 
 	  clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -2277,6 +2402,8 @@ cast_write(struct output_buffer *obuf)
         continue;
 
       ret = packet_send_next(cs);
+      if (ret == 0)
+	ret = packets_send_paced(cs);
       if (ret < 0)
         {
 	  // Downgrade state immediately to avoid further write attempts (session shutdown is async)
@@ -50,10 +50,20 @@ struct dummy_session
 
   uint64_t device_id;
   int callback_id;
+
+  // Zero if the session just takes whatever quality the source has
+  struct media_quality quality;
+  size_t bytes_written;
+
+  struct dummy_session *next;
 };
 
 struct dummy_session *sessions;
 
+// Like a real output we keep a reference to the last write, as if the data was
+// still waiting to be sent
+static struct output_buffer *dummy_obuf;
+
 /* ---------------------------- SESSION HANDLING ---------------------------- */
 
 static void
@@ -62,14 +72,35 @@ dummy_session_free(struct dummy_session *ds)
   if (!ds)
     return;
 
+  if (ds->quality.sample_rate)
+    outputs_quality_unsubscribe(&ds->quality);
+
   free(ds);
 }
 
 static void
 dummy_session_cleanup(struct dummy_session *ds)
 {
-  // Normally some here code to remove from linked list - here we just say:
-  sessions = NULL;
+  struct dummy_session *s;
+
+  if (ds == sessions)
+    sessions = ds->next;
+  else
+    {
+      for (s = sessions; s && (s->next != ds); s = s->next)
+	; /* EMPTY */
+
+      if (s)
+	s->next = ds->next;
+    }
+
+  if (!sessions)
+    {
+      outputs_buffer_unref(dummy_obuf);
+      dummy_obuf = NULL;
+    }
+
+  DPRINTF(E_DBG, L_LAUDIO, "Dummy session for device %" PRIu64 " ended, %zu bytes written\n", ds->device_id, ds->bytes_written);
 
   outputs_device_session_remove(ds->device_id);
 
@@ -87,6 +118,10 @@ dummy_session_make(struct output_device *device, int callback_id)
   ds->device_id = device->id;
   ds->callback_id = callback_id;
 
+  if (device->quality.sample_rate && outputs_quality_subscribe(&device->quality, OUTPUT_TYPE_DUMMY) == 0)
+    ds->quality = device->quality;
+
+  ds->next = sessions;
   sessions = ds;
 
   outputs_device_session_add(device->id, ds);
@@ -222,6 +257,44 @@ dummy_device_cb_set(struct output_device *device, int callback_id)
   ds->callback_id = callback_id;
 }
 
+static void
+dummy_write(struct output_buffer *obuf)
+{
+  struct dummy_session *ds;
+  int i;
+
+  if (!sessions)
+    return;
+
+  for (ds = sessions; ds; ds = ds->next)
+    {
+      if (ds->state < OUTPUT_STATE_CONNECTED)
+	continue;
+
+      i = 0;
+      if (ds->quality.sample_rate)
+	{
+	  for (; obuf->data[i].buffer; i++)
+	    {
+	      if (quality_is_equal(&ds->quality, &obuf->data[i].quality))
+		break;
+	    }
+	}
+
+      if (!obuf->data[i].buffer)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Bug! Did not get audio in quality required\n");
+	  continue;
+	}
+
+      ds->state = OUTPUT_STATE_STREAMING;
+      ds->bytes_written += obuf->data[i].bufsize;
+    }
+
+  outputs_buffer_unref(dummy_obuf);
+  dummy_obuf = outputs_buffer_ref(obuf);
+}
+
 static int
 dummy_init(void)
 {
@@ -256,7 +329,8 @@ dummy_init(void)
 static void
 dummy_deinit(void)
 {
-  return;
+  outputs_buffer_unref(dummy_obuf);
+  dummy_obuf = NULL;
 }
 
 struct output_definition output_dummy =
@@ -265,8 +339,10 @@ struct output_definition output_dummy =
   .type = OUTPUT_TYPE_DUMMY,
   .priority = 99,
   .disabled = 0,
+  .buffered = 1,
   .init = dummy_init,
   .deinit = dummy_deinit,
+  .write = dummy_write,
   .device_start = dummy_device_start,
   .device_stop = dummy_device_stop,
   .device_flush = dummy_device_flush,
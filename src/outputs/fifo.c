@@ -31,6 +31,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <event2/buffer.h>
+
 #include "misc.h"
 #include "conffile.h"
 #include "logger.h"
@@ -38,49 +40,6 @@
 #include "outputs.h"
 
 #define FIFO_BUFFER_SIZE 65536 // pipe capacity on Linux >= 2.6.11
-#define FIFO_PACKET_SIZE 1408  // 352 samples/packet * 16 bit/sample * 2 channels
-
-struct fifo_packet
-{
-  /* pcm data */
-  uint8_t *samples;
-  size_t samples_size;
-
-  /* Presentation timestamp of the first sample */
-  struct timespec pts;
-
-  struct fifo_packet *next;
-  struct fifo_packet *prev;
-};
-
-struct fifo_buffer
-{
-  struct fifo_packet *head;
-  struct fifo_packet *tail;
-};
-
-static struct fifo_buffer buffer;
-
-static struct media_quality fifo_quality = { 44100, 16, 2, 0 };
-
-
-static void
-free_buffer()
-{
-  struct fifo_packet *packet;
-  struct fifo_packet *tmp;
-
-  packet = buffer.tail;
-  while (packet)
-    {
-      tmp = packet;
-      packet = packet->next;
-      free(tmp);
-    }
-
-  buffer.tail = NULL;
-  buffer.head = NULL;
-}
 
 struct fifo_session
 {
@@ -93,12 +52,26 @@ struct fifo_session
 
   int created;
 
+  // Audio waiting to be written. The first delay_size bytes are held back so
+  // the FIFO plays in sync with the other outputs, anything beyond that is
+  // audio the reader hasn't taken yet (write-behind), up to write_behind_max.
+  struct evbuffer *pending;
+  size_t delay_size;
+  size_t write_behind_max;
+
+  // Bytes dropped because the reader didn't keep up
+  uint64_t dropped;
+
   uint64_t device_id;
   int callback_id;
 };
 
 static struct fifo_session *sessions;
 
+static struct media_quality fifo_quality = { 44100, 16, 2, 0 };
+
+static int fifo_write_behind_ms;
+
 
 /* ---------------------------- FIFO HANDLING ---------------------------- */
 
@@ -211,10 +184,11 @@ static void
 fifo_empty(struct fifo_session *fifo_session)
 {
   char buf[FIFO_BUFFER_SIZE];
-  int bytes = 1;
+  ssize_t bytes;
 
-  while (bytes > 0 && errno != EINTR)
+  do
     bytes = read(fifo_session->input_fd, buf, FIFO_BUFFER_SIZE);
+  while (bytes > 0 || (bytes < 0 && errno == EINTR));
 
   if (bytes < 0 && errno != EAGAIN)
     {
@@ -222,6 +196,54 @@ fifo_empty(struct fifo_session *fifo_session)
     }
 }
 
+// Writes what is due without blocking. If the reader has fallen so far behind
+// that the write-behind is full, we discard what it hasn't read, so that it
+// will be reading current audio when it catches up.
+static int
+fifo_pending_write(struct fifo_session *fifo_session)
+{
+  struct output_device *device;
+  size_t len;
+  size_t excess;
+  int ret;
+
+  len = evbuffer_get_length(fifo_session->pending);
+  if (len <= fifo_session->delay_size)
+    return 0;
+
+  do
+    ret = evbuffer_write_atmost(fifo_session->pending, fifo_session->output_fd, len - fifo_session->delay_size);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && errno != EAGAIN)
+    {
+      DPRINTF(E_LOG, L_FIFO, "Failed to write to FIFO %s: %d\n", fifo_session->path, errno);
+      return -1;
+    }
+
+  device = outputs_device_get(fifo_session->device_id);
+  if (device && ret > 0)
+    device->stats.bytes_sent += ret;
+
+  len = evbuffer_get_length(fifo_session->pending);
+  if (len <= fifo_session->delay_size + fifo_session->write_behind_max)
+    return 0;
+
+  if (device)
+    device->stats.overruns++;
+
+  excess = len - fifo_session->delay_size;
+  evbuffer_drain(fifo_session->pending, excess);
+  fifo_empty(fifo_session);
+
+  fifo_session->dropped += excess;
+
+  DPRINTF(E_WARN, L_FIFO, "Reader of FIFO %s is not keeping up, dropped %zu bytes (total %" PRIu64 ")\n",
+    fifo_session->path, excess, fifo_session->dropped);
+
+  return 0;
+}
+
 /* ---------------------------- SESSION HANDLING ---------------------------- */
 
 static void
@@ -230,8 +252,8 @@ fifo_session_free(struct fifo_session *fifo_session)
   if (!fifo_session)
     return;
 
+  evbuffer_free(fifo_session->pending);
   free(fifo_session);
-  free_buffer();
 }
 
 static void
@@ -261,6 +283,10 @@ fifo_session_make(struct output_device *device, int callback_id)
   fifo_session->input_fd = -1;
   fifo_session->output_fd = -1;
 
+  CHECK_NULL(L_FIFO, fifo_session->pending = evbuffer_new());
+  fifo_session->delay_size = STOB(OUTPUTS_BUFFER_DURATION * fifo_quality.sample_rate, fifo_quality.bits_per_sample, fifo_quality.channels);
+  fifo_session->write_behind_max = STOB((uint64_t)fifo_write_behind_ms * fifo_quality.sample_rate / 1000, fifo_quality.bits_per_sample, fifo_quality.channels);
+
   sessions = fifo_session;
 
   outputs_device_session_add(device->id, fifo_session);
@@ -288,7 +314,7 @@ fifo_device_start(struct output_device *device, int callback_id)
   struct fifo_session *fifo_session;
   int ret;
 
-  ret = outputs_quality_subscribe(&fifo_quality);
+  ret = outputs_quality_subscribe(&fifo_quality, OUTPUT_TYPE_FIFO);
   if (ret < 0)
     return -1;
 
@@ -315,7 +341,7 @@ fifo_device_stop(struct output_device *device, int callback_id)
   fifo_session->callback_id = callback_id;
 
   fifo_close(fifo_session);
-  free_buffer();
+  evbuffer_drain(fifo_session->pending, -1);
 
   fifo_session->state = OUTPUT_STATE_STOPPED;
   fifo_status(fifo_session);
@@ -329,7 +355,7 @@ fifo_device_flush(struct output_device *device, int callback_id)
   struct fifo_session *fifo_session = device->session;
 
   fifo_empty(fifo_session);
-  free_buffer();
+  evbuffer_drain(fifo_session->pending, -1);
 
   fifo_session->callback_id = callback_id;
   fifo_session->state = OUTPUT_STATE_CONNECTED;
@@ -391,9 +417,7 @@ static void
 fifo_write(struct output_buffer *obuf)
 {
   struct fifo_session *fifo_session = sessions;
-  struct fifo_packet *packet;
-  struct timespec now;
-  ssize_t bytes;
+  int ret;
   int i;
 
   if (!fifo_session)
@@ -413,54 +437,12 @@ fifo_write(struct output_buffer *obuf)
 
   fifo_session->state = OUTPUT_STATE_STREAMING;
 
-  CHECK_NULL(L_FIFO, packet = calloc(1, sizeof(struct fifo_packet)));
-  CHECK_NULL(L_FIFO, packet->samples = malloc(obuf->data[i].bufsize));
-
-  memcpy(packet->samples, obuf->data[i].buffer, obuf->data[i].bufsize);
-  packet->samples_size = obuf->data[i].bufsize;
-  packet->pts = obuf->pts;
-
-  if (buffer.head)
-    {
-      buffer.head->next = packet;
-      packet->prev = buffer.head;
-    }
-
-  buffer.head = packet;
-  if (!buffer.tail)
-    buffer.tail = packet;
-
-  now.tv_sec = obuf->pts.tv_sec - OUTPUTS_BUFFER_DURATION;
-  now.tv_nsec = obuf->pts.tv_sec;
+  evbuffer_add(fifo_session->pending, obuf->data[i].buffer, obuf->data[i].bufsize);
 
-  while (buffer.tail && (timespec_cmp(buffer.tail->pts, now) == -1))
-    {
-      bytes = write(fifo_session->output_fd, buffer.tail->samples, buffer.tail->samples_size);
-      if (bytes > 0)
-	{
-	  packet = buffer.tail;
-	  buffer.tail = buffer.tail->next;
-	  free(packet->samples);
-	  free(packet);
-	  return;
-	}
-
-      if (bytes < 0)
-	{
-	  switch (errno)
-	    {
-	      case EAGAIN:
-		/* The pipe is full, so empty it */
-		fifo_empty(fifo_session);
-		continue;
-	      case EINTR:
-		continue;
-	    }
-
-	  DPRINTF(E_LOG, L_FIFO, "Failed to write to FIFO %s: %d\n", fifo_session->path, errno);
-	  return;
-	}
-    }
+  // The output fd is non-blocking, so this will never stall the player
+  ret = fifo_pending_write(fifo_session);
+  if (ret < 0)
+    evbuffer_drain(fifo_session->pending, -1);
 }
 
 static int
@@ -481,7 +463,9 @@ fifo_init(void)
 
   nickname = cfg_getstr(cfg_fifo, "nickname");
 
-  memset(&buffer, 0, sizeof(struct fifo_buffer));
+  fifo_write_behind_ms = cfg_getint(cfg_fifo, "write_behind_ms");
+  if (fifo_write_behind_ms < 0)
+    fifo_write_behind_ms = 0;
 
   CHECK_NULL(L_FIFO, device = calloc(1, sizeof(struct output_device)));
 
@@ -511,6 +495,7 @@ struct output_definition output_fifo =
   .type = OUTPUT_TYPE_FIFO,
   .priority = 98,
   .disabled = 0,
+  .buffered = 1,
   .init = fifo_init,
   .deinit = fifo_deinit,
   .device_start = fifo_device_start,
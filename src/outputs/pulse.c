@@ -40,6 +40,8 @@
 
 #define PULSE_MAX_DEVICES 64
 #define PULSE_LOG_MAX 10
+// Seconds between latency measurements for the device stats
+#define PULSE_STATS_INTERVAL 10
 
 /* TODO for Pulseaudio
    - Add real sync with AirPlay
@@ -70,9 +72,16 @@ struct pulse_session
   pa_volume_t volume;
 
   struct media_quality quality;
+  struct output_quality_caps caps;
 
   int logcount;
 
+  // Counted by the Pulseaudio thread, moved to the device by playback_write()
+  uint32_t underruns;
+  uint32_t overruns;
+
+  time_t stats_last;
+
   struct pulse_session *next;
 };
 
@@ -85,7 +94,6 @@ static struct pulse_session *sessions;
 // Internal list with indeces of the Pulseaudio devices (sinks) we have registered
 static uint32_t pulse_known_devices[PULSE_MAX_DEVICES];
 
-static struct media_quality pulse_last_quality;
 static struct media_quality pulse_fallback_quality = { 44100, 16, 2, 0 };
 
 // Converts from 0 - 100 to Pulseaudio's scale
@@ -116,7 +124,7 @@ pulse_session_free(struct pulse_session *ps)
       pa_threaded_mainloop_unlock(pulse.mainloop);
     }
 
-  outputs_quality_unsubscribe(&pulse_fallback_quality);
+  outputs_quality_caps_remove(&ps->caps);
 
   free(ps->devname);
 
@@ -150,14 +158,6 @@ static struct pulse_session *
 pulse_session_make(struct output_device *device, int callback_id)
 {
   struct pulse_session *ps;
-  int ret;
-
-  ret = outputs_quality_subscribe(&pulse_fallback_quality);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not subscribe to fallback audio quality\n");
-      return NULL;
-    }
 
   CHECK_NULL(L_LAUDIO, ps = calloc(1, sizeof(struct pulse_session)));
 
@@ -284,6 +284,8 @@ underrun_cb(pa_stream *s, void *userdata)
 {
   struct pulse_session *ps = userdata;
 
+  ps->underruns++;
+
   if (ps->logcount > PULSE_LOG_MAX)
     return;
 
@@ -300,6 +302,8 @@ overrun_cb(pa_stream *s, void *userdata)
 {
   struct pulse_session *ps = userdata;
 
+  ps->overruns++;
+
   if (ps->logcount > PULSE_LOG_MAX)
     return;
 
@@ -316,6 +320,7 @@ static void
 start_cb(pa_stream *s, void *userdata)
 {
   struct pulse_session *ps = userdata;
+  const pa_buffer_attr *attr;
 
   ps->state = pa_stream_get_state(s);
   if (ps->state == PA_STREAM_CREATING)
@@ -328,6 +333,11 @@ start_cb(pa_stream *s, void *userdata)
       return;
     }
 
+  attr = pa_stream_get_buffer_attr(s);
+  if (attr)
+    DPRINTF(E_INFO, L_LAUDIO, "Pulseaudio stream to '%s' started with tlength %" PRIu32 ", minreq %" PRIu32 ", prebuf %" PRIu32 ", maxlength %" PRIu32 " (bytes)\n",
+      ps->devname, attr->tlength, attr->minreq, attr->prebuf, attr->maxlength);
+
   pa_stream_set_underflow_callback(ps->stream, underrun_cb, ps);
   pa_stream_set_overflow_callback(ps->stream, overrun_cb, ps);
   pa_stream_set_state_callback(ps->stream, stream_state_cb, ps);
@@ -564,13 +574,25 @@ pulse_free(void)
     pa_threaded_mainloop_free(pulse.mainloop);
 }
 
+// Converts a configured number of ms to bytes, with 0 meaning server default
+static uint32_t
+attr_from_ms(int ms, struct media_quality *quality)
+{
+  if (ms <= 0)
+    return (uint32_t)-1;
+
+  return STOB((uint64_t)ms * quality->sample_rate / 1000, quality->bits_per_sample, quality->channels);
+}
+
 static int
 stream_open(struct pulse_session *ps, struct media_quality *quality, pa_stream_notify_cb_t cb)
 {
+  cfg_t *cfg_audio = cfg_getsec(cfg, "audio");
   pa_stream_flags_t flags;
   pa_sample_spec ss;
   pa_cvolume cvol;
   int offset_ms;
+  int tlength_ms;
   int ret;
 
   DPRINTF(E_DBG, L_LAUDIO, "Opening Pulseaudio stream to '%s'\n", ps->devname);
@@ -587,7 +609,7 @@ stream_open(struct pulse_session *ps, struct media_quality *quality, pa_stream_n
   ss.channels = quality->channels;
   ss.rate = quality->sample_rate;
 
-  offset_ms = cfg_getint(cfg_getsec(cfg, "audio"), "offset_ms");
+  offset_ms = cfg_getint(cfg_audio, "offset_ms");
   if (abs(offset_ms) > 1000)
     {
       DPRINTF(E_LOG, L_LAUDIO, "The audio offset (%d) set in the configuration is out of bounds\n", offset_ms);
@@ -603,10 +625,19 @@ stream_open(struct pulse_session *ps, struct media_quality *quality, pa_stream_n
 
   flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
-  ps->attr.tlength   = STOB((OUTPUTS_BUFFER_DURATION * 1000 + offset_ms) * ss.rate / 1000, quality->bits_per_sample, quality->channels);
+  // With adjust_latency the server sizes the sink's own buffer so that the
+  // total latency becomes tlength, instead of adding tlength on top of it
+  if (cfg_getbool(cfg_audio, "adjust_latency"))
+    flags |= PA_STREAM_ADJUST_LATENCY;
+
+  tlength_ms = cfg_getint(cfg_audio, "tlength_ms");
+  if (tlength_ms <= 0)
+    tlength_ms = OUTPUTS_BUFFER_DURATION * 1000 + offset_ms;
+
+  ps->attr.tlength   = attr_from_ms(tlength_ms, quality);
   ps->attr.maxlength = 2 * ps->attr.tlength;
-  ps->attr.prebuf    = (uint32_t)-1;
-  ps->attr.minreq    = (uint32_t)-1;
+  ps->attr.prebuf    = attr_from_ms(cfg_getint(cfg_audio, "prebuf_ms"), quality);
+  ps->attr.minreq    = attr_from_ms(cfg_getint(cfg_audio, "minreq_ms"), quality);
   ps->attr.fragsize  = (uint32_t)-1;
 
   pa_cvolume_set(&cvol, 2, ps->volume);
@@ -656,35 +687,31 @@ stream_close(struct pulse_session *ps, pa_stream_notify_cb_t cb)
 }
 
 static void
-playback_restart(struct pulse_session *ps, struct output_buffer *obuf)
+playback_restart(struct pulse_session *ps)
 {
   int ret;
 
   stream_close(ps, NULL);
 
-  // Negotiate quality (sample rate) with device - first we try to use the source quality
-  ps->quality = obuf->data[0].quality;
+  // The output module selected the quality from our caps, which is normally
+  // just the source quality, since the server will resample if required
+  ps->quality = ps->caps.selected;
   ret = stream_open(ps, &ps->quality, start_cb);
   if (ret < 0)
     {
-      DPRINTF(E_INFO, L_LAUDIO, "Input quality (%d/%d/%d) not supported, falling back to default\n",
+      DPRINTF(E_LOG, L_LAUDIO, "Pulseaudio device failed setting quality %d/%d/%d\n",
         ps->quality.sample_rate, ps->quality.bits_per_sample, ps->quality.channels);
-
-      ps->quality = pulse_fallback_quality;
-      ret = stream_open(ps, &ps->quality, start_cb);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_LAUDIO, "Pulseaudio device failed setting fallback quality\n");
-	  ps->state = PA_STREAM_FAILED;
-	  pulse_session_shutdown(ps);
-	  return;
-	}
+      ps->state = PA_STREAM_FAILED;
+      pulse_session_shutdown(ps);
     }
 }
 
 static void
 playback_write(struct pulse_session *ps, struct output_buffer *obuf)
 {
+  struct output_device *device;
+  pa_usec_t latency;
+  int negative;
   int i;
   int ret;
 
@@ -715,6 +742,23 @@ playback_write(struct pulse_session *ps, struct output_buffer *obuf)
       goto unlock;
     }
 
+  device = outputs_device_get(ps->device_id);
+  if (device)
+    {
+      device->stats.underruns += ps->underruns;
+      device->stats.overruns += ps->overruns;
+      device->stats.bytes_sent += obuf->data[i].bufsize;
+
+      if (obuf->pts.tv_sec - ps->stats_last >= PULSE_STATS_INTERVAL && pa_stream_get_latency(ps->stream, &latency, &negative) == 0)
+	{
+	  outputs_device_stats_sample(device, negative ? -(int)(latency / 1000) : (int)(latency / 1000), 0);
+	  ps->stats_last = obuf->pts.tv_sec;
+	}
+    }
+
+  ps->underruns = 0;
+  ps->overruns = 0;
+
  unlock:
   pa_threaded_mainloop_unlock(pulse.mainloop);
 }
@@ -753,6 +797,17 @@ pulse_device_start(struct output_device *device, int callback_id)
   if (!ps)
     return -1;
 
+  // Pulseaudio can play any of the rates and formats we use
+  ps->caps.sample_rates = UINT32_MAX;
+  ps->caps.bits_per_sample = OUTPUTS_QUALITY_BITS(16) | OUTPUTS_QUALITY_BITS(24) | OUTPUTS_QUALITY_BITS(32);
+  ps->caps.channels = pulse_fallback_quality.channels;
+  ps->caps.fallback = pulse_fallback_quality;
+  if (outputs_quality_caps_add(&ps->caps, OUTPUT_TYPE_PULSE) < 0)
+    {
+      pulse_session_cleanup(ps);
+      return -1;
+    }
+
   pulse_status(ps);
 
   return 1;
@@ -890,11 +945,11 @@ pulse_write(struct output_buffer *obuf)
     {
       next = ps->next;
 
-      // We have not set up a stream OR the quality changed, so we need to set it up again
-      if (ps->state == PA_STREAM_UNCONNECTED || !quality_is_equal(&obuf->data[0].quality, &pulse_last_quality))
+      // We have not set up a stream OR the selected quality changed, so we need
+      // to set it up again
+      if (ps->state == PA_STREAM_UNCONNECTED || !quality_is_equal(&ps->caps.selected, &ps->quality))
 	{
-	  playback_restart(ps, obuf);
-	  pulse_last_quality = obuf->data[0].quality;
+	  playback_restart(ps);
 	  continue; // Async, so the device won't be ready for writing just now
 	}
       else if (ps->state != PA_STREAM_READY)
@@ -72,7 +72,6 @@
 #include "outputs.h"
 #include "pair_ap/pair.h"
 
-#define ALAC_HEADER_LEN                      3
 
 #define RAOP_QUALITY_SAMPLE_RATE_DEFAULT     44100
 #define RAOP_QUALITY_BITS_PER_SAMPLE_DEFAULT 16
@@ -230,6 +229,8 @@ struct raop_session
   struct pair_setup_context *pair_setup_ctx;
 
   int server_fd;
+  // Audio packets waiting to be sent on server_fd
+  struct rtp_batch *batch;
 
   struct raop_service *timing_svc;
   struct raop_service *control_svc;
@@ -249,6 +250,9 @@ struct raop_service
   int fd;
   unsigned short port;
   struct event *ev;
+
+  // Packets to send to devices on this service's socket
+  struct rtp_batch *batch;
 };
 
 typedef void (*evrtsp_req_cb)(struct evrtsp_request *req, void *arg);
@@ -349,93 +353,26 @@ raop_device_start(struct output_device *rd, int callback_id);
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
-/* ALAC bits writer - big endian
- * p    outgoing buffer pointer
- * val  bitfield value
- * blen bitfield length, max 8 bits
- * bpos bit position in the current byte (pointed by *p)
- */
-static inline void
-alac_write_bits(uint8_t **p, uint8_t val, int blen, int *bpos)
-{
-  int lb;
-  int rb;
-  int bd;
-
-  /* Remaining bits in the current byte */
-  lb = 7 - *bpos + 1;
-
-  /* Number of bits overflowing */
-  rb = lb - blen;
-
-  if (rb >= 0)
-    {
-      bd = val << rb;
-      if (*bpos == 0)
-	**p = bd;
-      else
-	**p |= bd;
-
-      /* No over- nor underflow, we're done with this byte */
-      if (rb == 0)
-	{
-	  *p += 1;
-	  *bpos = 0;
-	}
-      else
-	*bpos += blen;
-    }
-  else
-    {
-      /* Fill current byte */
-      bd = val >> -rb;
-      **p |= bd;
-
-      /* Overflow goes to the next byte */
-      *p += 1;
-      **p = val << (8 + rb);
-      *bpos = -rb;
-    }
-}
-
-/* Raw data must be little endian */
+// The retransmit buffer adapts to the devices, within bounds set in the config
 static void
-alac_encode_uncompressed(uint8_t *dst, uint8_t *raw, int len)
+pktbuf_bounds_set(struct rtp_session *rtp_session, struct media_quality *quality)
 {
-  uint8_t *maxraw;
-  int bpos;
-
-  bpos = 0;
-  maxraw = raw + len;
+  cfg_t *cfg_airplay = cfg_getsec(cfg, "airplay_shared");
+  size_t min;
+  size_t max;
 
-  alac_write_bits(&dst, 1, 3, &bpos); /* channel=1, stereo */
-  alac_write_bits(&dst, 0, 4, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 8, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 4, &bpos); /* unknown */
-  alac_write_bits(&dst, 0, 1, &bpos); /* hassize */
+  min = (size_t)cfg_getint(cfg_airplay, "retransmit_buffer_min_ms") * quality->sample_rate / 1000 / RAOP_SAMPLES_PER_PACKET;
+  max = (size_t)cfg_getint(cfg_airplay, "retransmit_buffer_max_ms") * quality->sample_rate / 1000 / RAOP_SAMPLES_PER_PACKET;
 
-  alac_write_bits(&dst, 0, 2, &bpos); /* unused */
-  alac_write_bits(&dst, 1, 1, &bpos); /* is-not-compressed */
-
-  for (; raw < maxraw; raw += 4)
-    {
-      /* Byteswap to big endian */
-      alac_write_bits(&dst, *(raw + 1), 8, &bpos);
-      alac_write_bits(&dst, *raw, 8, &bpos);
-      alac_write_bits(&dst, *(raw + 3), 8, &bpos);
-      alac_write_bits(&dst, *(raw + 2), 8, &bpos);
-    }
-
-  alac_write_bits(&dst, 7, 3, &bpos); /* end tag */
+  rtp_session_pktbuf_adapt(rtp_session, min, max);
 }
 
 static int
 alac_encode_no_xcode(struct evbuffer *evbuf, uint8_t *rawbuf, size_t rawbuf_size)
 {
 #define BODY_LEN STOB(RAOP_SAMPLES_PER_PACKET, RAOP_QUALITY_BITS_PER_SAMPLE_DEFAULT, RAOP_QUALITY_CHANNELS_DEFAULT)
-  // the "+ 1" above is space for the end tag (3 bits)
-  uint8_t dst[ALAC_HEADER_LEN + BODY_LEN + 1];
-  int len = ALAC_HEADER_LEN + rawbuf_size + 1;
+  uint8_t dst[ALAC_UNCOMPRESSED_LEN(BODY_LEN)];
+  int len = ALAC_UNCOMPRESSED_LEN(rawbuf_size);
 
   if (len > sizeof(dst))
     {
@@ -443,7 +380,7 @@ alac_encode_no_xcode(struct evbuffer *evbuf, uint8_t *rawbuf, size_t rawbuf_size
       return -1;
     }
 
-  alac_encode_uncompressed(dst, rawbuf, rawbuf_size);
+  alac_uncompressed_pack(dst, rawbuf, rawbuf_size);
   evbuffer_add(evbuf, dst, len);
   return len;
 #undef BODY_LEN
@@ -1811,7 +1748,7 @@ master_session_free(struct raop_master_session *rms)
   outputs_quality_unsubscribe(&rms->rtp_session->quality);
   rtp_session_free(rms->rtp_session);
 
-  transcode_encode_cleanup(&rms->encode_ctx);
+  transcode_encode_release(&rms->encode_ctx);
 
   if (rms->input_buffer)
     evbuffer_free(rms->input_buffer);
@@ -1855,7 +1792,6 @@ static struct raop_master_session *
 master_session_make(struct media_quality *quality, bool encrypt)
 {
   struct raop_master_session *rms;
-  struct transcode_encode_setup_args encode_args = { .profile = XCODE_ALAC, .quality = quality };
   int ret;
 
   // First check if we already have a suitable session
@@ -1866,7 +1802,7 @@ master_session_make(struct media_quality *quality, bool encrypt)
     }
 
   // Let's create a master session
-  ret = outputs_quality_subscribe(quality);
+  ret = outputs_quality_subscribe(quality, OUTPUT_TYPE_RAOP);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Could not subscribe to required audio quality (%d/%d/%d)\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
@@ -1876,6 +1812,8 @@ master_session_make(struct media_quality *quality, bool encrypt)
   CHECK_NULL(L_RAOP, rms = calloc(1, sizeof(struct raop_master_session)));
 
   rms->rtp_session = rtp_session_new(quality, RAOP_PACKET_BUFFER_SIZE, 0);
+  if (rms->rtp_session)
+    pktbuf_bounds_set(rms->rtp_session, quality);
   if (!rms->rtp_session)
     {
       outputs_quality_unsubscribe(quality);
@@ -1883,15 +1821,8 @@ master_session_make(struct media_quality *quality, bool encrypt)
       return NULL;
     }
 
-  encode_args.src_ctx = transcode_decode_setup_raw(XCODE_PCM16, quality);
-  if (!encode_args.src_ctx)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Could not create decoding context\n");
-      goto error;
-    }
-
-  rms->encode_ctx = transcode_encode_setup(encode_args);
-  transcode_decode_cleanup(&encode_args.src_ctx);
+  // Sessions come and go with the speakers, so reuse the encoder if possible
+  rms->encode_ctx = transcode_encode_setup_pooled(XCODE_ALAC, quality, XCODE_PCM16, quality, NULL);
   if (!rms->encode_ctx)
     {
       DPRINTF(E_LOG, L_RAOP, "Will not be able to stream AirPlay 2, ffmpeg has no ALAC encoder\n");
@@ -1939,6 +1870,8 @@ session_free(struct raop_session *rs)
   if (rs->server_fd >= 0)
     close(rs->server_fd);
 
+  rtp_batch_free(rs->batch);
+
   free(rs->realm);
   free(rs->nonce);
   free(rs->session);
@@ -2190,6 +2123,7 @@ session_make(struct output_device *rd, int callback_id, bool only_probe)
   rs->callback_id = callback_id;
 
   rs->server_fd = -1;
+  CHECK_NULL(L_RAOP, rs->batch = rtp_batch_new());
 
   rs->password = rd->password;
 
@@ -2840,14 +2774,11 @@ packet_encrypt(struct rtp_packet *pkt)
 }
 
 static int
-packet_send(struct raop_session *rs, struct rtp_packet *pkt)
+packets_flush(struct raop_session *rs)
 {
   int ret;
 
-  if (!rs)
-    return -1;
-
-  ret = send(rs->server_fd, pkt->data, pkt->data_len, 0);
+  ret = rtp_batch_flush(rs->batch, rs->server_fd);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(errno));
@@ -2857,12 +2788,30 @@ packet_send(struct raop_session *rs, struct rtp_packet *pkt)
       deferred_session_failure(rs);
       return -1;
     }
-  else if (ret != pkt->data_len)
+
+  return 0;
+}
+
+// Queues the packet, the caller must call packets_flush() when done
+static int
+packet_send(struct raop_session *rs, struct rtp_packet *pkt)
+{
+  uint8_t *data;
+
+  if (!rs)
+    return -1;
+
+  data = rtp_batch_next(rs->batch, pkt->data_len, NULL, 0);
+  if (!data)
     {
-      DPRINTF(E_WARN, L_RAOP, "Partial send (%d) for '%s'\n", ret, rs->devname);
-      return -1;
+      if (packets_flush(rs) < 0)
+	return -1;
+
+      data = rtp_batch_next(rs->batch, pkt->data_len, NULL, 0);
     }
 
+  memcpy(data, pkt->data, pkt->data_len);
+
 /*  DPRINTF(E_DBG, L_RAOP, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
     rs->master_session->rtp_session->seqnum,
     rs->master_session->rtp_session->pos,
@@ -2873,11 +2822,21 @@ packet_send(struct raop_session *rs, struct rtp_packet *pkt)
   return 0;
 }
 
+static void
+control_packets_flush(struct raop_service *svc)
+{
+  int ret;
+
+  ret = rtp_batch_flush(svc->batch, svc->fd);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_RAOP, "Could not send playback sync to devices: %s\n", strerror(errno));
+}
+
 static void
 control_packet_send(struct raop_session *rs, struct rtp_packet *pkt)
 {
   socklen_t addrlen;
-  int ret;
+  uint8_t *data;
 
   switch (rs->family)
     {
@@ -2896,9 +2855,16 @@ control_packet_send(struct raop_session *rs, struct rtp_packet *pkt)
 	return;
     }
 
-  ret = sendto(rs->control_svc->fd, pkt->data, pkt->data_len, 0, &rs->naddr.sa, addrlen);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_RAOP, "Could not send playback sync to device '%s': %s\n", rs->devname, strerror(errno));
+  // Queued, so that sync packets for all devices can go in one system call,
+  // see control_packets_flush()
+  data = rtp_batch_next(rs->control_svc->batch, pkt->data_len, &rs->naddr.sa, addrlen);
+  if (!data)
+    {
+      control_packets_flush(rs->control_svc);
+      data = rtp_batch_next(rs->control_svc->batch, pkt->data_len, &rs->naddr.sa, addrlen);
+    }
+
+  memcpy(data, pkt->data, pkt->data_len);
 }
 
 static void
@@ -2906,7 +2872,9 @@ packets_resend(struct raop_session *rs, uint16_t seqnum, int len)
 {
   struct rtp_session *rtp_session;
   struct rtp_packet *pkt;
+  struct output_device *device;
   uint16_t s;
+  int hits = 0;
   int i;
   bool pkt_missing = false;
 
@@ -2920,11 +2888,23 @@ packets_resend(struct raop_session *rs, uint16_t seqnum, int len)
     {
       pkt = rtp_packet_get(rtp_session, s);
       if (pkt)
-	packet_send(rs, pkt);
+	{
+	  packet_send(rs, pkt);
+	  hits++;
+	}
       else
 	pkt_missing = true;
     }
 
+  packets_flush(rs);
+
+  device = outputs_device_get(rs->device_id);
+  if (device)
+    {
+      device->stats.resend_hits += hits;
+      device->stats.resend_misses += len - hits;
+    }
+
   if (pkt_missing)
     DPRINTF(E_WARN, L_RAOP, "Device '%s' retransmit request for seqnum %" PRIu16 " (len %d) is outside buffer range (next seqnum %" PRIu16 ", len %zu)\n",
       rs->devname, seqnum, len, rtp_session->seqnum, rtp_session->pktbuf_len);
@@ -3017,6 +2997,18 @@ timestamp_set(struct raop_master_session *rms, struct timespec ts)
   rms->cur_stamp.pos = rms->rtp_session->pos + rms->input_buffer_samples - rms->output_buffer_samples;
 }
 
+static void
+session_stats_update(struct raop_session *rs)
+{
+  struct output_device *device;
+
+  device = outputs_device_get(rs->device_id);
+  if (device)
+    device->stats.bytes_sent += rs->batch->bytes_sent;
+
+  rs->batch->bytes_sent = 0;
+}
+
 static void
 packets_sync_send(struct raop_master_session *rms)
 {
@@ -3049,8 +3041,12 @@ packets_sync_send(struct raop_master_session *rms)
 	{
 	  sync_pkt = rtp_sync_packet_next(rms->rtp_session, rms->cur_stamp, 0x80);
 	  control_packet_send(rs, sync_pkt);
+
+	  session_stats_update(rs);
 	}
     }
+
+  control_packets_flush(&raop_control_svc);
 }
 
 
@@ -3065,9 +3061,12 @@ service_stop(struct raop_service *svc)
   if (svc->fd >= 0)
     close(svc->fd);
 
+  rtp_batch_free(svc->batch);
+
   svc->ev = NULL;
   svc->fd = -1;
   svc->port = 0;
+  svc->batch = NULL;
 }
 
 static int
@@ -3092,6 +3091,7 @@ service_start(struct raop_service *svc, event_callback_fn cb, unsigned short por
   event_add(svc->ev, NULL);
 
   svc->port = port;
+  svc->batch = rtp_batch_new();
 
   return 0;
 
@@ -4577,6 +4577,11 @@ raop_write(struct output_buffer *obuf)
 	}
     }
 
+  // The packets from packets_send() are queued, so each session gets all of
+  // them with one system call
+  for (rs = raop_sessions; rs; rs = rs->next)
+    packets_flush(rs);
+
   // Check for devices that have joined since last write (we have already sent them
   // initialization sync and rtp packets via packets_sync_send and packets_send)
   for (rs = raop_sessions; rs; rs = rs->next)
@@ -30,6 +30,8 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <gcrypt.h>
 
@@ -40,6 +42,10 @@
 #define RTP_HEADER_LEN        12
 #define RTCP_SYNC_PACKET_LEN  20 
 
+// How long (in seconds) the retransmit buffer must have been too large before
+// we shrink it
+#define RTP_PKTBUF_SHRINK_DELAY 30
+
 // NTP timestamp definitions
 #define FRAC             4294967296. // 2^32 as a double
 #define NTP_EPOCH_DELTA  0x83aa7e80  // 2208988800 - that's 1970 - 1900 in seconds
@@ -110,6 +116,88 @@ rtp_session_flush(struct rtp_session *session)
   session->sync_counter = 0;
 }
 
+// Moves the newest packets to a buffer of the new size, dropping the oldest
+// ones if it is smaller
+static void
+pktbuf_resize(struct rtp_session *session, size_t size)
+{
+  struct rtp_packet *pktbuf;
+  size_t keep;
+  size_t idx;
+  size_t i;
+
+  if (size == session->pktbuf_size)
+    return;
+
+  DPRINTF(E_DBG, L_PLAYER, "Resizing RTP retransmit buffer from %zu to %zu packets\n", session->pktbuf_size, size);
+
+  CHECK_NULL(L_PLAYER, pktbuf = calloc(size, sizeof(struct rtp_packet)));
+
+  keep = MIN(session->pktbuf_len, size);
+  for (i = 0; i < keep; i++)
+    {
+      idx = (session->pktbuf_next + session->pktbuf_size - keep + i) % session->pktbuf_size;
+      pktbuf[i] = session->pktbuf[idx];
+      session->pktbuf[idx].data = NULL;
+    }
+
+  for (i = 0; i < session->pktbuf_size; i++)
+    free(session->pktbuf[i].data);
+
+  free(session->pktbuf);
+
+  session->pktbuf = pktbuf;
+  session->pktbuf_size = size;
+  session->pktbuf_len = keep;
+  session->pktbuf_next = keep % size;
+}
+
+static void
+pktbuf_adapt(struct rtp_session *session, int samples)
+{
+  size_t wanted;
+
+  // We want to keep twice the distance of the furthest request
+  wanted = 2 * session->resend_distance_max;
+  wanted = MAX(wanted, session->pktbuf_size_min);
+  wanted = MIN(wanted, session->pktbuf_size_max);
+
+  if (wanted > session->pktbuf_size)
+    {
+      pktbuf_resize(session, wanted);
+      return;
+    }
+
+  session->adapt_counter += samples;
+  if (session->adapt_counter < RTP_PKTBUF_SHRINK_DELAY * session->quality.sample_rate)
+    return;
+
+  pktbuf_resize(session, wanted);
+
+  session->resend_distance_max = 0;
+  session->adapt_counter = 0;
+}
+
+void
+rtp_session_pktbuf_adapt(struct rtp_session *session, size_t min, size_t max)
+{
+  if (min == 0 || max < min)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Invalid RTP retransmit buffer bounds (min %zu, max %zu), keeping fixed size\n", min, max);
+      return;
+    }
+
+  session->pktbuf_size_min = min;
+  session->pktbuf_size_max = max;
+  session->resend_distance_max = 0;
+  session->adapt_counter = 0;
+
+  if (session->pktbuf_size < min)
+    pktbuf_resize(session, min);
+  else if (session->pktbuf_size > max)
+    pktbuf_resize(session, max);
+}
+
 // We don't want the caller to malloc payload for every packet, so instead we
 // will get him a packet from the ring buffer, thus in most cases reusing memory
 struct rtp_packet *
@@ -180,6 +268,10 @@ rtp_packet_commit(struct rtp_session *session, struct rtp_packet *pkt)
   session->seqnum++;
   session->pos += pkt->samples;
   session->sync_counter += pkt->samples;
+
+  // Only now, since the packets the caller has may be moved by a resize
+  if (session->pktbuf_size_max > 0)
+    pktbuf_adapt(session, pkt->samples);
 }
 
 struct rtp_packet *
@@ -190,6 +282,13 @@ rtp_packet_get(struct rtp_session *session, uint16_t seqnum)
   uint16_t delta;
   size_t idx;
 
+  // Distance from current seqnum (which is at pktbuf_next) to the requested seqnum
+  delta = session->seqnum - seqnum;
+
+  // A (bogus) request for a packet we haven't sent yet would look very far back
+  if (delta < 0x8000 && delta > session->resend_distance_max)
+    session->resend_distance_max = delta;
+
   if (session->pktbuf_len == 0)
     {
       DPRINTF(E_DBG, L_PLAYER, "Seqnum %" PRIu16 " requested, but buffer is empty\n", seqnum);
@@ -211,9 +310,6 @@ rtp_packet_get(struct rtp_session *session, uint16_t seqnum)
       return NULL;
     }
 
-  // Distance from current seqnum (which is at pktbuf_next) to the requested seqnum
-  delta = session->seqnum - seqnum;
-
   // Adding pktbuf_size so we don't have to deal with "negative" pktbuf_next - delta
   idx = (session->pktbuf_next + session->pktbuf_size - delta) % session->pktbuf_size;
 
@@ -349,3 +445,199 @@ rtcp_packet_parse(struct rtcp_packet *pkt, uint8_t *data, size_t size)
   DPRINTF(E_SPAM, L_PLAYER, "Ignoring incoming packet, packet is non-RTCP, malformed or partial (size=%zu)\n", size);
   return -1;
 }
+
+
+/* ------------------------- Uncompressed ALAC frames ----------------------- */
+
+// The frame is a 23 bit header, the samples as big endian and a 3 bit end tag.
+// Since the header leaves us at bit 7 of the third byte, every output byte is
+// made of the last 7 bits of one input byte and the first bit of the next.
+// Header: channels (3 bits) = 1 (stereo), 16 bits unknown, hassize (1 bit) = 0,
+// 2 bits unused, is-not-compressed (1 bit) = 1
+#define ALAC_HEADER_0 0x20
+#define ALAC_HEADER_1 0x00
+#define ALAC_HEADER_2 0x02
+#define ALAC_END_TAG  0x07
+
+// Byte i of the big endian sample stream
+#define SAMPLE_BYTE(raw, i) ((raw)[(i) ^ 1])
+
+void
+alac_uncompressed_pack(uint8_t *dst, const uint8_t *raw, size_t len)
+{
+  size_t i = 0;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint64_t w;
+#endif
+
+  dst[0] = ALAC_HEADER_0;
+  dst[1] = ALAC_HEADER_1;
+
+  if (len == 0)
+    {
+      dst[2] = ALAC_HEADER_2 | (ALAC_END_TAG >> 2);
+      dst[3] = (ALAC_END_TAG << 6) & 0xff;
+      return;
+    }
+
+  dst[2] = ALAC_HEADER_2 | (SAMPLE_BYTE(raw, 0) >> 7);
+  dst += 3;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  // Eight bytes at a time, the top bit of the following byte is the carry
+  for (; i + 8 < len; i += 8)
+    {
+      memcpy(&w, raw + i, sizeof(w));
+
+      // Reverse the order of the four samples, then a byte swap of the result
+      // gives the byteswapped samples in the original order
+      w = (w >> 32) | (w << 32);
+      w = ((w & 0xffff0000ffff0000ULL) >> 16) | ((w & 0x0000ffff0000ffffULL) << 16);
+      w = (w << 1) | (SAMPLE_BYTE(raw, i + 8) >> 7);
+      w = __builtin_bswap64(w);
+
+      memcpy(dst + i, &w, sizeof(w));
+    }
+#endif
+
+  for (; i + 1 < len; i++)
+    dst[i] = (SAMPLE_BYTE(raw, i) << 1) | (SAMPLE_BYTE(raw, i + 1) >> 7);
+
+  dst[i] = (SAMPLE_BYTE(raw, i) << 1) | (ALAC_END_TAG >> 2);
+  dst[i + 1] = (ALAC_END_TAG << 6) & 0xff;
+}
+
+
+/* ------------------------------- Batch sending ---------------------------- */
+
+struct rtp_batch *
+rtp_batch_new(void)
+{
+  struct rtp_batch *batch;
+
+  CHECK_NULL(L_PLAYER, batch = calloc(1, sizeof(struct rtp_batch)));
+
+  return batch;
+}
+
+void
+rtp_batch_free(struct rtp_batch *batch)
+{
+  int i;
+
+  if (!batch)
+    return;
+
+  for (i = 0; i < RTP_BATCH_MAX; i++)
+    free(batch->data[i]);
+
+  free(batch);
+}
+
+uint8_t *
+rtp_batch_next(struct rtp_batch *batch, size_t len, struct sockaddr *addr, socklen_t addrlen)
+{
+  int n = batch->count;
+
+  if (n >= RTP_BATCH_MAX)
+    return NULL;
+
+  // The buffers are kept between flushes, so this will rarely allocate
+  if (batch->data_size[n] < len)
+    {
+      CHECK_NULL(L_PLAYER, batch->data[n] = realloc(batch->data[n], len));
+      batch->data_size[n] = len;
+    }
+
+  batch->data_len[n] = len;
+
+  if (addr && addrlen <= sizeof(batch->addr[n]))
+    {
+      memcpy(&batch->addr[n], addr, addrlen);
+      batch->addrlen[n] = addrlen;
+    }
+  else
+    batch->addrlen[n] = 0;
+
+  batch->count++;
+
+  return batch->data[n];
+}
+
+#ifdef HAVE_SENDMMSG
+static int
+batch_send(struct rtp_batch *batch, int fd)
+{
+  struct mmsghdr msg[RTP_BATCH_MAX];
+  struct iovec iov[RTP_BATCH_MAX];
+  int sent;
+  int ret;
+  int i;
+
+  memset(msg, 0, batch->count * sizeof(struct mmsghdr));
+
+  for (i = 0; i < batch->count; i++)
+    {
+      iov[i].iov_base = batch->data[i];
+      iov[i].iov_len = batch->data_len[i];
+
+      msg[i].msg_hdr.msg_iov = &iov[i];
+      msg[i].msg_hdr.msg_iovlen = 1;
+      if (batch->addrlen[i] > 0)
+	{
+	  msg[i].msg_hdr.msg_name = &batch->addr[i];
+	  msg[i].msg_hdr.msg_namelen = batch->addrlen[i];
+	}
+    }
+
+  // sendmmsg() may return before all are sent, e.g. if interrupted
+  for (sent = 0; sent < batch->count; sent += ret)
+    {
+      ret = sendmmsg(fd, msg + sent, batch->count - sent, 0);
+      if (ret < 0 && errno == EINTR)
+	ret = 0;
+      else if (ret <= 0)
+	return -1;
+    }
+
+  return sent;
+}
+#else
+static int
+batch_send(struct rtp_batch *batch, int fd)
+{
+  ssize_t ret;
+  int i;
+
+  for (i = 0; i < batch->count; i++)
+    {
+      if (batch->addrlen[i] > 0)
+	ret = sendto(fd, batch->data[i], batch->data_len[i], 0, (struct sockaddr *)&batch->addr[i], batch->addrlen[i]);
+      else
+	ret = send(fd, batch->data[i], batch->data_len[i], 0);
+
+      if (ret < 0)
+	return -1;
+    }
+
+  return i;
+}
+#endif
+
+int
+rtp_batch_flush(struct rtp_batch *batch, int fd)
+{
+  int ret;
+  int i;
+
+  if (batch->count == 0)
+    return 0;
+
+  ret = batch_send(batch, fd);
+  for (i = 0; i < ret; i++)
+    batch->bytes_sent += batch->data_len[i];
+
+  batch->count = 0;
+
+  return ret;
+}
@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sys/socket.h>
+
+// Max number of packets that are sent with one system call
+#define RTP_BATCH_MAX 32
 
 struct rtcp_timestamp
 {
@@ -80,6 +84,21 @@ struct rtcp_packet
     };
 };
 
+// Packets queued for sending on a socket. The packets are copied, so the
+// caller is free to reuse or change its own after queuing.
+struct rtp_batch
+{
+  int count;
+  uint8_t *data[RTP_BATCH_MAX];
+  size_t data_size[RTP_BATCH_MAX];
+  size_t data_len[RTP_BATCH_MAX];
+  struct sockaddr_storage addr[RTP_BATCH_MAX];
+  socklen_t addrlen[RTP_BATCH_MAX];
+
+  // Bytes sent since the caller last reset it, for stats
+  uint64_t bytes_sent;
+};
+
 // An RTP session is characterised by all the receivers belonging to the session
 // getting the same RTP and RTCP packets. So if you have clients that require
 // different sample rates or where only some can accept encrypted payloads then
@@ -98,6 +117,15 @@ struct rtp_session
   size_t pktbuf_size;
   size_t pktbuf_len;
 
+  // Bounds for pktbuf_size, which is adapted to how far back receivers ask for
+  // retransmission, see rtp_session_pktbuf_adapt(). Zero if the size is fixed.
+  size_t pktbuf_size_min;
+  size_t pktbuf_size_max;
+  // Largest distance (in packets) of a retransmit request and samples sent
+  // since the size was last adapted
+  size_t resend_distance_max;
+  int adapt_counter;
+
   // Number of samples to elapse before sync'ing. If 0 we set it to the s/r, so
   // we sync once a second. If negative we won't sync.
   int sync_each_nsamples;
@@ -115,6 +143,18 @@ rtp_session_free(struct rtp_session *session);
 void
 rtp_session_flush(struct rtp_session *session);
 
+/* Lets the size of the retransmit buffer follow the needs of the receivers,
+ * within the given bounds. The buffer grows as soon as a request comes in for
+ * a packet further back than half the buffer, and shrinks if no requests have
+ * needed it for a while.
+ *
+ * @in  session       RTP session
+ * @in  min           Minimum number of packets to keep
+ * @in  max           Maximum number of packets to keep
+ */
+void
+rtp_session_pktbuf_adapt(struct rtp_session *session, size_t min, size_t max);
+
 
 /* Gets the next packet from the packet buffer, pkt->payload will be allocated
  * to a size of payload_len (or larger).
@@ -157,4 +197,47 @@ rtp_sync_packet_next(struct rtp_session *session, struct rtcp_timestamp cur_stam
 int
 rtcp_packet_parse(struct rtcp_packet *pkt, uint8_t *data, size_t size);
 
+/* Packs 16 bit stereo PCM into an uncompressed ALAC frame, so the ALAC encoder
+ * can be skipped entirely. The frame is ALAC_UNCOMPRESSED_LEN(len) bytes.
+ *
+ * @in  dst           Buffer for the frame, must be ALAC_UNCOMPRESSED_LEN(len)
+ * @in  raw           Samples, signed 16 bit little endian, interleaved
+ * @in  len           Length of raw in bytes, must be a multiple of 4
+ */
+#define ALAC_UNCOMPRESSED_LEN(len) ((len) + 4)
+
+void
+alac_uncompressed_pack(uint8_t *dst, const uint8_t *raw, size_t len);
+
+
+struct rtp_batch *
+rtp_batch_new(void);
+
+void
+rtp_batch_free(struct rtp_batch *batch);
+
+/* Reserves room for a packet in the batch. The caller must write the packet to
+ * the returned buffer before the batch is flushed.
+ *
+ * @in  batch         Batch to add the packet to
+ * @in  len           Length of the packet
+ * @in  addr          Destination, NULL if the socket is connected
+ * @in  addrlen       Length of addr
+ * @return            Buffer of len bytes, NULL if the batch is full and must be
+ *                    flushed first
+ */
+uint8_t *
+rtp_batch_next(struct rtp_batch *batch, size_t len, struct sockaddr *addr, socklen_t addrlen);
+
+/* Sends the queued packets, using as few system calls as the platform allows,
+ * and empties the batch. Packets that were not sent are dropped.
+ *
+ * @in  batch         Batch to send
+ * @in  fd            Socket to send on
+ * @return            Number of packets sent, -1 (with errno set) if sending
+ *                    failed before all were sent
+ */
+int
+rtp_batch_flush(struct rtp_batch *batch, int fd);
+
 #endif  /* !__RTP_COMMON_H__ */
@@ -24,9 +24,12 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
 #include <uninorm.h>
-#include <fcntl.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
 
 #include "outputs.h"
 #include "misc.h"
@@ -35,35 +38,55 @@
 #include "transcode.h"
 #include "logger.h"
 #include "db.h"
+#include "streaming.h"
 
 /* About
  *
  * This output takes the writes from the player thread, gives them to a worker
- * thread for mp3 encoding, and then the mp3 is written to a fd for the httpd
- * request handler to read and pass to clients. If there is no writing from the
- * player, but there are clients, it instead writes silence to the fd.
+ * thread for encoding (mp3, ogg/opus or flac), and then the encoded data is
+ * written to a ring buffer that is shared by all the httpd sessions that want
+ * the format. When there is new data the sessions are signalled, and each then
+ * reads from the ring from its own position. So no matter how many listeners
+ * there are, we only encode and store the data once. If there is no writing
+ * from the player, but there are sessions, it instead encodes silence.
+ *
+ * Ogg and flac streams start with a header, which is kept and given to each
+ * session before its first read from the ring.
  */
 
 // Seconds between sending a frame of silence when player is idle
 // (to prevent client from hanging up)
 #define STREAMING_SILENCE_INTERVAL 1
 
-// The wanted structure represents a particular format and quality that should
-// be produced for one or more sessions. A pipe pair is created for each session
-// for the i/o.
-#define WANTED_PIPES_MAX 8
+// Seconds of encoded audio the ring holds, which is how far a session can fall
+// behind (e.g. because the client is slow) before it must skip ahead
+#define STREAMING_RING_SECONDS 10
 
-struct pipepair
+struct streaming_reader
 {
-  int writefd;
-  int readfd;
+  int id;
+
+  // The httpd session's event, which we activate when there is new data
+  struct event *ev;
+
+  // Position in the ring of the next byte to read, see streaming_wanted
+  uint64_t pos;
+
+  // To know if the session has the current title
+  unsigned int title_seqnum;
+
+  // Whether the session has been given the header of the stream
+  bool header_sent;
+
+  struct streaming_reader *next;
 };
 
+// The wanted structure represents a particular format and quality that should
+// be produced for one or more sessions (readers)
 struct streaming_wanted
 {
   int num_sessions; // for refcounting
-  struct pipepair audio[WANTED_PIPES_MAX];
-  struct pipepair metadata[WANTED_PIPES_MAX];
+  struct streaming_reader *readers;
 
   enum media_format format;
   struct media_quality quality;
@@ -72,10 +95,25 @@ struct streaming_wanted
   struct evbuffer *audio_out;
   struct encode_ctx *xcode_ctx;
 
+  // Set if encoding failed, which ends all the sessions
+  bool failed;
+
   int nb_samples;
   uint8_t *frame_data;
   size_t frame_size;
 
+  // Container header (not for mp3) that each session must get first
+  uint8_t *header;
+  size_t header_len;
+
+  // Ring of encoded data. Positions are counted in bytes written since the
+  // start, so they don't wrap, and the index in the ring is pos % ring_size.
+  uint8_t *ring;
+  size_t ring_size;
+  uint64_t ring_pos;
+  // Where the latest write started, which is a frame boundary
+  uint64_t ring_pos_frame;
+
   struct streaming_wanted *next;
 };
 
@@ -87,6 +125,9 @@ struct streaming_ctx
   struct media_quality last_quality;
 
   char title[4064]; // See STREAMING_ICY_METALEN_MAX in http_streaming.c
+  unsigned int title_seqnum;
+
+  int reader_id_next;
 
   // seqnum may wrap around so must be unsigned
   unsigned int seqnum;
@@ -115,9 +156,21 @@ extern struct event_base *evbase_player;
 static struct encode_ctx *
 encoder_setup(enum media_format format, struct media_quality *quality)
 {
-  struct transcode_encode_setup_args encode_args = { .profile = XCODE_MP3, .quality = quality };
+  struct transcode_encode_setup_args encode_args = { .quality = quality };
   struct encode_ctx *encode_ctx = NULL;
 
+  if (format == MEDIA_FORMAT_MP3)
+    encode_args.profile = XCODE_MP3;
+  else if (format == MEDIA_FORMAT_OPUS)
+    encode_args.profile = XCODE_OGG_OPUS;
+  else if (format == MEDIA_FORMAT_FLAC)
+    encode_args.profile = XCODE_FLAC;
+  else
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Unsupported streaming format '%s'\n", media_format_to_string(format));
+      return NULL;
+    }
+
   if (quality->bits_per_sample == 16)
     encode_args.src_ctx = transcode_decode_setup_raw(XCODE_PCM16, quality);
   else if (quality->bits_per_sample == 24)
@@ -132,9 +185,7 @@ encoder_setup(enum media_format format, struct media_quality *quality)
       goto out;
     }
 
-  if (format == MEDIA_FORMAT_MP3)
-    encode_ctx = transcode_encode_setup(encode_args);
-
+  encode_ctx = transcode_encode_setup(encode_args);
   if (!encode_ctx)
     {
       DPRINTF(E_LOG, L_STREAMING, "Error setting up encoder for quality sr %d, bps %d, ch %d, cannot encode\n",
@@ -147,75 +198,94 @@ encoder_setup(enum media_format format, struct media_quality *quality)
   return encode_ctx;
 }
 
-static int
-pipe_open(struct pipepair *p)
+static void
+ring_write(struct streaming_wanted *w, uint8_t *buf, size_t len)
 {
-  int fd[2];
-  int ret;
+  size_t idx;
+  size_t n;
 
-#ifdef HAVE_PIPE2
-  ret = pipe2(fd, O_CLOEXEC | O_NONBLOCK);
-#else
-  if ( pipe(fd) < 0 ||
-       fcntl(fd[0], F_SETFL, O_CLOEXEC | O_NONBLOCK) < 0 ||
-       fcntl(fd[1], F_SETFL, O_CLOEXEC | O_NONBLOCK) < 0 )
-    ret = -1;
-  else
-    ret = 0;
-#endif
-  if (ret < 0)
+  w->ring_pos_frame = w->ring_pos;
+
+  // Can't happen with sane sizes, but if it did only the end would be kept
+  if (len > w->ring_size)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Could not create pipe: %s\n", strerror(errno));
-      return -1;
+      w->ring_pos += len - w->ring_size;
+      buf += len - w->ring_size;
+      len = w->ring_size;
     }
 
-  p->writefd = fd[1];
-  p->readfd = fd[0];
-  return 0;
+  idx = w->ring_pos % w->ring_size;
+  n = MIN(len, w->ring_size - idx);
+
+  memcpy(w->ring + idx, buf, n);
+  memcpy(w->ring, buf + n, len - n);
+
+  w->ring_pos += len;
+}
+
+static size_t
+ring_read(struct evbuffer *evbuf, struct streaming_wanted *w, struct streaming_reader *r)
+{
+  size_t len;
+  size_t idx;
+  size_t n;
+
+  if (w->ring_pos - r->pos > w->ring_size)
+    {
+      DPRINTF(E_WARN, L_STREAMING, "Streaming session %d fell %" PRIu64 " bytes behind, skipping ahead\n", r->id, w->ring_pos - r->pos);
+      r->pos = w->ring_pos_frame;
+    }
+
+  if (!r->header_sent)
+    {
+      evbuffer_add(evbuf, w->header, w->header_len);
+      r->header_sent = true;
+    }
+
+  len = w->ring_pos - r->pos;
+  idx = r->pos % w->ring_size;
+  n = MIN(len, w->ring_size - idx);
+
+  evbuffer_add(evbuf, w->ring + idx, n);
+  evbuffer_add(evbuf, w->ring, len - n);
+
+  r->pos += len;
+
+  return len;
 }
 
 static void
-pipe_close(struct pipepair *p)
+readers_notify(struct streaming_wanted *w)
 {
-  if (p->readfd >= 0)
-    close(p->readfd);
-  if (p->writefd >= 0)
-    close(p->writefd);
+  struct streaming_reader *r;
 
-  p->writefd = -1;
-  p->readfd = -1;
+  for (r = w->readers; r; r = r->next)
+    event_active(r->ev, 0, 0);
 }
 
 static void
 wanted_free(struct streaming_wanted *w)
 {
+  struct streaming_reader *r;
+
   if (!w)
     return;
 
-  for (int i = 0; i < WANTED_PIPES_MAX; i++)
-    pipe_close(&w->audio[i]);
-  for (int i = 0; i < WANTED_PIPES_MAX; i++)
-    pipe_close(&w->metadata[i]);
+  while ((r = w->readers))
+    {
+      w->readers = r->next;
+      free(r);
+    }
 
   transcode_encode_cleanup(&w->xcode_ctx);
   evbuffer_free(w->audio_in);
   evbuffer_free(w->audio_out);
   free(w->frame_data);
+  free(w->header);
+  free(w->ring);
   free(w);
 }
 
-static int
-pipe_index_find_byreadfd(struct pipepair *p, int readfd)
-{
-  for (int i = 0; i < WANTED_PIPES_MAX; i++, p++)
-    {
-      if (p->readfd == readfd)
-	return i;
-    }
-
-  return -1;
-}
-
 static struct streaming_wanted *
 wanted_new(enum media_format format, struct media_quality quality)
 {
@@ -236,14 +306,20 @@ wanted_new(enum media_format format, struct media_quality quality)
 
   CHECK_NULL(L_STREAMING, w->frame_data = malloc(w->frame_size));
 
-  for (int i = 0; i < WANTED_PIPES_MAX; i++)
+  if (transcode_encode_header_get(w->audio_out, w->xcode_ctx) < 0)
+    goto error;
+
+  w->header_len = evbuffer_get_length(w->audio_out);
+  if (w->header_len > 0)
     {
-      w->audio[i].writefd = -1;
-      w->audio[i].readfd = -1;
-      w->metadata[i].writefd = -1;
-      w->metadata[i].readfd = -1;
+      CHECK_NULL(L_STREAMING, w->header = malloc(w->header_len));
+      evbuffer_remove(w->audio_out, w->header, w->header_len);
     }
 
+  // Without a bit rate (flac) we use the size of the PCM, which flac won't exceed
+  w->ring_size = STREAMING_RING_SECONDS * (quality.bit_rate > 0 ? quality.bit_rate / 8 : STOB(quality.sample_rate, quality.bits_per_sample, quality.channels));
+  CHECK_NULL(L_STREAMING, w->ring = malloc(w->ring_size));
+
   return w;
 
  error:
@@ -282,6 +358,9 @@ wanted_add(struct streaming_wanted **wanted, enum media_format format, struct me
   struct streaming_wanted *w;
 
   w = wanted_new(format, quality);
+  if (!w)
+    return NULL;
+
   w->next = *wanted;
   *wanted = w;
 
@@ -302,74 +381,81 @@ wanted_find_byformat(struct streaming_wanted *wanted, enum media_format format,
   return NULL;
 }
 
-static struct streaming_wanted *
-wanted_find_byreadfd(struct streaming_wanted *wanted, int readfd)
+static struct streaming_reader *
+reader_find(struct streaming_wanted **out, struct streaming_wanted *wanted, int id)
 {
   struct streaming_wanted *w;
-  int i;
+  struct streaming_reader *r;
 
   for (w = wanted; w; w = w->next)
     {
-      i = pipe_index_find_byreadfd(w->audio, readfd);
-      if (i != -1)
-	return w;
+      for (r = w->readers; r; r = r->next)
+	{
+	  if (r->id == id)
+	    {
+	      *out = w;
+	      return r;
+	    }
+	}
     }
 
   return NULL;
 }
 
 static int
-wanted_session_add(int *audiofd, int *metadatafd, struct streaming_wanted *w)
+wanted_session_add(int *id, struct event *ev, struct streaming_wanted *w)
 {
-  int ret;
-  int i;
+  struct streaming_reader *r;
 
-  for (i = 0; i < WANTED_PIPES_MAX; i++)
-    {
-      if (w->audio[i].writefd != -1) // In use
-	continue;
+  CHECK_NULL(L_STREAMING, r = calloc(1, sizeof(struct streaming_reader)));
 
-      ret = pipe_open(&w->audio[i]);
-      if (ret < 0)
-	return -1;
+  // Negative ids are errors, and the counter may wrap around
+  if (streaming.reader_id_next < 0)
+    streaming.reader_id_next = 0;
 
-      ret = pipe_open(&w->metadata[i]);
-      if (ret < 0)
-	return -1;
+  r->id = streaming.reader_id_next++;
+  r->ev = ev;
+  r->pos = w->ring_pos_frame; // Start at a frame boundary
 
-      *audiofd = w->audio[i].readfd;
-      *metadatafd = w->metadata[i].readfd;
-      break;
-    }
+  r->next = w->readers;
+  w->readers = r;
 
-  if (i == WANTED_PIPES_MAX)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Cannot add streaming session, max pipe limit reached\n");
-      return -1;
-    }
+  *id = r->id;
 
   w->num_sessions++;
-  DPRINTF(E_DBG, L_STREAMING, "Session register audiofd %d, metadatafd %d, wanted->num_sessions=%d\n", *audiofd, *metadatafd, w->num_sessions);
+  DPRINTF(E_DBG, L_STREAMING, "Session register id %d, wanted->num_sessions=%d\n", *id, w->num_sessions);
   return 0;
 }
 
 static void
-wanted_session_remove(struct streaming_wanted *w, int readfd)
+wanted_session_remove(struct streaming_wanted *w, int id)
 {
-  int i;
+  struct streaming_reader *prev = NULL;
+  struct streaming_reader *r;
+
+  for (r = w->readers; r; r = r->next)
+    {
+      if (r->id == id)
+	break;
+
+      prev = r;
+    }
 
-  i = pipe_index_find_byreadfd(w->audio, readfd);
-  if (i < 0)
+  if (!r)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Cannot remove streaming session, readfd %d not found\n", readfd);
+      DPRINTF(E_LOG, L_STREAMING, "Cannot remove streaming session, id %d not found\n", id);
       return;
     }
 
-  pipe_close(&w->audio[i]);
-  pipe_close(&w->metadata[i]);
+  if (!prev)
+    w->readers = r->next;
+  else
+    prev->next = r->next;
+
+  free(r);
 
   w->num_sessions--;
-  DPRINTF(E_DBG, L_STREAMING, "Session deregister readfd %d, wanted->num_sessions=%d\n", readfd, w->num_sessions);
+  DPRINTF(E_DBG, L_STREAMING, "Session deregister id %d, wanted->num_sessions=%d\n", id, w->num_sessions);
 }
 
 
@@ -433,7 +519,7 @@ encode_buffer(struct streaming_wanted *w, uint8_t *buf, size_t bufsize)
 }
 
 static void
-encode_and_write(int *failed_pipe_readfd, struct streaming_wanted *w, struct output_buffer *obuf)
+encode_and_write(struct streaming_wanted *w, struct output_buffer *obuf)
 {
   uint8_t *buf;
   size_t bufsize;
@@ -441,6 +527,9 @@ encode_and_write(int *failed_pipe_readfd, struct streaming_wanted *w, struct out
   int ret;
   int i;
 
+  if (w->failed)
+    return;
+
   for (i = 0, buf = NULL, bufsize = 0; obuf && obuf->data[i].buffer; i++)
     {
       if (!quality_is_equal(&obuf->data[i].quality, &w->quality))
@@ -450,17 +539,13 @@ encode_and_write(int *failed_pipe_readfd, struct streaming_wanted *w, struct out
       bufsize = obuf->data[i].bufsize;
     }
 
-  // If encoding fails we should kill the sessions, which for thread safety
-  // and to avoid deadlocks has to be done later with player_streaming_deregister()
+  // If encoding fails the sessions will find out when they try to read, and
+  // then they will end themselves
   ret = encode_buffer(w, buf, bufsize);
   if (ret < 0)
     {
-      for (i = 0; i < WANTED_PIPES_MAX; i++)
-	{
-	  if (w->audio[i].writefd != -1)
-	    *failed_pipe_readfd = w->audio[i].readfd;
-	}
-
+      w->failed = true;
+      readers_notify(w);
       return;
     }
 
@@ -470,21 +555,10 @@ encode_and_write(int *failed_pipe_readfd, struct streaming_wanted *w, struct out
       return;
     }
 
-  buf = evbuffer_pullup(w->audio_out, -1);
-  for (i = 0; i < WANTED_PIPES_MAX; i++)
-    {
-      if (w->audio[i].writefd == -1)
-	continue;
-
-      ret = write(w->audio[i].writefd, buf, len);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_STREAMING, "Error writing to stream pipe %d (format %d): %s\n", w->audio[i].writefd, w->format, strerror(errno));
-	  *failed_pipe_readfd = w->audio[i].readfd;
-	}
-    }
-
+  ring_write(w, evbuffer_pullup(w->audio_out, -1), len);
   evbuffer_drain(w->audio_out, -1);
+
+  readers_notify(w);
 }
 
 static void
@@ -493,7 +567,6 @@ encode_data_cb(void *arg)
   struct encode_cmdarg *ctx = arg;
   struct output_buffer *obuf = ctx->obuf;
   struct streaming_wanted *w;
-  int failed_pipe_readfd = -1;
 
   pthread_mutex_lock(&streaming_wanted_lck);
 
@@ -502,58 +575,19 @@ encode_data_cb(void *arg)
     pthread_cond_wait(&streaming_sequence_cond, &streaming_wanted_lck);
 
   for (w = streaming.wanted; w; w = w->next)
-    encode_and_write(&failed_pipe_readfd, w, obuf);
+    encode_and_write(w, obuf);
 
   streaming.seqnum_encode_next++;
   pthread_cond_broadcast(&streaming_sequence_cond);
   pthread_mutex_unlock(&streaming_wanted_lck);
 
-  outputs_buffer_free(ctx->obuf);
-
-  // We have to do this after letting go of the lock or we will deadlock. This
-  // unfortunate method means we can only fail one session (pipe) each pass.
-  if (failed_pipe_readfd >= 0)
-    player_streaming_deregister(failed_pipe_readfd);
-}
-
-static void
-metadata_write(struct streaming_wanted *w, int readfd, const char *metadata)
-{
-  size_t metadata_size;
-  int i;
-  int ret;
-
-  for (i = 0; i < WANTED_PIPES_MAX; i++)
-    {
-      if (w->metadata[i].writefd == -1)
-	continue;
-      if (readfd >= 0 && w->metadata[i].readfd != readfd)
-	continue;
-
-      metadata_size = strlen(metadata) + 1;
-      ret = write(w->metadata[i].writefd, metadata, metadata_size);
-      if (ret < 0)
-	DPRINTF(E_WARN, L_STREAMING, "Error writing metadata '%s' to fd %d\n", metadata, w->metadata[i].writefd);
-    }
-}
-
-static void
-metadata_startup_cb(void *arg)
-{
-  int *metadata_fd = arg;
-  struct streaming_wanted *w;
-
-  pthread_mutex_lock(&streaming_wanted_lck);
-  for (w = streaming.wanted; w; w = w->next)
-    metadata_write(w, *metadata_fd, streaming.title);
-  pthread_mutex_unlock(&streaming_wanted_lck);
+  outputs_buffer_unref(ctx->obuf);
 }
 
 static void *
 streaming_metadata_prepare(struct output_metadata *metadata)
 {
   struct db_queue_item *queue_item;
-  struct streaming_wanted *w;
 
   queue_item = db_queue_fetch_byitemid(metadata->item_id);
   if (!queue_item)
@@ -562,12 +596,10 @@ streaming_metadata_prepare(struct output_metadata *metadata)
       return NULL;
     }
 
+  // The sessions pick it up next time they read
   pthread_mutex_lock(&streaming_wanted_lck);
-  // Save it here, we might need it later if a new session starts up
   snprintf(streaming.title, sizeof(streaming.title), "%s - %s", queue_item->title, queue_item->artist);
-
-  for (w = streaming.wanted; w; w = w->next)
-    metadata_write(w, -1, streaming.title);
+  streaming.title_seqnum++;
   pthread_mutex_unlock(&streaming_wanted_lck);
 
   free_queue_item(queue_item, 0);
@@ -575,6 +607,39 @@ streaming_metadata_prepare(struct output_metadata *metadata)
 }
 
 
+/* ----------------------------- Thread: httpd ------------------------------ */
+
+int
+streaming_session_read(struct evbuffer *evbuf, char *title, size_t title_size, bool *title_changed, int id)
+{
+  struct streaming_wanted *w;
+  struct streaming_reader *r;
+  int len;
+
+  pthread_mutex_lock(&streaming_wanted_lck);
+
+  r = reader_find(&w, streaming.wanted, id);
+  if (!r || w->failed)
+    {
+      pthread_mutex_unlock(&streaming_wanted_lck);
+      return -1;
+    }
+
+  len = ring_read(evbuf, w, r);
+
+  *title_changed = (r->title_seqnum != streaming.title_seqnum);
+  if (*title_changed)
+    {
+      snprintf(title, title_size, "%s", streaming.title);
+      r->title_seqnum = streaming.title_seqnum;
+    }
+
+  pthread_mutex_unlock(&streaming_wanted_lck);
+
+  return len;
+}
+
+
 /* ----------------------------- Thread: Player ----------------------------- */
 
 static void
@@ -587,10 +652,10 @@ streaming_write(struct output_buffer *obuf)
     return;
 
   // We don't want to block the player, so we can't lock to access
-  // streaming.wanted and find which qualities we need. So we just copy it all
-  // and pass it to a worker thread that can lock and check what is wanted, and
-  // also can encode without holding the player.
-  ctx.obuf = outputs_buffer_copy(obuf);
+  // streaming.wanted and find which qualities we need. So we just take a
+  // reference to it all and pass it to a worker thread that can lock and check
+  // what is wanted, and also can encode without holding the player.
+  ctx.obuf = outputs_buffer_ref(obuf);
   ctx.seqnum = streaming.seqnum;
 
   streaming.seqnum++;
@@ -620,26 +685,27 @@ static int
 streaming_start(struct output_device *device, int callback_id)
 {
   struct streaming_wanted *w;
+  int id;
   int ret;
 
   pthread_mutex_lock(&streaming_wanted_lck);
   w = wanted_find_byformat(streaming.wanted, device->selected_format, device->quality);
   if (!w)
     w = wanted_add(&streaming.wanted, device->selected_format, device->quality);
-  ret = wanted_session_add(&device->audio_fd, &device->metadata_fd, w);
+  if (!w)
+    goto error;
+  ret = wanted_session_add(&id, device->audio_ev, w);
   if (ret < 0)
     goto error;
   pthread_mutex_unlock(&streaming_wanted_lck);
 
-  worker_execute(metadata_startup_cb, &(device->metadata_fd), sizeof(device->metadata_fd), 0);
-
-  outputs_quality_subscribe(&device->quality);
+  outputs_quality_subscribe(&device->quality, OUTPUT_TYPE_STREAMING);
 
-  device->id = device->audio_fd;
+  device->id = id;
   return 0;
 
  error:
-  if (w->num_sessions == 0)
+  if (w && w->num_sessions == 0)
     wanted_remove(&streaming.wanted, w);
   pthread_mutex_unlock(&streaming_wanted_lck);
   return -1;
@@ -654,8 +720,7 @@ streaming_stop(struct output_device *device, int callback_id)
   struct streaming_wanted *w;
 
   pthread_mutex_lock(&streaming_wanted_lck);
-  w = wanted_find_byreadfd(streaming.wanted, device->id);
-  if (!w)
+  if (!reader_find(&w, streaming.wanted, device->id))
     goto error;
   device->quality = w->quality;
   wanted_session_remove(w, device->id);
@@ -694,6 +759,7 @@ struct output_definition output_streaming =
   .type = OUTPUT_TYPE_STREAMING,
   .priority = 0,
   .disabled = 0,
+  .buffered = 1,
   .init = streaming_init,
   .deinit = streaming_deinit,
   .write = streaming_write,
@@ -0,0 +1,22 @@
+#ifndef __STREAMING_H__
+#define __STREAMING_H__
+
+#include <event2/buffer.h>
+
+#include <stdbool.h>
+
+/* Reads the audio that has been encoded for a session since its last read. The
+ * session must have been registered with player_streaming_register(), and the
+ * read should be done when the given event is activated. Thread safe.
+ *
+ * @in  evbuf         Buffer to add the encoded audio to
+ * @out title         If the title changed since last read, set to the new one
+ * @in  title_size    Size of the title buffer
+ * @out title_changed Set to true if title was changed
+ * @in  id            The id of the session
+ * @return            Number of bytes read, -1 if the session should stop
+ */
+int
+streaming_session_read(struct evbuffer *evbuf, char *title, size_t title_size, bool *title_changed, int id);
+
+#endif /* !__STREAMING_H__ */
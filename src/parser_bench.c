@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for the query parsers in parsers/. Each query of a corpus is
+ * parsed to SQL a number of times, and the time and allocations per query are
+ * reported. The built-in corpora are queries as sent by Remote/iTunes, Roku
+ * Soundbridges, MPD clients and from smart playlists. The callers cache the
+ * results in an LRU cache, so what is measured here is the cost of a cache
+ * miss. Build with "make parser_bench", then e.g.:
+ *
+ *   ./parser_bench -r 10000
+ *   ./parser_bench -f queries.txt
+ *
+ * A corpus file has one query per line, prefixed by the parser and a space,
+ * e.g. "mpd find ((artist == \"Sting\"))". Lines starting with # are skipped.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "parsers/daap_parser.h"
+#include "parsers/rsp_parser.h"
+#include "parsers/mpd_parser.h"
+#include "parsers/smartpl_parser.h"
+
+#define PARSER_BENCH_QUERIES_MAX 1024
+
+// Normally defined in main.c, referenced by some of the modules
+struct event_base *evbase_main;
+
+enum bench_parser
+{
+  PARSER_DAAP,
+  PARSER_RSP,
+  PARSER_MPD,
+  PARSER_SMARTPL,
+};
+
+static const char *bench_parser_names[] = { "daap", "rsp", "mpd", "smartpl" };
+
+struct bench_query
+{
+  enum bench_parser parser;
+  const char *query;
+};
+
+// The daap queries are how they look after url decoding, the mpd queries how
+// mpd.c reassembles the arguments before parsing
+static struct bench_query bench_corpus[] =
+{
+  // Remote and iTunes browsing and searching
+  { PARSER_DAAP, "'com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32'" },
+  { PARSER_DAAP, "('com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32')+'daap.songalbumartist!:'" },
+  { PARSER_DAAP, "('daap.songalbumartist:Bob Dylan'+'daap.songartist!:')+('com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32')" },
+  { PARSER_DAAP, "('com.apple.itunes.mediakind:4','com.apple.itunes.mediakind:36','com.apple.itunes.mediakind:6','com.apple.itunes.mediakind:7')" },
+  { PARSER_DAAP, "'daap.songalbumid:6525753023700533274'" },
+  { PARSER_DAAP, "'dmap.itemid:156'" },
+  { PARSER_DAAP, "'daap.songgenre:Rock'+'daap.songalbumartist:AC/DC'+'com.apple.itunes.extended-media-kind:1'" },
+  { PARSER_DAAP, "(('com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32')+('dmap.itemname:*love*','daap.songartist:*love*','daap.songalbum:*love*'))" },
+  { PARSER_DAAP, "('daap.songartist:*beat*','daap.songalbumartist:*beat*')+'com.apple.itunes.extended-media-kind:1'+'daap.songalbum!:'" },
+  { PARSER_DAAP, "'daap.songcompilation:1'+'com.apple.itunes.mediakind:1'" },
+
+  // Roku Soundbridge
+  { PARSER_RSP, "artist=\"Sting\"" },
+  { PARSER_RSP, "album_artist=\"Sting\" and album=\"...All This Time\"" },
+  { PARSER_RSP, "id=36364" },
+  { PARSER_RSP, "genre=\"Jazz\" and not artist=\"Kenny G\"" },
+  { PARSER_RSP, "title includes \"love\" or artist includes \"love\" or album includes \"love\"" },
+
+  // MPD clients (mpc, ncmpcpp, Cantata, MPDroid, M.A.L.P.)
+  { PARSER_MPD, "find ((artist == \"Sting\"))" },
+  { PARSER_MPD, "find ((albumartist == \"Sting\") AND (album == \"...Nothing Like the Sun\")) sort track" },
+  { PARSER_MPD, "search ((any contains \"love\")) window 0:100" },
+  { PARSER_MPD, "list album ((albumartist == \"The Beatles\")) group date" },
+  { PARSER_MPD, "list albumartist group genre" },
+  { PARSER_MPD, "count ((genre == \"Rock\")) group artist" },
+  { PARSER_MPD, "findadd ((album == \"Abbey Road\") AND (albumartist == \"The Beatles\")) position +0" },
+  { PARSER_MPD, "find ((base 'Music/Jazz') AND (!(genre == 'Fusion'))) sort -date window 10:20" },
+  { PARSER_MPD, "find ((date >= 1990) AND (date < 2000) AND (audioformat == '44100:16:2'))" },
+  { PARSER_MPD, "search ((artist starts_with 'the ') OR (title ends_with ' remix')) sort -title" },
+
+  // Smart playlists, mostly from the documentation
+  { PARSER_SMARTPL, "\"techno\" { genre includes \"techno\" and artist includes \"zombie\" }" },
+  { PARSER_SMARTPL, "\"techno 2015\" { genre includes \"techno\" and artist includes \"zombie\" and not genre includes \"industrial\" }" },
+  { PARSER_SMARTPL, "\"Local music\" { data_kind is file and media_kind is music }" },
+  { PARSER_SMARTPL, "\"Unplayed podcasts and audiobooks\" { play_count = 0 and (media_kind is podcast or media_kind is audiobook) }" },
+  { PARSER_SMARTPL, "\"Recently added music\" { media_kind is music order by time_added desc limit 10 }" },
+  { PARSER_SMARTPL, "\"Random 10 Rated Pop songs\" { rating > 0 and genre is \"Pop\" and media_kind is music order by random desc limit 10 }" },
+  { PARSER_SMARTPL, "\"Files added after January 1, 2004\" { time_added after 2004-01-01 }" },
+  { PARSER_SMARTPL, "\"Recently Added\" { time_added after 2 weeks ago }" },
+  { PARSER_SMARTPL, "\"Recently played audiobooks\" { time_played after last week and media_kind is audiobook }" },
+};
+
+struct bench_result
+{
+  int queries;
+  int failed;
+  uint64_t parses;
+  double sec;
+  uint64_t allocs;
+  double max_us; // Slowest query, average over its runs
+  const char *max_query;
+};
+
+
+/* ---------------------------- Allocation counting ------------------------- */
+
+// Same as in xcode_bench.c, counts the allocations of the whole process
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t bench_allocs;
+
+void *
+malloc(size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  *memptr = __libc_memalign(alignment, size);
+  return *memptr ? 0 : ENOMEM;
+}
+
+static uint64_t
+allocs_get(void)
+{
+  return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+#else
+static uint64_t
+allocs_get(void)
+{
+  return 0;
+}
+#endif
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+seconds_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+parser_find(const char *name, size_t len)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(bench_parser_names); i++)
+    {
+      if (strlen(bench_parser_names[i]) == len && strncmp(bench_parser_names[i], name, len) == 0)
+	return i;
+    }
+
+  return -1;
+}
+
+// Returns the number of queries read into the corpus, which must be freed with
+// corpus_free()
+static int
+corpus_load(struct bench_query *corpus, int max, const char *path)
+{
+  FILE *fp;
+  char line[4096];
+  char *query;
+  int parser;
+  int n;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    {
+      fprintf(stderr, "Could not open corpus '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  n = 0;
+  while (n < max && fgets(line, sizeof(line), fp))
+    {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0' || line[0] == '#')
+	continue;
+
+      query = strchr(line, ' ');
+      parser = query ? parser_find(line, query - line) : -1;
+      if (parser < 0)
+	{
+	  fprintf(stderr, "Skipping line without a known parser: %s\n", line);
+	  continue;
+	}
+
+      corpus[n].parser = parser;
+      corpus[n].query = strdup(query + 1);
+      n++;
+    }
+
+  fclose(fp);
+  return n;
+}
+
+static void
+corpus_free(struct bench_query *corpus, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    free((char *)corpus[i].query);
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+// Returns 0 if the query was parsed to SQL. The results are in fixed buffers
+// of the result structs, so there is nothing to free.
+static int
+query_parse(struct bench_query *bq)
+{
+  struct daap_result daap_result;
+  struct rsp_result rsp_result;
+  struct mpd_result mpd_result;
+  struct smartpl_result smartpl_result;
+  int ret;
+
+  switch (bq->parser)
+    {
+      case PARSER_DAAP:
+	return daap_lex_parse(&daap_result, bq->query);
+
+      case PARSER_RSP:
+	return rsp_lex_parse(&rsp_result, bq->query);
+
+      case PARSER_MPD:
+	return mpd_lex_parse(&mpd_result, bq->query);
+
+      case PARSER_SMARTPL:
+	ret = smartpl_lex_parse(&smartpl_result, bq->query);
+	if (ret == 0 && (smartpl_result.title[0] == '\0' || !smartpl_result.where))
+	  return -1;
+	return ret;
+    }
+
+  return -1;
+}
+
+static void
+bench_run(struct bench_result *result, enum bench_parser parser, struct bench_query *corpus, int ncorpus, int runs)
+{
+  double start;
+  double elapsed;
+  double us;
+  uint64_t allocs_start;
+  int i;
+  int j;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  for (i = 0; i < ncorpus; i++)
+    {
+      if (corpus[i].parser != parser)
+	continue;
+
+      result->queries++;
+
+      // Queries that don't parse are reported and not timed
+      if (query_parse(&corpus[i]) != 0)
+	{
+	  fprintf(stderr, "Could not parse %s query: %s\n", bench_parser_names[parser], corpus[i].query);
+	  result->failed++;
+	  continue;
+	}
+
+      start = seconds_get();
+      allocs_start = allocs_get();
+
+      for (j = 0; j < runs; j++)
+	query_parse(&corpus[i]);
+
+      result->allocs += allocs_get() - allocs_start;
+
+      elapsed = seconds_get() - start;
+      result->sec += elapsed;
+      result->parses += runs;
+
+      us = elapsed * 1e6 / runs;
+      if (us > result->max_us)
+	{
+	  result->max_us = us;
+	  result->max_query = corpus[i].query;
+	}
+    }
+}
+
+static void
+result_print(enum bench_parser parser, struct bench_result *result)
+{
+  printf("%-8s %7d %6d %12.0f %9.2f %9.2f %9.1f  %s\n",
+    bench_parser_names[parser], result->queries, result->failed,
+    (result->sec > 0) ? result->parses / result->sec : 0,
+    result->parses ? result->sec * 1e6 / result->parses : 0,
+    result->max_us,
+    result->parses ? (double)result->allocs / result->parses : 0,
+    result->max_query ? result->max_query : "");
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -f <file>       Use the queries in <file> instead of the built-in corpus\n");
+  printf("  -p <name,name>  Parsers to run (default all: daap,rsp,mpd,smartpl)\n");
+  printf("  -r <number>     Runs per query (default 1000)\n");
+  printf("  -d <number>     Log level (0-5)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_query *corpus = bench_corpus;
+  struct bench_query *loaded = NULL;
+  struct bench_result result;
+  char *corpusfile = NULL;
+  char *parserlist = NULL;
+  int ncorpus = ARRAY_SIZE(bench_corpus);
+  int runs = 1000;
+  int loglevel = E_LOG;
+  int option;
+  int errors = 0;
+  int i;
+
+  while ((option = getopt(argc, argv, "f:p:r:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'f':
+	    corpusfile = optarg;
+	    break;
+
+	  case 'p':
+	    parserlist = optarg;
+	    break;
+
+	  case 'r':
+	    runs = atoi(optarg);
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (runs < 1)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (corpusfile)
+    {
+      CHECK_NULL(L_MAIN, loaded = calloc(PARSER_BENCH_QUERIES_MAX, sizeof(struct bench_query)));
+
+      ncorpus = corpus_load(loaded, PARSER_BENCH_QUERIES_MAX, corpusfile);
+      if (ncorpus <= 0)
+	{
+	  free(loaded);
+	  logger_deinit();
+	  return EXIT_FAILURE;
+	}
+
+      corpus = loaded;
+    }
+
+#ifndef __GLIBC__
+  fprintf(stderr, "Note: Counting allocations requires glibc, allocs/query will be 0\n");
+#endif
+
+  printf("%-8s %7s %6s %12s %9s %9s %9s  %s\n",
+    "parser", "queries", "failed", "queries/s", "avg_us", "max_us", "allocs/q", "slowest");
+
+  for (i = 0; i < ARRAY_SIZE(bench_parser_names); i++)
+    {
+      if (parserlist && !strstr(parserlist, bench_parser_names[i]))
+	continue;
+
+      bench_run(&result, i, corpus, ncorpus, runs);
+      if (result.queries == 0)
+	continue;
+
+      result_print(i, &result);
+
+      errors += result.failed;
+    }
+
+  if (loaded)
+    {
+      corpus_free(loaded, ncorpus);
+      free(loaded);
+    }
+
+  logger_deinit();
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
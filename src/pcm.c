@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Conversion between the PCM sample formats used by the outputs. This is much
+ * cheaper than running the samples through a transcode context, which is what
+ * we would otherwise do when an output wants another bit depth than the source
+ * has. The 16 <-> 32 bit conversions are the common case (e.g. ALSA devices
+ * that only take S32), so they have SIMD versions, selected at runtime for
+ * AVX2. SSE2 and NEON are used when the compiler targets them.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define PCM_X86 1
+#endif
+#ifdef __ARM_NEON
+# include <arm_neon.h>
+#endif
+
+#include "logger.h"
+#include "pcm.h"
+
+// The kernels do their arithmetic on native integers, so we only support hosts
+// where that matches the little endian byte order of the samples
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+# define PCM_LITTLE_ENDIAN 1
+#endif
+
+typedef void (*pcm_s16_to_s32_fn)(int32_t *dst, const int16_t *src, size_t n);
+typedef void (*pcm_s32_to_s16_fn)(int16_t *dst, const int32_t *src, size_t n);
+
+
+/* ---------------------------------- Scalar -------------------------------- */
+
+static void
+s16_to_s32_c(int32_t *dst, const int16_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (int32_t)((uint32_t)(uint16_t)src[i] << 16);
+}
+
+static void
+s32_to_s16_c(int16_t *dst, const int32_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = src[i] >> 16;
+}
+
+// The 24 bit format is packed, which doesn't vectorize well, so those are just
+// byte shuffling
+static void
+s16_to_s24_c(uint8_t *dst, const uint8_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, dst += 3, src += 2)
+    {
+      dst[0] = 0;
+      dst[1] = src[0];
+      dst[2] = src[1];
+    }
+}
+
+static void
+s24_to_s16_c(uint8_t *dst, const uint8_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, dst += 2, src += 3)
+    {
+      dst[0] = src[1];
+      dst[1] = src[2];
+    }
+}
+
+static void
+s24_to_s32_c(uint8_t *dst, const uint8_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, dst += 4, src += 3)
+    {
+      dst[0] = 0;
+      dst[1] = src[0];
+      dst[2] = src[1];
+      dst[3] = src[2];
+    }
+}
+
+static void
+s32_to_s24_c(uint8_t *dst, const uint8_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, dst += 3, src += 4)
+    {
+      dst[0] = src[1];
+      dst[1] = src[2];
+      dst[2] = src[3];
+    }
+}
+
+
+/* ----------------------------------- SSE2 --------------------------------- */
+
+#ifdef __SSE2__
+static void
+s16_to_s32_sse2(int32_t *dst, const int16_t *src, size_t n)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i v;
+  size_t i;
+
+  // Interleaving with zeros as the low half is the same as shifting left 16
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(zero, v));
+      _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(zero, v));
+    }
+
+  s16_to_s32_c(dst + i, src + i, n - i);
+}
+
+static void
+s32_to_s16_sse2(int16_t *dst, const int32_t *src, size_t n)
+{
+  __m128i a;
+  __m128i b;
+  size_t i;
+
+  // After the shift the values fit, so the saturation of packs is a no-op
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i)), 16);
+      b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i + 4)), 16);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+
+  s32_to_s16_c(dst + i, src + i, n - i);
+}
+#endif
+
+
+/* ----------------------------------- AVX2 --------------------------------- */
+
+#ifdef PCM_X86
+__attribute__((target("avx2"))) static void
+s16_to_s32_avx2(int32_t *dst, const int16_t *src, size_t n)
+{
+  __m256i a;
+  __m256i b;
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+      b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i + 8)));
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi32(a, 16));
+      _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_slli_epi32(b, 16));
+    }
+
+  s16_to_s32_c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+s32_to_s16_avx2(int16_t *dst, const int32_t *src, size_t n)
+{
+  __m256i a;
+  __m256i b;
+  size_t i;
+
+  // packs works within each 128 bit lane, so the result must be permuted
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i)), 16);
+      b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), 16);
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8));
+    }
+
+  s32_to_s16_c(dst + i, src + i, n - i);
+}
+#endif
+
+
+/* ----------------------------------- NEON --------------------------------- */
+
+#ifdef __ARM_NEON
+static void
+s16_to_s32_neon(int32_t *dst, const int16_t *src, size_t n)
+{
+  int16x8_t v;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = vld1q_s16(src + i);
+      vst1q_s32(dst + i, vshll_n_s16(vget_low_s16(v), 16));
+      vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+    }
+
+  s16_to_s32_c(dst + i, src + i, n - i);
+}
+
+static void
+s32_to_s16_neon(int16_t *dst, const int32_t *src, size_t n)
+{
+  int16x4_t a;
+  int16x4_t b;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = vshrn_n_s32(vld1q_s32(src + i), 16);
+      b = vshrn_n_s32(vld1q_s32(src + i + 4), 16);
+      vst1q_s16(dst + i, vcombine_s16(a, b));
+    }
+
+  s32_to_s16_c(dst + i, src + i, n - i);
+}
+#endif
+
+
+/* --------------------------------- Dispatch ------------------------------- */
+
+static pcm_s16_to_s32_fn pcm_s16_to_s32 = s16_to_s32_c;
+static pcm_s32_to_s16_fn pcm_s32_to_s16 = s32_to_s16_c;
+
+void
+pcm_init(void)
+{
+  const char *kernel = "C";
+
+#if defined(__SSE2__)
+  pcm_s16_to_s32 = s16_to_s32_sse2;
+  pcm_s32_to_s16 = s32_to_s16_sse2;
+  kernel = "SSE2";
+#elif defined(__ARM_NEON)
+  pcm_s16_to_s32 = s16_to_s32_neon;
+  pcm_s32_to_s16 = s32_to_s16_neon;
+  kernel = "NEON";
+#endif
+
+#ifdef PCM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    {
+      pcm_s16_to_s32 = s16_to_s32_avx2;
+      pcm_s32_to_s16 = s32_to_s16_avx2;
+      kernel = "AVX2";
+    }
+#endif
+
+  DPRINTF(E_DBG, L_PLAYER, "Using %s for PCM conversion\n", kernel);
+}
+
+bool
+pcm_convert_supported(int dst_bits, int src_bits)
+{
+#ifdef PCM_LITTLE_ENDIAN
+  return (dst_bits != src_bits) &&
+         (dst_bits == 16 || dst_bits == 24 || dst_bits == 32) &&
+         (src_bits == 16 || src_bits == 24 || src_bits == 32);
+#else
+  return false;
+#endif
+}
+
+int
+pcm_convert(void *dst, int dst_bits, const void *src, int src_bits, size_t n)
+{
+  if (!pcm_convert_supported(dst_bits, src_bits))
+    return -1;
+
+  if (src_bits == 16 && dst_bits == 32)
+    pcm_s16_to_s32(dst, src, n);
+  else if (src_bits == 32 && dst_bits == 16)
+    pcm_s32_to_s16(dst, src, n);
+  else if (src_bits == 16 && dst_bits == 24)
+    s16_to_s24_c(dst, src, n);
+  else if (src_bits == 24 && dst_bits == 16)
+    s24_to_s16_c(dst, src, n);
+  else if (src_bits == 24 && dst_bits == 32)
+    s24_to_s32_c(dst, src, n);
+  else
+    s32_to_s24_c(dst, src, n);
+
+  return 0;
+}
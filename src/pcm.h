@@ -0,0 +1,27 @@
+#ifndef __PCM_H__
+#define __PCM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Selects the fastest conversion kernels the CPU supports. Call once before
+ * using pcm_convert().
+ */
+void
+pcm_init(void);
+
+/* Returns true if pcm_convert() can convert between the two sample formats,
+ * which must be signed little endian with 16, 24 (packed) or 32 bits.
+ */
+bool
+pcm_convert_supported(int dst_bits, int src_bits);
+
+/* Converts n samples (i.e. frames x channels) from src to dst. Converting to
+ * fewer bits drops the least significant bits, so there is no dithering.
+ *
+ * @return 0 on success, -1 if the conversion is not supported
+ */
+int
+pcm_convert(void *dst, int dst_bits, const void *src, int src_bits, size_t n);
+
+#endif /* !__PCM_H__ */
@@ -92,6 +92,7 @@
 # include "lastfm.h"
 #endif
 #include "listenbrainz.h"
+#include "trace.h"
 
 // The interval between each tick of the playback clock in ms. This means that
 // we read 10 ms frames from the input and pass to the output, so the clock
@@ -101,6 +102,12 @@
 // only 100 x 220 = 22000 samples each second.
 #define PLAYER_TICK_INTERVAL 10
 
+// If all the running outputs are buffered (e.g. fifo and streaming), we don't
+// need to wake up every tick. Instead the timer will expire every
+// PLAYER_TICK_BATCH_MS, and then we process the ticks that have elapsed in one
+// go. This saves a lot of wakeups, which matters on low power devices.
+#define PLAYER_TICK_BATCH_MS 100
+
 // For every tick_interval, we will read a frame from the input buffer and
 // write it to the outputs. If the input is empty, we will try to catch up next
 // tick. However, at some point we will owe the outputs so much data that we
@@ -115,6 +122,15 @@
 // (value is in milliseconds)
 #define PLAYER_WRITE_BEHIND_MAX 1500
 
+// Background work like scanning backs off (see player_pressure_throttle) for
+// this long after a tick was late or the input buffer ran low
+#define PLAYER_PRESSURE_HOLD_MS 5000
+#define PLAYER_PRESSURE_LATE_MS 50
+#define PLAYER_PRESSURE_FILL_MS 500
+// The back off starts with this delay and doubles while the pressure lasts
+#define PLAYER_THROTTLE_MIN_MS 20
+#define PLAYER_THROTTLE_MAX_MS 1000
+
 // If a speaker fails during playback we try to bring it back by reconnecting
 // after this number of seconds. When this feature was added, we had an issue
 // with Homepods and ATV4's dropping connections, so it is also a workaround.
@@ -155,8 +171,7 @@ struct speaker_attr_param
   struct media_quality quality;
   enum media_format format;
 
-  int audio_fd;
-  int metadata_fd;
+  struct event *audio_ev;
 
   const char *pin;
 };
@@ -308,6 +323,11 @@ static int player_flush_pending;
 
 // Config values and player settings category
 static int speaker_autoselect;
+static int speaker_ready_min;
+
+// Number of speakers that must still report ready before playback is started,
+// 0 means we wait for all of them
+static int pb_start_ready_wait;
 static int clear_queue_on_stop_disabled;
 
 // Player status
@@ -328,10 +348,24 @@ static struct event *pb_timer_ev;
 static struct timespec player_tick_interval;
 // Timer resolution
 static struct timespec player_timer_res;
+// Number of ticks per timer expiration, 1 unless all outputs are buffered
+static int pb_timer_batch;
+// Max value of the above, PLAYER_TICK_BATCH_MS converted to clock ticks
+static int pb_timer_batch_max;
 
 // PLAYER_WRITE_BEHIND_MAX converted to clock ticks
 static int pb_write_deficit_max;
 
+// When the timer should next expire, and its period, for measuring lateness
+static uint64_t pb_timer_next_ns;
+static uint64_t pb_timer_period_ns;
+
+// Histograms to help diagnose stutter, see player_stats_get()
+static struct player_stats pb_stats;
+
+// When playback last was short of time (monotonic ns), read by other threads
+static uint64_t pb_pressure_ns;
+
 // True if we are trying to recover from a major playback timer overrun (write problems)
 static bool pb_write_recovery;
 
@@ -359,9 +393,40 @@ pb_abort(void);
 static int
 pb_suspend(void);
 
+static void
+pb_timer_batch_update(void);
+
 
 /* ----------------------- Misc helpers and callbacks ----------------------- */
 
+static uint64_t
+monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Samples the player pipeline, called every time the playback timer expires
+static void
+stats_update(uint64_t late_ns)
+{
+  size_t bytes_per_ms;
+
+  histogram_add(&pb_stats.tick_late_ms, late_ns / 1000000UL);
+
+  bytes_per_ms = STOB(pb_session.quality.sample_rate, pb_session.quality.bits_per_sample, pb_session.quality.channels) / 1000;
+  if (bytes_per_ms == 0)
+    return;
+
+  histogram_add(&pb_stats.read_behind_ms, pb_session.read_deficit / bytes_per_ms);
+  histogram_add(&pb_stats.input_fill_ms, input_buffer_fill() / bytes_per_ms);
+
+  if (late_ns > PLAYER_PRESSURE_LATE_MS * 1000000UL || pb_session.read_deficit > 0 || input_buffer_fill() < PLAYER_PRESSURE_FILL_MS * bytes_per_ms)
+    __atomic_store_n(&pb_pressure_ns, monotonic_ns(), __ATOMIC_RELAXED);
+}
+
 // Callback from the worker thread (async operation as it may block)
 static void
 playcount_inc_cb(void *arg)
@@ -679,6 +744,29 @@ source_next_create(struct player_source *current)
   return ps;
 }
 
+// Lets the input prepare the item that will be read after ps. Doesn't reshuffle
+// for repeat all, since that is done when we actually get there.
+static void
+source_next_prepare(struct player_source *ps)
+{
+  struct db_queue_item *queue_item;
+
+  if (repeat == REPEAT_SONG)
+    queue_item = db_queue_fetch_byitemid(ps->item_id);
+  else
+    queue_item = db_queue_fetch_next(ps->item_id, shuffle);
+
+  if (!queue_item && repeat == REPEAT_ALL && !shuffle)
+    queue_item = db_queue_fetch_bypos(0, 0);
+
+  if (!queue_item)
+    return;
+
+  input_prepare(queue_item->id);
+
+  free_queue_item(queue_item, 0);
+}
+
 static void
 source_stop(void)
 {
@@ -688,6 +776,8 @@ source_stop(void)
 static int
 source_start(struct player_source *ps)
 {
+  int ret;
+
   if (!ps)
     return 0;
 
@@ -695,7 +785,11 @@ source_start(struct player_source *ps)
 
   input_flush(NULL);
 
-  return input_seek(ps->item_id, (int)ps->seek_ms);
+  ret = input_seek(ps->item_id, (int)ps->seek_ms);
+
+  source_next_prepare(ps);
+
+  return ret;
 }
 
 static void
@@ -707,6 +801,8 @@ source_next(struct player_source *ps)
   DPRINTF(E_DBG, L_PLAYER, "Opening next track: '%s' (id=%d)\n", ps->path, ps->item_id);
 
   input_start(ps->item_id);
+
+  source_next_prepare(ps);
 }
 
 static int
@@ -755,6 +851,37 @@ source_print(char *line, size_t linesize, struct player_source *ps, const char *
   return pos;
 }
 
+static void
+histogram_print(const char *name, struct histogram *h)
+{
+  char line[512];
+  int pos = 0;
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    pos += snprintf(line + pos, sizeof(line) - pos, "%" PRIu64 " ", h->count[i]);
+
+  DPRINTF(E_DBG, L_PLAYER, "%s: max=%" PRIu64 "; buckets=%s\n", name, h->max, line);
+}
+
+static void
+stats_dump(void)
+{
+  char name[64];
+  int i;
+
+  histogram_print("tick_late_ms", &pb_stats.tick_late_ms);
+  histogram_print("read_behind_ms", &pb_stats.read_behind_ms);
+  histogram_print("input_fill_ms", &pb_stats.input_fill_ms);
+
+  pb_stats.noutputs = outputs_stats_get(pb_stats.output, PLAYER_STATS_OUTPUTS_MAX);
+  for (i = 0; i < pb_stats.noutputs; i++)
+    {
+      snprintf(name, sizeof(name), "%s.write_us", pb_stats.output[i].name);
+      histogram_print(name, &pb_stats.output[i].write_us);
+    }
+}
+
 static void
 session_dump(bool use_counter)
 {
@@ -787,6 +914,8 @@ session_dump(bool use_counter)
 
       DPRINTF(E_DBG, L_PLAYER, "%s\n", line);
     }
+
+  stats_dump();
 }
 #endif
 
@@ -1073,7 +1202,7 @@ event_play_eof()
 
   if (id != DB_MEDIA_FILE_NON_PERSISTENT_ID)
     {
-      worker_execute(playcount_inc_cb, &id, sizeof(int), 5);
+      worker_execute_priority(playcount_inc_cb, &id, sizeof(int), 5, WORKER_PRIORITY_HIGH);
       worker_execute(scrobble_cb, &id, sizeof(int), 8);
       history_add(pb_session.playing_now->id, pb_session.playing_now->item_id);
     }
@@ -1126,7 +1255,7 @@ event_play_metadata()
       // Triggers an async chain of metadata update, first worker will do an
       // update of the db, then the player will update outputs, where the worker
       // may be called by the output, and then player sends status_update
-      worker_execute(metadata_update_queue_cb, &(metadata_pending[i].metadata), sizeof(metadata_pending[i].metadata), 0);
+      worker_execute_priority(metadata_update_queue_cb, &(metadata_pending[i].metadata), sizeof(metadata_pending[i].metadata), 0, WORKER_PRIORITY_HIGH);
 
       memset(&metadata_pending[i], 0, sizeof(struct metadata_pending_register));
     }
@@ -1249,8 +1378,12 @@ source_read(int *nbytes, int *nsamples, uint8_t *buf, int len)
 static void
 playback_cb(int fd, short what, void *arg)
 {
+  struct trace_span span;
   struct timespec ts;
   uint64_t overrun;
+  uint64_t ticks;
+  uint64_t expired_ns;
+  uint64_t now_ns;
   int nbytes;
   int nsamples;
   int i;
@@ -1272,6 +1405,17 @@ playback_cb(int fd, short what, void *arg)
     overrun = ret;
 #endif /* HAVE_TIMERFD */
 
+  // Lateness is measured against the last expiration, catching up on the
+  // missed ones is handled below
+  now_ns = monotonic_ns();
+  expired_ns = pb_timer_next_ns + overrun * pb_timer_period_ns;
+  pb_timer_next_ns = expired_ns + pb_timer_period_ns;
+
+  // With a batching timer each expiration covers multiple ticks, so from here
+  // on overrun is in ticks
+  overrun *= pb_timer_batch;
+  ticks = pb_timer_batch + overrun;
+
   // We are too delayed, probably some output blocked: reset if first overrun or abort if second overrun
   if (overrun > pb_write_deficit_max)
     {
@@ -1294,7 +1438,7 @@ playback_cb(int fd, short what, void *arg)
     }
   else
     {
-      if (overrun > 1) // An overrun of 1 is no big deal
+      if (overrun > pb_timer_batch) // An overrun of 1 is no big deal
 	DPRINTF(E_WARN, L_PLAYER, "Output delay detected: player is %" PRIu64 " ticks behind, catching up\n", overrun);
 
       pb_write_recovery = false;
@@ -1306,12 +1450,13 @@ playback_cb(int fd, short what, void *arg)
 
   // The pessimistic approach: Assume you won't get anything, then anything that
   // comes your way is a positive surprise.
-  pb_session.read_deficit += (1 + overrun) * pb_session.bufsize;
+  pb_session.read_deficit += ticks * pb_session.bufsize;
 
   // If there was an overrun, we will try to read/write a corresponding number
   // of times so we catch up. The read from the input is non-blocking, so it
   // should not bring us further behind, even if there is no data.
-  for (i = 1 + overrun; i > 0; i--)
+  trace_begin(&span, "player", "playback_tick");
+  for (i = ticks; i > 0; i--)
     {
       ret = source_read(&nbytes, &nsamples, pb_session.buffer, pb_session.bufsize);
       if (ret < 0)
@@ -1349,6 +1494,7 @@ playback_cb(int fd, short what, void *arg)
 	    i = 2;
 	}
     }
+  trace_end(&span);
 
   if (pb_session.read_deficit_max && pb_session.read_deficit > pb_session.read_deficit_max)
     {
@@ -1360,7 +1506,14 @@ playback_cb(int fd, short what, void *arg)
       // the trigger will be set by device_flush_cb.
       if (player_flush_pending == 0)
 	input_buffer_full_cb(player_playback_start);
+
+      return;
     }
+
+  stats_update((now_ns > expired_ns) ? now_ns - expired_ns : 0);
+
+  // Outputs may have been added or removed since last time
+  pb_timer_batch_update();
 }
 
 
@@ -1594,6 +1747,33 @@ device_shutdown_cb(struct output_device *device, enum output_device_state status
   commands_exec_end(cmdbase, retval);
 }
 
+static void
+device_join_cb(struct output_device *device, enum output_device_state status)
+{
+  if (!device)
+    {
+      DPRINTF(E_WARN, L_PLAYER, "Output device disappeared while joining playback\n");
+      goto out;
+    }
+
+  DPRINTF(E_DBG, L_PLAYER, "Callback from %s device %s to device_join_cb (status %d)\n", device->type_name, device->name, status);
+
+  if (status == OUTPUT_STATE_PASSWORD || status == OUTPUT_STATE_FAILED)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "The %s device '%s' failed to join playback\n", device->type_name, device->name);
+
+      outputs_device_deselect(device);
+      goto out;
+    }
+
+  DPRINTF(E_INFO, L_PLAYER, "The %s device '%s' joined playback\n", device->type_name, device->name);
+
+  outputs_device_cb_set(device, device_streaming_cb);
+
+ out:
+  status_update(player_state, LISTENER_SPEAKER | LISTENER_VOLUME);
+}
+
 static void
 device_activate_cb(struct output_device *device, enum output_device_state status)
 {
@@ -1636,6 +1816,18 @@ device_activate_cb(struct output_device *device, enum output_device_state status
   // there is no session any more
   outputs_device_cb_set(device, device_streaming_cb);
 
+  // Enough speakers are ready to start playback, so the rest will join when
+  // they are ready. Since the backends sync with the clock the late ones will
+  // still play in sync.
+  if (pb_start_ready_wait > 0 && --pb_start_ready_wait == 0)
+    {
+      DPRINTF(E_INFO, L_PLAYER, "Starting playback with %d speaker(s) ready, the rest will join\n", speaker_ready_min);
+
+      outputs_cb_replace(device_activate_cb, device_join_cb);
+      commands_exec_end_now(cmdbase, 0);
+      return;
+    }
+
  out:
   commands_exec_end(cmdbase, retval);
 }
@@ -1645,6 +1837,8 @@ player_pmap(void *p)
 {
   if (p == device_activate_cb)
     return "device_activate_cb";
+  else if (p == device_join_cb)
+    return "device_join_cb";
   else if (p == device_streaming_cb)
     return "device_streaming_cb";
   else if (p == device_volume_cb)
@@ -1660,25 +1854,17 @@ player_pmap(void *p)
 /* ------------------------- Internal playback routines --------------------- */
 
 static int
-pb_timer_start(void)
+pb_timer_arm(int batch)
 {
   struct itimerspec tick;
+  uint64_t nsec;
   int ret;
 
-  // The stop timers will be active if we have recently paused, but now that the
-  // playback loop has been kicked off, we deactivate them
-  outputs_stop_delayed_cancel();
-
-  ret = event_add(pb_timer_ev, NULL);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Could not add playback timer\n");
+  nsec = (uint64_t)batch * player_tick_interval.tv_nsec;
 
-      return -1;
-    }
-
-  tick.it_interval = player_tick_interval;
-  tick.it_value = player_tick_interval;
+  tick.it_interval.tv_sec = nsec / 1000000000UL;
+  tick.it_interval.tv_nsec = nsec % 1000000000UL;
+  tick.it_value = tick.it_interval;
 
 #ifdef HAVE_TIMERFD
   ret = timerfd_settime(pb_timer_fd, 0, &tick, NULL);
@@ -1692,9 +1878,50 @@ pb_timer_start(void)
       return -1;
     }
 
+  pb_timer_batch = batch;
+  pb_timer_period_ns = nsec;
+  pb_timer_next_ns = monotonic_ns() + nsec;
+
   return 0;
 }
 
+static int
+pb_timer_start(void)
+{
+  int ret;
+
+  // The stop timers will be active if we have recently paused, but now that the
+  // playback loop has been kicked off, we deactivate them
+  outputs_stop_delayed_cancel();
+
+  ret = event_add(pb_timer_ev, NULL);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not add playback timer\n");
+
+      return -1;
+    }
+
+  return pb_timer_arm(outputs_sessions_buffered() ? pb_timer_batch_max : 1);
+}
+
+// Switches between batched and regular ticks if the outputs changed. Note that
+// re-arming the timer restarts the current period, which is fine, since it just
+// means we will be a bit late, and playback_cb() catches up on the next tick.
+static void
+pb_timer_batch_update(void)
+{
+  int batch;
+
+  batch = outputs_sessions_buffered() ? pb_timer_batch_max : 1;
+  if (batch == pb_timer_batch)
+    return;
+
+  DPRINTF(E_DBG, L_PLAYER, "Changing playback timer batch from %d to %d ticks\n", pb_timer_batch, batch);
+
+  pb_timer_arm(batch);
+}
+
 static int
 pb_timer_stop(void)
 {
@@ -1880,6 +2107,18 @@ pb_suspend(void)
 
 /* --------------- Actual commands, executed in the player thread ----------- */
 
+static enum command_state
+stats_get(void *arg, int *retval)
+{
+  struct player_stats *stats = arg;
+
+  *stats = pb_stats;
+  stats->noutputs = outputs_stats_get(stats->output, PLAYER_STATS_OUTPUTS_MAX);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
 static enum command_state
 get_status(void *arg, int *retval)
 {
@@ -2002,6 +2241,8 @@ playback_start_bh(void *arg, int *retval)
 {
   int ret;
 
+  pb_start_ready_wait = 0;
+
   ret = pb_timer_start();
   if (ret < 0)
     goto error;
@@ -2107,9 +2348,15 @@ playback_start_item(void *arg, int *retval)
 	}
     }
 
-  // We're async if we need to wait for devices starting
+  // We're async if we need to wait for devices starting. If configured we
+  // don't wait for all of them, see device_activate_cb().
   if (*retval > 0)
-    return COMMAND_PENDING; // async
+    {
+      if (speaker_ready_min > 0 && speaker_ready_min < *retval)
+	pb_start_ready_wait = speaker_ready_min;
+
+      return COMMAND_PENDING; // async
+    }
 
   // Otherwise, just run the bottom half
   *retval = 0;
@@ -2242,7 +2489,7 @@ playback_next_bh(void *arg, int *retval)
       history_add(pb_session.playing_now->id, pb_session.playing_now->item_id);
 
       id = (int)(pb_session.playing_now->id);
-      worker_execute(skipcount_inc_cb, &id, sizeof(int), 5);
+      worker_execute_priority(skipcount_inc_cb, &id, sizeof(int), 5, WORKER_PRIORITY_HIGH);
     }
 
   queue_item = queue_item_next(pb_session.playing_now->item_id);
@@ -2546,6 +2793,8 @@ device_to_speaker_info(struct player_speaker_info *spk, struct output_device *de
   spk->needs_auth_key = (device->requires_auth && device->auth_key == NULL);
   spk->prevent_playback = device->prevent_playback;
   spk->busy = device->busy;
+
+  spk->stats = device->stats;
 }
 
 static enum command_state
@@ -2999,13 +3248,12 @@ streaming_register(void *arg, int *retval)
     .name = "streaming",
     .quality = param->quality,
     .selected_format = param->format,
+    .audio_ev = param->audio_ev,
   };
 
   *retval = outputs_device_start(&device, NULL, false);
 
   param->spk_id = device.id;
-  param->audio_fd = device.audio_fd;
-  param->metadata_fd = device.metadata_fd;
   return COMMAND_END;
 }
 
@@ -3280,6 +3528,42 @@ player_get_status(struct player_status *status)
   return ret;
 }
 
+/*
+ * Gets histograms of timer lateness, read deficit, input buffer fill and output
+ * write duration, accumulated since startup.
+ */
+int
+player_stats_get(struct player_stats *stats)
+{
+  int ret;
+
+  ret = commands_exec_sync(cmdbase, stats_get, NULL, stats);
+  return ret;
+}
+
+/*
+ * For background work, e.g. scanning. Sleeps if playback recently was short of
+ * time, i.e. ticks were late or the input buffer ran low, and the longer that
+ * lasts, the longer the sleep.
+ *
+ * @in/out delay_ms kept by the caller between calls, initially 0
+ */
+void
+player_pressure_throttle(unsigned int *delay_ms)
+{
+  uint64_t pressure_ns;
+
+  pressure_ns = __atomic_load_n(&pb_pressure_ns, __ATOMIC_RELAXED);
+  if (pressure_ns == 0 || monotonic_ns() - pressure_ns > PLAYER_PRESSURE_HOLD_MS * 1000000UL)
+    {
+      *delay_ms = 0;
+      return;
+    }
+
+  *delay_ms = (*delay_ms == 0) ? PLAYER_THROTTLE_MIN_MS : MIN(2 * *delay_ms, PLAYER_THROTTLE_MAX_MS);
+  usleep(*delay_ms * 1000);
+}
+
 
 /* ------------------------------ Thread: httpd ----------------------------- */
 
@@ -3602,20 +3886,19 @@ player_speaker_format_set(uint64_t id, enum media_format format)
 }
 
 int
-player_streaming_register(int *audio_fd, int *metadata_fd, enum media_format format, struct media_quality quality)
+player_streaming_register(struct event *audio_ev, enum media_format format, struct media_quality quality)
 {
   struct speaker_attr_param param;
   int ret;
 
   param.format = format;
   param.quality = quality;
+  param.audio_ev = audio_ev;
 
   ret = commands_exec_sync(cmdbase, streaming_register, NULL, &param);
   if (ret < 0)
     return ret;
 
-  *audio_fd = param.audio_fd;
-  *metadata_fd = param.metadata_fd;
   return param.spk_id;
 }
 
@@ -3835,6 +4118,11 @@ player(void *arg)
   struct output_device *device;
   int ret;
 
+  // The outputs run in this thread
+  mem_tag_set(MEM_TAG_OUTPUTS);
+
+  thread_realtime_apply("player");
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -3870,6 +4158,7 @@ player_init(void)
   int ret;
 
   speaker_autoselect = cfg_getbool(cfg_getsec(cfg, "general"), "speaker_autoselect");
+  speaker_ready_min = cfg_getint(cfg_getsec(cfg, "general"), "speaker_ready_min");
   clear_queue_on_stop_disabled = cfg_getbool(cfg_getsec(cfg, "library"), "clear_queue_on_stop_disable");
 
   /* Handle deprecated config options, note that this is also in library.c */
@@ -3887,6 +4176,8 @@ player_init(void)
 
   CHECK_NULL(L_PLAYER, history = calloc(1, sizeof(struct player_history)));
 
+  memory_lock();
+
   // Determine if the resolution of the system timer is > or < the size
   // of an audio packet. NOTE: this assumes the system clock resolution
   // is less than one second.
@@ -3908,6 +4199,9 @@ player_init(void)
 
   pb_write_deficit_max = (PLAYER_WRITE_BEHIND_MAX * 1000000 / interval);
 
+  pb_timer_batch_max = MAX(1, PLAYER_TICK_BATCH_MS * 1000000 / interval);
+  pb_timer_batch = 1;
+
   // Create the playback timer
 #ifdef HAVE_TIMERFD
   pb_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
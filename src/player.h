@@ -7,6 +7,9 @@
 
 #include "db.h"
 #include "misc.h" // for struct media_quality
+#include "outputs.h" // for struct output_stats
+
+struct event;
 
 // Maximum number of previously played songs that are remembered
 #define MAX_HISTORY_COUNT 20
@@ -49,6 +52,8 @@ struct player_speaker_info {
   bool busy;
 
   bool has_video;
+
+  struct output_stats stats;
 };
 
 struct player_status {
@@ -71,6 +76,28 @@ struct player_status {
   uint32_t len_ms;
 };
 
+#define PLAYER_STATS_OUTPUTS_MAX 16
+
+struct player_stats_output {
+  const char *name;
+  /* Duration of each write to the output in microseconds */
+  struct histogram write_us;
+};
+
+/* Histograms of values sampled by the player each time the playback timer
+ * expires, i.e. every tick, or every batch of ticks */
+struct player_stats {
+  /* How late the timer event was handled in ms */
+  struct histogram tick_late_ms;
+  /* How much the input is behind (read deficit) in ms */
+  struct histogram read_behind_ms;
+  /* Amount of audio in the input buffer in ms */
+  struct histogram input_fill_ms;
+
+  int noutputs;
+  struct player_stats_output output[PLAYER_STATS_OUTPUTS_MAX];
+};
+
 typedef void (*spk_enum_cb)(struct player_speaker_info *spk, void *arg);
 
 struct player_history
@@ -89,6 +116,12 @@ struct player_history
 int
 player_get_status(struct player_status *status);
 
+int
+player_stats_get(struct player_stats *stats);
+
+void
+player_pressure_throttle(unsigned int *delay_ms);
+
 int
 player_playing_now(uint32_t *id);
 
@@ -132,7 +165,7 @@ int
 player_speaker_format_set(uint64_t id, enum media_format format);
 
 int
-player_streaming_register(int *audio_fd, int *metadata_fd, enum media_format format, struct media_quality quality);
+player_streaming_register(struct event *audio_ev, enum media_format format, struct media_quality quality);
 
 int
 player_streaming_deregister(int id);
@@ -0,0 +1,671 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for the player's write path: outputs.c filling the output buffer
+ * for each quality subscription, and the outputs taking their data. The given
+ * file is decoded once, and then written tick by tick like the player does,
+ * but without waiting for the timer, to a growing number of dummy output
+ * sessions. Each session subscribes to one of the given qualities. Reported
+ * are the CPU time and allocations per second of audio and the distribution
+ * of the cost of a tick. Build with "make player_bench", then e.g.:
+ *
+ *   ./player_bench -c /etc/owntone.conf -n 1,4,16 -q 44100/16,48000/16 test.flac
+ *
+ * Outputs save the speaker state in the database, so one is created in the
+ * work directory given with -w.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <getopt.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <libavutil/log.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "listener.h"
+#include "transcode.h"
+#include "outputs.h"
+
+#define PLAYER_BENCH_CONFFILE CONFDIR "/owntone.conf"
+#define PLAYER_BENCH_SQLITE_EXT PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so"
+// Same as the player's PLAYER_TICK_INTERVAL
+#define PLAYER_BENCH_TICK_MS 10
+// Bytes requested from transcode() per call when decoding the file
+#define PLAYER_BENCH_READ_SIZE (64 * 1024)
+#define PLAYER_BENCH_SPEAKERS_MAX 64
+
+// Normally defined in main.c and player.c, referenced by outputs.c and others
+struct event_base *evbase_main;
+extern struct event_base *evbase_player;
+
+// Only the dummy output is used, the others are disabled before outputs_init()
+extern struct output_definition output_raop;
+extern struct output_definition output_airplay;
+extern struct output_definition output_streaming;
+extern struct output_definition output_dummy;
+extern struct output_definition output_fifo;
+extern struct output_definition output_rcp;
+#ifdef HAVE_ALSA
+extern struct output_definition output_alsa;
+#endif
+#ifdef HAVE_LIBPULSE
+extern struct output_definition output_pulse;
+#endif
+#ifdef CHROMECAST
+extern struct output_definition output_cast;
+#endif
+
+// The decoded file, which the ticks are read from, looping if the run is
+// longer than the file
+struct bench_source
+{
+  uint8_t *buf;
+  size_t len;
+  size_t pos;
+  struct media_quality quality;
+};
+
+struct bench_result
+{
+  double *tick_us;
+  int ticks;
+  double audio_sec;
+  double wall_sec;
+  double cpu_sec;
+  uint64_t allocs;
+  long rss_kib;
+};
+
+
+/* ---------------------------- Allocation counting ------------------------- */
+
+// Same as in xcode_bench.c, counts the allocations of the whole process
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t bench_allocs;
+
+void *
+malloc(size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  *memptr = __libc_memalign(alignment, size);
+  return *memptr ? 0 : ENOMEM;
+}
+
+static uint64_t
+allocs_get(void)
+{
+  return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+#else
+static uint64_t
+allocs_get(void)
+{
+  return 0;
+}
+#endif
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+seconds_get(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+rss_peak_kib_get(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+
+  return (da > db) - (da < db);
+}
+
+static double
+percentile_get(double *sorted, int n, int pct)
+{
+  return sorted[(int)((n - 1) * pct / 100.0 + 0.5)];
+}
+
+// Parses "44100/16" or "44100/16/2", the default is two channels
+static int
+quality_parse(struct media_quality *quality, const char *str)
+{
+  memset(quality, 0, sizeof(struct media_quality));
+
+  quality->channels = 2;
+  if (sscanf(str, "%d/%d/%d", &quality->sample_rate, &quality->bits_per_sample, &quality->channels) < 2)
+    return -1;
+
+  if (quality->sample_rate <= 0 || quality->channels <= 0)
+    return -1;
+
+  if (quality->bits_per_sample != 16 && quality->bits_per_sample != 24 && quality->bits_per_sample != 32)
+    return -1;
+
+  return 0;
+}
+
+static void
+device_cb(struct output_device *device, enum output_device_state status)
+{
+  if (status < OUTPUT_STATE_STOPPED)
+    fprintf(stderr, "Dummy device '%s' failed (state %d)\n", device->name, status);
+}
+
+// Runs the callbacks that outputs.c defers to the player's event loop
+static void
+outputs_callbacks_run(void)
+{
+  event_base_loop(evbase_player, EVLOOP_NONBLOCK);
+}
+
+
+/* --------------------------------- Source --------------------------------- */
+
+static int
+source_load(struct bench_source *source, const char *path)
+{
+  struct media_quality quality = { 44100, 16, 2, 0 };
+  struct transcode_decode_setup_args decode_args = { .profile = XCODE_PCM_NATIVE, .path = path };
+  struct transcode_encode_setup_args encode_args = { .profile = XCODE_PCM16, .quality = &quality };
+  struct transcode_ctx *ctx;
+  struct evbuffer *evbuf;
+  int ret;
+
+  memset(source, 0, sizeof(struct bench_source));
+
+  ctx = transcode_setup(decode_args, encode_args);
+  if (!ctx)
+    {
+      fprintf(stderr, "Could not set up decoding of '%s'\n", path);
+      return -1;
+    }
+
+  CHECK_NULL(L_MAIN, evbuf = evbuffer_new());
+
+  do
+    ret = transcode(evbuf, NULL, ctx, PLAYER_BENCH_READ_SIZE);
+  while (ret > 0);
+
+  transcode_cleanup(&ctx);
+
+  source->len = evbuffer_get_length(evbuf);
+  if (ret < 0 || source->len < STOB(quality.sample_rate, quality.bits_per_sample, quality.channels))
+    {
+      fprintf(stderr, "Could not decode at least one second of audio from '%s'\n", path);
+      evbuffer_free(evbuf);
+      return -1;
+    }
+
+  CHECK_NULL(L_MAIN, source->buf = malloc(source->len));
+  evbuffer_remove(evbuf, source->buf, source->len);
+  evbuffer_free(evbuf);
+
+  source->quality = quality;
+
+  return 0;
+}
+
+// Like source_read() in player.c, but never short
+static void
+source_read(uint8_t *buf, size_t len, struct bench_source *source)
+{
+  size_t n;
+
+  while (len > 0)
+    {
+      n = MIN(len, source->len - source->pos);
+      memcpy(buf, source->buf + source->pos, n);
+
+      buf += n;
+      len -= n;
+      source->pos = (source->pos + n) % source->len;
+    }
+}
+
+
+/* --------------------------------- Devices -------------------------------- */
+
+static int
+outputs_setup(void)
+{
+  output_raop.disabled = 1;
+  output_airplay.disabled = 1;
+  output_streaming.disabled = 1;
+  output_fifo.disabled = 1;
+  output_rcp.disabled = 1;
+#ifdef HAVE_ALSA
+  output_alsa.disabled = 1;
+#endif
+#ifdef HAVE_LIBPULSE
+  output_pulse.disabled = 1;
+#endif
+#ifdef CHROMECAST
+  output_cast.disabled = 1;
+#endif
+
+  // The dummy's own init would add its device via the player, which isn't
+  // running. We add our own devices instead.
+  output_dummy.init = NULL;
+
+  return outputs_init();
+}
+
+static struct output_device *
+device_make(int index, struct media_quality *quality)
+{
+  struct output_device *device;
+
+  CHECK_NULL(L_MAIN, device = calloc(1, sizeof(struct output_device)));
+
+  device->id = index + 1;
+  device->name = safe_asprintf("Bench speaker %d", index + 1);
+  device->type = OUTPUT_TYPE_DUMMY;
+  device->type_name = outputs_name(device->type);
+  device->quality = *quality;
+
+  return outputs_device_add(device, false);
+}
+
+static int
+sessions_start(struct output_device **devices, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (outputs_device_start(devices[i], device_cb, false) < 0)
+	return -1;
+    }
+
+  outputs_callbacks_run();
+
+  return (outputs_sessions_count() == n) ? 0 : -1;
+}
+
+static void
+sessions_stop(struct output_device **devices, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (devices[i]->session)
+	outputs_device_stop(devices[i], device_cb);
+    }
+
+  outputs_callbacks_run();
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+static int
+bench_run(struct bench_result *result, struct bench_source *source, int seconds)
+{
+  struct timespec tick_interval = { 0, PLAYER_BENCH_TICK_MS * 1000000L };
+  struct timespec pts;
+  uint8_t *buf;
+  size_t bufsize;
+  int nsamples;
+  double wall_start;
+  double cpu_start;
+  double start;
+  uint64_t allocs_start;
+  int i;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  nsamples = source->quality.sample_rate * PLAYER_BENCH_TICK_MS / 1000;
+  bufsize = STOB(nsamples, source->quality.bits_per_sample, source->quality.channels);
+
+  result->ticks = seconds * 1000 / PLAYER_BENCH_TICK_MS;
+
+  CHECK_NULL(L_MAIN, buf = malloc(bufsize));
+  CHECK_NULL(L_MAIN, result->tick_us = calloc(result->ticks, sizeof(double)));
+
+  clock_gettime(CLOCK_REALTIME, &pts);
+
+  // The first write after a change of subscriptions sets up the encoders, which
+  // is not what we want to measure
+  source_read(buf, bufsize, source);
+  outputs_write(buf, bufsize, nsamples, &source->quality, &pts);
+  pts = timespec_add(pts, tick_interval);
+
+  wall_start = seconds_get(CLOCK_MONOTONIC);
+  cpu_start = seconds_get(CLOCK_PROCESS_CPUTIME_ID);
+  allocs_start = allocs_get();
+
+  for (i = 0; i < result->ticks; i++)
+    {
+      start = seconds_get(CLOCK_MONOTONIC);
+
+      source_read(buf, bufsize, source);
+      outputs_write(buf, bufsize, nsamples, &source->quality, &pts);
+      pts = timespec_add(pts, tick_interval);
+
+      result->tick_us[i] = (seconds_get(CLOCK_MONOTONIC) - start) * 1e6;
+    }
+
+  result->wall_sec = seconds_get(CLOCK_MONOTONIC) - wall_start;
+  result->cpu_sec = seconds_get(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  result->allocs = allocs_get() - allocs_start;
+  result->audio_sec = result->ticks * PLAYER_BENCH_TICK_MS / 1000.0;
+  result->rss_kib = rss_peak_kib_get();
+
+  qsort(result->tick_us, result->ticks, sizeof(double), compare_double);
+
+  free(buf);
+
+  return 0;
+}
+
+static void
+result_print(int speakers, struct bench_result *result)
+{
+  printf("%8d %10.1fx %9.3f %12.1f %9.1f %9.1f %9.1f %9.1f %10ld\n",
+    speakers,
+    (result->wall_sec > 0) ? result->audio_sec / result->wall_sec : 0,
+    result->cpu_sec * 1000 / result->audio_sec,
+    result->allocs / result->audio_sec,
+    percentile_get(result->tick_us, result->ticks, 50),
+    percentile_get(result->tick_us, result->ticks, 90),
+    percentile_get(result->tick_us, result->ticks, 99),
+    result->tick_us[result->ticks - 1],
+    result->rss_kib);
+}
+
+static int
+bench_setup(const char *workdir)
+{
+  cfg_t *general = cfg_getsec(cfg, "general");
+  char *path;
+
+  if (mkdir(workdir, 0755) < 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create work directory '%s': %s\n", workdir, strerror(errno));
+      return -1;
+    }
+
+  path = safe_asprintf("%s/songs3.db", workdir);
+  cfg_setstr(general, "db_path", path);
+  free(path);
+
+  return 0;
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options] <file>\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>       Use <file> as the configuration file\n");
+  printf("  -w <dir>        Work directory for the database (default /tmp/owntone-bench)\n");
+  printf("  -n <n,n>        Numbers of speakers to run with (max %d, default 1,2,4,8,16)\n", PLAYER_BENCH_SPEAKERS_MAX);
+  printf("  -q <rate/bits>  Qualities the speakers subscribe to, in turn (default 44100/16,44100/24,48000/16)\n");
+  printf("  -t <seconds>    Seconds of audio per run (default 60)\n");
+  printf("  -s <path>       Path to the sqlite extension\n");
+  printf("  -d <number>     Log level (0-5)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct output_device *devices[PLAYER_BENCH_SPEAKERS_MAX];
+  struct media_quality qualities[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS];
+  struct bench_source source;
+  struct bench_result result;
+  char *configfile = PLAYER_BENCH_CONFFILE;
+  char *sqlite_ext = PLAYER_BENCH_SQLITE_EXT;
+  char *workdir = "/tmp/owntone-bench";
+  char *countlist = "1,2,4,8,16";
+  char *qualitylist = "44100/16,44100/24,48000/16";
+  char *name;
+  char *ptr;
+  int nqualities;
+  int ndevices;
+  int seconds = 60;
+  int speakers;
+  int loglevel = E_LOG;
+  int option;
+  int errors = 0;
+  int ret = EXIT_FAILURE;
+
+  while ((option = getopt(argc, argv, "c:w:n:q:t:s:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'w':
+	    workdir = optarg;
+	    break;
+
+	  case 'n':
+	    countlist = optarg;
+	    break;
+
+	  case 'q':
+	    qualitylist = optarg;
+	    break;
+
+	  case 't':
+	    seconds = atoi(optarg);
+	    break;
+
+	  case 's':
+	    sqlite_ext = optarg;
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (optind >= argc || seconds < 1)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  nqualities = 0;
+  for (name = strtok_r(qualitylist, ",", &ptr); name; name = strtok_r(NULL, ",", &ptr))
+    {
+      if (nqualities == ARRAY_SIZE(qualities))
+	{
+	  fprintf(stderr, "Too many qualities, outputs.c supports %d subscriptions\n", OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS);
+	  return EXIT_FAILURE;
+	}
+
+      if (quality_parse(&qualities[nqualities], name) < 0)
+	{
+	  fprintf(stderr, "Invalid quality '%s'\n", name);
+	  return EXIT_FAILURE;
+	}
+
+      nqualities++;
+    }
+
+  if (nqualities == 0)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (conffile_load(configfile) != 0)
+    {
+      fprintf(stderr, "Config file errors; please fix your config\n");
+      goto conffile_fail;
+    }
+
+  if (bench_setup(workdir) < 0)
+    goto setup_fail;
+
+  av_log_set_callback(logger_ffmpeg);
+
+  if (source_load(&source, argv[optind]) < 0)
+    goto source_fail;
+
+  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
+  CHECK_NULL(L_MAIN, evbase_player = event_base_new());
+
+  if (db_init(sqlite_ext) < 0 || db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not initialize the database\n");
+      goto db_fail;
+    }
+
+  listener_init();
+
+  if (outputs_setup() < 0)
+    {
+      fprintf(stderr, "Could not initialize the dummy output\n");
+      goto outputs_fail;
+    }
+
+#ifndef __GLIBC__
+  fprintf(stderr, "Note: Counting allocations requires glibc, allocs/s will be 0\n");
+#endif
+
+  printf("%8s %11s %9s %12s %9s %9s %9s %9s %10s\n",
+    "speakers", "realtime", "cpu_ms/s", "allocs/s", "p50_us", "p90_us", "p99_us", "max_us", "rss_kib");
+
+  ndevices = 0;
+  for (name = strtok_r(countlist, ",", &ptr); name; name = strtok_r(NULL, ",", &ptr))
+    {
+      speakers = atoi(name);
+      if (speakers < 1 || speakers > PLAYER_BENCH_SPEAKERS_MAX)
+	{
+	  fprintf(stderr, "Invalid number of speakers '%s'\n", name);
+	  errors++;
+	  continue;
+	}
+
+      for (; ndevices < speakers; ndevices++)
+	devices[ndevices] = device_make(ndevices, &qualities[ndevices % nqualities]);
+
+      if (sessions_start(devices, speakers) < 0)
+	{
+	  fprintf(stderr, "Could not start %d dummy sessions\n", speakers);
+	  sessions_stop(devices, ndevices);
+	  errors++;
+	  continue;
+	}
+
+      bench_run(&result, &source, seconds);
+      result_print(speakers, &result);
+      free(result.tick_us);
+
+      sessions_stop(devices, speakers);
+    }
+
+  while (ndevices > 0)
+    outputs_device_remove(devices[--ndevices]);
+
+  ret = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  outputs_deinit();
+ outputs_fail:
+  listener_deinit();
+  db_perthread_deinit();
+  db_deinit();
+ db_fail:
+  event_base_free(evbase_player);
+  event_base_free(evbase_main);
+  free(source.buf);
+ source_fail:
+ setup_fail:
+  conffile_unload();
+ conffile_fail:
+  logger_deinit();
+
+  return ret;
+}
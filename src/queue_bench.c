@@ -0,0 +1,678 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for the queue operations with large queues. For each of the given
+ * queue sizes, the queue is filled from a synthetic library, and then each
+ * operation (adding, moving, deleting, fetching, reshuffling) and the queue
+ * replies of the JSON API and DACP are run a number of times in-process. The
+ * latency percentiles, the number of rows written per operation and the size
+ * of the replies are reported. Build with "make queue_bench", then e.g.:
+ *
+ *   ./queue_bench -c /etc/owntone.conf -w /tmp/queue-bench -n 1000,10000,100000
+ *
+ * The library is kept in the work directory and only generated again if it
+ * isn't large enough for the largest queue. The player is started, since the
+ * replies include its status, but no outputs. The web server is started on the
+ * port given with -p, which must be free.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <getopt.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "listener.h"
+#include "worker.h"
+#include "cache.h"
+#include "library.h"
+#include "player.h"
+#include "outputs.h"
+#include "httpd.h"
+
+#define QUEUE_BENCH_CONFFILE CONFDIR "/owntone.conf"
+#define QUEUE_BENCH_SQLITE_EXT PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so"
+#define QUEUE_BENCH_ITEMS_MIN 1000
+#define QUEUE_BENCH_ITEMS_MAX 100000
+#define QUEUE_BENCH_SIZES_MAX 16
+#define QUEUE_BENCH_PORT 13689
+// Number of inserts per transaction when generating the library
+#define QUEUE_BENCH_COMMIT_SIZE 1000
+#define QUEUE_BENCH_ALBUM_TRACKS 12
+
+// Normally defined in main.c, referenced by some of the modules
+struct event_base *evbase_main;
+
+// Outputs that would look for devices on the network or need audio hardware
+extern struct output_definition output_raop;
+extern struct output_definition output_airplay;
+extern struct output_definition output_fifo;
+extern struct output_definition output_rcp;
+#ifdef HAVE_ALSA
+extern struct output_definition output_alsa;
+#endif
+#ifdef HAVE_LIBPULSE
+extern struct output_definition output_pulse;
+#endif
+#ifdef CHROMECAST
+extern struct output_definition output_cast;
+#endif
+
+enum bench_kind
+{
+  BENCH_ADD_BY_QUERY,
+  BENCH_MOVE_BYPOS,
+  BENCH_DELETE_BYPOS,
+  BENCH_FETCH_BYPOSRELATIVETOITEM,
+  BENCH_RESHUFFLE,
+  BENCH_JSONAPI,
+  BENCH_DACP,
+};
+
+struct bench_case
+{
+  const char *name;
+  enum bench_kind kind;
+  const char *request;
+};
+
+// Run in this order, the adds leave a queue of the size being measured
+static struct bench_case bench_cases[] =
+{
+  { "add_by_query", BENCH_ADD_BY_QUERY, NULL },
+  { "move_bypos", BENCH_MOVE_BYPOS, NULL },
+  { "delete_bypos", BENCH_DELETE_BYPOS, NULL },
+  { "fetch_byposrelative", BENCH_FETCH_BYPOSRELATIVETOITEM, NULL },
+  { "reshuffle", BENCH_RESHUFFLE, NULL },
+  { "json_queue", BENCH_JSONAPI, "/api/queue" },
+  { "dacp_playqueue", BENCH_DACP, "/ctrl-int/1/playqueue-contents?span=50" },
+};
+
+struct bench_result
+{
+  double *ms; // Latency of each run
+  int runs;
+  int rows; // Rows written per run
+  size_t bytes;
+  long rss_kib;
+};
+
+static uint32_t bench_rand_state;
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+ms_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static long
+rss_peak_kib_get(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+// Own generator (xorshift32), so the positions are the same on all platforms
+static uint32_t
+rand_get(void)
+{
+  uint32_t x = bench_rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  bench_rand_state = x;
+
+  return x;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+
+  return (da > db) - (da < db);
+}
+
+static double
+percentile_get(double *sorted, int n, int pct)
+{
+  return sorted[(int)((n - 1) * pct / 100.0 + 0.5)];
+}
+
+static int
+sizes_parse(int *sizes, int max, char *list)
+{
+  char *ptr;
+  int n;
+
+  for (n = 0, ptr = strtok(list, ","); ptr && n < max; ptr = strtok(NULL, ","), n++)
+    {
+      sizes[n] = atoi(ptr);
+      if (sizes[n] < QUEUE_BENCH_ITEMS_MIN || sizes[n] > QUEUE_BENCH_ITEMS_MAX)
+	return -1;
+    }
+
+  return n;
+}
+
+
+/* ---------------------------- Library generation -------------------------- */
+
+static void
+track_make(struct media_file_info *mfi, int n)
+{
+  int album = n / QUEUE_BENCH_ALBUM_TRACKS;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  mfi->title = safe_asprintf("Track %d", n);
+  mfi->artist = safe_asprintf("Artist %d", album / 5);
+  mfi->album_artist = strdup(mfi->artist);
+  mfi->album = safe_asprintf("Album %d", album);
+  mfi->genre = strdup((album % 2) ? "Rock" : "Jazz");
+  mfi->year = 1960 + album % 60;
+  mfi->track = n % QUEUE_BENCH_ALBUM_TRACKS + 1;
+  mfi->total_tracks = QUEUE_BENCH_ALBUM_TRACKS;
+
+  mfi->path = safe_asprintf("/bench/%s/%s/%02d %s.mp3", mfi->artist, mfi->album, mfi->track, mfi->title);
+  mfi->virtual_path = safe_asprintf("/file:%s", mfi->path);
+  mfi->fname = strdup(strrchr(mfi->path, '/') + 1);
+  mfi->directory_id = DIR_FILE;
+
+  mfi->type = strdup("mp3");
+  mfi->codectype = strdup("mpeg");
+  mfi->description = strdup("MPEG audio file");
+  mfi->bitrate = 320;
+  mfi->samplerate = 44100;
+  mfi->bits_per_sample = 16;
+  mfi->channels = 2;
+  mfi->song_length = (120 + rand_get() % 300) * 1000;
+  mfi->file_size = (int64_t)mfi->song_length * 40;
+
+  mfi->data_kind = DATA_KIND_FILE;
+  mfi->media_kind = MEDIA_KIND_MUSIC;
+  mfi->item_kind = 2; // music
+  mfi->time_modified = time(NULL);
+  mfi->time_added = mfi->time_modified;
+}
+
+static int
+library_generate(int ntracks)
+{
+  struct media_file_info mfi;
+  bool bulk_load;
+  int n;
+  int ret;
+
+  printf("Generating library with %d tracks\n", ntracks);
+
+  bulk_load = db_bulk_load_begin();
+  db_transaction_begin();
+
+  for (n = 0; n < ntracks; n++)
+    {
+      track_make(&mfi, n);
+
+      ret = db_file_add(&mfi);
+      free_mfi(&mfi, 1);
+      if (ret < 0)
+	{
+	  fprintf(stderr, "Could not add generated track %d\n", n);
+	  db_transaction_rollback();
+	  return -1;
+	}
+
+      if ((n + 1) % QUEUE_BENCH_COMMIT_SIZE == 0)
+	{
+	  db_transaction_end();
+	  db_transaction_begin();
+	}
+    }
+
+  db_transaction_end();
+
+  if (bulk_load)
+    db_bulk_load_end();
+  else
+    db_hook_post_scan();
+
+  return 0;
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+static int
+queue_fill(int size)
+{
+  struct query_params qp;
+  int count;
+  int ret;
+
+  db_queue_clear(0);
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_ITEMS;
+  qp.idx_type = I_FIRST;
+  qp.limit = size;
+
+  ret = db_queue_add_by_query(&qp, 0, 0, -1, &count, NULL);
+  if (ret < 0 || count != size)
+    {
+      fprintf(stderr, "Could not add %d items to the queue (added %d)\n", size, count);
+      return -1;
+    }
+
+  return 0;
+}
+
+// Returns the number of bytes in the reply, which is 0 for the operations
+// that don't have one
+static ssize_t
+bench_request(struct bench_case *bc, int size)
+{
+  struct db_queue_item *qi;
+  struct evbuffer *evbuf;
+  uint32_t count;
+  char *reply;
+  ssize_t bytes;
+  int ret;
+
+  // Operations that delete items make the queue a little smaller than size
+  if (db_queue_get_count(&count) < 0 || count == 0)
+    return -1;
+
+  switch (bc->kind)
+    {
+      case BENCH_ADD_BY_QUERY:
+	return queue_fill(size);
+
+      case BENCH_MOVE_BYPOS:
+	ret = db_queue_move_bypos(rand_get() % count, rand_get() % count);
+	return (ret < 0) ? -1 : 0;
+
+      case BENCH_DELETE_BYPOS:
+	ret = db_queue_delete_bypos(rand_get() % count, 1);
+	return (ret < 0) ? -1 : 0;
+
+      case BENCH_FETCH_BYPOSRELATIVETOITEM:
+	qi = db_queue_fetch_bypos(0, 0);
+	if (!qi)
+	  return -1;
+	ret = qi->id;
+	free_queue_item(qi, 0);
+
+	qi = db_queue_fetch_byposrelativetoitem(rand_get() % count, ret, 0);
+	if (!qi)
+	  return -1;
+	free_queue_item(qi, 0);
+	return 0;
+
+      case BENCH_RESHUFFLE:
+	ret = db_queue_reshuffle(0);
+	return (ret < 0) ? -1 : 0;
+
+      case BENCH_JSONAPI:
+	reply = httpd_jsonapi_get(bc->request);
+	if (!reply)
+	  return -1;
+	bytes = strlen(reply);
+	free(reply);
+	return bytes;
+
+      case BENCH_DACP:
+	evbuf = httpd_dacp_get(bc->request);
+	if (!evbuf)
+	  return -1;
+	bytes = evbuffer_get_length(evbuf);
+	evbuffer_free(evbuf);
+	return bytes;
+    }
+
+  return -1;
+}
+
+static int
+bench_run(struct bench_result *result, struct bench_case *bc, int size, int runs)
+{
+  ssize_t bytes;
+  double start;
+  int changes;
+  int i;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  CHECK_NULL(L_MAIN, result->ms = calloc(runs, sizeof(double)));
+
+  changes = db_changes_total_get();
+
+  for (i = 0; i < runs; i++)
+    {
+      start = ms_get();
+      bytes = bench_request(bc, size);
+      result->ms[i] = ms_get() - start;
+      if (bytes < 0)
+	{
+	  fprintf(stderr, "Operation '%s' failed with queue size %d\n", bc->name, size);
+	  free(result->ms);
+	  return -1;
+	}
+    }
+
+  result->runs = runs;
+  result->rows = (db_changes_total_get() - changes) / runs;
+  result->bytes = bytes;
+  result->rss_kib = rss_peak_kib_get();
+
+  qsort(result->ms, runs, sizeof(double), compare_double);
+
+  return 0;
+}
+
+static void
+result_print(struct bench_case *bc, struct bench_result *result, int size)
+{
+  printf("%8d %-20s %9.2f %9.2f %9.2f %9.2f %9d %10zu %10ld\n",
+    size, bc->name,
+    percentile_get(result->ms, result->runs, 50),
+    percentile_get(result->ms, result->runs, 90),
+    percentile_get(result->ms, result->runs, 99),
+    result->ms[result->runs - 1],
+    result->rows, result->bytes, result->rss_kib);
+}
+
+static int
+bench_setup(const char *workdir, int port)
+{
+  cfg_t *general = cfg_getsec(cfg, "general");
+  char *path;
+
+  if (mkdir(workdir, 0755) < 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create work directory '%s': %s\n", workdir, strerror(errno));
+      return -1;
+    }
+
+  path = safe_asprintf("%s/songs3.db", workdir);
+  cfg_setstr(general, "db_path", path);
+  free(path);
+
+  path = safe_asprintf("%s/", workdir);
+  cfg_setstr(general, "cache_dir", path);
+  free(path);
+
+  cfg_setint(cfg_getsec(cfg, "library"), "port", port);
+
+  output_raop.disabled = 1;
+  output_airplay.disabled = 1;
+  output_fifo.disabled = 1;
+  output_rcp.disabled = 1;
+#ifdef HAVE_ALSA
+  output_alsa.disabled = 1;
+#endif
+#ifdef HAVE_LIBPULSE
+  output_pulse.disabled = 1;
+#endif
+#ifdef CHROMECAST
+  output_cast.disabled = 1;
+#endif
+
+  return 0;
+}
+
+static void
+usage(char *program)
+{
+  int i;
+
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>       Use <file> as the configuration file\n");
+  printf("  -w <dir>        Work directory for the database and cache (default /tmp/owntone-queue-bench)\n");
+  printf("  -n <list>       Queue sizes, e.g. 1000,10000 (%d-%d, default 1000,10000,100000)\n", QUEUE_BENCH_ITEMS_MIN, QUEUE_BENCH_ITEMS_MAX);
+  printf("  -r <number>     Runs per operation (default 20)\n");
+  printf("  -b <name,name>  Operations to run (default all)\n");
+  printf("  -p <port>       Web server port (default %d)\n", QUEUE_BENCH_PORT);
+  printf("  -s <path>       Path to the sqlite extension\n");
+  printf("  -d <number>     Log level (0-5)\n");
+  printf("\n");
+  printf("Operations:");
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    printf(" %s", bench_cases[i].name);
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_result result;
+  char *configfile = QUEUE_BENCH_CONFFILE;
+  char *sqlite_ext = QUEUE_BENCH_SQLITE_EXT;
+  char *workdir = "/tmp/owntone-queue-bench";
+  char *caselist = NULL;
+  char sizelist[] = "1000,10000,100000";
+  int sizes[QUEUE_BENCH_SIZES_MAX];
+  int nsizes;
+  int ntracks;
+  uint32_t nitems;
+  int runs = 20;
+  int port = QUEUE_BENCH_PORT;
+  int loglevel = E_LOG;
+  int option;
+  int errors = 0;
+  int ret = EXIT_FAILURE;
+  int i;
+  int j;
+
+  bench_rand_state = 0x5eed;
+  nsizes = sizes_parse(sizes, QUEUE_BENCH_SIZES_MAX, sizelist);
+
+  while ((option = getopt(argc, argv, "c:w:n:r:b:p:s:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'w':
+	    workdir = optarg;
+	    break;
+
+	  case 'n':
+	    nsizes = sizes_parse(sizes, QUEUE_BENCH_SIZES_MAX, optarg);
+	    break;
+
+	  case 'r':
+	    runs = atoi(optarg);
+	    break;
+
+	  case 'b':
+	    caselist = optarg;
+	    break;
+
+	  case 'p':
+	    port = atoi(optarg);
+	    break;
+
+	  case 's':
+	    sqlite_ext = optarg;
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (nsizes <= 0 || runs < 1 || port <= 0 || port > 65535)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0, ntracks = 0; i < nsizes; i++)
+    ntracks = MAX(ntracks, sizes[i]);
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (conffile_load(configfile) != 0)
+    {
+      fprintf(stderr, "Config file errors; please fix your config\n");
+      goto conffile_fail;
+    }
+
+  if (bench_setup(workdir, port) < 0)
+    goto setup_fail;
+
+  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
+
+  if (db_init(sqlite_ext) < 0 || db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not initialize the database\n");
+      goto db_fail;
+    }
+
+  if (worker_init() < 0)
+    goto worker_fail;
+
+  listener_init();
+
+  if (cache_init() < 0)
+    goto cache_fail;
+
+  // Doesn't scan, since library_initscan_start() isn't called
+  if (library_init() < 0)
+    goto library_fail;
+
+  db_files_get_count(&nitems, NULL, NULL);
+  if (nitems < ntracks)
+    {
+      if (nitems > 0)
+	db_purge_all();
+
+      if (library_generate(ntracks) < 0)
+	goto generate_fail;
+    }
+  else
+    printf("Using existing library with %u tracks\n", nitems);
+
+  if (player_init() < 0)
+    {
+      fprintf(stderr, "Could not start the player\n");
+      goto player_fail;
+    }
+
+  if (httpd_init("/") < 0)
+    {
+      fprintf(stderr, "Could not start the web server on port %d\n", port);
+      goto httpd_fail;
+    }
+
+  printf("%8s %-20s %9s %9s %9s %9s %9s %10s %10s\n",
+    "items", "operation", "p50_ms", "p90_ms", "p99_ms", "max_ms", "rows", "bytes", "rss_kib");
+
+  for (i = 0; i < nsizes; i++)
+    {
+      if (queue_fill(sizes[i]) < 0)
+	{
+	  errors++;
+	  continue;
+	}
+
+      for (j = 0; j < ARRAY_SIZE(bench_cases); j++)
+	{
+	  if (caselist && !strstr(caselist, bench_cases[j].name))
+	    continue;
+
+	  if (bench_run(&result, &bench_cases[j], sizes[i], runs) < 0)
+	    {
+	      errors++;
+	      continue;
+	    }
+
+	  result_print(&bench_cases[j], &result, sizes[i]);
+	  free(result.ms);
+	}
+    }
+
+  db_queue_clear(0);
+
+  ret = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  httpd_deinit();
+ httpd_fail:
+  player_deinit();
+ player_fail:
+ generate_fail:
+  library_deinit();
+ library_fail:
+  cache_deinit();
+ cache_fail:
+  listener_deinit();
+  worker_deinit();
+ worker_fail:
+  db_perthread_deinit();
+  db_deinit();
+ db_fail:
+  event_base_free(evbase_main);
+ setup_fail:
+  conffile_unload();
+ conffile_fail:
+  logger_deinit();
+
+  return ret;
+}
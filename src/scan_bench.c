@@ -0,0 +1,719 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for the file scanner. A synthetic music tree (artist/album
+ * directories with small tagged mp3 files and a playlist per album) is created
+ * on the filesystem that is to be measured, e.g. a local SSD or an NFS mount,
+ * and then the library is scanned the way the server would do it: an init scan
+ * of an empty library, a rescan with no changes, a rescan after a part of the
+ * files have been modified and a full rescan. For each scan the time is
+ * reported, together with the scan stats broken down by phase. Build with
+ * "make scan_bench", then e.g.:
+ *
+ *   ./scan_bench -c /etc/owntone.conf -r /mnt/nfs/bench -D 1000 -F 12
+ *
+ * The tree is only created again if the number of directories or files per
+ * directory changes. The database and the cache are kept in the work
+ * directory (-w), which should be on a local disk so that it doesn't get
+ * measured together with the tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <getopt.h>
+#include <event2/event.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "listener.h"
+#include "worker.h"
+#include "cache.h"
+#include "library.h"
+
+#define SCAN_BENCH_CONFFILE CONFDIR "/owntone.conf"
+#define SCAN_BENCH_SQLITE_EXT PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so"
+#define SCAN_BENCH_DIRS_MAX 100000
+#define SCAN_BENCH_FILES_MAX 100
+// Number of album directories per artist directory
+#define SCAN_BENCH_ARTIST_ALBUMS 5
+// Number of mp3 frames in each file, about 0.26 sec of audio
+#define SCAN_BENCH_MP3_FRAMES 10
+// MPEG-1 Layer III, 128 kbps, 44.1 kHz, no padding
+#define SCAN_BENCH_MP3_FRAME_SIZE 417
+// Written in the root of the tree when it is complete, with its dimensions
+#define SCAN_BENCH_MARKER ".scan_bench"
+
+// Normally defined in main.c, referenced by some of the modules
+struct event_base *evbase_main;
+
+// Sources other than the file scanner that would need the network
+extern struct library_source rssscanner;
+#ifdef SPOTIFY
+extern struct library_source spotifyscanner;
+#endif
+
+enum bench_kind
+{
+  // Init scan of an empty library, which is a bulk load
+  BENCH_INITSCAN,
+  // Rescan with nothing changed on disk
+  BENCH_RESCAN,
+  // Rescan after modifying some of the files
+  BENCH_RESCAN_CHANGES,
+  // Library purged and scanned again
+  BENCH_FULLRESCAN,
+};
+
+struct bench_case
+{
+  const char *name;
+  enum bench_kind kind;
+};
+
+static struct bench_case bench_cases[] =
+{
+  { "bulk_scan", BENCH_INITSCAN },
+  { "rescan_unchanged", BENCH_RESCAN },
+  { "rescan_changes", BENCH_RESCAN_CHANGES },
+  { "fullrescan", BENCH_FULLRESCAN },
+};
+
+struct bench_tree
+{
+  const char *root;
+  int ndirs;
+  int nfiles; // Per directory
+  int modified; // Number of times tree_modify() was called
+};
+
+struct bench_result
+{
+  double wall_ms;
+  int changed;
+  uint32_t nitems;
+  struct library_scan_stats stats;
+};
+
+static const char *scan_phase_names[LIBRARY_SCAN_PHASE_MAX] =
+{
+  "walk_s", "stat_s", "meta_s", "save_s", "pl_s", "purge_s",
+};
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+ms_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long
+rss_peak_kib_get(void)
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+
+  return usage.ru_maxrss;
+}
+
+static int
+mkdir_make(const char *path)
+{
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Could not create directory '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/* ------------------------------- Tree creation ---------------------------- */
+
+static void
+artist_path_make(char *path, size_t len, struct bench_tree *tree, int dir)
+{
+  snprintf(path, len, "%s/Artist %05d", tree->root, dir / SCAN_BENCH_ARTIST_ALBUMS);
+}
+
+static void
+album_path_make(char *path, size_t len, struct bench_tree *tree, int dir)
+{
+  snprintf(path, len, "%s/Artist %05d/Album %06d", tree->root, dir / SCAN_BENCH_ARTIST_ALBUMS, dir);
+}
+
+static void
+track_name_make(char *name, size_t len, int track)
+{
+  snprintf(name, len, "%02d Track %02d.mp3", track + 1, track + 1);
+}
+
+static size_t
+id3_frame_add(uint8_t *buf, const char *id, const char *value)
+{
+  size_t len = strlen(value) + 1; // Encoding byte + text
+
+  memcpy(buf, id, 4);
+  buf[4] = (len >> 24) & 0xff;
+  buf[5] = (len >> 16) & 0xff;
+  buf[6] = (len >> 8) & 0xff;
+  buf[7] = len & 0xff;
+  buf[8] = 0; // Flags
+  buf[9] = 0;
+  buf[10] = 0; // ISO-8859-1
+  memcpy(buf + 11, value, len - 1);
+
+  return 10 + len;
+}
+
+// Writes a file with an ID3v2.3 tag and a few frames of silence, which is
+// enough for ffmpeg to find the tags, the codec and a duration
+static int
+mp3_write(const char *path, struct bench_tree *tree, int dir, int track)
+{
+  uint8_t buf[1024 + SCAN_BENCH_MP3_FRAMES * SCAN_BENCH_MP3_FRAME_SIZE];
+  char value[128];
+  size_t tag_len;
+  size_t len;
+  uint8_t *frame;
+  int fd;
+  int i;
+
+  memset(buf, 0, sizeof(buf));
+
+  len = 10;
+  snprintf(value, sizeof(value), "Track %02d of album %d%s", track + 1, dir, tree->modified ? " (modified)" : "");
+  len += id3_frame_add(buf + len, "TIT2", value);
+  snprintf(value, sizeof(value), "Artist %d", dir / SCAN_BENCH_ARTIST_ALBUMS);
+  len += id3_frame_add(buf + len, "TPE1", value);
+  snprintf(value, sizeof(value), "Album %d", dir);
+  len += id3_frame_add(buf + len, "TALB", value);
+  snprintf(value, sizeof(value), "%d/%d", track + 1, tree->nfiles);
+  len += id3_frame_add(buf + len, "TRCK", value);
+  snprintf(value, sizeof(value), "%d", 1960 + dir % 60);
+  len += id3_frame_add(buf + len, "TYER", value);
+  len += id3_frame_add(buf + len, "TCON", (dir % 2) ? "Rock" : "Jazz");
+
+  // Tag header, the size is syncsafe and excludes the header
+  tag_len = len - 10;
+  memcpy(buf, "ID3", 3);
+  buf[3] = 3;
+  buf[4] = 0;
+  buf[5] = 0;
+  buf[6] = (tag_len >> 21) & 0x7f;
+  buf[7] = (tag_len >> 14) & 0x7f;
+  buf[8] = (tag_len >> 7) & 0x7f;
+  buf[9] = tag_len & 0x7f;
+
+  // Frames with an all-zero side info, which decode to silence
+  for (i = 0; i < SCAN_BENCH_MP3_FRAMES; i++)
+    {
+      frame = buf + len;
+      frame[0] = 0xff;
+      frame[1] = 0xfb;
+      frame[2] = 0x90;
+      frame[3] = 0x00;
+      len += SCAN_BENCH_MP3_FRAME_SIZE;
+    }
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Could not create '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  if (write(fd, buf, len) != (ssize_t)len)
+    {
+      fprintf(stderr, "Could not write '%s': %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+  close(fd);
+  return 0;
+}
+
+static int
+playlist_write(const char *path, struct bench_tree *tree)
+{
+  char name[64];
+  FILE *fp;
+  int i;
+
+  fp = fopen(path, "w");
+  if (!fp)
+    {
+      fprintf(stderr, "Could not create '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  fprintf(fp, "#EXTM3U\n");
+  for (i = 0; i < tree->nfiles; i++)
+    {
+      track_name_make(name, sizeof(name), i);
+      fprintf(fp, "%s\n", name);
+    }
+
+  fclose(fp);
+  return 0;
+}
+
+static bool
+tree_exists(struct bench_tree *tree)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  int ndirs;
+  int nfiles;
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/%s", tree->root, SCAN_BENCH_MARKER);
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return false;
+
+  ret = fscanf(fp, "%d %d", &ndirs, &nfiles);
+  fclose(fp);
+
+  return (ret == 2 && ndirs == tree->ndirs && nfiles == tree->nfiles);
+}
+
+static int
+tree_create(struct bench_tree *tree)
+{
+  char path[PATH_MAX];
+  char name[64];
+  FILE *fp;
+  double start;
+  int dir;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s", tree->root, SCAN_BENCH_MARKER);
+  unlink(path);
+
+  if (mkdir_make(tree->root) < 0)
+    return -1;
+
+  printf("Creating tree with %d directories of %d files in '%s'\n", tree->ndirs, tree->nfiles, tree->root);
+  start = ms_get();
+
+  for (dir = 0; dir < tree->ndirs; dir++)
+    {
+      artist_path_make(path, sizeof(path), tree, dir);
+      if (mkdir_make(path) < 0)
+	return -1;
+
+      album_path_make(path, sizeof(path), tree, dir);
+      if (mkdir_make(path) < 0)
+	return -1;
+
+      for (i = 0; i < tree->nfiles; i++)
+	{
+	  album_path_make(path, sizeof(path), tree, dir);
+	  track_name_make(name, sizeof(name), i);
+	  strncat(path, "/", sizeof(path) - strlen(path) - 1);
+	  strncat(path, name, sizeof(path) - strlen(path) - 1);
+	  if (mp3_write(path, tree, dir, i) < 0)
+	    return -1;
+	}
+
+      album_path_make(path, sizeof(path), tree, dir);
+      strncat(path, "/album.m3u", sizeof(path) - strlen(path) - 1);
+      if (playlist_write(path, tree) < 0)
+	return -1;
+    }
+
+  // Files created in the same second as the first scan would be seen as
+  // possibly changed by later scans, which isn't what is to be measured
+  sleep(1);
+
+  snprintf(path, sizeof(path), "%s/%s", tree->root, SCAN_BENCH_MARKER);
+  fp = fopen(path, "w");
+  if (!fp)
+    {
+      fprintf(stderr, "Could not create '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  fprintf(fp, "%d %d\n", tree->ndirs, tree->nfiles);
+  fclose(fp);
+
+  printf("Created %d files in %.1f sec\n", tree->ndirs * tree->nfiles, (ms_get() - start) / 1000.0);
+  return 0;
+}
+
+// Rewrites the tags of every n'th file, spread over the tree so that the
+// changes are in as many directories as possible. The mtime is set ahead, so
+// that it differs from what the last scan saved even if that scan was in the
+// same second. Returns the number of files modified.
+static int
+tree_modify(struct bench_tree *tree, double pct)
+{
+  struct timespec times[2];
+  char path[PATH_MAX];
+  char name[64];
+  int total;
+  int step;
+  int changed;
+  int n;
+
+  total = tree->ndirs * tree->nfiles;
+  step = (pct > 0) ? (int)(100.0 / pct) : total + 1;
+  if (step < 1)
+    step = 1;
+
+  tree->modified++;
+
+  times[0].tv_sec = times[1].tv_sec = time(NULL) + tree->modified;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+
+  // Offset by the number of modifications, so a new set of files is chosen
+  // when the case is run again
+  for (n = tree->modified - 1, changed = 0; n < total; n += step)
+    {
+      album_path_make(path, sizeof(path), tree, n % tree->ndirs);
+      track_name_make(name, sizeof(name), (n / tree->ndirs) % tree->nfiles);
+      strncat(path, "/", sizeof(path) - strlen(path) - 1);
+      strncat(path, name, sizeof(path) - strlen(path) - 1);
+
+      if (mp3_write(path, tree, n % tree->ndirs, (n / tree->ndirs) % tree->nfiles) < 0)
+	return -1;
+
+      if (utimensat(AT_FDCWD, path, times, 0) < 0)
+	{
+	  fprintf(stderr, "Could not set mtime of '%s': %s\n", path, strerror(errno));
+	  return -1;
+	}
+
+      changed++;
+    }
+
+  return changed;
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+// The library is started for each scan and stopped again afterwards, so that
+// the changes made by tree_modify() aren't picked up by inotify before the
+// rescan, and so that each scan starts with the same state
+static int
+bench_run(struct bench_result *result, struct bench_case *bc, struct bench_tree *tree, double pct)
+{
+  double start;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  // library_fullrescan() would also stop the player and clear the queue, which
+  // isn't running here, so it is done like the init scan after a purge
+  if (bc->kind == BENCH_INITSCAN || bc->kind == BENCH_FULLRESCAN)
+    db_purge_all();
+
+  if (bc->kind == BENCH_RESCAN_CHANGES)
+    {
+      result->changed = tree_modify(tree, pct);
+      if (result->changed < 0)
+	return -1;
+    }
+
+  if (library_init() < 0)
+    {
+      fprintf(stderr, "Could not start the library\n");
+      return -1;
+    }
+
+  start = ms_get();
+
+  // library_init() marks the library as scanning until the init scan has run
+  if (bc->kind == BENCH_INITSCAN || bc->kind == BENCH_FULLRESCAN)
+    library_initscan_start();
+  else
+    {
+      library_set_scanning(false);
+      library_rescan(SCAN_KIND_FILES);
+    }
+
+  while (library_is_scanning())
+    usleep(10000);
+
+  result->wall_ms = ms_get() - start;
+
+  library_scan_stats_get(&result->stats);
+  db_files_get_count(&result->nitems, NULL, NULL);
+
+  library_deinit();
+
+  return 0;
+}
+
+static void
+result_print(struct bench_case *bc, struct bench_result *result)
+{
+  struct library_scan_stats *stats = &result->stats;
+  int i;
+
+  printf("%-16s %8.2f %8u %8u %8u %8d %8u",
+    bc->name, result->wall_ms / 1000.0, stats->dirs, stats->files, stats->files_scanned, result->changed, result->nitems);
+
+  for (i = 0; i < LIBRARY_SCAN_PHASE_MAX; i++)
+    printf(" %8.2f", stats->phase_usec[i] / 1000000.0);
+
+  printf(" %10ld\n", rss_peak_kib_get());
+
+  if (stats->nslowest > 0)
+    printf("%-16s slowest file %.1f ms: %s\n", "", stats->slowest[0].usec / 1000.0, stats->slowest[0].path);
+}
+
+static int
+bench_setup(const char *workdir, const char *root, int workers)
+{
+  cfg_t *general = cfg_getsec(cfg, "general");
+  cfg_t *lib = cfg_getsec(cfg, "library");
+  char *path;
+
+  if (mkdir_make(workdir) < 0)
+    return -1;
+
+  path = safe_asprintf("%s/songs3.db", workdir);
+  cfg_setstr(general, "db_path", path);
+  free(path);
+
+  path = safe_asprintf("%s/", workdir);
+  cfg_setstr(general, "cache_dir", path);
+  free(path);
+
+  cfg_setlist(lib, "directories", 1, root);
+  cfg_setbool(lib, "filescan_disable", cfg_false);
+
+  if (workers > 0)
+    cfg_setint(lib, "scan_workers", workers);
+
+  rssscanner.disabled = 1;
+#ifdef SPOTIFY
+  spotifyscanner.disabled = 1;
+#endif
+
+  return 0;
+}
+
+static void
+usage(char *program)
+{
+  int i;
+
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>       Use <file> as the configuration file\n");
+  printf("  -r <dir>        Directory for the music tree, on the filesystem to measure (default /tmp/owntone-scan)\n");
+  printf("  -w <dir>        Work directory for the database and cache (default /tmp/owntone-bench)\n");
+  printf("  -D <number>     Number of album directories (1-%d, default 1000)\n", SCAN_BENCH_DIRS_MAX);
+  printf("  -F <number>     Files per album directory (1-%d, default 12)\n", SCAN_BENCH_FILES_MAX);
+  printf("  -m <percent>    Files modified for rescan_changes (default 1)\n");
+  printf("  -j <number>     Metadata workers, overrides scan_workers from the config\n");
+  printf("  -b <name,name>  Scans to run (default all)\n");
+  printf("  -s <path>       Path to the sqlite extension\n");
+  printf("  -d <number>     Log level (0-5)\n");
+  printf("\n");
+  printf("Scans:");
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    printf(" %s", bench_cases[i].name);
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_result result;
+  struct bench_tree tree;
+  char *configfile = SCAN_BENCH_CONFFILE;
+  char *sqlite_ext = SCAN_BENCH_SQLITE_EXT;
+  char *workdir = "/tmp/owntone-bench";
+  char *caselist = NULL;
+  double pct = 1.0;
+  int workers = 0;
+  int loglevel = E_LOG;
+  int option;
+  int errors = 0;
+  int ret = EXIT_FAILURE;
+  int i;
+
+  memset(&tree, 0, sizeof(struct bench_tree));
+  tree.root = "/tmp/owntone-scan";
+  tree.ndirs = 1000;
+  tree.nfiles = 12;
+
+  while ((option = getopt(argc, argv, "c:r:w:D:F:m:j:b:s:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'r':
+	    tree.root = optarg;
+	    break;
+
+	  case 'w':
+	    workdir = optarg;
+	    break;
+
+	  case 'D':
+	    tree.ndirs = atoi(optarg);
+	    break;
+
+	  case 'F':
+	    tree.nfiles = atoi(optarg);
+	    break;
+
+	  case 'm':
+	    pct = atof(optarg);
+	    break;
+
+	  case 'j':
+	    workers = atoi(optarg);
+	    break;
+
+	  case 'b':
+	    caselist = optarg;
+	    break;
+
+	  case 's':
+	    sqlite_ext = optarg;
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (tree.ndirs < 1 || tree.ndirs > SCAN_BENCH_DIRS_MAX || tree.nfiles < 1 || tree.nfiles > SCAN_BENCH_FILES_MAX || pct < 0 || pct > 100 || workers < 0)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (conffile_load(configfile) != 0)
+    {
+      fprintf(stderr, "Config file errors; please fix your config\n");
+      goto conffile_fail;
+    }
+
+  if (bench_setup(workdir, tree.root, workers) < 0)
+    goto setup_fail;
+
+  if (!tree_exists(&tree))
+    {
+      if (tree_create(&tree) < 0)
+	goto setup_fail;
+    }
+  else
+    printf("Using existing tree with %d directories of %d files in '%s'\n", tree.ndirs, tree.nfiles, tree.root);
+
+  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
+
+  if (db_init(sqlite_ext) < 0 || db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not initialize the database\n");
+      goto db_fail;
+    }
+
+  if (worker_init() < 0)
+    goto worker_fail;
+
+  listener_init();
+
+  if (cache_init() < 0)
+    goto cache_fail;
+
+  printf("%-16s %8s %8s %8s %8s %8s %8s", "scan", "wall_s", "dirs", "files", "scanned", "changed", "items");
+  for (i = 0; i < LIBRARY_SCAN_PHASE_MAX; i++)
+    printf(" %8s", scan_phase_names[i]);
+  printf(" %10s\n", "rss_kib");
+
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    {
+      if (caselist && !strstr(caselist, bench_cases[i].name))
+	continue;
+
+      if (bench_run(&result, &bench_cases[i], &tree, pct) < 0)
+	{
+	  errors++;
+	  continue;
+	}
+
+      result_print(&bench_cases[i], &result);
+    }
+
+  ret = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  cache_deinit();
+ cache_fail:
+  listener_deinit();
+  worker_deinit();
+ worker_fail:
+  db_perthread_deinit();
+  db_deinit();
+ db_fail:
+  event_base_free(evbase_main);
+ setup_fail:
+  conffile_unload();
+ conffile_fail:
+  logger_deinit();
+
+  return ret;
+}
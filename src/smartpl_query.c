@@ -86,10 +86,39 @@ smartpl_query_parse_file(struct smartpl *smartpl, const char *file)
   return -1;
 }
 
+static void *
+smartpl_dup(const void *value)
+{
+  const struct smartpl *in = value;
+  struct smartpl *out;
+
+  out = calloc(1, sizeof(struct smartpl));
+  if (!out)
+    return NULL;
+
+  out->title = safe_strdup(in->title);
+  out->query_where = safe_strdup(in->query_where);
+  out->having = safe_strdup(in->having);
+  out->order = safe_strdup(in->order);
+  out->limit = in->limit;
+
+  return out;
+}
+
+static void
+smartpl_free(void *value)
+{
+  free_smartpl(value, 0);
+}
+
+// Parsed expressions, since the JSON API gets the same searches repeatedly
+static struct lru_cache smartpl_cache = LRU_CACHE_INITIALIZER(smartpl_dup, smartpl_free);
+
 int
 smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
 {
   struct smartpl_result result;
+  struct smartpl *cached;
 
   if (!expression)
     {
@@ -97,6 +126,15 @@ smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
       return -1;
     }
 
+  cached = lru_cache_get(&smartpl_cache, expression);
+  if (cached)
+    {
+      free_smartpl(smartpl, 1);
+      *smartpl = *cached;
+      free(cached);
+      return 0;
+    }
+
   DPRINTF(E_SPAM, L_SCAN, "Parse smartpl query input '%s'\n", expression);
 
   if (smartpl_lex_parse(&result, expression) != 0)
@@ -128,6 +166,8 @@ smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
   DPRINTF(E_SPAM, L_SCAN, "Parse smartpl query output '%s': WHERE %s HAVING %s ORDER BY %s LIMIT %d\n",
     smartpl->title, smartpl->query_where, smartpl->having, smartpl->order, smartpl->limit);
 
+  lru_cache_add(&smartpl_cache, expression, smartpl);
+
   return 0;
 }
 
@@ -0,0 +1,783 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Load generator for a running server: opens a number of HTTP streaming
+ * sessions (/stream.mp3) and a number of websocket clients subscribed to
+ * volume notifications. While running, it changes the volume through the JSON
+ * API at a fixed interval, and measures how long it takes for each websocket
+ * client to be notified. For the streams it measures the bitrate and the
+ * longest gap between two reads. Clients that the server disconnects are
+ * counted as dropped. If the pid of the server is given (and it runs on the
+ * same host) its CPU usage and memory are also reported. Build with
+ * "make stream_load", then e.g.:
+ *
+ *   ./stream_load -a 192.168.1.10 -s 50 -m 200 -t 60
+ *
+ * Note that the volume of the server is changed, and it is left at what it
+ * was at the last change.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <getopt.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "logger.h"
+#include "misc.h"
+
+#define STREAM_LOAD_WEB_PORT 3689
+#define STREAM_LOAD_WEBSOCKET_PORT 3688
+// A stream read gap longer than this means the client would have had a dropout
+// with the buffering of a typical player
+#define STREAM_LOAD_STALL_MS 2000
+
+enum client_kind
+{
+  CLIENT_STREAM,
+  CLIENT_WEBSOCKET,
+};
+
+struct load_ctx;
+
+struct load_client
+{
+  struct load_ctx *ctx;
+  enum client_kind kind;
+  int id;
+  struct bufferevent *bev;
+
+  bool connected; // Got the HTTP reply (200 or 101)
+  bool dropped;
+
+  // Stream clients
+  uint64_t bytes;
+  double first_ms;
+  double last_ms;
+  double max_gap_ms;
+
+  // Websocket clients, the trigger the last notification was counted for
+  int trigger_seen;
+  int notifications;
+};
+
+struct load_ctx
+{
+  struct event_base *evbase;
+  struct event *trigger_ev;
+  struct event *stop_ev;
+
+  const char *addr;
+  unsigned short web_port;
+  unsigned short ws_port;
+  const char *stream_path;
+
+  struct load_client *clients;
+  int nclients;
+
+  // Number of volume changes and when the last was requested
+  int trigger_seq;
+  double trigger_ms;
+
+  double *latencies_ms;
+  int nlatencies;
+  int latencies_size;
+
+  double start_ms;
+};
+
+struct proc_stats
+{
+  double cpu_sec;
+  long rss_kib;
+  long hwm_kib;
+};
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+ms_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+
+  return (da > db) - (da < db);
+}
+
+static double
+percentile_get(double *sorted, int n, int pct)
+{
+  return sorted[(int)((n - 1) * pct / 100.0 + 0.5)];
+}
+
+static void
+latency_add(struct load_ctx *ctx, double ms)
+{
+  if (ctx->nlatencies == ctx->latencies_size)
+    {
+      ctx->latencies_size = ctx->latencies_size ? 2 * ctx->latencies_size : 1024;
+      CHECK_NULL(L_MAIN, ctx->latencies_ms = realloc(ctx->latencies_ms, ctx->latencies_size * sizeof(double)));
+    }
+
+  ctx->latencies_ms[ctx->nlatencies++] = ms;
+}
+
+// Blocking connect, the socket is made non-blocking by the bufferevent
+static int
+tcp_connect(const char *addr, unsigned short port)
+{
+  struct addrinfo hints = { 0 };
+  struct addrinfo *servinfo;
+  struct addrinfo *ptr;
+  char strport[8];
+  int fd = -1;
+  int ret;
+
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_family = AF_UNSPEC;
+
+  snprintf(strport, sizeof(strport), "%hu", port);
+  ret = getaddrinfo(addr, strport, &hints, &servinfo);
+  if (ret != 0)
+    {
+      fprintf(stderr, "Could not resolve '%s': %s\n", addr, gai_strerror(ret));
+      return -1;
+    }
+
+  for (ptr = servinfo; ptr; ptr = ptr->ai_next)
+    {
+      fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+      if (fd < 0)
+	continue;
+
+      if (connect(fd, ptr->ai_addr, ptr->ai_addrlen) == 0)
+	break;
+
+      close(fd);
+      fd = -1;
+    }
+
+  freeaddrinfo(servinfo);
+
+  if (fd < 0)
+    fprintf(stderr, "Could not connect to %s port %hu: %s\n", addr, port, strerror(errno));
+
+  return fd;
+}
+
+// Returns 0 and the parsed status if the input has a complete HTTP reply head,
+// which is then drained. Returns 1 if more data is needed.
+static int
+http_head_read(int *status, struct evbuffer *input)
+{
+  struct evbuffer_ptr end;
+  char line[64];
+  size_t len;
+
+  end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+  if (end.pos < 0)
+    return 1;
+
+  len = MIN(end.pos, sizeof(line) - 1);
+  evbuffer_copyout(input, line, len);
+  line[len] = '\0';
+
+  evbuffer_drain(input, end.pos + 4);
+
+  if (sscanf(line, "HTTP/%*d.%*d %d", status) != 1)
+    *status = -1;
+
+  return 0;
+}
+
+static int
+proc_stats_get(struct proc_stats *stats, pid_t pid)
+{
+  unsigned long utime;
+  unsigned long stime;
+  char path[64];
+  char line[256];
+  char *ptr;
+  FILE *fp;
+
+  memset(stats, 0, sizeof(struct proc_stats));
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  // The process name can have spaces, so skip past it before scanning
+  ptr = fgets(line, sizeof(line), fp) ? strrchr(line, ')') : NULL;
+  fclose(fp);
+  if (!ptr || sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+
+  stats->cpu_sec = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      if (strncmp(line, "VmRSS:", 6) == 0)
+	stats->rss_kib = atol(line + 6);
+      else if (strncmp(line, "VmHWM:", 6) == 0)
+	stats->hwm_kib = atol(line + 6);
+    }
+
+  fclose(fp);
+  return 0;
+}
+
+
+/* -------------------------------- Websocket ------------------------------- */
+
+// Sends a masked text frame, which is required from clients. Only short
+// payloads are supported.
+static void
+ws_text_send(struct bufferevent *bev, const char *text)
+{
+  uint8_t hdr[2 + 4];
+  uint8_t *payload;
+  size_t len = strlen(text);
+  size_t i;
+
+  hdr[0] = 0x81; // FIN + text
+  hdr[1] = 0x80 | len;
+  for (i = 0; i < 4; i++)
+    hdr[2 + i] = random() & 0xff;
+
+  CHECK_NULL(L_MAIN, payload = malloc(len));
+  for (i = 0; i < len; i++)
+    payload[i] = text[i] ^ hdr[2 + (i % 4)];
+
+  bufferevent_write(bev, hdr, sizeof(hdr));
+  bufferevent_write(bev, payload, len);
+
+  free(payload);
+}
+
+static void
+ws_handshake_send(struct bufferevent *bev, const char *addr)
+{
+  uint8_t nonce[16];
+  char *key;
+  int i;
+
+  for (i = 0; i < sizeof(nonce); i++)
+    nonce[i] = random() & 0xff;
+
+  CHECK_NULL(L_MAIN, key = b64_encode(nonce, sizeof(nonce)));
+
+  evbuffer_add_printf(bufferevent_get_output(bev),
+    "GET / HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: %s\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Sec-WebSocket-Protocol: notify\r\n"
+    "\r\n", addr, key);
+
+  free(key);
+}
+
+// Handles the complete frames in the input, the server doesn't mask them
+static void
+ws_frames_read(struct load_ctx *ctx, struct load_client *client, struct evbuffer *input)
+{
+  uint8_t hdr[10];
+  uint64_t len;
+  size_t hdrlen;
+  size_t avail;
+  char *payload;
+  int opcode;
+  int i;
+
+  while ((avail = evbuffer_get_length(input)) >= 2)
+    {
+      evbuffer_copyout(input, hdr, MIN(avail, sizeof(hdr)));
+
+      opcode = hdr[0] & 0x0f;
+      len = hdr[1] & 0x7f;
+      hdrlen = 2;
+      if (len == 126)
+	hdrlen = 4;
+      else if (len == 127)
+	hdrlen = 10;
+
+      if (avail < hdrlen)
+	return;
+
+      if (hdrlen == 4)
+	len = (hdr[2] << 8) | hdr[3];
+      else if (hdrlen == 10)
+	for (len = 0, i = 2; i < 10; i++)
+	  len = (len << 8) | hdr[i];
+
+      if (avail < hdrlen + len)
+	return;
+
+      evbuffer_drain(input, hdrlen);
+
+      if (opcode == 0x8) // Close
+	{
+	  client->dropped = true;
+	  evbuffer_drain(input, len);
+	  return;
+	}
+
+      if (opcode != 0x1) // We only care about text, no pings expected
+	{
+	  evbuffer_drain(input, len);
+	  continue;
+	}
+
+      CHECK_NULL(L_MAIN, payload = malloc(len + 1));
+      evbuffer_remove(input, payload, len);
+      payload[len] = '\0';
+
+      if (strstr(payload, "\"volume\"") && client->trigger_seen != ctx->trigger_seq && ctx->trigger_seq > 0)
+	{
+	  latency_add(ctx, ms_get() - ctx->trigger_ms);
+	  client->trigger_seen = ctx->trigger_seq;
+	  client->notifications++;
+	}
+
+      free(payload);
+    }
+}
+
+
+/* -------------------------------- Callbacks ------------------------------- */
+
+static void
+client_read_cb(struct bufferevent *bev, void *arg)
+{
+  struct load_client *client = arg;
+  struct load_ctx *ctx = client->ctx;
+  struct evbuffer *input = bufferevent_get_input(bev);
+  double now;
+  int status;
+
+  if (!client->connected)
+    {
+      if (http_head_read(&status, input) != 0)
+	return;
+
+      if ((client->kind == CLIENT_STREAM && status != 200) || (client->kind == CLIENT_WEBSOCKET && status != 101))
+	{
+	  fprintf(stderr, "Client %d got unexpected HTTP status %d\n", client->id, status);
+	  client->dropped = true;
+	  bufferevent_disable(bev, EV_READ);
+	  return;
+	}
+
+      client->connected = true;
+      if (client->kind == CLIENT_WEBSOCKET)
+	ws_text_send(bev, "{ \"notify\": [ \"volume\" ] }");
+    }
+
+  if (client->kind == CLIENT_WEBSOCKET)
+    {
+      ws_frames_read(ctx, client, input);
+      return;
+    }
+
+  now = ms_get();
+  if (client->bytes == 0)
+    client->first_ms = now;
+  else if (now - client->last_ms > client->max_gap_ms)
+    client->max_gap_ms = now - client->last_ms;
+
+  client->last_ms = now;
+  client->bytes += evbuffer_get_length(input);
+  evbuffer_drain(input, -1);
+}
+
+static void
+client_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+  struct load_client *client = arg;
+
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    {
+      client->dropped = true;
+      bufferevent_disable(bev, EV_READ | EV_WRITE);
+    }
+}
+
+// The trigger connection is closed by the server after the reply
+static void
+trigger_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    bufferevent_free(bev);
+}
+
+static void
+trigger_read_cb(struct bufferevent *bev, void *arg)
+{
+  evbuffer_drain(bufferevent_get_input(bev), -1);
+}
+
+static void
+trigger_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct load_ctx *ctx = arg;
+  struct bufferevent *bev;
+  int sock;
+
+  sock = tcp_connect(ctx->addr, ctx->web_port);
+  if (sock < 0)
+    return;
+
+  CHECK_NULL(L_MAIN, bev = bufferevent_socket_new(ctx->evbase, sock, BEV_OPT_CLOSE_ON_FREE));
+  bufferevent_setcb(bev, trigger_read_cb, NULL, trigger_event_cb, NULL);
+  bufferevent_enable(bev, EV_READ);
+
+  ctx->trigger_seq++;
+  ctx->trigger_ms = ms_get();
+
+  // Alternates between two volumes, so that each request is a change
+  evbuffer_add_printf(bufferevent_get_output(bev),
+    "PUT /api/player/volume?volume=%d HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n", 40 + (ctx->trigger_seq % 2), ctx->addr);
+}
+
+static void
+stop_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct load_ctx *ctx = arg;
+
+  event_base_loopbreak(ctx->evbase);
+}
+
+
+/* --------------------------------- Clients -------------------------------- */
+
+static int
+client_start(struct load_ctx *ctx, struct load_client *client)
+{
+  int sock;
+
+  sock = tcp_connect(ctx->addr, (client->kind == CLIENT_STREAM) ? ctx->web_port : ctx->ws_port);
+  if (sock < 0)
+    return -1;
+
+  CHECK_NULL(L_MAIN, client->bev = bufferevent_socket_new(ctx->evbase, sock, BEV_OPT_CLOSE_ON_FREE));
+  bufferevent_setcb(client->bev, client_read_cb, NULL, client_event_cb, client);
+  bufferevent_enable(client->bev, EV_READ);
+
+  if (client->kind == CLIENT_WEBSOCKET)
+    {
+      ws_handshake_send(client->bev, ctx->addr);
+      return 0;
+    }
+
+  evbuffer_add_printf(bufferevent_get_output(client->bev),
+    "GET %s HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: stream_load\r\n"
+    "\r\n", ctx->stream_path, ctx->addr);
+
+  return 0;
+}
+
+static void
+results_print(struct load_ctx *ctx, int nstreams, int nws, double duration_sec)
+{
+  struct load_client *client;
+  double kbps;
+  double min_kbps = -1;
+  double sum_kbps = 0;
+  double max_gap_ms = 0;
+  int stream_ok = 0;
+  int stream_dropped = 0;
+  int stream_stalled = 0;
+  int ws_ok = 0;
+  int ws_dropped = 0;
+  int i;
+
+  for (i = 0; i < ctx->nclients; i++)
+    {
+      client = &ctx->clients[i];
+
+      if (client->kind == CLIENT_WEBSOCKET)
+	{
+	  if (client->dropped || !client->connected)
+	    ws_dropped++;
+	  else
+	    ws_ok++;
+	  continue;
+	}
+
+      if (client->dropped || !client->connected)
+	{
+	  stream_dropped++;
+	  continue;
+	}
+
+      stream_ok++;
+
+      // From the first data, so the time to connect isn't included
+      kbps = (client->last_ms > client->first_ms) ? client->bytes * 8 / (client->last_ms - client->first_ms) : 0;
+      sum_kbps += kbps;
+      if (min_kbps < 0 || kbps < min_kbps)
+	min_kbps = kbps;
+      if (client->max_gap_ms > max_gap_ms)
+	max_gap_ms = client->max_gap_ms;
+      if (client->max_gap_ms > STREAM_LOAD_STALL_MS)
+	stream_stalled++;
+    }
+
+  printf("Ran for %.1f seconds\n\n", duration_sec);
+
+  if (nstreams > 0)
+    {
+      printf("Streams:    %d ok, %d dropped, %d stalled (gap over %d ms)\n", stream_ok, stream_dropped, stream_stalled, STREAM_LOAD_STALL_MS);
+      if (stream_ok > 0)
+	printf("            avg %.1f kbit/s, min %.1f kbit/s, max gap %.0f ms\n", sum_kbps / stream_ok, min_kbps, max_gap_ms);
+    }
+
+  if (nws > 0)
+    {
+      printf("Websockets: %d ok, %d dropped\n", ws_ok, ws_dropped);
+      printf("            %d volume changes, %d of %d notifications received\n",
+	ctx->trigger_seq, ctx->nlatencies, ctx->trigger_seq * nws);
+
+      if (ctx->nlatencies > 0)
+	{
+	  qsort(ctx->latencies_ms, ctx->nlatencies, sizeof(double), compare_double);
+	  printf("            latency p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+	    percentile_get(ctx->latencies_ms, ctx->nlatencies, 50),
+	    percentile_get(ctx->latencies_ms, ctx->nlatencies, 90),
+	    percentile_get(ctx->latencies_ms, ctx->nlatencies, 99),
+	    ctx->latencies_ms[ctx->nlatencies - 1]);
+	}
+    }
+}
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -a <address>    Address of the server (default localhost)\n");
+  printf("  -p <port>       Web server port (default %d)\n", STREAM_LOAD_WEB_PORT);
+  printf("  -w <port>       Websocket port (default %d)\n", STREAM_LOAD_WEBSOCKET_PORT);
+  printf("  -s <number>     Number of streaming clients (default 10)\n");
+  printf("  -m <number>     Number of websocket clients (default 10)\n");
+  printf("  -u <path>       Stream path (default /stream.mp3)\n");
+  printf("  -t <seconds>    Duration of the test (default 30)\n");
+  printf("  -i <ms>         Interval between volume changes (default 1000)\n");
+  printf("  -P <pid>        Pid of the server, to report its CPU and memory use\n");
+  printf("  -d <number>     Log level (0-5)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct load_ctx ctx = { 0 };
+  struct proc_stats proc_start;
+  struct proc_stats proc_end;
+  struct timeval tv;
+  double duration_sec;
+  pid_t pid = 0;
+  int nstreams = 10;
+  int nws = 10;
+  int seconds = 30;
+  int interval_ms = 1000;
+  int loglevel = E_LOG;
+  int option;
+  int ret = EXIT_FAILURE;
+  int i;
+
+  ctx.addr = "localhost";
+  ctx.web_port = STREAM_LOAD_WEB_PORT;
+  ctx.ws_port = STREAM_LOAD_WEBSOCKET_PORT;
+  ctx.stream_path = "/stream.mp3";
+
+  while ((option = getopt(argc, argv, "a:p:w:s:m:u:t:i:P:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'a':
+	    ctx.addr = optarg;
+	    break;
+
+	  case 'p':
+	    ctx.web_port = atoi(optarg);
+	    break;
+
+	  case 'w':
+	    ctx.ws_port = atoi(optarg);
+	    break;
+
+	  case 's':
+	    nstreams = atoi(optarg);
+	    break;
+
+	  case 'm':
+	    nws = atoi(optarg);
+	    break;
+
+	  case 'u':
+	    ctx.stream_path = optarg;
+	    break;
+
+	  case 't':
+	    seconds = atoi(optarg);
+	    break;
+
+	  case 'i':
+	    interval_ms = atoi(optarg);
+	    break;
+
+	  case 'P':
+	    pid = atoi(optarg);
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (nstreams < 0 || nws < 0 || (nstreams + nws) == 0 || seconds < 1 || interval_ms < 10)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  srandom(time(NULL));
+
+  CHECK_NULL(L_MAIN, ctx.evbase = event_base_new());
+
+  ctx.nclients = nstreams + nws;
+  CHECK_NULL(L_MAIN, ctx.clients = calloc(ctx.nclients, sizeof(struct load_client)));
+
+  if (pid > 0 && proc_stats_get(&proc_start, pid) < 0)
+    {
+      fprintf(stderr, "Could not read the stats of pid %d, is the server running on this host?\n", (int)pid);
+      pid = 0;
+    }
+
+  ctx.start_ms = ms_get();
+
+  for (i = 0; i < ctx.nclients; i++)
+    {
+      ctx.clients[i].ctx = &ctx;
+      ctx.clients[i].id = i;
+      ctx.clients[i].kind = (i < nstreams) ? CLIENT_STREAM : CLIENT_WEBSOCKET;
+
+      if (client_start(&ctx, &ctx.clients[i]) < 0)
+	{
+	  ctx.clients[i].dropped = true;
+	  if (i == 0)
+	    goto connect_fail;
+	}
+    }
+
+  printf("Started %d streaming and %d websocket clients\n", nstreams, nws);
+
+  if (nws > 0)
+    {
+      CHECK_NULL(L_MAIN, ctx.trigger_ev = event_new(ctx.evbase, -1, EV_PERSIST, trigger_cb, &ctx));
+      tv.tv_sec = interval_ms / 1000;
+      tv.tv_usec = (interval_ms % 1000) * 1000;
+      event_add(ctx.trigger_ev, &tv);
+    }
+
+  CHECK_NULL(L_MAIN, ctx.stop_ev = evtimer_new(ctx.evbase, stop_cb, &ctx));
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+  evtimer_add(ctx.stop_ev, &tv);
+
+  event_base_dispatch(ctx.evbase);
+
+  duration_sec = (ms_get() - ctx.start_ms) / 1000;
+
+  results_print(&ctx, nstreams, nws, duration_sec);
+
+  if (pid > 0 && proc_stats_get(&proc_end, pid) == 0)
+    printf("Server:     %.1f%% CPU, RSS %ld KiB (peak %ld KiB)\n",
+      100 * (proc_end.cpu_sec - proc_start.cpu_sec) / duration_sec, proc_end.rss_kib, proc_end.hwm_kib);
+
+  ret = EXIT_SUCCESS;
+
+  if (ctx.trigger_ev)
+    event_free(ctx.trigger_ev);
+  event_free(ctx.stop_ev);
+
+ connect_fail:
+  for (i = 0; i < ctx.nclients; i++)
+    {
+      if (ctx.clients[i].bev)
+	bufferevent_free(ctx.clients[i].bev);
+    }
+
+  free(ctx.clients);
+  free(ctx.latencies_ms);
+  event_base_free(ctx.evbase);
+  logger_deinit();
+
+  return ret;
+}
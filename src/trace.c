@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "trace.h"
+
+// Number of spans kept per thread, when full the oldest are overwritten
+#define TRACE_EVENTS_MAX 2048
+
+struct trace_event
+{
+  const char *cat;
+  const char *name;
+  uint64_t start_us;
+  uint64_t dur_us;
+};
+
+// Each thread only writes to its own buffer, so the lock is only contended
+// while trace_enable() or trace_dump() are running
+struct trace_buf
+{
+  pthread_mutex_t lck;
+  int tid;
+  char thread_name[32];
+
+  struct trace_event events[TRACE_EVENTS_MAX];
+  uint64_t count; // Total added, the next is written at count % TRACE_EVENTS_MAX
+
+  struct trace_buf *next;
+};
+
+static bool trace_on;
+
+// Buffers of all threads that have traced, also those that have exited, so
+// their spans can still be dumped
+static pthread_mutex_t trace_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *trace_bufs;
+
+static __thread struct trace_buf *trace_thread_buf;
+
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct trace_buf *
+thread_buf_get(void)
+{
+  struct trace_buf *buf;
+
+  if (trace_thread_buf)
+    return trace_thread_buf;
+
+  buf = calloc(1, sizeof(struct trace_buf));
+  if (!buf)
+    return NULL;
+
+  CHECK_ERR(L_MAIN, mutex_init(&buf->lck));
+  buf->tid = thread_gettid();
+  thread_getname(pthread_self(), buf->thread_name, sizeof(buf->thread_name));
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&trace_lck));
+  buf->next = trace_bufs;
+  trace_bufs = buf;
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&trace_lck));
+
+  trace_thread_buf = buf;
+  return buf;
+}
+
+// The names are string literals and regexps, so this is just precaution
+static void
+json_string_add(struct evbuffer *evbuf, const char *s)
+{
+  evbuffer_add(evbuf, "\"", 1);
+  for (; *s; s++)
+    {
+      if (*s == '"' || *s == '\\')
+	evbuffer_add_printf(evbuf, "\\%c", *s);
+      else if ((unsigned char)*s < 0x20)
+	evbuffer_add_printf(evbuf, "\\u%04x", *s);
+      else
+	evbuffer_add(evbuf, s, 1);
+    }
+  evbuffer_add(evbuf, "\"", 1);
+}
+
+static void
+buf_dump(struct evbuffer *evbuf, struct trace_buf *buf, int pid, bool *first)
+{
+  struct trace_event *event;
+  uint64_t start;
+  uint64_t i;
+
+  evbuffer_add_printf(evbuf, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+    *first ? "" : ",", pid, buf->tid);
+  json_string_add(evbuf, buf->thread_name);
+  evbuffer_add(evbuf, "}}", 2);
+  *first = false;
+
+  start = (buf->count > TRACE_EVENTS_MAX) ? buf->count - TRACE_EVENTS_MAX : 0;
+  for (i = start; i < buf->count; i++)
+    {
+      event = &buf->events[i % TRACE_EVENTS_MAX];
+
+      evbuffer_add(evbuf, ",{\"name\":", 9);
+      json_string_add(evbuf, event->name);
+      evbuffer_add(evbuf, ",\"cat\":", 7);
+      json_string_add(evbuf, event->cat);
+      evbuffer_add_printf(evbuf, ",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%d,\"tid\":%d}",
+	event->start_us, event->dur_us, pid, buf->tid);
+    }
+}
+
+
+/* -------------------------------- Trace API ------------------------------- */
+
+void
+trace_begin(struct trace_span *span, const char *cat, const char *name)
+{
+  if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED))
+    {
+      span->start_us = 0;
+      return;
+    }
+
+  span->cat = cat;
+  span->name = name;
+  span->start_us = now_us();
+}
+
+void
+trace_end(struct trace_span *span)
+{
+  struct trace_buf *buf;
+  struct trace_event *event;
+  uint64_t end_us;
+
+  if (span->start_us == 0)
+    return;
+
+  end_us = now_us();
+
+  buf = thread_buf_get();
+  if (!buf)
+    return;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&buf->lck));
+  event = &buf->events[buf->count % TRACE_EVENTS_MAX];
+  event->cat = span->cat;
+  event->name = span->name;
+  event->start_us = span->start_us;
+  event->dur_us = end_us - span->start_us;
+  buf->count++;
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&buf->lck));
+}
+
+void
+trace_enable(bool enable)
+{
+  struct trace_buf *buf;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&trace_lck));
+
+  if (enable && !trace_on)
+    {
+      for (buf = trace_bufs; buf; buf = buf->next)
+	{
+	  CHECK_ERR(L_MAIN, pthread_mutex_lock(&buf->lck));
+	  buf->count = 0;
+	  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&buf->lck));
+	}
+    }
+
+  __atomic_store_n(&trace_on, enable, __ATOMIC_RELAXED);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&trace_lck));
+
+  DPRINTF(E_LOG, L_MAIN, "Tracing %s\n", enable ? "enabled" : "disabled");
+}
+
+bool
+trace_is_enabled(void)
+{
+  return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+int
+trace_dump(struct evbuffer *evbuf)
+{
+  struct trace_buf *buf;
+  bool first = true;
+  int pid = getpid();
+
+  evbuffer_add_printf(evbuf, "{\"traceEvents\":[");
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&trace_lck));
+  for (buf = trace_bufs; buf; buf = buf->next)
+    {
+      CHECK_ERR(L_MAIN, pthread_mutex_lock(&buf->lck));
+      buf_dump(evbuf, buf, pid, &first);
+      CHECK_ERR(L_MAIN, pthread_mutex_unlock(&buf->lck));
+    }
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&trace_lck));
+
+  return evbuffer_add_printf(evbuf, "],\"displayTimeUnit\":\"ms\"}") < 0 ? -1 : 0;
+}
+
+void
+trace_deinit(void)
+{
+  struct trace_buf *buf;
+
+  __atomic_store_n(&trace_on, false, __ATOMIC_RELAXED);
+
+  while ((buf = trace_bufs))
+    {
+      trace_bufs = buf->next;
+      pthread_mutex_destroy(&buf->lck);
+      free(buf);
+    }
+
+  trace_thread_buf = NULL;
+}
@@ -0,0 +1,56 @@
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+/* Spans that show how work flows between threads, e.g. from a httpd thread to
+ * the player thread and on to a worker. Tracing is off by default, and then a
+ * span costs a check of a flag. When on, each thread records its spans in its
+ * own ring buffer, and trace_dump() writes them as Chrome trace event JSON,
+ * which can be loaded in chrome://tracing or https://ui.perfetto.dev.
+ *
+ *   struct trace_span span;
+ *
+ *   trace_begin(&span, "player", "playback_tick");
+ *   ...
+ *   trace_end(&span);
+ *
+ * The category and name strings are not copied, so they must stay valid, i.e.
+ * usually be string literals.
+ */
+struct trace_span
+{
+  const char *cat;
+  const char *name;
+  uint64_t start_us; // 0 if tracing was off at trace_begin()
+};
+
+void
+trace_begin(struct trace_span *span, const char *cat, const char *name);
+
+void
+trace_end(struct trace_span *span);
+
+/* Turns tracing on or off. Turning it on clears what has been recorded. */
+void
+trace_enable(bool enable);
+
+bool
+trace_is_enabled(void);
+
+/* Adds the recorded spans to evbuf as a Chrome trace event JSON object.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+trace_dump(struct evbuffer *evbuf);
+
+/* Frees the buffers, must be called when no other threads are running */
+void
+trace_deinit(void);
+
+#endif /* !__TRACE_H__ */
@@ -24,6 +24,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -65,6 +67,12 @@
 #define MAX_FILTERS 9
 // Set to same size as in httpd.c (but can be set to something else)
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// Max number of idle encoders kept by transcode_encode_release()
+#define ENCODE_POOL_SIZE 8
+// Distance between the entries of the seek index
+#define SEEK_INDEX_INTERVAL_MS 2000
+#define SEEK_INDEX_MAGIC 0x4f545349 // "OTSI"
+#define SEEK_INDEX_VERSION 1
 
 static const char *default_codecs = "mpeg,alac,wav";
 static const char *roku_codecs = "mpeg,mp4a,wma,alac,wav";
@@ -73,6 +81,11 @@ static const char *itunes_codecs = "mpeg,mp4a,mp4v,alac,wav";
 // Used for passing errors to DPRINTF (can't count on av_err2str being present)
 static char errbuf[64];
 
+// Idle encoders from transcode_encode_release(), oldest first
+static struct encode_ctx *encode_pool[ENCODE_POOL_SIZE];
+static int encode_pool_count;
+static pthread_mutex_t encode_pool_lck = PTHREAD_MUTEX_INITIALIZER;
+
 // Used by dummy_seek to mark a seek requested by ffmpeg
 static const uint8_t xcode_seek_marker[8] = { 0x0D, 0x0E, 0x0A, 0x0D, 0x0B, 0x0E, 0x0E, 0x0F };
 
@@ -109,6 +122,7 @@ struct settings_ctx
   bool without_libav_trailer;
   bool with_icy;
   bool with_user_filters;
+  struct transcode_resample resample;
 
   // Video settings
   enum AVCodecID video_codec;
@@ -132,6 +146,27 @@ struct stream_ctx
   int64_t offset_pts;
 };
 
+struct seek_index_entry
+{
+  int64_t pts; // In the time base of the audio stream
+  int64_t pos; // Byte offset of the packet in the input
+};
+
+// Collected while the input is read from the start, see seek_index_collect()
+struct seek_index
+{
+  struct seek_index_entry *entries;
+  int count;
+  int size;
+
+  // Size of the input the index was made for
+  int64_t input_size;
+
+  bool is_collecting;
+  bool is_complete;
+  bool is_loaded;
+};
+
 struct decode_ctx
 {
   // Settings derived from the profile
@@ -156,6 +191,8 @@ struct decode_ctx
   // Set to true if we just seeked
   bool resume;
 
+  struct seek_index seek_index;
+
   // Set to true if we have reached eof
   bool eof;
 
@@ -205,6 +242,20 @@ struct encode_ctx
   // Used to check for ICY metadata changes at certain intervals
   uint32_t icy_interval;
   uint32_t icy_hash;
+
+  // If true the source audio packets are copied to the output without decoding
+  // and encoding, see remux_is_possible()
+  bool is_remux;
+
+  // What the ctx was made for, if made by transcode_encode_setup_pooled()
+  struct encode_pool_key
+  {
+    enum transcode_profile profile;
+    struct media_quality quality;
+    enum transcode_profile src_profile;
+    struct media_quality src_quality;
+    struct transcode_resample resample;
+  } pool_key;
 };
 
 enum probe_type
@@ -317,6 +368,20 @@ init_settings(struct settings_ctx *settings, enum transcode_profile profile, str
 	settings->in_format = "ogg";
 	break;
 
+      case XCODE_OGG_OPUS:
+	settings->encode_audio = true;
+	settings->format = "ogg";
+	settings->audio_codec = AV_CODEC_ID_OPUS;
+	settings->sample_format = AV_SAMPLE_FMT_S16; // Only libopus support
+	break;
+
+      case XCODE_FLAC:
+	settings->encode_audio = true;
+	settings->format = "flac";
+	settings->audio_codec = AV_CODEC_ID_FLAC;
+	settings->sample_format = AV_SAMPLE_FMT_S16;
+	break;
+
       case XCODE_JPEG:
 	settings->encode_video = true;
 	settings->silent = 1;
@@ -360,6 +425,19 @@ init_settings(struct settings_ctx *settings, enum transcode_profile profile, str
 	settings->video_codec = AV_CODEC_ID_VP8;
 	break;
 
+      case XCODE_WEBP:
+	settings->encode_video = true;
+	settings->silent = true;
+// See explanation above
+#if USE_IMAGE2PIPE
+	settings->format = "image2pipe";
+#else
+	settings->format = "image2";
+#endif
+	settings->pix_fmt = AV_PIX_FMT_YUV420P;
+	settings->video_codec = AV_CODEC_ID_WEBP;
+	break;
+
       default:
 	DPRINTF(E_LOG, L_XCODE, "Bug! Unknown transcoding profile\n");
 	return -1;
@@ -703,6 +781,38 @@ stream_add(struct encode_ctx *ctx, struct stream_ctx *s, enum AVCodecID codec_id
   return -1;
 }
 
+/*
+ * Adds an output stream with the codec parameters of the input stream, for
+ * remuxing. The stream doesn't get an encoder, so s->codec will be NULL.
+ *
+ * @in ctx        Encode context
+ * @in s          Output stream context
+ * @in in_stream  Input stream context
+ * @return        Negative on failure, otherwise zero
+ */
+static int
+stream_add_copy(struct encode_ctx *ctx, struct stream_ctx *s, struct stream_ctx *in_stream)
+{
+  int ret;
+
+  CHECK_NULL(L_XCODE, s->stream = avformat_new_stream(ctx->ofmt_ctx, NULL));
+
+  ret = avcodec_parameters_copy(s->stream->codecpar, in_stream->stream->codecpar);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Cannot copy stream parameters for remuxing: %s\n", err2str(ret));
+      return -1;
+    }
+
+  // The tag of the source container may not be valid in the output container
+  s->stream->codecpar->codec_tag = 0;
+  s->stream->time_base = in_stream->stream->time_base;
+
+  DPRINTF(E_DBG, L_XCODE, "Remuxing audio stream (%s), no transcoding required\n", avcodec_get_name(s->stream->codecpar->codec_id));
+
+  return 0;
+}
+
 /*
  * Called by libavformat while demuxing. Used to interrupt/unblock av_read_frame
  * in case a source (especially a network stream) becomes unavailable.
@@ -735,6 +845,186 @@ decode_interrupt_cb(void *arg)
  * @in  ctx       Decode context
  * @return        0 if OK, < 0 on error or end of file
  */
+/*                              Seek index                                   */
+
+// The index is only made for seekable inputs that support seeking by byte
+// offset, and not for live streams
+static void
+seek_index_init(struct decode_ctx *ctx)
+{
+  struct seek_index *index = &ctx->seek_index;
+
+  if (!ctx->audio_stream.stream || !ctx->ifmt_ctx->pb || ctx->len_ms == 0)
+    return;
+
+  if ((ctx->ifmt_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL) == 0 || (ctx->ifmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK))
+    return;
+
+  index->input_size = avio_size(ctx->ifmt_ctx->pb);
+  if (index->input_size <= 0)
+    return;
+
+  index->is_collecting = true;
+}
+
+static void
+seek_index_collect(struct decode_ctx *ctx)
+{
+  struct seek_index *index = &ctx->seek_index;
+  AVPacket *pkt = ctx->packet;
+  int64_t interval;
+
+  if (!index->is_collecting || index->is_complete || pkt->pts == AV_NOPTS_VALUE || pkt->pos < 0)
+    return;
+
+  if (index->count > 0)
+    {
+      interval = av_rescale_q(SEEK_INDEX_INTERVAL_MS, (AVRational){ 1, 1000 }, ctx->audio_stream.stream->time_base);
+      if (pkt->pts < index->entries[index->count - 1].pts + interval)
+	return;
+    }
+
+  if (index->count == index->size)
+    {
+      index->size = index->size ? 2 * index->size : 256;
+      CHECK_NULL(L_XCODE, index->entries = realloc(index->entries, index->size * sizeof(struct seek_index_entry)));
+    }
+
+  index->entries[index->count].pts = pkt->pts;
+  index->entries[index->count].pos = pkt->pos;
+  index->count++;
+}
+
+// Returns the last entry before the target, or -1 if the target is beyond
+// what the index covers
+static int
+seek_index_lookup(struct seek_index *index, AVStream *stream, int64_t target_pts)
+{
+  int64_t interval;
+  int low;
+  int high;
+  int mid;
+
+  if (index->count == 0 || target_pts < index->entries[0].pts)
+    return -1;
+
+  interval = av_rescale_q(SEEK_INDEX_INTERVAL_MS, (AVRational){ 1, 1000 }, stream->time_base);
+  if (!index->is_complete && target_pts > index->entries[index->count - 1].pts + interval)
+    return -1;
+
+  low = 0;
+  high = index->count - 1;
+  while (low < high)
+    {
+      mid = (low + high + 1) / 2;
+      if (index->entries[mid].pts <= target_pts)
+	low = mid;
+      else
+	high = mid - 1;
+    }
+
+  return low;
+}
+
+// Jumps to the byte offset of the index entry before the target, and then
+// demuxes (but doesn't decode) until the packet that has the target. On return
+// ctx->packet holds that packet.
+static int
+seek_index_seek(struct decode_ctx *ctx, struct stream_ctx *s, int64_t target_pts)
+{
+  int64_t pts;
+  int i;
+  int ret;
+
+  i = seek_index_lookup(&ctx->seek_index, s->stream, target_pts);
+  if (i < 0)
+    return -1;
+
+  ret = av_seek_frame(ctx->ifmt_ctx, s->stream->index, ctx->seek_index.entries[i].pos, AVSEEK_FLAG_BYTE);
+  if (ret < 0)
+    {
+      DPRINTF(E_DBG, L_XCODE, "Could not seek by byte offset, falling back to seek by time: %s\n", err2str(ret));
+      return -1;
+    }
+
+  avcodec_flush_buffers(s->codec);
+
+  pts = ctx->seek_index.entries[i].pts;
+  while (1)
+    {
+      ctx->timestamp = av_gettime();
+
+      av_packet_unref(ctx->packet);
+      ret = av_read_frame(ctx->ifmt_ctx, ctx->packet);
+      if (ret < 0)
+	{
+	  DPRINTF(E_WARN, L_XCODE, "Could not read more data while seeking: %s\n", err2str(ret));
+	  return -1;
+	}
+
+      if (ctx->packet->stream_index != s->stream->index)
+	continue;
+
+      // Demuxers don't always set the pts right after a byte seek
+      if (ctx->packet->pts != AV_NOPTS_VALUE)
+	pts = ctx->packet->pts;
+      else
+	ctx->packet->pts = pts;
+
+      if (ctx->packet->duration <= 0 || pts + ctx->packet->duration > target_pts)
+	break;
+
+      pts += ctx->packet->duration;
+    }
+
+  return 0;
+}
+
+// Seeks to the nearest keyframe before the target, and then reads until first
+// packet with a timestamp. On return ctx->packet holds that packet.
+static int
+seek_bytime(struct decode_ctx *ctx, struct stream_ctx *s, int64_t target_pts)
+{
+  int ret;
+
+  ret = av_seek_frame(ctx->ifmt_ctx, s->stream->index, target_pts, AVSEEK_FLAG_BACKWARD);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not seek into stream: %s\n", err2str(ret));
+      return -1;
+    }
+
+  avcodec_flush_buffers(s->codec);
+
+  // Fast forward until first packet with a timestamp is found
+  s->codec->skip_frame = AVDISCARD_NONREF;
+  while (1)
+    {
+      ctx->timestamp = av_gettime();
+
+      av_packet_unref(ctx->packet);
+      ret = av_read_frame(ctx->ifmt_ctx, ctx->packet);
+      if (ret < 0)
+	{
+	  DPRINTF(E_WARN, L_XCODE, "Could not read more data while seeking: %s\n", err2str(ret));
+	  s->codec->skip_frame = AVDISCARD_DEFAULT;
+	  return -1;
+	}
+
+      if (stream_find(ctx, ctx->packet->stream_index) == AVMEDIA_TYPE_UNKNOWN)
+	continue;
+
+      // Need a pts to return the real position
+      if (ctx->packet->pts == AV_NOPTS_VALUE)
+	continue;
+
+      break;
+    }
+  s->codec->skip_frame = AVDISCARD_DEFAULT;
+
+  return 0;
+}
+
 static int
 read_packet(enum AVMediaType *type, struct decode_ctx *dec_ctx)
 {
@@ -758,6 +1048,9 @@ read_packet(enum AVMediaType *type, struct decode_ctx *dec_ctx)
       ret = av_read_frame(dec_ctx->ifmt_ctx, dec_ctx->packet);
       if (ret < 0)
 	{
+	  if (ret == AVERROR_EOF && dec_ctx->seek_index.is_collecting && dec_ctx->seek_index.count > 0)
+	    dec_ctx->seek_index.is_complete = true;
+
 	  DPRINTF(E_WARN, L_XCODE, "Could not read frame: %s\n", err2str(ret));
 	  return ret;
 	}
@@ -766,12 +1059,16 @@ read_packet(enum AVMediaType *type, struct decode_ctx *dec_ctx)
     }
   while (*type == AVMEDIA_TYPE_UNKNOWN);
 
+  if (*type == AVMEDIA_TYPE_AUDIO)
+    seek_index_collect(dec_ctx);
+
   return 0;
 }
 
-// Prepares a packet from the encoder for muxing
+// Prepares a packet from the encoder (or the demuxer, if remuxing) for muxing.
+// The time_base is the one of the packet's timestamps.
 static void
-packet_prepare(AVPacket *pkt, struct stream_ctx *s)
+packet_prepare(AVPacket *pkt, struct stream_ctx *s, AVRational time_base)
 {
   pkt->stream_index = s->stream->index;
 
@@ -787,7 +1084,7 @@ packet_prepare(AVPacket *pkt, struct stream_ctx *s)
   s->prev_pts = pkt->pts;
   pkt->dts = pkt->pts; //FIXME
 
-  av_packet_rescale_ts(pkt, s->codec->time_base, s->stream->time_base);
+  av_packet_rescale_ts(pkt, time_base, s->stream->time_base);
 }
 
 /*
@@ -815,7 +1112,7 @@ encode_write(struct encode_ctx *ctx, struct stream_ctx *s, AVFrame *filt_frame)
 	  break;
 	}
 
-      packet_prepare(ctx->encoded_pkt, s);
+      packet_prepare(ctx->encoded_pkt, s, s->codec->time_base);
 
       ret = av_interleaved_write_frame(ctx->ofmt_ctx, ctx->encoded_pkt);
       if (ret < 0)
@@ -928,6 +1225,31 @@ decode_filter_encode_write(struct transcode_ctx *ctx, struct stream_ctx *s, AVPa
   return ret;
 }
 
+/*
+ * Shortcut for part 2-5 of the conversion chain if remuxing: read -> write
+ *
+ */
+static int
+remux_write(struct encode_ctx *ctx, struct stream_ctx *in_stream, AVPacket *pkt)
+{
+  struct stream_ctx *out_stream = &ctx->audio_stream;
+  int ret;
+
+  // Some demuxers don't set pts on all packets
+  if (pkt->pts == AV_NOPTS_VALUE)
+    pkt->pts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : out_stream->prev_pts + pkt->duration;
+
+  packet_prepare(pkt, out_stream, in_stream->stream->time_base);
+  pkt->pos = -1;
+
+  // Takes ownership of the packet data and resets pkt
+  ret = av_interleaved_write_frame(ctx->ofmt_ctx, pkt);
+  if (ret < 0)
+    DPRINTF(E_WARN, L_XCODE, "av_interleaved_write_frame() failed while remuxing: %s\n", err2str(ret));
+
+  return ret;
+}
+
 /*
  * Part 1 of the conversion chain: read -> decode -> filter -> encode -> write
  *
@@ -944,6 +1266,7 @@ read_decode_filter_encode_write(struct transcode_ctx *ctx)
   struct encode_ctx *enc_ctx = ctx->encode_ctx;
   enum AVMediaType type;
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_XCODE);
 
   ret = read_packet(&type, dec_ctx);
   if (ret < 0)
@@ -951,7 +1274,8 @@ read_decode_filter_encode_write(struct transcode_ctx *ctx)
       if (ret == AVERROR_EOF)
 	dec_ctx->eof = 1;
 
-      if (dec_ctx->audio_stream.stream)
+      // Nothing buffered in decoder, filter or encoder to flush when remuxing
+      if (dec_ctx->audio_stream.stream && !(enc_ctx && enc_ctx->is_remux))
 	decode_filter_encode_write(ctx, &dec_ctx->audio_stream, NULL, AVMEDIA_TYPE_AUDIO);
       if (dec_ctx->video_stream.stream)
 	decode_filter_encode_write(ctx, &dec_ctx->video_stream, NULL, AVMEDIA_TYPE_VIDEO);
@@ -964,7 +1288,9 @@ read_decode_filter_encode_write(struct transcode_ctx *ctx)
       return ret;
     }
 
-  if (type == AVMEDIA_TYPE_AUDIO)
+  if (type == AVMEDIA_TYPE_AUDIO && enc_ctx && enc_ctx->is_remux)
+    ret = remux_write(enc_ctx, &dec_ctx->audio_stream, dec_ctx->packet);
+  else if (type == AVMEDIA_TYPE_AUDIO)
     ret = decode_filter_encode_write(ctx, &dec_ctx->audio_stream, dec_ctx->packet, type);
   else if (type == AVMEDIA_TYPE_VIDEO)
     ret = decode_filter_encode_write(ctx, &dec_ctx->video_stream, dec_ctx->packet, type);
@@ -1403,6 +1729,8 @@ open_input(struct decode_ctx *ctx, const char *path, struct transcode_evbuf_io *
       // see https://lists.ffmpeg.org/pipermail/ffmpeg-user/2018-September/041109.html
 //      av_dict_set(&options, "reconnect_at_eof", "1", 0);
       av_dict_set(&options, "reconnect_streamed", "1", 0);
+      // Also try to reconnect on e.g. a reset connection, not only on EOF
+      av_dict_set(&options, "reconnect_on_network_error", "1", 0);
     }
 
   // TODO Newest versions of ffmpeg have timeout and reconnect options we should use
@@ -1532,7 +1860,13 @@ open_output(struct encode_ctx *ctx, struct transcode_evbuf_io *evbuf_io, struct
   CHECK_NULL(L_XCODE, ctx->ofmt_ctx->pb = avio_evbuffer_open(evbuf_io, 1));
   ctx->obuf = evbuf_io->evbuf;
 
-  if (ctx->settings.encode_audio)
+  if (ctx->settings.encode_audio && ctx->is_remux)
+    {
+      ret = stream_add_copy(ctx, &ctx->audio_stream, &src_ctx->audio_stream);
+      if (ret < 0)
+	goto error;
+    }
+  else if (ctx->settings.encode_audio)
     {
       ret = stream_add(ctx, &ctx->audio_stream, ctx->settings.audio_codec);
       if (ret < 0)
@@ -1831,15 +2165,47 @@ add_filters(int *num_added, AVFilterGraph *filter_graph, struct filters *filters
   return 0;
 }
 
+/* Options for the resamplers that ffmpeg inserts in the audio filter graph.
+ * Lower filter_size and phase_shift mean fewer operations per sample, at the
+ * cost of some aliasing. swresample doesn't dither by default.
+ */
+static void
+resample_opts_make(char *opts, size_t len, struct transcode_resample *resample)
+{
+  const char *quality_opts;
+
+  switch (resample->quality)
+    {
+      case XCODE_RESAMPLE_LOW:
+	quality_opts = "filter_size=8:phase_shift=6";
+	break;
+      case XCODE_RESAMPLE_HIGH:
+	quality_opts = "filter_size=64:phase_shift=12";
+	break;
+      default:
+	quality_opts = NULL;
+    }
+
+  snprintf(opts, len, "%s%s%s", quality_opts ? quality_opts : "", (quality_opts && resample->dither) ? ":" : "", resample->dither ? "dither_method=triangular" : "");
+}
+
 static int
-create_filtergraph(struct stream_ctx *out_stream, struct filters *filters, size_t filters_len, struct stream_ctx *in_stream)
+create_filtergraph(struct stream_ctx *out_stream, struct filters *filters, size_t filters_len, struct stream_ctx *in_stream, struct transcode_resample *resample)
 {
   AVFilterGraph *filter_graph;
+  char swr_opts[128];
   int ret;
   int added;
 
   CHECK_NULL(L_XCODE, filter_graph = avfilter_graph_alloc());
 
+  if (resample)
+    {
+      resample_opts_make(swr_opts, sizeof(swr_opts), resample);
+      if (*swr_opts != '\0' && av_opt_set(filter_graph, "aresample_swr_opts", swr_opts, 0) < 0)
+	DPRINTF(E_WARN, L_XCODE, "Could not set resampler options '%s'\n", swr_opts);
+    }
+
   ret = add_filters(&added, filter_graph, filters, filters_len, out_stream, in_stream);
   if (ret < 0)
     {
@@ -1877,13 +2243,13 @@ open_filters(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
   struct filters filters[MAX_FILTERS] = { 0 };
   int ret;
 
-  if (ctx->settings.encode_audio)
+  if (ctx->settings.encode_audio && !ctx->is_remux)
     {
       ret = define_audio_filters(filters, ARRAY_SIZE(filters), ctx->settings.with_user_filters);
       if (ret < 0)
 	goto out_fail;
 
-      ret = create_filtergraph(&ctx->audio_stream, filters, ARRAY_SIZE(filters), &src_ctx->audio_stream);
+      ret = create_filtergraph(&ctx->audio_stream, filters, ARRAY_SIZE(filters), &src_ctx->audio_stream, &ctx->settings.resample);
       if (ret < 0)
 	goto out_fail;
 
@@ -1899,7 +2265,7 @@ open_filters(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
       if (ret < 0)
 	goto out_fail;
 
-      ret = create_filtergraph(&ctx->video_stream, filters, ARRAY_SIZE(filters), &src_ctx->video_stream);
+      ret = create_filtergraph(&ctx->video_stream, filters, ARRAY_SIZE(filters), &src_ctx->video_stream, NULL);
       if (ret < 0)
 	goto out_fail;
     }
@@ -1921,6 +2287,7 @@ transcode_decode_setup(struct transcode_decode_setup_args args)
 {
   struct decode_ctx *ctx;
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_XCODE);
 
   CHECK_NULL(L_XCODE, ctx = calloc(1, sizeof(struct decode_ctx)));
   CHECK_NULL(L_XCODE, ctx->decoded_frame = av_frame_alloc());
@@ -1948,6 +2315,8 @@ transcode_decode_setup(struct transcode_decode_setup_args args)
   if (ret < 0)
     goto fail_free;
 
+  seek_index_init(ctx);
+
   return ctx;
 
  fail_free:
@@ -1957,11 +2326,43 @@ transcode_decode_setup(struct transcode_decode_setup_args args)
   return NULL;
 }
 
-struct encode_ctx *
-transcode_encode_setup(struct transcode_encode_setup_args args)
+/* Checks if the audio packets from the source can be copied as they are to
+ * the output, which is the case if the encoder would produce the same codec
+ * with the same parameters. We don't remux if there is video, user filters or
+ * a header that we make ourselves (the mp4 header must match what the encoder
+ * produces, since it may have been prepared beforehand).
+ */
+static bool
+remux_is_possible(struct encode_ctx *ctx, struct decode_ctx *src_ctx)
+{
+  AVCodecParameters *src_par;
+  int src_channels;
+
+  if (!src_ctx->ifmt_ctx || !src_ctx->audio_stream.stream)
+    return false; // Raw input or input without audio
+
+  if (!ctx->settings.encode_audio || ctx->settings.encode_video || ctx->settings.with_mp4_header || ctx->settings.with_wav_header)
+    return false;
+
+  if (ctx->settings.with_user_filters && cfg_size(cfg_getsec(cfg, "library"), "decode_audio_filters") > 0)
+    return false;
+
+  src_par = src_ctx->audio_stream.stream->codecpar;
+#if USE_CH_LAYOUT
+  src_channels = src_par->ch_layout.nb_channels;
+#else
+  src_channels = src_par->channels;
+#endif
+
+  return (src_par->codec_id == ctx->settings.audio_codec && src_par->sample_rate == ctx->settings.sample_rate && src_channels == ctx->settings.nb_channels);
+}
+
+static struct encode_ctx *
+encode_setup(struct transcode_encode_setup_args args, bool allow_remux)
 {
   struct encode_ctx *ctx;
   int dst_bytes_per_sample;
+  MEM_TAG_SCOPE(MEM_TAG_XCODE);
 
   CHECK_NULL(L_XCODE, ctx = calloc(1, sizeof(struct encode_ctx)));
   CHECK_NULL(L_XCODE, ctx->filt_frame = av_frame_alloc());
@@ -1982,6 +2383,9 @@ transcode_encode_setup(struct transcode_encode_setup_args args)
   if (ctx->settings.encode_video && init_settings_from_video(&ctx->settings, args.profile, args.src_ctx, args.width, args.height) < 0)
     goto error;
 
+  ctx->settings.resample = args.resample;
+  ctx->is_remux = allow_remux && remux_is_possible(ctx, args.src_ctx);
+
   dst_bytes_per_sample = av_get_bytes_per_sample(ctx->settings.sample_format);
   ctx->bytes_total = size_estimate(args.profile, ctx->settings.bit_rate, ctx->settings.sample_rate, dst_bytes_per_sample, ctx->settings.nb_channels, args.src_ctx->len_ms);
 
@@ -2001,6 +2405,116 @@ transcode_encode_setup(struct transcode_encode_setup_args args)
   return NULL;
 }
 
+struct encode_ctx *
+transcode_encode_setup(struct transcode_encode_setup_args args)
+{
+  // The caller will give us frames with transcode_encode(), so no remuxing
+  return encode_setup(args, false);
+}
+
+static bool
+encode_pool_key_is_equal(struct encode_pool_key *a, struct encode_pool_key *b)
+{
+  return a->profile == b->profile && a->src_profile == b->src_profile &&
+    quality_is_equal(&a->quality, &b->quality) && quality_is_equal(&a->src_quality, &b->src_quality) &&
+    a->resample.quality == b->resample.quality && a->resample.dither == b->resample.dither;
+}
+
+struct encode_ctx *
+transcode_encode_setup_pooled(enum transcode_profile profile, struct media_quality *quality, enum transcode_profile src_profile, struct media_quality *src_quality, struct transcode_resample *resample)
+{
+  struct transcode_encode_setup_args encode_args = { .profile = profile, .quality = quality };
+  struct encode_pool_key key = { .profile = profile, .quality = *quality, .src_profile = src_profile, .src_quality = *src_quality };
+  struct encode_ctx *ctx = NULL;
+  int i;
+
+  if (resample)
+    {
+      encode_args.resample = *resample;
+      key.resample = *resample;
+    }
+
+  CHECK_ERR(L_XCODE, pthread_mutex_lock(&encode_pool_lck));
+  for (i = encode_pool_count - 1; i >= 0; i--)
+    {
+      if (!encode_pool_key_is_equal(&encode_pool[i]->pool_key, &key))
+	continue;
+
+      ctx = encode_pool[i];
+      encode_pool_count--;
+      memmove(&encode_pool[i], &encode_pool[i + 1], (encode_pool_count - i) * sizeof(struct encode_ctx *));
+      break;
+    }
+  CHECK_ERR(L_XCODE, pthread_mutex_unlock(&encode_pool_lck));
+
+  if (ctx)
+    {
+      DPRINTF(E_DBG, L_XCODE, "Reusing encoder for %d/%d/%d -> %d/%d/%d\n", src_quality->sample_rate, src_quality->bits_per_sample,
+	src_quality->channels, quality->sample_rate, quality->bits_per_sample, quality->channels);
+      return ctx;
+    }
+
+  encode_args.src_ctx = transcode_decode_setup_raw(src_profile, src_quality);
+  if (!encode_args.src_ctx)
+    return NULL;
+
+  ctx = transcode_encode_setup(encode_args);
+  transcode_decode_cleanup(&encode_args.src_ctx);
+  if (!ctx)
+    return NULL;
+
+  ctx->pool_key = key;
+  return ctx;
+}
+
+void
+transcode_encode_release(struct encode_ctx **ctx)
+{
+  struct encode_ctx *evicted = NULL;
+
+  if (!*ctx)
+    return;
+
+  // Not made by transcode_encode_setup_pooled()
+  if ((*ctx)->pool_key.profile == XCODE_UNKNOWN)
+    {
+      transcode_encode_cleanup(ctx);
+      return;
+    }
+
+  // Output that the previous user didn't read
+  evbuffer_drain((*ctx)->obuf, evbuffer_get_length((*ctx)->obuf));
+
+  CHECK_ERR(L_XCODE, pthread_mutex_lock(&encode_pool_lck));
+  if (encode_pool_count == ENCODE_POOL_SIZE)
+    {
+      evicted = encode_pool[0];
+      encode_pool_count--;
+      memmove(&encode_pool[0], &encode_pool[1], encode_pool_count * sizeof(struct encode_ctx *));
+    }
+  encode_pool[encode_pool_count] = *ctx;
+  encode_pool_count++;
+  CHECK_ERR(L_XCODE, pthread_mutex_unlock(&encode_pool_lck));
+
+  transcode_encode_cleanup(&evicted);
+  *ctx = NULL;
+}
+
+void
+transcode_encode_pool_clear(void)
+{
+  struct encode_ctx *ctx;
+
+  CHECK_ERR(L_XCODE, pthread_mutex_lock(&encode_pool_lck));
+  while (encode_pool_count > 0)
+    {
+      encode_pool_count--;
+      ctx = encode_pool[encode_pool_count];
+      transcode_encode_cleanup(&ctx);
+    }
+  CHECK_ERR(L_XCODE, pthread_mutex_unlock(&encode_pool_lck));
+}
+
 struct transcode_ctx *
 transcode_setup(struct transcode_decode_setup_args decode_args, struct transcode_encode_setup_args encode_args)
 {
@@ -2016,7 +2530,7 @@ transcode_setup(struct transcode_decode_setup_args decode_args, struct transcode
     }
 
   encode_args.src_ctx = ctx->decode_ctx;
-  ctx->encode_ctx = transcode_encode_setup(encode_args);
+  ctx->encode_ctx = encode_setup(encode_args, true);
   if (!ctx->encode_ctx)
     {
       transcode_decode_cleanup(&ctx->decode_ctx);
@@ -2039,6 +2553,7 @@ transcode_decode_setup_raw(enum transcode_profile profile, struct media_quality
   AVCodec *decoder;
 #endif
   int ret;
+  MEM_TAG_SCOPE(MEM_TAG_XCODE);
 
   CHECK_NULL(L_XCODE, ctx = calloc(1, sizeof(struct decode_ctx)));
 
@@ -2185,6 +2700,24 @@ transcode_needed(const char *user_agent, const char *client_codecs, const char *
 
 /*                                  Cleanup                                  */
 
+bool
+transcode_encode_is_supported(enum transcode_profile profile)
+{
+  struct settings_ctx settings;
+  int ret;
+
+  ret = init_settings(&settings, profile, NULL);
+  if (ret < 0)
+    return false;
+
+  if (settings.encode_video && !avcodec_find_encoder(settings.video_codec))
+    return false;
+  if (settings.encode_audio && settings.audio_codec && !avcodec_find_encoder(settings.audio_codec))
+    return false;
+
+  return true;
+}
+
 void
 transcode_decode_cleanup(struct decode_ctx **ctx)
 {
@@ -2193,6 +2726,7 @@ transcode_decode_cleanup(struct decode_ctx **ctx)
 
   close_input(*ctx);
 
+  free((*ctx)->seek_index.entries);
   av_packet_free(&(*ctx)->packet);
   av_frame_free(&(*ctx)->decoded_frame);
   free(*ctx);
@@ -2307,6 +2841,20 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame
   return ret;
 }
 
+int
+transcode_encode_header_get(struct evbuffer *evbuf, struct encode_ctx *ctx)
+{
+  int ret;
+
+  avio_flush(ctx->ofmt_ctx->pb);
+
+  ret = evbuffer_get_length(ctx->obuf);
+
+  evbuffer_add_buffer(evbuf, ctx->obuf);
+
+  return ret;
+}
+
 int
 transcode(struct evbuffer *evbuf, int *icy_timer, struct transcode_ctx *ctx, int want_bytes)
 {
@@ -2427,40 +2975,14 @@ transcode_seek(struct transcode_ctx *ctx, int ms)
   if ((start_time != AV_NOPTS_VALUE) && (start_time > 0))
     target_pts += start_time;
 
-  ret = av_seek_frame(dec_ctx->ifmt_ctx, s->stream->index, target_pts, AVSEEK_FLAG_BACKWARD);
-  if (ret < 0)
-    {
-      DPRINTF(E_WARN, L_XCODE, "Could not seek into stream: %s\n", err2str(ret));
-      return -1;
-    }
-
-  avcodec_flush_buffers(s->codec);
-
-  // Fast forward until first packet with a timestamp is found
-  s->codec->skip_frame = AVDISCARD_NONREF;
-  while (1)
-    {
-      dec_ctx->timestamp = av_gettime();
-
-      av_packet_unref(dec_ctx->packet);
-      ret = av_read_frame(dec_ctx->ifmt_ctx, dec_ctx->packet);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_XCODE, "Could not read more data while seeking: %s\n", err2str(ret));
-	  s->codec->skip_frame = AVDISCARD_DEFAULT;
-	  return -1;
-	}
-
-      if (stream_find(dec_ctx, dec_ctx->packet->stream_index) == AVMEDIA_TYPE_UNKNOWN)
-	continue;
-
-      // Need a pts to return the real position
-      if (dec_ctx->packet->pts == AV_NOPTS_VALUE)
-	continue;
+  // The index would get holes if we kept collecting after the seek
+  dec_ctx->seek_index.is_collecting = false;
 
-      break;
-    }
-  s->codec->skip_frame = AVDISCARD_DEFAULT;
+  ret = seek_index_seek(dec_ctx, s, target_pts);
+  if (ret < 0)
+    ret = seek_bytime(dec_ctx, s, target_pts);
+  if (ret < 0)
+    return -1;
 
   // Tell read_packet() to resume with dec_ctx->packet
   dec_ctx->resume = 1;
@@ -2483,6 +3005,118 @@ transcode_seek(struct transcode_ctx *ctx, int ms)
   return got_ms;
 }
 
+off_t
+transcode_seek_bytes(struct transcode_ctx *ctx, off_t offset)
+{
+  struct settings_ctx *settings = &ctx->encode_ctx->settings;
+  struct evbuffer *obuf = ctx->encode_ctx->obuf;
+  uint64_t bytes_per_sec;
+  int block_align;
+  off_t header_len;
+  off_t pos;
+  int got_ms;
+
+  // Only the header has been written at this point
+  header_len = evbuffer_get_length(obuf);
+  if (offset <= header_len)
+    return -1;
+
+  // Only for the profiles where size_estimate() is exact enough that a byte
+  // offset can be converted to a time position
+  if (settings->with_wav_header)
+    {
+      block_align = av_get_bytes_per_sample(settings->sample_format) * settings->nb_channels;
+      bytes_per_sec = (uint64_t)block_align * settings->sample_rate;
+    }
+  else if (settings->audio_codec == AV_CODEC_ID_MP3 && settings->bit_rate > 0)
+    {
+      block_align = 1;
+      bytes_per_sec = settings->bit_rate / 8;
+    }
+  else
+    return -1;
+
+  if (bytes_per_sec == 0)
+    return -1;
+
+  got_ms = transcode_seek(ctx, (uint64_t)(offset - header_len) * 1000 / bytes_per_sec);
+  if (got_ms < 0)
+    return -1;
+
+  // The client already has the header from the part before offset
+  evbuffer_drain(obuf, header_len);
+
+  // Keep the position aligned to whole frames, so that PCM channels don't get
+  // mixed up when the caller skips from pos to offset
+  pos = (uint64_t)got_ms * bytes_per_sec / 1000;
+  pos = header_len + pos - (pos % block_align);
+  if (pos > offset)
+    pos = offset - ((offset - header_len) % block_align);
+
+  DPRINTF(E_DBG, L_XCODE, "Seek to byte offset %" PRIi64 " is at %" PRIi64 " (%d ms)\n", (int64_t)offset, (int64_t)pos, got_ms);
+
+  return pos;
+}
+
+int
+transcode_seek_index_get(struct evbuffer *evbuf, struct transcode_ctx *ctx)
+{
+  struct seek_index *index = &ctx->decode_ctx->seek_index;
+  uint32_t header[3] = { SEEK_INDEX_MAGIC, SEEK_INDEX_VERSION, 0 };
+
+  if (!index->is_complete || index->is_loaded)
+    return -1;
+
+  header[2] = index->count;
+
+  evbuffer_add(evbuf, header, sizeof(header));
+  evbuffer_add(evbuf, &index->input_size, sizeof(index->input_size));
+  evbuffer_add(evbuf, index->entries, index->count * sizeof(struct seek_index_entry));
+
+  return 0;
+}
+
+int
+transcode_seek_index_set(struct transcode_ctx *ctx, struct evbuffer *evbuf)
+{
+  struct seek_index *index = &ctx->decode_ctx->seek_index;
+  uint32_t header[3];
+  int64_t input_size;
+  size_t len;
+
+  // Only if the input qualified for an index, see seek_index_init()
+  if (!index->is_collecting || index->count > 0)
+    return -1;
+
+  len = evbuffer_get_length(evbuf);
+  if (len < sizeof(header) + sizeof(input_size))
+    return -1;
+
+  evbuffer_remove(evbuf, header, sizeof(header));
+  evbuffer_remove(evbuf, &input_size, sizeof(input_size));
+  len -= sizeof(header) + sizeof(input_size);
+
+  if (header[0] != SEEK_INDEX_MAGIC || header[1] != SEEK_INDEX_VERSION || header[2] == 0 || len != header[2] * sizeof(struct seek_index_entry))
+    {
+      DPRINTF(E_WARN, L_XCODE, "Ignoring invalid seek index\n");
+      return -1;
+    }
+
+  // The input has changed since the index was made
+  if (input_size != index->input_size)
+    return -1;
+
+  CHECK_NULL(L_XCODE, index->entries = malloc(len));
+  evbuffer_remove(evbuf, index->entries, len);
+
+  index->count = index->size = header[2];
+  index->is_collecting = false;
+  index->is_complete = true;
+  index->is_loaded = true;
+
+  return 0;
+}
+
 /*                                  Querying                                 */
 
 int
@@ -2512,6 +3146,19 @@ transcode_decode_query(struct decode_ctx *ctx, const char *query)
   return -1;
 }
 
+int
+transcode_decode_attached_pic_get(const uint8_t **data, size_t *len, struct decode_ctx *ctx)
+{
+  AVStream *stream = ctx->video_stream.stream;
+
+  if (!stream || !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC) || stream->attached_pic.size <= 0)
+    return -1;
+
+  *data = stream->attached_pic.data;
+  *len = stream->attached_pic.size;
+  return 0;
+}
+
 int
 transcode_encode_query(struct encode_ctx *ctx, const char *query)
 {
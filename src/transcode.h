@@ -32,10 +32,15 @@ enum transcode_profile
   XCODE_MP4_ALAC_HEADER,
   // Transcodes the best audio stream from OGG
   XCODE_OGG,
-  // Transcodes the best video stream to JPEG/PNG/VP8
+  // Transcodes the best audio stream to OPUS in an OGG container
+  XCODE_OGG_OPUS,
+  // Transcodes the best audio stream to FLAC
+  XCODE_FLAC,
+  // Transcodes the best video stream to JPEG/PNG/VP8/WebP
   XCODE_JPEG,
   XCODE_PNG,
   XCODE_VP8,
+  XCODE_WEBP,
 };
 
 enum transcode_seek_type
@@ -77,10 +82,26 @@ struct transcode_decode_setup_args
   struct transcode_evbuf_io *evbuf_io;
 };
 
+// Trades CPU for quality when resampling
+enum transcode_resample_quality
+{
+  XCODE_RESAMPLE_DEFAULT, // ffmpeg's default, same as medium
+  XCODE_RESAMPLE_LOW,
+  XCODE_RESAMPLE_MEDIUM,
+  XCODE_RESAMPLE_HIGH,
+};
+
+struct transcode_resample
+{
+  enum transcode_resample_quality quality;
+  bool dither;
+};
+
 struct transcode_encode_setup_args
 {
   enum transcode_profile profile;
   struct media_quality *quality;
+  struct transcode_resample resample;
   struct decode_ctx *src_ctx;
   struct transcode_evbuf_io *evbuf_io;
   struct evbuffer *prepared_header;
@@ -111,9 +132,21 @@ transcode_setup(struct transcode_decode_setup_args decode_args, struct transcode
 struct decode_ctx *
 transcode_decode_setup_raw(enum transcode_profile profile, struct media_quality *quality);
 
+// Like transcode_encode_setup() with a src_ctx from transcode_decode_setup_raw(),
+// but reuses an encoder given to transcode_encode_release() if there is one
+// with the same profiles and qualities. Only for continuous raw encoding (e.g.
+// resampling or ALAC), since a reused encoder may output a few samples still
+// buffered from the previous user, and won't repeat any header.
+struct encode_ctx *
+transcode_encode_setup_pooled(enum transcode_profile profile, struct media_quality *quality, enum transcode_profile src_profile, struct media_quality *src_quality, struct transcode_resample *resample);
+
 enum transcode_profile
 transcode_needed(const char *user_agent, const char *client_codecs, const char *file_codectype);
 
+// Checks if ffmpeg has the encoder required by the profile
+bool
+transcode_encode_is_supported(enum transcode_profile profile);
+
 // Cleaning up
 void
 transcode_decode_cleanup(struct decode_ctx **ctx);
@@ -121,6 +154,14 @@ transcode_decode_cleanup(struct decode_ctx **ctx);
 void
 transcode_encode_cleanup(struct encode_ctx **ctx);
 
+// Gives the encoder back for reuse by transcode_encode_setup_pooled(), frees
+// it if it wasn't from there. Points the ctx to NULL.
+void
+transcode_encode_release(struct encode_ctx **ctx);
+
+void
+transcode_encode_pool_clear(void);
+
 void
 transcode_cleanup(struct transcode_ctx **ctx);
 
@@ -148,6 +189,17 @@ transcode_decode(transcode_frame **frame, struct decode_ctx *ctx);
 int
 transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, transcode_frame *frame, int eof);
 
+/* Gets the header that transcode_encode_setup() made for the output container
+ * (e.g. the OGG header pages or the FLAC stream info). Must be called before
+ * the first transcode_encode(), since it would otherwise output the header.
+ *
+ * @out evbuf      An evbuffer filled with the header, if the container has one
+ * @in  ctx        Encode context
+ * @return         Bytes added if OK, negative if error
+ */
+int
+transcode_encode_header_get(struct evbuffer *evbuf, struct encode_ctx *ctx);
+
 /* Demuxes, decodes, encodes and remuxes from the input.
  *
  * @out evbuf      An evbuffer filled with remuxed data
@@ -185,6 +237,44 @@ transcode_frame_free(transcode_frame *frame);
 int
 transcode_seek(struct transcode_ctx *ctx, int ms);
 
+/* Seek to the position of a byte offset in the output, so that a transcoded
+ * stream can be served from the offset of a Range request without transcoding
+ * everything before it. Only possible for constant bit rate profiles (WAV and
+ * MP3), and only before the first transcode(). The output from the header is
+ * discarded, so the next transcode() returns the data from the seek position.
+ *
+ * @in  ctx        Transcode context
+ * @in  offset     Requested byte offset in the output
+ * @return         Negative if not possible, otherwise the byte offset of the
+ *                 actual seek position, which is at or before offset
+ */
+off_t
+transcode_seek_bytes(struct transcode_ctx *ctx, off_t offset);
+
+/* While an input is read from start to end, transcode makes an index of the
+ * byte offsets of the audio every few seconds. With the index, transcode_seek()
+ * can jump directly to the position instead of searching for it, which is slow
+ * for some formats and for inputs over http. The index can be saved and then
+ * restored when the same input is played again.
+ *
+ * @out evbuf      Buffer for the serialized index
+ * @in  ctx        Transcode context
+ * @return         Negative if there is no new, complete index
+ */
+int
+transcode_seek_index_get(struct evbuffer *evbuf, struct transcode_ctx *ctx);
+
+/* Restores a seek index made by transcode_seek_index_get(). Must be called
+ * before the first transcode() or transcode_seek().
+ *
+ * @in  ctx        Transcode context
+ * @in  evbuf      Buffer with the serialized index, will be drained
+ * @return         Negative if the index could not be used, e.g. the input has
+ *                 changed since the index was made
+ */
+int
+transcode_seek_index_set(struct transcode_ctx *ctx, struct evbuffer *evbuf);
+
 /* Query for information about a media file opened by transcode_decode_setup()
  *
  * @in  ctx        Decode context
@@ -194,6 +284,17 @@ transcode_seek(struct transcode_ctx *ctx, int ms);
 int
 transcode_decode_query(struct decode_ctx *ctx, const char *query);
 
+/* Gets the undecoded image of a media file with embedded artwork (the attached
+ * picture), e.g. so it can be hashed without decoding it
+ *
+ * @out data       Image data, valid until the ctx is cleaned up
+ * @out len        Length of data
+ * @in  ctx        Decode context
+ * @return         Negative if no attached picture, otherwise 0
+ */
+int
+transcode_decode_attached_pic_get(const uint8_t **data, size_t *len, struct decode_ctx *ctx);
+
 /* Query for information (e.g. sample rate) about the output being produced by
  * the transcoding
  *
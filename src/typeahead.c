@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Prefix index of artist and album names for search as you type. Searching
+ * the groups with LIKE (or FTS) means grouping all matching files for each
+ * keystroke, while the index is just a sorted array of normalized names, so a
+ * lookup is a binary search. The index is built on the first lookup and again
+ * when a library update has changed DB_ADMIN_DB_UPDATE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <uninorm.h>
+
+#include "db.h"
+#include "logger.h"
+#include "misc.h"
+#include "typeahead.h"
+
+struct typeahead_entry
+{
+  char *key;
+  int64_t id;
+};
+
+struct typeahead_index
+{
+  enum query_type query_type;
+  struct typeahead_entry *entries;
+  int nentries;
+  int size;
+  // Value of DB_ADMIN_DB_UPDATE when the index was built
+  int64_t db_update;
+  bool built;
+};
+
+static struct typeahead_index typeahead_index[] =
+{
+  [TYPEAHEAD_ARTIST] = { .query_type = Q_GROUP_ARTISTS },
+  [TYPEAHEAD_ALBUM]  = { .query_type = Q_GROUP_ALBUMS },
+};
+
+static pthread_mutex_t typeahead_lck = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+// Decomposes the string so that accents become separate combining marks, which
+// are then dropped, and lower cases ASCII. This means that e.g. "Björk" and
+// "bjork" get the same key.
+static char *
+key_make(const char *str)
+{
+  uint8_t *key;
+  size_t len;
+  size_t i;
+  size_t j;
+
+  key = u8_normalize(UNINORM_NFD, (const uint8_t *)str, strlen(str) + 1, NULL, &len);
+  if (!key)
+    return NULL;
+
+  for (i = 0, j = 0; key[i]; i++)
+    {
+      // Combining diacritical marks, U+0300 to U+036F
+      if ((key[i] == 0xCC && key[i + 1] >= 0x80 && key[i + 1] <= 0xBF) ||
+          (key[i] == 0xCD && key[i + 1] >= 0x80 && key[i + 1] <= 0xAF))
+	{
+	  i++;
+	  continue;
+	}
+
+      key[j++] = (key[i] >= 'A' && key[i] <= 'Z') ? key[i] + ('a' - 'A') : key[i];
+    }
+
+  key[j] = '\0';
+
+  return (char *)key;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+  const struct typeahead_entry *ea = a;
+  const struct typeahead_entry *eb = b;
+
+  return strcmp(ea->key, eb->key);
+}
+
+static int
+id_cmp(const void *a, const void *b)
+{
+  int64_t ia = *(const int64_t *)a;
+  int64_t ib = *(const int64_t *)b;
+
+  return (ia > ib) - (ia < ib);
+}
+
+static void
+entry_add(struct typeahead_index *index, const char *name, int64_t id)
+{
+  struct typeahead_entry *entry;
+  char *key;
+
+  key = key_make(name);
+  if (!key)
+    return;
+
+  if (index->nentries == index->size)
+    {
+      index->size = index->size ? 2 * index->size : 1024;
+      CHECK_NULL(L_WEB, index->entries = realloc(index->entries, index->size * sizeof(struct typeahead_entry)));
+    }
+
+  entry = &index->entries[index->nentries++];
+  entry->key = key;
+  entry->id = id;
+}
+
+static void
+index_clear(struct typeahead_index *index)
+{
+  int i;
+
+  for (i = 0; i < index->nentries; i++)
+    free(index->entries[i].key);
+
+  free(index->entries);
+  index->entries = NULL;
+  index->nentries = 0;
+  index->size = 0;
+  index->built = false;
+}
+
+static int
+index_build(struct typeahead_index *index, int64_t db_update)
+{
+  struct query_params qp;
+  struct db_group_info dbgri;
+  int64_t id;
+  int ret;
+
+  index_clear(index);
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = index->query_type;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    goto out;
+
+  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
+    {
+      if (!dbgri.itemname || dbgri.itemname[0] == '\0' || safe_atoi64(dbgri.persistentid, &id) < 0)
+	continue;
+
+      // Also the sort name, so that "beat" finds "The Beatles" (sort name
+      // "Beatles, The")
+      entry_add(index, dbgri.itemname, id);
+      if (dbgri.itemname_sort && strcasecmp(dbgri.itemname, dbgri.itemname_sort) != 0)
+	entry_add(index, dbgri.itemname_sort, id);
+    }
+
+  if (ret < 0)
+    goto out;
+
+  qsort(index->entries, index->nentries, sizeof(struct typeahead_entry), entry_cmp);
+
+  index->db_update = db_update;
+  index->built = true;
+
+  DPRINTF(E_DBG, L_WEB, "Built typeahead index with %d entries\n", index->nentries);
+
+ out:
+  db_query_end(&qp);
+  if (ret < 0)
+    index_clear(index);
+
+  return ret;
+}
+
+// Returns the first entry where the key is not less than prefix
+static int
+lower_bound(struct typeahead_index *index, const char *prefix)
+{
+  int lo = 0;
+  int hi = index->nentries;
+  int mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (strcmp(index->entries[mid].key, prefix) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+int
+typeahead_search(int64_t **ids, int *total, enum typeahead_kind kind, const char *prefix, int limit)
+{
+  struct typeahead_index *index = &typeahead_index[kind];
+  int64_t db_update = 0;
+  int64_t *matches;
+  char *key;
+  size_t keylen;
+  int first;
+  int nmatches;
+  int nids;
+  int i;
+  int j;
+
+  *ids = NULL;
+  *total = 0;
+
+  key = key_make(prefix);
+  if (!key)
+    return -1;
+
+  keylen = strlen(key);
+
+  db_admin_getint64(&db_update, DB_ADMIN_DB_UPDATE);
+
+  pthread_mutex_lock(&typeahead_lck);
+
+  if ((!index->built || index->db_update != db_update) && index_build(index, db_update) < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Could not build typeahead index\n");
+      pthread_mutex_unlock(&typeahead_lck);
+      free(key);
+      return -1;
+    }
+
+  first = lower_bound(index, key);
+  for (i = first; i < index->nentries && strncmp(index->entries[i].key, key, keylen) == 0; i++)
+    ;
+
+  nmatches = i - first;
+
+  CHECK_NULL(L_WEB, matches = calloc(nmatches + 1, sizeof(int64_t)));
+  CHECK_NULL(L_WEB, *ids = calloc((limit > 0 ? limit : 0) + 1, sizeof(int64_t)));
+
+  // The first 'limit' distinct ids in name order. An id can be in the range
+  // twice, when both its name and sort name match.
+  for (i = 0, nids = 0; i < nmatches; i++)
+    {
+      matches[i] = index->entries[first + i].id;
+
+      if (nids >= limit)
+	continue;
+
+      for (j = 0; j < nids && (*ids)[j] != matches[i]; j++)
+	;
+      if (j == nids)
+	(*ids)[nids++] = matches[i];
+    }
+
+  pthread_mutex_unlock(&typeahead_lck);
+
+  // Total number of distinct ids
+  qsort(matches, nmatches, sizeof(int64_t), id_cmp);
+  for (i = 0; i < nmatches; i++)
+    {
+      if (i == 0 || matches[i] != matches[i - 1])
+	(*total)++;
+    }
+
+  free(matches);
+  free(key);
+
+  return nids;
+}
+
+void
+typeahead_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&typeahead_lck);
+
+  for (i = 0; i < ARRAY_SIZE(typeahead_index); i++)
+    index_clear(&typeahead_index[i]);
+
+  pthread_mutex_unlock(&typeahead_lck);
+}
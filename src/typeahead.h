@@ -0,0 +1,30 @@
+#ifndef __TYPEAHEAD_H__
+#define __TYPEAHEAD_H__
+
+#include <stdint.h>
+
+enum typeahead_kind
+{
+  TYPEAHEAD_ARTIST,
+  TYPEAHEAD_ALBUM,
+};
+
+/* Finds the artists or albums where the name or the sort name starts with the
+ * given prefix. Upper/lower case and accents don't matter. The index is kept
+ * in memory and rebuilt when the library has been updated.
+ *
+ * @out ids      Persistent ids of the first 'limit' matches in name order,
+ *               must be freed by caller
+ * @out total    Total number of matches
+ * @param kind   Artists or albums
+ * @param prefix The prefix to look for
+ * @param limit  Max number of ids to return
+ * @return       Number of ids, -1 on error
+ */
+int
+typeahead_search(int64_t **ids, int *total, enum typeahead_kind kind, const char *prefix, int limit);
+
+void
+typeahead_deinit(void);
+
+#endif /* !__TYPEAHEAD_H__ */
@@ -24,14 +24,28 @@
 #include <libwebsockets.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <event2/event.h>
 
 #include "conffile.h"
+#include "httpd.h"
 #include "listener.h"
 #include "logger.h"
 #include "misc.h"
+#include "worker.h"
+
+// Events are collected for this long before the state is pushed, since e.g. a
+// track change makes the player emit several events right after each other
+#define WEBSOCKET_STATE_COALESCE_MS 100
+// The events that clients in state mode get the new state for, instead of
+// just the name of the event
+#define WEBSOCKET_STATE_EVENTS (LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_SPEAKER | LISTENER_QUEUE)
+// A state bigger than this, e.g. a long queue, isn't pushed, clients just get
+// the name of the event and can get the state from the JSON API
+#define WEBSOCKET_STATE_SIZE_MAX (128 * 1024)
 
 
 static struct lws_context *websocket_context;
@@ -47,16 +61,188 @@ static pthread_mutex_t websocket_write_event_lock;
 // Event mask of events processed by the writeable callback
 static short websocket_write_events;
 
+enum websocket_state_type
+{
+  WS_STATE_PLAYER = 0,
+  WS_STATE_OUTPUTS,
+  WS_STATE_QUEUE,
+  WS_STATE_MAX,
+};
+
+/*
+ * For clients in state mode the reply of the JSON API for the changed state is
+ * pushed with the event. It is made once for all clients by the worker thread,
+ * which gives the JSON string and a new version to the websocket thread. That
+ * parses it once and adds it to the messages of the clients that haven't had
+ * that version yet. If the state is the same as the last one nothing is sent.
+ */
+struct websocket_state
+{
+  const char *name;
+  const char *uri;
+  short events;
+
+  // Protected by websocket_state_lock
+  char *json;
+  uint32_t version;
+
+  // Only used by the websocket thread
+  json_object *obj;
+  uint32_t obj_version;
+};
+
+static struct websocket_state websocket_states[WS_STATE_MAX] =
+{
+  { "player", "/api/player", LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME },
+  { "outputs", "/api/outputs", LISTENER_SPEAKER | LISTENER_VOLUME },
+  { "queue", "/api/queue", LISTENER_QUEUE },
+};
+
+static pthread_mutex_t websocket_state_lock;
+// Events that the worker hasn't made the new state for yet
+static short websocket_state_events;
+static bool websocket_state_pending;
+static bool websocket_state_changed;
+// Number of clients in state mode, the state is only made if there are any
+static int websocket_state_clients;
+// Only used by the worker thread
+static struct event *websocket_state_ev;
+
+// Buffer for outgoing messages, only used by the websocket thread
+static unsigned char *websocket_send_buf;
+static size_t websocket_send_buf_size;
+
+#if !defined(LWS_WITHOUT_EXTENSIONS) && !defined(LWS_NO_EXTENSIONS)
+static const struct lws_extension websocket_extensions[] =
+{
+  {
+    "permessage-deflate",
+    lws_extension_callback_pm_deflate,
+    "permessage-deflate; client_no_context_takeover; client_max_window_bits"
+  },
+  { NULL, NULL, NULL } // terminator
+};
+#endif
+
+
+/* Thread: worker */
+static void
+state_update_cb(int fd, short what, void *arg)
+{
+  struct websocket_state *state;
+  short events;
+  char *json;
+  bool changed = false;
+  int i;
+
+  event_free(websocket_state_ev);
+  websocket_state_ev = NULL;
+
+  if (!websocket_is_initialized)
+    return;
+
+  pthread_mutex_lock(&websocket_state_lock);
+  events = websocket_state_events;
+  websocket_state_events = 0;
+  websocket_state_pending = false;
+  pthread_mutex_unlock(&websocket_state_lock);
+
+  for (i = 0; i < WS_STATE_MAX; i++)
+    {
+      state = &websocket_states[i];
+      if (!(events & state->events))
+	continue;
+
+      // If this fails the client will just get the name of the event
+      json = httpd_jsonapi_get(state->uri);
+      if (json && strlen(json) > WEBSOCKET_STATE_SIZE_MAX)
+	{
+	  DPRINTF(E_DBG, L_WEB, "Not pushing %s state, size %zu exceeds max\n", state->name, strlen(json));
+	  free(json);
+	  json = NULL;
+	}
+
+      pthread_mutex_lock(&websocket_state_lock);
+      if (!json || !state->json || strcmp(json, state->json) != 0)
+	{
+	  free(state->json);
+	  state->json = json;
+	  state->version++;
+	  changed = true;
+	  json = NULL;
+	}
+      websocket_state_changed |= changed;
+      pthread_mutex_unlock(&websocket_state_lock);
+
+      free(json);
+    }
+
+  if (changed)
+    lws_cancel_service(websocket_context);
+}
+
+/* Thread: worker */
+static void
+state_update_schedule(void *arg)
+{
+  struct timeval tv = { 0, WEBSOCKET_STATE_COALESCE_MS * 1000 };
+
+  CHECK_NULL(L_WEB, websocket_state_ev = evtimer_new(worker_evbase_get(), state_update_cb, NULL));
+  evtimer_add(websocket_state_ev, &tv);
+}
+
+/* Thread: websocket */
+static void
+state_sync(void)
+{
+  struct websocket_state *state;
+  int i;
+
+  pthread_mutex_lock(&websocket_state_lock);
+  for (i = 0; i < WS_STATE_MAX; i++)
+    {
+      state = &websocket_states[i];
+      if (state->obj_version == state->version)
+	continue;
+
+      if (state->obj)
+	json_object_put(state->obj);
+
+      state->obj = state->json ? json_tokener_parse(state->json) : NULL;
+      state->obj_version = state->version;
+    }
+  websocket_state_changed = false;
+  pthread_mutex_unlock(&websocket_state_lock);
+}
+
 
 /* Thread: library, player, etc. (the thread the event occurred) */
 static void
 listener_cb(short event_mask, void *ctx)
 {
+  bool schedule = false;
+
   pthread_mutex_lock(&websocket_write_event_lock);
   websocket_write_events |= event_mask;
   pthread_mutex_unlock(&websocket_write_event_lock);
 
   lws_cancel_service(websocket_context);
+
+  if (!(event_mask & WEBSOCKET_STATE_EVENTS) || __atomic_load_n(&websocket_state_clients, __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock(&websocket_state_lock);
+  websocket_state_events |= event_mask;
+  if (!websocket_state_pending)
+    {
+      websocket_state_pending = true;
+      schedule = true;
+    }
+  pthread_mutex_unlock(&websocket_state_lock);
+
+  // The worker makes the state, since we may be in the player thread here
+  if (schedule)
+    worker_execute_priority(state_update_schedule, NULL, 0, 0, WORKER_PRIORITY_HIGH);
 }
 
 /*
@@ -81,6 +267,10 @@ struct per_session_data {
   struct lws *wsi;
   short requested_events;
   short write_events;
+  bool state;
+  uint32_t state_versions[WS_STATE_MAX];
+  // Set if the client couldn't keep up, the next message is then without state
+  bool resync;
 };
 
 /* one of these is created for each vhost our protocol is used with */
@@ -94,11 +284,14 @@ struct per_vhost_data {
  * Expects the message in "in" to be a JSON string of the form:
  *
  * {
- *   "notify": [ "update" ]
+ *   "notify": [ "update" ],
+ *   "state": true
  * }
+ *
+ * "state" is optional and switches state mode on or off.
  */
 static int
-process_notify_request(short *requested_events, void *in, size_t len)
+process_notify_request(short *requested_events, bool *state, void *in, size_t len)
 {
   json_tokener *tokener;
   json_object *request;
@@ -179,6 +372,9 @@ process_notify_request(short *requested_events, void *in, size_t len)
 	}
     }
 
+  if (json_object_object_get_ex(request, "state", &needle) && json_object_get_type(needle) == json_type_boolean)
+    *state = json_object_get_boolean(needle);
+
   json_tokener_free(tokener);
   json_object_put(request);
 
@@ -193,14 +389,29 @@ process_notify_request(short *requested_events, void *in, size_t len)
  * {
  *   "notify": [ "update" ]
  * }
+ *
+ * In state mode the message also has the new state for the types in the
+ * states mask, which are added to "notify" too:
+ *
+ * {
+ *   "notify": [ "player" ],
+ *   "state": { "player": { <reply of /api/player> } }
+ * }
+ *
+ * With with_state false the state is left out, so the client must get it from
+ * the JSON API, e.g. after having been too slow to receive what was pushed.
  */
-static void
-send_notify_reply(short events, struct lws* wsi)
+static int
+send_notify_reply(short events, int states, bool with_state, struct lws* wsi)
 {
   unsigned char* buf;
   const char* json_response;
+  size_t len;
   json_object* reply;
   json_object* notify;
+  json_object* state = NULL;
+  int ret;
+  int i;
 
   DPRINTF(E_DBG, L_WEB, "notify callback reply: %d\n", events);
 
@@ -246,17 +457,52 @@ send_notify_reply(short events, struct lws* wsi)
       json_object_array_add(notify, json_object_new_string("queue"));
     }
 
+  for (i = 0; i < WS_STATE_MAX; i++)
+    {
+      if (!(states & (1 << i)))
+	continue;
+
+      json_object_array_add(notify, json_object_new_string(websocket_states[i].name));
+
+      // The object is shared by all the replies, so it gets a reference
+      if (!with_state || !websocket_states[i].obj)
+	continue;
+
+      if (!state)
+	state = json_object_new_object();
+      json_object_object_add(state, websocket_states[i].name, json_object_get(websocket_states[i].obj));
+    }
+
   reply = json_object_new_object();
   json_object_object_add(reply, "notify", notify);
+  if (state)
+    json_object_object_add(reply, "state", state);
 
   json_response = json_object_to_json_string(reply);
+  len = strlen(json_response);
 
-  buf = malloc(LWS_PRE + strlen(json_response));
-  memcpy(&buf[LWS_PRE], json_response, strlen(json_response));
-  lws_write(wsi, &buf[LWS_PRE], strlen(json_response), LWS_WRITE_TEXT);
+  // lws_write() needs LWS_PRE bytes of headroom before the payload. The buffer
+  // is kept, since there is a message for each event.
+  if (LWS_PRE + len > websocket_send_buf_size)
+    {
+      CHECK_NULL(L_WEB, buf = realloc(websocket_send_buf, LWS_PRE + len));
+      websocket_send_buf = buf;
+      websocket_send_buf_size = LWS_PRE + len;
+    }
+
+  buf = websocket_send_buf;
+  memcpy(&buf[LWS_PRE], json_response, len);
+  ret = lws_write(wsi, &buf[LWS_PRE], len, LWS_WRITE_TEXT);
 
-  free(buf);
   json_object_put(reply);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Error writing to websocket, closing connection\n");
+      return -1;
+    }
+
+  return 0;
 }
 
 /*
@@ -269,6 +515,7 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
 #if LWS_LIBRARY_VERSION_MAJOR < 3
   struct per_session_data **ppss = NULL;
 #endif
+  struct websocket_state *state;
   struct per_vhost_data *vhd = lws_protocol_vh_priv_get(
 #if LWS_LIBRARY_VERSION_MAJOR >= 3
     lws_get_vhost(wsi),
@@ -277,7 +524,10 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
 #endif
     lws_get_protocol(wsi));
   short events = 0;
+  bool state_mode;
+  int states;
   int ret = 0;
+  int i;
 
   DPRINTF(E_SPAM, L_WEB, "notify callback reason: %d\n", reason);
 
@@ -314,6 +564,9 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
       break;
 
     case LWS_CALLBACK_CLOSED:
+      if (pss->state)
+	__atomic_sub_fetch(&websocket_state_clients, 1, __ATOMIC_RELAXED);
+
       /* remove our closing pss from the list of live pss */
       if (vhd)
       {
@@ -347,16 +600,55 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
         }
       }
 #endif
-      if (pss->requested_events & pss->write_events)
+      events = pss->requested_events & pss->write_events;
+
+      // The client hasn't received the last message yet. Instead of queuing
+      // another the events are kept until it is writeable and then sent in one
+      // message, without the state, which the client will have to get itself.
+      if (lws_send_pipe_choked(wsi))
       {
-        events = pss->requested_events & pss->write_events;
-        send_notify_reply(events, wsi);
-        pss->write_events = 0;
+        if (pss->state)
+          pss->resync = true;
+        lws_callback_on_writable(wsi);
+        break;
       }
+
+      states = 0;
+      if (pss->state)
+      {
+        // These events come with the state when it has been made
+        events &= ~WEBSOCKET_STATE_EVENTS;
+
+        state_sync();
+        for (i = 0; i < WS_STATE_MAX; i++)
+        {
+          state = &websocket_states[i];
+          if ((pss->requested_events & state->events) && pss->state_versions[i] != state->obj_version)
+            states |= (1 << i);
+          pss->state_versions[i] = state->obj_version;
+        }
+      }
+      if (events || states)
+      {
+        ret = send_notify_reply(events, states, !pss->resync, wsi);
+        pss->resync = false;
+      }
+      pss->write_events = 0;
       break;
 
     case LWS_CALLBACK_RECEIVE:
-      ret = process_notify_request(&pss->requested_events, in, len);
+      state_mode = pss->state;
+      ret = process_notify_request(&pss->requested_events, &pss->state, in, len);
+      if (pss->state && !state_mode)
+      {
+        // Clients already have the current state from the JSON API
+        state_sync();
+        for (i = 0; i < WS_STATE_MAX; i++)
+          pss->state_versions[i] = websocket_states[i].obj_version;
+        __atomic_add_fetch(&websocket_state_clients, 1, __ATOMIC_RELAXED);
+      }
+      else if (!pss->state && state_mode)
+        __atomic_sub_fetch(&websocket_state_clients, 1, __ATOMIC_RELAXED);
       break;
 
 #if LWS_LIBRARY_VERSION_MAJOR >= 3
@@ -425,7 +717,7 @@ websocket(void *arg)
       websocket_exit = true;
 #else
     lws_service(websocket_context, 10000);
-    if (websocket_write_events)
+    if (websocket_write_events || websocket_state_changed)
       lws_callback_on_writable_all_protocol(websocket_context, &protocols[WS_PROTOCOL_NOTIFY]);
 #endif
   }
@@ -490,6 +782,10 @@ websocket_init(void)
   info.port = websocket_port;
   info.iface = websocket_interface;
   info.protocols = protocols;
+#if !defined(LWS_WITHOUT_EXTENSIONS) && !defined(LWS_NO_EXTENSIONS)
+  // Compression is only used if the client supports it, which browsers do
+  info.extensions = websocket_extensions;
+#endif
 #ifdef LWS_SERVER_OPTION_IPV6_V6ONLY_MODIFY // Debian Buster's libwebsockets does not have this flag
   if (cfg_getbool(cfg_getsec(cfg, "general"), "ipv6"))
     info.options |= LWS_SERVER_OPTION_IPV6_V6ONLY_MODIFY; // Assures dual stack is enabled by switching off IPV6_V6ONLY
@@ -524,11 +820,21 @@ websocket_init(void)
       return -1;
     }
 
+  ret = mutex_init(&websocket_state_lock);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Failed to initialize mutex: %s\n", strerror(ret));
+      pthread_mutex_destroy(&websocket_write_event_lock);
+      lws_context_destroy(websocket_context);
+      return -1;
+    }
+
   ret = pthread_create(&tid_websocket, NULL, websocket, NULL);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_WEB, "Could not spawn websocket thread (%d): %s\n", ret, strerror(ret));
       pthread_mutex_destroy(&websocket_write_event_lock);
+      pthread_mutex_destroy(&websocket_state_lock);
       lws_context_destroy(websocket_context);
       return -1;
     }
@@ -544,6 +850,7 @@ void
 websocket_deinit(void)
 {
   int ret;
+  int i;
 
   if (!websocket_is_initialized)
     return;
@@ -557,4 +864,16 @@ websocket_deinit(void)
 
   lws_context_destroy(websocket_context);
   pthread_mutex_destroy(&websocket_write_event_lock);
+  pthread_mutex_destroy(&websocket_state_lock);
+
+  free(websocket_send_buf);
+  websocket_send_buf = NULL;
+  websocket_send_buf_size = 0;
+
+  for (i = 0; i < WS_STATE_MAX; i++)
+    {
+      free(websocket_states[i].json);
+      if (websocket_states[i].obj)
+	json_object_put(websocket_states[i].obj);
+    }
 }
@@ -42,16 +42,30 @@
 #include "worker.h"
 #include "evthr.h"
 #include "misc.h"
+#include "trace.h"
 
+// Minimum number of threads, will be more if there are more cores
 #define THREADPOOL_NTHREADS 4
-
+// Number of different delays that each thread keeps a common timeout for
+#define WORKER_COMMON_TIMEOUTS_MAX 8
+// Minimum number of threads for high priority jobs, will be more if there are
+// more than twice as many cores
+#define THREADPOOL_HIGH_NTHREADS 2
+
+// The pools have a queue that all their threads take jobs from, so a job only
+// waits if all the threads of its pool are busy. High priority jobs have their
+// own pool, so they don't wait for slow normal jobs like network requests.
 static struct evthr_pool *worker_threadpool;
+static struct evthr_pool *worker_threadpool_high;
+static int worker_nthreads;
 static __thread struct evthr *worker_thr;
 
 
 /* ----------------------------- CALLBACK EXECUTION ------------------------- */
 /*                                 Worker threads                             */
 
+// For delayed jobs the timer event is allocated together with the struct, it
+// is the memory right after it
 struct worker_arg
 {
   void (*cb)(void *);
@@ -60,15 +74,51 @@ struct worker_arg
   struct event *timer;
 };
 
+struct worker_timeout
+{
+  int delay;
+  const struct timeval *tv;
+};
+
+// The delays are whole seconds, and there are only a few different ones, so we
+// use libevent's common timeouts. Timers with a common timeout are kept in a
+// list instead of the timer heap, which makes adding them and expiring them
+// cheaper. The timeouts are per event base, so they are per thread.
+static __thread struct worker_timeout worker_timeouts[WORKER_COMMON_TIMEOUTS_MAX];
+
+
+static const struct timeval *
+timeout_get(struct event_base *evbase, int delay)
+{
+  struct timeval tv = { delay, 0 };
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(worker_timeouts) && worker_timeouts[i].tv; i++)
+    {
+      if (worker_timeouts[i].delay == delay)
+	return worker_timeouts[i].tv;
+    }
+
+  if (i == ARRAY_SIZE(worker_timeouts))
+    return NULL;
+
+  worker_timeouts[i].tv = event_base_init_common_timeout(evbase, &tv);
+  worker_timeouts[i].delay = delay;
+  return worker_timeouts[i].tv;
+}
 
 static void
 execute_cb(int fd, short what, void *arg)
 {
   struct worker_arg *cmdarg = arg;
+  struct trace_span span;
 
+  trace_begin(&span, "worker", "worker_job");
   cmdarg->cb(cmdarg->cb_arg);
+  trace_end(&span);
 
-  event_free(cmdarg->timer);
+  // The timer has fired and isn't pending anymore, so it can just be freed
+  // with cmdarg
   free(cmdarg->cb_arg);
   free(cmdarg);
 }
@@ -77,18 +127,26 @@ static void
 execute(struct evthr *thr, void *arg, void *shared)
 {
   struct worker_arg *cmdarg = arg;
-  struct timeval tv = { cmdarg->delay, 0 };
+  struct timeval delay_tv = { cmdarg->delay, 0 };
+  const struct timeval *tv;
   struct event_base *evbase;
+  struct trace_span span;
 
   if (cmdarg->delay)
     {
       evbase = evthr_get_base(thr);
-      cmdarg->timer = evtimer_new(evbase, execute_cb, cmdarg);
-      evtimer_add(cmdarg->timer, &tv);
+      tv = timeout_get(evbase, cmdarg->delay);
+      if (!tv)
+	tv = &delay_tv;
+
+      event_assign(cmdarg->timer, evbase, -1, 0, execute_cb, cmdarg);
+      evtimer_add(cmdarg->timer, tv);
       return;
     }
 
+  trace_begin(&span, "worker", "worker_job");
   cmdarg->cb(cmdarg->cb_arg);
+  trace_end(&span);
   free(cmdarg->cb_arg);
   free(cmdarg);
 }
@@ -100,7 +158,7 @@ init_cb(struct evthr *thr, void *shared)
 
   worker_thr = thr;
 
-  thread_setname(pthread_self(), "worker");
+  thread_setname(pthread_self(), shared);
 }
 
 static void
@@ -115,12 +173,13 @@ exit_cb(struct evthr *thr, void *shared)
 /* ---------------------------- Our worker API  --------------------------- */
 
 void
-worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
+worker_execute_priority(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay, enum worker_priority priority)
 {
   struct worker_arg *cmdarg;
+  struct evthr_pool *pool;
   void *argcpy;
 
-  cmdarg = calloc(1, sizeof(struct worker_arg));
+  cmdarg = calloc(1, sizeof(struct worker_arg) + (delay ? event_get_struct_event_size() : 0));
   if (!cmdarg)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not allocate worker_arg\n");
@@ -145,8 +204,22 @@ worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
   cmdarg->cb = cb;
   cmdarg->cb_arg = argcpy;
   cmdarg->delay = delay;
+  cmdarg->timer = delay ? (struct event *)(cmdarg + 1) : NULL;
+
+  pool = (priority == WORKER_PRIORITY_HIGH) ? worker_threadpool_high : worker_threadpool;
 
-  evthr_pool_defer(worker_threadpool, execute, cmdarg);
+  if (evthr_pool_defer(pool, execute, cmdarg) != EVTHR_RES_OK)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not queue job for worker thread\n");
+      free(argcpy);
+      free(cmdarg);
+    }
+}
+
+void
+worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
+{
+  worker_execute_priority(cb, cb_arg, arg_size, delay, WORKER_PRIORITY_NORMAL);
 }
 
 struct event_base *
@@ -155,25 +228,42 @@ worker_evbase_get(void)
   return evthr_get_base(worker_thr);
 }
 
+int
+worker_nthreads_get(void)
+{
+  return worker_nthreads;
+}
+
 int
 worker_init(void)
 {
+  long ncores;
+  int nthreads_high;
   int ret;
 
-  worker_threadpool = evthr_pool_wexit_new(THREADPOOL_NTHREADS, init_cb, exit_cb, NULL);
-  if (!worker_threadpool)
+  ncores = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_nthreads = (ncores > THREADPOOL_NTHREADS) ? ncores : THREADPOOL_NTHREADS;
+  nthreads_high = (ncores / 2 > THREADPOOL_HIGH_NTHREADS) ? ncores / 2 : THREADPOOL_HIGH_NTHREADS;
+
+  worker_threadpool = evthr_pool_wexit_new(worker_nthreads, init_cb, exit_cb, "worker");
+  worker_threadpool_high = evthr_pool_wexit_new(nthreads_high, init_cb, exit_cb, "worker_high");
+  if (!worker_threadpool || !worker_threadpool_high)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not create worker thread pool\n");
       goto error;
     }
 
   ret = evthr_pool_start(worker_threadpool);
+  if (ret == 0)
+    ret = evthr_pool_start(worker_threadpool_high);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not spawn worker threads\n");
       goto error;
     }
 
+  DPRINTF(E_DBG, L_MAIN, "Worker threads: %d normal, %d high priority\n", worker_nthreads, nthreads_high);
+
   return 0;
   
  error:
@@ -184,6 +274,8 @@ worker_init(void)
 void
 worker_deinit(void)
 {
+  evthr_pool_stop(worker_threadpool_high);
+  evthr_pool_free(worker_threadpool_high);
   evthr_pool_stop(worker_threadpool);
   evthr_pool_free(worker_threadpool);
 }
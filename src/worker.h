@@ -21,11 +21,31 @@
 void
 worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay);
 
+enum worker_priority
+{
+  WORKER_PRIORITY_NORMAL = 0,
+  // For short jobs where latency matters, e.g. metadata for the speakers
+  WORKER_PRIORITY_HIGH,
+};
+
+/* Like worker_execute(), but high priority jobs are run by their own threads,
+ * so they don't wait for normal jobs, e.g. network requests. A high priority
+ * job must not block for long, since that would defeat the purpose.
+ */
+void
+worker_execute_priority(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay, enum worker_priority priority);
+
 /* Can be called within a callback to get the worker thread's event base
  */
 struct event_base *
 worker_evbase_get(void);
 
+/* Number of normal priority worker threads, which is at least 4 and otherwise
+ * the number of online cores
+ */
+int
+worker_nthreads_get(void);
+
 int
 worker_init(void);
 
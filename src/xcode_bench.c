@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2025 OwnTone contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Benchmark for transcode.c. Runs each of the given media files through the
+ * transcoding profiles and reports how much faster than realtime it is, the
+ * CPU time used and the number of allocations per second of audio. Build with
+ * "make xcode_bench", then e.g.:
+ *
+ *   ./xcode_bench -c /etc/owntone.conf test.flac test.m4a test.mp3
+ *
+ * The config file is needed because transcode reads settings like
+ * decode_audio_filters from it.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <event2/buffer.h>
+#include <libavutil/log.h>
+#include <libavformat/avformat.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "transcode.h"
+
+#define XCODE_BENCH_CONFFILE CONFDIR "/owntone.conf"
+// Bytes requested from transcode() per call
+#define XCODE_BENCH_READ_SIZE (64 * 1024)
+
+struct bench_profile
+{
+  const char *name;
+  enum transcode_profile profile;
+};
+
+static struct bench_profile bench_profiles[] =
+{
+  { "pcm_native", XCODE_PCM_NATIVE },
+  { "wav", XCODE_WAV },
+  { "pcm16", XCODE_PCM16 },
+  { "pcm24", XCODE_PCM24 },
+  { "pcm32", XCODE_PCM32 },
+  { "mp3", XCODE_MP3 },
+  { "opus", XCODE_OPUS },
+  { "alac", XCODE_ALAC },
+  { "mp4_alac", XCODE_MP4_ALAC },
+};
+
+struct bench_result
+{
+  uint32_t len_ms;
+  double wall_sec;
+  double cpu_sec;
+  uint64_t allocs;
+  size_t bytes;
+};
+
+
+/* ---------------------------- Allocation counting ------------------------- */
+
+// With glibc we can count allocations by everything in the process, including
+// ffmpeg, by interposing the allocator and passing the calls on to glibc's own
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t bench_allocs;
+
+void *
+malloc(size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+  *memptr = __libc_memalign(alignment, size);
+  return *memptr ? 0 : ENOMEM;
+}
+
+static uint64_t
+allocs_get(void)
+{
+  return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+#else
+static uint64_t
+allocs_get(void)
+{
+  return 0;
+}
+#endif
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+static double
+seconds_get(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+len_ms_get(const char *path)
+{
+  AVFormatContext *ifmt_ctx = NULL;
+  uint32_t len_ms = 0;
+
+  if (avformat_open_input(&ifmt_ctx, path, NULL, NULL) < 0)
+    return 0;
+
+  if (avformat_find_stream_info(ifmt_ctx, NULL) >= 0 && ifmt_ctx->duration > 0)
+    len_ms = ifmt_ctx->duration / (AV_TIME_BASE / 1000);
+
+  avformat_close_input(&ifmt_ctx);
+  return len_ms;
+}
+
+static struct bench_profile *
+profile_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(bench_profiles); i++)
+    {
+      if (strcmp(bench_profiles[i].name, name) == 0)
+	return &bench_profiles[i];
+    }
+
+  return NULL;
+}
+
+
+/* ---------------------------------- Bench --------------------------------- */
+
+static int
+bench_run(struct bench_result *result, const char *path, enum transcode_profile profile)
+{
+  struct media_quality quality = { 44100, 16, 2, 192000 };
+  struct transcode_decode_setup_args decode_args = { .profile = XCODE_PCM_NATIVE, .path = path };
+  struct transcode_encode_setup_args encode_args = { .profile = profile, .quality = &quality };
+  struct transcode_ctx *ctx;
+  struct evbuffer *evbuf;
+  double wall_start;
+  double cpu_start;
+  uint64_t allocs_start;
+  int ret;
+
+  memset(result, 0, sizeof(struct bench_result));
+
+  result->len_ms = len_ms_get(path);
+  if (result->len_ms == 0)
+    {
+      fprintf(stderr, "Could not get the length of '%s'\n", path);
+      return -1;
+    }
+
+  decode_args.len_ms = result->len_ms;
+
+  CHECK_NULL(L_MAIN, evbuf = evbuffer_new());
+
+  wall_start = seconds_get(CLOCK_MONOTONIC);
+  cpu_start = seconds_get(CLOCK_PROCESS_CPUTIME_ID);
+  allocs_start = allocs_get();
+
+  ctx = transcode_setup(decode_args, encode_args);
+  if (!ctx)
+    {
+      fprintf(stderr, "Could not set up transcoding of '%s'\n", path);
+      evbuffer_free(evbuf);
+      return -1;
+    }
+
+  do
+    {
+      ret = transcode(evbuf, NULL, ctx, XCODE_BENCH_READ_SIZE);
+      result->bytes += evbuffer_get_length(evbuf);
+      evbuffer_drain(evbuf, -1);
+    }
+  while (ret > 0);
+
+  transcode_cleanup(&ctx);
+
+  result->wall_sec = seconds_get(CLOCK_MONOTONIC) - wall_start;
+  result->cpu_sec = seconds_get(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  result->allocs = allocs_get() - allocs_start;
+
+  evbuffer_free(evbuf);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static void
+result_print(const char *path, const char *profile, struct bench_result *result)
+{
+  double len_sec = result->len_ms / 1000.0;
+
+  printf("%-40s %-10s %8.1f %10.1fx %9.3f %9.4f %12.1f %10zu\n",
+    path, profile, len_sec,
+    (result->wall_sec > 0) ? len_sec / result->wall_sec : 0,
+    result->cpu_sec, result->cpu_sec / len_sec,
+    result->allocs / len_sec, result->bytes);
+}
+
+static void
+usage(char *program)
+{
+  int i;
+
+  printf("Usage: %s [options] <file> [<file> ...]\n\n", program);
+  printf("Options:\n");
+  printf("  -c <file>       Use <file> as the configuration file\n");
+  printf("  -p <prof,prof>  Profiles to run (default all)\n");
+  printf("  -d <number>     Log level (0-5)\n");
+  printf("\n");
+  printf("Profiles:");
+  for (i = 0; i < ARRAY_SIZE(bench_profiles); i++)
+    printf(" %s", bench_profiles[i].name);
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_profile *profiles[ARRAY_SIZE(bench_profiles)];
+  struct bench_result result;
+  char *configfile = XCODE_BENCH_CONFFILE;
+  char *profilelist = NULL;
+  char *name;
+  char *ptr;
+  int nprofiles;
+  int loglevel = E_LOG;
+  int option;
+  int errors = 0;
+  int i;
+  int j;
+
+  while ((option = getopt(argc, argv, "c:p:d:h")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'p':
+	    profilelist = optarg;
+	    break;
+
+	  case 'd':
+	    loglevel = atoi(optarg);
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (optind >= argc)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  nprofiles = 0;
+  if (profilelist)
+    {
+      for (name = strtok_r(profilelist, ",", &ptr); name; name = strtok_r(NULL, ",", &ptr))
+	{
+	  profiles[nprofiles] = profile_find(name);
+	  if (!profiles[nprofiles])
+	    {
+	      fprintf(stderr, "Unknown profile '%s'\n", name);
+	      return EXIT_FAILURE;
+	    }
+
+	  if (++nprofiles == ARRAY_SIZE(profiles))
+	    break;
+	}
+    }
+  else
+    {
+      for (nprofiles = 0; nprofiles < ARRAY_SIZE(bench_profiles); nprofiles++)
+	profiles[nprofiles] = &bench_profiles[nprofiles];
+    }
+
+  if (logger_init(NULL, NULL, loglevel) != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+      return EXIT_FAILURE;
+    }
+
+  if (conffile_load(configfile) != 0)
+    {
+      fprintf(stderr, "Config file errors; please fix your config\n");
+      logger_deinit();
+      return EXIT_FAILURE;
+    }
+
+  av_log_set_callback(logger_ffmpeg);
+
+#ifndef __GLIBC__
+  fprintf(stderr, "Note: Counting allocations requires glibc, allocs/s will be 0\n");
+#endif
+
+  printf("%-40s %-10s %8s %11s %9s %9s %12s %10s\n",
+    "file", "profile", "len_s", "realtime", "cpu_s", "cpu/s", "allocs/s", "bytes");
+
+  for (i = optind; i < argc; i++)
+    {
+      for (j = 0; j < nprofiles; j++)
+	{
+	  if (bench_run(&result, argv[i], profiles[j]->profile) < 0)
+	    {
+	      errors++;
+	      continue;
+	    }
+
+	  result_print(argv[i], profiles[j]->name, &result);
+	}
+    }
+
+  conffile_unload();
+  logger_deinit();
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}